@@ -45,7 +45,7 @@ void DetectFaces(          // all face rects into detpars
     vec_DetPar&  detpars,  // out
     const Image& img,      // in
     int          minwidth,
-    cv::CascadeClassifier cascade) // in: as percent of img width
+    cv::CascadeClassifier &cascade) // in: as percent of img width
 {
     int leftborder = 0, topborder = 0; // border size in pixels
     Image bordered_img(BORDER_FRAC == 0?
@@ -181,7 +181,7 @@ void FaceDet::DetectFaces_(  // call once per image to find all the faces
     bool         multiface,  // in: if false, want only the best face
     int          minwidth,   // in: min face width as percentage of img width
     void*        user,       // in: unused (match virt func signature)
-    cv::CascadeClassifier cascade)
+    cv::CascadeClassifier &cascade)
 {
     CV_Assert(user == NULL);
     //CV_Assert(!facedet_g.empty()); // check that OpenFaceDetector_ was called
@@ -32,7 +32,7 @@ public:
         bool         multiface,   // in: if false, want only the best face
         int          minwidth,    // in: min face width as percent of img width
         void*        user,
-        cv::CascadeClassifier cascade);       // in: unused (match virt func signature)
+        cv::CascadeClassifier &cascade);       // in: unused (match virt func signature)
 
     const DetPar NextFace_(void); // get next face from faces found by DetectFaces_
 
@@ -247,7 +247,7 @@ static void DetectAllEyes(
     const Image& img,      // in
     EYAW         eyaw,     // in
     const Rect&  facerect, // in
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier &cascade)
 {
     // 1.2 is 40ms faster than 1.1 but finds slightly fewer eyes
     static const double EYE_SCALE_FACTOR   = 1.2;
@@ -278,7 +278,7 @@ static void DetectAllMouths(
     int             iright_best, // in
     const vec_Rect& leyes,       // in
     const vec_Rect& reyes,       // in
-    cv::CascadeClassifier cascade)
+    cv::CascadeClassifier &cascade)
 {
     static const double MOUTH_SCALE_FACTOR   = 1.2; // less false pos with 1.2 than 1.1
     static const int    MOUTH_MIN_NEIGHBORS  = 5;   // less false pos with 5 than 3
@@ -661,7 +661,7 @@ static void RectToImgFrame(
 void DetectEyesAndMouth(  // use OpenCV detectors to find the eyes and mouth
     DetPar&       detpar, // io: eye and mouth fields updated, other fields untouched
     const Image&  img,    // in: ROI around face (already rotated if necessary)
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier &cascade)
 {
     Rect facerect(cvRound(detpar.x - detpar.width/2),
                   cvRound(detpar.y - detpar.height/2),
@@ -371,7 +371,7 @@ static void StartShapeAndRoi(  // we have the facerect, now get the rest
     const Image&   img,        // in:  the image (grayscale)
     const vec_Mod& mods,       // in:  a vector of models, one for each yaw range
                                //       (use only estart, and meanshape)
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier &cascade)
 {
     PossiblySetRotToZero(detpar.rot);         // treat small rots as zero rots
 
@@ -450,7 +450,7 @@ bool NextStartShapeAndRoi(     // use face detector results to estimate start sh
     const vec_Mod& mods,       // in:  a vector of models, one for each yaw range
                                //       (use only estart, and meanshape)
     FaceDet&       facedet,    // io:  the face detector (internal face index bumped)
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier &cascade)
 {
     detpar = facedet.NextFace_();  // get next face's detpar from the face det
 
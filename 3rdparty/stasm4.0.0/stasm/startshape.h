@@ -19,7 +19,7 @@ bool NextStartShapeAndRoi(     // use face detector results to estimate start sh
     const Image&   img,        // in: the image (grayscale)
     const vec_Mod& mods,       // in: a vector of models, one for each yaw range
     FaceDet&       facedet,   // io:  the face detector (internal face index bumped)
-    StasmCascadeClassifier cascade);
+    StasmCascadeClassifier &cascade);
 
 void PinnedStartShapeAndRoi(   // use the pinned landmarks to init the start shape
     Shape&         startshape, // out: the start shape (in ROI frame)
@@ -160,7 +160,7 @@ int stasm_search_auto_ext( // extended version of stasm_search_auto
     const char* data,
     const int width,
     const int height,
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier &cascade)
 {
     int returnval = 1;     // assume success
     *foundface = 0;        // but assume no face found
@@ -219,7 +219,7 @@ int stasm_search_auto(// call repeatedly to find all faces
     const char *data,
     const int width,
     const int height,
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier &cascade)
 {
     return stasm_search_auto_ext(foundface, landmarks, NULL, data, width, height, cascade);
 }
@@ -230,7 +230,7 @@ int stasm_search_single(   // wrapper for stasm_search_auto and friends
     const char* img,       // in: gray image data, top left corner at 0,0
     int         width,     // in: image width
     int         height,    // in: image height
-    StasmCascadeClassifier cascade,
+    StasmCascadeClassifier &cascade,
     const char* imgpath,   // in: image path, used only for err msgs and debug
     const char* datadir)   // in: directory of face detector files
 {
@@ -240,6 +240,50 @@ int stasm_search_single(   // wrapper for stasm_search_auto and friends
     return stasm_search_auto(foundface, landmarks, img, width, height, cascade);
 }
 
+int stasm_search_faces(    // detect once, then search every face in the image
+    int*        nfaces,    // out: number of faces found, at most maxfaces
+    float*      landmarks, // out: x0, y0, x1, y1, ... of each face, caller must allocate
+    int         maxfaces,  // in: stop after this many faces
+    const char* data,      // in: gray image data, top left corner at 0,0
+    int         width,     // in: image width
+    int         height,    // in: image height
+    StasmCascadeClassifier &cascade)
+{
+    int returnval = 1;     // assume success
+    *nfaces = 0;
+    try
+    {
+        CheckStasmInit();
+
+        Image img = Image(height, width,(unsigned char*)data);
+
+        // The face detector scans the image once for all the faces
+        FaceDet facedet;
+        facedet.DetectFaces_(img, NULL, maxfaces > 1, 10, NULL, cascade.faceCascade);
+
+        Shape shape;       // the shape with landmarks
+        Image face_roi;    // cropped to area around startshape and possibly rotated
+        DetPar detpar_roi; // detpar translated to ROI frame
+        DetPar detpar;     // params returned by face det, in img frame
+        while (*nfaces < maxfaces &&
+               NextStartShapeAndRoi(shape, face_roi, detpar_roi, detpar,
+                                    img, mods_g, facedet, cascade))
+        {
+            const int imod = ABS(EyawAsModIndex(detpar.eyaw, mods_g));
+            shape = mods_g[imod]->ModSearch_(shape, face_roi);
+            shape = RoiShapeToImgFrame(shape, face_roi, detpar_roi, detpar);
+            RoundMat(shape);
+            ShapeToLandmarks(landmarks + 2 * stasm_NLANDMARKS * *nfaces, shape);
+            (*nfaces)++;
+        }
+    }
+    catch(...)
+    {
+        returnval = 0; // a call was made to Err or a CV_Assert failed
+    }
+    return returnval;
+}
+
 int stasm_search_pinned(    // call after the user has pinned some points
     float*       landmarks, // out: x0, y0, x1, y1, ..., caller must allocate
     const float* pinned,    // in: pinned landmarks (0,0 points not pinned)
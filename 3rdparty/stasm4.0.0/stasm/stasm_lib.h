@@ -89,7 +89,7 @@ int stasm_search_auto(       // call repeatedly to find all faces
     const char*  data,
     const int    width,
     const int    height,
-    StasmCascadeClassifier cascade);
+    StasmCascadeClassifier &cascade);
 
 extern "C"
 int stasm_search_single(     // wrapper for stasm_search_auto and friends
@@ -98,10 +98,20 @@ int stasm_search_single(     // wrapper for stasm_search_auto and friends
     const char*  img,        // in: gray image data, top left corner at 0,0
     int          width,      // in: image width
     int          height,     // in: image height
-    StasmCascadeClassifier cascade,
+    StasmCascadeClassifier &cascade,
     const char*  imgpath,    // in: image path, used only for err msgs and debug
     const char*  datadir);   // in: directory of face detector files
 
+extern "C"
+int stasm_search_faces(      // detect once, then search every face in the image
+    int*         nfaces,     // out: number of faces found, at most maxfaces
+    float*       landmarks,  // out: x0, y0, x1, y1, ... of each face, caller must allocate
+    int          maxfaces,   // in: stop after this many faces
+    const char*  img,        // in: gray image data, top left corner at 0,0
+    int          width,      // in: image width
+    int          height,     // in: image height
+    StasmCascadeClassifier &cascade);
+
 extern "C"                   // find landmarks, no OpenCV face detect
 int stasm_search_pinned(     // call after the user has pinned some points
     float*       landmarks,  // out: x0, y0, x1, y1, ..., caller must allocate
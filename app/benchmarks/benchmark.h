@@ -0,0 +1,132 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_BENCHMARK_H
+#define BR_BENCHMARK_H
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <openbr/openbr_plugin.h>
+#include <openbr/core/distance_sse.h>
+
+// Shared by the micro-benchmarks, each of which reports its suite as JSON:
+// $ <benchmark> [output.json]
+namespace benchmark
+{
+
+// Results are folded into the checksum so the timed work can't be optimized away
+static double checksum = 0;
+
+// Identifies the machine and build the results were measured on
+inline QJsonObject hardware()
+{
+    QJsonObject info;
+    info["version"] = br::Context::version();
+    info["threads"] = QThread::idealThreadCount();
+#ifdef __VERSION__
+    info["compiler"] = QString(__VERSION__);
+#endif
+
+    QString cpu;
+#ifdef __linux__
+    QFile cpuinfo("/proc/cpuinfo");
+    if (cpuinfo.open(QFile::ReadOnly))
+        foreach (const QByteArray &line, cpuinfo.readAll().split('\n'))
+            if (line.startsWith("model name")) {
+                cpu = QString(line.mid(line.indexOf(':')+1)).trimmed();
+                break;
+            }
+#endif
+    info["cpu"] = cpu;
+
+    QJsonArray features;
+#ifdef __SSE__
+    features.append(QString("sse"));
+#endif
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt"))   features.append(QString("popcnt"));
+    if (__builtin_cpu_supports("avx2"))     features.append(QString("avx2"));
+    if (__builtin_cpu_supports("avx512bw")) features.append(QString("avx512bw"));
+#endif
+    info["features"] = features;
+    return info;
+}
+
+// Calls kernel, in doubling batches, until at least minSeconds elapse.
+// Each call processes items of unit, e.g. comparisons or bytes, reported as a rate.
+template <typename Kernel>
+QJsonObject measure(const QString &name, Kernel &kernel, double items, const QString &unit, double minSeconds = 0.25)
+{
+    checksum += kernel(); // Warm up caches and lazily initialized state
+
+    qint64 calls = 0, batch = 1, elapsed = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (elapsed < minSeconds*1e9) {
+        for (qint64 i=0; i<batch; i++)
+            checksum += kernel();
+        calls += batch;
+        batch *= 2;
+        elapsed = std::max<qint64>(timer.nsecsElapsed(), 1);
+    }
+
+    QJsonObject result;
+    result["name"] = name;
+    result["calls"] = double(calls);
+    result["nsPerCall"] = double(elapsed) / calls;
+    result[unit + "PerSecond"] = items * calls / (elapsed / 1e9);
+    return result;
+}
+
+// Writes the suite to the file named by the first argument, or standard output, and finalizes the context
+inline int report(const QString &suite, const QJsonArray &results, int argc, char *argv[])
+{
+    QJsonObject report;
+    report["suite"] = suite;
+    report["hardware"] = hardware();
+    report["results"] = results;
+    report["checksum"] = checksum;
+    const QByteArray json = QJsonDocument(report).toJson();
+
+    if (argc > 1) {
+        QFile file(argv[1]);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(file.fileName()));
+        file.write(json);
+    } else {
+        printf("%s", json.constData());
+        fflush(stdout);
+    }
+
+    br::Context::finalize();
+    return 0;
+}
+
+inline cv::Mat randomMat(int rows, int cols, int type)
+{
+    cv::Mat m(rows, cols, type);
+    cv::randu(m, cv::Scalar::all(0), cv::Scalar::all(256));
+    return m;
+}
+
+} // namespace benchmark
+
+#endif // BR_BENCHMARK_H
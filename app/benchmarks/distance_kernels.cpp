@@ -0,0 +1,146 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \brief Micro-benchmarks of the distance kernels, reported as JSON.
+ *
+ * Times the dispatched l1 and packed_l1 kernels, after checking them against their scalar references, fast_tanh_sse, and the
+ * ByteL1, HalfByteL1, Dist and BayesianQuantization distances comparing one template pair per call.
+ * \code
+ * $ distance_kernels [output.json]
+ * \endcode
+ */
+
+#include <openbr/core/tanh_sse.h>
+#include "benchmark.h"
+
+using namespace cv;
+
+static const int Dimensions = 512;
+static const int Targets = 1024;
+
+struct L1Benchmark
+{
+    QList<Mat> targets;
+    Mat query;
+    bool packed;
+    int index;
+
+    L1Benchmark(int bytes, bool packed)
+        : packed(packed), index(0)
+    {
+        for (int i=0; i<Targets; i++)
+            targets.append(benchmark::randomMat(1, bytes, CV_8UC1));
+        query = benchmark::randomMat(1, bytes, CV_8UC1);
+    }
+
+    double operator()()
+    {
+        const Mat &target = targets[index++ % Targets];
+        return packed ? packed_l1(target.data, query.data, query.cols) : l1(target.data, query.data, query.cols);
+    }
+
+    // The dispatched kernel must agree with the scalar reference before it is timed
+    void verify() const
+    {
+        foreach (const Mat &target, targets)
+            if (packed ? (packed_l1(target.data, query.data, query.cols) != packed_l1_scalar(target.data, query.data, query.cols))
+                       : (l1(target.data, query.data, query.cols) != l1_scalar(target.data, query.data, query.cols)))
+                qFatal("%s kernel disagrees with the scalar reference.", packed ? "packed_l1" : "l1");
+    }
+};
+
+struct TanhBenchmark
+{
+    Mat values;
+
+    TanhBenchmark()
+    {
+        values = benchmark::randomMat(1, 4096, CV_32FC1);
+        values = values / 25.6f - 5.f;
+    }
+
+    double operator()()
+    {
+        const float *x = values.ptr<float>();
+#ifdef __SSE__
+        v4sf sum = _mm_setzero_ps();
+        for (int i=0; i<values.cols; i+=4)
+            sum = _mm_add_ps(sum, fast_tanh_sse(_mm_loadu_ps(x + i)));
+        float lanes[4];
+        _mm_storeu_ps(lanes, sum);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+        float sum = 0;
+        for (int i=0; i<values.cols; i++)
+            sum += fast_tanh(x[i]);
+        return sum;
+#endif
+    }
+};
+
+struct DistanceBenchmark
+{
+    QSharedPointer<br::Distance> distance;
+    br::TemplateList targets;
+    br::Template query;
+    int index;
+
+    DistanceBenchmark(const QString &description, int cols, int type)
+        : distance(br::Distance::make(description, NULL)), index(0)
+    {
+        for (int i=0; i<Targets; i++) {
+            br::Template t(benchmark::randomMat(1, cols, type));
+            t.file.set("Label", i % 32);
+            targets.append(t);
+        }
+        query = br::Template(benchmark::randomMat(1, cols, type));
+        if (distance->trainable())
+            distance->train(targets);
+    }
+
+    double operator()()
+    {
+        return distance->compare(targets[index++ % Targets], query);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+
+    QJsonArray results;
+
+    L1Benchmark byte(Dimensions, false), packed((Dimensions + 1) / 2, true);
+    byte.verify();
+    packed.verify();
+    results.append(benchmark::measure("l1", byte, 1, "comparisons"));
+    results.append(benchmark::measure("packed_l1", packed, 1, "comparisons"));
+
+    TanhBenchmark fastTanh;
+    results.append(benchmark::measure("fast_tanh_sse", fastTanh, fastTanh.values.cols, "values"));
+
+    DistanceBenchmark byteL1("ByteL1", Dimensions, CV_8UC1);
+    DistanceBenchmark halfByteL1("HalfByteL1", (Dimensions + 1) / 2, CV_8UC1);
+    DistanceBenchmark dist("Dist(L2)", Dimensions, CV_32FC1);
+    DistanceBenchmark bayesianQuantization("BayesianQuantization", Dimensions, CV_8UC1);
+    results.append(benchmark::measure("ByteL1", byteL1, 1, "comparisons"));
+    results.append(benchmark::measure("HalfByteL1", halfByteL1, 1, "comparisons"));
+    results.append(benchmark::measure("Dist", dist, 1, "comparisons"));
+    results.append(benchmark::measure("BayesianQuantization", bayesianQuantization, 1, "comparisons"));
+
+    return benchmark::report("distance_kernels", results, argc, argv);
+}
@@ -0,0 +1,116 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \brief Micro-benchmarks of template serialization and gallery reads, reported as JSON.
+ *
+ * Times QDataStream serialization and deserialization of a block of templates,
+ * and reading them back from a <tt>.gal</tt> gallery written to a temporary directory.
+ * \code
+ * $ template_io [output.json]
+ * \endcode
+ */
+
+#include <QDataStream>
+#include <QTemporaryDir>
+#include "benchmark.h"
+
+using namespace cv;
+
+static const int Templates = 1000;
+static const int Dimensions = 512;
+
+static br::TemplateList randomTemplates()
+{
+    br::TemplateList templates;
+    for (int i=0; i<Templates; i++) {
+        br::Template t(br::File(QString("images/%1.jpg").arg(i)), benchmark::randomMat(1, Dimensions, CV_32FC1));
+        t.file.set("Label", i % 100);
+        templates.append(t);
+    }
+    return templates;
+}
+
+struct SerializeBenchmark
+{
+    br::TemplateList templates;
+
+    double operator()()
+    {
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << templates;
+        return data.size();
+    }
+};
+
+struct DeserializeBenchmark
+{
+    QByteArray data;
+
+    double operator()()
+    {
+        br::TemplateList templates;
+        QDataStream stream(data);
+        stream >> templates;
+        return templates.size();
+    }
+};
+
+struct GalleryBenchmark
+{
+    br::File gallery;
+
+    double operator()()
+    {
+        QScopedPointer<br::Gallery> g(br::Gallery::make(gallery));
+        int count = 0;
+        bool done = false;
+        while (!done)
+            count += g->readBlock(&done).size();
+        return count;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+
+    SerializeBenchmark serialize;
+    serialize.templates = randomTemplates();
+
+    DeserializeBenchmark deserialize;
+    QDataStream stream(&deserialize.data, QFile::WriteOnly);
+    stream << serialize.templates;
+
+    QTemporaryDir dir;
+    if (!dir.isValid())
+        qFatal("Failed to create a temporary directory.");
+    GalleryBenchmark read;
+    read.gallery = dir.path() + "/templates.gal";
+    {
+        QScopedPointer<br::Gallery> g(br::Gallery::make(read.gallery));
+        g->writeBlock(serialize.templates);
+    }
+
+    const double bytes = deserialize.data.size();
+    QJsonArray results;
+    results.append(benchmark::measure("serialize", serialize, bytes, "bytes"));
+    results.append(benchmark::measure("deserialize", deserialize, bytes, "bytes"));
+    results.append(benchmark::measure("galleryRead", read, bytes, "bytes"));
+
+    return benchmark::report("template_io", results, argc, argv);
+}
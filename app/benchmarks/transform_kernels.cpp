@@ -0,0 +1,62 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \brief Micro-benchmarks of the feature extraction transforms, reported as JSON.
+ *
+ * Times LBP, HoGDescriptor, Gabor and IntegralHist projecting one image per call.
+ * \code
+ * $ transform_kernels [output.json]
+ * \endcode
+ */
+
+#include "benchmark.h"
+
+using namespace cv;
+
+struct TransformBenchmark
+{
+    QSharedPointer<br::Transform> transform;
+    br::Template src;
+
+    TransformBenchmark(const QString &description, int rows, int cols, int type)
+        : transform(br::Transform::make(description, NULL)), src(benchmark::randomMat(rows, cols, type)) {}
+
+    double operator()()
+    {
+        br::Template dst;
+        transform->project(src, dst);
+        return dst.m().total();
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+
+    TransformBenchmark lbp("LBP", 128, 128, CV_8UC1);
+    TransformBenchmark hog("HoGDescriptor", 128, 64, CV_8UC1); // The default 64x128 window
+    TransformBenchmark gabor("Gabor(5,0,0,3,1,Magnitude)", 128, 128, CV_32FC1);
+    TransformBenchmark integralHist("IntegralHist(256,8)", 128, 128, CV_8UC1); // Unquantized pixels need every bin
+
+    QJsonArray results;
+    results.append(benchmark::measure("LBP", lbp, lbp.src.m().total(), "pixels"));
+    results.append(benchmark::measure("HoGDescriptor", hog, hog.src.m().total(), "pixels"));
+    results.append(benchmark::measure("Gabor", gabor, gabor.src.m().total(), "pixels"));
+    results.append(benchmark::measure("IntegralHist", integralHist, integralHist.src.m().total(), "pixels"));
+
+    return benchmark::report("transform_kernels", results, argc, argv);
+}
@@ -180,6 +180,12 @@ public:
             } else if (!strcmp(fun, "project")) {
                 check(parc == 2, "Insufficient parameter count for 'project'.");
                 br_project(parv[0], parv[1]);
+            } else if (!strcmp(fun, "benchmark")) {
+                check((parc >= 1) && (parc <= 3), "Incorrect parameter count for 'benchmark'.");
+                br_benchmark(parv[0], parc >= 2 ? parv[1] : "", parc >= 3 ? parv[2] : "");
+            } else if (!strcmp(fun, "serve")) {
+                check(parc <= 2, "Incorrect parameter count for 'serve'.");
+                br_serve(parc >= 1 ? parv[0] : "", parc >= 2 ? atoi(parv[1]) : 8080);
             } else if (!strcmp(fun, "deduplicate")) {
                 check(parc == 3, "Incorrect parameter count for 'deduplicate'.");
                 br_deduplicate(parv[0], parv[1], parv[2]);
@@ -271,6 +277,8 @@ private:
                "-plotLandmarking <file> ... <file> {destination}\n"
                "-plotMetadata <file> ... <file> <columns>\n"
                "-project <input_gallery> {output_gallery}\n"
+               "-benchmark <input_gallery> [{json}] [parallelism,...,parallelism]\n"
+               "-serve [<gallery>] [port]\n"
                "-getHeader <matrix>\n"
                "-setHeader {<matrix>} <target_gallery> <query_gallery>\n"
                "-<key> <value>\n"
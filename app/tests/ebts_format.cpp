@@ -0,0 +1,100 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Reads a small synthetic EBTS transaction with a type 2, a binary type 4 and a type 10 record
+#include <QDir>
+#include <QFile>
+#include <QtEndian>
+#include <opencv2/highgui/highgui.hpp>
+#include <openbr/openbr_plugin.h>
+
+static const char GS = 0x1D, FS = 0x1C, RS = 0x1E, US = 0x1F;
+
+static int failures = 0;
+
+static void check(bool condition, const char *description)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", description);
+        failures++;
+    }
+}
+
+// "<type>.001:<length>" followed by the fields, the length counts every byte of the record including its own digits
+static QByteArray taggedRecord(int type, const QList< QPair<int,QByteArray> > &fields)
+{
+    QByteArray body;
+    for (int i=0; i<fields.size(); i++)
+        body += GS + QByteArray::number(type) + "." + QByteArray::number(fields[i].first).rightJustified(3, '0') + ":" + fields[i].second;
+    body += FS;
+
+    const QByteArray prefix = QByteArray::number(type) + ".001:";
+    int length = prefix.size() + body.size();
+    while (prefix.size() + QByteArray::number(length).size() + body.size() != length)
+        length = prefix.size() + QByteArray::number(length).size() + body.size();
+    return prefix + QByteArray::number(length) + body;
+}
+
+static QByteArray binaryRecord(int bytes)
+{
+    QByteArray record(bytes, 'x');
+    qToBigEndian<quint32>(bytes, (uchar*) record.data());
+    return record;
+}
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+
+    cv::Mat image(24, 32, CV_8UC3, cv::Scalar(10, 20, 30));
+    std::vector<uchar> png;
+    cv::imencode(".png", image, png);
+
+    QList< QPair<int,QByteArray> > type1;
+    type1 << qMakePair(2, QByteArray("0400"))
+          << qMakePair(3, QByteArray("1") + US + "3" + RS + "2" + US + "00" + RS + "4" + US + "01" + RS + "10" + US + "02");
+    QList< QPair<int,QByteArray> > type2;
+    type2 << qMakePair(2, QByteArray("00"))
+          << qMakePair(18, QByteArray("DOE,JOHN"))
+          << qMakePair(24, QByteArray("M"));
+    QList< QPair<int,QByteArray> > type10;
+    type10 << qMakePair(2, QByteArray("02"))
+           << qMakePair(999, QByteArray((const char*) &png[0], int(png.size())));
+
+    const QString fileName = QDir::temp().filePath("br_ebts_format_test.ebts");
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Failed to open %s for writing.", qPrintable(fileName));
+    file.write(taggedRecord(1, type1) + taggedRecord(2, type2) + binaryRecord(50) + taggedRecord(10, type10));
+    file.close();
+
+    QScopedPointer<br::Format> format(br::Factory<br::Format>::make(br::File(fileName)));
+    const br::Template t = format->read();
+    QFile::remove(fileName);
+
+    check(t.file.get<QString>("FIRSTNAME", "") == "JOHN", "type 2 first name");
+    check(t.file.get<QString>("LASTNAME", "") == "DOE", "type 2 last name");
+    check(t.file.get<QString>("GENDER", "") == "M", "type 2 gender");
+    check(t.size() == 1, "one type 10 image");
+    if (t.size() == 1) {
+        check((t.m().rows == image.rows) && (t.m().cols == image.cols), "type 10 image size");
+        check(cv::norm(t.m(), image, cv::NORM_INF) == 0, "type 10 image pixels");
+    }
+
+    br::Context::finalize();
+    if (failures == 0) printf("ebts_format: passed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Checks that lists projected through an Independent wrapper reach the wrapped transform's batched project(TemplateList)
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+// Records the size of the list each template was projected in, single templates are recorded as 0
+class BatchProbeTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        dst.file.set("Batch", 0);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        foreach (const Template &t, src) {
+            dst.append(t);
+            dst.last().file.set("Batch", src.size());
+        }
+    }
+};
+
+BR_REGISTER(Transform, BatchProbeTransform)
+
+} // namespace br
+
+static int failures = 0;
+
+static void check(bool condition, const char *description)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", description);
+        failures++;
+    }
+}
+
+static br::TemplateList templates(int count, int matrices)
+{
+    br::TemplateList list;
+    for (int i=0; i<count; i++) {
+        list.append(br::Template(br::File(QString("template%1.png").arg(i))));
+        for (int j=0; j<matrices; j++)
+            list.last().append(Mat(2, 2, CV_32FC1, Scalar(i)));
+    }
+    return list;
+}
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+    QScopedPointer<br::Transform> probe(br::Transform::make("BatchProbe", NULL));
+
+    { // Single matrix templates
+        const br::TemplateList src = templates(3, 1);
+        br::TemplateList dst;
+        probe->project(src, dst);
+        check(dst.size() == 3, "one template per single matrix template");
+        for (int i=0; i<dst.size(); i++) {
+            check(dst[i].file.get<int>("Batch", -1) == 3, "single matrix templates projected as one list");
+            check(dst[i].file.name == src[i].file.name, "single matrix template file kept");
+        }
+    }
+
+    { // Multiple matrix templates, each matrix index is its own list
+        const br::TemplateList src = templates(3, 2);
+        br::TemplateList dst;
+        probe->project(src, dst);
+        check(dst.size() == 3, "one template per multiple matrix template");
+        for (int i=0; i<dst.size(); i++) {
+            check(dst[i].size() == 2, "every matrix projected");
+            check(dst[i].file.get<int>("Batch", -1) == 3, "matrix index projected as one list");
+            check(dst[i].file.name == src[i].file.name, "multiple matrix template file kept");
+        }
+    }
+
+    { // Templates without matrices keep their place and file
+        br::TemplateList src = templates(3, 1);
+        src[1].clear();
+        br::TemplateList dst;
+        probe->project(src, dst);
+        check(dst.size() == 3, "one template per template with or without matrices");
+        if (dst.size() == 3) {
+            check(dst[0].file.get<int>("Batch", -1) == 2, "templates with matrices projected as one list");
+            check(dst[1].isEmpty() && (dst[1].file.name == src[1].file.name), "template without matrices passed through");
+            check(dst[2].file.name == src[2].file.name, "order kept around a template without matrices");
+        }
+    }
+
+    br::Context::finalize();
+    if (failures == 0) printf("independent_batch: passed\n");
+    return failures == 0 ? 0 : 1;
+}
+
+#include "independent_batch.moc"
@@ -0,0 +1,92 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Round trips out of range scores through quantized and half precision .mtx matrices
+#include <QDir>
+#include <QFile>
+#include <cmath>
+#include <limits>
+#include <openbr/openbr_plugin.h>
+
+static int failures = 0;
+
+static void check(bool condition, const QString &description)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", qPrintable(description));
+        failures++;
+    }
+}
+
+static void roundTrip(const QString &precision)
+{
+    const float low = -1, high = 2;
+    QList<float> scores, expected;
+    scores   << std::numeric_limits<float>::infinity() << 1000.f << -1000.f << 0.5f << -std::numeric_limits<float>::max();
+    expected << high                                    << high   << low     << 0.5f << -std::numeric_limits<float>::max();
+    if (precision == "Half") {
+        // Half precision keeps out of range scores rather than clamping them
+        expected[0] = std::numeric_limits<float>::infinity();
+        expected[1] = 1000.f;
+        expected[2] = -1000.f;
+    }
+
+    br::FileList targets, queries;
+    for (int i=0; i<scores.size(); i++)
+        targets.append(br::File(QString("target%1.jpg").arg(i)));
+    queries.append(br::File("query.jpg"));
+
+    const QString fileName = QDir::temp().filePath("br_score_codec_test_" + precision + ".mtx");
+    br::File output(fileName);
+    output.set("precision", precision);
+    output.set("low", low);
+    output.set("high", high);
+    {
+        QScopedPointer<br::Output> mtx(br::Output::make(output, targets, queries));
+        mtx->setBlock(0, 0);
+        for (int i=0; i<scores.size(); i++)
+            mtx->setRelative(scores[i], 0, i);
+    }
+
+    QScopedPointer<br::Format> format(br::Factory<br::Format>::make(br::File(fileName)));
+    const br::Template t = format->read();
+    QFile::remove(fileName);
+
+    check((t.m().rows == 1) && (t.m().cols == scores.size()), precision + " matrix size");
+    if ((t.m().rows != 1) || (t.m().cols != scores.size()))
+        return;
+
+    // Quantized scores are exact to within one step
+    const float tolerance = (precision == "8Bit") ? (high - low) / 254 : (precision == "16Bit") ? (high - low) / 65534 : 1e-3f;
+    for (int i=0; i<scores.size(); i++) {
+        const float value = t.m().at<float>(0, i);
+        const bool ok = (value == expected[i]) || (std::abs(value - expected[i]) <= tolerance);
+        check(ok, QString("%1 score %2 read back as %3, expected %4").arg(precision, QString::number(scores[i]), QString::number(value), QString::number(expected[i])));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+
+    roundTrip("8Bit");
+    roundTrip("16Bit");
+    roundTrip("Half");
+
+    br::Context::finalize();
+    if (failures == 0) printf("score_codec: passed\n");
+    return failures == 0 ? 0 : 1;
+}
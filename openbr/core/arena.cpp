@@ -0,0 +1,188 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThreadStorage>
+#include <QVector>
+
+#include "arena.h"
+
+namespace br
+{
+
+// Size classes are quarter steps between powers of two, starting at 256 bytes
+static const size_t minClassBytes = 256;
+static const int classesPerOctave = 4;
+static const int numClasses = 1 + (64 - 8) * classesPerOctave;
+
+// Idle buffers kept per arena, anything beyond this is returned to the heap
+static const size_t maxCachedBytes = 64 * 1024 * 1024;
+
+// Room in front of each buffer for its size class, kept at 16 bytes to preserve alignment
+static const size_t headerBytes = 16;
+
+static int sizeClass(size_t bytes, size_t &classBytes)
+{
+    if (bytes <= minClassBytes) {
+        classBytes = minClassBytes;
+        return 0;
+    }
+
+    int octave = 0;
+    while ((size_t(1) << (octave + 1)) <= bytes - 1)
+        octave++;
+    const size_t base = size_t(1) << octave;
+    const size_t step = base / classesPerOctave;
+    const int sub = int((bytes - 1 - base) / step);
+    classBytes = base + (sub + 1) * step;
+    return 1 + (octave - 8) * classesPerOctave + sub;
+}
+
+class Arena : public cv::MatAllocator
+{
+    QMutex mutex;
+    QVector< QList<uchar*> > freeLists;
+    size_t cachedBytes;
+
+public:
+    Arena() : freeLists(numClasses), cachedBytes(0) {}
+
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; i--) {
+            step[i] = total;
+            total *= sizes[i];
+        }
+        total = cv::alignSize(total, (int)sizeof(*refcount));
+
+        size_t classBytes;
+        const int index = sizeClass(total + sizeof(*refcount), classBytes);
+
+        uchar *block = NULL;
+        {
+            QMutexLocker locker(&mutex);
+            if (!freeLists[index].isEmpty()) {
+                block = freeLists[index].takeLast();
+                cachedBytes -= classBytes;
+            }
+        }
+        if (!block)
+            block = (uchar*) cv::fastMalloc(headerBytes + classBytes);
+
+        *reinterpret_cast<int*>(block) = index;
+        datastart = data = block + headerBytes;
+        refcount = reinterpret_cast<int*>(data + total);
+        *refcount = 1;
+    }
+
+    void deallocate(int *refcount, uchar *datastart, uchar *data)
+    {
+        (void) refcount;
+        (void) data;
+        if (!datastart)
+            return;
+
+        uchar *block = datastart - headerBytes;
+        const int index = *reinterpret_cast<int*>(block);
+        size_t classBytes = minClassBytes;
+        if (index > 0) {
+            const int octave = 8 + (index - 1) / classesPerOctave;
+            const int sub = (index - 1) % classesPerOctave;
+            const size_t base = size_t(1) << octave;
+            classBytes = base + (sub + 1) * (base / classesPerOctave);
+        }
+
+        {
+            QMutexLocker locker(&mutex);
+            if (cachedBytes + classBytes <= maxCachedBytes) {
+                freeLists[index].append(block);
+                cachedBytes += classBytes;
+                return;
+            }
+        }
+        cv::fastFree(block);
+    }
+
+    // Return every idle buffer to the heap
+    void trim()
+    {
+        QMutexLocker locker(&mutex);
+        for (int i=0; i<freeLists.size(); i++) {
+            foreach (uchar *block, freeLists[i])
+                cv::fastFree(block);
+            freeLists[i].clear();
+        }
+        cachedBytes = 0;
+    }
+};
+
+// Arenas are never destroyed since matrices may outlive the thread that allocated them,
+// instead an exiting thread parks its arena for reuse by the next thread to ask for one.
+static QMutex idleLock;
+static QList<Arena*> idleArenas;
+
+struct ArenaLease
+{
+    Arena *arena;
+
+    ArenaLease()
+    {
+        QMutexLocker locker(&idleLock);
+        arena = idleArenas.isEmpty() ? new Arena() : idleArenas.takeLast();
+    }
+
+    ~ArenaLease()
+    {
+        arena->trim();
+        QMutexLocker locker(&idleLock);
+        idleArenas.append(arena);
+    }
+};
+
+static QThreadStorage<ArenaLease*> leases;
+
+static Arena *threadArena()
+{
+    if (!leases.hasLocalData())
+        leases.setLocalData(new ArenaLease());
+    return leases.localData()->arena;
+}
+
+cv::Mat MatArena::mat()
+{
+    cv::Mat m;
+    m.allocator = threadArena();
+    return m;
+}
+
+cv::Mat MatArena::mat(int rows, int cols, int type)
+{
+    cv::Mat m = mat();
+    m.create(rows, cols, type);
+    return m;
+}
+
+cv::Mat MatArena::clone(const cv::Mat &m)
+{
+    cv::Mat copy = mat();
+    m.copyTo(copy);
+    return copy;
+}
+
+} // namespace br
@@ -0,0 +1,45 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_ARENA_H
+#define BR_ARENA_H
+
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Per-thread recycling allocator for intermediate matrices.
+// Matrices obtained here draw their buffers from the calling thread's arena,
+// and released buffers return to the arena's size-classed free lists instead of the heap,
+// so steady-state enrollment reuses the same blocks template after template.
+// Buffers may be released from any thread, and the arena of a finished thread is handed to the next new one.
+class BR_EXPORT MatArena
+{
+public:
+    // An empty matrix that allocates from the arena the first time it is created, e.g. as an OpenCV output argument
+    static cv::Mat mat();
+
+    static cv::Mat mat(int rows, int cols, int type);
+
+    // Deep copy of m with its buffer from the arena
+    static cv::Mat clone(const cv::Mat &m);
+};
+
+} // namespace br
+
+#endif // BR_ARENA_H
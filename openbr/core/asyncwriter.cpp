@@ -0,0 +1,157 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QThread>
+#include <algorithm>
+
+#include "asyncwriter.h"
+#include "profiler.h"
+
+namespace br
+{
+
+class AsyncWriter::Thread : public QThread
+{
+public:
+    AsyncWriter *writer;
+    int index;
+
+    Thread(AsyncWriter *writer, int index) : writer(writer), index(index) {}
+
+private:
+    void run()
+    {
+        Profiler::nameThread(QString("br-writer-%1").arg(index));
+        while (QRunnable *job = writer->take()) {
+            const bool autoDelete = job->autoDelete();
+            job->run();
+            if (autoDelete)
+                delete job;
+            writer->done();
+        }
+    }
+};
+
+AsyncWriter::AsyncWriter(int threads, int capacity, bool ordered)
+    : capacity(std::max(1, capacity)), pending(0), stopping(false)
+{
+    threads = ordered ? 1 : std::max(1, threads);
+    for (int i=0; i<threads; i++) {
+        this->threads.append(new Thread(this, i));
+        this->threads.last()->start();
+    }
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    flush();
+    {
+        QMutexLocker locker(&lock);
+        stopping = true;
+        available.wakeAll();
+    }
+    foreach (Thread *thread, threads) {
+        thread->wait();
+        delete thread;
+    }
+}
+
+void AsyncWriter::start(QRunnable *job)
+{
+    QMutexLocker locker(&lock);
+    while (pending >= capacity)
+        space.wait(&lock);
+    jobs.append(job);
+    pending++;
+    available.wakeOne();
+}
+
+void AsyncWriter::flush()
+{
+    QMutexLocker locker(&lock);
+    while (pending > 0)
+        finished.wait(&lock);
+}
+
+// Returns NULL once the writer is stopping and the queue is empty
+QRunnable *AsyncWriter::take()
+{
+    QMutexLocker locker(&lock);
+    while (jobs.isEmpty() && !stopping)
+        available.wait(&lock);
+    return jobs.isEmpty() ? NULL : jobs.takeFirst();
+}
+
+void AsyncWriter::done()
+{
+    QMutexLocker locker(&lock);
+    pending--;
+    space.wakeOne();
+    if (pending == 0)
+        finished.wakeAll();
+}
+
+struct WriteBlock : public QRunnable
+{
+    QSharedPointer<Gallery> gallery;
+    TemplateList templates;
+    WriteBlock(const QSharedPointer<Gallery> &gallery, const TemplateList &templates) : gallery(gallery), templates(templates) {}
+    void run() { gallery->writeBlock(templates); }
+};
+
+GroupCommit::GroupCommit(const QSharedPointer<Gallery> &gallery, int commitSize, bool asynchronous, int queueSize)
+    : gallery(gallery), commitSize(std::max(1, commitSize))
+{
+    // Thread affine galleries, like database connections, are written from the calling thread
+    if (asynchronous && !gallery->threadAffine())
+        writer.reset(new AsyncWriter(1, queueSize, true));
+}
+
+GroupCommit::~GroupCommit()
+{
+    flush();
+}
+
+void GroupCommit::append(const Template &t)
+{
+    group.append(writer ? t.clone() : t);
+    if (group.size() >= commitSize)
+        commit();
+}
+
+void GroupCommit::append(const TemplateList &templates)
+{
+    foreach (const Template &t, templates)
+        append(t);
+}
+
+void GroupCommit::commit()
+{
+    if (group.isEmpty())
+        return;
+    if (writer) writer->start(new WriteBlock(gallery, group));
+    else        gallery->writeBlock(group);
+    group.clear();
+}
+
+void GroupCommit::flush()
+{
+    commit();
+    if (writer)
+        writer->flush();
+}
+
+} // namespace br
@@ -0,0 +1,95 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_ASYNCWRITER_H
+#define BR_ASYNCWRITER_H
+
+#include <QList>
+#include <QMutex>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QWaitCondition>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Runs output jobs, like encoding images or appending to a gallery, on background threads so the transform producing them
+// returns to the pipeline instead of waiting on compression and disk latency.
+// At most capacity jobs are queued or running, start() blocks the producer beyond that.
+// Ordered writers run jobs one at a time in the order they were started, otherwise up to threads jobs run concurrently.
+class BR_EXPORT AsyncWriter
+{
+public:
+    AsyncWriter(int threads, int capacity, bool ordered);
+
+    // Finishes every started job, then joins the threads.
+    ~AsyncWriter();
+
+    // Takes ownership of job if job->autoDelete() is set, as in QThreadPool.
+    void start(QRunnable *job);
+
+    // Waits until every started job has finished.
+    void flush();
+
+private:
+    class Thread;
+    friend class Thread;
+
+    QList<Thread*> threads;
+    QList<QRunnable*> jobs;
+    int capacity, pending; // Limit on and count of jobs queued or running
+    bool stopping;
+
+    QMutex lock;
+    QWaitCondition available, space, finished;
+
+    QRunnable *take();
+    void done();
+};
+
+// Appends templates to a gallery in groups of commitSize with one Gallery::writeBlock() each, amortizing per write overhead.
+// When asynchronous, groups are written in order by a background thread, with at most queueSize groups waiting,
+// and templates are copied on append since the caller may reuse their data before they are written.
+// Galleries reporting Gallery::threadAffine() are always written synchronously.
+class BR_EXPORT GroupCommit
+{
+public:
+    GroupCommit(const QSharedPointer<Gallery> &gallery, int commitSize, bool asynchronous, int queueSize);
+
+    // Writes every appended template.
+    ~GroupCommit();
+
+    void append(const Template &t);
+    void append(const TemplateList &templates);
+
+    // Writes the pending group, even if it is smaller than commitSize.
+    void commit();
+
+    // Commits and waits until every appended template is written.
+    void flush();
+
+private:
+    QSharedPointer<Gallery> gallery;
+    int commitSize;
+    TemplateList group;
+    QScopedPointer<AsyncWriter> writer;
+};
+
+} // namespace br
+
+#endif // BR_ASYNCWRITER_H
@@ -15,9 +15,9 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtCore>
-#ifndef BR_EMBEDDED
-#include <QtXml>
-#endif // BR_EMBEDDED
+#include <QtConcurrent>
+#include <algorithm>
+#include <limits>
 
 #include "bee.h"
 #include "opencvutils.h"
@@ -29,70 +29,194 @@ using namespace br;
 namespace BEE
 {
 
-FileList readSigset(const File &sigset, bool ignoreMetadata)
+SigsetReader::SigsetReader(QIODevice *device, const QString &sigset, bool ignoreMetadata)
+    : xml(device), sigset(sigset), ignoreMetadata(ignoreMetadata), started(false)
+{
+}
+
+bool SigsetReader::read(File &file)
+{
+    if (!started) {
+        started = true;
+        if (!xml.readNextStartElement() || (xml.name() != "biometric-signature-set"))
+            return false;
+    }
+
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (!xml.isStartElement())
+            continue;
+
+        if (xml.name() == "biometric-signature") {
+            label = xml.attributes().value("name").toString();
+            continue;
+        }
+
+        // A presentation
+        file = File("", label);
+        foreach (const QXmlStreamAttribute &attribute, xml.attributes()) {
+            if      (attribute.name() == "file-name") file.name = attribute.value().toString();
+            else if (!ignoreMetadata)                 file.set(attribute.name().toString(), attribute.value().toString());
+        }
+
+        // Bounding boxes, if they exist, are child elements of the presentation
+        QList<QRectF> rects;
+        while (xml.readNextStartElement()) {
+            const QXmlStreamAttributes bbox = xml.attributes();
+            if (bbox.hasAttribute("x") && bbox.hasAttribute("y") && bbox.hasAttribute("width") && bbox.hasAttribute("height"))
+                rects += QRectF(bbox.value("x").toString().toDouble(), bbox.value("y").toString().toDouble(),
+                                bbox.value("width").toString().toDouble(), bbox.value("height").toString().toDouble());
+            xml.skipCurrentElement();
+        }
+        if (!rects.isEmpty())
+            file.setRects(rects);
+
+        if (file.name.isEmpty()) qFatal("Missing file-name in %s.", qPrintable(sigset));
+        return true;
+    }
+
+    if (xml.hasError())
+        qFatal("Unable to parse %s: %s.", qPrintable(sigset), qPrintable(xml.errorString()));
+    return false;
+}
+
+FileList SigsetReader::readAll()
 {
     FileList fileList;
+    File file;
+    while (read(file))
+        fileList.append(file);
+    return fileList;
+}
+
+// Signatures in [begin, end) of a mapped sigset of the given size
+struct SigsetChunk
+{
+    const char *data;
+    qint64 begin, end, size;
+};
+
+// Reads a chunk in place, wrapped in a root element where it lacks one, so chunks aren't limited to a QByteArray's size
+class SigsetChunkDevice : public QIODevice
+{
+    SigsetChunk chunk;
+    QByteArray prefix, suffix;
+    qint64 offset;
 
-#ifndef BR_EMBEDDED
-    QDomDocument doc(sigset.fileName());
+public:
+    SigsetChunkDevice(const SigsetChunk &chunk)
+        : chunk(chunk), offset(0)
     {
-        QFile file(sigset.resolved());
-        if (!file.open(QIODevice::ReadOnly))
-            qFatal("Unable to open %s for reading.", qPrintable(sigset));
-        if (!doc.setContent(&file))
-            qFatal("Unable to parse %s.", qPrintable(sigset));
-    }
-
-    QDomElement docElem = doc.documentElement();
-    if (docElem.nodeName() != "biometric-signature-set")
-        return fileList;
-
-    QDomNode subject = docElem.firstChild();
-    while (!subject.isNull()) {
-        // Looping through subjects
-        QDomNode fileNode = subject.firstChild();
-        QDomElement d = subject.toElement();
-        QString name = d.attribute("name");
-        while (!fileNode.isNull()) {
-            // Looping through files
-            File file("", name);
-
-            QDomElement e = fileNode.toElement();
-            QDomNamedNodeMap attributes = e.attributes();
-            for (int i=0; i<attributes.length(); i++) {
-                const QString key = attributes.item(i).nodeName();
-                const QString value = attributes.item(i).nodeValue();
-                if      (key == "file-name") file.name = value;
-                else if (!ignoreMetadata)    file.set(key, value);
-            }
+        if (chunk.begin > 0) prefix = "<biometric-signature-set>";
+        if (chunk.end < chunk.size) suffix = "</biometric-signature-set>";
+    }
 
-            // add bounding boxes, if they exist (will be child elements of <presentation>)
-            if (fileNode.hasChildNodes()) {
-                QList<QRectF> rects;
-                QDomNodeList bboxes = fileNode.childNodes();
-                for (int i=0; i<bboxes.length(); i++) {
-                    QDomElement bbox = bboxes.at(i).toElement();
-                    qreal x = bbox.attribute("x").toDouble();
-                    qreal y = bbox.attribute("y").toDouble();
-                    qreal width = bbox.attribute("width").toDouble();
-                    qreal height = bbox.attribute("height").toDouble();
-                    rects += QRectF(x, y, width, height);
-                }
-                file.setRects(rects);
-            }
+    qint64 size() const
+    {
+        return prefix.size() + (chunk.end - chunk.begin) + suffix.size();
+    }
 
-            if (file.name.isEmpty()) qFatal("Missing file-name in %s.", qPrintable(sigset));
-            fileList.append(file);
+    bool seek(qint64 pos)
+    {
+        if (!QIODevice::seek(pos))
+            return false;
+        offset = pos;
+        return true;
+    }
 
-            fileNode = fileNode.nextSibling();
+private:
+    qint64 readData(char *data, qint64 maxSize)
+    {
+        const qint64 bodySize = chunk.end - chunk.begin;
+        qint64 read = 0;
+        while ((read < maxSize) && (offset < size())) {
+            const char *source;
+            qint64 available;
+            if (offset < prefix.size()) {
+                source = prefix.constData() + offset;
+                available = prefix.size() - offset;
+            } else if (offset < prefix.size() + bodySize) {
+                source = chunk.data + chunk.begin + (offset - prefix.size());
+                available = prefix.size() + bodySize - offset;
+            } else {
+                source = suffix.constData() + (offset - prefix.size() - bodySize);
+                available = size() - offset;
+            }
+            const qint64 bytes = std::min(available, maxSize - read);
+            memcpy(data + read, source, size_t(bytes));
+            read += bytes;
+            offset += bytes;
         }
-        subject = subject.nextSibling();
+        return read;
+    }
+
+    qint64 writeData(const char *, qint64)
+    {
+        return -1;
+    }
+};
+
+static FileList readSigsetChunk(const SigsetChunk &chunk, const QString &sigset, bool ignoreMetadata)
+{
+    SigsetChunkDevice device(chunk);
+    device.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    SigsetReader reader(&device, sigset, ignoreMetadata);
+    return reader.readAll();
+}
+
+// Offsets of biometric-signature start tags that split the sigset into roughly equal chunks
+static QList<qint64> signatureBoundaries(const char *data, qint64 size, int chunks)
+{
+    static const char tag[] = "<biometric-signature";
+    static const int tagSize = sizeof(tag) - 1;
+    QList<qint64> boundaries;
+    boundaries.append(0);
+    for (int i=1; i<chunks; i++) {
+        const char *position = data + std::max(size * i / chunks, boundaries.last() + 1);
+        while (((position = std::search(position, data + size, tag, tag + tagSize)) != data + size) &&
+               ((position + tagSize == data + size) || (position[tagSize] == '-'))) // Not biometric-signature-set
+            position += tagSize;
+        if (position == data + size)
+            break;
+        boundaries.append(position - data);
     }
-#else // BR_EMBEDDED
-    (void) sigset;
-    (void) ignoreMetadata;
-#endif // BR_EMBEDDED
+    boundaries.append(size);
+    return boundaries;
+}
 
+FileList readSigset(const File &sigset, bool ignoreMetadata)
+{
+    QFile file(sigset.resolved());
+    if (!file.open(QIODevice::ReadOnly))
+        qFatal("Unable to open %s for reading.", qPrintable(sigset));
+
+    // Sigsets smaller than a chunk are streamed on this thread
+    static const qint64 chunkSize = 16*1024*1024;
+    const int chunks = (int) std::min(qint64(Globals->parallelism), file.size() / chunkSize + 1);
+    const char *mapped = (chunks > 1) ? (const char*) file.map(0, file.size()) : NULL;
+    if (!mapped) {
+        SigsetReader reader(&file, sigset.name, ignoreMetadata);
+        return reader.readAll();
+    }
+
+    // Chunks after the first are wrapped in a signature set, so first check that the document is one
+    QXmlStreamReader root(QByteArray::fromRawData(mapped, (int) std::min(file.size(), qint64(64*1024))));
+    if (!root.readNextStartElement() || (root.name() != "biometric-signature-set")) {
+        file.unmap((uchar*) mapped);
+        return FileList();
+    }
+
+    const QList<qint64> boundaries = signatureBoundaries(mapped, file.size(), chunks);
+    QList< QFuture<FileList> > futures;
+    for (int i=0; i+1<boundaries.size(); i++) {
+        const SigsetChunk chunk = { mapped, boundaries[i], boundaries[i+1], file.size() };
+        futures.append(QtConcurrent::run(readSigsetChunk, chunk, sigset.name, ignoreMetadata));
+    }
+
+    FileList fileList;
+    for (int i=0; i<futures.size(); i++)
+        fileList.append(futures[i].result());
+    file.unmap((uchar*) mapped);
     return fileList;
 }
 
@@ -128,6 +252,170 @@ void writeSigset(const QString &sigset, const FileList &files, bool ignoreMetada
     QtUtils::writeFile(sigset, lines);
 }
 
+// The -FLT_MAX and FLT_MAX sentinels are out of half range, so they're stored as NaNs with a
+// payload that encoding a real NaN (0x7e00) never produces, leaving infinities and overflow as themselves
+static const quint16 halfLowest = 0xfc01, halfHighest = 0x7c01;
+
+static inline quint16 floatToHalf(float value)
+{
+    if (value == -std::numeric_limits<float>::max()) return halfLowest;
+    if (value ==  std::numeric_limits<float>::max()) return halfHighest;
+
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const quint16 sign = (bits >> 16) & 0x8000;
+    const int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    quint32 mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0); // Infinity and NaN
+    if (exponent >= 31) return sign | 0x7c00; // Overflow
+    if (exponent <= 0) {
+        // Subnormal or underflow
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        return sign | ((mantissa >> shift) + ((mantissa >> (shift - 1)) & 1));
+    }
+    // Rounding may carry into the exponent, which is still the correctly rounded result
+    return (sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+}
+
+static inline float halfToFloat(quint16 half)
+{
+    if (half == halfLowest) return -std::numeric_limits<float>::max();
+    if (half == halfHighest) return std::numeric_limits<float>::max();
+
+    const quint32 sign = quint32(half & 0x8000) << 16;
+    int exponent = (half >> 10) & 0x1f;
+    quint32 mantissa = half & 0x3ff;
+
+    quint32 bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa ? 0x400000 : 0); // Infinity and NaN
+    } else if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            exponent = 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | ((exponent + 127 - 15) << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+ScoreCodec::ScoreCodec(char matrixType, float low, float high)
+    : matrixType(matrixType), low(low), high(high)
+{
+    if (!isScoreType(matrixType))
+        qFatal("Invalid similarity matrix type %c.", matrixType);
+    if (((matrixType == 'S') || (matrixType == 'C')) && !(high > low))
+        qFatal("Quantized similarity matrices require high > low.");
+}
+
+ScoreCodec ScoreCodec::fromPrecision(const QString &precision, float low, float high)
+{
+    if      (precision == "Float") return ScoreCodec('F');
+    else if (precision == "Half")  return ScoreCodec('H');
+    else if (precision == "16Bit") return ScoreCodec('S', low, high);
+    else if (precision == "8Bit")  return ScoreCodec('C', low, high);
+    qFatal("Invalid precision %s, expected Float, Half, 16Bit or 8Bit.", qPrintable(precision));
+    return ScoreCodec();
+}
+
+bool ScoreCodec::isScoreType(char matrixType)
+{
+    return (matrixType == 'F') || (matrixType == 'H') || (matrixType == 'S') || (matrixType == 'C');
+}
+
+int ScoreCodec::elementSize() const
+{
+    switch (matrixType) {
+      case 'H':
+      case 'S': return 2;
+      case 'C': return 1;
+      default:  return sizeof(SimmatValue);
+    }
+}
+
+QString ScoreCodec::parameters() const
+{
+    if ((matrixType == 'S') || (matrixType == 'C'))
+        return QString::number(low, 'g', 9) + " " + QString::number(high, 'g', 9);
+    return QString();
+}
+
+void ScoreCodec::encode(const SimmatValue *src, uchar *dst, int n) const
+{
+    if (matrixType == 'F') {
+        memcpy(dst, src, n * sizeof(SimmatValue));
+    } else if (matrixType == 'H') {
+        quint16 *half = (quint16*) dst;
+        for (int i=0; i<n; i++)
+            half[i] = floatToHalf(src[i]);
+    } else {
+        const int levels = (matrixType == 'S') ? 0xffff : 0xff;
+        const float scale = (levels - 1) / (high - low);
+        for (int i=0; i<n; i++) {
+            int code = 0;
+            if ((src[i] == src[i]) && (src[i] != -std::numeric_limits<float>::max())) {
+                // Clamped as a float, converting infinities or scores far outside [low, high] to int is undefined
+                const float q = std::min(std::max((src[i] - low) * scale + 0.5f, 0.f), float(levels - 1));
+                code = 1 + int(q);
+            }
+            if (matrixType == 'S') ((quint16*) dst)[i] = code;
+            else                   dst[i] = code;
+        }
+    }
+}
+
+void ScoreCodec::decode(const uchar *src, SimmatValue *dst, int n) const
+{
+    if (matrixType == 'F') {
+        memcpy(dst, src, n * sizeof(SimmatValue));
+    } else if (matrixType == 'H') {
+        const quint16 *half = (const quint16*) src;
+        for (int i=0; i<n; i++)
+            dst[i] = halfToFloat(half[i]);
+    } else {
+        const int levels = (matrixType == 'S') ? 0xffff : 0xff;
+        const float step = (high - low) / (levels - 1);
+        for (int i=0; i<n; i++) {
+            const int code = (matrixType == 'S') ? int(((const quint16*) src)[i]) : int(src[i]);
+            dst[i] = (code == 0) ? -std::numeric_limits<float>::max() : low + (code - 1) * step;
+        }
+    }
+}
+
+// Expands rows of a matrix payload, where row i starts at payload + i*bytesPerRow
+struct RowDecoder
+{
+    ScoreCodec codec;
+    bool isReduced, isPacked;
+    qint64 bytesPerRow;
+
+    void decodeRow(const uchar *src, Mat &m, int i) const
+    {
+        if      (isReduced) codec.decode(src, m.ptr<SimmatValue>(i), m.cols);
+        else if (isPacked)  unpackMaskRow(src, m.ptr<MaskValue>(i), m.cols);
+        else                memcpy(m.ptr(i), src, bytesPerRow);
+    }
+
+    void decode(const uchar *payload, Mat m, int begin, int end) const
+    {
+        for (int i=begin; i<end; i++)
+            decodeRow(payload + i*bytesPerRow, m, i);
+    }
+};
+
 Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
 {
     QFile file(matrix);
@@ -147,10 +435,18 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
 
     // Get matrix size
     const QStringList words = QString(file.readLine()).split(" ");
+    if (words[0][1] == 'R') {
+        // Sparse matrices are expanded with -FLT_MAX for the scores that weren't kept
+        file.close();
+        return readSparseMatrix(matrix).toDense();
+    }
     const int rows = words[1].toInt();
     const int cols = words[2].toInt();
-    const bool isMask = words[0][1] == 'B';
+    const bool isPacked = words[0][1] == 'P';
+    const bool isMask = isPacked || (words[0][1] == 'B');
     const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    const char matrixType = words[0][1].toLatin1();
+    const bool isReduced = !isMask && (matrixType != 'F');
 
     // Get matrix data
     Mat m;
@@ -159,15 +455,42 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
     else
         m.create(rows, cols, OpenCVType<BEE::SimmatValue,1>::make());
 
-    const qint64 bytesPerRow = m.cols * typeSize;
-    for (int i=0; i<m.rows; i++) {
-        Mat aRow = m.row(i);
-        qint64 bytesRead = file.read((char *)aRow.data, bytesPerRow);
-        if (bytesRead != bytesPerRow)
-            qFatal("Didn't read complete row!");
+    RowDecoder decoder;
+    decoder.isReduced = isReduced;
+    decoder.isPacked = isPacked;
+    if (isReduced) {
+        // Reduced precision scores are expanded back to floats
+        decoder.codec = ScoreCodec(matrixType, words.value(3).toFloat(), words.value(4).toFloat());
+        decoder.bytesPerRow = qint64(cols) * decoder.codec.elementSize();
+    } else if (isPacked) {
+        // Packed masks are expanded back to one byte per comparison
+        decoder.bytesPerRow = packedMaskRowBytes(cols);
+    } else {
+        decoder.bytesPerRow = qint64(cols) * typeSize;
+    }
+
+    // Validate the header against the payload before reading it
+    const qint64 bytes = decoder.bytesPerRow * rows;
+    if (file.size() - file.pos() != bytes)
+        qFatal("Expected %lld bytes of matrix data in %s, found %lld.", bytes, qPrintable(matrix.name), file.size() - file.pos());
+
+    const uchar *payload = (bytes > 0) ? file.map(file.pos(), bytes) : NULL;
+    if (payload) {
+        // Rows are decoded from the mapping in parallel
+        const int threads = std::max(1, std::min(rows, QThreadPool::globalInstance()->maxThreadCount()));
+        const int step = (rows + threads - 1) / threads;
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<rows; i+=step)
+            futures.addFuture(QtConcurrent::run(&decoder, &RowDecoder::decode, payload, m, i, std::min(rows, i+step)));
+        futures.waitForFinished();
+    } else {
+        QByteArray row(decoder.bytesPerRow, 0);
+        for (int i=0; i<m.rows; i++) {
+            if (file.read(row.data(), decoder.bytesPerRow) != decoder.bytesPerRow)
+                qFatal("Didn't read complete row!");
+            decoder.decodeRow((const uchar*) row.constData(), m, i);
+        }
     }
-    if (!file.atEnd())
-        qFatal("Expected matrix end of file.");
     file.close();
 
     Mat result = m;
@@ -176,22 +499,46 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
     return result;
 }
 
-void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+MappedMatrix::MappedMatrix(const File &matrix)
+    : file(matrix.name)
 {
-    bool isMask = false;
-    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
-        isMask = true;
-    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
-        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
+    if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
 
-    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-    const QString matrixType = isMask ? "B" : "F";
+    const QByteArray format = file.readLine();
+    if (format[1] != '2') qFatal("Invalid matrix header.");
+    targetSigset = file.readLine().simplified();
+    querySigset = file.readLine().simplified();
+    const QStringList words = QString(file.readLine()).split(" ");
+    const int rows = words[1].toInt();
+    const int cols = words[2].toInt();
+    const bool isMask = words[0][1] == 'B';
+    const bool negate = (format[0] == 'D') ^ matrix.get<bool>("negate", false);
+
+    // Packed masks, reduced precision scores and matrices that need negating can't be used in place
+    if (negate || (!isMask && (words[0][1] != 'F'))) {
+        file.close();
+        m = readMatrix(matrix);
+        return;
+    }
 
+    const int type = isMask ? OpenCVType<MaskValue,1>::make() : OpenCVType<SimmatValue,1>::make();
+    const qint64 bytes = qint64(rows) * cols * (isMask ? sizeof(MaskValue) : sizeof(SimmatValue));
+    if (file.size() - file.pos() != bytes)
+        qFatal("Expected %lld bytes of matrix data in %s.", bytes, qPrintable(matrix.name));
+
+    uchar *data = (bytes > 0) ? file.map(file.pos(), bytes) : NULL;
+    if (data == NULL) {
+        if (bytes > 0) qWarning("Unable to map %s, reading it instead.", qPrintable(matrix.name));
+        file.close();
+        m = readMatrix(matrix);
+        return;
+    }
+    m = Mat(rows, cols, type, data);
+}
+
+static void writeHeader(QFile &file, const QString &matrixType, int rows, int cols, const QString &targetSigset, const QString &querySigset, const QString &parameters = QString())
+{
     char buff[4];
-    QFile file(fileName);
-    QtUtils::touchDir(file);
-    if (!file.open(QFile::WriteOnly))
-        qFatal("Unable to open %s for writing.", qPrintable(fileName));
     file.write("S2\n");
     file.write(qPrintable(targetSigset));
     file.write("\n");
@@ -200,18 +547,145 @@ void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSig
     file.write("M");
     file.write(qPrintable(matrixType));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(cols)));
     file.write(" ");
+    if (!parameters.isEmpty()) {
+        file.write(qPrintable(parameters));
+        file.write(" ");
+    }
     const int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
     file.write("\n");
+}
+
+void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+{
+    bool isMask = false;
+    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
+        isMask = true;
+    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
+        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
+
+    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    const QString matrixType = isMask ? "B" : "F";
+
+    QFile file(fileName);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(fileName));
+    writeHeader(file, matrixType, m.rows, m.cols, targetSigset, querySigset);
     file.write((const char*)m.data, m.rows*m.cols*elemSize);
     file.close();
 }
 
+void SparseMatrix::row(int row, SimmatValue *dst) const
+{
+    std::fill(dst, dst + cols, -std::numeric_limits<SimmatValue>::max());
+    for (qint64 i=rowPointers[row]; i<rowPointers[row+1]; i++)
+        dst[columns[i]] = values[i];
+}
+
+Mat SparseMatrix::toDense() const
+{
+    Mat m(rows, cols, OpenCVType<SimmatValue,1>::make());
+    for (int i=0; i<rows; i++)
+        row(i, m.ptr<SimmatValue>(i));
+    return m;
+}
+
+// Stored as matrix type 'R': the header line also gives the number of stored scores, followed by
+// rows+1 64-bit row offsets, 32-bit column indices and float scores
+SparseMatrix readSparseMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+{
+    QFile file(matrix);
+    if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
+
+    const QByteArray format = file.readLine();
+    if (format[1] != '2') qFatal("Invalid matrix header.");
+    if (targetSigset != NULL) *targetSigset = file.readLine().simplified();
+    else                      file.readLine();
+    if (querySigset != NULL) *querySigset = file.readLine().simplified();
+    else                     file.readLine();
+
+    const QStringList words = QString(file.readLine()).split(" ");
+    if (words[0][1] != 'R') qFatal("%s is not a sparse matrix.", qPrintable(matrix.name));
+    SparseMatrix m;
+    m.rows = words[1].toInt();
+    m.cols = words[2].toInt();
+    const qint64 count = words[3].toLongLong();
+
+    m.rowPointers.resize(m.rows + 1);
+    m.columns.resize(count);
+    m.values.resize(count);
+    const qint64 rowPointerBytes = sizeof(qint64) * qint64(m.rowPointers.size());
+    const qint64 columnBytes = sizeof(qint32) * count;
+    const qint64 valueBytes = sizeof(SimmatValue) * count;
+    if ((file.read((char*) m.rowPointers.data(), rowPointerBytes) != rowPointerBytes) ||
+        (file.read((char*) m.columns.data(), columnBytes) != columnBytes) ||
+        (file.read((char*) m.values.data(), valueBytes) != valueBytes))
+        qFatal("Didn't read complete sparse matrix!");
+    if (!file.atEnd())
+        qFatal("Expected matrix end of file.");
+
+    if ((format[0] == 'D') ^ matrix.get<bool>("negate", false))
+        for (qint64 i=0; i<count; i++)
+            m.values[i] = -m.values[i];
+    return m;
+}
+
+void writeSparseMatrix(const SparseMatrix &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+{
+    if ((m.rowPointers.size() != m.rows + 1) || (m.columns.size() != m.values.size()) || (m.rowPointers.last() != m.values.size()))
+        qFatal("Inconsistent sparse matrix.");
+
+    QFile file(fileName);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(fileName));
+    writeHeader(file, "R", m.rows, m.cols, targetSigset, querySigset, QString::number(m.values.size()));
+    file.write((const char*) m.rowPointers.constData(), sizeof(qint64) * qint64(m.rowPointers.size()));
+    file.write((const char*) m.columns.constData(), sizeof(qint32) * qint64(m.columns.size()));
+    file.write((const char*) m.values.constData(), sizeof(SimmatValue) * qint64(m.values.size()));
+    file.close();
+}
+
+MatrixWriter::MatrixWriter(const QString &fileName, int rows, int cols, const QString &targetSigset, const QString &querySigset)
+    : file(fileName), rows(rows), cols(cols), written(0)
+{
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(fileName));
+    writeHeader(file, "F", rows, cols, targetSigset, querySigset);
+}
+
+MatrixWriter::~MatrixWriter()
+{
+    if (written != rows)
+        qWarning("Only %d of %d rows written to %s.", written, rows, qPrintable(file.fileName()));
+    file.close();
+}
+
+void MatrixWriter::append(const Mat &block)
+{
+    if ((block.type() != OpenCVType<SimmatValue,1>::make()) || (block.cols != cols) || (written + block.rows > rows))
+        qFatal("Invalid block for %s.", qPrintable(file.fileName()));
+    for (int i=0; i<block.rows; i++) {
+        const qint64 bytes = sizeof(SimmatValue) * qint64(cols);
+        if (file.write((const char*) block.ptr(i), bytes) != bytes)
+            qFatal("Failed to write to %s.", qPrintable(file.fileName()));
+    }
+    written += block.rows;
+}
+
+static void writeMask(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset, bool packed)
+{
+    if (packed) writePackedMask(m, fileName, targetSigset, querySigset);
+    else        writeMatrix(m, fileName, targetSigset, querySigset);
+}
+
 void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
 {
     qDebug("Reading %s header.", qPrintable(matrix));
@@ -230,12 +704,14 @@ void makeMask(const QString &targetInput, const QString &queryInput, const QStri
     const FileList targets = TemplateList::fromGallery(targetInput).files();
     const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
     const int partitions = targets.first().get<int>("crossValidate");
+    const File maskFile(mask);
+    const bool packed = maskFile.get<bool>("packed", false);
     if (partitions == 0) {
-        writeMatrix(makeMask(targets, queries), mask, targetInput, queryInput);
+        writeMask(makeMask(targets, queries), maskFile.name, targetInput, queryInput, packed);
     } else {
-        if (!mask.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
+        if (!maskFile.name.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
         for (int i=0; i<partitions; i++) {
-            writeMatrix(makeMask(targets, queries, i), mask.arg(i), targetInput, queryInput);
+            writeMask(makeMask(targets, queries, i), maskFile.name.arg(i), targetInput, queryInput, packed);
         }
     }
 }
@@ -246,84 +722,159 @@ void makePairwiseMask(const QString &targetInput, const QString &queryInput, con
     const FileList targets = TemplateList::fromGallery(targetInput).files();
     const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
     const int partitions = targets.first().get<int>("crossValidate");
+    const File maskFile(mask);
+    const bool packed = maskFile.get<bool>("packed", false);
     if (partitions == 0) {
-        writeMatrix(makePairwiseMask(targets, queries), mask, targetInput, queryInput);
+        writeMask(makePairwiseMask(targets, queries), maskFile.name, targetInput, queryInput, packed);
     } else {
-        if (!mask.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
+        if (!maskFile.name.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
         for (int i=0; i<partitions; i++) {
-            writeMatrix(makePairwiseMask(targets, queries, i), mask.arg(i), targetInput, queryInput);
+            writeMask(makePairwiseMask(targets, queries, i), maskFile.name.arg(i), targetInput, queryInput, packed);
         }
     }
 }
 
 Mat makePairwiseMask(const FileList &targets, const FileList &queries, int partition)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
+    return ImplicitMask(targets, queries, partition, true).block(0, queries.size());
+}
 
-    Mat mask(queries.size(), 1, CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
+Mat makeMask(const FileList &targets, const FileList &queries, int partition)
+{
+    return ImplicitMask(targets, queries, partition).block(0, queries.size());
+}
 
-        const QString &fileB = targets[i];
-        const QString labelB = targetLabels[i];
-        const int partitionB = targetPartitions[i];
+// Map each distinct string to a dense integer so mask values reduce to integer comparisons
+static QVector<int> intern(const QStringList &strings, QHash<QString,int> &ids, const QString &missing = QString())
+{
+    QVector<int> result(strings.size());
+    for (int i=0; i<strings.size(); i++) {
+        if (!missing.isNull() && (strings[i] == missing)) {
+            result[i] = -1;
+            continue;
+        }
+        QHash<QString,int>::const_iterator it = ids.constFind(strings[i]);
+        if (it == ids.constEnd())
+            it = ids.insert(strings[i], ids.size());
+        result[i] = it.value();
+    }
+    return result;
+}
 
+ImplicitMask::ImplicitMask(const FileList &targets, const FileList &queries, int partition, bool pairwise)
+    : partition(partition), pairwise(pairwise)
+{
+    if (pairwise && (targets.size() != queries.size()))
+        qFatal("Pairwise mask requires equal length target and query sets.");
+
+    // TODO: Direct use of "Label" isn't general -cao
+    QHash<QString,int> labels, names;
+    targetLabels = intern(File::get<QString>(targets, "Label", "-1"), labels, "-1");
+    queryLabels = intern(File::get<QString>(queries, "Label", "-1"), labels, "-1");
+    targetNames = intern(targets.names(), names);
+    queryNames = intern(queries.names(), names);
+    targetPartitions = targets.crossValidationPartitions().toVector();
+    queryPartitions = queries.crossValidationPartitions().toVector();
+}
+
+MaskValue ImplicitMask::at(int row, int col) const
+{
+    const int j = pairwise ? row : col;
+    const int partitionB = targetPartitions[j];
+    if      (queryNames[row] == targetNames[j])   return DontCare;
+    else if (queryLabels[row] == -1)              return DontCare;
+    else if (targetLabels[j] == -1)               return DontCare;
+    else if (queryPartitions[row] != partition)   return DontCare;
+    else if (partitionB == -1)                    return NonMatch;
+    else if (partitionB != partition)             return DontCare;
+    else if (queryLabels[row] == targetLabels[j]) return Match;
+    else                                          return NonMatch;
+}
+
+void ImplicitMask::row(int row, MaskValue *dst) const
+{
+    if (pairwise) {
+        dst[0] = at(row, 0);
+        return;
+    }
+
+    const int labelA = queryLabels[row];
+    const int nameA = queryNames[row];
+    const int n = targetLabels.size();
+    if ((labelA == -1) || (queryPartitions[row] != partition)) {
+        memset(dst, DontCare, n * sizeof(MaskValue));
+        return;
+    }
+
+    const int *labelB = targetLabels.constData();
+    const int *nameB = targetNames.constData();
+    const int *partitionB = targetPartitions.constData();
+    for (int j=0; j<n; j++) {
         MaskValue val;
-        if      (fileA == fileB)           val = DontCare;
-        else if (labelA == "-1")           val = DontCare;
-        else if (labelB == "-1")           val = DontCare;
-        else if (partitionA != partition)  val = DontCare;
-        else if (partitionB == -1)         val = NonMatch;
-        else if (partitionB != partition)  val = DontCare;
-        else if (labelA == labelB)         val = Match;
-        else                               val = NonMatch;
-        mask.at<MaskValue>(i,0) = val;
+        if      (nameA == nameB[j])             val = DontCare;
+        else if (labelB[j] == -1)               val = DontCare;
+        else if (partitionB[j] == -1)           val = NonMatch;
+        else if (partitionB[j] != partition)    val = DontCare;
+        else if (labelA == labelB[j])           val = Match;
+        else                                    val = NonMatch;
+        dst[j] = val;
     }
+}
 
+Mat ImplicitMask::block(int begin, int count) const
+{
+    Mat mask(count, cols(), OpenCVType<MaskValue,1>::make());
+    for (int i=0; i<count; i++)
+        row(begin + i, mask.ptr<MaskValue>(i));
     return mask;
 }
 
-Mat makeMask(const FileList &targets, const FileList &queries, int partition)
+// Two bits per comparison, four comparisons per byte with the first in the low bits, each row padded to a whole byte
+static inline uchar packMaskValue(MaskValue val)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
+    return (val == Match) ? 2 : ((val == NonMatch) ? 1 : 0);
+}
 
-    Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
+static inline MaskValue unpackMaskValue(uchar code)
+{
+    static const MaskValue values[4] = { DontCare, NonMatch, Match, DontCare };
+    return values[code & 3];
+}
 
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
+int packedMaskRowBytes(int cols)
+{
+    return (cols + 3) / 4;
+}
 
-            MaskValue val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
-        }
-    }
+void packMaskRow(const MaskValue *src, uchar *dst, int cols)
+{
+    memset(dst, 0, packedMaskRowBytes(cols));
+    for (int j=0; j<cols; j++)
+        dst[j/4] |= packMaskValue(src[j]) << (2*(j%4));
+}
 
-    return mask;
+void unpackMaskRow(const uchar *src, MaskValue *dst, int cols)
+{
+    for (int j=0; j<cols; j++)
+        dst[j] = unpackMaskValue(src[j/4] >> (2*(j%4)));
+}
+
+void writePackedMask(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+{
+    if (m.type() != OpenCVType<MaskValue,1>::make())
+        qFatal("Packed masks can only be written from single channel uchar matrices.");
+
+    QFile file(fileName);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(fileName));
+    writeHeader(file, "P", m.rows, m.cols, targetSigset, querySigset);
+    QByteArray packedRow(packedMaskRowBytes(m.cols), 0);
+    for (int i=0; i<m.rows; i++) {
+        packMaskRow(m.ptr<MaskValue>(i), (uchar*) packedRow.data(), m.cols);
+        file.write(packedRow);
+    }
+    file.close();
 }
 
 void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method)
@@ -17,8 +17,10 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
 #include <QString>
 #include <QStringList>
+#include <QXmlStreamReader>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -33,14 +35,105 @@ namespace BEE
     const MaskValue NonMatch(0x7f);
     const MaskValue DontCare(0x00);
 
+    // Mask values computed on demand from interned labels, partitions and file names
+    class ImplicitMask
+    {
+        QVector<int> targetLabels, queryLabels, targetPartitions, queryPartitions, targetNames, queryNames;
+        int partition;
+        bool pairwise;
+
+    public:
+        ImplicitMask(const br::FileList &targets, const br::FileList &queries, int partition = 0, bool pairwise = false);
+        int rows() const { return queryLabels.size(); }
+        int cols() const { return pairwise ? 1 : targetLabels.size(); }
+        MaskValue at(int row, int col) const;
+        void row(int row, MaskValue *dst) const;
+        cv::Mat block(int begin, int count) const;
+    };
+
     // Sigset
+    // Streams the presentations of a sigset in document order without holding the document in memory
+    class SigsetReader
+    {
+        QXmlStreamReader xml;
+        QString sigset, label;
+        bool ignoreMetadata, started;
+
+    public:
+        SigsetReader(QIODevice *device, const QString &sigset, bool ignoreMetadata = false);
+        bool read(br::File &file); // The next presentation, false at the end of the sigset
+        br::FileList readAll();
+    };
+
+    // Large sigsets are mapped and parsed in parallel chunks split at signature boundaries
     br::FileList readSigset(const br::File &sigset, bool ignoreMetadata = false);
     void writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata = false);
 
+    // Reduced precision similarity scores, stored as matrix type 'H' (IEEE half) or linearly quantized
+    // between low and high as 'S' (16-bit) and 'C' (8-bit), with code zero reserved for -FLT_MAX and NaN
+    class ScoreCodec
+    {
+        char matrixType;
+        float low, high;
+
+    public:
+        ScoreCodec(char matrixType = 'F', float low = 0, float high = 1);
+        static ScoreCodec fromPrecision(const QString &precision, float low = 0, float high = 1);
+        static bool isScoreType(char matrixType);
+        char type() const { return matrixType; }
+        int elementSize() const;
+        QString parameters() const;
+        void encode(const SimmatValue *src, uchar *dst, int n) const;
+        void decode(const uchar *src, SimmatValue *dst, int n) const;
+    };
+
+    // Compressed sparse row similarity matrix, comparisons that aren't stored are -FLT_MAX
+    struct SparseMatrix
+    {
+        int rows, cols;
+        QVector<qint64> rowPointers; // rows+1 offsets into columns and values
+        QVector<qint32> columns;
+        QVector<SimmatValue> values;
+
+        SparseMatrix() : rows(0), cols(0) {}
+        cv::Mat toDense() const;
+        void row(int row, SimmatValue *dst) const;
+    };
+
     // Matrix
     cv::Mat readMatrix(const br::File &mat, QString *targetSigset = NULL, QString *querySigset = NULL);
     void writeMatrix(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+    // Writes a float similarity matrix a block of rows at a time
+    class MatrixWriter
+    {
+        QFile file;
+        int rows, cols, written;
+        Q_DISABLE_COPY(MatrixWriter)
+
+    public:
+        MatrixWriter(const QString &fileName, int rows, int cols, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+        ~MatrixWriter();
+        void append(const cv::Mat &block);
+    };
+
+    SparseMatrix readSparseMatrix(const br::File &mat, QString *targetSigset = NULL, QString *querySigset = NULL);
+    void writeSparseMatrix(const SparseMatrix &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
     void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
+
+    // Read-only similarity matrix backed by a memory mapping of the .mtx file where possible
+    class MappedMatrix
+    {
+        QFile file;
+        cv::Mat m;
+        QString targetSigset, querySigset;
+        Q_DISABLE_COPY(MappedMatrix)
+
+    public:
+        explicit MappedMatrix(const br::File &matrix);
+        const cv::Mat &matrix() const { return m; }
+        const QString &target() const { return targetSigset; }
+        const QString &query() const { return querySigset; }
+    };
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
 
     // Mask
@@ -48,6 +141,10 @@ namespace BEE
     cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makePairwiseMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
+    int packedMaskRowBytes(int cols);
+    void packMaskRow(const MaskValue *src, uchar *dst, int cols);
+    void unpackMaskRow(const uchar *src, MaskValue *dst, int cols);
+    void writePackedMask(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
     void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method);
 }
 
@@ -0,0 +1,246 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFutureSynchronizer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtConcurrentRun>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <openbr/openbr_plugin.h>
+#include "../plugins/openbr_internal.h"
+
+namespace br
+{
+
+// Peak resident set size of the process in bytes, or 0 if unknown
+static qint64 peakRSS()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss; // Bytes
+#else
+    return qint64(usage.ru_maxrss) * 1024; // Kilobytes
+#endif
+#endif
+}
+
+// Latency percentile in milliseconds from nanosecond samples
+static double percentile(QVector<qint64> samples, double p)
+{
+    if (samples.isEmpty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    const int index = std::min(samples.size()-1, int(p * samples.size()));
+    return samples[index] / 1e6;
+}
+
+static void timedProject(const Transform *transform, const Template *src, Template *dst, qint64 *elapsed)
+{
+    QElapsedTimer timer;
+    timer.start();
+    try {
+        transform->project(*src, *dst);
+    } catch (...) {
+        *dst = Template(src->file);
+        dst->file.fte = true;
+    }
+    *elapsed = timer.nsecsElapsed();
+}
+
+static QJsonObject benchmarkEnroll(const QSharedPointer<Transform> &transform, const TemplateList &input, TemplateList &enrolled)
+{
+    QVector<qint64> latencies(input.size());
+    enrolled = TemplateList();
+    for (int i=0; i<input.size(); i++)
+        enrolled.append(Template());
+
+    QElapsedTimer timer;
+    timer.start();
+    if (transform->timeVarying()) {
+        for (int i=0; i<input.size(); i++) {
+            QElapsedTimer latency;
+            latency.start();
+            transform->projectUpdate(input[i], enrolled[i]);
+            latencies[i] = latency.nsecsElapsed();
+        }
+    } else {
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<input.size(); i++)
+            futures.addFuture(QtConcurrent::run(timedProject, transform.data(), &input[i], &enrolled[i], &latencies[i]));
+        futures.waitForFinished();
+    }
+    const double seconds = timer.nsecsElapsed() / 1e9;
+
+    int failures = 0;
+    foreach (const Template &t, enrolled)
+        if (t.file.fte || t.isEmpty())
+            failures++;
+
+    QJsonObject result;
+    result["templates"] = input.size();
+    result["failures"] = failures;
+    result["seconds"] = seconds;
+    result["templatesPerSecond"] = seconds > 0 ? input.size() / seconds : 0.0;
+    result["p50Ms"] = percentile(latencies, 0.50);
+    result["p99Ms"] = percentile(latencies, 0.99);
+    return result;
+}
+
+static QJsonObject benchmarkCompare(const QSharedPointer<Distance> &distance, const TemplateList &targets, const TemplateList &queries)
+{
+    QScopedPointer<Output> output(Output::make("benchmark.null", targets.files(), queries.files()));
+
+    QElapsedTimer timer;
+    timer.start();
+    distance->compare(targets, queries, output.data());
+    const double seconds = timer.nsecsElapsed() / 1e9;
+    const double comparisons = double(targets.size()) * queries.size();
+
+    QJsonObject result;
+    result["targets"] = targets.size();
+    result["queries"] = queries.size();
+    result["seconds"] = seconds;
+    result["comparisonsPerSecond"] = seconds > 0 ? comparisons / seconds : 0.0;
+    return result;
+}
+
+static QJsonObject benchmarkSearch(const QSharedPointer<Distance> &distance, const TemplateList &targets, const TemplateList &queries, int k)
+{
+    QVector<qint64> latencies(queries.size());
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i=0; i<queries.size(); i++) {
+        QElapsedTimer latency;
+        latency.start();
+
+        TemplateList query;
+        query.append(queries[i]);
+        TopKOutput output;
+        output.k = k;
+        output.initialize(targets.files(), query.files());
+        distance->compare(targets, query, &output);
+        output.topK();
+
+        latencies[i] = latency.nsecsElapsed();
+    }
+    const double seconds = timer.nsecsElapsed() / 1e9;
+
+    QJsonObject result;
+    result["targets"] = targets.size();
+    result["queries"] = queries.size();
+    result["k"] = k;
+    result["seconds"] = seconds;
+    result["queriesPerSecond"] = seconds > 0 ? queries.size() / seconds : 0.0;
+    result["p50Ms"] = percentile(latencies, 0.50);
+    result["p99Ms"] = percentile(latencies, 0.99);
+    return result;
+}
+
+void Benchmark(const File &input, const File &output, const QList<int> &parallelisms)
+{
+    const QString algorithm = input.get<QString>("algorithm");
+    if (algorithm.isEmpty())
+        qFatal("No algorithm specified for benchmark.");
+
+    const TemplateList templates = TemplateList::fromGallery(input);
+    if (templates.isEmpty())
+        qFatal("Benchmark gallery %s is empty.", qPrintable(input.flat()));
+
+    QSharedPointer<Transform> transform = Transform::fromAlgorithm(algorithm);
+    QSharedPointer<Distance> distance = IsClassifier(algorithm) ? QSharedPointer<Distance>() : Distance::fromAlgorithm(algorithm);
+
+    const int originalParallelism = Globals->parallelism;
+    QList<int> levels = parallelisms;
+    if (levels.isEmpty())
+        levels.append(originalParallelism);
+
+    qDebug("Benchmarking %s on %d templates", qPrintable(algorithm), templates.size());
+
+    QJsonArray runs;
+    foreach (int parallelism, levels) {
+        Globals->setProperty("parallelism", QString::number(parallelism));
+
+        QJsonObject run;
+        run["parallelism"] = Globals->parallelism;
+
+        TemplateList enrolled;
+        run["enroll"] = benchmarkEnroll(transform, templates, enrolled);
+
+        if (distance) {
+            TemplateList valid;
+            foreach (const Template &t, enrolled)
+                if (!t.file.fte && !t.isEmpty())
+                    valid.append(t);
+
+            if (!valid.isEmpty()) {
+                // Replicate the enrolled templates to the requested gallery size
+                TemplateList targets;
+                const int targetCount = input.get<int>("targets", valid.size());
+                while (targets.size() < targetCount)
+                    targets.append(valid.mid(0, targetCount - targets.size()));
+                const TemplateList queries = valid.mid(0, input.get<int>("queries", std::min(valid.size(), 100)));
+
+                run["compare"] = benchmarkCompare(distance, targets, queries);
+                run["search"] = benchmarkSearch(distance, targets, queries, input.get<int>("k", 10));
+            }
+        }
+
+        run["peakRssBytes"] = double(peakRSS());
+        runs.append(run);
+    }
+
+    Globals->setProperty("parallelism", QString::number(originalParallelism));
+
+    QJsonObject report;
+    report["version"] = Context::version();
+    report["algorithm"] = algorithm;
+    report["gallery"] = input.flat();
+    report["templates"] = templates.size();
+    report["runs"] = runs;
+    const QByteArray json = QJsonDocument(report).toJson();
+
+    if (output.isNull()) {
+        printf("%s", json.constData());
+        fflush(stdout);
+    } else {
+        QFile file(output);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(file.fileName()));
+        file.write(json);
+    }
+}
+
+} // namespace br
@@ -0,0 +1,57 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFile>
+#include <QSaveFile>
+#include <QStringList>
+
+#include "checkpoint.h"
+
+using namespace br;
+
+QString Checkpoint::fileName(const QString &output)
+{
+    return output + ".ckpt";
+}
+
+// One line: completed bufferedSize rows columns
+bool Checkpoint::load(const QString &output)
+{
+    QFile file(fileName(output));
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    const QStringList words = QString(file.readLine()).simplified().split(' ');
+    if (words.size() != 4)
+        return false;
+
+    bool ok[4];
+    completed = words[0].toLongLong(&ok[0]);
+    bufferedSize = words[1].toInt(&ok[1]);
+    rows = words[2].toInt(&ok[2]);
+    columns = words[3].toInt(&ok[3]);
+    return ok[0] && ok[1] && ok[2] && ok[3] && (completed >= 0) && (bufferedSize > 0);
+}
+
+void Checkpoint::save(const QString &output) const
+{
+    QSaveFile file(fileName(output));
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
+    file.write(QString("%1 %2 %3 %4\n").arg(completed).arg(bufferedSize).arg(rows).arg(columns).toLatin1());
+    if (!file.commit())
+        qFatal("Failed to write %s.", qPrintable(file.fileName()));
+}
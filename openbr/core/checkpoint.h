@@ -0,0 +1,48 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_CHECKPOINT_H
+#define BR_CHECKPOINT_H
+
+#include <QString>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Progress of a br::Compare recorded beside its output, so an interrupted comparison can be resumed with Context::resume.
+// OutputTransform saves one every Context::checkpointInterval seconds, after the Output has made the completed blocks durable,
+// and removes it once the comparison finishes.
+struct BR_EXPORT Checkpoint
+{
+    qint64 completed; // Streamed templates whose scores are in the output
+    int bufferedSize; // Streamed templates per output block
+    int rows, columns; // Dimensions of the output
+
+    Checkpoint() : completed(0), bufferedSize(1), rows(0), columns(0) {}
+
+    static QString fileName(const QString &output);
+
+    // Returns false if there is no valid checkpoint for the output
+    bool load(const QString &output);
+
+    // Replaces the previous checkpoint atomically
+    void save(const QString &output) const;
+};
+
+} // namespace br
+
+#endif // BR_CHECKPOINT_H
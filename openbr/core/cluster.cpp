@@ -16,15 +16,22 @@
 
 #include <QDebug>
 #include <QFile>
+#include <QFileInfo>
+#include <QFutureSynchronizer>
 #include <QHash>
 #include <QPair>
 #include <QSet>
+#include <QtConcurrentRun>
+#include <QtEndian>
+#include <algorithm>
 #include <limits>
 #include <openbr/openbr_plugin.h>
 #include <assert.h>
+#include <string.h>
 
 #include "openbr/core/bee.h"
 #include "openbr/core/cluster.h"
+#include "openbr/core/hnsw.h"
 #include "openbr/plugins/openbr_internal.h"
 
 using namespace br;
@@ -37,29 +44,51 @@ bool br::compareNeighbors(const Neighbor &a, const Neighbor &b)
     return a.second > b.second;
 }
 
+// Bounded min-heap of the best neighbors seen so far, the worst kept neighbor is at the front
+void br::insertNeighbor(Neighbors &heap, const Neighbor &neighbor, int capacity)
+{
+    if (heap.size() < capacity) {
+        heap.append(neighbor);
+        std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+    } else if (!heap.isEmpty() && compareNeighbors(neighbor, heap.front())) { // A capacity of zero keeps nothing
+        std::pop_heap(heap.begin(), heap.end(), compareNeighbors);
+        heap.back() = neighbor;
+        std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+    }
+}
+
+// Position of each neighbor in a list of neighbors, so lookups don't scan the list
+typedef QHash<int,int> NeighborIndex;
+
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 // Ob(x) in eq. 1, modified to consider 0/1 as ground truth imposter/genuine.
-static int indexOf(const Neighbors &neighbors, int i)
+static NeighborIndex makeNeighborIndex(const Neighbors &neighbors)
 {
-    for (int j=0; j<neighbors.size(); j++) {
+    NeighborIndex index;
+    index.reserve(neighbors.size());
+    // Visited in reverse so the first occurrence of a neighbor is the one kept
+    for (int j=neighbors.size()-1; j>=0; j--) {
         const Neighbor &neighbor = neighbors[j];
-        if (neighbor.first == i) {
-            if      (neighbor.second == 0) return neighbors.size()-1;
-            else if (neighbor.second == 1) return 0;
-            else                           return j;
-        }
+        if      (neighbor.second == 0) index.insert(neighbor.first, neighbors.size()-1);
+        else if (neighbor.second == 1) index.insert(neighbor.first, 0);
+        else                           index.insert(neighbor.first, j);
     }
-    return -1;
+    return index;
+}
+
+static inline int indexOf(const NeighborIndex &index, int i)
+{
+    return index.value(i, -1);
 }
 
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 // Corresponds to eq. 1, or D(a,b)
-static int asymmetricalROD(const Neighborhood &neighborhood, int a, int b)
+static int asymmetricalROD(const Neighborhood &neighborhood, const QVector<NeighborIndex> &indices, int a, int b)
 {
     int distance = 0;
     foreach (const Neighbor &neighbor, neighborhood[a]) {
         if (neighbor.first == b) break;
-        int index = indexOf(neighborhood[b], neighbor.first);
+        int index = indexOf(indices[b], neighbor.first);
         distance += (index == -1) ? neighborhood[b].size() : index;
     }
     return distance;
@@ -67,89 +96,284 @@ static int asymmetricalROD(const Neighborhood &neighborhood, int a, int b)
 
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 // Corresponds to eq. 2/4, or D-R(a,b)
-float normalizedROD(const Neighborhood &neighborhood, int a, int b)
+static float normalizedROD(const Neighborhood &neighborhood, const QVector<NeighborIndex> &indices, int a, int b)
 {
-    int indexA = indexOf(neighborhood[b], a);
-    int indexB = indexOf(neighborhood[a], b);
+    int indexA = indexOf(indices[b], a);
+    int indexB = indexOf(indices[a], b);
 
     // Default behaviors
     if ((indexA == -1) || (indexB == -1)) return std::numeric_limits<float>::max();
     if ((neighborhood[b][indexA].second == 1) || (neighborhood[a][indexB].second == 1)) return 0;
     if ((neighborhood[b][indexA].second == 0) || (neighborhood[a][indexB].second == 0)) return std::numeric_limits<float>::max();
 
-    int distanceA = asymmetricalROD(neighborhood, a, b);
-    int distanceB = asymmetricalROD(neighborhood, b, a);
+    int distanceA = asymmetricalROD(neighborhood, indices, a, b);
+    int distanceB = asymmetricalROD(neighborhood, indices, b, a);
     return 1.f * (distanceA + distanceB) / std::min(indexA+1, indexB+1);
 }
 
-Neighborhood br::knnFromSimmat(const QList<cv::Mat> &simmats, int k)
+// Rank-order distances only depend on the neighborhood, so they are computed in parallel before clusters are merged
+struct RankOrderJob
 {
-    Neighborhood neighborhood;
+    const Neighborhood *neighborhood;
+    QVector<NeighborIndex> *indices;
+    QVector< QVector<bool> > *similar; // Indexed by node, then position in the node's neighbors
+    float threshold;
+};
 
-    float globalMax = -std::numeric_limits<float>::max();
-    float globalMin = std::numeric_limits<float>::max();
-    int numGalleries = (int)sqrt((float)simmats.size());
-    if (numGalleries*numGalleries != simmats.size())
-        qFatal("Incorrect number of similarity matrices.");
+static void indexNeighbors(const RankOrderJob *job, int begin, int end)
+{
+    for (int i=begin; i<end; i++)
+        (*job->indices)[i] = makeNeighborIndex((*job->neighborhood)[i]);
+}
 
-    // Process each simmat
-    for (int i=0; i<numGalleries; i++) {
-        QVector<Neighbors> allNeighbors;
+static void measureNeighbors(const RankOrderJob *job, int begin, int end)
+{
+    for (int i=begin; i<end; i++) {
+        const Neighbors &neighbors = (*job->neighborhood)[i];
+        QVector<bool> &similar = (*job->similar)[i];
+        similar.resize(neighbors.size());
+        for (int j=0; j<neighbors.size(); j++)
+            similar[j] = normalizedROD(*job->neighborhood, *job->indices, i, neighbors[j].first) < job->threshold;
+    }
+}
 
-        int currentRows = -1;
-        int columnOffset = 0;
-        for (int j=0; j<numGalleries; j++) {
-            cv::Mat m = simmats[i * numGalleries + j];
-            if (j==0) {
-                currentRows = m.rows;
-                allNeighbors.resize(currentRows);
-            }
-            if (currentRows != m.rows) qFatal("Row count mismatch.");
-
-            // Get data row by row
-            for (int k=0; k<m.rows; k++) {
-                Neighbors &neighbors = allNeighbors[k];
-                neighbors.reserve(neighbors.size() + m.cols);
-                for (int l=0; l<m.cols; l++) {
-                    float val = m.at<float>(k,l);
-                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
-
-                    if (val != -std::numeric_limits<float>::max()
-                        && val != -std::numeric_limits<float>::infinity()
-                        && val != std::numeric_limits<float>::infinity()) {
-                        globalMax = std::max(globalMax, val);
-                        globalMin = std::min(globalMin, val);
-                    }
-                    neighbors.append(Neighbor(l+columnOffset, val));
+static void rankOrder(const RankOrderJob &job, void (*function)(const RankOrderJob*, int, int))
+{
+    const int n = job.neighborhood->size();
+    const int step = std::max(1, n / std::max(1, 4 * Globals->parallelism));
+    QFutureSynchronizer<void> futures;
+    for (int begin=0; begin<n; begin+=step) {
+        const int end = std::min(begin+step, n);
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(function, &job, begin, end));
+        else                      function(&job, begin, end);
+    }
+    futures.waitForFinished();
+}
+
+// Rows of one row of similarity matrices to find the neighbors of
+struct KNNJob
+{
+    const QList<cv::Mat> *dense;
+    const QList<BEE::SparseMatrix> *sparse;
+    QVector<int> columnOffsets;
+    int numGalleries, gallery, k;
+    Neighbors *neighborhood; // First row of the gallery
+};
+
+static void knnRows(const KNNJob *job, int begin, int end)
+{
+    for (int r=begin; r<end; r++) {
+        Neighbors &heap = job->neighborhood[r];
+        heap.reserve(job->k);
+        for (int j=0; j<job->numGalleries; j++) {
+            const int columnOffset = job->columnOffsets[j];
+            const bool self = (job->gallery == j);
+            if (job->dense) {
+                const cv::Mat &m = (*job->dense)[job->gallery * job->numGalleries + j];
+                const float *row = m.ptr<float>(r);
+                for (int l=0; l<m.cols; l++)
+                    if (!self || (r != l)) // Skips self-similarity scores
+                        insertNeighbor(heap, Neighbor(l+columnOffset, row[l]), job->k);
+            } else {
+                // Sparse matrices only list the scores that were kept
+                const BEE::SparseMatrix &m = (*job->sparse)[job->gallery * job->numGalleries + j];
+                for (qint64 e=m.rowPointers[r]; e<m.rowPointers[r+1]; e++) {
+                    const int l = m.columns[e];
+                    if (!self || (r != l)) // Skips self-similarity scores
+                        insertNeighbor(heap, Neighbor(l+columnOffset, m.values[e]), job->k);
                 }
             }
+        }
+        std::sort_heap(heap.begin(), heap.end(), compareNeighbors);
+    }
+}
 
-            columnOffset += m.cols;
+// Each gallery's rows are searched in parallel chunks, only the k best neighbors of a row are ever kept
+static Neighborhood knn(const QList<cv::Mat> *dense, const QList<BEE::SparseMatrix> *sparse, int k)
+{
+    const int count = dense ? dense->size() : sparse->size();
+    int numGalleries = (int)sqrt((float)count);
+    if (numGalleries*numGalleries != count)
+        qFatal("Incorrect number of similarity matrices.");
+
+    KNNJob job;
+    job.dense = dense;
+    job.sparse = sparse;
+    job.numGalleries = numGalleries;
+    job.k = std::max(k, 0);
+    job.columnOffsets.resize(numGalleries);
+    for (int j=0, offset=0; j<numGalleries; j++) {
+        job.columnOffsets[j] = offset;
+        offset += dense ? (*dense)[j].cols : (*sparse)[j].cols;
+    }
+
+    int totalRows = 0;
+    QVector<int> rows(numGalleries);
+    for (int i=0; i<numGalleries; i++) {
+        rows[i] = dense ? (*dense)[i * numGalleries].rows : (*sparse)[i * numGalleries].rows;
+        for (int j=0; j<numGalleries; j++) {
+            const int index = i * numGalleries + j;
+            if (dense && ((*dense)[index].type() != CV_32FC1)) qFatal("Expected single channel floating point similarity matrices.");
+            if (rows[i] != (dense ? (*dense)[index].rows : (*sparse)[index].rows)) qFatal("Row count mismatch.");
+            if ((dense ? (*dense)[index].cols : (*sparse)[index].cols) != (dense ? (*dense)[j].cols : (*sparse)[j].cols)) qFatal("Column count mismatch.");
         }
+        totalRows += rows[i];
+    }
 
-        // Keep the top matches
-        for (int j=0; j<allNeighbors.size(); j++) {
-            Neighbors &val = allNeighbors[j];
-            const int cutoff = k; // Number of neighbors to keep
-            int keep = std::min(cutoff, val.size());
-            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
-            neighborhood.append((Neighbors)val.mid(0, keep));
+    Neighborhood neighborhood(totalRows);
+    for (int i=0, rowOffset=0; i<numGalleries; rowOffset += rows[i], i++) {
+        job.gallery = i;
+        job.neighborhood = neighborhood.data() + rowOffset;
+
+        const int step = std::max(1, rows[i] / std::max(1, 4 * Globals->parallelism));
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<rows[i]; begin+=step) {
+            const int end = std::min(begin+step, rows[i]);
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(knnRows, (const KNNJob*) &job, begin, end));
+            else                      knnRows(&job, begin, end);
         }
+        futures.waitForFinished();
     }
 
     return neighborhood;
 }
 
+Neighborhood br::knnFromSimmat(const QList<cv::Mat> &simmats, int k)
+{
+    return knn(&simmats, NULL, k);
+}
+
 // generate k-NN graph from pre-computed similarity matrices 
 Neighborhood br::knnFromSimmat(const QStringList &simmats, int k)
 {
+    // Sparse similarity matrices are used without expanding them
+    if (!simmats.isEmpty() && simmats.first().endsWith(".smtx")) {
+        QList<BEE::SparseMatrix> sparse;
+        foreach (const QString &simmat, simmats) {
+            if (!simmat.endsWith(".smtx")) qFatal("Can't mix sparse and dense similarity matrices.");
+            sparse.append(BEE::readSparseMatrix(simmat));
+        }
+        return knn(NULL, &sparse, k);
+    }
+
+    // BEE matrices are memory mapped so rows are paged in as they are searched
+    QList< QSharedPointer<BEE::MappedMatrix> > mapped;
     QList<cv::Mat> mats;
     foreach (const QString &simmat, simmats) {
-        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
-        br::Template t = format->read();
-        mats.append(t);
+        if (simmat.endsWith(".mtx")) {
+            mapped.append(QSharedPointer<BEE::MappedMatrix>(new BEE::MappedMatrix(simmat)));
+            mats.append(mapped.last()->matrix());
+        } else {
+            QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
+            br::Template t = format->read();
+            mats.append(t);
+        }
+    }
+    return knn(&mats, NULL, k);
+}
+
+// Templates to search the index for, and where to store their neighbors
+struct NeighborSearch
+{
+    const HNSWIndex *index;
+    const TemplateList *templates;
+    const QVector<int> *rows;
+    int k;
+    Neighborhood *neighborhood;
+};
+
+// The k most similar templates to each row in [begin, end), excluding the template itself
+static void searchRows(const NeighborSearch *search, int begin, int end)
+{
+    for (int r=begin; r<end; r++) {
+        const int i = search->rows->at(r);
+        Neighbors &neighbors = (*search->neighborhood)[i];
+        neighbors.clear();
+        foreach (const HNSWIndex::Match &match, search->index->search(search->templates->at(i), search->k+1))
+            if ((match.first != i) && (neighbors.size() < search->k))
+                neighbors.append(match);
+    }
+}
+
+static void searchNeighbors(const HNSWIndex &index, const TemplateList &templates, int k, const QVector<int> &rows, Neighborhood &neighborhood)
+{
+    NeighborSearch search;
+    search.index = &index;
+    search.templates = &templates;
+    search.rows = &rows;
+    search.k = k;
+    search.neighborhood = &neighborhood;
+
+    QFutureSynchronizer<void> futures;
+    const int step = std::max(1, rows.size() / std::max(1, 4 * Globals->parallelism));
+    for (int begin=0; begin<rows.size(); begin+=step) {
+        const int end = std::min(begin+step, rows.size());
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(searchRows, (const NeighborSearch*) &search, begin, end));
+        else                      searchRows(&search, begin, end);
+    }
+    futures.waitForFinished();
+}
+
+// Approximate k-NN graph from a graph index of the gallery, so each template is compared against a small fraction of the gallery.
+// Exact neighbors are computed for a sample of templates and the candidates examined per search is doubled until the sample reaches the recall target.
+static Neighborhood approximateKnnFromGallery(const QString &galleryName, int k, float recall)
+{
+    QScopedPointer<Gallery> gallery(Gallery::make(galleryName));
+    const TemplateList templates = gallery->read();
+    const int n = templates.size();
+
+    QSharedPointer<Distance> distance = Distance::fromAlgorithm(Globals->algorithm);
+    HNSWIndex index;
+    index.setDistance(distance.data());
+    foreach (const Template &t, templates)
+        index.insert(t);
+
+    // Ground truth for a sample of templates spread evenly through the gallery
+    QVector<int> sample;
+    const int sampleSize = std::min(n, 100);
+    for (int i=0; i<sampleSize; i++)
+        sample.append(int(qint64(i) * n / sampleSize));
+
+    Neighborhood exact(n);
+    for (int s=0; s<sample.size(); s++) {
+        const int i = sample[s];
+        if (templates[i].isEmpty() || templates[i].file.fte) continue;
+        const QList<float> scores = distance->compare(templates, templates[i]);
+        Neighbors &neighbors = exact[i];
+        for (int j=0; j<n; j++)
+            if ((j != i) && !templates[j].isEmpty() && !templates[j].file.fte)
+                insertNeighbor(neighbors, Neighbor(j, scores[j]), k);
+    }
+
+    int ef = std::max(2*k, 16);
+    Neighborhood neighborhood(n);
+    forever {
+        index.setEf(ef);
+        searchNeighbors(index, templates, k, sample, neighborhood);
+
+        qint64 found = 0, total = 0;
+        foreach (int i, sample) {
+            QSet<int> approximate;
+            foreach (const Neighbor &neighbor, neighborhood[i])
+                approximate.insert(neighbor.first);
+            foreach (const Neighbor &neighbor, exact[i])
+                if (approximate.contains(neighbor.first))
+                    found++;
+            total += exact[i].size();
+        }
+
+        const float sampleRecall = (total == 0) ? 1 : float(found) / total;
+        qDebug("Estimated k-NN recall %.3f examining %d candidates per search.", sampleRecall, ef);
+        if ((sampleRecall >= recall) || (ef >= n))
+            break;
+        ef = std::min(2*ef, n);
     }
-    return knnFromSimmat(mats, k);
+
+    QVector<int> rows(n);
+    for (int i=0; i<n; i++)
+        rows[i] = i;
+    searchNeighbors(index, templates, k, rows, neighborhood);
+    return neighborhood;
 }
 
 TemplateList knnFromGallery(const QString & galleryName, bool inMemory, const QString & outFile, int k)
@@ -160,6 +384,8 @@ TemplateList knnFromGallery(const QString & galleryName, bool inMemory, const QS
     qint64 total = tempG->totalSize();
     delete tempG;
     comparison->setPropertyRecursive("galleryName", galleryName+"[dropMetadata=true]");
+    // One extra neighbor since the template itself is among the nearest
+    comparison->setPropertyRecursive("nearest", k+1);
 
     bool multiProcess = Globals->file.getBool("multiProcess", false);
     if (multiProcess)
@@ -193,22 +419,24 @@ TemplateList knnFromGallery(const QString & galleryName, bool inMemory, const QS
  
 // Generate k-NN graph from a gallery, using the current algorithm for comparison.
 // Direct serialization to file system, k-NN graph is not retained in memory
-void br::knnFromGallery(const QString &galleryName, const QString &outFile, int k)
+void br::knnFromGallery(const QString &galleryName, const QString &outFile, int k, float recall)
 {
-    knnFromGallery(galleryName, false, outFile, k);
+    if (recall < 1) savekNN(approximateKnnFromGallery(galleryName, k, recall), outFile);
+    else            knnFromGallery(galleryName, false, outFile, k);
 }
 
 // In-memory graph construction
-Neighborhood br::knnFromGallery(const QString &gallery, int k)
+Neighborhood br::knnFromGallery(const QString &gallery, int k, float recall)
 {
+    if (recall < 1)
+        return approximateKnnFromGallery(gallery, k, recall);
+
     // Nearest neighbor data current stored as template metadata, so retrieve it
     TemplateList res = knnFromGallery(gallery, true, "", k);
 
     Neighborhood neighborhood;
-    foreach (const Template &t, res) {
-        Neighbors neighbors = t.file.get<Neighbors>("neighbors");
-        neighbors.append(neighbors);
-    }
+    foreach (const Template &t, res)
+        neighborhood.append(t.file.get<Neighbors>("neighbors"));
 
     return neighborhood;
 }
@@ -219,6 +447,28 @@ Neighborhood br::loadkNN(const QString &infile)
     QFile file(infile);
     bool success = file.open(QFile::ReadOnly);
     if (!success) qFatal("Failed to open %s for reading.", qPrintable(infile));
+    if (file.peek(4) == kNNHeader(true)) {
+        const QByteArray data = file.readAll();
+        file.close();
+
+        // Records are read in place, a truncated final record is dropped
+        qint64 offset = 4;
+        while (offset + 4 <= data.size()) {
+            const quint32 count = qFromLittleEndian<quint32>((const uchar*) data.constData() + offset);
+            offset += 4;
+            if (offset + qint64(count) * 8 > data.size()) break;
+            Neighbors neighbors; neighbors.reserve(count);
+            for (quint32 i=0; i<count; i++, offset+=8) {
+                const qint32 index = qFromLittleEndian<qint32>((const uchar*) data.constData() + offset);
+                const quint32 bits = qFromLittleEndian<quint32>((const uchar*) data.constData() + offset + 4);
+                float score;
+                memcpy(&score, &bits, sizeof(score));
+                neighbors.append(Neighbor(index, score));
+            }
+            neighborhood.append(neighbors);
+        }
+        return neighborhood;
+    }
     QStringList lines = QString(file.readAll()).split("\n");
     file.close();
     int min_idx = INT_MAX;
@@ -267,22 +517,52 @@ bool br::savekNN(const Neighborhood &neighborhood, const QString &outfile)
     bool success = file.open(QFile::WriteOnly);
     if (!success) qFatal("Failed to open %s for writing.", qPrintable(outfile));
 
-    foreach (Neighbors neighbors, neighborhood) {
-        QString aLine;
-        if (!neighbors.empty())
-        {
-            aLine.append(QString::number(neighbors[0].first)+":"+QString::number(neighbors[0].second));
-            for (int i=1; i < neighbors.size();i++) {
-                aLine.append(","+QString::number(neighbors[i].first)+":"+QString::number(neighbors[i].second));
-            }
-        }
-        aLine += "\n";
-        file.write(qPrintable(aLine));
-    }
+    const bool binary = isBinarykNN(outfile);
+    file.write(kNNHeader(binary));
+    foreach (const Neighbors &neighbors, neighborhood)
+        file.write(encodeNeighbors(neighbors, binary));
     file.close();
     return true;
 }
 
+bool br::isBinarykNN(const QString &fname)
+{
+    return QFileInfo(fname).suffix() == "bknn";
+}
+
+QByteArray br::kNNHeader(bool binary)
+{
+    return binary ? QByteArray("BKNN") : QByteArray();
+}
+
+QByteArray br::encodeNeighbors(const Neighbors &neighbors, bool binary)
+{
+    QByteArray record;
+    if (binary) {
+        record.resize(4 + 8*neighbors.size());
+        uchar *dst = (uchar*) record.data();
+        qToLittleEndian<quint32>(neighbors.size(), dst);
+        for (int i=0; i<neighbors.size(); i++) {
+            quint32 bits;
+            memcpy(&bits, &neighbors[i].second, sizeof(bits));
+            qToLittleEndian<qint32>(neighbors[i].first, dst + 4 + 8*i);
+            qToLittleEndian<quint32>(bits, dst + 8 + 8*i);
+        }
+        return record;
+    }
+
+    QString aLine;
+    if (!neighbors.empty())
+    {
+        aLine.append(QString::number(neighbors[0].first)+":"+QString::number(neighbors[0].second));
+        for (int i=1; i < neighbors.size();i++) {
+            aLine.append(","+QString::number(neighbors[i].first)+":"+QString::number(neighbors[i].second));
+        }
+    }
+    aLine += "\n";
+    return aLine.toLatin1();
+}
+
 
 // Rank-order clustering on a pre-computed k-NN graph
 Clusters br::ClusterGraph(Neighborhood neighborhood, float aggressiveness, const QString &csv)
@@ -298,46 +578,55 @@ Clusters br::ClusterGraph(Neighborhood neighborhood, float aggressiveness, const
 
     bool done = false;
     while (!done) {
+        QVector<NeighborIndex> indices(neighborhood.size());
+        QVector< QVector<bool> > similar(neighborhood.size());
+        RankOrderJob job;
+        job.neighborhood = &neighborhood;
+        job.indices = &indices;
+        job.similar = &similar;
+        job.threshold = threshold;
+        rankOrder(job, indexNeighbors);
+        rankOrder(job, measureNeighbors);
+
         // nextClusterIds[i] = j means that cluster i is set to merge into cluster j
         QVector<int> nextClusterIDs(neighborhood.size());
         for (int i=0; i<neighborhood.size(); i++) nextClusterIDs[i] = i;
 
-        // For each cluster
+        // For each cluster, in order since each merge depends on the merges before it
         for (int clusterID=0; clusterID<neighborhood.size(); clusterID++) {
             const Neighbors &neighbors = neighborhood[clusterID];
             int nextClusterID = nextClusterIDs[clusterID];
 
             // Check its neighbors
-            foreach (const Neighbor &neighbor, neighbors) {
-                int neighborID = neighbor.first;
+            for (int j=0; j<neighbors.size(); j++) {
+                int neighborID = neighbors[j].first;
                 int nextNeighborID = nextClusterIDs[neighborID];
 
                 // Don't bother if they have already merged
                 if (nextNeighborID == nextClusterID) continue;
 
                 // Flag for merge if similar enough
-                if (normalizedROD(neighborhood, clusterID, neighborID) < threshold) {
+                if (similar[clusterID][j]) {
                     if (nextClusterID < nextNeighborID) nextClusterIDs[neighborID] = nextClusterID;
                     else                                nextClusterIDs[clusterID] = nextNeighborID;
                 }
             }
         }
 
-        // Transitive merge
+        // Transitive merge, clusters only merge into lower IDs which have already been resolved
         for (int i=0; i<neighborhood.size(); i++) {
-            int nextClusterID = i;
-            while (nextClusterID != nextClusterIDs[nextClusterID]) {
-                assert(nextClusterIDs[nextClusterID] < nextClusterID);
-                nextClusterID = nextClusterIDs[nextClusterID];
-            }
-            nextClusterIDs[i] = nextClusterID;
+            assert(nextClusterIDs[i] <= i);
+            nextClusterIDs[i] = nextClusterIDs[nextClusterIDs[i]];
         }
 
         // Construct new clusters
         QHash<int, int> clusterIDLUT;
         QList<int> allClusterIDs = QSet<int>::fromList(nextClusterIDs.toList()).values();
+        QHash<int, int> allClusterIDIndex;
+        for (int i=0; i<allClusterIDs.size(); i++)
+            allClusterIDIndex.insert(allClusterIDs[i], i);
         for (int i=0; i<neighborhood.size(); i++)
-            clusterIDLUT[i] = allClusterIDs.indexOf(nextClusterIDs[i]);
+            clusterIDLUT[i] = allClusterIDIndex[nextClusterIDs[i]];
 
         Clusters newClusters(allClusterIDs.size());
         Neighborhood newNeighborhood(allClusterIDs.size());
@@ -389,45 +678,111 @@ br::Clusters br::ClusterSimmat(const QList<cv::Mat> &simmats, float aggressivene
 
 br::Clusters br::ClusterSimmat(const QStringList &simmats, float aggressiveness, const QString &csv)
 {
-    QList<cv::Mat> mats;
-    foreach (const QString &simmat, simmats) {
-        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
-        br::Template t = format->read();
-        mats.append(t);
+    // A gallery with a recall target is clustered from its approximate k-NN graph
+    if ((simmats.size() == 1) && File(simmats.first()).contains("recall")) {
+        const File gallery(simmats.first());
+        qDebug("Clustering %s, aggressiveness %f", qPrintable(gallery.name), aggressiveness);
+        Neighborhood neighborhood = knnFromGallery(gallery.name, gallery.get<int>("k", 20), gallery.get<float>("recall"));
+        return ClusterGraph(neighborhood, aggressiveness, csv);
     }
 
-    Clusters clusters = ClusterSimmat(mats, aggressiveness, csv);
-    return clusters;
+    qDebug("Clustering %d simmat(s), aggressiveness %f", simmats.size(), aggressiveness);
+
+    // Read in gallery parts, keeping top neighbors of each template
+    Neighborhood neighborhood = knnFromSimmat(simmats);
+
+    return ClusterGraph(neighborhood, aggressiveness, csv);
+}
+
+static inline qint64 pairs(qint64 n)
+{
+    return n * (n-1) / 2;
+}
+
+// Pairs within clusters [begin, end), and those of them that share an index
+static void countClusterPairs(const br::Clusters *clusters, const QVector<int> *indices, int begin, int end, QPair<qint64, qint64> *result)
+{
+    qint64 matches = 0, total = 0;
+    QHash<int, qint64> counts;
+    for (int c=begin; c<end; c++) {
+        const Cluster &cluster = (*clusters)[c];
+        counts.clear();
+        foreach (int member, cluster)
+            counts[(*indices)[member]]++;
+        foreach (qint64 count, counts)
+            matches += pairs(count);
+        total += pairs(cluster.size());
+    }
+    *result = QPair<qint64, qint64>(matches, total);
 }
 
 // Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
 // wI or wII metric (page 148)
 float wallaceMetric(const br::Clusters &clusters, const QVector<int> &indices)
 {
-    int matches = 0;
-    int total = 0;
-    foreach (const QList<int> &cluster, clusters) {
-        for (int i=0; i<cluster.size(); i++) {
-            for (int j=i+1; j<cluster.size(); j++) {
-                total++;
-                if (indices[cluster[i]] == indices[cluster[j]])
-                    matches++;
-            }
-        }
+    // Each cluster is a row of the contingency table against indices, so its matching pairs are counted from its intersections
+    const int step = std::max(1, clusters.size() / std::max(1, 4 * Globals->parallelism));
+    QVector< QPair<qint64, qint64> > results((clusters.size() + step - 1) / step);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<results.size(); i++) {
+        const int begin = i * step, end = std::min(begin + step, clusters.size());
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(countClusterPairs, &clusters, &indices, begin, end, &results[i]));
+        else                      countClusterPairs(&clusters, &indices, begin, end, &results[i]);
+    }
+    futures.waitForFinished();
+
+    qint64 matches = 0, total = 0;
+    foreach (const QPair<qint64, qint64> &result, results) {
+        matches += result.first;
+        total += result.second;
     }
     return (float)matches/(float)total;
 }
 
+// Element counts of each cluster of two clusterings and of each of their intersections
+struct ContingencyTable
+{
+    QHash<qint64, qint64> joint;
+    QHash<int, qint64> a, b;
+};
+
+static void countIntersections(const QVector<int> *indicesA, const QVector<int> *indicesB, int begin, int end, ContingencyTable *table)
+{
+    for (int i=begin; i<end; i++) {
+        const int a = (*indicesA)[i], b = (*indicesB)[i];
+        table->joint[(qint64(a) << 32) | quint32(b)]++;
+        table->a[a]++;
+        table->b[b]++;
+    }
+}
+
 // Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
-// Jaccard index (page 149)
+// Jaccard index (page 149), with pairs counted from the contingency table rather than enumerated
 float jaccardIndex(const QVector<int> &indicesA, const QVector<int> &indicesB)
 {
-    int a[2][2] = {{0,0},{0,0}};
-    for (int i=0; i<indicesA.size()-1; i++)
-        for (int j=i+1; j<indicesA.size(); j++)
-            a[indicesA[i] == indicesA[j] ? 1 : 0][indicesB[i] == indicesB[j] ? 1 : 0]++;
+    const int step = std::max(1, indicesA.size() / std::max(1, 4 * Globals->parallelism));
+    QVector<ContingencyTable> tables((indicesA.size() + step - 1) / step);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<tables.size(); i++) {
+        const int begin = i * step, end = std::min(begin + step, indicesA.size());
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(countIntersections, &indicesA, &indicesB, begin, end, &tables[i]));
+        else                      countIntersections(&indicesA, &indicesB, begin, end, &tables[i]);
+    }
+    futures.waitForFinished();
+
+    ContingencyTable table;
+    foreach (const ContingencyTable &partial, tables) {
+        for (QHash<qint64, qint64>::const_iterator it = partial.joint.begin(); it != partial.joint.end(); ++it) table.joint[it.key()] += it.value();
+        for (QHash<int, qint64>::const_iterator it = partial.a.begin(); it != partial.a.end(); ++it) table.a[it.key()] += it.value();
+        for (QHash<int, qint64>::const_iterator it = partial.b.begin(); it != partial.b.end(); ++it) table.b[it.key()] += it.value();
+    }
 
-    return float(a[1][1]) / (a[0][1] + a[1][0] + a[1][1]);
+    // a11 pairs share both clusters, a10 and a01 only the cluster of A or B respectively
+    qint64 a11 = 0, sameA = 0, sameB = 0;
+    foreach (qint64 count, table.joint) a11 += pairs(count);
+    foreach (qint64 count, table.a) sameA += pairs(count);
+    foreach (qint64 count, table.b) sameB += pairs(count);
+    return float(a11) / (sameA + sameB - a11);
 }
 
 // Evaluates clustering algorithms based on metrics described in
@@ -34,19 +34,28 @@ namespace br
     Neighborhood knnFromSimmat(const QList<cv::Mat> &simmats, int k = 20);
  
     // Generate k-NN graph from a gallery, using the current algorithm for comparison.
+    // A recall below one searches a graph index of the gallery instead of comparing every pair,
+    // examining enough candidates for a sample of the neighbors found to reach the target recall.
     // direct serialization to file system.
-    void  knnFromGallery(const QString &galleryName, const QString & outFile, int k = 20);
+    void  knnFromGallery(const QString &galleryName, const QString & outFile, int k = 20, float recall = 1);
     // in memory graph computation
-    Neighborhood knnFromGallery(const QString &gallery, int k = 20);
+    Neighborhood knnFromGallery(const QString &gallery, int k = 20, float recall = 1);
 
     // Load k-NN graph from a file with the following ascii format:
     // One line per sample, each line lists the top k neighbors for the sample as follows:
     // index1:score1,index2:score2,...,indexk:scorek
+    // Binary files, identified by their leading "BKNN", are also accepted.
     Neighborhood loadkNN(const QString &fname);
 
-    // Save k-NN graph to file
+    // Save k-NN graph to file, in the binary format when the suffix is .bknn
     bool savekNN(const Neighborhood &neighborhood, const QString &outfile);
 
+    // The binary k-NN graph layout is the four bytes "BKNN" followed by one record per sample,
+    // a 32-bit neighbor count and then each neighbor's 32-bit index and 32-bit float score, little endian.
+    bool isBinarykNN(const QString &fname); // True for the .bknn suffix
+    QByteArray kNNHeader(bool binary);
+    QByteArray encodeNeighbors(const Neighbors &neighbors, bool binary); // One record or line
+
     // Rank-order clustering on a pre-computed k-NN graph
     Clusters ClusterGraph(Neighborhood neighbors, float aggresssiveness, const QString &csv = "");
     Clusters ClusterGraph(const QString & knnName, float aggressiveness, const QString &csv = "");
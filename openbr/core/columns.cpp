@@ -0,0 +1,110 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "columns.h"
+
+namespace br
+{
+
+MetadataColumns::MetadataColumns(const TemplateList &templates, const QStringList &keys)
+    : rows(templates.size())
+{
+    foreach (const QString &key, keys) {
+        Column &column = columns[key];
+        column.codes.reserve(rows);
+        QHash<QString, qint32> codes; // Keyed by type and value so types round trip through the dictionary
+
+        foreach (const Template &t, templates) {
+            if (!t.file.contains(key)) {
+                column.codes.append(-1);
+                continue;
+            }
+
+            QVariant variant = t.file.value(key);
+            if (!variant.canConvert<QString>())
+                variant = QVariant();
+            const QString string = variant.isValid() ? variant.value<QString>() : QString("");
+            const QString code = QString::number(variant.userType()) + QChar(0) + string;
+
+            QHash<QString, qint32>::const_iterator it = codes.constFind(code);
+            if (it == codes.constEnd()) {
+                it = codes.insert(code, column.dictionary.size());
+                column.dictionary.append(variant);
+                column.strings.append(string);
+            }
+            column.codes.append(it.value());
+        }
+    }
+}
+
+QStringList MetadataColumns::values(const QString &key) const
+{
+    return columns.value(key).strings;
+}
+
+QBitArray MetadataColumns::select(const QString &key, const QVector<bool> &selected, bool absent) const
+{
+    QBitArray bits(rows, absent);
+    QHash<QString, Column>::const_iterator it = columns.constFind(key);
+    if (it == columns.constEnd())
+        return bits;
+
+    const qint32 *codes = it->codes.constData();
+    for (int i=0; i<rows; i++)
+        if (codes[i] >= 0)
+            bits.setBit(i, selected[codes[i]]);
+    return bits;
+}
+
+QBitArray MetadataColumns::contains(const QString &key) const
+{
+    return select(key, QVector<bool>(values(key).size(), true));
+}
+
+QVariant MetadataColumns::value(const QString &key, int row) const
+{
+    QHash<QString, Column>::const_iterator it = columns.constFind(key);
+    if (it == columns.constEnd() || it->codes[row] < 0)
+        return QVariant();
+    return it->dictionary[it->codes[row]];
+}
+
+QDataStream &operator<<(QDataStream &stream, const MetadataColumns &columns)
+{
+    stream << qint32(columns.rows) << qint32(columns.columns.size());
+    for (QHash<QString, MetadataColumns::Column>::const_iterator it = columns.columns.constBegin(); it != columns.columns.constEnd(); ++it)
+        stream << it.key() << it->dictionary << it->codes;
+    return stream;
+}
+
+QDataStream &operator>>(QDataStream &stream, MetadataColumns &columns)
+{
+    qint32 rows, size;
+    stream >> rows >> size;
+    columns.rows = rows;
+    columns.columns.clear();
+    for (qint32 i=0; i<size; i++) {
+        QString key;
+        MetadataColumns::Column column;
+        stream >> key >> column.dictionary >> column.codes;
+        foreach (const QVariant &variant, column.dictionary)
+            column.strings.append(variant.isValid() ? variant.value<QString>() : QString(""));
+        columns.columns.insert(key, column);
+    }
+    return stream;
+}
+
+} // namespace br
@@ -0,0 +1,74 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_COLUMNS_H
+#define BR_COLUMNS_H
+
+#include <QBitArray>
+#include <QDataStream>
+#include <QHash>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Metadata of a br::TemplateList stored column-wise, one dictionary encoded column per key,
+// so filters are evaluated once per distinct value and applied to every row as a bitmap.
+class BR_EXPORT MetadataColumns
+{
+public:
+    MetadataColumns() : rows(0) {}
+    MetadataColumns(const TemplateList &templates, const QStringList &keys);
+
+    int size() const { return rows; }
+    QStringList keys() const { return columns.keys(); }
+
+    // Distinct values of a column as returned by br::File::get<QString>(), values that can't be converted are empty
+    QStringList values(const QString &key) const;
+
+    // Rows whose value was selected by index in values(), rows without the key are set to absent
+    QBitArray select(const QString &key, const QVector<bool> &selected, bool absent = false) const;
+
+    // Rows with the key
+    QBitArray contains(const QString &key) const;
+
+    // The original value of a row, invalid if the row doesn't have the key
+    QVariant value(const QString &key, int row) const;
+
+    friend BR_EXPORT QDataStream &operator<<(QDataStream &stream, const MetadataColumns &columns);
+    friend BR_EXPORT QDataStream &operator>>(QDataStream &stream, MetadataColumns &columns);
+
+private:
+    struct Column
+    {
+        QVariantList dictionary; // Values that can't be converted to a string share one invalid entry
+        QStringList strings;
+        QVector<qint32> codes; // -1 for rows without the key
+    };
+
+    int rows;
+    QHash<QString, Column> columns;
+};
+
+BR_EXPORT QDataStream &operator<<(QDataStream &stream, const MetadataColumns &columns);
+BR_EXPORT QDataStream &operator>>(QDataStream &stream, MetadataColumns &columns);
+
+} // namespace br
+
+#endif // BR_COLUMNS_H
@@ -42,6 +42,32 @@ double Common::randN()
     return g_rand.FloatN();
 }
 
+QList<float> Common::BinnedKernelDensity(const QVector<double> &counts, double min, double max, double n, double h)
+{
+    QList<float> density; density.reserve(counts.size());
+    if (counts.isEmpty() || (n <= 0) || (h <= 0)) {
+        for (int i=0; i<counts.size(); i++)
+            density.append(0);
+        return density;
+    }
+
+    const double delta = (counts.size() > 1) ? (max - min) / (counts.size() - 1) : 0;
+    const int radius = (delta > 0) ? std::min(counts.size() - 1, int(ceil(4 * h / delta))) : 0;
+    QVector<double> kernel(radius + 1);
+    for (int j=0; j<=radius; j++)
+        kernel[j] = exp(-pow(j*delta/h, 2)/2)/sqrt(2*3.1415926353898);
+
+    for (int i=0; i<counts.size(); i++) {
+        double y = counts[i] * kernel[0];
+        for (int j=1; j<=radius; j++) {
+            if (i-j >= 0)            y += counts[i-j] * kernel[j];
+            if (i+j < counts.size()) y += counts[i+j] * kernel[j];
+        }
+        density.append(y / (n * h));
+    }
+    return density;
+}
+
 QList<int> Common::RandSample(int n, int max, int min, bool unique)
 {
     QList<int> samples; samples.reserve(n);
@@ -53,11 +79,23 @@ QList<int> Common::RandSample(int n, int max, int min, bool unique)
         return samples;
     }
 
-    while (samples.size() < n) {
-        const int sample = (rand() % range) + min;
-        if (unique && samples.contains(sample)) continue;
-        samples.append(sample);
+    if (unique) {
+        // Floyd's algorithm, one draw per sample instead of retrying duplicates
+        QSet<int> chosen; chosen.reserve(n);
+        for (int j=range-n; j<range; j++) {
+            const int t = rand() % (j+1);
+            const int sample = chosen.contains(t) ? j : t;
+            chosen.insert(sample);
+            samples.append(sample + min);
+        }
+        // Floyd's algorithm places late draws (j) toward the end, shuffle so the order is uniform too
+        for (int i=samples.size()-1; i>0; i--)
+            samples.swap(i, rand() % (i+1));
+        return samples;
     }
+
+    while (samples.size() < n)
+        samples.append((rand() % range) + min);
     return samples;
 }
 
@@ -70,7 +108,11 @@ QList<int> Common::RandSample(int n, const QSet<int> &values, bool unique)
     while (samples.size() < n) {
         const int randIndex = rand() % valueList.size();
         samples.append(valueList[randIndex]);
-        if (unique) valueList.removeAt(randIndex);
+        if (unique) {
+            // Order doesn't matter, so the last value fills the gap
+            valueList[randIndex] = valueList.last();
+            valueList.removeLast();
+        }
     }
     return samples;
 }
@@ -22,6 +22,7 @@
 #include <QMap>
 #include <QPair>
 #include <QSet>
+#include <QVector>
 #include <QtAlgorithms>
 #include <algorithm>
 #include <functional>
@@ -46,27 +47,41 @@ int round(T r)
 }
 
 /*!
- * \brief Returns a list of pairs sorted by value where:
+ * \brief Returns the \em n leading pairs of \em size values sorted by value where:
  *        pair.first = original value
  *        pair.second = original index
+ *
+ * Ranks the values in contiguous storage, and when \em n is smaller than \em size selects the leading pairs before sorting only them.
  */
 template <typename T>
-QList< QPair<T,int> > Sort(const QList<T> &vals, bool decending = false, int n = std::numeric_limits<int>::max())
+QList< QPair<T,int> > Sort(const T *vals, int size, bool decending = false, int n = std::numeric_limits<int>::max())
 {
-    const int size = vals.size();
-    QList< QPair<T,int> > pairs; pairs.reserve(size);
-    for (int i=0; i<size; i++) pairs.append(QPair<T,int>(vals[i], i));
-
-    if (n >= pairs.size()) {
-        if (decending) std::sort(pairs.begin(), pairs.end(), std::greater< QPair<T,int> >());
-        else           std::sort(pairs.begin(), pairs.end(), std::less< QPair<T,int> >());
-    } else {
-        if (decending) std::partial_sort(pairs.begin(), pairs.begin()+n, pairs.end(), std::greater< QPair<T,int> >());
-        else           std::partial_sort(pairs.begin(), pairs.begin()+n, pairs.end(), std::less< QPair<T,int> >());
-        pairs = pairs.mid(0, n);
+    std::vector< std::pair<T,int> > pairs(size);
+    for (int i=0; i<size; i++) pairs[i] = std::pair<T,int>(vals[i], i);
+
+    n = std::max(0, std::min(n, size));
+    if (n < size) {
+        if (decending) std::nth_element(pairs.begin(), pairs.begin()+n, pairs.end(), std::greater< std::pair<T,int> >());
+        else           std::nth_element(pairs.begin(), pairs.begin()+n, pairs.end(), std::less< std::pair<T,int> >());
     }
+    if (decending) std::sort(pairs.begin(), pairs.begin()+n, std::greater< std::pair<T,int> >());
+    else           std::sort(pairs.begin(), pairs.begin()+n, std::less< std::pair<T,int> >());
+
+    QList< QPair<T,int> > sorted; sorted.reserve(n);
+    for (int i=0; i<n; i++) sorted.append(QPair<T,int>(pairs[i].first, pairs[i].second));
+    return sorted;
+}
 
-    return pairs;
+/*!
+ * \brief Returns a list of pairs sorted by value where:
+ *        pair.first = original value
+ *        pair.second = original index
+ */
+template <typename T>
+QList< QPair<T,int> > Sort(const QList<T> &vals, bool decending = false, int n = std::numeric_limits<int>::max())
+{
+    const std::vector<T> values(vals.begin(), vals.end());
+    return Sort(values.empty() ? NULL : &values[0], int(values.size()), decending, n);
 }
 
 /*!
@@ -220,6 +235,34 @@ double KernelDensityEstimation(const V<T> &vals, double x, double h)
     return y / (vals.size() * h);
 }
 
+/*!
+ * \brief Linearly bin values onto \em counts, which are evenly spaced points over [min, max].
+ *
+ * Each value is split between its two nearest points in proportion to its distance from them, values outside the range go to the nearest end point.
+ */
+template <template<class> class V, typename T>
+void LinearBin(const V<T> &vals, double min, double max, QVector<double> &counts)
+{
+    const int last = counts.size() - 1;
+    if (last < 0) return;
+    const double scale = (max > min) ? last / (max - min) : 0;
+    foreach (T val, vals) {
+        const double x = std::min(std::max((val - min) * scale, 0.0), double(last));
+        const int i = std::min(int(x), std::max(last - 1, 0));
+        const double w = std::min(x - i, 1.0);
+        counts[i] += 1 - w;
+        if (i < last) counts[i+1] += w;
+    }
+}
+
+/*!
+ * \brief Approximate kernel density at the points of linearly binned \em counts of \em n values, with bandwidth h.
+ *
+ * Equivalent to KernelDensityEstimation() at each point, convolving the counts with the Gaussian kernel truncated at four bandwidths,
+ * so the cost depends on the number of points rather than the number of values.
+ */
+QList<float> BinnedKernelDensity(const QVector<double> &counts, double min, double max, double n, double h);
+
 // Return a random number, uniformly distributed over 0,1
 double randN();
 
@@ -227,7 +270,7 @@ double randN();
  * \brief Returns a vector of n integers sampled in the range <min, max].
  *
  * If unique then there will be no repeated integers.
- * \note Algorithm is inefficient for unique vectors where n ~= max-min.
+ * If unique, samples are drawn with Floyd's algorithm in a single draw each.
  */
 void seedRNG();
 QList<int> RandSample(int n, int max, int min = 0, bool unique = false);
@@ -14,15 +14,43 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QQueue>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtConcurrentRun>
+#include <string.h>
 #include <openbr/openbr_plugin.h>
+#ifdef BR_DISTRIBUTED
+#include <mpi.h>
+#endif // BR_DISTRIBUTED
 
 #include "bee.h"
+#include "checkpoint.h"
 #include "common.h"
+#include "hnsw.h"
+#include "ivf.h"
+#include "memory.h"
+#include "opencvutils.h"
+#include "profiler.h"
 #include "qtutils.h"
+#include "templatecodec.h"
 #include "../plugins/openbr_internal.h"
 
 namespace br {
 
+static const MemoryAccount trainingMemory("Training data");
+
+// Assumed memory held by each image while it is decoded and enrolled, used to size streams under Context::memoryLimit
+static const qint64 enrollmentFrameBytes = qint64(32) << 20;
+
+// Frames a stream may hold at once when each costs bytesPerFrame beside the reserved bytes, 100 without a memory limit
+static int budgetedFrames(qint64 bytesPerFrame, qint64 reserved)
+{
+    return std::max(1, std::min(Globals->blockSize, Globals->budgetedBlock(bytesPerFrame, reserved, 100)));
+}
+
 void noDelete(Transform *target)
 {
     (void) target;
@@ -42,6 +70,7 @@ struct AlgorithmCore
     QSharedPointer<Transform> comparison;
     QSharedPointer<Distance> distance;
     QSharedPointer<Transform> progressCounter;
+    QSharedPointer<QFile> mappedModel;
 
     AlgorithmCore(const QString &name)
     {
@@ -67,6 +96,21 @@ struct AlgorithmCore
                model.isEmpty() ? "" : qPrintable(" to " + model));
 
         QScopedPointer<Transform> trainingWrapper(br::wrapTransform(transform.data(), "Stream(readMode=DistributeFrames)"));
+        if (Globals->streamTraining) trainStreamed(trainingWrapper.data(), input);
+        else                         trainInMemory(trainingWrapper.data(), input);
+
+        if (!model.isEmpty()) {
+            qDebug("Storing %s", qPrintable(QFileInfo(model).fileName()));
+            store(model);
+        }
+
+        qDebug("Training Time: %s", qPrintable(QtUtils::toTime(Globals->startTime.elapsed()/1000.0f)));
+
+        simplifyTransform();
+    }
+
+    void trainInMemory(Transform *trainingWrapper, const File &input)
+    {
         TemplateList data(TemplateList::fromGallery(input));
 
         if (Globals->crossValidate > 1)
@@ -77,6 +121,9 @@ struct AlgorithmCore
         if (transform.isNull()) qFatal("Null transform.");
         qDebug("%d Training Files", data.size());
 
+        const qint64 loaded = data.bytes<qint64>();
+        trainingMemory.allocated(loaded);
+
         Globals->startTime.start();
 
         qDebug("Training Enrollment");
@@ -91,20 +138,49 @@ struct AlgorithmCore
                 if (!data[i].file.fte && !data[i].file.getBool("FTE"))
                     distanceData.append(data[i]);
 
+            const qint64 projected = distanceData.bytes<qint64>();
+            trainingMemory.allocated(projected);
             data.clear();
+            trainingMemory.freed(loaded);
 
             qDebug("Training Comparison");
             distance->train(distanceData);
+            trainingMemory.freed(projected);
+        } else {
+            trainingMemory.freed(loaded);
         }
+    }
 
-        if (!model.isEmpty()) {
-            qDebug("Storing %s", qPrintable(QFileInfo(model).fileName()));
-            store(model);
-        }
+    // Only the blocks in flight and, for a trainable distance, the projected templates are held in memory
+    void trainStreamed(Transform *trainingWrapper, const File &input)
+    {
+        if (transform.isNull()) qFatal("Null transform.");
+        TemplateIterator data(input);
 
-        qDebug("Training Time: %s", qPrintable(QtUtils::toTime(Globals->startTime.elapsed()/1000.0f)));
+        Globals->startTime.start();
 
-        simplifyTransform();
+        qDebug("Training Enrollment");
+        trainingWrapper->train(data);
+
+        if (!distance.isNull() && distance->trainable()) {
+            qDebug("Projecting Enrollment");
+            TemplateList distanceData, block;
+            data.rewind();
+            qint64 projected = 0;
+            while (data.next(block)) {
+                trainingWrapper->projectUpdate(block, block);
+                for (int i=0; i<block.size(); i++)
+                    if (!block[i].file.fte && !block[i].file.getBool("FTE")) {
+                        distanceData.append(block[i]);
+                        projected += block[i].bytes();
+                        trainingMemory.allocated(block[i].bytes());
+                    }
+            }
+
+            qDebug("Training Comparison");
+            distance->train(distanceData);
+            trainingMemory.freed(projected);
+        }
     }
 
     void simplifyTransform()
@@ -119,12 +195,22 @@ struct AlgorithmCore
 
     void store(const QString &model) const
     {
+        if (Globals->mappedModels) {
+            storeMapped(model);
+            return;
+        }
+
         QtUtils::BlockCompression compressedWrite;
         QFile outFile(model);
         compressedWrite.setBasis(&outFile);
         QDataStream out(&compressedWrite);
         compressedWrite.open(QFile::WriteOnly);
+        serialize(out);
+        compressedWrite.close();
+    }
 
+    void serialize(QDataStream &out) const
+    {
         // Serialize algorithm to stream
         transform->serialize(out);
 
@@ -141,8 +227,39 @@ struct AlgorithmCore
 
         if (mode == TransformCompare)
             comparison->serialize(out);
+    }
 
-        compressedWrite.close();
+    // Mapped models are an uncompressed container: a header, the serialized algorithm, then the large matrices
+    // each aligned to 64 bytes in a page aligned payload section, so they can be mapped instead of copied.
+    static const quint32 mappedModelVersion = 1;
+    static const int mappedModelHeaderBytes = 8 + 4 + 3*8;
+    static const char *mappedModelMagic() { return "BRMODEL"; } // Eight bytes with the terminator
+
+    void storeMapped(const QString &model) const
+    {
+        QByteArray algorithm;
+        OpenCVUtils::MatPayloadWriter payloads;
+        {
+            QDataStream out(&algorithm, QFile::WriteOnly);
+            serialize(out);
+        }
+
+        const quint64 payloadOffset = (quint64(mappedModelHeaderBytes + algorithm.size()) + 4095) & ~quint64(4095);
+
+        QFile outFile(model);
+        if (!outFile.open(QFile::WriteOnly))
+            qFatal("Unable to open %s for writing.", qPrintable(model));
+        QDataStream header(&outFile);
+        header.writeRawData(mappedModelMagic(), 8);
+        header << mappedModelVersion << quint64(algorithm.size()) << payloadOffset << payloads.size;
+        outFile.write(algorithm);
+
+        for (int i=0; i<payloads.payloads.size(); i++) {
+            const cv::Mat &m = payloads.payloads[i];
+            outFile.write(QByteArray(int(payloadOffset + payloads.offsets[i] - outFile.pos()), '\0'));
+            outFile.write((const char*) m.data, m.total() * m.elemSize());
+        }
+        outFile.close();
     }
 
     void load(const QString &model)
@@ -154,12 +271,54 @@ struct AlgorithmCore
         if (!Globals->modelSearch.contains(path))
             Globals->modelSearch.append(path);
 
+        if (loadMapped(model))
+            return;
+
         QtUtils::BlockCompression compressedRead;
         QFile inFile(model);
         compressedRead.setBasis(&inFile);
         QDataStream in(&compressedRead);
         compressedRead.open(QFile::ReadOnly);
+        deserialize(in);
+    }
+
+    // Returns false if the model isn't in the mapped container format
+    bool loadMapped(const QString &model)
+    {
+        QSharedPointer<QFile> file(new QFile(model));
+        if (!file->open(QFile::ReadOnly))
+            return false;
+
+        char magic[8];
+        if ((file->read(magic, 8) != 8) || (memcmp(magic, mappedModelMagic(), 8) != 0))
+            return false;
+
+        QDataStream header(file.data());
+        quint32 version;
+        quint64 algorithmSize, payloadOffset, payloadSize;
+        header >> version >> algorithmSize >> payloadOffset >> payloadSize;
+        if (version > mappedModelVersion)
+            qFatal("%s is a version %d model, newer than supported version %d.", qPrintable(model), version, mappedModelVersion);
+        if ((header.status() != QDataStream::Ok) || (payloadOffset + payloadSize > quint64(file->size())))
+            qFatal("%s is a truncated model.", qPrintable(model));
+
+        // Private mappings share physical pages between processes until written to
+        uchar *mapped = file->map(0, file->size(), QFileDevice::MapPrivateOption);
+        if (!mapped)
+            qFatal("Unable to map %s.", qPrintable(model));
+
+        const QByteArray algorithm = QByteArray::fromRawData((const char*) mapped + mappedModelHeaderBytes, int(algorithmSize));
+        QDataStream in(algorithm);
+        OpenCVUtils::MatPayloadReader payloads(mapped + payloadOffset, payloadSize);
+        deserialize(in);
+
+        // Matrices reference the mapping directly, so it lives as long as the algorithm
+        mappedModel = file;
+        return true;
+    }
 
+    void deserialize(QDataStream &in)
+    {
         // Load algorithm
         transform = QSharedPointer<Transform>(Transform::deserialize(in));
 
@@ -194,31 +353,75 @@ struct AlgorithmCore
         bool multiProcess = Globals->file.getBool("multiProcess", false);
         bool fileExclusion = false;
 
+        // A resumed enrollment appends to the complete templates of the previous run, the first read of the gallery
+        // removes any template left incomplete when it was interrupted
+        File existing = gallery;
+        if (Globals->resume && !noOutput && gallery.exists()) {
+            gallery.set("append", true);
+            existing = gallery;
+            existing.set("resume", true);
+        }
+
         // In append mode, we will exclude any templates with filenames already present in the output gallery
         if (gallery.contains("append") && gallery.exists() ) {
-            FileList::fromGallery(gallery,true);
+            FileList::fromGallery(existing,true);
             fileExclusion = true;
         }
 
         Transform *enroll = simplifiedTransform.data();
 
+        // Skip work already done by previous runs on the same images
+        QScopedPointer<Transform> contentCache;
+        if (!Globals->enrollmentCache.isEmpty()) {
+            contentCache.reset(Transform::make("ContentCache", NULL));
+            contentCache->setProperty("transform", QVariant::fromValue(enroll));
+            contentCache->init();
+            enroll = contentCache.data();
+        }
+
         if (multiProcess)
             enroll = wrapTransform(enroll, "ProcessWrapper");
 
         QList<Transform *> stages;
         stages.append(enroll);
 
+        // The gallery this process writes to, each MPI rank writes its own shard
+        File output = gallery;
+#ifdef BR_DISTRIBUTED
+        int rank = 0, ranks = 1;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+        const bool distributed = ranks > 1;
+
+        // Shards galleries take concurrent commits from several processes, other galleries are merged at the end
+        if (distributed && !noOutput && (gallery.suffix() != "shards")) {
+            output.name = gallery.path() + "/" + gallery.baseName() + QString(".rank%1.gal").arg(rank);
+            output.remove("append");
+            output.set("remove", true);
+        }
+#endif // BR_DISTRIBUTED
+
         QString outputDesc;
         if (fileExclusion)
             outputDesc = "FileExclusion(" + gallery.flat() + ")+";
         if (!noOutput)
-            outputDesc.append("GalleryOutput("+gallery.flat()+")+");
+            outputDesc.append("GalleryOutput("+output.flat()+")+");
 
         outputDesc = outputDesc + "DiscardTemplates";
         stages.append(progressCounter.data());
 
         QScopedPointer<Transform> pipeline(pipeTransforms(stages));
-        QScopedPointer<Transform> stream(wrapTransform(pipeline.data(), "Stream(readMode=StreamGallery, endPoint="+outputDesc+")"));
+        const int activeFrames = budgetedFrames(enrollmentFrameBytes, 0);
+        QScopedPointer<Transform> stream(wrapTransform(pipeline.data(), "Stream(readMode=StreamGallery, activeFrames=" + QString::number(activeFrames) + ", endPoint="+outputDesc+")"));
+
+#ifdef BR_DISTRIBUTED
+        if (distributed) {
+            enrollChunks(input, gallery, output, noOutput, stream.data());
+            if (multiProcess)
+                delete enroll;
+            return;
+        }
+#endif // BR_DISTRIBUTED
 
         foreach (const br::File &file, input.split()) {
             qDebug("Enrolling %s%s", qPrintable(file.name),
@@ -240,6 +443,114 @@ struct AlgorithmCore
             delete enroll;
     }
 
+#ifdef BR_DISTRIBUTED
+    // Enroll chunks of the input claimed from a queue shared by every MPI rank, then merge the rank galleries.
+    void enrollChunks(const File &input, const File &gallery, const File &output, bool noOutput, Transform *stream)
+    {
+        int rank, ranks;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+        // Every rank lists the input identically, so chunks can be referred to by index alone
+        FileList files;
+        foreach (const br::File &file, input.split())
+            files.append(FileList::fromGallery(file, true));
+
+        const int chunkSize = std::max(1, Globals->file.get<int>("chunkSize", 256));
+        const int chunks = (files.size() + chunkSize - 1) / chunkSize;
+        qDebug("Rank %d of %d enrolling %d chunks of %s%s", rank, ranks, chunks, qPrintable(input.flat()),
+               noOutput ? "" : qPrintable(" to " + output.flat()));
+        progressCounter->setPropertyRecursive("totalProgress", QString::number((files.size() + ranks - 1) / ranks));
+
+        {
+            ChunkQueue queue(chunks);
+            int chunk;
+            while ((chunk = queue.next()) != -1) {
+                const File chunkGallery = input.baseName() + input.hash() + QString(".chunk%1.mem").arg(chunk);
+                {
+                    QScopedPointer<Gallery> chunkOutput(Gallery::make(chunkGallery));
+                    TemplateList templates;
+                    for (int i=chunk*chunkSize; i<std::min(files.size(), (chunk+1)*chunkSize); i++)
+                        templates.append(Template(files[i]));
+                    chunkOutput->writeBlock(templates);
+                }
+
+                TemplateList data, dst;
+                data.append(chunkGallery);
+                stream->projectUpdate(data, dst);
+            }
+        }
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        if ((rank == 0) && !noOutput && (gallery.suffix() != "shards")) {
+            // Ranks that never claimed a chunk didn't write a gallery
+            QStringList partials;
+            for (int i=0; i<ranks; i++) {
+                const QString partial = gallery.path() + "/" + gallery.baseName() + QString(".rank%1.gal").arg(i);
+                if (QFile::exists(partial))
+                    partials.append(partial);
+            }
+            Cat(partials, gallery.flat());
+            foreach (const QString &partial, partials)
+                QFile::remove(partial);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+
+    /*!
+     * One claim counter per rank, exposed through an MPI window so any rank can claim chunks atomically.
+     * Each rank starts on its own contiguous range of chunks and steals from the others once it runs dry,
+     * so a slow rank's unclaimed chunks are picked up by whichever ranks finish first.
+     */
+    class ChunkQueue
+    {
+        int *counter;
+        MPI_Win window;
+        int rank, ranks, chunks, victim, visited;
+
+        int end(int owner) const
+        {
+            return chunks * qint64(owner+1) / ranks;
+        }
+
+    public:
+        ChunkQueue(int chunks)
+            : chunks(chunks), visited(0)
+        {
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+            victim = rank;
+            MPI_Alloc_mem(sizeof(int), MPI_INFO_NULL, &counter);
+            *counter = chunks * qint64(rank) / ranks;
+            MPI_Win_create(counter, sizeof(int), sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &window);
+            MPI_Win_lock_all(0, window);
+        }
+
+        ~ChunkQueue()
+        {
+            MPI_Win_unlock_all(window);
+            MPI_Win_free(&window);
+            MPI_Free_mem(counter);
+        }
+
+        // Returns the next unclaimed chunk, or -1 once every range is exhausted
+        int next()
+        {
+            const int one = 1;
+            while (visited < ranks) {
+                int claimed;
+                MPI_Fetch_and_op(&one, &claimed, MPI_INT, victim, 0, MPI_SUM, window);
+                MPI_Win_flush(victim, window);
+                if (claimed < end(victim))
+                    return claimed;
+                victim = (victim + 1) % ranks;
+                visited++;
+            }
+            return -1;
+        }
+    };
+#endif // BR_DISTRIBUTED
+
     void project(File input, File output)
     {
         qDebug("Projecting %s%s", qPrintable(input.flat()),
@@ -266,7 +577,7 @@ struct AlgorithmCore
 
     void retrieveOrEnroll(const File &file, QScopedPointer<Gallery> &gallery, FileList &galleryFiles)
     {
-        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
+        if (!file.getBool("enroll") && (QStringList() << "gal" << "mgal" << "ivf" << "hnsw" << "shards" << "mem" << "template" << "ut").contains(file.suffix())) {
             // Retrieve it
             gallery.reset(Gallery::make(file));
             galleryFiles = gallery->files();
@@ -321,6 +632,46 @@ struct AlgorithmCore
         }
     }
 
+    // Templates to search for duplicates, either exhaustively or among their nearest neighbors in an index
+    struct DuplicateSearch
+    {
+        const Distance *distance;
+        const TemplateList *templates;
+        const HNSWIndex *index;
+        int k;
+        float threshold;
+    };
+
+    // Pairs (i, j) with j < i in [begin, end) scoring at least the threshold
+    static void findDuplicates(const DuplicateSearch *search, int begin, int end, QList< QPair<int,int> > *duplicates)
+    {
+        const TemplateList &templates = *search->templates;
+        for (int i=begin; i<end; i++) {
+            if (templates[i].isEmpty()) continue;
+            if (search->index) {
+                foreach (const HNSWIndex::Match &match, search->index->search(templates[i], search->k+1))
+                    if ((match.first < i) && (match.second >= search->threshold))
+                        duplicates->append(QPair<int,int>(i, match.first));
+            } else {
+                const QList<float> scores = search->distance->compare(templates.mid(0, i), templates[i]);
+                for (int j=0; j<scores.size(); j++)
+                    if (!templates[j].isEmpty() && (scores[j] >= search->threshold))
+                        duplicates->append(QPair<int,int>(i, j));
+            }
+        }
+    }
+
+    static int findRoot(QVector<int> &parents, int i)
+    {
+        while (parents[i] != i) {
+            parents[i] = parents[parents[i]];
+            i = parents[i];
+        }
+        return i;
+    }
+
+    // Comparisons are made in parallel blocks and only the duplicate pairs are kept, never a similarity matrix.
+    // With a k in the input gallery's metadata only the k nearest neighbors of each template in a br::HNSWIndex are considered.
     void deduplicate(const File &inputGallery, const File &outputGallery, const float threshold)
     {
         qDebug("Deduplicating %s to %s with a score threshold of %f", qPrintable(inputGallery.flat()), qPrintable(outputGallery.flat()), threshold);
@@ -331,44 +682,96 @@ struct AlgorithmCore
         FileList inputFiles;
         retrieveOrEnroll(inputGallery, i, inputFiles);
 
-        TemplateList t = i->read();
-
-        Output *o = Output::make(QString("buffer.tail[selfSimilar,threshold=%1,atLeast=0]").arg(QString::number(threshold)),inputFiles,inputFiles);
+        const TemplateList t = i->read();
+        if (t.size() != inputFiles.size()) qFatal("Gallery size mismatch.");
 
-        // Compare to global tail output
-        distance->compare(t,t,o);
-
-        delete o;
+        QScopedPointer<HNSWIndex> index;
+        if (inputGallery.contains("k")) {
+            index.reset(new HNSWIndex());
+            index->setDistance(distance.data());
+            foreach (const Template &templ, t)
+                index->insert(templ);
+        }
 
-        QString buffer(Globals->buffer);
+        DuplicateSearch search;
+        search.distance = distance.data();
+        search.templates = &t;
+        search.index = index.data();
+        search.k = inputGallery.get<int>("k", 0);
+        search.threshold = threshold;
+
+        // Later rows make more comparisons, so the gallery is split into many small blocks
+        const int step = std::max(1, t.size() / std::max(1, 16 * Globals->parallelism));
+        QVector< QList< QPair<int,int> > > duplicates((t.size() + step - 1) / step);
+        QFutureSynchronizer<void> futures;
+        for (int block=0; block<duplicates.size(); block++) {
+            const int begin = block * step, end = std::min(begin + step, t.size());
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(findDuplicates, (const DuplicateSearch*) &search, begin, end, &duplicates[block]));
+            else                      findDuplicates(&search, begin, end, &duplicates[block]);
+        }
+        futures.waitForFinished();
+
+        // Duplicates are grouped transitively and the last template of each group is kept
+        QVector<int> parents(t.size());
+        for (int j=0; j<parents.size(); j++)
+            parents[j] = j;
+        foreach (const QList< QPair<int,int> > &pairs, duplicates) {
+            typedef QPair<int,int> Pair;
+            foreach (const Pair &pair, pairs) {
+                const int a = findRoot(parents, pair.first), b = findRoot(parents, pair.second);
+                if (a != b) parents[std::min(a, b)] = std::max(a, b);
+            }
+        }
 
-        QStringList tail = buffer.split("\n");
+        FileList deduplicated;
+        for (int j=0; j<inputFiles.size(); j++)
+            if (findRoot(parents, j) == j)
+                deduplicated.append(inputFiles[j]);
 
-        // Remove header
-        tail.removeFirst();
+        qDebug("\n%d duplicates removed.", inputFiles.size() - deduplicated.size());
 
-        QStringList toRemove;
-        foreach (const QString &s, tail)
-            toRemove.append(s.split(',').at(1));
+        QScopedPointer<Gallery> og(Gallery::make(outputGallery));
 
-        QSet<QString> duplicates = QSet<QString>::fromList(toRemove);
+        og->writeBlock(deduplicated);
+    }
 
-        QStringList fileNames = inputFiles.names();
+    static void searchQuery(const InvertedIndex *index, const Distance *distance, const TemplateList *targets, const Template *query, int row, Output *output)
+    {
+        foreach (int j, index->candidates(*query)) {
+            const Template &target = (*targets)[j];
+            output->setRelative((target.isEmpty() || query->isEmpty()) ? -std::numeric_limits<float>::max()
+                                                                       : distance->compare(target, *query), row, j);
+        }
+    }
 
-        QList<int> indices;
-        foreach (const QString &d, duplicates)
-            indices.append(fileNames.indexOf(d));
+    // Compare each query against the nprobe nearest lists of an inverted file gallery
+    void search(const File &targetGallery, File queryGallery, const File &output)
+    {
+        if (distance.isNull()) qFatal("Null distance.");
+        if (queryGallery == ".") queryGallery = targetGallery;
 
-        std::sort(indices.begin(),indices.end(),std::greater<float>());
+        InvertedIndex index;
+        TemplateList targets;
+        index.read(targetGallery, targets);
 
-        qDebug("\n%d duplicates removed.", indices.size());
+        QScopedPointer<Gallery> q;
+        FileList queryFiles;
+        retrieveOrEnroll(queryGallery, q, queryFiles);
+        const TemplateList queries = q->read();
 
-        for (int i=0; i<indices.size(); i++)
-            inputFiles.removeAt(indices[i]);
+        QScopedPointer<Output> o(Output::make(output, targets.files(), queryFiles));
+        o->set_blockRows(INT_MAX);
+        o->set_blockCols(INT_MAX);
+        o->setBlock(0,0);
 
-        QScopedPointer<Gallery> og(Gallery::make(outputGallery));
+        // Pairs outside the probed lists are never compared
+        MatrixOutput *matrix = dynamic_cast<MatrixOutput*>(o.data());
+        if (matrix) matrix->data.setTo(-std::numeric_limits<float>::max());
 
-        og->writeBlock(inputFiles);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<queries.size(); i++)
+            futures.addFuture(QtConcurrent::run(searchQuery, &index, distance.data(), &targets, &queries[i], i, o.data()));
+        futures.waitForFinished();
     }
 
     void compare(File targetGallery, File queryGallery, File output)
@@ -381,6 +784,12 @@ struct AlgorithmCore
         if (distance && distance->compare(targetGallery, queryGallery, output))
             return;
 
+        // Inverted file galleries are searched rather than compared exhaustively
+        if (targetGallery.suffix() == "ivf") {
+            search(targetGallery, queryGallery, output);
+            return;
+        }
+
         // Are we comparing the same gallery against itself?
         bool selfCompare = targetGallery == queryGallery;
 
@@ -443,7 +852,7 @@ struct AlgorithmCore
             colEnrolledGallery = colGallery.baseName() + colGallery.hash() + '.' + targetExtension;
 
             // Check if we have to do real enrollment, and not just convert the gallery's type.
-            if (!(QStringList() << "gal" << "template" << "mem" << "ut").contains(colGallery.suffix()))
+            if (!(QStringList() << "gal" << "mgal" << "ivf" << "hnsw" << "shards" << "template" << "mem" << "ut").contains(colGallery.suffix()))
                 enroll(colGallery, colEnrolledGallery);
 
             // If the gallery does have enrolled templates, but is not the right type, we do a simple
@@ -465,9 +874,51 @@ struct AlgorithmCore
         // which compares incoming templates against a gallery, we will handle enrollment of the row set by simply
         // building a transform that does enrollment (using the current algorithm), then does the comparison in one
         // step. This way, we don't have to retain the complete enrolled row gallery in memory, or on disk.
-        else if (!(QStringList() << "gal" << "mem" << "template" << "ut").contains(rowGallery.suffix()))
+        else if (!(QStringList() << "gal" << "mgal" << "ivf" << "hnsw" << "shards" << "mem" << "template" << "ut").contains(rowGallery.suffix()))
             needEnrollRows = true;
 
+        // The Output is told which galleries the rows and columns came from, these change if the rows are sharded.
+        File outputTarget = targetGallery;
+        File outputQuery = queryGallery;
+
+#ifdef BR_DISTRIBUTED
+        // When launched across several MPI ranks, every rank holds the complete column gallery and compares a
+        // disjoint block of rows against it. Each rank writes its block to a partial similarity matrix, which rank 0
+        // concatenates into the requested output once all ranks have finished.
+        int rank = 0, ranks = 1;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+        const bool distributed = ranks > 1;
+        if (distributed) {
+            rowGallery = shardGallery(rowGallery, transposeMode ? targetMetadata : queryMetadata, needEnrollRows, rank, ranks);
+            rowSize = FileList::fromGallery(rowGallery, true).size();
+            if (transposeMode) outputTarget = rowGallery;
+            else               outputQuery = rowGallery;
+            if (!output.isNull()) {
+                const File requested = output;
+                output = partialOutput(requested, rank);
+                output.remove("cache");
+                qDebug("Rank %d of %d comparing %s to %s", rank, ranks, qPrintable(rowGallery.flat()), qPrintable(output.flat()));
+                compareRows(rowGallery, output, outputTarget, outputQuery, transposeMode, needEnrollRows, multiProcess, colEnrolledGallery, rowSize);
+                MPI_Barrier(MPI_COMM_WORLD);
+                if (rank == 0) mergePartialOutputs(requested, targetGallery, queryGallery, ranks, transposeMode);
+                MPI_Barrier(MPI_COMM_WORLD);
+                return;
+            }
+        }
+#endif // BR_DISTRIBUTED
+
+        compareRows(rowGallery, output, outputTarget, outputQuery, transposeMode, needEnrollRows, multiProcess, colEnrolledGallery, rowSize);
+    }
+
+private:
+    QString name;
+
+    // Stream the row gallery through enrollment (if needed) and comparison against the enrolled column gallery.
+    void compareRows(const File &rowGallery, const File &output, const File &targetGallery, const File &queryGallery,
+                     bool transposeMode, bool needEnrollRows, bool multiProcess, const File &colEnrolledGallery, qint64 rowSize)
+    {
+
         // At this point, we have decided how we will structure the comparison (either in transpose mode, or not), 
         // and have the column gallery enrolled, and have decided whether or not we need to enroll the row gallery.
         // From this point, we will build a single algorithm that (optionally) does enrollment, then does comparisons
@@ -512,7 +963,25 @@ struct AlgorithmCore
         // The output transform takes the metadata memGalleries we set up previously as input, along with the
         // output specification we were passed. Gallery metadata is necessary for some Outputs to function correctly.
         QString outputString = output.flat().isEmpty() ? "Empty" : output.flat();
-        QString outputRegionDesc = "Output("+ outputString +"," + targetGallery.flat() +"," + queryGallery.flat() + ","+ QString::number(transposeMode ? 1 : 0) + ")";
+        // Under a memory limit the stream holds as many rows as fit beside the column gallery, each row holds its template
+        // (or image being enrolled) and its scores, and in transpose mode the output buffers as many columns as remain.
+        const qint64 colBytes = tlist.bytes<qint64>();
+        const qint64 rowBytes = (tlist.isEmpty() ? 0 : colBytes / tlist.size()) + qint64(tlist.size()) * sizeof(float)
+                                + (needEnrollRows ? enrollmentFrameBytes : 0);
+        const int activeFrames = budgetedFrames(rowBytes, colBytes);
+        int bufferedSize = budgetedFrames(qint64(tlist.size()) * sizeof(float), colBytes + activeFrames * rowBytes);
+
+        // A resumed comparison skips the rows its output's checkpoint records as complete, buffering columns as before
+        Checkpoint checkpoint;
+        const bool resume = Globals->resume && !output.isNull() && output.exists() && checkpoint.load(output.name) && (checkpoint.completed > 0);
+        if (resume) {
+            qDebug("Resuming %s after %lld completed rows", qPrintable(output.name), checkpoint.completed);
+            if (transposeMode)
+                bufferedSize = checkpoint.bufferedSize;
+        }
+
+        QString outputRegionDesc = "Output("+ outputString +"," + targetGallery.flat() +"," + queryGallery.flat() + ","+ QString::number(transposeMode ? 1 : 0) + ","
+                                   + QString::number(bufferedSize) + "," + QString::number(resume ? 1 : 0) + ")";
 
         // The ProgressCounter transform will simply provide a display about the number of rows completed.
         compareOutput.append(progressCounter.data());
@@ -523,11 +992,15 @@ struct AlgorithmCore
 
         // Now, we will give that base transform to a stream, which will incrementally read the row gallery
         // and pass the transforms it reads through the base algorithm.
-        QScopedPointer<Transform> streamWrapper(br::wrapTransform(pipeline, "Stream(readMode=StreamGallery, endPoint="+outputRegionDesc+"+DiscardTemplates)"));
+        QScopedPointer<Transform> streamWrapper(br::wrapTransform(pipeline, "Stream(readMode=StreamGallery, activeFrames=" + QString::number(activeFrames)
+                                                                          + ", endPoint="+outputRegionDesc+"+DiscardTemplates)"));
 
         // We set up a template containing the rowGallery we want to compare. 
         TemplateList rowGalleryTemplate;
-        rowGalleryTemplate.append(Template(rowGallery));
+        File rows = rowGallery;
+        if (resume)
+            rows.set("skip", checkpoint.completed);
+        rowGalleryTemplate.append(Template(rows));
         TemplateList outputGallery;
 
         // initialize the progress counter
@@ -537,8 +1010,67 @@ struct AlgorithmCore
         streamWrapper->projectUpdate(rowGalleryTemplate, outputGallery);
     }
 
-private:
-    QString name;
+#ifdef BR_DISTRIBUTED
+    // Restrict a row gallery to the templates assigned to this rank, indexed binary galleries are read in place.
+    static File shardGallery(const File &gallery, const FileList &metadata, bool needEnroll, int rank, int ranks)
+    {
+        if (gallery.suffix() == "gal") {
+            File shard = gallery;
+            shard.set("index", true);
+            shard.set("shards", ranks);
+            shard.set("shard", rank);
+            return shard;
+        }
+
+        // Other galleries are split on the same boundaries and copied into a memGallery
+        const int begin = metadata.size() * qint64(rank) / ranks;
+        const int end = metadata.size() * qint64(rank+1) / ranks;
+        TemplateList templates;
+        if (needEnroll) {
+            for (int i=begin; i<end; i++)
+                templates.append(Template(metadata[i]));
+        } else {
+            templates = TemplateList::fromGallery(gallery).mid(begin, end-begin);
+        }
+
+        const File shard = gallery.baseName() + gallery.hash() + QString(".rank%1.mem").arg(rank);
+        QScopedPointer<Gallery> shardGallery(Gallery::make(shard));
+        shardGallery->writeBlock(templates);
+        return shard;
+    }
+
+    static File partialOutput(const File &output, int rank)
+    {
+        File partial = output;
+        partial.name = output.path() + "/" + output.baseName() + QString(".rank%1.mtx").arg(rank);
+        return partial;
+    }
+
+    // Concatenate the partial similarity matrices in rank order and convert them to the requested output.
+    static void mergePartialOutputs(const File &output, const File &targetGallery, const File &queryGallery, int ranks, bool transposeMode)
+    {
+        std::vector<cv::Mat> blocks;
+        for (int i=0; i<ranks; i++)
+            blocks.push_back(BEE::readMatrix(partialOutput(output, i)));
+
+        // Rows are queries unless transposed, in which case each rank produced a block of target columns
+        cv::Mat m;
+        if (transposeMode) cv::hconcat(blocks, m);
+        else               cv::vconcat(blocks, m);
+        blocks.clear();
+
+        const QString merged = output.path() + "/" + output.baseName() + ".merged.mtx";
+        BEE::writeMatrix(m, output.suffix() == "mtx" ? output.name : merged, targetGallery.flat(), queryGallery.flat());
+        if (output.suffix() != "mtx") {
+            Convert(File("Output"), merged, output);
+            QFile::remove(merged);
+        }
+
+        for (int i=0; i<ranks; i++)
+            QFile::remove(partialOutput(output, i));
+        qDebug("Merged %d partial outputs into %s", ranks, qPrintable(output.flat()));
+    }
+#endif // BR_DISTRIBUTED
 
     // Check if description is either an abbreviation or a model file, if so load it
     bool loadOrExpand(const QString &description)
@@ -640,6 +1172,36 @@ QMutex AlgorithmManager::algorithmsLock;
 
 BR_REGISTER(Initializer, AlgorithmManager)
 
+#ifdef BR_DISTRIBUTED
+/*!
+ * \brief Brings up MPI so that comparisons can be sharded across ranks.
+ */
+class DistributedInitializer : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const
+    {
+        int initialized;
+        MPI_Initialized(&initialized);
+        if (initialized) return;
+
+        // Only the main thread makes MPI calls
+        int provided;
+        MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+    }
+
+    void finalize() const
+    {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if (!finalized) MPI_Finalize();
+    }
+};
+
+BR_REGISTER(Initializer, DistributedInitializer)
+#endif // BR_DISTRIBUTED
+
 bool br::IsClassifier(const QString &algorithm)
 {
     qDebug("Checking if %s is a classifier", qPrintable(algorithm));
@@ -684,6 +1246,131 @@ void br::PairwiseCompare(const File &targetGallery, const File &queryGallery, co
     AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->pairwiseCompare(targetGallery, queryGallery, output);
 }
 
+namespace br
+{
+
+// Reads one gallery on a worker thread into a bounded queue of blocks, consumed in order by copyGalleries()
+class GalleryReader : public QRunnable
+{
+    File input;
+    QQueue<TemplateList> blocks;
+    bool done;
+    QMutex mutex;
+    QWaitCondition changed;
+
+public:
+    GalleryReader(const File &input) : input(input), done(false) { setAutoDelete(false); }
+
+    void run()
+    {
+        Profiler::nameThread("br-gallery");
+        QScopedPointer<Gallery> gallery(Gallery::make(input));
+        bool last = false;
+        while (!last) {
+            const TemplateList block = gallery->readBlock(&last);
+            QMutexLocker locker(&mutex);
+            while (blocks.size() >= 4) // Bounds memory to a few blocks per reader
+                changed.wait(&mutex);
+            blocks.enqueue(block);
+            done = last;
+            changed.wakeAll();
+        }
+    }
+
+    // Returns false after the last block was taken
+    bool take(TemplateList &block)
+    {
+        QMutexLocker locker(&mutex);
+        while (blocks.isEmpty() && !done)
+            changed.wait(&mutex);
+        if (blocks.isEmpty())
+            return false;
+        block = blocks.dequeue();
+        changed.wakeAll();
+        return true;
+    }
+};
+
+// Galleries that are a plain sequence of records, without a header or trailer.
+// Compact .gal files begin with a TemplateCodec header and key dictionary of their own, so only legacy ones qualify.
+static bool concatenable(const QList<File> &inputs, const File &output)
+{
+    static const QStringList formats = QStringList() << "gal" << "ut";
+    if (!formats.contains(output.suffix()) || !output.localMetadata().isEmpty())
+        return false;
+    foreach (const File &input, inputs) {
+        if ((input.suffix() != output.suffix()) || !input.localMetadata().isEmpty() || !QFileInfo(input.name).isFile())
+            return false;
+        if (input.suffix() == "gal") {
+            QFile src(input.name);
+            if (!src.open(QFile::ReadOnly) || TemplateCodec::isHeader(src.peek(TemplateCodec::HeaderSize)))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Whether a and b name the same file, however their paths are spelled
+static bool sameFile(const QString &a, const QString &b)
+{
+    const QFileInfo infoA(a), infoB(b);
+    if (infoA.absoluteFilePath() == infoB.absoluteFilePath())
+        return true;
+    return infoA.exists() && (infoA.canonicalFilePath() == infoB.canonicalFilePath());
+}
+
+// Copies the templates of every input, in order, to the output gallery
+static void copyGalleries(const QList<File> &inputs, const File &output)
+{
+    // Opening the output truncates it before the input sharing its file is read
+    foreach (const File &input, inputs)
+        if (sameFile(input.name, output.name))
+            qFatal("Output gallery %s must not also be an input.", qPrintable(output.name));
+
+    if (concatenable(inputs, output)) {
+        // Identical formats are copied byte for byte
+        QFile dst(output.name);
+        QtUtils::touchDir(dst);
+        if (!dst.open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(output.name));
+        QByteArray buffer(1 << 23, Qt::Uninitialized);
+        foreach (const File &input, inputs) {
+            QFile src(input.name);
+            if (!src.open(QFile::ReadOnly))
+                qFatal("Failed to open %s for reading.", qPrintable(input.name));
+            qint64 bytes;
+            while ((bytes = src.read(buffer.data(), buffer.size())) > 0)
+                if (dst.write(buffer.constData(), bytes) != bytes)
+                    qFatal("Failed to write %s.", qPrintable(output.name));
+        }
+
+        // Offsets of a previous gallery by this name no longer apply, an indexed read rebuilds the sidecar
+        QFile::remove(output.name + ".idx");
+        return;
+    }
+
+    // Inputs are read and decoded concurrently, in order, while this thread writes their blocks in order.
+    // The pool starts readers in order, so the reader being written is always running.
+    QThreadPool pool;
+    pool.setMaxThreadCount(std::max(1, std::min(inputs.size(), Globals->parallelism)));
+    QList< QSharedPointer<GalleryReader> > readers;
+    foreach (const File &input, inputs) {
+        readers.append(QSharedPointer<GalleryReader>(new GalleryReader(input)));
+        pool.start(readers.last().data());
+    }
+
+    QScopedPointer<Gallery> gallery(Gallery::make(output));
+    for (int i=0; i<readers.size(); i++) {
+        TemplateList block;
+        while (readers[i]->take(block))
+            gallery->writeBlock(block);
+        readers[i].clear(); // Releases the input's templates
+    }
+    pool.waitForDone();
+}
+
+} // namespace br
+
 void br::Convert(const File &fileType, const File &inputFile, const File &outputFile)
 {
     qDebug("Converting %s %s to %s", qPrintable(fileType.flat()), qPrintable(inputFile.flat()), qPrintable(outputFile.flat()));
@@ -693,10 +1380,7 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
         QScopedPointer<Format> after(Factory<Format>::make(outputFile));
         after->write(before->read());
     } else if (fileType == "Gallery") {
-        QScopedPointer<Gallery> before(Gallery::make(inputFile));
-        QScopedPointer<Gallery> after(Gallery::make(outputFile));
-        bool done = false;
-        while (!done) after->writeBlock(before->readBlock(&done));
+        copyGalleries(QList<File>() << inputFile, outputFile);
     } else if (fileType == "Output") {
         QString target, query;
         cv::Mat m = BEE::readMatrix(inputFile, &target, &query);
@@ -732,12 +1416,10 @@ void br::Cat(const QStringList &inputGalleries, const QString &outputGallery)
     foreach (const QString &inputGallery, inputGalleries)
         if (inputGallery == outputGallery)
             qFatal("outputGallery must not be in inputGalleries.");
-    QScopedPointer<Gallery> og(Gallery::make(outputGallery));
-    foreach (const QString &inputGallery, inputGalleries) {
-        QScopedPointer<Gallery> ig(Gallery::make(inputGallery));
-        bool done = false;
-        while (!done) og->writeBlock(ig->readBlock(&done));
-    }
+    QList<File> inputs;
+    foreach (const QString &inputGallery, inputGalleries)
+        inputs.append(inputGallery);
+    copyGalleries(inputs, outputGallery);
 }
 
 void br::Deduplicate(const File &inputGallery, const File &outputGallery, const QString &threshold)
@@ -748,6 +1430,18 @@ void br::Deduplicate(const File &inputGallery, const File &outputGallery, const
     else qFatal("Unable to convert deduplication threshold to float.");
 }
 
+void br::Serve(const File &gallery, int port)
+{
+    if (!Factory<Initializer>::names().contains("Serve"))
+        qFatal("Serving requires building with BR_WITH_MONGOOSE.");
+
+    File server(".Serve");
+    server.set("gallery", QVariant(gallery.flat()));
+    server.set("port", port);
+    QScopedPointer<Initializer> initializer(Factory<Initializer>::make(server));
+    initializer->initialize();
+}
+
 QSharedPointer<br::Transform> br::Transform::fromComparison(const QString &algorithm)
 {
     return AlgorithmManager::getAlgorithm(algorithm)->comparison;
@@ -0,0 +1,218 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QThread>
+#include <algorithm>
+#ifdef Q_OS_UNIX
+#include <dirent.h>
+#include <sys/stat.h>
+#endif // Q_OS_UNIX
+
+#include "dirwalker.h"
+#include "profiler.h"
+
+namespace br
+{
+
+// Entries listed but not yet taken by next(), beyond which workers wait
+static const int maxBufferedEntries = 1 << 20;
+
+class DirectoryWalker::Worker : public QRunnable
+{
+    DirectoryWalker *walker;
+    int index;
+
+public:
+    Worker(DirectoryWalker *walker, int index) : walker(walker), index(index) {}
+    void run()
+    {
+        Profiler::nameThread("br-dirwalk");
+        walker->work(index);
+    }
+};
+
+DirectoryWalker::DirectoryWalker(const QStringList &roots, int threads, int maxDepth, bool depthFirst)
+    : maxDepth(maxDepth), depthFirst(depthFirst), idle(0), walked(false), stopped(false)
+{
+    this->threads = (threads > 0) ? threads : 4 * std::max(1, QThread::idealThreadCount());
+    tasks.resize(this->threads);
+    pool.setMaxThreadCount(this->threads);
+
+    // Roots are dealt round robin to the workers, roots that are files are entries of their own
+    int worker = 0;
+    foreach (const QString &root, roots) {
+        const QFileInfo info(root);
+        if (info.isDir()) {
+            Task task;
+            task.path = QFile::encodeName(info.absoluteFilePath());
+            task.label = QDir(info.absoluteFilePath()).dirName();
+            task.depth = 0;
+            tasks[worker++ % this->threads].append(task);
+        } else if (info.isFile()) {
+            Entry entry;
+            entry.path = info.absoluteFilePath();
+            entry.label = info.dir().dirName();
+            entries.enqueue(entry);
+        }
+    }
+
+    for (int i=0; i<this->threads; i++)
+        pool.start(new Worker(this, i));
+}
+
+DirectoryWalker::~DirectoryWalker()
+{
+    mutex.lock();
+    stopped = true;
+    taskAvailable.wakeAll();
+    entriesTaken.wakeAll();
+    mutex.unlock();
+    pool.waitForDone();
+}
+
+QList<DirectoryWalker::Entry> DirectoryWalker::next(int count, bool *done)
+{
+    QMutexLocker locker(&mutex);
+    while (!walked && (entries.size() < count))
+        entriesAvailable.wait(&mutex);
+
+    QList<Entry> result;
+    while (!entries.isEmpty() && (result.size() < count))
+        result.append(entries.dequeue());
+    entriesTaken.wakeAll();
+    *done = walked && entries.isEmpty();
+    return result;
+}
+
+void DirectoryWalker::work(int worker)
+{
+    QMutexLocker locker(&mutex);
+    while (!stopped && !walked) {
+        Task task;
+        bool found = false;
+        if (!tasks[worker].isEmpty()) {
+            task = depthFirst ? tasks[worker].takeLast() : tasks[worker].takeFirst();
+            found = true;
+        } else {
+            for (int i=1; i<threads; i++) {
+                QList<Task> &victim = tasks[(worker + i) % threads];
+                if (!victim.isEmpty()) {
+                    task = victim.takeFirst();
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        if (!found) {
+            // Every deque is empty and every other worker is waiting, so no more work can appear
+            if (idle == threads - 1) {
+                walked = true;
+                taskAvailable.wakeAll();
+                entriesAvailable.wakeAll();
+                break;
+            }
+            idle++;
+            taskAvailable.wait(&mutex);
+            idle--;
+            continue;
+        }
+
+        locker.unlock();
+        QList<Task> subdirectories;
+        QList<Entry> files;
+        list(task, subdirectories, files);
+        locker.relock();
+
+        tasks[worker].append(subdirectories);
+        if (!subdirectories.isEmpty() && (idle > 0))
+            taskAvailable.wakeAll();
+
+        while (!stopped && (entries.size() >= maxBufferedEntries))
+            entriesTaken.wait(&mutex);
+        foreach (const Entry &file, files)
+            entries.enqueue(file);
+        if (!files.isEmpty())
+            entriesAvailable.wakeAll();
+    }
+}
+
+void DirectoryWalker::list(const Task &task, QList<Task> &subdirectories, QList<Entry> &files) const
+{
+    // The files and subdirectories of a directory are one level deeper than it
+    if (task.depth + 1 >= maxDepth)
+        return;
+
+#ifdef Q_OS_UNIX
+    DIR *dir = opendir(task.path.constData());
+    if (!dir)
+        return;
+
+    while (struct dirent *dirEntry = readdir(dir)) {
+        const char *name = dirEntry->d_name;
+        if (name[0] == '.') // Hidden, or . and ..
+            continue;
+
+        const QByteArray path = task.path + '/' + name;
+        bool isDir = (dirEntry->d_type == DT_DIR);
+        bool isFile = (dirEntry->d_type == DT_REG);
+        if ((dirEntry->d_type == DT_UNKNOWN) || (dirEntry->d_type == DT_LNK)) {
+            // Not every file system fills in d_type, and links are typed by their targets
+            struct stat status;
+            if (stat(path.constData(), &status) != 0)
+                continue;
+            isDir = S_ISDIR(status.st_mode);
+            isFile = S_ISREG(status.st_mode);
+        }
+
+        if (isDir) {
+            Task subdirectory;
+            subdirectory.path = path;
+            subdirectory.label = (task.depth == 0) ? QFile::decodeName(name) : task.label;
+            subdirectory.depth = task.depth + 1;
+            subdirectories.append(subdirectory);
+        } else if (isFile) {
+            Entry entry;
+            entry.path = QFile::decodeName(path);
+            entry.label = task.label;
+            files.append(entry);
+        }
+    }
+    closedir(dir);
+#else // Q_OS_UNIX
+    const QDir dir(QFile::decodeName(task.path));
+    foreach (const QFileInfo &info, dir.entryInfoList(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot)) {
+        if (info.isDir()) {
+            Task subdirectory;
+            subdirectory.path = QFile::encodeName(info.absoluteFilePath());
+            subdirectory.label = (task.depth == 0) ? info.fileName() : task.label;
+            subdirectory.depth = task.depth + 1;
+            subdirectories.append(subdirectory);
+        } else if (info.isFile()) {
+            Entry entry;
+            entry.path = info.absoluteFilePath();
+            entry.label = task.label;
+            files.append(entry);
+        }
+    }
+#endif // Q_OS_UNIX
+}
+
+} // namespace br
@@ -0,0 +1,80 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_DIRWALKER_H
+#define BR_DIRWALKER_H
+
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QVector>
+#include <QWaitCondition>
+#include <limits>
+
+namespace br
+{
+
+// Lists the files below a set of roots on a pool of threads that steal subdirectories from each other,
+// so listing can be consumed in blocks while the walk continues.
+// On POSIX systems entries are typed with readdir's d_type, only entries of unknown type and symbolic links are stat'ed.
+// Like QDir::entryList(QDir::Files), hidden entries are skipped.
+class DirectoryWalker
+{
+public:
+    struct Entry
+    {
+        QString path; // Absolute
+        QString label; // The name of the root's immediate subdirectory containing the file, or of the root itself
+    };
+
+    // Directories deeper than maxDepth-1 below a root aren't listed, threads defaults to four per core as listing is I/O bound
+    DirectoryWalker(const QStringList &roots, int threads = 0, int maxDepth = std::numeric_limits<int>::max(), bool depthFirst = true);
+    ~DirectoryWalker(); // Stops walking
+
+    // Blocks for count more entries, returns fewer only after setting done at the end of the walk
+    QList<Entry> next(int count, bool *done);
+
+private:
+    class Worker;
+    friend class Worker;
+
+    struct Task
+    {
+        QByteArray path;
+        QString label;
+        int depth;
+    };
+
+    int maxDepth;
+    bool depthFirst;
+    int idle, threads;
+    bool walked, stopped;
+    QVector< QList<Task> > tasks; // One deque per worker, owners take from the back when depth first and thieves take from the front
+    QQueue<Entry> entries;
+    QMutex mutex;
+    QWaitCondition taskAvailable, entriesAvailable, entriesTaken;
+    QThreadPool pool;
+
+    void work(int worker);
+    void list(const Task &task, QList<Task> &subdirectories, QList<Entry> &files) const;
+};
+
+} // namespace br
+
+#endif // BR_DIRWALKER_H
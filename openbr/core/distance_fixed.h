@@ -0,0 +1,236 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef DISTANCE_FIXED_H
+#define DISTANCE_FIXED_H
+
+#include <math.h>
+#include "distance_sse.h"
+
+// Float distance kernels instantiated for common feature dimensions, where the trip count is a compile time constant
+// so the loops are fully unrolled, alongside runtime length versions (Size == 0) for every other dimension.
+// L2 is the squared distance.
+
+enum FloatMetric { FloatL1, FloatL2, FloatDot, FloatCosine };
+
+typedef float (*FloatDistanceKernel)(const float *a, const float *b, int size);
+
+template <int Size, int Metric>
+struct FloatKernelScalar
+{
+    static float run(const float *a, const float *b, int size)
+    {
+        const int n = Size ? Size : size;
+        float result = 0, aa = 0, bb = 0;
+        for (int i=0; i<n; i++) {
+            if      (Metric == FloatL1)  result += fabsf(a[i]-b[i]);
+            else if (Metric == FloatL2)  result += (a[i]-b[i])*(a[i]-b[i]);
+            else                       { result += a[i]*b[i]; aa += a[i]*a[i]; bb += b[i]*b[i]; }
+        }
+        return (Metric == FloatCosine) ? result / (sqrtf(aa)*sqrtf(bb)) : result;
+    }
+};
+
+#ifdef __SSE__
+
+inline float hsum_sse(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+template <int Size, int Metric>
+struct FloatKernelSSE
+{
+    // Accumulates four vectors at a time, acc and squared norms aa and bb for cosine
+    static inline void step(const float *a, const float *b, __m128 &acc, __m128 &aa, __m128 &bb)
+    {
+        const __m128 A = _mm_loadu_ps(a), B = _mm_loadu_ps(b);
+        if (Metric == FloatL1) {
+            acc = _mm_add_ps(acc, _mm_andnot_ps(_mm_set1_ps(-0.f), _mm_sub_ps(A, B)));
+        } else if (Metric == FloatL2) {
+            const __m128 d = _mm_sub_ps(A, B);
+            acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+        } else {
+            acc = _mm_add_ps(acc, _mm_mul_ps(A, B));
+            if (Metric == FloatCosine) {
+                aa = _mm_add_ps(aa, _mm_mul_ps(A, A));
+                bb = _mm_add_ps(bb, _mm_mul_ps(B, B));
+            }
+        }
+    }
+
+    static float run(const float *a, const float *b, int size)
+    {
+        const int n = Size ? Size : size;
+        __m128 acc0 = _mm_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        __m128 aa0 = acc0, aa1 = acc0, bb0 = acc0, bb1 = acc0;
+        int i = 0;
+        for (; i+16<=n; i+=16) {
+            step(a+i,    b+i,    acc0, aa0, bb0);
+            step(a+i+4,  b+i+4,  acc1, aa1, bb1);
+            step(a+i+8,  b+i+8,  acc2, aa0, bb0);
+            step(a+i+12, b+i+12, acc3, aa1, bb1);
+        }
+        for (; i+4<=n; i+=4)
+            step(a+i, b+i, acc0, aa0, bb0);
+
+        float result = hsum_sse(_mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+        float aa = hsum_sse(_mm_add_ps(aa0, aa1)), bb = hsum_sse(_mm_add_ps(bb0, bb1));
+        for (; i<n; i++) {
+            if      (Metric == FloatL1)  result += fabsf(a[i]-b[i]);
+            else if (Metric == FloatL2)  result += (a[i]-b[i])*(a[i]-b[i]);
+            else                       { result += a[i]*b[i]; aa += a[i]*a[i]; bb += b[i]*b[i]; }
+        }
+        return (Metric == FloatCosine) ? result / (sqrtf(aa)*sqrtf(bb)) : result;
+    }
+};
+
+#endif // __SSE__
+
+#ifdef BR_SIMD_DISPATCH
+
+BR_TARGET("avx2,fma")
+inline float hsum_avx(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+template <int Size, int Metric>
+struct FloatKernelAVX2
+{
+    BR_TARGET("avx2,fma")
+    static inline void step(const float *a, const float *b, __m256 &acc, __m256 &aa, __m256 &bb)
+    {
+        const __m256 A = _mm256_loadu_ps(a), B = _mm256_loadu_ps(b);
+        if (Metric == FloatL1) {
+            acc = _mm256_add_ps(acc, _mm256_andnot_ps(_mm256_set1_ps(-0.f), _mm256_sub_ps(A, B)));
+        } else if (Metric == FloatL2) {
+            const __m256 d = _mm256_sub_ps(A, B);
+            acc = _mm256_fmadd_ps(d, d, acc);
+        } else {
+            acc = _mm256_fmadd_ps(A, B, acc);
+            if (Metric == FloatCosine) {
+                aa = _mm256_fmadd_ps(A, A, aa);
+                bb = _mm256_fmadd_ps(B, B, bb);
+            }
+        }
+    }
+
+    BR_TARGET("avx2,fma")
+    static float run(const float *a, const float *b, int size)
+    {
+        const int n = Size ? Size : size;
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        __m256 aa0 = acc0, aa1 = acc0, bb0 = acc0, bb1 = acc0;
+        int i = 0;
+        for (; i+32<=n; i+=32) {
+            step(a+i,    b+i,    acc0, aa0, bb0);
+            step(a+i+8,  b+i+8,  acc1, aa1, bb1);
+            step(a+i+16, b+i+16, acc2, aa0, bb0);
+            step(a+i+24, b+i+24, acc3, aa1, bb1);
+        }
+        for (; i+8<=n; i+=8)
+            step(a+i, b+i, acc0, aa0, bb0);
+
+        float result = hsum_avx(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+        float aa = hsum_avx(_mm256_add_ps(aa0, aa1)), bb = hsum_avx(_mm256_add_ps(bb0, bb1));
+        for (; i<n; i++) {
+            if      (Metric == FloatL1)  result += fabsf(a[i]-b[i]);
+            else if (Metric == FloatL2)  result += (a[i]-b[i])*(a[i]-b[i]);
+            else                       { result += a[i]*b[i]; aa += a[i]*a[i]; bb += b[i]*b[i]; }
+        }
+        return (Metric == FloatCosine) ? result / (sqrtf(aa)*sqrtf(bb)) : result;
+    }
+};
+
+#endif // BR_SIMD_DISPATCH
+
+/*!
+ * \brief The kernels of one metric for the widest instruction set supported by the running CPU.
+ *
+ * Construct once, for example in br::Object::init(), then look up the kernel for a dimension with a switch per comparison.
+ */
+class FloatDistanceKernels
+{
+    FloatDistanceKernel generic, fixed[7]; // Indexed as in operator()
+
+    template <template <int, int> class Kernel, int Metric>
+    void assign()
+    {
+        generic  = Kernel<0,    Metric>::run;
+        fixed[0] = Kernel<64,   Metric>::run;
+        fixed[1] = Kernel<128,  Metric>::run;
+        fixed[2] = Kernel<256,  Metric>::run;
+        fixed[3] = Kernel<384,  Metric>::run;
+        fixed[4] = Kernel<512,  Metric>::run;
+        fixed[5] = Kernel<1024, Metric>::run;
+        fixed[6] = Kernel<2048, Metric>::run;
+    }
+
+    template <template <int, int> class Kernel>
+    void assign(int metric)
+    {
+        switch (metric) {
+          case FloatL1:  assign<Kernel, FloatL1>();     break;
+          case FloatL2:  assign<Kernel, FloatL2>();     break;
+          case FloatDot: assign<Kernel, FloatDot>();    break;
+          default:       assign<Kernel, FloatCosine>();
+        }
+    }
+
+public:
+    explicit FloatDistanceKernels(int metric = FloatL2)
+    {
+#ifdef BR_SIMD_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            assign<FloatKernelAVX2>(metric);
+            return;
+        }
+#endif
+#ifdef __SSE__
+        assign<FloatKernelSSE>(metric);
+#else
+        assign<FloatKernelScalar>(metric);
+#endif
+    }
+
+    FloatDistanceKernel operator()(int size) const
+    {
+        switch (size) {
+          case 64:   return fixed[0];
+          case 128:  return fixed[1];
+          case 256:  return fixed[2];
+          case 384:  return fixed[3];
+          case 512:  return fixed[4];
+          case 1024: return fixed[5];
+          case 2048: return fixed[6];
+          default:   return generic;
+        }
+    }
+
+    float operator()(const float *a, const float *b, int size) const
+    {
+        return (*this)(size)(a, b, size);
+    }
+};
+
+#endif // DISTANCE_FIXED_H
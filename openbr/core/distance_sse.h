@@ -18,10 +18,14 @@
 #define DISTANCE_SSE_H
 
 #include <QDebug>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef __SSE__
 
-#include <xmmintrin.h>
+#include <emmintrin.h>
 
 inline QDebug operator<<(QDebug dbg, const __m128i &p)
 {
@@ -31,12 +35,34 @@ inline QDebug operator<<(QDebug dbg, const __m128i &p)
     return dbg.space();
 }
 
-inline float l1(const uchar *a, const uchar *b, int size)
+#endif // __SSE__
+
+// Wider kernels are compiled per-function with target attributes and selected at run time,
+// so a single binary built without -mavx2 can still use them on capable hardware.
+// GCC only accepts the AVX-512BW intrinsics and target("avx512bw") from version 5.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    ((__GNUC__ >= 5) || defined(__clang__))
+#define BR_SIMD_DISPATCH
+#include <immintrin.h>
+#define BR_TARGET(ISA) __attribute__((target(ISA)))
+#endif
+
+inline int64_t l1_scalar(const uchar *a, const uchar *b, int size)
+{
+    int64_t distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs(a[i]-b[i]);
+    return distance;
+}
+
+#ifdef __SSE__
+
+inline int64_t l1_sse2(const uchar *a, const uchar *b, int size)
 {
-    size = size / sizeof(__m128i);
+    const int blocks = size / sizeof(__m128i);
     __m128i accumulate = _mm_setzero_si128();
 
-    for (int i=0; i<size; i++) {
+    for (int i=0; i<blocks; i++) {
         __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
         __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
         __m128i sad = _mm_sad_epu8(A, B);
@@ -45,31 +71,527 @@ inline float l1(const uchar *a, const uchar *b, int size)
 
     int64_t buff[2];
     _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), accumulate);
-    return buff[0] + buff[1];
+    const int done = blocks * sizeof(__m128i);
+    return buff[0] + buff[1] + l1_scalar(a + done, b + done, size - done);
+}
+
+#endif // __SSE__
+
+#ifdef BR_SIMD_DISPATCH
+
+BR_TARGET("avx2")
+inline int64_t l1_avx2(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(__m256i);
+    __m256i accumulate = _mm256_setzero_si256();
+
+    for (int i=0; i<blocks; i++) {
+        __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)+i);
+        __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)+i);
+        accumulate = _mm256_add_epi64(_mm256_sad_epu8(A, B), accumulate);
+    }
+
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(accumulate), _mm256_extracti128_si256(accumulate, 1));
+    int64_t buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), sum);
+    const int done = blocks * sizeof(__m256i);
+    return buff[0] + buff[1] + l1_scalar(a + done, b + done, size - done);
 }
 
+BR_TARGET("avx512f,avx512bw")
+inline int64_t l1_avx512(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(__m512i);
+    __m512i accumulate = _mm512_setzero_si512();
+
+    for (int i=0; i<blocks; i++) {
+        __m512i A = _mm512_loadu_si512(reinterpret_cast<const __m512i*>(a)+i);
+        __m512i B = _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b)+i);
+        accumulate = _mm512_add_epi64(_mm512_sad_epu8(A, B), accumulate);
+    }
+
+    // The tail is at most 63 bytes, a masked load keeps it in-register
+    const int done = blocks * sizeof(__m512i);
+    const int remaining = size - done;
+    if (remaining > 0) {
+        const __mmask64 mask = (~0ULL) >> (64 - remaining);
+        __m512i A = _mm512_maskz_loadu_epi8(mask, a + done);
+        __m512i B = _mm512_maskz_loadu_epi8(mask, b + done);
+        accumulate = _mm512_add_epi64(_mm512_sad_epu8(A, B), accumulate);
+    }
+
+    int64_t buff[8];
+    _mm512_storeu_si512(reinterpret_cast<__m512i*>(&buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+}
+
+#endif // BR_SIMD_DISPATCH
+
+typedef int64_t (*L1Kernel)(const uchar *a, const uchar *b, int size);
+
+/*!
+ * \brief Selects the widest byte L1 kernel supported by the running CPU.
+ */
+inline L1Kernel l1_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return l1_avx512;
+    if (__builtin_cpu_supports("avx2"))     return l1_avx2;
+#endif
+#ifdef __SSE__
+    return l1_sse2;
 #else
+    return l1_scalar;
+#endif
+}
 
 inline float l1(const uchar *a, const uchar *b, int size)
 {
-    int distance = 0;
+    static const L1Kernel kernel = l1_kernel();
+    return kernel(a, b, size);
+}
+
+inline int64_t packed_l1_scalar(const uchar *a, const uchar *b, int size)
+{
+    static const uchar low_mask = 0x0F;
+    static const uchar hi_mask = 0xF0;
+
+    int64_t distance = 0;
     for (int i=0; i<size; i++)
-        distance += abs(a[i]-b[i]);
+        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
+                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
     return distance;
 }
 
+// The packed kernels split each byte into its two nibbles with masks and take the SAD of each half.
+// The high nibbles are left in place, so their sum is 16x too large and is shifted down once at the end.
+
+#ifdef __SSE__
+
+inline int64_t packed_l1_sse2(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(__m128i);
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+    const __m128i hi_mask = _mm_set1_epi8((char)0xF0);
+    __m128i low = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+
+    for (int i=0; i<blocks; i++) {
+        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
+        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
+        low = _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(A, low_mask), _mm_and_si128(B, low_mask)), low);
+        hi = _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(A, hi_mask), _mm_and_si128(B, hi_mask)), hi);
+    }
+
+    int64_t buff[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff[0]), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff[2]), hi);
+    const int done = blocks * sizeof(__m128i);
+    return buff[0] + buff[1] + ((buff[2] + buff[3]) >> 4) + packed_l1_scalar(a + done, b + done, size - done);
+}
+
+#endif // __SSE__
+
+#ifdef BR_SIMD_DISPATCH
+
+BR_TARGET("avx2")
+inline int64_t packed_l1_avx2(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(__m256i);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    const __m256i hi_mask = _mm256_set1_epi8((char)0xF0);
+    __m256i low = _mm256_setzero_si256();
+    __m256i hi = _mm256_setzero_si256();
+
+    for (int i=0; i<blocks; i++) {
+        __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)+i);
+        __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)+i);
+        low = _mm256_add_epi64(_mm256_sad_epu8(_mm256_and_si256(A, low_mask), _mm256_and_si256(B, low_mask)), low);
+        hi = _mm256_add_epi64(_mm256_sad_epu8(_mm256_and_si256(A, hi_mask), _mm256_and_si256(B, hi_mask)), hi);
+    }
+
+    int64_t buff[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&buff[0]), low);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&buff[4]), hi);
+    const int done = blocks * sizeof(__m256i);
+    return buff[0] + buff[1] + buff[2] + buff[3] + ((buff[4] + buff[5] + buff[6] + buff[7]) >> 4) +
+           packed_l1_scalar(a + done, b + done, size - done);
+}
+
+BR_TARGET("avx512f,avx512bw")
+inline int64_t packed_l1_avx512(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(__m512i);
+    const __m512i low_mask = _mm512_set1_epi8(0x0F);
+    const __m512i hi_mask = _mm512_set1_epi8((char)0xF0);
+    __m512i low = _mm512_setzero_si512();
+    __m512i hi = _mm512_setzero_si512();
+
+    for (int i=0; i<blocks; i++) {
+        __m512i A = _mm512_loadu_si512(reinterpret_cast<const __m512i*>(a)+i);
+        __m512i B = _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b)+i);
+        low = _mm512_add_epi64(_mm512_sad_epu8(_mm512_and_si512(A, low_mask), _mm512_and_si512(B, low_mask)), low);
+        hi = _mm512_add_epi64(_mm512_sad_epu8(_mm512_and_si512(A, hi_mask), _mm512_and_si512(B, hi_mask)), hi);
+    }
+
+    const int done = blocks * sizeof(__m512i);
+    const int remaining = size - done;
+    if (remaining > 0) {
+        const __mmask64 mask = (~0ULL) >> (64 - remaining);
+        __m512i A = _mm512_maskz_loadu_epi8(mask, a + done);
+        __m512i B = _mm512_maskz_loadu_epi8(mask, b + done);
+        low = _mm512_add_epi64(_mm512_sad_epu8(_mm512_and_si512(A, low_mask), _mm512_and_si512(B, low_mask)), low);
+        hi = _mm512_add_epi64(_mm512_sad_epu8(_mm512_and_si512(A, hi_mask), _mm512_and_si512(B, hi_mask)), hi);
+    }
+
+    int64_t buff[16];
+    _mm512_storeu_si512(reinterpret_cast<__m512i*>(&buff[0]), low);
+    _mm512_storeu_si512(reinterpret_cast<__m512i*>(&buff[8]), hi);
+    int64_t low_sum = 0, hi_sum = 0;
+    for (int i=0; i<8; i++) {
+        low_sum += buff[i];
+        hi_sum += buff[8+i];
+    }
+    return low_sum + (hi_sum >> 4);
+}
+
+#endif // BR_SIMD_DISPATCH
+
+/*!
+ * \brief Selects the widest packed 4-bit L1 kernel supported by the running CPU.
+ */
+inline L1Kernel packed_l1_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return packed_l1_avx512;
+    if (__builtin_cpu_supports("avx2"))     return packed_l1_avx2;
 #endif
+#ifdef __SSE__
+    return packed_l1_sse2;
+#else
+    return packed_l1_scalar;
+#endif
+}
 
 inline float packed_l1(const uchar *a, const uchar *b, int size)
 {
-    static const uchar low_mask = 0x0F;
-    static const uchar hi_mask = 0xF0;
+    static const L1Kernel kernel = packed_l1_kernel();
+    return kernel(a, b, size);
+}
+
+// Asymmetric product quantization kernels sum one entry per subspace from a query's table of 256 floats per subspace,
+// indexed by the target's 8-bit codes.
 
-    int distance = 0;
+inline float pq_adc_scalar(const float *table, const uchar *codes, int size)
+{
+    float distance = 0;
     for (int i=0; i<size; i++)
-        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
-                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
+        distance += table[i*256 + codes[i]];
     return distance;
 }
 
+typedef float (*ADCKernel)(const float *table, const uchar *codes, int size);
+
+#ifdef BR_SIMD_DISPATCH
+
+// Eight subspaces per step, their codes are widened to table offsets and gathered
+BR_TARGET("avx2")
+inline float pq_adc_avx2(const float *table, const uchar *codes, int size)
+{
+    const int blocks = size / 8;
+    const __m256i step = _mm256_set1_epi32(8*256);
+    __m256i offsets = _mm256_setr_epi32(0*256, 1*256, 2*256, 3*256, 4*256, 5*256, 6*256, 7*256);
+    __m256 accumulate = _mm256_setzero_ps();
+
+    for (int i=0; i<blocks; i++) {
+        const __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes + 8*i));
+        const __m256i indices = _mm256_add_epi32(_mm256_cvtepu8_epi32(packed), offsets);
+        accumulate = _mm256_add_ps(_mm256_i32gather_ps(table, indices, sizeof(float)), accumulate);
+        offsets = _mm256_add_epi32(offsets, step);
+    }
+
+    float buff[8];
+    _mm256_storeu_ps(buff, accumulate);
+    const int done = blocks * 8;
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7] +
+           pq_adc_scalar(table + done*256, codes + done, size - done);
+}
+
+#endif // BR_SIMD_DISPATCH
+
+/*!
+ * \brief Selects the widest asymmetric product quantization kernel supported by the running CPU.
+ */
+inline ADCKernel pq_adc_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return pq_adc_avx2;
+#endif
+    return pq_adc_scalar;
+}
+
+inline float pq_adc(const float *table, const uchar *codes, int size)
+{
+    static const ADCKernel kernel = pq_adc_kernel();
+    return kernel(table, codes, size);
+}
+
+// Hamming kernels count the set bits of the XOR of two bit-packed codes, 64 bits at a time.
+
+inline int64_t hamming_scalar(const uchar *a, const uchar *b, int size)
+{
+    int64_t distance = 0;
+    for (int i=0; i<size; i++) {
+        uchar x = a[i] ^ b[i];
+        while (x) {
+            x &= x - 1;
+            distance++;
+        }
+    }
+    return distance;
+}
+
+#ifdef BR_SIMD_DISPATCH
+
+BR_TARGET("popcnt")
+inline int64_t hamming_popcnt(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(uint64_t);
+    int64_t distance = 0;
+    for (int i=0; i<blocks; i++) {
+        uint64_t A, B;
+        memcpy(&A, a + i*sizeof(uint64_t), sizeof(uint64_t));
+        memcpy(&B, b + i*sizeof(uint64_t), sizeof(uint64_t));
+        distance += __builtin_popcountll(A ^ B);
+    }
+    const int done = blocks * sizeof(uint64_t);
+    return distance + hamming_scalar(a + done, b + done, size - done);
+}
+
+// VPOPCNTDQ first shipped with GCC 7 and Clang 5
+#if (__GNUC__ >= 7) || (defined(__clang__) && (__clang_major__ >= 5))
+#define BR_SIMD_VPOPCNTDQ
+
+BR_TARGET("avx512f,avx512bw,avx512vpopcntdq")
+inline int64_t hamming_avx512(const uchar *a, const uchar *b, int size)
+{
+    const int blocks = size / sizeof(__m512i);
+    __m512i accumulate = _mm512_setzero_si512();
+
+    for (int i=0; i<blocks; i++) {
+        __m512i A = _mm512_loadu_si512(reinterpret_cast<const __m512i*>(a)+i);
+        __m512i B = _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b)+i);
+        accumulate = _mm512_add_epi64(_mm512_popcnt_epi64(_mm512_xor_si512(A, B)), accumulate);
+    }
+
+    const int done = blocks * sizeof(__m512i);
+    const int remaining = size - done;
+    if (remaining > 0) {
+        const __mmask64 mask = (~0ULL) >> (64 - remaining);
+        __m512i A = _mm512_maskz_loadu_epi8(mask, a + done);
+        __m512i B = _mm512_maskz_loadu_epi8(mask, b + done);
+        accumulate = _mm512_add_epi64(_mm512_popcnt_epi64(_mm512_xor_si512(A, B)), accumulate);
+    }
+
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+#endif // VPOPCNTDQ
+
+#endif // BR_SIMD_DISPATCH
+
+/*!
+ * \brief Selects the widest Hamming kernel supported by the running CPU.
+ */
+inline L1Kernel hamming_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+#ifdef BR_SIMD_VPOPCNTDQ
+    if (__builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512bw")) return hamming_avx512;
+#endif
+    if (__builtin_cpu_supports("popcnt")) return hamming_popcnt;
+#endif
+    return hamming_scalar;
+}
+
+inline int64_t hamming(const uchar *a, const uchar *b, int size)
+{
+    static const L1Kernel kernel = hamming_kernel();
+    return kernel(a, b, size);
+}
+
+// Int8 kernels accumulate the inner product of two symmetric int8 codes, and with Norms their squared norms for cosine.
+// Codes are expected in [-127, 127], so the x86 kernels multiply |a| by b with the sign of a as unsigned by signed bytes.
+
+template <bool Norms>
+inline void int8_dot_scalar(const int8_t *a, const int8_t *b, int size, int32_t *dots)
+{
+    int32_t ab = 0, aa = 0, bb = 0;
+    for (int i=0; i<size; i++) {
+        ab += a[i] * b[i];
+        if (Norms) {
+            aa += a[i] * a[i];
+            bb += b[i] * b[i];
+        }
+    }
+    dots[0] = ab;
+    if (Norms) {
+        dots[1] = aa;
+        dots[2] = bb;
+    }
+}
+
+#ifdef BR_SIMD_DISPATCH
+
+BR_TARGET("avx2")
+inline int32_t int8_hsum_avx2(__m256i v)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+template <bool Norms>
+BR_TARGET("avx2")
+inline void int8_dot_avx2(const int8_t *a, const int8_t *b, int size, int32_t *dots)
+{
+    const int blocks = size / sizeof(__m256i);
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i ab = _mm256_setzero_si256(), aa = ab, bb = ab;
+
+    for (int i=0; i<blocks; i++) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)+i);
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)+i);
+        const __m256i absA = _mm256_sign_epi8(A, A);
+        // Pairs of products are at most 2*127*127, so the 16-bit sums of maddubs never saturate
+        ab = _mm256_add_epi32(ab, _mm256_madd_epi16(_mm256_maddubs_epi16(absA, _mm256_sign_epi8(B, A)), ones));
+        if (Norms) {
+            const __m256i absB = _mm256_sign_epi8(B, B);
+            aa = _mm256_add_epi32(aa, _mm256_madd_epi16(_mm256_maddubs_epi16(absA, absA), ones));
+            bb = _mm256_add_epi32(bb, _mm256_madd_epi16(_mm256_maddubs_epi16(absB, absB), ones));
+        }
+    }
+
+    const int done = blocks * sizeof(__m256i);
+    int8_dot_scalar<Norms>(a + done, b + done, size - done, dots);
+    dots[0] += int8_hsum_avx2(ab);
+    if (Norms) {
+        dots[1] += int8_hsum_avx2(aa);
+        dots[2] += int8_hsum_avx2(bb);
+    }
+}
+
+// AVX-512 VNNI first shipped with GCC 8 and Clang 6
+#if (__GNUC__ >= 8) || (defined(__clang__) && (__clang_major__ >= 6))
+#define BR_SIMD_VNNI
+
+template <bool Norms>
+BR_TARGET("avx512f,avx512bw,avx512vnni")
+inline void int8_dot_vnni(const int8_t *a, const int8_t *b, int size, int32_t *dots)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i ab = zero, aa = zero, bb = zero;
+
+    for (int i=0; i<size; i+=sizeof(__m512i)) {
+        const int remaining = size - i;
+        const __mmask64 mask = (remaining >= int(sizeof(__m512i))) ? ~0ULL : (~0ULL) >> (64 - remaining);
+        const __m512i A = _mm512_maskz_loadu_epi8(mask, a + i);
+        const __m512i B = _mm512_maskz_loadu_epi8(mask, b + i);
+        const __m512i absA = _mm512_abs_epi8(A);
+        const __m512i signedB = _mm512_mask_sub_epi8(B, _mm512_movepi8_mask(A), zero, B);
+        ab = _mm512_dpbusd_epi32(ab, absA, signedB);
+        if (Norms) {
+            const __m512i absB = _mm512_abs_epi8(B);
+            aa = _mm512_dpbusd_epi32(aa, absA, absA);
+            bb = _mm512_dpbusd_epi32(bb, absB, absB);
+        }
+    }
+
+    dots[0] = _mm512_reduce_add_epi32(ab);
+    if (Norms) {
+        dots[1] = _mm512_reduce_add_epi32(aa);
+        dots[2] = _mm512_reduce_add_epi32(bb);
+    }
+}
+
+#endif // VNNI
+
+#endif // BR_SIMD_DISPATCH
+
+#if defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#include <arm_neon.h>
+#define BR_SIMD_SDOT
+
+template <bool Norms>
+inline void int8_dot_sdot(const int8_t *a, const int8_t *b, int size, int32_t *dots)
+{
+    const int blocks = size / 16;
+    int32x4_t ab = vdupq_n_s32(0), aa = ab, bb = ab;
+
+    for (int i=0; i<blocks; i++) {
+        const int8x16_t A = vld1q_s8(a + 16*i);
+        const int8x16_t B = vld1q_s8(b + 16*i);
+        ab = vdotq_s32(ab, A, B);
+        if (Norms) {
+            aa = vdotq_s32(aa, A, A);
+            bb = vdotq_s32(bb, B, B);
+        }
+    }
+
+    const int done = blocks * 16;
+    int8_dot_scalar<Norms>(a + done, b + done, size - done, dots);
+    dots[0] += vaddvq_s32(ab);
+    if (Norms) {
+        dots[1] += vaddvq_s32(aa);
+        dots[2] += vaddvq_s32(bb);
+    }
+}
+
+#endif // __ARM_FEATURE_DOTPROD
+
+typedef void (*Int8Kernel)(const int8_t *a, const int8_t *b, int size, int32_t *dots);
+
+/*!
+ * \brief Selects the widest int8 inner product kernel supported by the running CPU.
+ */
+template <bool Norms>
+inline Int8Kernel int8_dot_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+#ifdef BR_SIMD_VNNI
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) return int8_dot_vnni<Norms>;
+#endif
+    if (__builtin_cpu_supports("avx2")) return int8_dot_avx2<Norms>;
+#endif
+#ifdef BR_SIMD_SDOT
+    return int8_dot_sdot<Norms>;
+#else
+    return int8_dot_scalar<Norms>;
+#endif
+}
+
+inline float int8_dot(const int8_t *a, const int8_t *b, int size)
+{
+    static const Int8Kernel kernel = int8_dot_kernel<false>();
+    int32_t dots[1];
+    kernel(a, b, size, dots);
+    return dots[0];
+}
+
+inline float int8_cosine(const int8_t *a, const int8_t *b, int size)
+{
+    static const Int8Kernel kernel = int8_dot_kernel<true>();
+    int32_t dots[3];
+    kernel(a, b, size, dots);
+    if ((dots[1] == 0) || (dots[2] == 0))
+        return 0;
+    return dots[0] / (sqrtf(float(dots[1])) * sqrtf(float(dots[2])));
+}
+
 #endif // DISTANCE_SSE_H
@@ -0,0 +1,241 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_EMBEDDED
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMultiMap>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+#include <algorithm>
+
+#include "downloader.h"
+
+namespace br
+{
+
+struct DownloadRequest
+{
+    DownloadBatch *batch;
+    QUrl url;
+    int index, attempts, redirects;
+};
+
+// Owns the network access managers, all of its slots run on the network thread
+class DownloadEngine : public QObject
+{
+    Q_OBJECT
+
+    // Qt opens at most six connections per host for each manager, so more managers are made as requests need them
+    static const int connectionsPerManager = 6;
+    QList<QNetworkAccessManager*> managers;
+    QVector<int> managerActive;
+
+    QQueue<DownloadRequest*> pending;
+    QMultiMap<qint64, DownloadRequest*> delayed; // Keyed by when they may be retried
+    QHash<DownloadBatch*, int> batchActive;
+    QTimer *retryTimer;
+    QElapsedTimer clock;
+
+    DownloadEngine()
+    {
+        retryTimer = new QTimer(this);
+        retryTimer->setSingleShot(true);
+        connect(retryTimer, SIGNAL(timeout()), this, SLOT(retry()));
+        clock.start();
+    }
+
+public:
+    static DownloadEngine *instance()
+    {
+        static QMutex instanceLock;
+        static DownloadEngine *engine = NULL;
+        QMutexLocker locker(&instanceLock);
+        if (!engine) {
+            // Like the engine, the thread is never deleted so it outlives downloads made while statics are destroyed
+            QThread *thread = new QThread();
+            engine = new DownloadEngine();
+            engine->moveToThread(thread);
+            thread->start();
+        }
+        return engine;
+    }
+
+    void submit(DownloadRequest *request)
+    {
+        QMetaObject::invokeMethod(this, "enqueue", Qt::QueuedConnection, Q_ARG(void*, request));
+    }
+
+private:
+    static bool retryable(QNetworkReply::NetworkError error, int status)
+    {
+        if ((status == 429) || ((status >= 500) && (status < 600)))
+            return true;
+        switch (error) {
+          case QNetworkReply::ConnectionRefusedError:
+          case QNetworkReply::RemoteHostClosedError:
+          case QNetworkReply::TimeoutError:
+          case QNetworkReply::TemporaryNetworkFailureError:
+          case QNetworkReply::NetworkSessionFailedError:
+          case QNetworkReply::ProxyTimeoutError:
+          case QNetworkReply::UnknownNetworkError:
+            return true;
+          default:
+            return false;
+        }
+    }
+
+    void start(DownloadRequest *request)
+    {
+        int manager = 0;
+        for (int i=1; i<managers.size(); i++)
+            if (managerActive[i] < managerActive[manager])
+                manager = i;
+        if (managers.isEmpty() || (managerActive[manager] >= connectionsPerManager)) {
+            managers.append(new QNetworkAccessManager(this));
+            managerActive.append(0);
+            manager = managers.size() - 1;
+        }
+
+        QNetworkRequest networkRequest(request->url);
+        networkRequest.setRawHeader("User-Agent", "br");
+        QNetworkReply *reply = managers[manager]->get(networkRequest);
+        reply->setProperty("request", qVariantFromValue((void*) request));
+        connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+        managerActive[manager]++;
+        batchActive[request->batch]++;
+    }
+
+    void startPending()
+    {
+        // Requests of batches at their limit wait without holding back other batches
+        QQueue<DownloadRequest*> waiting;
+        while (!pending.isEmpty()) {
+            DownloadRequest *request = pending.dequeue();
+            if (batchActive.value(request->batch) < request->batch->maxActive) start(request);
+            else                                                               waiting.enqueue(request);
+        }
+        pending = waiting;
+    }
+
+    void scheduleRetry()
+    {
+        if (!delayed.isEmpty())
+            retryTimer->start(int(std::max(qint64(0), delayed.begin().key() - clock.elapsed())));
+    }
+
+private slots:
+    void enqueue(void *request)
+    {
+        pending.enqueue(static_cast<DownloadRequest*>(request));
+        startPending();
+    }
+
+    void replyFinished()
+    {
+        QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+        DownloadRequest *request = static_cast<DownloadRequest*>(reply->property("request").value<void*>());
+        reply->deleteLater();
+        managerActive[managers.indexOf(reply->manager())]--;
+        if (--batchActive[request->batch] == 0)
+            batchActive.remove(request->batch);
+
+        const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        const QUrl redirect = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
+        if (!redirect.isEmpty() && (request->redirects < 5)) {
+            request->url = request->url.resolved(redirect);
+            request->redirects++;
+            pending.enqueue(request);
+        } else if (retryable(reply->error(), status) && (request->attempts < request->batch->retries)) {
+            // Backoff doubles from 100 ms
+            delayed.insert(clock.elapsed() + (qint64(100) << request->attempts), request);
+            request->attempts++;
+            scheduleRetry();
+        } else {
+            const bool failed = (reply->error() != QNetworkReply::NoError);
+            request->batch->finish(request->index, failed ? QByteArray() : reply->readAll(), failed ? reply->errorString() : QString());
+            delete request;
+        }
+        startPending();
+    }
+
+    void retry()
+    {
+        const qint64 now = clock.elapsed();
+        while (!delayed.isEmpty() && (delayed.begin().key() <= now)) {
+            pending.enqueue(delayed.begin().value());
+            delayed.erase(delayed.begin());
+        }
+        scheduleRetry();
+        startPending();
+    }
+};
+
+DownloadBatch::DownloadBatch(const QList<QUrl> &urls, int maxActive, int retries)
+    : maxActive(std::max(1, maxActive)), retries(retries), returned(0), total(urls.size())
+{
+    DownloadEngine *engine = DownloadEngine::instance();
+    for (int i=0; i<urls.size(); i++) {
+        DownloadRequest *request = new DownloadRequest();
+        request->batch = this;
+        request->url = urls[i];
+        request->index = i;
+        request->attempts = 0;
+        request->redirects = 0;
+        engine->submit(request);
+    }
+}
+
+DownloadBatch::~DownloadBatch()
+{
+    QByteArray data;
+    QString error;
+    while (next(data, error) != -1);
+}
+
+int DownloadBatch::next(QByteArray &data, QString &error)
+{
+    QMutexLocker locker(&mutex);
+    if (returned == total)
+        return -1;
+    while (results.isEmpty())
+        finished.wait(&mutex);
+    const Result result = results.dequeue();
+    data = result.data;
+    error = result.error;
+    returned++;
+    return result.index;
+}
+
+void DownloadBatch::finish(int index, const QByteArray &data, const QString &error)
+{
+    Result result;
+    result.index = index;
+    result.data = data;
+    result.error = error;
+
+    QMutexLocker locker(&mutex);
+    results.enqueue(result);
+    finished.wakeOne();
+}
+
+} // namespace br
+
+#include "downloader.moc"
+#endif // BR_EMBEDDED
@@ -0,0 +1,63 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_DOWNLOADER_H
+#define BR_DOWNLOADER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QUrl>
+#include <QWaitCondition>
+
+namespace br
+{
+
+// Concurrent downloads on a network thread shared by the whole process.
+// Connections to each host are kept alive and reused across batches, at most maxActive requests of a batch are in flight,
+// and requests that fail with transient errors are retried with exponential backoff.
+class DownloadBatch
+{
+public:
+    DownloadBatch(const QList<QUrl> &urls, int maxActive = 16, int retries = 3);
+    ~DownloadBatch(); // Waits for outstanding requests
+
+    // Blocks until another download finishes and returns its index into urls, or -1 once every download has been returned
+    int next(QByteArray &data, QString &error);
+
+private:
+    friend class DownloadEngine;
+
+    struct Result
+    {
+        int index;
+        QByteArray data;
+        QString error;
+    };
+
+    int maxActive, retries, returned, total;
+    QMutex mutex;
+    QWaitCondition finished;
+    QQueue<Result> results;
+
+    void finish(int index, const QByteArray &data, const QString &error); // Called from the network thread
+};
+
+} // namespace br
+
+#endif // BR_DOWNLOADER_H
@@ -1,4 +1,5 @@
 #include "eigenutils.h"
+#include "scheduler.h"
 #include <openbr/openbr_plugin.h>
 
 using namespace Eigen;
@@ -12,6 +13,53 @@ float EigenUtils::stddev(const Eigen::MatrixXf& x) {
     return sqrt((x.array() - x.mean()).pow(2).sum() / (x.cols() * x.rows()));
 }
 
+// Rows [begin, end) of the lower triangle, each band is an independent matrix product
+template <typename Matrix>
+static void scatterBand(const Matrix *x, bool columns, Matrix *result, int begin, int end)
+{
+    if (columns) result->block(begin, 0, end-begin, end).noalias() = x->middleCols(begin, end-begin).transpose() * x->leftCols(end);
+    else         result->block(begin, 0, end-begin, end).noalias() = x->middleRows(begin, end-begin) * x->topRows(end).transpose();
+}
+
+template <typename Matrix>
+static Matrix scatterImpl(const Matrix &x, bool columns)
+{
+    const int dims = columns ? x.cols() : x.rows();
+    Matrix result(dims, dims);
+
+    // Band k ends at dims*sqrt(k/bands) so each band is roughly the same amount of work
+    const int bands = std::min(4 * std::max(Globals->parallelism, 1), dims);
+    if (bands <= 1) {
+        scatterBand(&x, columns, &result, 0, dims);
+    } else {
+        br::TaskGroup tasks;
+        int begin = 0;
+        for (int k=1; k<=bands; k++) {
+            const int end = (k == bands) ? dims : int(dims * sqrt(double(k) / bands));
+            if (end <= begin)
+                continue;
+            tasks.run(scatterBand<Matrix>, &x, columns, &result, begin, end);
+            begin = end;
+        }
+        tasks.wait();
+    }
+
+    for (int i=0; i<dims; i++)
+        for (int j=i+1; j<dims; j++)
+            result(i, j) = result(j, i);
+    return result;
+}
+
+MatrixXd EigenUtils::scatter(const MatrixXd &x, bool columns)
+{
+    return scatterImpl(x, columns);
+}
+
+MatrixXf EigenUtils::scatter(const MatrixXf &x, bool columns)
+{
+    return scatterImpl(x, columns);
+}
+
 MatrixXf EigenUtils::removeRowCol(const MatrixXf X, int row, int col) {
     MatrixXf Y(X.rows() - 1,X.cols() - 1);
 
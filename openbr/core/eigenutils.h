@@ -78,6 +78,10 @@ namespace EigenUtils
 
     // Compute the element-wise standard deviation
     float stddev(const Eigen::MatrixXf& x);
+
+    // Scatter matrix X*X^T, or X^T*X when columns is true, computed in parallel over lower-triangular row bands
+    Eigen::MatrixXd scatter(const Eigen::MatrixXd &x, bool columns = false);
+    Eigen::MatrixXf scatter(const Eigen::MatrixXf &x, bool columns = false);
 }
 
 template<typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols>
@@ -17,9 +17,12 @@
 #include "bee.h"
 #include "eval.h"
 #include "openbr/core/common.h"
+#include "openbr/core/nameindex.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
+#include <QFutureSynchronizer>
 #include <QMapIterator>
+#include <QtConcurrentRun>
 #include <cmath>
 
 using namespace cv;
@@ -29,6 +32,12 @@ namespace br
 
 static const int Max_Points = 500; // Maximum number of points to render on plots
 
+// Curves and score samples written to csv, lowered with e.g. results.csv[points=100] to keep reports over many runs small
+static int maxPoints(const File &csv)
+{
+    return std::max(2, csv.get<int>("points", Max_Points));
+}
+
 struct Comparison
 {
     float score;
@@ -134,6 +143,212 @@ static cv::Mat constructMatchingMask(const cv::Mat &scores, const FileList &targ
     return cv::Mat();
 }
 
+// Everything written to an evaluation .csv, however it was computed
+struct Evaluation
+{
+    qint64 rows, cols, genuineCount, impostorCount;
+    int totalImpostorSearches;
+    QList<OperatingPoint> operatingPoints, searchOperatingPoints;
+    QVector<int> firstGenuineReturns;
+    QList<float> sampledGenuineScores, sampledImpostorScores; // Score distribution samples of equal length, highest first
+    QStringList matches; // IM and GM lines around the EER
+};
+
+static float writeEvaluation(Evaluation &evaluation, const File &csv, const QString &target)
+{
+    float result = -1;
+    QList<OperatingPoint> &operatingPoints = evaluation.operatingPoints;
+    QList<OperatingPoint> &searchOperatingPoints = evaluation.searchOperatingPoints;
+    const QVector<int> &firstGenuineReturns = evaluation.firstGenuineReturns;
+    const qint64 genuineCount = evaluation.genuineCount, impostorCount = evaluation.impostorCount;
+    const int totalImpostorSearches = evaluation.totalImpostorSearches;
+
+    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
+    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
+
+    if (searchOperatingPoints.size() == 0) searchOperatingPoints.append(OperatingPoint(1, 1, 1));
+    if (searchOperatingPoints.size() == 1) searchOperatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (searchOperatingPoints.size() > 2)  searchOperatingPoints.takeLast();
+
+    // Write Metadata table
+    QStringList lines;
+    lines.append("Plot,X,Y");
+    lines.append("Metadata,"+QString::number(evaluation.cols)+",Gallery");
+    lines.append("Metadata,"+QString::number(evaluation.rows)+",Probe");
+    lines.append("Metadata,"+QString::number(genuineCount)+",Genuine");
+    lines.append("Metadata,"+QString::number(impostorCount)+",Impostor");
+    lines.append("Metadata,"+QString::number(evaluation.cols*evaluation.rows-(genuineCount+impostorCount))+",Ignored");
+    lines.append(evaluation.matches);
+
+    // Write Detection Error Tradeoff (DET), PRE, REC, Identification Error Tradeoff (IET)
+    float expFAR = csv.get<float>("FAR", std::max(ceil(log10(impostorCount)), 1.0));
+    float expFRR = csv.get<float>("FRR", std::max(ceil(log10(genuineCount)), 1.0));
+    float expFPIR = csv.get<float>("FPIR", std::max(ceil(log10(totalImpostorSearches)), 1.0));
+
+    const int points = maxPoints(csv);
+    float FARstep = expFAR / (float)(points - 1);
+    float FRRstep = expFRR / (float)(points - 1);
+    float FPIRstep = expFPIR / (float)(points - 1);
+
+    for (int i=0; i<points; i++) {
+        float FAR = pow(10, -expFAR + i*FARstep);
+        float FRR = pow(10, -expFRR + i*FRRstep);
+        float FPIR = pow(10, -expFPIR + i*FPIRstep);
+
+        OperatingPoint operatingPointFAR = getOperatingPointGivenFAR(operatingPoints, FAR);
+        OperatingPoint operatingPointTAR = getOperatingPointGivenTAR(operatingPoints, 1-FRR);
+        OperatingPoint searchOperatingPoint = getOperatingPointGivenFAR(searchOperatingPoints, FPIR);
+        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
+                                              QString::number(1-operatingPointFAR.TAR)));
+        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPointFAR.score),
+                                              QString::number(FAR)));
+        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPointTAR.score),
+                                              QString::number(FRR)));
+        lines.append(QString("IET,%1,%2").arg(QString::number(searchOperatingPoint.FAR),
+                                              QString::number(1-searchOperatingPoint.TAR)));
+    }
+
+    // Write TAR@FAR Table (TF)
+    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
+      lines.append(qPrintable(QString("TF,%1,%2").arg(
+						      QString::number(far, 'f'),
+						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
+
+    // Write FAR@TAR Table (FT)
+    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
+      lines.append(qPrintable(QString("FT,%1,%2").arg(
+                         QString::number(tar, 'f', 2),
+                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
+
+    //Write CMC Table (CT)
+    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
+    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
+    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
+    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
+    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
+    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
+
+    // Write FAR/TAR Bar Chart (BC)
+    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
+    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
+
+    // Attempt to read template size from enrolled gallery and write to output CSV
+    size_t maxSize(0);
+    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
+        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
+        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
+    }
+
+    // Write SD & KDE
+    for (int i=0; i<evaluation.sampledGenuineScores.size(); i++) {
+        lines.append(QString("SD,%1,Genuine").arg(QString::number(evaluation.sampledGenuineScores[i])));
+        lines.append(QString("SD,%1,Impostor").arg(QString::number(evaluation.sampledImpostorScores[i])));
+    }
+
+    // Write Cumulative Match Characteristic (CMC) curve
+    const int Max_Retrieval = 200;
+    const int Report_Retrieval = 5;
+    for (int i=1; i<=Max_Retrieval; i++) {
+        const float retrievalRate = getCMC(firstGenuineReturns, i);
+        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+    }
+
+    QtUtils::writeFile(csv, lines);
+    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
+    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
+    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
+    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
+    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
+
+    qDebug("FNIR @ FPIR = 0.1:   %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.1).TAR);
+    qDebug("FNIR @ FPIR = 0.01:  %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.01).TAR);
+
+    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+
+    return result;
+}
+
+// Sorts blocks concurrently and merges them pairwise, giving the same order as std::stable_sort
+static void sortRange(Comparison *begin, Comparison *end)
+{
+    std::stable_sort(begin, end);
+}
+
+static void mergeRange(Comparison *begin, Comparison *middle, Comparison *end)
+{
+    std::inplace_merge(begin, middle, end);
+}
+
+static void parallelStableSort(QVector<Comparison> &comparisons)
+{
+    const int size = comparisons.size();
+    const int blocks = std::min(Globals->parallelism, size / 65536);
+    if (blocks < 2) {
+        std::stable_sort(comparisons.begin(), comparisons.end());
+        return;
+    }
+
+    Comparison *data = comparisons.data();
+    QVector<int> bounds;
+    for (int i=0; i<=blocks; i++)
+        bounds.append(int(qint64(size) * i / blocks));
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<blocks; i++)
+        futures.addFuture(QtConcurrent::run(sortRange, data + bounds[i], data + bounds[i+1]));
+    futures.waitForFinished();
+
+    while (bounds.size() > 2) {
+        QVector<int> merged;
+        QFutureSynchronizer<void> merges;
+        for (int i=0; i+2<bounds.size(); i+=2) {
+            merges.addFuture(QtConcurrent::run(mergeRange, data + bounds[i], data + bounds[i+1], data + bounds[i+2]));
+            merged.append(bounds[i]);
+        }
+        if (bounds.size() % 2 == 0) merged.append(bounds[bounds.size()-2]);
+        merged.append(bounds.last());
+        merges.waitForFinished();
+        bounds = merged;
+    }
+}
+
+// Rank of the first genuine match of queries [begin, end), zero for queries without one.
+// Impostors tied with the best genuine score rank ahead of it, as in the sorted comparisons.
+static void firstGenuineReturnRange(const Mat *simmat, const Mat *mask, int *firstGenuineReturns, int begin, int end)
+{
+    for (int i=begin; i<end; i++) {
+        const BEE::SimmatValue *scores = simmat->ptr<BEE::SimmatValue>(i);
+        const BEE::MaskValue *masks = mask->ptr<BEE::MaskValue>(i);
+        float maxGenuine = 0;
+        bool mated = false;
+        for (int j=0; j<simmat->cols; j++)
+            if ((masks[j] == BEE::Match) && (scores[j] == scores[j]) && (!mated || (scores[j] > maxGenuine))) {
+                maxGenuine = scores[j];
+                mated = true;
+            }
+        if (!mated)
+            continue;
+
+        int rank = 1;
+        for (int j=0; j<simmat->cols; j++)
+            if ((masks[j] != BEE::DontCare) && (masks[j] != BEE::Match) && (scores[j] >= maxGenuine))
+                rank++;
+        firstGenuineReturns[i] = rank;
+    }
+}
+
+static QVector<int> computeFirstGenuineReturns(const Mat &simmat, const Mat &mask)
+{
+    QVector<int> firstGenuineReturns(simmat.rows, 0);
+    const int step = std::max(1, simmat.rows / (4 * Globals->parallelism));
+    QFutureSynchronizer<void> futures;
+    for (int begin=0; begin<simmat.rows; begin+=step)
+        futures.addFuture(QtConcurrent::run(firstGenuineReturnRange, &simmat, &mask, firstGenuineReturns.data(), begin, std::min(begin+step, simmat.rows)));
+    futures.waitForFinished();
+    return firstGenuineReturns;
+}
+
 float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const File &csv, int partition)
 {
     return Evaluate(scores, constructMatchingMask(scores, target, query, partition), csv, QString(), QString(), 0);
@@ -146,11 +361,20 @@ float Evaluate(const QString &simmat, const QString &mask, const File &csv, unsi
            mask.isEmpty() ? "" : qPrintable(" with " + mask),
            csv.name.isEmpty() ? "" : qPrintable(" to " + csv));
 
+    // Large matrices can be evaluated a block of rows at a time against score histograms
+    const int bins = csv.get<int>("bins", 0);
+    if ((bins > 0) && (simmat.endsWith(".mtx") || simmat.endsWith(".smtx")))
+        return StreamingEval(simmat, mask, csv, bins);
+
     // Read similarity matrix
     QString target, query;
     Mat scores;
+    QScopedPointer<BEE::MappedMatrix> mappedScores;
     if (simmat.endsWith(".mtx")) {
-        scores = BEE::readMatrix(simmat, &target, &query);
+        mappedScores.reset(new BEE::MappedMatrix(simmat));
+        scores = mappedScores->matrix();
+        target = mappedScores->target();
+        query = mappedScores->query();
     } else {
         QScopedPointer<Format> format(Factory<Format>::make(simmat));
         scores = format->read();
@@ -189,10 +413,8 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
     if (mask.type() != CV_8UC1)
         qFatal("Invalid mask format");
 
-    float result = -1;
-
     // Make comparisons
-    QList<Comparison> comparisons; comparisons.reserve(simmat.rows*simmat.cols);
+    QVector<Comparison> comparisons; comparisons.reserve(simmat.rows*simmat.cols);
 
     // Flags rows as being mated or non-mated searches
     // Positive value: mated search, negative value: non-mated search
@@ -234,13 +456,13 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
     if (impostorCount == 0) qFatal("No impostor scores!");
 
     // Sort comparisons by simmat_val (score)
-    std::stable_sort(comparisons.begin(), comparisons.end());
+    parallelStableSort(comparisons);
 
     QList<OperatingPoint> operatingPoints;
     QList<OperatingPoint> searchOperatingPoints;
     QList<float> genuines; genuines.reserve(sqrt((float)comparisons.size()));
     QList<float> impostors; impostors.reserve(comparisons.size());
-    QVector<int> firstGenuineReturns(simmat.rows, 0);
+    const QVector<int> firstGenuineReturns = computeFirstGenuineReturns(simmat, mask);
 
     int falsePositives = 0, previousFalsePositives = 0;
     int truePositives = 0, previousTruePositives = 0;
@@ -265,8 +487,6 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
                     trueSearches++;
                 }
                 genuines.append(comparison.score);
-                if (firstGenuineReturns[comparison.query] < 1)
-                    firstGenuineReturns[comparison.query] = abs(firstGenuineReturns[comparison.query]) + 1;
                 if ((comparison.score != -std::numeric_limits<float>::max()) &&
                     (comparison.score < minGenuineScore))
                     minGenuineScore = comparison.score;
@@ -278,8 +498,6 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
                     falseSearches++;
                 }
                 impostors.append(comparison.score);
-                if (firstGenuineReturns[comparison.query] < 1)
-                    firstGenuineReturns[comparison.query]--;
                 if ((comparison.score != -std::numeric_limits<float>::max()) &&
                     (comparison.score < minImpostorScore))
                     minImpostorScore = comparison.score;
@@ -306,22 +524,15 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
         }
     }
 
-    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
-    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
-    if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
-
-    if (searchOperatingPoints.size() == 0) searchOperatingPoints.append(OperatingPoint(1, 1, 1));
-    if (searchOperatingPoints.size() == 1) searchOperatingPoints.prepend(OperatingPoint(0, 0, 0));
-    if (searchOperatingPoints.size() > 2)  searchOperatingPoints.takeLast();
-
-    // Write Metadata table
-    QStringList lines;
-    lines.append("Plot,X,Y");
-    lines.append("Metadata,"+QString::number(simmat.cols)+",Gallery");
-    lines.append("Metadata,"+QString::number(simmat.rows)+",Probe");
-    lines.append("Metadata,"+QString::number(genuineCount)+",Genuine");
-    lines.append("Metadata,"+QString::number(impostorCount)+",Impostor");
-    lines.append("Metadata,"+QString::number(simmat.cols*simmat.rows-(genuineCount+impostorCount))+",Ignored");
+    Evaluation evaluation;
+    evaluation.rows = simmat.rows;
+    evaluation.cols = simmat.cols;
+    evaluation.genuineCount = genuineCount;
+    evaluation.impostorCount = impostorCount;
+    evaluation.totalImpostorSearches = totalImpostorSearches;
+    evaluation.operatingPoints = operatingPoints;
+    evaluation.searchOperatingPoints = searchOperatingPoints;
+    evaluation.firstGenuineReturns = firstGenuineReturns;
 
     QString filePath = Globals->path;
     if (matches != 0 && EERIndex != 0) {
@@ -330,7 +541,7 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
         unsigned int count = 0;
         for (int i = EERIndex-1; i >= 0; i--) {
             if (!comparisons[i].genuine) {
-                lines.append("IM,"+QString::number(comparisons[i].score)+","+targetFiles[comparisons[i].target].get<QString>("Label")+":"
+                evaluation.matches.append("IM,"+QString::number(comparisons[i].score)+","+targetFiles[comparisons[i].target].get<QString>("Label")+":"
                     +filePath+"/"+targetFiles[comparisons[i].target].name+":"+queryFiles[comparisons[i].query].get<QString>("Label")+":"+filePath+"/"+queryFiles[comparisons[i].query].name);
                 if (++count == matches) break;
             }
@@ -338,110 +549,242 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
         count = 0;
         for (int i = EERIndex+1; i < comparisons.size(); i++) {
             if (comparisons[i].genuine) {
-                lines.append("GM,"+QString::number(comparisons[i].score)+","+targetFiles[comparisons[i].target].get<QString>("Label")+":"
+                evaluation.matches.append("GM,"+QString::number(comparisons[i].score)+","+targetFiles[comparisons[i].target].get<QString>("Label")+":"
                     +filePath+"/"+targetFiles[comparisons[i].target].name+":"+queryFiles[comparisons[i].query].get<QString>("Label")+":"+filePath+"/"+queryFiles[comparisons[i].query].name);
                 if (++count == matches) break;
             }
         }
     }
 
-    // Write Detection Error Tradeoff (DET), PRE, REC, Identification Error Tradeoff (IET)
-    float expFAR = csv.get<float>("FAR", std::max(ceil(log10(impostorCount)), 1.0));
-    float expFRR = csv.get<float>("FRR", std::max(ceil(log10(genuineCount)), 1.0));
-    float expFPIR = csv.get<float>("FPIR", std::max(ceil(log10(totalImpostorSearches)), 1.0));
+    // Sample the score distributions
+    int points = qMin(qMin(maxPoints(csv), genuines.size()), impostors.size());
+    if (points > 1) {
+        for (int i=0; i<points; i++) {
+            float genuineScore = genuines[double(i) / double(points-1) * double(genuines.size()-1)];
+            float impostorScore = impostors[double(i) / double(points-1) * double(impostors.size()-1)];
+            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
+            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
+            evaluation.sampledGenuineScores.append(genuineScore);
+            evaluation.sampledImpostorScores.append(impostorScore);
+        }
+    }
 
-    float FARstep = expFAR / (float)(Max_Points - 1);
-    float FRRstep = expFRR / (float)(Max_Points - 1);
-    float FPIRstep = expFPIR / (float)(Max_Points - 1);
+    return writeEvaluation(evaluation, csv, target);
+}
 
-    for (int i=0; i<Max_Points; i++) {
-        float FAR = pow(10, -expFAR + i*FARstep);
-        float FRR = pow(10, -expFRR + i*FRRstep);
-        float FPIR = pow(10, -expFPIR + i*FPIRstep);
+// Genuine and impostor counts over a shared set of equal width score bins, the range doubles to fit new scores
+struct ScoreHistogram
+{
+    double low, width;
+    QVector<qint64> genuine, impostor;
+    qint64 floorGenuine, floorImpostor; // Scores of -FLT_MAX, which rank below every bin
+    float minGenuine, minImpostor;
+    qint64 genuineCount, impostorCount;
 
-        OperatingPoint operatingPointFAR = getOperatingPointGivenFAR(operatingPoints, FAR);
-        OperatingPoint operatingPointTAR = getOperatingPointGivenTAR(operatingPoints, 1-FRR);
-        OperatingPoint searchOperatingPoint = getOperatingPointGivenFAR(searchOperatingPoints, FPIR);
-        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
-                                              QString::number(1-operatingPointFAR.TAR)));
-        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPointFAR.score),
-                                              QString::number(FAR)));
-        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPointTAR.score),
-                                              QString::number(FRR)));
-        lines.append(QString("IET,%1,%2").arg(QString::number(searchOperatingPoint.FAR),
-                                              QString::number(1-searchOperatingPoint.TAR)));
-    }
+    explicit ScoreHistogram(int bins)
+        : low(0), width(0), genuine(std::max(bins + bins%2, 2), 0), impostor(genuine.size(), 0), floorGenuine(0), floorImpostor(0),
+          minGenuine(std::numeric_limits<float>::max()), minImpostor(std::numeric_limits<float>::max()), genuineCount(0), impostorCount(0) {}
 
-    // Write TAR@FAR Table (TF)
-    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
-      lines.append(qPrintable(QString("TF,%1,%2").arg(
-						      QString::number(far, 'f'),
-						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
+    void add(float score, bool isGenuine)
+    {
+        if (isGenuine) genuineCount++;
+        else           impostorCount++;
+
+        // Infinite scores would grow the range forever
+        score = std::max(std::min(score, std::numeric_limits<float>::max()), -std::numeric_limits<float>::max());
+        if (score == -std::numeric_limits<float>::max()) {
+            if (isGenuine) floorGenuine++;
+            else           floorImpostor++;
+            return;
+        }
 
-    // Write FAR@TAR Table (FT)
-    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
-      lines.append(qPrintable(QString("FT,%1,%2").arg(
-                         QString::number(tar, 'f', 2),
-                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
+        if (isGenuine) minGenuine = std::min(minGenuine, score);
+        else           minImpostor = std::min(minImpostor, score);
 
-    //Write CMC Table (CT)
-    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
-    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
-    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
-    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
-    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
-    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
+        const int bins = genuine.size();
+        if (width == 0) {
+            // Centered on the first score until the range is known
+            width = std::max(fabs(double(score)), 1.0) * 1e-6;
+            low = score - width * bins / 2;
+        }
+        while (score < low)                grow(false);
+        while (score >= low + width*bins) grow(true);
 
-    // Write FAR/TAR Bar Chart (BC)
-    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
-    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
+        const int bin = std::min(int((score - low) / width), bins-1);
+        if (isGenuine) genuine[bin]++;
+        else           impostor[bin]++;
+    }
 
-    // Attempt to read template size from enrolled gallery and write to output CSV
-    size_t maxSize(0);
-    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
-        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
-        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
+    // Merge adjacent bins to double the range upwards or downwards
+    void grow(bool up)
+    {
+        const int bins = genuine.size(), half = bins/2;
+        QVector<qint64> g(bins, 0), i(bins, 0);
+        for (int k=0; k<half; k++) {
+            g[(up ? 0 : half) + k] = genuine[2*k] + genuine[2*k+1];
+            i[(up ? 0 : half) + k] = impostor[2*k] + impostor[2*k+1];
+        }
+        if (!up) low -= width * bins;
+        width *= 2;
+        genuine = g;
+        impostor = i;
     }
 
-    // Write SD & KDE
-    int points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
-    QList<double> sampledGenuineScores; sampledGenuineScores.reserve(points);
-    QList<double> sampledImpostorScores; sampledImpostorScores.reserve(points);
+    // The lower edge of each bin is a threshold, matching the sorted sweep of Evaluate
+    QList<OperatingPoint> operatingPoints() const
+    {
+        QList<OperatingPoint> operatingPoints;
+        qint64 truePositives = 0, falsePositives = 0, previousTruePositives = 0, previousFalsePositives = 0;
+        for (int bin=genuine.size()-1; bin>=-1; bin--) {
+            truePositives += (bin >= 0) ? genuine[bin] : floorGenuine;
+            falsePositives += (bin >= 0) ? impostor[bin] : floorImpostor;
+            if ((falsePositives > previousFalsePositives) && (truePositives > previousTruePositives)) {
+                const float thresh = (bin >= 0) ? float(low + bin*width) : -std::numeric_limits<float>::max();
+                operatingPoints.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+                previousFalsePositives = falsePositives;
+                previousTruePositives = truePositives;
+            }
+        }
+        return operatingPoints;
+    }
 
-    if (points > 1) {
-        for (int i=0; i<points; i++) {
-            float genuineScore = genuines[double(i) / double(points-1) * double(genuines.size()-1)];
-            float impostorScore = impostors[double(i) / double(points-1) * double(impostors.size()-1)];
-            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
-            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
-            lines.append(QString("SD,%1,Genuine").arg(QString::number(genuineScore)));
-            lines.append(QString("SD,%1,Impostor").arg(QString::number(impostorScore)));
-            sampledGenuineScores.append(genuineScore);
-            sampledImpostorScores.append(impostorScore);
+    // Score at a position counting down from the highest, taken as the center of its bin
+    float quantile(qint64 position, bool isGenuine) const
+    {
+        const QVector<qint64> &counts = isGenuine ? genuine : impostor;
+        for (int bin=counts.size()-1; bin>=0; bin--) {
+            if (position < counts[bin])
+                return float(low + (bin + 0.5)*width);
+            position -= counts[bin];
         }
+        return isGenuine ? minGenuine : minImpostor;
     }
+};
 
-    // Write Cumulative Match Characteristic (CMC) curve
-    const int Max_Retrieval = 200;
-    const int Report_Retrieval = 5;
-    for (int i=1; i<=Max_Retrieval; i++) {
-        const float retrievalRate = getCMC(firstGenuineReturns, i);
-        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+float StreamingEval(const QString &simmat, const QString &mask, const File &csv, int bins)
+{
+    QFile file(simmat);
+    if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(simmat));
+    if (file.readLine()[1] != '2') qFatal("Invalid matrix header.");
+    const QString target = file.readLine().simplified();
+    const QString query = file.readLine().simplified();
+    const QStringList words = QString(file.readLine()).split(" ");
+    const int rows = words[1].toInt();
+    const int cols = words[2].toInt();
+
+    // Sparse matrices are held in memory and expanded a row at a time
+    const bool isSparse = (words[0][1] == 'R');
+    BEE::SparseMatrix sparse;
+    if (isSparse) sparse = BEE::readSparseMatrix(simmat);
+    const BEE::ScoreCodec codec(isSparse ? 'F' : words[0][1].toLatin1(), words.value(3).toFloat(), words.value(4).toFloat());
+
+    // Either a mask file read alongside the similarity matrix, or one block of mask rows at a time from the galleries
+    QFile maskFile(mask);
+    QScopedPointer<BEE::ImplicitMask> implicitMask;
+    bool packedMask = false;
+    if (!mask.isEmpty()) {
+        if (!maskFile.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(mask));
+        for (int i=0; i<3; i++) maskFile.readLine();
+        packedMask = (maskFile.readLine()[1] == 'P');
+    } else {
+        if (target.isEmpty()) qFatal("Unspecified target gallery.");
+        if (query.isEmpty()) qFatal("Unspecified query gallery.");
+        const FileList targetFiles = TemplateList::fromGallery(target).files();
+        const FileList queryFiles = TemplateList::fromGallery(query).files();
+        if ((targetFiles.size() != cols) || (queryFiles.size() != rows))
+            qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", rows, cols, queryFiles.size(), targetFiles.size());
+        implicitMask.reset(new BEE::ImplicitMask(targetFiles, queryFiles));
     }
 
-    QtUtils::writeFile(csv, lines);
-    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
-    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
-    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
-    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
-    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
+    ScoreHistogram scores(bins), searches(bins);
+    QVector<int> firstGenuineReturns(rows, 0);
+    int totalGenuineSearches = 0, totalImpostorSearches = 0, numNaNs = 0;
+
+    // Roughly 64 MB of scores per block, or as many rows as fit under Context::memoryLimit
+    const qint64 scoreRowBytes = qint64(cols) * sizeof(BEE::SimmatValue);
+    const int blockRows = std::max(1, std::min(rows, Globals->budgetedBlock(scoreRowBytes, 0, int((qint64(64) << 20) / scoreRowBytes))));
+    Mat block(blockRows, cols, CV_32FC1), truth(1, cols, CV_8UC1);
+    const qint64 maskRowBytes = packedMask ? BEE::packedMaskRowBytes(cols) : cols;
+    QByteArray maskRow(maskRowBytes, 0), encoded;
+    for (int begin=0; begin<rows; begin+=blockRows) {
+        const int count = std::min(blockRows, rows - begin);
+        const qint64 bytes = qint64(count) * cols * codec.elementSize();
+        if (isSparse) {
+            for (int i=0; i<count; i++)
+                sparse.row(begin+i, block.ptr<BEE::SimmatValue>(i));
+        } else if (codec.type() == 'F') {
+            if (file.read((char*) block.data, bytes) != bytes)
+                qFatal("Didn't read complete row!");
+        } else {
+            encoded.resize(bytes);
+            if (file.read(encoded.data(), bytes) != bytes)
+                qFatal("Didn't read complete row!");
+            codec.decode((const uchar*) encoded.constData(), block.ptr<BEE::SimmatValue>(), count * cols);
+        }
 
-    qDebug("FNIR @ FPIR = 0.1:   %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.1).TAR);
-    qDebug("FNIR @ FPIR = 0.01:  %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.01).TAR);
+        for (int i=0; i<count; i++) {
+            const BEE::SimmatValue *score = block.ptr<BEE::SimmatValue>(i);
 
-    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+            // One mask row at a time, either read from the mask file or computed from the gallery labels
+            BEE::MaskValue *maskValue = truth.ptr<BEE::MaskValue>(0);
+            if (implicitMask) {
+                implicitMask->row(begin+i, maskValue);
+            } else {
+                if (maskFile.read(packedMask ? maskRow.data() : (char*) maskValue, maskRowBytes) != maskRowBytes)
+                    qFatal("Didn't read complete mask row!");
+                if (packedMask) BEE::unpackMaskRow((const uchar*) maskRow.constData(), maskValue, cols);
+            }
 
-    return result;
+            // A query's first genuine return is preceded by every impostor scoring at least as high
+            float maxGenuine = -std::numeric_limits<float>::infinity(), maxImpostor = maxGenuine;
+            bool hasImpostor = false;
+            for (int j=0; j<cols; j++) {
+                if (maskValue[j] == BEE::DontCare) continue;
+                if (score[j] != score[j]) { numNaNs++; continue; }
+                const bool genuine = (maskValue[j] == BEE::Match);
+                scores.add(score[j], genuine);
+                if (genuine) maxGenuine = std::max(maxGenuine, score[j]);
+                else       { maxImpostor = std::max(maxImpostor, score[j]); hasImpostor = true; }
+            }
+
+            if (maxGenuine != -std::numeric_limits<float>::infinity()) {
+                int rank = 1;
+                for (int j=0; j<cols; j++)
+                    if ((maskValue[j] == BEE::NonMatch) && (score[j] >= maxGenuine))
+                        rank++;
+                firstGenuineReturns[begin+i] = rank;
+                searches.add(maxGenuine, true);
+                totalGenuineSearches++;
+            } else if (hasImpostor) {
+                searches.add(maxImpostor, false);
+                totalImpostorSearches++;
+            }
+        }
+    }
+
+    if (numNaNs > 0) qWarning("Encountered %d NaN scores!", numNaNs);
+    if (scores.genuineCount == 0) qFatal("No genuine scores!");
+    if (scores.impostorCount == 0) qFatal("No impostor scores!");
+
+    Evaluation evaluation;
+    evaluation.rows = rows;
+    evaluation.cols = cols;
+    evaluation.genuineCount = scores.genuineCount;
+    evaluation.impostorCount = scores.impostorCount;
+    evaluation.totalImpostorSearches = totalImpostorSearches;
+    evaluation.operatingPoints = scores.operatingPoints();
+    evaluation.searchOperatingPoints = searches.operatingPoints();
+    evaluation.firstGenuineReturns = firstGenuineReturns;
+
+    const qint64 points = qMin(qMin(qint64(maxPoints(csv)), scores.genuineCount), scores.impostorCount);
+    if (points > 1) {
+        for (qint64 i=0; i<points; i++) {
+            evaluation.sampledGenuineScores.append(scores.quantile(double(i) / double(points-1) * double(scores.genuineCount-1), true));
+            evaluation.sampledImpostorScores.append(scores.quantile(double(i) / double(points-1) * double(scores.impostorCount-1), false));
+        }
+    }
+
+    return writeEvaluation(evaluation, csv, target);
 }
 
 void assertEval(const QString &simmat, const QString &mask, float accuracy)
@@ -494,6 +837,8 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
     qint64 cols = words[2].toLongLong();
 
     bool isMask = words[0][1] == 'B';
+    if (!isMask && (words[0][1] != 'F'))
+        qFatal("In place evaluation requires a single precision similarity matrix.");
     qint64 typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
 
     // Get matrix data
@@ -567,7 +912,7 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
     qint64 highImpostors = 0;
 
     QScopedPointer<Gallery> probeGallery2 (Gallery::make(query));
-    int bSize = 10000;
+    int bSize = std::max(1, Globals->budgetedBlock(rowSize, 0, 10000));
     probeGallery2->set_readBlockSize(bSize);
     done = false;
     row_count  = 0;
@@ -649,7 +994,7 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
     lines.append("Metadata,"+QString::number(cols*rows-(genTotal+imposterTotal))+",Ignored");
 
     // Write Detection Error Tradeoff (DET), PRE, REC
-    int points = qMin(operatingPoints.size(), Max_Points);
+    int points = qMin(operatingPoints.size(), maxPoints(csv));
     for (int i=0; i<points; i++) {
         const OperatingPoint &operatingPoint = operatingPoints[double(i) / double(points-1) * double(operatingPoints.size()-1)];
         lines.append(QString("DET,%1,%2").arg(QString::number(operatingPoint.FAR),
@@ -682,49 +1027,109 @@ struct Counter
     }
 };
 
-void EvalClassification(const QString &predictedGallery, const QString &truthGallery, QString predictedProperty, QString truthProperty)
+// Row of the truth template for each predicted template, joined by file name
+static QVector<int> joinByName(const TemplateList &predicted, const TemplateList &truth)
 {
-    qDebug("Evaluating classification of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
-
-    if (predictedProperty.isEmpty())
-        predictedProperty = "Label";
-    // If predictedProperty is specified, but truthProperty isn't, copy over the value from
-    // predicted property
-    else if (truthProperty.isEmpty())
-        truthProperty = predictedProperty;
+    QVector<int> rows(predicted.size());
 
-    if (truthProperty.isEmpty())
-        truthProperty = "Label";
+    // Galleries written in the same order don't need an index
+    bool aligned = (predicted.size() == truth.size());
+    for (int i=0; aligned && (i<predicted.size()); i++) {
+        aligned = (predicted[i].file.name == truth[i].file.name);
+        rows[i] = i;
+    }
+    if (aligned)
+        return rows;
+
+    QStringList truthNames; truthNames.reserve(truth.size());
+    foreach (const Template &t, truth)
+        truthNames.append(t.file.name);
+    const NameIndex index(truthNames);
+    if (index.size() < truthNames.size())
+        qWarning("%d ground truth files repeat the name of an earlier one, predictions are joined to the first.", truthNames.size() - index.size());
+    for (int i=0; i<predicted.size(); i++) {
+        rows[i] = index.indexOf(predicted[i].file.name);
+        if (rows[i] == -1) qFatal("Could not identify ground truth for file: %s", qPrintable(predicted[i].file.name));
+    }
+    return rows;
+}
 
-    TemplateList predicted(TemplateList::fromGallery(predictedGallery));
-    TemplateList truth(TemplateList::fromGallery(truthGallery));
-    if (predicted.size() != truth.size()) qFatal("Input size mismatch.");
+// Joined pairs are evaluated in a few chunks per thread
+static int joinStep(int size)
+{
+    const int chunks = std::max(1, 4*abs(Globals->parallelism));
+    return std::max(1, (size + chunks - 1) / chunks);
+}
 
-    QHash<QString, Counter> counters;
-    for (int i=0; i<predicted.size(); i++) {
-        if (predicted[i].file.name != truth[i].file.name)
-            qFatal("Input order mismatch.");
+struct PropertyJoin
+{
+    const TemplateList *predicted, *truth;
+    const QVector<int> *rows;
+    QString predictedProperty, truthProperty;
+};
 
-        QString predictedSubject = predicted[i].file.get<QString>(predictedProperty);
-        QString trueSubject = truth[i].file.get<QString>(truthProperty);
+static void countClassifications(const PropertyJoin *join, int begin, int end, QHash<QString, Counter> *counters)
+{
+    for (int i=begin; i<end; i++) {
+        QString predictedSubject = (*join->predicted)[i].file.get<QString>(join->predictedProperty);
+        QString trueSubject = (*join->truth)[(*join->rows)[i]].file.get<QString>(join->truthProperty);
 
         QStringList predictedSubjects(predictedSubject);
         QStringList trueSubjects(trueSubject);
 
         foreach (const QString &subject, trueSubjects.toVector() /* Hack to copy the list. */) {
             if (predictedSubjects.contains(subject)) {
-                counters[subject].truePositive++;
+                (*counters)[subject].truePositive++;
                 trueSubjects.removeOne(subject);
                 predictedSubjects.removeOne(subject);
             } else {
-                counters[subject].falseNegative++;
+                (*counters)[subject].falseNegative++;
             }
         }
 
-        for (int i=0; i<trueSubjects.size(); i++)
+        for (int j=0; j<trueSubjects.size(); j++)
             foreach (const QString &subject, predictedSubjects)
-                counters[subject].falsePositive += 1.f / predictedSubjects.size();
+                (*counters)[subject].falsePositive += 1.f / predictedSubjects.size();
     }
+}
+
+void EvalClassification(const QString &predictedGallery, const QString &truthGallery, QString predictedProperty, QString truthProperty)
+{
+    qDebug("Evaluating classification of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
+
+    if (predictedProperty.isEmpty())
+        predictedProperty = "Label";
+    // If predictedProperty is specified, but truthProperty isn't, copy over the value from
+    // predicted property
+    else if (truthProperty.isEmpty())
+        truthProperty = predictedProperty;
+
+    if (truthProperty.isEmpty())
+        truthProperty = "Label";
+
+    const TemplateList predicted(TemplateList::fromGallery(predictedGallery));
+    const TemplateList truth(TemplateList::fromGallery(truthGallery));
+    const QVector<int> rows = joinByName(predicted, truth);
+
+    const PropertyJoin join = { &predicted, &truth, &rows, predictedProperty, truthProperty };
+    const int step = joinStep(predicted.size());
+    QVector< QHash<QString, Counter> > blocks((predicted.size() + step - 1) / step);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<predicted.size(); i+=step) {
+        const int end = std::min(predicted.size(), i + step);
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(countClassifications, &join, i, end, &blocks[i/step]));
+        else                                                          countClassifications (&join, i, end, &blocks[i/step]);
+    }
+    futures.waitForFinished();
+
+    QHash<QString, Counter> counters;
+    foreach (const QHash<QString, Counter> &block, blocks)
+        for (QHash<QString, Counter>::const_iterator it = block.begin(); it != block.end(); ++it) {
+            Counter &counter = counters[it.key()];
+            counter.truePositive += it.value().truePositive;
+            counter.falsePositive += it.value().falsePositive;
+            counter.falseNegative += it.value().falseNegative;
+        }
 
     const QStringList keys = counters.keys();
     QSharedPointer<Output> output(Output::make("", FileList() << "Count" << "Precision" << "Recall" << "F-score", FileList(keys)));
@@ -779,7 +1184,13 @@ struct SortedDetection
     SortedDetection() : truth_idx(-1), predicted_idx(-1), overlap(-1) {}
     SortedDetection(int truth_idx_, int predicted_idx_, float overlap_)
         : truth_idx(truth_idx_), predicted_idx(predicted_idx_), overlap(overlap_) {}
-    inline bool operator<(const SortedDetection &other) const { return overlap > other.overlap; }
+    inline bool operator<(const SortedDetection &other) const
+    {
+        // Ties are broken by index so association doesn't depend on the order candidates were found
+        if (overlap != other.overlap) return overlap > other.overlap;
+        if (truth_idx != other.truth_idx) return truth_idx < other.truth_idx;
+        return predicted_idx < other.predicted_idx;
+    }
 };
 
 struct Detections
@@ -950,66 +1361,176 @@ static inline int getNumberOfImages(const QMap<QString, Detections> detections)
     return detections.keys().size();
 }
 
-static int associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+// Uniform grid over an image's ground truth boxes, so each prediction is only compared against nearby truth
+class DetectionGrid
 {
-    float dLeftTotal = 0.0, dRightTotal = 0.0, dTopTotal = 0.0, dBottomTotal = 0.0;
-    int count = 0, totalTrueDetections = 0;
+    QRectF bounds;
+    qreal cellSize;
+    int columns, rows;
+    QVector< QVector<int> > cells;
 
-    foreach (Detections detections, all.values()) {
-        totalTrueDetections += detections.truth.size();
-        // Try to associate ground truth detections with predicted detections
-
-        QList<SortedDetection> sortedDetections; sortedDetections.reserve(detections.truth.size() * detections.predicted.size());
-        for (int t = 0; t < detections.truth.size(); t++) {
-            const Detection truth = detections.truth[t];
-            for (int p = 0; p < detections.predicted.size(); p++) {
-                Detection predicted = detections.predicted[p];
-
-                float predictedWidth = predicted.boundingBox.width();
-                float x, y, width, height;
-                x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
-                y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
-                width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
-                height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
-                Detection newPredicted(QRectF(x, y, width, height), 0.0);
-
-                const float overlap = truth.overlap(newPredicted);
-                if (overlap > 0)
-                    sortedDetections.append(SortedDetection(t, p, overlap));
-            }
+    void cellRange(const QRectF &box, int &left, int &top, int &right, int &bottom) const
+    {
+        left   = qBound(0, int((box.left()   - bounds.left()) / cellSize), columns-1);
+        right  = qBound(0, int((box.right()  - bounds.left()) / cellSize), columns-1);
+        top    = qBound(0, int((box.top()    - bounds.top())  / cellSize), rows-1);
+        bottom = qBound(0, int((box.bottom() - bounds.top())  / cellSize), rows-1);
+    }
+
+public:
+    explicit DetectionGrid(const QList<Detection> &truth)
+        : cellSize(1), columns(0), rows(0)
+    {
+        if (truth.isEmpty()) return;
+
+        // Cells about the size of an average box keep both the candidates per query and the cells per box small
+        qreal totalSide = 0;
+        for (int t=0; t<truth.size(); t++) {
+            const QRectF box = truth[t].boundingBox.normalized();
+            bounds = (t == 0) ? box : bounds.united(box);
+            totalSide += std::max(box.width(), box.height());
+        }
+        // Cells no smaller than needed for about four per box, however small the boxes are relative to the image
+        const qreal maxCells = 4.0 * truth.size();
+        const qreal minCellSize = std::max(std::sqrt(bounds.width() * bounds.height() / maxCells), std::max(bounds.width(), bounds.height()) / maxCells);
+        cellSize = std::max(totalSide / truth.size(), minCellSize);
+        if (!(cellSize > 0)) cellSize = 1;
+        columns = int(bounds.width() / cellSize) + 1;
+        rows = int(bounds.height() / cellSize) + 1;
+        cells.resize(columns * rows);
+
+        for (int t=0; t<truth.size(); t++) {
+            int left, top, right, bottom;
+            cellRange(truth[t].boundingBox.normalized(), left, top, right, bottom);
+            for (int y=top; y<=bottom; y++)
+                for (int x=left; x<=right; x++)
+                    cells[y*columns + x].append(t);
         }
+    }
 
-        std::sort(sortedDetections.begin(), sortedDetections.end());
+    // Truth indices whose cells overlap box, visited[] de-duplicates using the unique query id
+    void candidates(const QRectF &box, int query, QVector<int> &visited, QVector<int> &result) const
+    {
+        result.clear();
+        if (cells.isEmpty()) return;
+        const QRectF normalized = box.normalized();
+        if (!normalized.intersects(bounds)) return;
+
+        int left, top, right, bottom;
+        cellRange(normalized, left, top, right, bottom);
+        for (int y=top; y<=bottom; y++)
+            for (int x=left; x<=right; x++)
+                foreach (int t, cells[y*columns + x])
+                    if (visited[t] != query) {
+                        visited[t] = query;
+                        result.append(t);
+                    }
+    }
+};
 
-        QList<int> removedTruth;
-        QList<int> removedPredicted;
+// The result of associating one image's predictions with its ground truth
+struct ImageAssociation
+{
+    QList<ResolvedDetection> resolved, falseNegative;
+    float dLeftTotal, dRightTotal, dTopTotal, dBottomTotal;
+    int count;
 
-        foreach (const SortedDetection &detection, sortedDetections) {
-            if (removedTruth.contains(detection.truth_idx) || removedPredicted.contains(detection.predicted_idx))
-                continue;
+    ImageAssociation() : dLeftTotal(0), dRightTotal(0), dTopTotal(0), dBottomTotal(0), count(0) {}
+};
+
+static void associateImage(const Detections &detections, const QRectF &offsets, ImageAssociation &result)
+{
+    // Try to associate ground truth detections with predicted detections
+    const DetectionGrid grid(detections.truth);
+    QVector<int> visited(detections.truth.size(), -1), nearby;
+    QList<SortedDetection> sortedDetections;
+    for (int p = 0; p < detections.predicted.size(); p++) {
+        const Detection &predicted = detections.predicted[p];
+
+        float predictedWidth = predicted.boundingBox.width();
+        float x, y, width, height;
+        x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
+        y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
+        width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
+        height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
+        Detection newPredicted(QRectF(x, y, width, height), 0.0);
+
+        grid.candidates(newPredicted.boundingBox, p, visited, nearby);
+        foreach (int t, nearby) {
+            const float overlap = detections.truth[t].overlap(newPredicted);
+            if (overlap > 0)
+                sortedDetections.append(SortedDetection(t, p, overlap));
+        }
+    }
 
-            const Detection truth = detections.truth[detection.truth_idx];
-            const Detection predicted = detections.predicted[detection.predicted_idx];
+    std::sort(sortedDetections.begin(), sortedDetections.end());
 
-            if (!truth.ignore) resolved.append(ResolvedDetection(predicted.confidence, detection.overlap));
+    QVector<bool> removedTruth(detections.truth.size(), false);
+    QVector<bool> removedPredicted(detections.predicted.size(), false);
 
-            removedTruth.append(detection.truth_idx);
-            removedPredicted.append(detection.predicted_idx);
+    foreach (const SortedDetection &detection, sortedDetections) {
+        if (removedTruth[detection.truth_idx] || removedPredicted[detection.predicted_idx])
+            continue;
 
-            if (offsets.x() == 0 && detection.overlap > 0.3) {
-                count++;
-                float width = predicted.boundingBox.width();
-                dLeftTotal += (truth.boundingBox.left() - predicted.boundingBox.left()) / width;
-                dRightTotal += (truth.boundingBox.right() - predicted.boundingBox.right()) / width;
-                dTopTotal += (truth.boundingBox.top() - predicted.boundingBox.top()) / width;
-                dBottomTotal += (truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width;
-            }
+        const Detection &truth = detections.truth[detection.truth_idx];
+        const Detection &predicted = detections.predicted[detection.predicted_idx];
+
+        if (!truth.ignore) result.resolved.append(ResolvedDetection(predicted.confidence, detection.overlap));
+
+        removedTruth[detection.truth_idx] = true;
+        removedPredicted[detection.predicted_idx] = true;
+
+        if (offsets.x() == 0 && detection.overlap > 0.3) {
+            result.count++;
+            float width = predicted.boundingBox.width();
+            result.dLeftTotal += (truth.boundingBox.left() - predicted.boundingBox.left()) / width;
+            result.dRightTotal += (truth.boundingBox.right() - predicted.boundingBox.right()) / width;
+            result.dTopTotal += (truth.boundingBox.top() - predicted.boundingBox.top()) / width;
+            result.dBottomTotal += (truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width;
         }
+    }
+
+    for (int i = 0; i < detections.predicted.size(); i++)
+        if (!removedPredicted[i]) result.resolved.append(ResolvedDetection(detections.predicted[i].confidence, 0));
+    for (int i = 0; i < detections.truth.size(); i++)
+        if (!removedTruth[i] && !detections.truth[i].ignore) result.falseNegative.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
+}
+
+static void associateImages(const QList<Detections> *images, const QRectF *offsets, int begin, int end, QVector<ImageAssociation> *results)
+{
+    for (int i=begin; i<end; i++)
+        associateImage((*images)[i], *offsets, (*results)[i]);
+}
 
-        for (int i = 0; i < detections.predicted.size(); i++)
-            if (!removedPredicted.contains(i)) resolved.append(ResolvedDetection(detections.predicted[i].confidence, 0));
-        for (int i = 0; i < detections.truth.size(); i++)
-            if (!removedTruth.contains(i) && !detections.truth[i].ignore) falseNegative.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
+static int associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+{
+    float dLeftTotal = 0.0, dRightTotal = 0.0, dTopTotal = 0.0, dBottomTotal = 0.0;
+    int count = 0, totalTrueDetections = 0;
+
+    // Images are associated independently, a few chunks per thread balance images with many boxes
+    const QList<Detections> images = all.values();
+    QVector<ImageAssociation> results(images.size());
+    const int chunks = std::max(1, 4*abs(Globals->parallelism));
+    const int stepSize = std::max(1, (images.size() + chunks - 1) / chunks);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<images.size(); i+=stepSize) {
+        const int end = std::min(images.size(), i + stepSize);
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(associateImages, &images, (const QRectF*) &offsets, i, end, &results));
+        else                                                          associateImages (&images, (const QRectF*) &offsets, i, end, &results);
+    }
+    futures.waitForFinished();
+
+    // Merged in image order, as before
+    for (int i=0; i<images.size(); i++) {
+        const ImageAssociation &result = results[i];
+        totalTrueDetections += images[i].truth.size();
+        resolved.append(result.resolved);
+        falseNegative.append(result.falseNegative);
+        dLeftTotal += result.dLeftTotal;
+        dRightTotal += result.dRightTotal;
+        dTopTotal += result.dTopTotal;
+        dBottomTotal += result.dBottomTotal;
+        count += result.count;
     }
 
     if (offsets.x() == 0) {
@@ -1135,50 +1656,86 @@ static void projectAndWrite(Transform *t, const Template &src, const QString &fi
     OpenCVUtils::saveImage(dst.m(),filePath);
 }
 
+struct LandmarkJoin
+{
+    const TemplateList *predicted, *truth;
+    const QVector<int> *rows;
+    int normalizationIndexA, normalizationIndexB;
+};
+
+struct LandmarkError
+{
+    bool skipped;
+    float normalizedLength;
+    QVector<float> pointErrors;
+};
+
+static void measureLandmarks(const LandmarkJoin *join, int begin, int end, QVector<LandmarkError> *results)
+{
+    for (int i=begin; i<end; i++) {
+        LandmarkError &result = (*results)[i];
+        const QList<QPointF> predictedPoints = (*join->predicted)[i].file.points();
+        const QList<QPointF> truthPoints = (*join->truth)[(*join->rows)[i]].file.points();
+        result.skipped = (predictedPoints.size() != truthPoints.size() || truthPoints.contains(QPointF(-1,-1)));
+        if (result.skipped)
+            continue;
+
+        if (join->normalizationIndexA >= truthPoints.size()) qFatal("Normalization index A is out of range.");
+        if (join->normalizationIndexB >= truthPoints.size()) qFatal("Normalization index B is out of range.");
+        result.normalizedLength = QtUtils::euclideanLength(truthPoints[join->normalizationIndexB] - truthPoints[join->normalizationIndexA]);
+        result.pointErrors.resize(predictedPoints.size());
+        for (int j=0; j<predictedPoints.size(); j++)
+            result.pointErrors[j] = QtUtils::euclideanLength(predictedPoints[j] - truthPoints[j])/result.normalizedLength;
+    }
+}
+
 float EvalLandmarking(const QString &predictedGallery, const QString &truthGallery, const QString &csv, int normalizationIndexA, int normalizationIndexB, int sampleIndex, int totalExamples)
 {
     qDebug("Evaluating landmarking of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
     TemplateList predicted(TemplateList::fromGallery(predictedGallery));
     TemplateList truth(TemplateList::fromGallery(truthGallery));
-    QStringList predictedNames = File::get<QString>(predicted, "name");
-    QStringList truthNames = File::get<QString>(truth, "name");
+    const QVector<int> rows = joinByName(predicted, truth);
+
+    const LandmarkJoin join = { &predicted, &truth, &rows, normalizationIndexA, normalizationIndexB };
+    QVector<LandmarkError> errors(predicted.size());
+    const int step = joinStep(predicted.size());
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<predicted.size(); i+=step) {
+        const int end = std::min(predicted.size(), i + step);
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(measureLandmarks, &join, i, end, &errors));
+        else                                                          measureLandmarks (&join, i, end, &errors);
+    }
+    futures.waitForFinished();
 
+    // Pairs that weren't skipped, aligned so predicted[i] is compared to truth[i]
+    TemplateList keptPredicted, keptTruth;
     int skipped = 0;
     QList< QList<float> > pointErrors;
     QList<float> imageErrors;
     QList<float> normalizedLengths;
     for (int i=0; i<predicted.size(); i++) {
-        const QString &predictedName = predictedNames[i];
-        const int truthIndex = truthNames.indexOf(predictedName);
-        if (truthIndex == -1) qFatal("Could not identify ground truth for file: %s", qPrintable(predictedName));
-        const QList<QPointF> predictedPoints = predicted[i].file.points();
-        const QList<QPointF> truthPoints = truth[truthIndex].file.points();
-        if (predictedPoints.size() != truthPoints.size() || truthPoints.contains(QPointF(-1,-1))) {
-            predicted.removeAt(i);
-            predictedNames.removeAt(i);
-            truth.removeAt(i);
-            truthNames.removeAt(i);
-            i--; skipped++;
+        const LandmarkError &error = errors[i];
+        if (error.skipped) {
+            skipped++;
             continue;
         }
+        keptPredicted.append(predicted[i]);
+        keptTruth.append(truth[rows[i]]);
 
-        while (pointErrors.size() < predictedPoints.size())
+        while (pointErrors.size() < error.pointErrors.size())
             pointErrors.append(QList<float>());
 
         // Want to know error for every image.
-
-        if (normalizationIndexA >= truthPoints.size()) qFatal("Normalization index A is out of range.");
-        if (normalizationIndexB >= truthPoints.size()) qFatal("Normalization index B is out of range.");
-        const float normalizedLength = QtUtils::euclideanLength(truthPoints[normalizationIndexB] - truthPoints[normalizationIndexA]);
-        normalizedLengths.append(normalizedLength);
+        normalizedLengths.append(error.normalizedLength);
         float totalError = 0;
-        for (int j=0; j<predictedPoints.size(); j++) {
-            float error = QtUtils::euclideanLength(predictedPoints[j] - truthPoints[j])/normalizedLength;
-            totalError += error;
-            pointErrors[j].append(error);
+        for (int j=0; j<error.pointErrors.size(); j++) {
+            totalError += error.pointErrors[j];
+            pointErrors[j].append(error.pointErrors[j]);
         }
-        imageErrors.append(totalError/predictedPoints.size());
+        imageErrors.append(totalError/error.pointErrors.size());
     }
+    predicted = keptPredicted;
+    truth = keptTruth;
 
     qDebug() << "Skipped" << skipped << "files due to point size mismatch.";
 
@@ -1245,6 +1802,32 @@ float EvalLandmarking(const QString &predictedGallery, const QString &truthGalle
     return averagePointError;
 }
 
+struct RegressionError
+{
+    float rmsError, maeError;
+    QStringList truthValues, predictedValues;
+};
+
+static void compareRegressions(const PropertyJoin *join, int begin, int end, RegressionError *result)
+{
+    result->rmsError = 0;
+    result->maeError = 0;
+    for (int i=begin; i<end; i++) {
+        const File &predicted = (*join->predicted)[i].file;
+        const File &truth = (*join->truth)[(*join->rows)[i]].file;
+        if (predicted.contains(join->predictedProperty) && truth.contains(join->truthProperty)) {
+            const float predictedValue = predicted.get<float>(join->predictedProperty);
+            const float truthValue = truth.get<float>(join->truthProperty);
+            const float difference = predictedValue - truthValue;
+
+            result->rmsError += pow(difference, 2.f);
+            result->maeError += fabsf(difference);
+            result->truthValues.append(QString::number(truthValue));
+            result->predictedValues.append(QString::number(predictedValue));
+        }
+    }
+}
+
 void EvalRegression(const QString &predictedGallery, const QString &truthGallery, QString predictedProperty, QString truthProperty)
 {
     qDebug("Evaluating regression of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
@@ -1261,23 +1844,28 @@ void EvalRegression(const QString &predictedGallery, const QString &truthGallery
 
     const TemplateList predicted(TemplateList::fromGallery(predictedGallery));
     const TemplateList truth(TemplateList::fromGallery(truthGallery));
-    if (predicted.size() != truth.size()) qFatal("Input size mismatch.");
+    const QVector<int> rows = joinByName(predicted, truth);
+
+    const PropertyJoin join = { &predicted, &truth, &rows, predictedProperty, truthProperty };
+    const int step = joinStep(predicted.size());
+    QVector<RegressionError> blocks((predicted.size() + step - 1) / step);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<predicted.size(); i+=step) {
+        const int end = std::min(predicted.size(), i + step);
+        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(compareRegressions, &join, i, end, &blocks[i/step]));
+        else                                                          compareRegressions (&join, i, end, &blocks[i/step]);
+    }
+    futures.waitForFinished();
 
+    // Merged in gallery order, as before
     float rmsError = 0;
     float maeError = 0;
     QStringList truthValues, predictedValues;
-    for (int i=0; i<predicted.size(); i++) {
-        if (predicted[i].file.name != truth[i].file.name)
-            qFatal("Input order mismatch.");
-
-        if (predicted[i].file.contains(predictedProperty) && truth[i].file.contains(truthProperty)) {
-            float difference = predicted[i].file.get<float>(predictedProperty) - truth[i].file.get<float>(truthProperty);
-
-            rmsError += pow(difference, 2.f);
-            maeError += fabsf(difference);
-            truthValues.append(QString::number(truth[i].file.get<float>(truthProperty)));
-            predictedValues.append(QString::number(predicted[i].file.get<float>(predictedProperty)));
-        }
+    foreach (const RegressionError &block, blocks) {
+        rmsError += block.rmsError;
+        maeError += block.maeError;
+        truthValues.append(block.truthValues);
+        predictedValues.append(block.predictedValues);
     }
 
     QStringList rSource;
@@ -0,0 +1,206 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QVector>
+
+#include "filelistcache.h"
+
+using namespace br;
+
+namespace FileListCache
+{
+
+// Followed by the read parameters in UTF-16 padded to a multiple of four bytes, the string offsets and file records
+// as quint32, the UTF-16 string data, and the values that aren't strings serialized with QDataStream in the order they are referenced
+struct Header
+{
+    quint32 magic, version;
+    qint64 sourceSize, sourceModified;
+    quint32 parameters, strings, files, recordWords; // parameters is the length of the parameter string
+    quint64 variantBytes;
+};
+
+static const quint32 Magic = 0x4c465242; // "BRFL"
+static const quint32 Version = 2;
+static const quint32 VariantValue = 0xffffffff; // In place of a string index
+
+QString path(const QString &source)
+{
+    return source + ".brcache";
+}
+
+static Header describe(const QString &source, const QString &parameters)
+{
+    const QFileInfo info(source);
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    header.magic = Magic;
+    header.version = Version;
+    header.sourceSize = info.size();
+    header.sourceModified = info.lastModified().toMSecsSinceEpoch();
+    header.parameters = parameters.size();
+    return header;
+}
+
+static int padded(int characters)
+{
+    return (characters + 1) & ~1;
+}
+
+bool read(const QString &source, const QString &parameters, FileList &files)
+{
+    QFile file(path(source));
+    if (!file.open(QFile::ReadOnly) || (file.size() < qint64(sizeof(Header))))
+        return false;
+
+    const uchar *data = file.map(0, file.size());
+    if (!data)
+        return false;
+
+    const Header expected = describe(source, parameters);
+    Header header;
+    memcpy(&header, data, sizeof(Header));
+    const QChar *storedParameters = (const QChar*) (data + sizeof(Header));
+    const quint32 *offsets = (const quint32*) (storedParameters + padded(header.parameters));
+    const quint32 *records = offsets + header.strings + 1;
+    const uchar *end = data + file.size();
+    const bool valid = (header.magic == expected.magic) && (header.version == expected.version) &&
+                       (header.sourceSize == expected.sourceSize) && (header.sourceModified == expected.sourceModified) &&
+                       (header.parameters == expected.parameters) && ((const uchar*) (offsets + 1) <= end) &&
+                       (QString::fromRawData(storedParameters, int(header.parameters)) == parameters) &&
+                       ((const uchar*) (offsets + header.strings + 1) <= end) &&
+                       ((const uchar*) (records + header.recordWords) <= end) &&
+                       ((const uchar*) ((const QChar*) (records + header.recordWords) + offsets[header.strings]) + header.variantBytes == end);
+    if (!valid) {
+        file.unmap((uchar*) data);
+        return false;
+    }
+
+    // Each distinct string is constructed once and implicitly shared by every file that references it
+    const QChar *characters = (const QChar*) (records + header.recordWords);
+    QVector<QString> strings(header.strings);
+    for (quint32 i=0; i<header.strings; i++)
+        strings[i] = QString(characters + offsets[i], int(offsets[i+1] - offsets[i]));
+    QVector<MetadataKey> keys(header.strings); // Interned on first use
+
+    const QByteArray variants = QByteArray::fromRawData((const char*) (characters + offsets[header.strings]), int(header.variantBytes));
+    QDataStream stream(variants);
+
+    FileList cached;
+    cached.reserve(header.files);
+    const quint32 *record = records, *recordsEnd = records + header.recordWords;
+    bool ok = true;
+    for (quint32 i=0; ok && (i<header.files) && (record+3 <= recordsEnd) && (record[0] < header.strings); i++) {
+        File f;
+        f.name = strings[record[0]];
+        f.fte = record[1];
+        const quint32 entries = record[2];
+        record += 3;
+        for (quint32 j=0; (j<entries) && (record+2 <= recordsEnd); j++, record+=2) {
+            const quint32 key = record[0], value = record[1];
+            if ((key >= header.strings) || ((value != VariantValue) && (value >= header.strings))) {
+                ok = false;
+                break;
+            }
+            if (keys[key].atom == -1)
+                keys[key].atom = MetadataKey::intern(strings[key]);
+            if (value == VariantValue) {
+                QVariant variant;
+                stream >> variant;
+                f.set(keys[key], variant);
+            } else {
+                f.set(keys[key], strings[value]);
+            }
+        }
+        cached.append(f);
+    }
+    file.unmap((uchar*) data);
+
+    if (!ok || (cached.size() != int(header.files)) || (record != recordsEnd) || (stream.status() != QDataStream::Ok))
+        return false;
+    files.append(cached);
+    return true;
+}
+
+static quint32 intern(const QString &string, QHash<QString,quint32> &ids, QString &characters, QVector<quint32> &offsets)
+{
+    QHash<QString,quint32>::const_iterator it = ids.constFind(string);
+    if (it != ids.constEnd())
+        return it.value();
+    const quint32 id = offsets.size() - 1;
+    ids.insert(string, id);
+    characters.append(string);
+    offsets.append(characters.size());
+    return id;
+}
+
+void write(const QString &source, const QString &parameters, const FileList &files)
+{
+    Header header = describe(source, parameters);
+
+    QHash<QString,quint32> ids;
+    QString characters;
+    QVector<quint32> offsets(1, 0), records;
+    QByteArray variants;
+    QDataStream stream(&variants, QIODevice::WriteOnly);
+
+    foreach (const File &f, files) {
+        records.append(intern(f.name, ids, characters, offsets));
+        records.append(f.fte);
+        const int entries = records.size();
+        records.append(0);
+
+        const QVariantMap metadata = f.localMetadata();
+        for (QVariantMap::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it) {
+            if (it.key() == "progress") // Reading state rather than metadata
+                continue;
+            records.append(intern(it.key(), ids, characters, offsets));
+            if (it.value().type() == QVariant::String) {
+                records.append(intern(it.value().toString(), ids, characters, offsets));
+            } else {
+                stream << it.value();
+                records.append(VariantValue);
+            }
+            records[entries]++;
+        }
+    }
+
+    header.strings = offsets.size() - 1;
+    header.files = files.size();
+    header.recordWords = records.size();
+    header.variantBytes = variants.size();
+
+    QSaveFile file(path(source));
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    file.write((const char*) &header, sizeof(Header));
+    file.write((const char*) parameters.constData(), parameters.size() * sizeof(QChar));
+    if (padded(parameters.size()) != parameters.size())
+        file.write(QByteArray(sizeof(QChar), '\0'));
+    file.write((const char*) offsets.constData(), offsets.size() * sizeof(quint32));
+    file.write((const char*) records.constData(), records.size() * sizeof(quint32));
+    file.write((const char*) characters.constData(), characters.size() * sizeof(QChar));
+    file.write(variants);
+    if (!file.commit())
+        qWarning("Failed to write %s.", qPrintable(path(source)));
+}
+
+} // namespace FileListCache
@@ -0,0 +1,36 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_FILELISTCACHE_H
+#define BR_FILELISTCACHE_H
+
+#include <QString>
+#include <openbr/openbr_plugin.h>
+
+/*!
+ * A compact binary cache of the br::FileList read from a sigset or CSV gallery, written next to the source.
+ * It is invalidated when the source's size or modification time, or the parameters it was read with, change.
+ * Parameters are stored verbatim and compared exactly, galleries pass the arguments they were opened with.
+ * Strings are stored once in a table and the whole cache is read from a single mapping.
+ */
+namespace FileListCache
+{
+    QString path(const QString &source); // <source>.brcache
+    bool read(const QString &source, const QString &parameters, br::FileList &files); // Returns false if there is no valid cache
+    void write(const QString &source, const QString &parameters, const br::FileList &files); // Skipped if the directory isn't writable
+}
+
+#endif // BR_FILELISTCACHE_H
@@ -17,6 +17,7 @@
 #include <QList>
 #include <QStringList>
 #include "openbr/core/opencvutils.h"
+#include <cmath>
 #include <limits>
 #include <vector>
 #include <opencv2/core/core.hpp>
@@ -25,56 +26,152 @@
 #include "openbr/core/bee.h"
 #include "openbr/core/common.h"
 #include "openbr/core/fuse.h"
+#include "openbr/core/scheduler.h"
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+// Statistics of the scores a mask considers, merged across blocks with the parallel update of Chan et al.
+struct ScoreStatistics
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
-
-    if (method == "None") return;
-
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
-                continue;
-            vals.append(val);
-        }
+    qint64 count;
+    double mean, m2;
+    float min, max;
+
+    ScoreStatistics()
+        : count(0), mean(0), m2(0), min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+    void add(float val)
+    {
+        count++;
+        const double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+        min = std::min(min, val);
+        max = std::max(max, val);
     }
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
+    void merge(const ScoreStatistics &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * double(count) * other.count / total;
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
 
-    if (method == "MinMax") {
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = 0;
-                else if (val ==  std::numeric_limits<float>::max()) val = 1;
-                else                                                     val = (val - min) / (max - min);
+    double stddev() const
+    {
+        return (count > 0) ? sqrt(m2 / count) : 0;
+    }
+};
+
+// Everything a block of rows needs, shared read-only by the worker threads
+struct FusionJob
+{
+    QList<Mat> matrices;
+    QList<BEE::ImplicitMask> masks; // One per partition
+    QVector<ScoreStatistics> statistics; // Indexed by partition * matrices.size() + matrix
+    QString normalization, fusion;
+    QList<float> weights;
+};
+
+static void statisticsBlock(const FusionJob *job, int begin, int count, QVector<ScoreStatistics> *statistics)
+{
+    const int cols = job->matrices.first().cols;
+    statistics->fill(ScoreStatistics(), job->masks.size() * job->matrices.size());
+    QVector<BEE::MaskValue> mask(cols);
+    for (int p=0; p<job->masks.size(); p++) {
+        for (int i=begin; i<begin+count; i++) {
+            job->masks[p].row(i, mask.data());
+            for (int m=0; m<job->matrices.size(); m++) {
+                ScoreStatistics &s = (*statistics)[p * job->matrices.size() + m];
+                const float *row = job->matrices[m].ptr<float>(i);
+                for (int j=0; j<cols; j++) {
+                    const float val = row[j];
+                    if ((mask[j] == BEE::DontCare) ||
+                        (val == -std::numeric_limits<float>::max()) ||
+                        (val ==  std::numeric_limits<float>::max()))
+                        continue;
+                    s.add(val);
+                }
             }
         }
+    }
+}
+
+static void normalizeRow(float *row, const BEE::MaskValue *mask, int cols, const QString &method, const ScoreStatistics &s)
+{
+    if (method == "MinMax") {
+        for (int j=0; j<cols; j++) {
+            if (mask[j] == BEE::DontCare) continue;
+            float &val = row[j];
+            if      (val == -std::numeric_limits<float>::max()) val = 0;
+            else if (val ==  std::numeric_limits<float>::max()) val = 1;
+            else                                                val = (val - s.min) / (s.max - s.min);
+        }
     } else if (method == "ZScore") {
-        if (stddev == 0) qFatal("Stddev is 0.");
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = (min - mean) / stddev;
-                else if (val ==  std::numeric_limits<float>::max()) val = (max - mean) / stddev;
-                else                                                val = (val - mean) / stddev;
+        const double stddev = s.stddev();
+        for (int j=0; j<cols; j++) {
+            if (mask[j] == BEE::DontCare) continue;
+            float &val = row[j];
+            if      (val == -std::numeric_limits<float>::max()) val = (s.min - s.mean) / stddev;
+            else if (val ==  std::numeric_limits<float>::max()) val = (s.max - s.mean) / stddev;
+            else                                                val = (val - s.mean) / stddev;
+        }
+    }
+}
+
+static void fuseBlock(const FusionJob *job, int begin, int count, Mat *output)
+{
+    const int cols = job->matrices.first().cols;
+    const int n = job->matrices.size();
+    *output = Mat::zeros(count, cols, CV_32FC1);
+
+    QList<Mat> rows;
+    for (int m=0; m<n; m++)
+        rows.append(Mat(1, cols, CV_32FC1));
+    Mat mask(1, cols, CV_8UC1), fused(1, cols, CV_32FC1);
+
+    for (int i=0; i<count; i++) {
+        float *result = output->ptr<float>(i);
+        for (int p=0; p<job->masks.size(); p++) {
+            job->masks[p].row(begin+i, mask.ptr<BEE::MaskValue>());
+            for (int m=0; m<n; m++) {
+                job->matrices[m].row(begin+i).copyTo(rows[m]);
+                normalizeRow(rows[m].ptr<float>(), mask.ptr<BEE::MaskValue>(), cols, job->normalization, job->statistics[p * n + m]);
+            }
+
+            if (job->fusion == "Max") {
+                max(rows[0], rows[1], fused);
+                for (int m=2; m<n; m++)
+                    max(fused, rows[m], fused);
+            } else if (job->fusion == "Min") {
+                min(rows[0], rows[1], fused);
+                for (int m=2; m<n; m++)
+                    min(fused, rows[m], fused);
+            } else if (job->fusion.startsWith("Sum")) {
+                addWeighted(rows[0], job->weights[0], rows[1], job->weights[1], 0, fused);
+                for (int m=2; m<n; m++)
+                    addWeighted(fused, 1, rows[m], job->weights[m], 0, fused);
+            } else if (job->fusion == "Replace") {
+                rows.first().copyTo(fused);
+                rows.last().copyTo(fused, mask != BEE::DontCare);
+            } else if (job->fusion == "Difference") {
+                subtract(rows[0], rows[1], fused);
+            } else {
+                rows[0].copyTo(fused);
             }
+
+            // We don't want to add scores where the mask says we shouldn't care
+            const BEE::MaskValue *maskValues = mask.ptr<BEE::MaskValue>();
+            const float *fusedValues = fused.ptr<float>();
+            for (int j=0; j<cols; j++)
+                if (maskValues[j] != BEE::DontCare)
+                    result[j] += fusedValues[j];
         }
-    } else {
-        qFatal("Invalid normalization method %s.", qPrintable(method));
     }
 }
 
@@ -83,85 +180,101 @@ void br::Fuse(const QStringList &inputSimmats, const QString &normalization, con
     qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
 
     QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
+    QList< QSharedPointer<BEE::MappedMatrix> > mappedMatrices;
+    FusionJob job;
     foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMatrix(simmat,&target,&query));
+        // Inputs are memory mapped and only ever read a block of rows at a time
+        mappedMatrices.append(QSharedPointer<BEE::MappedMatrix>(new BEE::MappedMatrix(simmat)));
+        job.matrices.append(mappedMatrices.last()->matrix());
+        target = mappedMatrices.last()->target();
+        query = mappedMatrices.last()->query();
         // Make we're fusing score matrices for the same set of targets and querys
         if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
             qFatal("Target or query files are not the same across fused matrices.");
         previousTarget = target; previousQuery = query;
     }
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if ((job.matrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+    if ((job.matrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if ((normalization != "None") && (normalization != "MinMax") && (normalization != "ZScore"))
+        qFatal("Invalid normalization method %s.", qPrintable(normalization));
 
-    const FileList targetFiles = TemplateList::fromGallery(target).files();
-    const FileList queryFiles = TemplateList::fromGallery(query).files();
-
-    int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
-    do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
-            QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
-            if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
-                    weights.append(1);
-            } else if (words.size() == matrices.size()) {
-                bool ok;
-                for (int k=0; k<matrices.size(); k++) {
-                    float weight = words[k].toFloat(&ok);
-                    if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
-                    weights.append(weight);
-                }
-            } else {
-                qFatal("Number of weights does not match number of similarity matrices.");
+    job.normalization = normalization;
+    job.fusion = fusion;
+    if (fusion.startsWith("Sum")) {
+        QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
+        if (words.size() == 0) {
+            for (int k=0; k<job.matrices.size(); k++)
+                job.weights.append(1);
+        } else if (words.size() == job.matrices.size()) {
+            bool ok;
+            for (int k=0; k<job.matrices.size(); k++) {
+                float weight = words[k].toFloat(&ok);
+                if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
+                job.weights.append(weight);
             }
-
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
         } else {
-            qFatal("Invalid fusion method %s.", qPrintable(fusion));
+            qFatal("Number of weights does not match number of similarity matrices.");
         }
+    } else if ((fusion == "Replace") || (fusion == "Difference")) {
+        if (job.matrices.size() != 2) qFatal("%s fusion requires exactly two matrices.", qPrintable(fusion));
+    } else if ((fusion != "Max") && (fusion != "Min") && (fusion != "None")) {
+        qFatal("Invalid fusion method %s.", qPrintable(fusion));
+    }
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
+    const int rows = job.matrices.last().rows;
+    const int cols = job.matrices.last().cols;
+    foreach (const Mat &matrix, job.matrices)
+        if ((matrix.rows != rows) || (matrix.cols != cols) || (matrix.type() != CV_32FC1))
+            qFatal("Similarity matrices differ in size or type.");
 
-        add(buffer,fused,buffer,buffer_mask);
+    const FileList targetFiles = TemplateList::fromGallery(target).files();
+    const FileList queryFiles = TemplateList::fromGallery(query).files();
+    if ((targetFiles.size() != cols) || (queryFiles.size() != rows))
+        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", rows, cols, queryFiles.size(), targetFiles.size());
 
-        partition++;
+    const int partitions = std::max(1, Globals->crossValidate);
+    for (int p=0; p<partitions; p++)
+        job.masks.append(BEE::ImplicitMask(targetFiles, queryFiles, p));
 
-    } while (partition < crossValidate);
+    // Roughly 16 MB of scores per input matrix per block
+    const int blockRows = std::max(1, int((qint64(16) << 20) / (qint64(cols) * sizeof(float))));
+    const int blocks = (rows + blockRows - 1) / blockRows;
 
-    BEE::writeMatrix(buffer, outputSimmat);
+    // Global statistics of each matrix for each partition
+    job.statistics = QVector<ScoreStatistics>(partitions * job.matrices.size());
+    if (normalization != "None") {
+        QVector< QVector<ScoreStatistics> > blockStatistics(blocks);
+        TaskGroup tasks;
+        for (int b=0; b<blocks; b++) {
+            const int begin = b * blockRows, count = std::min(blockRows, rows - begin);
+            if (Globals->parallelism) tasks.run(statisticsBlock, (const FusionJob*) &job, begin, count, &blockStatistics[b]);
+            else                                statisticsBlock ((const FusionJob*) &job, begin, count, &blockStatistics[b]);
+        }
+        tasks.wait();
+
+        for (int b=0; b<blocks; b++)
+            for (int i=0; i<job.statistics.size(); i++)
+                job.statistics[i].merge(blockStatistics[b][i]);
+        if (normalization == "ZScore")
+            foreach (const ScoreStatistics &s, job.statistics)
+                if (s.stddev() == 0) qFatal("Stddev is 0.");
+    }
+
+    // Fuse a group of blocks concurrently, then write them out in order
+    const int concurrentBlocks = std::max(1, abs(Globals->parallelism));
+    BEE::MatrixWriter writer(outputSimmat, rows, cols);
+    for (int first=0; first<blocks; first+=concurrentBlocks) {
+        const int group = std::min(concurrentBlocks, blocks - first);
+        QVector<Mat> fused(group);
+        TaskGroup tasks;
+        for (int g=0; g<group; g++) {
+            const int begin = (first + g) * blockRows, count = std::min(blockRows, rows - begin);
+            if (Globals->parallelism) tasks.run(fuseBlock, (const FusionJob*) &job, begin, count, &fused[g]);
+            else                                fuseBlock ((const FusionJob*) &job, begin, count, &fused[g]);
+        }
+        tasks.wait();
+        foreach (const Mat &block, fused)
+            writer.append(block);
+    }
 }
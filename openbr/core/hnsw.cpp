@@ -0,0 +1,251 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFile>
+#include <QSet>
+#include <QtCore/qmath.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include "hnsw.h"
+#include "qtutils.h"
+
+namespace br
+{
+
+typedef HNSWIndex::Match Match;
+
+// Orders a heap with the most similar match on top
+struct MostSimilar
+{
+    bool operator()(const Match &a, const Match &b) const { return a.second < b.second; }
+};
+
+// Orders a heap with the least similar match on top
+struct LeastSimilar
+{
+    bool operator()(const Match &a, const Match &b) const { return a.second > b.second; }
+};
+
+static bool moreSimilar(const Match &a, const Match &b)
+{
+    return a.second > b.second;
+}
+
+HNSWIndex::HNSWIndex(int M, int efConstruction)
+    : distance(NULL), M(std::max(2, M)), efConstruction(std::max(1, efConstruction)), ef(64), entryPoint(-1), maxLevel(-1), seed(1) {}
+
+float HNSWIndex::similarity(const Template &query, int node) const
+{
+    return distance->compare(items[node], query);
+}
+
+int HNSWIndex::randomLevel()
+{
+    // Geometric distribution with ratio 1/M, from a linear congruential generator for reproducibility
+    seed = seed * 1103515245u + 12345u;
+    const double uniform = (double((seed >> 8) & 0xFFFFFF) + 1) / double(0x1000000 + 1);
+    return int(-qLn(uniform) / qLn(double(M)));
+}
+
+int HNSWIndex::greedy(const Template &query, int entry, int level) const
+{
+    float best = similarity(query, entry);
+    bool improved = true;
+    while (improved) {
+        improved = false;
+        foreach (int neighbor, links[entry][level]) {
+            const float s = similarity(query, neighbor);
+            if (s > best) {
+                best = s;
+                entry = neighbor;
+                improved = true;
+            }
+        }
+    }
+    return entry;
+}
+
+QList<Match> HNSWIndex::searchLayer(const Template &query, int entry, int ef, int level) const
+{
+    QSet<int> visited;
+    visited.insert(entry);
+
+    const Match first(entry, similarity(query, entry));
+    std::priority_queue<Match, std::vector<Match>, MostSimilar> candidates;
+    std::priority_queue<Match, std::vector<Match>, LeastSimilar> results;
+    candidates.push(first);
+    results.push(first);
+
+    while (!candidates.empty()) {
+        const Match current = candidates.top();
+        if ((int(results.size()) >= ef) && (current.second < results.top().second))
+            break;
+        candidates.pop();
+
+        foreach (int neighbor, links[current.first][level]) {
+            if (visited.contains(neighbor))
+                continue;
+            visited.insert(neighbor);
+
+            const Match match(neighbor, similarity(query, neighbor));
+            if ((int(results.size()) < ef) || (match.second > results.top().second)) {
+                candidates.push(match);
+                results.push(match);
+                if (int(results.size()) > ef)
+                    results.pop();
+            }
+        }
+    }
+
+    QList<Match> matches;
+    while (!results.empty()) {
+        matches.append(results.top());
+        results.pop();
+    }
+    std::reverse(matches.begin(), matches.end());
+    return matches;
+}
+
+void HNSWIndex::connect(int node, int neighbor, int level)
+{
+    QVector<int> &neighbors = links[node][level];
+    neighbors.append(neighbor);
+
+    const int capacity = (level == 0) ? 2*M : M;
+    if (neighbors.size() <= capacity)
+        return;
+
+    // Over capacity, keep the most similar links
+    QList<Match> scored;
+    foreach (int n, neighbors)
+        scored.append(Match(n, similarity(items[node], n)));
+    std::partial_sort(scored.begin(), scored.begin() + capacity, scored.end(), moreSimilar);
+    neighbors.clear();
+    for (int i=0; i<capacity; i++)
+        neighbors.append(scored[i].first);
+}
+
+void HNSWIndex::insert(const Template &t)
+{
+    if (distance == NULL)
+        qFatal("HNSWIndex requires a distance.");
+
+    QWriteLocker locker(&lock);
+    const int node = items.size();
+    items.append(t);
+
+    // Templates that failed to enroll are stored but can't be reached
+    if (t.isEmpty() || t.file.fte) {
+        links.append(QVector< QVector<int> >());
+        return;
+    }
+
+    const int level = randomLevel();
+    links.append(QVector< QVector<int> >(level+1));
+
+    if (entryPoint < 0) {
+        entryPoint = node;
+        maxLevel = level;
+        return;
+    }
+
+    int entry = entryPoint;
+    for (int l=maxLevel; l>level; l--)
+        entry = greedy(t, entry, l);
+
+    for (int l=std::min(level, maxLevel); l>=0; l--) {
+        const QList<Match> nearest = searchLayer(t, entry, efConstruction, l);
+        const int capacity = (l == 0) ? 2*M : M;
+        for (int i=0; i<std::min(capacity, nearest.size()); i++) {
+            links[node][l].append(nearest[i].first);
+            connect(nearest[i].first, node, l);
+        }
+        entry = nearest.first().first;
+    }
+
+    if (level > maxLevel) {
+        entryPoint = node;
+        maxLevel = level;
+    }
+}
+
+QList<Match> HNSWIndex::search(const Template &query, int k) const
+{
+    if (distance == NULL)
+        qFatal("HNSWIndex requires a distance.");
+
+    QReadLocker locker(&lock);
+    if ((entryPoint < 0) || (k <= 0) || query.isEmpty())
+        return QList<Match>();
+
+    int entry = entryPoint;
+    for (int l=maxLevel; l>0; l--)
+        entry = greedy(query, entry, l);
+
+    return searchLayer(query, entry, std::max(ef, k), 0).mid(0, k);
+}
+
+int HNSWIndex::size() const
+{
+    QReadLocker locker(&lock);
+    return items.size();
+}
+
+TemplateList HNSWIndex::templates() const
+{
+    QReadLocker locker(&lock);
+    return items;
+}
+
+void HNSWIndex::store(QDataStream &stream) const
+{
+    QReadLocker locker(&lock);
+    stream << M << efConstruction << entryPoint << maxLevel << seed << links << items;
+}
+
+void HNSWIndex::load(QDataStream &stream)
+{
+    QWriteLocker locker(&lock);
+    stream >> M >> efConstruction >> entryPoint >> maxLevel >> seed >> links >> items;
+}
+
+void HNSWIndex::write(const File &file, const QString &distanceDescription) const
+{
+    QFile f(file);
+    QtUtils::touchDir(f);
+    if (!f.open(QFile::WriteOnly))
+        qFatal("Can't open gallery: %s for writing", qPrintable(f.fileName()));
+    QDataStream stream(&f);
+    stream << distanceDescription;
+    store(stream);
+}
+
+QString HNSWIndex::read(const File &file)
+{
+    QFile f(file);
+    if (!f.open(QFile::ReadOnly))
+        qFatal("Can't open gallery: %s for reading", qPrintable(f.fileName()));
+    QDataStream stream(&f);
+    QString distanceDescription;
+    stream >> distanceDescription;
+    load(stream);
+    setEf(file.get<int>("ef", 64));
+    return distanceDescription;
+}
+
+} // namespace br
@@ -0,0 +1,78 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_HNSW_H
+#define BR_HNSW_H
+
+#include <QDataStream>
+#include <QReadWriteLock>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// A hierarchical navigable small world graph over templates, scored by any
+// br::Distance whose similarities behave like a metric. Templates are inserted
+// incrementally, and a search greedily descends the layers of the graph
+// before a best-first search of the bottom layer, examining ef candidates.
+// Inserts and searches may be called concurrently.
+class BR_EXPORT HNSWIndex
+{
+public:
+    typedef QPair<int,float> Match; // Template index and similarity
+
+    // M is the number of links per node and layer, twice that in the bottom layer
+    HNSWIndex(int M = 16, int efConstruction = 100);
+
+    void setDistance(const Distance *distance) { this->distance = distance; } // Not owned
+    void setEf(int ef) { this->ef = ef; }
+
+    void insert(const Template &t);
+
+    // The k most similar templates, ordered from most to least similar
+    QList<Match> search(const Template &query, int k) const;
+
+    int size() const;
+    TemplateList templates() const;
+
+    void store(QDataStream &stream) const;
+    void load(QDataStream &stream);
+
+    // The .hnsw gallery layout, the description of the distance used to build the graph followed by the graph.
+    // read() takes ef from the file's metadata, 64 by default.
+    void write(const File &file, const QString &distanceDescription) const;
+    QString read(const File &file);
+
+private:
+    const Distance *distance;
+    int M, efConstruction, ef, entryPoint, maxLevel;
+    quint32 seed;
+
+    TemplateList items;
+    QVector< QVector< QVector<int> > > links; // Indexed by template, then layer
+    mutable QReadWriteLock lock;
+
+    float similarity(const Template &query, int node) const;
+    int randomLevel();
+    int greedy(const Template &query, int entry, int level) const;
+    QList<Match> searchLayer(const Template &query, int entry, int ef, int level) const;
+    void connect(int node, int neighbor, int level);
+};
+
+} // namespace br
+
+#endif // BR_HNSW_H
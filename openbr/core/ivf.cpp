@@ -0,0 +1,147 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFile>
+#include <QtCore/qmath.h>
+#include <opencv2/core/core.hpp>
+
+#include "ivf.h"
+#include "qtutils.h"
+
+using namespace cv;
+
+namespace br
+{
+
+// Largest number of templates the quantizer is trained on, per list
+static const int TrainingSamplesPerList = 256;
+
+Template InvertedIndex::feature(const Template &t)
+{
+    Template f(t.file);
+    if (t.isEmpty() || t.file.fte || !t.m().data)
+        return f;
+    Mat m;
+    t.m().reshape(1, 1).convertTo(m, CV_32F);
+    f.append(m);
+    return f;
+}
+
+void InvertedIndex::build(const TemplateList &templates, int numLists, const QString &quantizerDescription)
+{
+    count = templates.size();
+
+    TemplateList features;
+    QList<int> indices;
+    for (int i=0; i<templates.size(); i++) {
+        const Template f = feature(templates[i]);
+        if (f.isEmpty())
+            continue;
+        features.append(f);
+        indices.append(i);
+    }
+
+    if (numLists <= 0)
+        numLists = std::max(1, int(qSqrt(features.size())));
+    numLists = std::max(1, std::min(numLists, features.size()));
+
+    // Train on an evenly spaced subset of the templates
+    TemplateList training;
+    const int step = std::max(1, features.size() / (numLists * TrainingSamplesPerList));
+    for (int i=0; i<features.size(); i+=step)
+        training.append(features[i]);
+
+    description = QString("%1(kTrain=%2,kSearch=1)").arg(quantizerDescription, QString::number(numLists));
+    quantizer = QSharedPointer<Transform>(Transform::make(description, NULL));
+    if (!training.isEmpty())
+        quantizer->train(training);
+
+    lists = QVector< QVector<int> >(numLists);
+    for (int i=0; i<features.size(); i++) {
+        const Template assignment = (*quantizer)(features[i]);
+        const int list = int(assignment.m().at<int>(0));
+        if ((list < 0) || (list >= numLists))
+            qFatal("Quantizer %s returned invalid list %d.", qPrintable(description), list);
+        lists[list].append(indices[i]);
+    }
+
+    setNProbe(nprobe);
+}
+
+void InvertedIndex::setNProbe(int nprobe)
+{
+    this->nprobe = std::max(1, std::min(nprobe, lists.size()));
+    if (quantizer)
+        quantizer->setPropertyRecursive("kSearch", this->nprobe);
+}
+
+QVector<int> InvertedIndex::candidates(const Template &query) const
+{
+    QVector<int> result;
+    const Template f = feature(query);
+    if (f.isEmpty() || !quantizer)
+        return result;
+
+    const Template probes = (*quantizer)(f);
+    const Mat &m = probes.m();
+    for (int i=0; i<int(m.total()); i++) {
+        const int list = m.at<int>(i);
+        if ((list >= 0) && (list < lists.size()))
+            result += lists[list];
+    }
+    return result;
+}
+
+void InvertedIndex::store(QDataStream &stream) const
+{
+    stream << description << count << lists;
+    quantizer->store(stream);
+}
+
+void InvertedIndex::load(QDataStream &stream)
+{
+    stream >> description >> count >> lists;
+    quantizer = QSharedPointer<Transform>(Transform::make(description, NULL));
+    quantizer->load(stream);
+    setNProbe(nprobe);
+}
+
+void InvertedIndex::write(const File &file, const TemplateList &templates, int numLists, const QString &quantizer)
+{
+    InvertedIndex index;
+    index.build(templates, numLists, quantizer);
+
+    QFile f(file);
+    QtUtils::touchDir(f);
+    if (!f.open(QFile::WriteOnly))
+        qFatal("Can't open gallery: %s for writing", qPrintable(f.fileName()));
+    QDataStream stream(&f);
+    index.store(stream);
+    stream << templates;
+}
+
+void InvertedIndex::read(const File &file, TemplateList &templates)
+{
+    QFile f(file);
+    if (!f.open(QFile::ReadOnly))
+        qFatal("Can't open gallery: %s for reading", qPrintable(f.fileName()));
+    QDataStream stream(&f);
+    load(stream);
+    stream >> templates;
+    setNProbe(file.get<int>("nprobe", 8));
+}
+
+} // namespace br
@@ -0,0 +1,68 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_IVF_H
+#define BR_IVF_H
+
+#include <QDataStream>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// An inverted file index over a list of templates. A coarse quantizer,
+// KMeans by default, is trained on the templates' first matrix and each
+// template is assigned to the list of its nearest centroid. A search then
+// only considers the templates in the nprobe lists nearest the query, so
+// increasing nprobe trades speed for recall.
+class BR_EXPORT InvertedIndex
+{
+public:
+    InvertedIndex() : count(0), nprobe(1) {}
+
+    // Train the quantizer with numLists centroids and assign each template to a list.
+    // numLists <= 0 selects sqrt(templates.size()).
+    void build(const TemplateList &templates, int numLists = 0, const QString &quantizer = "KMeans");
+
+    void setNProbe(int nprobe);
+    int size() const { return count; }
+
+    // Indices of the templates in the nprobe lists nearest the query
+    QVector<int> candidates(const Template &query) const;
+
+    void store(QDataStream &stream) const;
+    void load(QDataStream &stream);
+
+    // The .ivf gallery layout, an index followed by the templates it indexes.
+    // read() takes nprobe from the file's metadata, 8 by default.
+    static void write(const File &file, const TemplateList &templates, int numLists = 0, const QString &quantizer = "KMeans");
+    void read(const File &file, TemplateList &templates);
+
+private:
+    QString description;
+    QSharedPointer<Transform> quantizer;
+    QVector< QVector<int> > lists;
+    int count, nprobe;
+
+    static Template feature(const Template &t);
+};
+
+} // namespace br
+
+#endif // BR_IVF_H
@@ -0,0 +1,460 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QPointF>
+#include <QRectF>
+#include <QStringList>
+#include <limits>
+#include <string.h>
+
+#include "jsonutils.h"
+
+using namespace br;
+
+namespace JSONUtils
+{
+
+static inline void appendNumber(QByteArray &json, double value, int precision)
+{
+    // JSON has no representation for NaN or infinity
+    if ((value != value) || (value > std::numeric_limits<double>::max()) || (value < -std::numeric_limits<double>::max()))
+        json.append("null");
+    else
+        json.append(QByteArray::number(value, 'g', precision));
+}
+
+static void appendUtf8(QByteArray &json, const QByteArray &utf8)
+{
+    static const char hex[] = "0123456789abcdef";
+    json.reserve(json.size() + utf8.size() + 2);
+    json.append('"');
+    const char *data = utf8.constData();
+    int start = 0;
+    for (int i=0; i<utf8.size(); i++) {
+        const uchar c = data[i];
+        if ((c >= 0x20) && (c != '"') && (c != '\\'))
+            continue;
+        json.append(data + start, i - start);
+        start = i+1;
+        switch (c) {
+          case '"':  json.append("\\\""); break;
+          case '\\': json.append("\\\\"); break;
+          case '\n': json.append("\\n"); break;
+          case '\r': json.append("\\r"); break;
+          case '\t': json.append("\\t"); break;
+          case '\b': json.append("\\b"); break;
+          case '\f': json.append("\\f"); break;
+          default: {
+            const char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            json.append(escape, sizeof(escape));
+          }
+        }
+    }
+    json.append(data + start, utf8.size() - start);
+    json.append('"');
+}
+
+void append(QByteArray &json, const QString &string)
+{
+    appendUtf8(json, string.toUtf8());
+}
+
+static void appendPoint(QByteArray &json, const QPointF &point)
+{
+    json.append("{\"x\":");
+    appendNumber(json, point.x(), 9);
+    json.append(",\"y\":");
+    appendNumber(json, point.y(), 9);
+    json.append('}');
+}
+
+static void appendRect(QByteArray &json, const QRectF &rect)
+{
+    json.append("{\"height\":");
+    appendNumber(json, rect.height(), 9);
+    json.append(",\"width\":");
+    appendNumber(json, rect.width(), 9);
+    json.append(",\"x\":");
+    appendNumber(json, rect.x(), 9);
+    json.append(",\"y\":");
+    appendNumber(json, rect.y(), 9);
+    json.append('}');
+}
+
+void append(QByteArray &json, const QVariant &value)
+{
+    switch (value.userType()) {
+      case QMetaType::UnknownType:
+        json.append("null");
+        break;
+      case QMetaType::Bool:
+        json.append(value.toBool() ? "true" : "false");
+        break;
+      case QMetaType::Int:
+      case QMetaType::Short:
+      case QMetaType::Long:
+      case QMetaType::LongLong:
+        json.append(QByteArray::number(value.toLongLong()));
+        break;
+      case QMetaType::UInt:
+      case QMetaType::UShort:
+      case QMetaType::ULong:
+      case QMetaType::ULongLong:
+        json.append(QByteArray::number(value.toULongLong()));
+        break;
+      case QMetaType::Float:
+        appendNumber(json, value.toFloat(), 9);
+        break;
+      case QMetaType::Double:
+        appendNumber(json, value.toDouble(), 17);
+        break;
+      case QMetaType::QString:
+        append(json, value.toString());
+        break;
+      case QMetaType::QByteArray:
+        appendUtf8(json, value.toByteArray());
+        break;
+      case QMetaType::QPoint:
+      case QMetaType::QPointF:
+        appendPoint(json, value.toPointF());
+        break;
+      case QMetaType::QRect:
+      case QMetaType::QRectF:
+        appendRect(json, value.toRectF());
+        break;
+      case QMetaType::QStringList: {
+        const QStringList list = value.toStringList();
+        json.append('[');
+        for (int i=0; i<list.size(); i++) {
+            if (i > 0) json.append(',');
+            append(json, list[i]);
+        }
+        json.append(']');
+      } break;
+      case QMetaType::QVariantList: {
+        const QVariantList list = value.toList();
+        json.append('[');
+        for (int i=0; i<list.size(); i++) {
+            if (i > 0) json.append(',');
+            append(json, list[i]);
+        }
+        json.append(']');
+      } break;
+      case QMetaType::QVariantMap:
+      case QMetaType::QVariantHash:
+        append(json, value.toMap());
+        break;
+      default:
+        // Match QJsonValue::fromVariant() for everything else
+        if (value.canConvert<QString>()) append(json, value.toString());
+        else                             json.append("null");
+    }
+}
+
+void append(QByteArray &json, const QVariantMap &object)
+{
+    json.append('{');
+    for (QVariantMap::const_iterator it = object.constBegin(); it != object.constEnd(); ++it) {
+        if (it != object.constBegin()) json.append(',');
+        append(json, it.key());
+        json.append(':');
+        append(json, it.value());
+    }
+    json.append('}');
+}
+
+void append(QByteArray &json, const File &file)
+{
+    append(json, file.localMetadata());
+}
+
+struct Reader
+{
+    const char *begin, *p, *end;
+    QString error;
+
+    Reader(const char *json, int size) : begin(json), p(json), end(json + size) {}
+
+    bool fail(const char *message)
+    {
+        if (error.isEmpty())
+            error = QString("%1 at offset %2").arg(message, QString::number(p - begin));
+        return false;
+    }
+
+    void skipSpaces()
+    {
+        while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r')))
+            p++;
+    }
+
+    bool literal(const char *word, int length)
+    {
+        if ((end - p < length) || strncmp(p, word, length))
+            return fail("Invalid literal");
+        p += length;
+        return true;
+    }
+
+    static int hexValue(char c)
+    {
+        if ((c >= '0') && (c <= '9')) return c - '0';
+        if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+        if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+        return -1;
+    }
+
+    bool string(QString &result)
+    {
+        if ((p >= end) || (*p != '"'))
+            return fail("Expected a string");
+        p++;
+
+        // Unescaped runs are decoded directly from the input
+        const char *start = p;
+        while ((p < end) && (*p != '"') && (*p != '\\'))
+            p++;
+        result = QString::fromUtf8(start, p - start);
+
+        while ((p < end) && (*p != '"')) {
+            if (*p == '\\') {
+                if (++p >= end) break;
+                switch (*p++) {
+                  case '"':  result.append('"'); break;
+                  case '\\': result.append('\\'); break;
+                  case '/':  result.append('/'); break;
+                  case 'b':  result.append('\b'); break;
+                  case 'f':  result.append('\f'); break;
+                  case 'n':  result.append('\n'); break;
+                  case 'r':  result.append('\r'); break;
+                  case 't':  result.append('\t'); break;
+                  case 'u': {
+                    if (end - p < 4) return fail("Invalid unicode escape");
+                    int code = 0;
+                    for (int i=0; i<4; i++) {
+                        const int digit = hexValue(p[i]);
+                        if (digit < 0) return fail("Invalid unicode escape");
+                        code = 16*code + digit;
+                    }
+                    p += 4;
+                    result.append(QChar(ushort(code))); // Surrogate pairs are two consecutive escapes
+                  } break;
+                  default:
+                    return fail("Invalid escape sequence");
+                }
+            } else {
+                start = p;
+                while ((p < end) && (*p != '"') && (*p != '\\'))
+                    p++;
+                result.append(QString::fromUtf8(start, p - start));
+            }
+        }
+
+        if (p >= end)
+            return fail("Unterminated string");
+        p++;
+        return true;
+    }
+
+    bool number(QVariant &result)
+    {
+        const char *start = p;
+        bool integer = true;
+        while ((p < end) && (((*p >= '0') && (*p <= '9')) || (*p == '-') || (*p == '+') || (*p == '.') || (*p == 'e') || (*p == 'E'))) {
+            if ((*p == '.') || (*p == 'e') || (*p == 'E'))
+                integer = false;
+            p++;
+        }
+
+        const QByteArray text = QByteArray::fromRawData(start, p - start);
+        bool ok = false;
+        if (integer) {
+            const qlonglong value = text.toLongLong(&ok);
+            if (ok) {
+                if ((value >= std::numeric_limits<int>::min()) && (value <= std::numeric_limits<int>::max()))
+                    result = int(value);
+                else
+                    result = value;
+                return true;
+            }
+        }
+
+        const double value = text.toDouble(&ok);
+        if (!ok)
+            return fail("Invalid number");
+        result = value;
+        return true;
+    }
+
+    bool array(QVariant &result)
+    {
+        p++; // '['
+        QVariantList list;
+        skipSpaces();
+        if ((p < end) && (*p == ']')) {
+            p++;
+            result = list;
+            return true;
+        }
+
+        forever {
+            QVariant element;
+            if (!value(element))
+                return false;
+            list.append(element);
+            skipSpaces();
+            if (p >= end) return fail("Unterminated array");
+            if (*p == ']') break;
+            if (*p != ',') return fail("Expected ',' or ']'");
+            p++;
+        }
+        p++;
+        result = list;
+        return true;
+    }
+
+    // Calls member(key, value) for each member of the object
+    template <typename Visitor>
+    bool object(Visitor &visitor)
+    {
+        skipSpaces();
+        if ((p >= end) || (*p != '{'))
+            return fail("Expected an object");
+        p++;
+        skipSpaces();
+        if ((p < end) && (*p == '}')) {
+            p++;
+            return true;
+        }
+
+        QString key;
+        forever {
+            skipSpaces();
+            if (!string(key))
+                return false;
+            skipSpaces();
+            if ((p >= end) || (*p != ':'))
+                return fail("Expected ':'");
+            p++;
+            QVariant member;
+            if (!value(member))
+                return false;
+            visitor(key, member);
+            skipSpaces();
+            if (p >= end) return fail("Unterminated object");
+            if (*p == '}') break;
+            if (*p != ',') return fail("Expected ',' or '}'");
+            p++;
+        }
+        p++;
+        return true;
+    }
+
+    struct MapVisitor
+    {
+        QVariantMap map;
+        void operator()(const QString &key, const QVariant &value) { map.insert(key, value); }
+    };
+
+    // Objects with exactly the members written by appendPoint() or appendRect() are read back as geometry
+    static QVariant geometry(const QVariantMap &map)
+    {
+        bool numeric = true;
+        for (QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it) {
+            const int type = it.value().userType();
+            numeric = numeric && ((type == QMetaType::Int) || (type == QMetaType::LongLong) || (type == QMetaType::Double));
+        }
+
+        if (numeric && (map.size() == 2) && map.contains("x") && map.contains("y"))
+            return QPointF(map["x"].toDouble(), map["y"].toDouble());
+        if (numeric && (map.size() == 4) && map.contains("x") && map.contains("y") && map.contains("width") && map.contains("height"))
+            return QRectF(map["x"].toDouble(), map["y"].toDouble(), map["width"].toDouble(), map["height"].toDouble());
+        return map;
+    }
+
+    bool value(QVariant &result)
+    {
+        skipSpaces();
+        if (p >= end)
+            return fail("Unexpected end of input");
+
+        switch (*p) {
+          case '{': {
+            MapVisitor visitor;
+            if (!object(visitor))
+                return false;
+            result = geometry(visitor.map);
+            return true;
+          }
+          case '[':
+            return array(result);
+          case '"': {
+            QString s;
+            if (!string(s))
+                return false;
+            result = s;
+            return true;
+          }
+          case 't':
+            result = true;
+            return literal("true", 4);
+          case 'f':
+            result = false;
+            return literal("false", 5);
+          case 'n':
+            result = QVariant();
+            return literal("null", 4);
+          default:
+            if ((*p == '-') || ((*p >= '0') && (*p <= '9')))
+                return number(result);
+            return fail("Unexpected character");
+        }
+    }
+
+    bool finish()
+    {
+        skipSpaces();
+        return (p == end) || fail("Unexpected trailing characters");
+    }
+};
+
+struct FileVisitor
+{
+    File &file;
+    FileVisitor(File &file) : file(file) {}
+    void operator()(const QString &key, const QVariant &value) { file.set(key, value); }
+};
+
+bool parse(const char *json, int size, File &file, QString *error)
+{
+    Reader reader(json, size);
+    FileVisitor visitor(file);
+    const bool ok = reader.object(visitor) && reader.finish();
+    if (!ok && error)
+        *error = reader.error;
+    return ok;
+}
+
+bool parse(const QByteArray &json, QVariant &value, QString *error)
+{
+    Reader reader(json.constData(), json.size());
+    const bool ok = reader.value(value) && reader.finish();
+    if (!ok && error)
+        *error = reader.error;
+    return ok;
+}
+
+} // namespace JSONUtils
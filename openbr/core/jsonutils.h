@@ -0,0 +1,42 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef JSONUTILS_JSONUTILS_H
+#define JSONUTILS_JSONUTILS_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVariant>
+#include <openbr/openbr_plugin.h>
+
+// Streaming JSON for br::File metadata without a QJsonDocument round trip.
+// Points and rects are written as {"x","y"} and {"x","y","width","height"} objects and read back as QPointF and QRectF.
+// Output never contains a raw newline, so one object per line is valid NDJSON.
+namespace JSONUtils
+{
+    /**** Writing ****/
+    void append(QByteArray &json, const QVariant &value);
+    void append(QByteArray &json, const QVariantMap &object);
+    void append(QByteArray &json, const QString &string);
+    void append(QByteArray &json, const br::File &file); // The file's private metadata as an object
+
+    /**** Reading ****/
+    // Parse a JSON object into the file's private metadata, integers are read as int or qlonglong and other numbers as double
+    bool parse(const char *json, int size, br::File &file, QString *error = NULL);
+    bool parse(const QByteArray &json, QVariant &value, QString *error = NULL);
+}
+
+#endif // JSONUTILS_JSONUTILS_H
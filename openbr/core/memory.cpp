@@ -0,0 +1,163 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInteger>
+#include <QBasicMutex>
+#include <QHash>
+#include <QList>
+#include <QMutexLocker>
+#include <algorithm>
+
+#include "memory.h"
+#include "metrics.h"
+#include "profiler.h"
+
+namespace br
+{
+
+// Matrices are preceded by a header holding their charged size and reference count, keeping the data 16 byte aligned
+class AccountedMatAllocator : public cv::MatAllocator
+{
+    static const size_t headerSize = 16;
+    const MemoryAccount account;
+
+public:
+    AccountedMatAllocator(const MemoryAccount &account) : account(account) {}
+
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; i--) {
+            step[i] = total;
+            total *= sizes[i];
+        }
+
+        uchar *block = (uchar*) cv::fastMalloc(total + headerSize);
+        *reinterpret_cast<size_t*>(block) = total;
+        refcount = reinterpret_cast<int*>(block + sizeof(size_t));
+        *refcount = 1;
+        datastart = data = block + headerSize;
+        account.allocated(total);
+    }
+
+    void deallocate(int *refcount, uchar *datastart, uchar *data)
+    {
+        (void) refcount;
+        (void) data;
+        if (!datastart)
+            return;
+        uchar *block = datastart - headerSize;
+        account.freed(*reinterpret_cast<size_t*>(block));
+        cv::fastFree(block);
+    }
+};
+
+// Never deleted, matrices charged to an account may be released during static destruction
+struct MemoryAccount::Data
+{
+    QString name;
+    QAtomicInteger<qint64> current, peak, reportedMB;
+    Metrics::Gauge currentGauge, peakGauge;
+    AccountedMatAllocator *allocator;
+};
+
+static QBasicMutex accountsLock;
+
+QList<MemoryAccount::Data*> &MemoryAccount::accounts()
+{
+    static QList<Data*> accounts;
+    return accounts;
+}
+
+MemoryAccount::MemoryAccount(const QString &subsystem)
+{
+    QMutexLocker locker(&accountsLock);
+    foreach (Data *data, accounts())
+        if (data->name == subsystem) {
+            d = data;
+            return;
+        }
+
+    d = new Data();
+    d->name = subsystem;
+    d->currentGauge = Metrics::Gauge(QString("br_memory_bytes{subsystem=\"%1\"}").arg(subsystem), "Bytes held by a subsystem.");
+    d->peakGauge = Metrics::Gauge(QString("br_memory_peak_bytes{subsystem=\"%1\"}").arg(subsystem), "Most bytes held by a subsystem at once.");
+    d->allocator = new AccountedMatAllocator(*this);
+    accounts().append(d);
+}
+
+void MemoryAccount::allocated(qint64 bytes) const
+{
+    if (!d)
+        return;
+
+    const qint64 current = d->current.fetchAndAddRelaxed(bytes) + bytes;
+    qint64 peak = d->peak.load();
+    while ((current > peak) && !d->peak.testAndSetRelaxed(peak, current))
+        peak = d->peak.load();
+    d->currentGauge.set(current);
+    d->peakGauge.set(std::max(peak, current));
+
+    // Sampled at megabyte granularity so the profile isn't flooded by small charges
+    const qint64 mb = current >> 20;
+    if (Profiler::enabled() && (d->reportedMB.fetchAndStoreRelaxed(mb) != mb))
+        Profiler::counter("Memory " + d->name + " (MB)", mb);
+}
+
+void MemoryAccount::freed(qint64 bytes) const
+{
+    if (!d)
+        return;
+
+    const qint64 current = d->current.fetchAndAddRelaxed(-bytes) - bytes;
+    d->currentGauge.set(current);
+
+    const qint64 mb = current >> 20;
+    if (Profiler::enabled() && (d->reportedMB.fetchAndStoreRelaxed(mb) != mb))
+        Profiler::counter("Memory " + d->name + " (MB)", mb);
+}
+
+qint64 MemoryAccount::current() const
+{
+    return d ? d->current.load() : 0;
+}
+
+qint64 MemoryAccount::peak() const
+{
+    return d ? d->peak.load() : 0;
+}
+
+cv::MatAllocator *MemoryAccount::allocator() const
+{
+    return d ? d->allocator : NULL;
+}
+
+void MemoryAccount::report()
+{
+    QList<Data*> list;
+    {
+        QMutexLocker locker(&accountsLock);
+        list = accounts();
+    }
+    if (list.isEmpty())
+        return;
+
+    qDebug("%-30s %14s %14s", "Memory", "Current (MB)", "Peak (MB)");
+    foreach (const Data *data, list)
+        qDebug("%-30s %14.1f %14.1f", qPrintable(data->name), data->current.load() / 1048576.0, data->peak.load() / 1048576.0);
+}
+
+} // namespace br
@@ -0,0 +1,57 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_MEMORY_H
+#define BR_MEMORY_H
+
+#include <QList>
+#include <QString>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Bytes held by a subsystem, such as MatrixOutput or memGallery, and the most it has held at once.
+// Accounts are exported as br::Metrics gauges and recorded as counters in the profile,
+// and Context::finalize prints every account when verbose or profiling.
+// Constructing an account looks up its name, so construct once and charge often.
+class BR_EXPORT MemoryAccount
+{
+public:
+    MemoryAccount() : d(NULL) {}
+    explicit MemoryAccount(const QString &subsystem);
+
+    void allocated(qint64 bytes) const;
+    void freed(qint64 bytes) const;
+    qint64 current() const;
+    qint64 peak() const;
+
+    // Assign to cv::Mat::allocator before cv::Mat::create() to charge the matrix to the account until it is released
+    cv::MatAllocator *allocator() const;
+
+    static void report();
+
+private:
+    struct Data;
+    Data *d;
+
+    static QList<Data*> &accounts();
+};
+
+} // namespace br
+
+#endif // BR_MEMORY_H
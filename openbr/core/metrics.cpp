@@ -0,0 +1,447 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInteger>
+#include <QBasicMutex>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QMutexLocker>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QThreadStorage>
+#include <QVector>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <stdio.h>
+#include <unistd.h>
+#endif // __linux__
+
+#include "metrics.h"
+
+namespace br
+{
+
+static const int MaxMetrics = 1024;
+
+// Values below 2^SubBucketBits get a bucket each, larger ones share 2^SubBucketBits buckets per power of two
+static const int SubBucketBits = 5;
+static const int SubBuckets = 1 << SubBucketBits;
+static const int MaxExponent = 36; // Larger values, over 19 hours in microseconds, saturate
+static const int HistogramBuckets = (MaxExponent - SubBucketBits + 2) * SubBuckets;
+
+struct MetricInfo
+{
+    QByteArray name, family, help;
+    const char *type;
+};
+
+struct HistogramCounts
+{
+    QAtomicInteger<qint64> buckets[HistogramBuckets];
+    QAtomicInteger<qint64> sum;
+};
+
+// Leased by one thread at a time and owned by the registry, so counts survive the thread exiting.
+// A thread returns its shard when it exits and the next new thread reuses it, so there are only as many
+// shards as threads ever alive at once. Histogram counts are allocated the first time they are recorded.
+struct MetricsShard
+{
+    QAtomicInteger<qint64> values[MaxMetrics];
+    QAtomicPointer<HistogramCounts> histograms[MaxMetrics];
+
+    ~MetricsShard()
+    {
+        for (int i=0; i<MaxMetrics; i++)
+            delete histograms[i].load();
+    }
+};
+
+// Constant initialized, so metrics can be constructed during static initialization of other translation units
+static QBasicMutex metricsLock;
+
+static QList<MetricInfo> &metricInfos()
+{
+    static QList<MetricInfo> infos;
+    return infos;
+}
+
+// Never destroyed, threads may return their shards after static destruction begins
+static QList< QSharedPointer<MetricsShard> > &metricsShards()
+{
+    static QList< QSharedPointer<MetricsShard> > *shards = new QList< QSharedPointer<MetricsShard> >();
+    return *shards;
+}
+
+static QList< QSharedPointer<MetricsShard> > &freeMetricsShards()
+{
+    static QList< QSharedPointer<MetricsShard> > *shards = new QList< QSharedPointer<MetricsShard> >();
+    return *shards;
+}
+
+static QAtomicInteger<qint64> *gaugeValues()
+{
+    static QAtomicInteger<qint64> values[MaxMetrics];
+    return values;
+}
+
+// Deleted by QThreadStorage when its thread exits
+struct ShardLease
+{
+    QSharedPointer<MetricsShard> shard;
+
+    ~ShardLease()
+    {
+        QMutexLocker locker(&metricsLock);
+        freeMetricsShards().append(shard);
+    }
+};
+
+static QThreadStorage<ShardLease*> currentShard;
+
+static MetricsShard *metricsShard()
+{
+    if (!currentShard.hasLocalData()) {
+        ShardLease *lease = new ShardLease();
+        {
+            QMutexLocker locker(&metricsLock);
+            if (freeMetricsShards().isEmpty()) {
+                lease->shard = QSharedPointer<MetricsShard>(new MetricsShard());
+                metricsShards().append(lease->shard);
+            } else {
+                lease->shard = freeMetricsShards().takeLast();
+            }
+        }
+        currentShard.setLocalData(lease);
+    }
+    return currentShard.localData()->shard.data();
+}
+
+// Guarded by metricsLock
+static QHash<QByteArray, int> &metricIds()
+{
+    static QHash<QByteArray, int> ids;
+    return ids;
+}
+
+// Metrics with the same name share an id
+static int registerMetric(const QString &name, const QString &help, const char *type)
+{
+    QMutexLocker locker(&metricsLock);
+    QHash<QByteArray, int> &ids = metricIds();
+    const QByteArray key = name.toUtf8();
+    QHash<QByteArray, int>::const_iterator it = ids.constFind(key);
+    if (it != ids.constEnd())
+        return it.value();
+
+    if (metricInfos().size() >= MaxMetrics)
+        qFatal("Too many metrics registering %s.", key.constData());
+    MetricInfo info;
+    info.name = key;
+    info.family = key.left(key.indexOf('{') < 0 ? key.size() : key.indexOf('{'));
+    info.help = help.toUtf8();
+    info.type = type;
+    metricInfos().append(info);
+    ids.insert(key, metricInfos().size()-1);
+    return metricInfos().size()-1;
+}
+
+Metrics::Counter::Counter(const QString &name, const QString &help)
+    : id(registerMetric(name, help, "counter"))
+{}
+
+void Metrics::Counter::add(qint64 value) const
+{
+    if (id >= 0)
+        metricsShard()->values[id].fetchAndAddRelaxed(value);
+}
+
+Metrics::Gauge::Gauge(const QString &name, const QString &help)
+    : id(registerMetric(name, help, "gauge"))
+{}
+
+void Metrics::Gauge::set(qint64 value) const
+{
+    if (id >= 0)
+        gaugeValues()[id].store(value);
+}
+
+void Metrics::Gauge::add(qint64 delta) const
+{
+    if (id >= 0)
+        gaugeValues()[id].fetchAndAddRelaxed(delta);
+}
+
+static int bucketIndex(qint64 value)
+{
+    if (value < SubBuckets)
+        return std::max(value, qint64(0));
+#ifdef __GNUC__
+    const int exponent = 63 - __builtin_clzll(quint64(value));
+#else
+    int exponent = 0;
+    for (quint64 v = quint64(value) >> 1; v; v >>= 1)
+        exponent++;
+#endif
+    if (exponent > MaxExponent)
+        return HistogramBuckets - 1;
+    return (exponent - SubBucketBits + 1) * SubBuckets + int(value >> (exponent - SubBucketBits)) - SubBuckets;
+}
+
+// The largest value recorded to a bucket
+static qint64 bucketValue(int index)
+{
+    if (index < SubBuckets)
+        return index;
+    const int shift = index / SubBuckets - 1;
+    return ((qint64(index % SubBuckets + SubBuckets) + 1) << shift) - 1;
+}
+
+Metrics::Histogram::Histogram(const QString &name, const QString &help)
+    : id(registerMetric(name, help, "summary"))
+{}
+
+void Metrics::Histogram::record(qint64 value) const
+{
+    if (id < 0)
+        return;
+    MetricsShard *shard = metricsShard();
+    HistogramCounts *counts = shard->histograms[id].loadAcquire();
+    if (counts == NULL) {
+        // Released so readers merging the shard see the zeroed counts
+        counts = new HistogramCounts();
+        shard->histograms[id].storeRelease(counts);
+    }
+    counts->buckets[bucketIndex(value)].fetchAndAddRelaxed(1);
+    counts->sum.fetchAndAddRelaxed(value);
+}
+
+// Bucket counts summed across threads, returns the total count
+static qint64 mergeHistogram(int id, const QList< QSharedPointer<MetricsShard> > &shards, QVector<qint64> &buckets, qint64 &sum)
+{
+    buckets = QVector<qint64>(HistogramBuckets, 0);
+    sum = 0;
+    qint64 count = 0;
+    foreach (const QSharedPointer<MetricsShard> &shard, shards) {
+        const HistogramCounts *counts = shard->histograms[id].loadAcquire();
+        if (counts == NULL)
+            continue;
+        for (int i=0; i<HistogramBuckets; i++) {
+            const qint64 n = counts->buckets[i].load();
+            buckets[i] += n;
+            count += n;
+        }
+        sum += counts->sum.load();
+    }
+    return count;
+}
+
+static qint64 histogramQuantile(const QVector<qint64> &buckets, qint64 count, double q)
+{
+    if (count == 0)
+        return 0;
+    const qint64 rank = std::max(qint64(1), qint64(ceil(q * count)));
+    qint64 seen = 0;
+    for (int i=0; i<buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return bucketValue(i);
+    }
+    return bucketValue(buckets.size()-1);
+}
+
+static QList< QSharedPointer<MetricsShard> > currentShards()
+{
+    QMutexLocker locker(&metricsLock);
+    return metricsShards();
+}
+
+qint64 Metrics::Histogram::count() const
+{
+    if (id < 0)
+        return 0;
+    QVector<qint64> buckets;
+    qint64 sum;
+    return mergeHistogram(id, currentShards(), buckets, sum);
+}
+
+qint64 Metrics::Histogram::quantile(double q) const
+{
+    if (id < 0)
+        return 0;
+    QVector<qint64> buckets;
+    qint64 sum;
+    const qint64 count = mergeHistogram(id, currentShards(), buckets, sum);
+    return histogramQuantile(buckets, count, q);
+}
+
+Metrics::Timer::Timer(const Histogram &histogram)
+    : histogram(histogram)
+{
+    if (Globals && !Globals->latency.isEmpty())
+        timer.start();
+}
+
+Metrics::Timer::~Timer()
+{
+    if (timer.isValid())
+        histogram.record(timer.nsecsElapsed() / 1000);
+}
+
+Metrics::Histogram Metrics::Histogram::find(const QString &name)
+{
+    Histogram histogram;
+    QMutexLocker locker(&metricsLock);
+    QHash<QByteArray, int>::const_iterator it = metricIds().constFind(name.toUtf8());
+    if ((it != metricIds().constEnd()) && !strcmp(metricInfos()[it.value()].type, "summary"))
+        histogram.id = it.value();
+    return histogram;
+}
+
+QString Metrics::latencyName(const QString &call)
+{
+    return QString("br_call_latency_microseconds{call=\"%1\"}").arg(call);
+}
+
+Metrics::Histogram Metrics::latency(const QString &call)
+{
+    return Histogram(latencyName(call), "Latency of C API and Janus calls, recorded while br::Context::latency is set.");
+}
+
+// Inserts a label into a metric name, which may already have a label set
+static QByteArray withLabel(const QByteArray &name, const QByteArray &suffix, const QByteArray &label)
+{
+    const int brace = name.indexOf('{');
+    if (brace < 0)
+        return name + suffix + (label.isEmpty() ? QByteArray() : "{" + label + "}");
+    return name.left(brace) + suffix + name.mid(brace, name.size()-brace-1) + (label.isEmpty() ? QByteArray() : "," + label) + "}";
+}
+
+static void appendFamily(QByteArray &text, const QByteArray &family, const QByteArray &help, const char *type)
+{
+    text += "# HELP " + family + " " + help + "\n";
+    text += "# TYPE " + family + " " + type + "\n";
+}
+
+QByteArray Metrics::exposition()
+{
+    QList<MetricInfo> infos;
+    QList< QSharedPointer<MetricsShard> > shards;
+    {
+        QMutexLocker locker(&metricsLock);
+        infos = metricInfos();
+        shards = metricsShards();
+    }
+
+    // Samples of a family must be consecutive, within a family they are in registration order
+    QList< QPair<QByteArray, int> > order;
+    for (int i=0; i<infos.size(); i++)
+        order.append(QPair<QByteArray, int>(infos[i].family, i));
+    std::sort(order.begin(), order.end());
+
+    QByteArray text;
+    QByteArray family;
+    for (int i=0; i<order.size(); i++) {
+        const int id = order[i].second;
+        const MetricInfo *info = &infos[id];
+        if (info->family != family) {
+            family = info->family;
+            appendFamily(text, family, info->help, info->type);
+        }
+
+        if (!strcmp(info->type, "summary")) {
+            QVector<qint64> buckets;
+            qint64 sum;
+            const qint64 count = mergeHistogram(id, shards, buckets, sum);
+            foreach (double q, QList<double>() << 0.5 << 0.9 << 0.99 << 0.999)
+                text += withLabel(info->name, "", "quantile=\"" + QByteArray::number(q) + "\"") + " " + QByteArray::number(histogramQuantile(buckets, count, q)) + "\n";
+            text += withLabel(info->name, "_sum", "") + " " + QByteArray::number(sum) + "\n";
+            text += withLabel(info->name, "_count", "") + " " + QByteArray::number(count) + "\n";
+            continue;
+        }
+
+        qint64 value = 0;
+        if (!strcmp(info->type, "counter")) {
+            foreach (const QSharedPointer<MetricsShard> &shard, shards)
+                value += shard->values[id].load();
+        } else {
+            value = gaugeValues()[id].load();
+        }
+        text += info->name + " " + QByteArray::number(value) + "\n";
+    }
+
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) == 2) {
+            appendFamily(text, "process_resident_memory_bytes", "Resident memory size in bytes.", "gauge");
+            text += "process_resident_memory_bytes " + QByteArray::number(qint64(resident) * sysconf(_SC_PAGESIZE)) + "\n";
+        }
+        fclose(statm);
+    }
+#endif // __linux__
+
+    if (Globals) {
+        appendFamily(text, "br_progress_steps", "Steps completed by the current br::Context operation.", "gauge");
+        text += "br_progress_steps " + QByteArray::number(Globals->currentStep, 'f', 0) + "\n";
+        appendFamily(text, "br_progress_ratio", "Fraction of the current br::Context operation completed.", "gauge");
+        text += "br_progress_ratio " + QByteArray::number(Globals->totalSteps > 0 ? Globals->currentProgress / Globals->totalSteps : 0) + "\n";
+    }
+
+    return text;
+}
+
+QStringList Metrics::latencyReport()
+{
+    QList<MetricInfo> infos;
+    QList< QSharedPointer<MetricsShard> > shards;
+    {
+        QMutexLocker locker(&metricsLock);
+        infos = metricInfos();
+        shards = metricsShards();
+    }
+
+    QStringList lines;
+    lines.append("Call,Count,Mean,P50,P90,P99,P999,Max");
+    for (int id=0; id<infos.size(); id++) {
+        const QByteArray &name = infos[id].name;
+        if (strcmp(infos[id].type, "summary") || !name.startsWith("br_call_latency_microseconds{call=\""))
+            continue;
+
+        QVector<qint64> buckets;
+        qint64 sum;
+        const qint64 count = mergeHistogram(id, shards, buckets, sum);
+        if (count == 0)
+            continue;
+
+        const int begin = name.indexOf('"') + 1;
+        lines.append(QString("%1,%2,%3,%4,%5,%6,%7,%8").arg(QString::fromUtf8(name.mid(begin, name.lastIndexOf('"') - begin)),
+                                                          QString::number(count),
+                                                          QString::number(double(sum) / count, 'f', 1),
+                                                          QString::number(histogramQuantile(buckets, count, 0.5)),
+                                                          QString::number(histogramQuantile(buckets, count, 0.9)),
+                                                          QString::number(histogramQuantile(buckets, count, 0.99)),
+                                                          QString::number(histogramQuantile(buckets, count, 0.999)),
+                                                          QString::number(histogramQuantile(buckets, count, 1))));
+    }
+    return lines;
+}
+
+} // namespace br
@@ -0,0 +1,105 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_METRICS_H
+#define BR_METRICS_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+#include <QStringList>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Process-wide counters, gauges and histograms, exported in the Prometheus text exposition format.
+// Counters are sharded per thread so incrementing one is an uncontended atomic add, rates such as
+// templates per second are left to the monitoring system. Constructing a metric looks up its name,
+// so construct once, for example as a static or a member, and increment often.
+// Names may carry a label set, such as br_stream_queue_depth{stage="1"}.
+class BR_EXPORT Metrics
+{
+public:
+    // A monotonically increasing count, such as templates enrolled
+    class BR_EXPORT Counter
+    {
+    public:
+        Counter() : id(-1) {}
+        Counter(const QString &name, const QString &help);
+        void add(qint64 value = 1) const;
+
+    private:
+        int id;
+    };
+
+    // A value that goes up and down, such as a queue depth
+    class BR_EXPORT Gauge
+    {
+    public:
+        Gauge() : id(-1) {}
+        Gauge(const QString &name, const QString &help);
+        void set(qint64 value) const;
+        void add(qint64 delta) const;
+
+    private:
+        int id;
+    };
+
+    // A distribution of values, such as call latencies in microseconds, exported as a summary.
+    // Buckets are log-linear, 32 per power of two, so quantiles are within about 3% of the recorded values.
+    class BR_EXPORT Histogram
+    {
+    public:
+        Histogram() : id(-1) {}
+        Histogram(const QString &name, const QString &help);
+        void record(qint64 value) const;
+        qint64 count() const;
+        qint64 quantile(double q) const; // 0 if nothing was recorded
+
+        // The histogram registered as name, or one that never has samples, without registering name
+        static Histogram find(const QString &name);
+
+    private:
+        int id;
+    };
+
+    // Records the lifetime of a scope to a histogram in microseconds, while Globals->latency is set
+    class BR_EXPORT Timer
+    {
+    public:
+        explicit Timer(const Histogram &histogram);
+        ~Timer();
+
+    private:
+        const Histogram &histogram;
+        QElapsedTimer timer; // Invalid if not timing
+    };
+
+    // The latency histogram of an API call, such as janus_search
+    static Histogram latency(const QString &call);
+    static QString latencyName(const QString &call);
+
+    // Every metric, plus the process resident set size and the br::Context progress
+    static QByteArray exposition();
+
+    // One CSV row of count, mean and quantiles in microseconds per latency histogram with samples
+    static QStringList latencyReport();
+};
+
+} // namespace br
+
+#endif // BR_METRICS_H
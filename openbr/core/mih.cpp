@@ -0,0 +1,100 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+
+#include "distance_sse.h"
+#include "mih.h"
+
+namespace br
+{
+
+quint32 MultiIndexHash::substring(const uchar *code, int index) const
+{
+    quint32 key = 0;
+    const int begin = index * substringBytes;
+    const int end = std::min(begin + substringBytes, bytes);
+    for (int i=begin; i<end; i++)
+        key = (key << 8) | code[i];
+    return key;
+}
+
+void MultiIndexHash::build(const TemplateList &templates, int substrings)
+{
+    codes.clear();
+    tables.clear();
+    bytes = 0;
+    foreach (const Template &t, templates)
+        if (!t.isEmpty() && !t.m().empty()) {
+            bytes = t.m().total() * t.m().elemSize();
+            break;
+        }
+    if (bytes == 0)
+        return;
+
+    if (substrings <= 0)
+        substrings = (bytes + 1) / 2;
+    substringBytes = std::min(4, (bytes + substrings - 1) / substrings);
+    substrings = (bytes + substringBytes - 1) / substringBytes;
+    tables.resize(substrings);
+
+    codes.reserve(templates.size());
+    for (int i=0; i<templates.size(); i++) {
+        const Template &t = templates[i];
+        const bool valid = !t.isEmpty() && t.m().isContinuous() && (int(t.m().total() * t.m().elemSize()) == bytes);
+        codes.append(valid ? t.m().data : NULL);
+        if (!valid)
+            continue;
+        for (int j=0; j<substrings; j++)
+            tables[j][substring(t.m().data, j)].append(i);
+    }
+}
+
+// Visits every key within flips bits of key, starting at bit position first
+static void probe(const QHash<quint32, QVector<int> > &table, quint32 key, int bits, int first, int flips, QVector<int> &candidates)
+{
+    QHash<quint32, QVector<int> >::const_iterator it = table.find(key);
+    if (it != table.end())
+        candidates += it.value();
+    if (flips == 0)
+        return;
+    for (int i=first; i<bits; i++)
+        probe(table, key ^ (quint32(1) << i), bits, i+1, flips-1, candidates);
+}
+
+QVector<int> MultiIndexHash::search(const uchar *query, int radius) const
+{
+    QVector<int> candidates;
+    if (tables.isEmpty() || (radius < 0))
+        return candidates;
+
+    const int flips = radius / tables.size();
+    for (int j=0; j<tables.size(); j++) {
+        const int bits = 8 * (std::min((j+1) * substringBytes, bytes) - j * substringBytes);
+        probe(tables[j], substring(query, j), bits, 0, std::min(flips, bits), candidates);
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    QVector<int> matches;
+    foreach (int candidate, candidates)
+        if (hamming(codes[candidate], query, bytes) <= radius)
+            matches.append(candidate);
+    return matches;
+}
+
+} // namespace br
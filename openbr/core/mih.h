@@ -0,0 +1,52 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_MIH_H
+#define BR_MIH_H
+
+#include <QHash>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Multi-index hashing of bit-packed codes, after Norouzi, Punjani and Fleet.
+// Each code is split into disjoint substrings with one hash table per substring.
+// By the pigeonhole principle, any code within radius r of a query matches it to within r/m bits in one of its m substrings,
+// so probing each table with the query's substrings and their near neighbors finds every code within r without a linear scan.
+class BR_EXPORT MultiIndexHash
+{
+public:
+    // Indexes the matrix of each template, see Template::m(), substrings are 16 bits wide when zero
+    void build(const TemplateList &templates, int substrings = 0);
+
+    // Indices of the codes within radius bits of query, in ascending order
+    QVector<int> search(const uchar *query, int radius) const;
+
+    int size() const { return codes.size(); }
+
+private:
+    int bytes, substringBytes;
+    QVector<const uchar*> codes;
+    QVector< QHash<quint32, QVector<int> > > tables;
+
+    quint32 substring(const uchar *code, int index) const;
+};
+
+} // namespace br
+
+#endif // BR_MIH_H
@@ -0,0 +1,107 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "nameindex.h"
+
+namespace br
+{
+
+NameIndex::NameIndex()
+{
+    table.resize(16);
+    for (int i=0; i<table.size(); i++)
+        table[i].entry = -1;
+}
+
+NameIndex::NameIndex(const QStringList &names)
+{
+    int capacity = 16;
+    while (capacity < 2 * names.size())
+        capacity *= 2;
+    table.resize(capacity);
+    for (int i=0; i<table.size(); i++)
+        table[i].entry = -1;
+    this->names.reserve(names.size());
+    rows.reserve(names.size());
+    for (int i=0; i<names.size(); i++)
+        insert(names[i], i);
+}
+
+// FNV-1a, the low bits pick the slot so they must depend on every character
+quint64 NameIndex::hash(const QString &name)
+{
+    quint64 h = Q_UINT64_C(14695981039346656037);
+    const ushort *data = name.utf16();
+    for (int i=0; i<name.size(); i++) {
+        h ^= data[i];
+        h *= Q_UINT64_C(1099511628211);
+    }
+    return h ^ (h >> 32);
+}
+
+void NameIndex::insert(const QString &name, int row)
+{
+    if (2 * (names.size() + 1) > table.size())
+        grow();
+
+    const quint64 h = hash(name);
+    const int mask = table.size() - 1;
+    for (int i=int(h & mask); ; i=(i+1) & mask) {
+        Slot &slot = table[i];
+        if (slot.entry == -1) {
+            slot.hash = h;
+            slot.entry = names.size();
+            names.append(name);
+            rows.append(row);
+            return;
+        }
+        if ((slot.hash == h) && (names[slot.entry] == name))
+            return; // Keep the first occurrence
+    }
+}
+
+int NameIndex::indexOf(const QString &name) const
+{
+    const quint64 h = hash(name);
+    const int mask = table.size() - 1;
+    for (int i=int(h & mask); ; i=(i+1) & mask) {
+        const Slot &slot = table[i];
+        if (slot.entry == -1)
+            return -1;
+        if ((slot.hash == h) && (names[slot.entry] == name))
+            return rows[slot.entry];
+    }
+}
+
+void NameIndex::grow()
+{
+    QVector<Slot> larger(2 * table.size());
+    for (int i=0; i<larger.size(); i++)
+        larger[i].entry = -1;
+
+    const int mask = larger.size() - 1;
+    foreach (const Slot &slot, table) {
+        if (slot.entry == -1)
+            continue;
+        int i = int(slot.hash & mask);
+        while (larger[i].entry != -1)
+            i = (i+1) & mask;
+        larger[i] = slot;
+    }
+    table = larger;
+}
+
+} // namespace br
@@ -0,0 +1,64 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_NAMEINDEX_H
+#define BR_NAMEINDEX_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Finds the row of a name in a gallery, used to join predictions to ground truth by name.
+// Each distinct name is stored once, in an open addressing table with linear probing that
+// keeps the full hash of every entry so names are only compared when their hashes match.
+class BR_EXPORT NameIndex
+{
+public:
+    NameIndex();
+
+    // Indexes the first occurrence of each name.
+    explicit NameIndex(const QStringList &names);
+
+    void insert(const QString &name, int row);
+
+    // The row of name, or -1 if it wasn't indexed.
+    int indexOf(const QString &name) const;
+
+    bool contains(const QString &name) const { return indexOf(name) != -1; }
+    int size() const { return names.size(); }
+
+private:
+    struct Slot
+    {
+        quint64 hash;
+        int entry; // -1 when empty
+    };
+
+    QVector<Slot> table; // Size is a power of two, at most half full
+    QStringList names;
+    QVector<int> rows;
+
+    static quint64 hash(const QString &name);
+    void grow();
+};
+
+} // namespace br
+
+#endif // BR_NAMEINDEX_H
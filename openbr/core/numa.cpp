@@ -0,0 +1,93 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include <QThread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "numa.h"
+
+namespace br
+{
+
+// Parses kernel CPU lists such as "0-7,16-23"
+static QList<int> parseCPUList(const QString &list)
+{
+    QList<int> cpus;
+    foreach (const QString &range, list.trimmed().split(',', QString::SkipEmptyParts)) {
+        const QStringList bounds = range.split('-');
+        const int first = bounds.first().toInt();
+        const int last = bounds.last().toInt();
+        for (int cpu=first; cpu<=last; cpu++)
+            cpus.append(cpu);
+    }
+    return cpus;
+}
+
+QList< QList<int> > NUMA::nodes()
+{
+    QList< QList<int> > nodes;
+#ifdef __linux__
+    const QDir dir("/sys/devices/system/node");
+    foreach (const QString &node, dir.entryList(QStringList() << "node*", QDir::Dirs)) {
+        QFile file(dir.filePath(node + "/cpulist"));
+        if (!file.open(QFile::ReadOnly))
+            continue;
+        const QList<int> cpus = parseCPUList(QString::fromLatin1(file.readAll()));
+        if (!cpus.isEmpty())
+            nodes.append(cpus);
+    }
+#endif
+
+    if (nodes.isEmpty()) {
+        QList<int> cpus;
+        for (int i=0; i<std::max(1, QThread::idealThreadCount()); i++)
+            cpus.append(i);
+        nodes.append(cpus);
+    }
+    return nodes;
+}
+
+bool NUMA::bindCurrentThread(const QList<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    foreach (int cpu, cpus)
+        CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+#elif defined(_WIN32)
+    DWORD_PTR mask = 0;
+    foreach (int cpu, cpus)
+        if (cpu < int(8*sizeof(DWORD_PTR)))
+            mask |= DWORD_PTR(1) << cpu;
+    return (mask != 0) && SetThreadAffinityMask(GetCurrentThread(), mask);
+#else
+    // Affinity isn't available, threads keep running anywhere
+    (void) cpus;
+    return true;
+#endif
+}
+
+} // namespace br
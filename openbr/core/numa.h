@@ -0,0 +1,42 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_NUMA_H
+#define BR_NUMA_H
+
+#include <QList>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Memory nodes of the machine and the logical CPUs local to each, read from
+// /sys/devices/system/node on Linux. Elsewhere, or when the topology can't be
+// read, the machine is a single node of every CPU.
+//
+// Linux places a page on the node of the thread that first touches it, so a
+// buffer allocated and filled by a thread bound to a node stays local to it.
+namespace NUMA
+{
+    BR_EXPORT QList< QList<int> > nodes();
+
+    // Restricts the calling thread to the given logical CPUs.
+    BR_EXPORT bool bindCurrentThread(const QList<int> &cpus);
+}
+
+} // namespace br
+
+#endif // BR_NUMA_H
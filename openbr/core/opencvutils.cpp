@@ -23,7 +23,17 @@
 #include "opencvutils.h"
 #include "qtutils.h"
 
+#include <QFile>
+#include <QScopedPointer>
 #include <QTemporaryFile>
+#include <QThreadStorage>
+#include <limits>
+
+#ifdef BR_WITH_JPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif // BR_WITH_JPEG
 
 using namespace cv;
 using namespace std;
@@ -75,6 +85,146 @@ void OpenCVUtils::showImage(const Mat &src, const QString &window, bool waitKey)
     cv::waitKey(waitKey ? -1 : 1);
 }
 
+#ifdef BR_WITH_JPEG
+
+struct JPEGDecoder
+{
+    jpeg_decompress_struct info;
+    jpeg_error_mgr error;
+    jmp_buf jump;
+    Mat image;
+
+    JPEGDecoder()
+    {
+        info.err = jpeg_std_error(&error);
+        error.error_exit = errorExit;
+        info.client_data = this;
+        jpeg_create_decompress(&info);
+    }
+
+    ~JPEGDecoder()
+    {
+        jpeg_destroy_decompress(&info);
+    }
+
+    static void errorExit(j_common_ptr info)
+    {
+        longjmp(static_cast<JPEGDecoder*>(info->client_data)->jump, 1);
+    }
+};
+
+// Decodes with the DCT scaled down as far as maxSize allows, return an empty matrix to fall back on cv::imdecode
+static Mat decodeReducedJPEG(const Mat &buffer, int flags, int maxSize, int &scale)
+{
+    const uchar *data = buffer.ptr();
+    const size_t size = buffer.total() * buffer.elemSize();
+    if (!buffer.isContinuous() || (size < 3) || (data[0] != 0xFF) || (data[1] != 0xD8) || (data[2] != 0xFF))
+        return Mat();
+
+    // Heap allocated so its state survives a longjmp from libjpeg
+    QScopedPointer<JPEGDecoder> decoder(new JPEGDecoder());
+    if (setjmp(decoder->jump))
+        return Mat();
+
+    jpeg_decompress_struct &info = decoder->info;
+    jpeg_mem_src(&info, const_cast<uchar*>(data), size);
+    jpeg_read_header(&info, TRUE);
+
+    // Same channel selection as cv::imread
+    if ((info.num_components != 1) && (info.num_components != 3))
+        return Mat();
+    const bool color = (flags < 0) ? (info.num_components > 1) : ((flags & IMREAD_COLOR) || ((flags & IMREAD_ANYCOLOR) && (info.num_components > 1)));
+    info.out_color_space = color ? JCS_RGB : JCS_GRAYSCALE;
+
+    int denom = 1;
+    while ((denom < 8) && (int(std::max(info.image_width, info.image_height)) >= 2*denom*maxSize))
+        denom *= 2;
+    info.scale_num = 1;
+    info.scale_denom = denom;
+
+    jpeg_start_decompress(&info);
+    decoder->image.create(info.output_height, info.output_width, CV_8UC(info.output_components));
+    while (info.output_scanline < info.output_height) {
+        JSAMPROW row = decoder->image.ptr(info.output_scanline);
+        jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+
+    if (color)
+        cvtColor(decoder->image, decoder->image, CV_RGB2BGR);
+    scale = denom;
+    return decoder->image;
+}
+
+#endif // BR_WITH_JPEG
+
+Mat OpenCVUtils::imdecode(const Mat &buffer, int flags, int maxSize, int *scale)
+{
+    if (scale)
+        *scale = 1;
+
+#ifdef BR_WITH_JPEG
+    if (maxSize > 0) {
+        int reduction = 1;
+        const Mat image = decodeReducedJPEG(buffer, flags, maxSize, reduction);
+        if (image.data) {
+            if (scale)
+                *scale = reduction;
+            return image;
+        }
+    }
+#else
+    (void) maxSize;
+#endif // BR_WITH_JPEG
+
+    return cv::imdecode(buffer, flags);
+}
+
+static inline int bigEndian16(const uchar *p) { return (p[0] << 8) | p[1]; }
+static inline int bigEndian32(const uchar *p) { return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static inline int littleEndian16(const uchar *p) { return p[0] | (p[1] << 8); }
+static inline int littleEndian32(const uchar *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24); }
+
+Size OpenCVUtils::imageSize(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly))
+        return Size();
+
+    const QByteArray header = file.read(26);
+    const uchar *h = reinterpret_cast<const uchar*>(header.constData());
+    if (header.size() < 10)
+        return Size();
+
+    if ((header.size() >= 24) && header.startsWith("\x89PNG"))
+        return Size(bigEndian32(h+16), bigEndian32(h+20));
+    if (header.startsWith("GIF8"))
+        return Size(littleEndian16(h+6), littleEndian16(h+8));
+    if ((header.size() >= 26) && header.startsWith("BM"))
+        return Size(littleEndian32(h+18), abs(littleEndian32(h+22)));
+
+    if ((h[0] != 0xFF) || (h[1] != 0xD8))
+        return Size();
+
+    // Walk the JPEG segments up to the first start of frame
+    qint64 offset = 2;
+    while (file.seek(offset)) {
+        const QByteArray segment = file.read(9);
+        const uchar *s = reinterpret_cast<const uchar*>(segment.constData());
+        if ((segment.size() < 4) || (s[0] != 0xFF))
+            return Size();
+        const uchar marker = s[1];
+        if (marker == 0xFF) { // Fill byte
+            offset++;
+            continue;
+        }
+        if ((marker >= 0xC0) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC))
+            return segment.size() < 9 ? Size() : Size(bigEndian16(s+7), bigEndian16(s+5));
+        offset += 2 + bigEndian16(s+2);
+    }
+    return Size();
+}
+
 void OpenCVUtils::cvtGray(const Mat &src, Mat &dst)
 {
     if      (src.channels() == 3) cvtColor(src, dst, CV_BGR2GRAY);
@@ -285,7 +435,11 @@ void OpenCVUtils::loadModel(CvStatModel &model, QDataStream &stream)
     // Copy local file contents from stream
     QByteArray data;
     stream >> data;
+    loadModel(model, data);
+}
 
+void OpenCVUtils::loadModel(CvStatModel &model, const QByteArray &data)
+{
     // Create local file
     QTemporaryFile tempFile(QDir::tempPath()+"/model");
     tempFile.open();
@@ -382,6 +536,143 @@ bool OpenCVUtils::overlaps(const QList<Rect> &posRects, const Rect &negRect, dou
     return false;
 }
 
+// Matrices at least this large are stored out of line by an active MatPayloadWriter
+static const int minPayloadBytes = 4096;
+
+// Marks a matrix whose data follows as a payload offset rather than inline
+static const int payloadLength = -1;
+
+// Marks a matrix whose length doesn't fit in an int, the qint64 length follows
+static const int largeLength = -2;
+
+struct MatPayloads
+{
+    OpenCVUtils::MatPayloadWriter *writer;
+    OpenCVUtils::MatPayloadReader *reader;
+    MatPayloads() : writer(NULL), reader(NULL) {}
+};
+
+static QThreadStorage<MatPayloads> matPayloads;
+
+OpenCVUtils::MatPayloadWriter::MatPayloadWriter()
+    : size(0)
+{
+    matPayloads.localData().writer = this;
+}
+
+OpenCVUtils::MatPayloadWriter::~MatPayloadWriter()
+{
+    matPayloads.localData().writer = NULL;
+}
+
+quint64 OpenCVUtils::MatPayloadWriter::append(const Mat &m)
+{
+    const quint64 offset = (size + 63) & ~quint64(63);
+    payloads.append(m);
+    offsets.append(offset);
+    size = offset + m.total() * m.elemSize();
+    return offset;
+}
+
+OpenCVUtils::MatPayloadReader::MatPayloadReader(const uchar *_base, quint64 _size)
+    : base(_base), size(_size)
+{
+    matPayloads.localData().reader = this;
+}
+
+OpenCVUtils::MatPayloadReader::~MatPayloadReader()
+{
+    matPayloads.localData().reader = NULL;
+}
+
+OpenCVUtils::FramePool::FramePool(int _capacity)
+    : capacity(_capacity)
+{
+}
+
+Mat OpenCVUtils::FramePool::get(int rows, int cols, int type)
+{
+    int retired = -1;
+    for (int i=0; i<buffers.size(); i++) {
+        const Mat &buffer = buffers[i];
+        if (!buffer.refcount || (*buffer.refcount != 1))
+            continue;
+        if ((buffer.rows == rows) && (buffer.cols == cols) && (buffer.type() == type))
+            return buffer;
+        retired = i; // Free, but the wrong size, as after a change in resolution
+    }
+
+    const Mat buffer(rows, cols, type);
+    if (retired >= 0)                     buffers[retired] = buffer;
+    else if (buffers.size() < capacity)   buffers.append(buffer);
+    return buffer;
+}
+
+#ifdef BR_WITH_OPENCL
+bool OpenCVUtils::openCLAvailable()
+{
+    static int available = -1;
+    static QMutex availableLock;
+    QMutexLocker locker(&availableLock);
+    if (available == -1) {
+        ocl::DevicesInfo devices;
+        available = ocl::getOpenCLDevices(devices, ocl::CVCL_DEVICE_TYPE_GPU) > 0 ? 1 : 0;
+        if (available)
+            qDebug("Using OpenCL device %s", devices[0]->deviceName.c_str());
+    }
+    return available;
+}
+
+OpenCVUtils::DeviceMatrix::DeviceMatrix()
+    : copied(false)
+{
+}
+
+void OpenCVUtils::DeviceMatrix::multiply(const Mat &a, const Mat &resident, bool transposeResident, Mat &dst, Mat *norms)
+{
+    QMutexLocker locker(&mutex);
+
+    // Residency is never decided by address alone, as freed memory may be reused by another matrix of the same size.
+    // A matrix that owns its memory is referenced while resident, so rows of that same allocation are viewed in place.
+    // Memory the caller owns is copied instead, and compared with the copy to decide whether it is still resident.
+    bool withinDevice = false;
+    if (!host.empty() && (resident.type() == host.type()) && (resident.cols == host.cols)) {
+        if (resident.refcount) {
+            withinDevice = !copied && (resident.refcount == host.refcount) && (resident.step[0] == host.step[0]) &&
+                           (resident.data >= host.data) && (resident.data + resident.rows*host.step[0] <= host.data + host.rows*host.step[0]);
+        } else if (copied && (resident.rows == host.rows)) {
+            const size_t rowBytes = resident.cols * resident.elemSize();
+            withinDevice = true;
+            for (int i=0; withinDevice && (i<resident.rows); i++)
+                withinDevice = (memcmp(resident.ptr(i), host.ptr(i), rowBytes) == 0);
+        }
+    }
+
+    if (!withinDevice) {
+        copied = !resident.refcount;
+        host = copied ? resident.clone() : resident;
+        const Mat continuous = host.isContinuous() ? host : host.clone();
+        device.upload(continuous);
+        reduce(continuous.mul(continuous), squaredNorms, 1, CV_REDUCE_SUM);
+    }
+    const int offset = copied ? 0 : int((resident.data - host.data) / host.step[0]);
+    const ocl::oclMat view = device.rowRange(offset, offset + resident.rows);
+    if (norms)
+        *norms = squaredNorms.rowRange(offset, offset + resident.rows).clone();
+
+    ocl::oclMat deviceDst;
+    ocl::gemm(ocl::oclMat(a), view, 1, ocl::oclMat(), 0, deviceDst, transposeResident ? GEMM_2_T : 0);
+    deviceDst.download(dst);
+}
+
+void OpenCVUtils::DeviceMatrix::invalidate()
+{
+    QMutexLocker locker(&mutex);
+    host.release();
+    copied = false;
+}
+#endif // BR_WITH_OPENCL
+
 QDataStream &operator<<(QDataStream &stream, const Mat &m)
 {
     // Write header
@@ -391,12 +682,25 @@ QDataStream &operator<<(QDataStream &stream, const Mat &m)
     stream << rows << cols << type;
 
     // Write data
-    int len = rows * cols * m.elemSize();
-    stream << len;
+    const qint64 len = qint64(rows) * cols * m.elemSize();
+    OpenCVUtils::MatPayloadWriter *writer = matPayloads.hasLocalData() ? matPayloads.localData().writer : NULL;
+    if (writer && (len >= minPayloadBytes) && m.isContinuous()) {
+        stream << payloadLength << writer->append(m);
+        return stream;
+    }
+
+    if (len > std::numeric_limits<int>::max()) stream << largeLength << len;
+    else                                       stream << int(len);
     if (len > 0) {
         if (!m.isContinuous()) qFatal("Can't serialize non-continuous matrices.");
-        int written = stream.writeRawData((const char*)m.data, len);
-        if (written != len) qFatal("Mat serialization failure, expected: %d bytes, wrote: %d bytes.", len, written);
+        const char *data = (const char*) m.data;
+        for (qint64 remaining = len; remaining > 0; ) {
+            const int chunk = int(std::min(remaining, qint64(std::numeric_limits<int>::max())));
+            const int written = stream.writeRawData(data, chunk);
+            if (written != chunk) qFatal("Mat serialization failure, expected: %d bytes, wrote: %d bytes.", chunk, written);
+            data += written;
+            remaining -= written;
+        }
     }
     return stream;
 }
@@ -406,18 +710,33 @@ QDataStream &operator>>(QDataStream &stream, Mat &m)
     // Read header
     int rows, cols, type;
     stream >> rows >> cols >> type;
-    m.create(rows, cols, type);
 
-    int len;
-    stream >> len;
+    int marker;
+    stream >> marker;
+
+    if (marker == payloadLength) {
+        quint64 offset;
+        stream >> offset;
+        OpenCVUtils::MatPayloadReader *reader = matPayloads.hasLocalData() ? matPayloads.localData().reader : NULL;
+        if (!reader) qFatal("Mat deserialization failure, out of line payload without a mapped model.");
+        if (offset + quint64(rows) * cols * CV_ELEM_SIZE(type) > reader->size) qFatal("Mat deserialization failure, payload out of bounds.");
+        m = Mat(rows, cols, type, (void*) (reader->base + offset));
+        return stream;
+    }
+
+    qint64 len = marker;
+    if (marker == largeLength)
+        stream >> len;
+
+    m.create(rows, cols, type);
     char *data = (char*) m.data;
 
     // In certain circumstances, like reading from stdin or sockets, we may not
     // be given all the data we need at once because it isn't available yet.
     // So we loop until it we get it.
     while (len > 0) {
-        const int read = stream.readRawData(data, len);
-        if (read == -1) qFatal("Mat deserialization failure, exptected %d more bytes.", len);
+        const int read = stream.readRawData(data, int(std::min(len, qint64(std::numeric_limits<int>::max()))));
+        if (read == -1) qFatal("Mat deserialization failure, exptected %lld more bytes.", len);
         data += read;
         len -= read;
     }
@@ -19,11 +19,15 @@
 
 #include <QDataStream>
 #include <QDebug>
+#include <QMutex>
 #include <QString>
 #include <QStringList>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 #include <assert.h>
+#ifdef BR_WITH_OPENCL
+#include <opencv2/ocl/ocl.hpp>
+#endif // BR_WITH_OPENCL
 
 namespace OpenCVUtils
 {
@@ -31,6 +35,13 @@ namespace OpenCVUtils
     void saveImage(const cv::Mat &src, const QString &file);
     void showImage(const cv::Mat &src, const QString &window = "OpenBR", bool waitKey = true);
 
+    // Decode image, JPEGs may be decoded at 1/2, 1/4 or 1/8 scale as long as the larger side stays at least maxSize pixels.
+    // Requires BR_WITH_JPEG, otherwise or with maxSize <= 0 this is cv::imdecode. The reduction applied is returned in scale.
+    cv::Mat imdecode(const cv::Mat &buffer, int flags, int maxSize = 0, int *scale = NULL);
+
+    // Image dimensions read from the JPEG, PNG, GIF or BMP header without decoding, empty if not recognized
+    cv::Size imageSize(const QString &fileName);
+
     // Convert image
     void cvtGray(const cv::Mat &src, cv::Mat &dst);
     void cvtUChar(const cv::Mat &src, cv::Mat &dst);
@@ -53,6 +64,65 @@ namespace OpenCVUtils
     // Model storage
     void storeModel(const CvStatModel &model, QDataStream &stream);
     void loadModel(CvStatModel &model, QDataStream &stream);
+    void loadModel(CvStatModel &model, const QByteArray &data);
+
+    // Out of line matrix payloads for memory mapped models.
+    // While a writer is active on the calling thread, serializing a large continuous matrix records it
+    // and streams only its payload offset. While a reader is active, deserializing such a matrix wraps
+    // the bytes at that offset without copying, so the memory must outlive the matrix.
+    struct MatPayloadWriter
+    {
+        QList<cv::Mat> payloads;
+        QList<quint64> offsets;
+        quint64 size;
+
+        MatPayloadWriter();
+        ~MatPayloadWriter();
+        quint64 append(const cv::Mat &m); // Returns the payload offset, aligned to 64 bytes
+    };
+
+    struct MatPayloadReader
+    {
+        const uchar *base;
+        quint64 size;
+
+        MatPayloadReader(const uchar *base, quint64 size);
+        ~MatPayloadReader();
+    };
+
+    // Recycled buffers for decoded video frames, used from one thread.
+    // A buffer is free again once the pool holds its only reference, so frames are reused as soon as every copy of
+    // them has been released downstream. Past capacity buffers that are still in use are allocated outside the pool.
+    struct FramePool
+    {
+        QList<cv::Mat> buffers;
+        int capacity;
+
+        FramePool(int capacity = 256);
+        cv::Mat get(int rows, int cols, int type); // A free buffer of this size and type, allocated if there is none
+    };
+
+#ifdef BR_WITH_OPENCL
+    // True if OpenCV found an OpenCL GPU, checked once
+    bool openCLAvailable();
+
+    // A host matrix, such as an enrolled gallery or a projection, kept resident in OpenCL device memory.
+    // It is uploaded again only when multiplied with rows that don't lie within the previously uploaded matrix,
+    // and device work is serialized so callers may share one instance between threads.
+    struct DeviceMatrix
+    {
+        QMutex mutex;
+        cv::Mat host; // What was uploaded, sharing the caller's allocation, or a copy of memory the caller owns
+        bool copied;
+        cv::ocl::oclMat device;
+        cv::Mat squaredNorms; // Of each uploaded row, as the inner product distances need them too
+
+        DeviceMatrix();
+        // dst = a * resident, or its transpose, optionally setting the squared norms of the rows of resident
+        void multiply(const cv::Mat &a, const cv::Mat &resident, bool transposeResident, cv::Mat &dst, cv::Mat *norms = NULL);
+        void invalidate(); // The host matrix changed in place, upload it again on next use
+    };
+#endif // BR_WITH_OPENCL
 
     template <typename T>
     T getElement(const cv::Mat &m, int r, int c)
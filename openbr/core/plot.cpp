@@ -107,22 +107,37 @@ struct RPlot
 
         // Read files and retrieve pivots
         pivotHeaders = getPivots(files.first(), true);
-        pivotItems = QVector< QSet<QString> >(pivotHeaders.size());
+        QList<QStringList> filePivots;
         foreach (const QString &fileName, files) {
-            QStringList pivots = getPivots(fileName, false);
+            const QStringList pivots = getPivots(fileName, false);
             // If the number of pivots don't match, abandon the directory/filename labeling scheme
             if (pivots.size() != pivotHeaders.size()) {
-                pivots.clear();
-                pivots.push_back(QFileInfo(fileName).completeBaseName());
-                pivotHeaders.clear();
-                pivotHeaders.push_back("File");
-            } 
-            file.write(qPrintable(QString("tmp <- read.csv(\"%1\")\n").arg(fileName).replace("\\", "\\\\")));
-            for (int i=0; i<pivots.size(); i++) {
+                pivotHeaders = QStringList() << "File";
+                filePivots.clear();
+                foreach (const QString &name, files)
+                    filePivots.append(QStringList() << QFileInfo(name).completeBaseName());
+                break;
+            }
+            filePivots.append(pivots);
+        }
+        pivotItems = QVector< QSet<QString> >(pivotHeaders.size());
+        foreach (const QStringList &pivots, filePivots)
+            for (int i=0; i<pivots.size(); i++)
                 pivotItems[i].insert(pivots[i]);
-                file.write(qPrintable(QString("tmp$%1 <- \"%2\"\n").arg(pivotHeaders[i], pivots[i])));
+
+        const QString dataFile = basename+".data.csv";
+        if (writeData(dataFile, files, filePivots, destination.get<int>("points", 0))) {
+            file.write(qPrintable(QString("data <- read.csv(\"%1\")\n").arg(dataFile).replace("\\", "\\\\")));
+            foreach (const QString &header, pivotHeaders)
+                file.write(qPrintable(QString("data$%1 <- as.character(data$%1)\n").arg(header)));
+        } else {
+            // Files with differing columns can't share one table, let R bind them
+            for (int i=0; i<files.size(); i++) {
+                file.write(qPrintable(QString("tmp <- read.csv(\"%1\")\n").arg(files[i]).replace("\\", "\\\\")));
+                for (int j=0; j<pivotHeaders.size(); j++)
+                    file.write(qPrintable(QString("tmp$%1 <- \"%2\"\n").arg(pivotHeaders[j], filePivots[i][j])));
+                file.write("data <- rbind(data, tmp)\n");
             }
-            file.write("data <- rbind(data, tmp)\n");
         }
         for (int i=0; i<pivotItems.size(); i++) {
             const int size = pivotItems[i].size();
@@ -280,6 +295,68 @@ struct RPlot
                    "# Write figures\n");
     }
 
+    // Concatenates the CSVs into one table with the pivots as trailing columns, so R parses a single file
+    // instead of growing a data frame per file. With a positive number of points, curves longer than that
+    // are thinned to evenly spaced rows, keeping the first and last.
+    bool writeData(const QString &dataFile, const QStringList &files, const QList<QStringList> &filePivots, int points) const
+    {
+        QFile data(dataFile);
+        if (!data.open(QFile::WriteOnly)) return false;
+
+        QByteArray header;
+        for (int i=0; i<files.size(); i++) {
+            QByteArray contents;
+            QtUtils::readFile(files[i], contents);
+            QList<QByteArray> lines = contents.split('\n');
+            for (int j=lines.size()-1; j>=0; j--) {
+                if (lines[j].endsWith('\r')) lines[j].chop(1);
+                if (lines[j].isEmpty()) lines.removeAt(j);
+            }
+            if (lines.isEmpty()) continue;
+
+            if (header.isEmpty()) {
+                header = lines.first();
+                data.write(header + "," + pivotHeaders.join(",").toUtf8() + "\n");
+            } else if (lines.first() != header) {
+                data.close();
+                data.remove();
+                return false;
+            }
+
+            QByteArray suffix;
+            foreach (const QString &pivot, filePivots[i])
+                suffix += ",\"" + pivot.toUtf8() + "\"";
+            suffix += "\n";
+
+            QHash<QByteArray,int> counts, seen;
+            if (points > 1)
+                for (int j=1; j<lines.size(); j++)
+                    counts[rowKey(lines[j])]++;
+
+            for (int j=1; j<lines.size(); j++) {
+                if (points > 1) {
+                    const QByteArray key = rowKey(lines[j]);
+                    const qint64 count = counts.value(key);
+                    const qint64 index = seen[key]++;
+                    if ((count > points) && (index > 0) &&
+                        ((index*(points-1))/(count-1) == ((index-1)*(points-1))/(count-1)))
+                        continue;
+                }
+                data.write(lines[j] + suffix);
+            }
+        }
+        return !header.isEmpty();
+    }
+
+    // Rows are thinned per plot, and per series when the last column is a label (e.g. the SD table)
+    static QByteArray rowKey(const QByteArray &line)
+    {
+        const int plot = line.indexOf(','), last = line.lastIndexOf(',');
+        bool numeric;
+        line.mid(last+1).toDouble(&numeric);
+        return numeric ? line.left(plot) : line.left(plot) + line.mid(last);
+    }
+
     bool finalize(bool show = false)
     {
         file.write("dev.off()\n");
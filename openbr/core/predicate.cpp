@@ -0,0 +1,295 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QVarLengthArray>
+#include <algorithm>
+#include <string.h>
+
+#include "predicate.h"
+
+namespace br
+{
+
+struct MetadataPredicate::Parser
+{
+    MetadataPredicate &predicate;
+    const QString &text;
+    int pos;
+
+    Parser(MetadataPredicate &predicate, const QString &text)
+        : predicate(predicate), text(text), pos(0) {}
+
+    void skipSpaces()
+    {
+        while ((pos < text.size()) && text[pos].isSpace())
+            pos++;
+    }
+
+    bool accept(const char *token)
+    {
+        skipSpaces();
+        const int length = int(strlen(token));
+        if (text.midRef(pos, length) != QLatin1String(token))
+            return false;
+        pos += length;
+        return true;
+    }
+
+    // A quoted string, or everything up to the next stop character
+    QString token(const char *stop, bool *quoted = NULL)
+    {
+        skipSpaces();
+        if ((pos < text.size()) && (text[pos] == '\'')) {
+            const int end = text.indexOf('\'', pos+1);
+            if (end < 0) qFatal("Unterminated quote in metadata predicate: %s", qPrintable(text));
+            const QString result = text.mid(pos+1, end-pos-1);
+            pos = end+1;
+            if (quoted) *quoted = true;
+            return result;
+        }
+
+        const int start = pos;
+        while ((pos < text.size()) && !((text[pos].unicode() < 128) && strchr(stop, text[pos].toLatin1())))
+            pos++;
+        if (quoted) *quoted = false;
+        return text.mid(start, pos-start).trimmed();
+    }
+
+    void expression()
+    {
+        conjunction();
+        while (accept("|")) {
+            conjunction();
+            predicate.append(Or);
+        }
+    }
+
+    void conjunction()
+    {
+        term();
+        while (accept("&")) {
+            term();
+            predicate.append(And);
+        }
+    }
+
+    void term()
+    {
+        if (accept("!")) {
+            term();
+            predicate.append(Not);
+        } else if (accept("(")) {
+            expression();
+            if (!accept(")")) qFatal("Expected ')' at %d in metadata predicate: %s", pos, qPrintable(text));
+        } else {
+            comparison();
+        }
+    }
+
+    void comparison()
+    {
+        const QString key = token("=!~&|()");
+        if (key.isEmpty()) qFatal("Expected a key at %d in metadata predicate: %s", pos, qPrintable(text));
+
+        const bool negated = accept("!");
+        if (accept("=")) {
+            bool quoted;
+            const QString values = token("&|()", &quoted);
+            QStringList list;
+            if (quoted) list.append(values);
+            else        foreach (const QString &value, values.split(',')) list.append(value.trimmed());
+            predicate.appendEquals(key, list);
+        } else if (accept("~")) {
+            predicate.appendMatches(key, token("&|()"));
+        } else if (negated) {
+            qFatal("Expected '=' or '~' after '!' at %d in metadata predicate: %s", pos, qPrintable(text));
+        } else {
+            predicate.append(Present, key);
+            return;
+        }
+
+        if (negated)
+            predicate.append(Not);
+    }
+};
+
+MetadataPredicate::MetadataPredicate(const QString &expression)
+{
+    QString text = expression.trimmed();
+    // Algorithm strings quote expressions containing reserved characters, the quotes are left in the property value
+    if ((text.size() >= 2) && text.startsWith('\'') && (text.indexOf('\'', 1) == text.size()-1))
+        text = text.mid(1, text.size()-2);
+    if (text.isEmpty())
+        return;
+
+    Parser parser(*this, text);
+    parser.expression();
+    parser.skipSpaces();
+    if (parser.pos != text.size())
+        qFatal("Unexpected '%s' at %d in metadata predicate: %s", qPrintable(text.mid(parser.pos, 1)), parser.pos, qPrintable(text));
+}
+
+MetadataPredicate MetadataPredicate::equals(const QString &key, const QStringList &values)
+{
+    MetadataPredicate predicate;
+    predicate.appendEquals(key, values);
+    return predicate;
+}
+
+MetadataPredicate MetadataPredicate::fromFilters(const Context::Filters &filters)
+{
+    QStringList keys = filters.keys();
+    std::sort(keys.begin(), keys.end());
+
+    MetadataPredicate predicate;
+    foreach (const QString &key, keys) {
+        QStringList values = filters[key];
+        if (values.isEmpty()) continue;
+        values.removeAll(""); // Targets without the key are never accepted
+        const bool first = predicate.isEmpty();
+        predicate.appendEquals(key, values);
+        if (!first)
+            predicate.append(And);
+    }
+    return predicate;
+}
+
+QStringList MetadataPredicate::keys() const
+{
+    QStringList keys;
+    foreach (const Instruction &instruction, program)
+        if (!instruction.name.isEmpty() && !keys.contains(instruction.name))
+            keys.append(instruction.name);
+    return keys;
+}
+
+static bool present(const File &file, const MetadataKey &key, const QString &name)
+{
+    return file.containsLocal(key) || file.contains(name);
+}
+
+static QString stringValue(const File &file, const MetadataKey &key, const QString &name)
+{
+    if (file.containsLocal(key)) {
+        const QVariant variant = file.localValue(key);
+        return variant.canConvert<QString>() ? variant.toString() : QString("");
+    }
+    return file.get<QString>(name, "");
+}
+
+bool MetadataPredicate::operator()(const File &file) const
+{
+    if (program.isEmpty())
+        return true;
+
+    QVarLengthArray<bool, 16> stack;
+    foreach (const Instruction &instruction, program) {
+        switch (instruction.op) {
+          case Present:
+            stack.append(present(file, instruction.key, instruction.name));
+            break;
+          case Equals:
+            stack.append(sets[instruction.operand].contains(stringValue(file, instruction.key, instruction.name)));
+            break;
+          case Matches:
+            stack.append(patterns[instruction.operand].match(stringValue(file, instruction.key, instruction.name)).hasMatch());
+            break;
+          case Not:
+            stack.last() = !stack.last();
+            break;
+          case And: {
+            const bool b = stack.last(); stack.removeLast();
+            stack.last() = stack.last() && b;
+          } break;
+          case Or: {
+            const bool b = stack.last(); stack.removeLast();
+            stack.last() = stack.last() || b;
+          } break;
+        }
+    }
+    return stack.last();
+}
+
+QBitArray MetadataPredicate::operator()(const MetadataColumns &columns) const
+{
+    if (program.isEmpty())
+        return QBitArray(columns.size(), true);
+
+    QVector<QBitArray> stack;
+    foreach (const Instruction &instruction, program) {
+        switch (instruction.op) {
+          case Present:
+            stack.append(columns.contains(instruction.name));
+            break;
+          case Equals: {
+            const QSet<QString> &set = sets[instruction.operand];
+            const QStringList values = columns.values(instruction.name);
+            QVector<bool> selected(values.size());
+            for (int i=0; i<values.size(); i++)
+                selected[i] = set.contains(values[i]);
+            stack.append(columns.select(instruction.name, selected, set.contains("")));
+          } break;
+          case Matches: {
+            const QRegularExpression &pattern = patterns[instruction.operand];
+            const QStringList values = columns.values(instruction.name);
+            QVector<bool> selected(values.size());
+            for (int i=0; i<values.size(); i++)
+                selected[i] = pattern.match(values[i]).hasMatch();
+            stack.append(columns.select(instruction.name, selected, pattern.match(QString("")).hasMatch()));
+          } break;
+          case Not:
+            stack.last() = ~stack.last();
+            break;
+          case And: {
+            const QBitArray b = stack.last(); stack.removeLast();
+            stack.last() &= b;
+          } break;
+          case Or: {
+            const QBitArray b = stack.last(); stack.removeLast();
+            stack.last() |= b;
+          } break;
+        }
+    }
+    return stack.last();
+}
+
+void MetadataPredicate::append(Opcode op, const QString &name, int operand)
+{
+    Instruction instruction;
+    instruction.op = op;
+    if (!name.isEmpty())
+        instruction.key = MetadataKey(name);
+    instruction.name = name;
+    instruction.operand = operand;
+    program.append(instruction);
+}
+
+void MetadataPredicate::appendEquals(const QString &key, const QStringList &values)
+{
+    sets.append(QSet<QString>::fromList(values));
+    append(Equals, key, sets.size()-1);
+}
+
+void MetadataPredicate::appendMatches(const QString &key, const QString &pattern)
+{
+    QRegularExpression regexp(pattern);
+    if (!regexp.isValid())
+        qFatal("Invalid regular expression \"%s\" in metadata predicate: %s", qPrintable(pattern), qPrintable(regexp.errorString()));
+    patterns.append(regexp);
+    append(Matches, key, patterns.size()-1);
+}
+
+} // namespace br
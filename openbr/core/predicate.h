@@ -0,0 +1,84 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_PREDICATE_H
+#define BR_PREDICATE_H
+
+#include <QBitArray>
+#include <QRegularExpression>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+#include <openbr/core/columns.h>
+
+namespace br
+{
+
+// A condition on br::File metadata, parsed once into postfix bytecode over interned keys and evaluated per file.
+//
+// expression := conjunction ('|' conjunction)*
+// conjunction := term ('&' term)*
+// term := '!' term | '(' expression ')' | key | key '=' values | key '!=' values | key '~' regexp | key '!~' regexp
+//
+// A bare key tests for presence, values are a comma separated list, either side may be enclosed in single quotes.
+// Missing keys compare as the empty string, like br::File::get<QString>(key, "").
+class BR_EXPORT MetadataPredicate
+{
+public:
+    MetadataPredicate() {}
+    explicit MetadataPredicate(const QString &expression);
+
+    // Accepts files whose value for the key is one of the values
+    static MetadataPredicate equals(const QString &key, const QStringList &values);
+
+    // Equivalent to br::Context::filters, accepts files with a non-empty value in every non-empty filter
+    static MetadataPredicate fromFilters(const Context::Filters &filters);
+
+    bool isEmpty() const { return program.isEmpty(); } // Empty predicates accept everything
+    QStringList keys() const;
+
+    bool operator()(const File &file) const;
+
+    // Evaluated once per distinct value of each column rather than once per row
+    QBitArray operator()(const MetadataColumns &columns) const;
+
+private:
+    enum Opcode { Present, Equals, Matches, Not, And, Or };
+
+    struct Instruction
+    {
+        Opcode op;
+        MetadataKey key;
+        QString name;
+        int operand; // Index into sets or patterns
+    };
+
+    QVector<Instruction> program;
+    QList< QSet<QString> > sets;
+    QList<QRegularExpression> patterns;
+
+    void append(Opcode op, const QString &name = QString(), int operand = -1);
+    void appendEquals(const QString &key, const QStringList &values);
+    void appendMatches(const QString &key, const QString &pattern);
+
+    struct Parser;
+    friend struct Parser;
+};
+
+} // namespace br
+
+#endif // BR_PREDICATE_H
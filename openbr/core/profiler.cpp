@@ -0,0 +1,300 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QTextStream>
+#include <QThreadStorage>
+#include <algorithm>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+#ifdef BR_WITH_ITT
+#include <ittnotify.h>
+#endif
+
+#include "profiler.h"
+
+namespace br
+{
+
+struct ProfileEvent
+{
+    const char *category;
+    QString name;
+    qint64 start, duration; // Microseconds
+    int templates;
+    bool counter; // templates is the value of the counter named name at start
+};
+
+// Events recorded by one thread. Owned by the registry below so they survive
+// thread pool threads exiting before the profile is written.
+struct ProfileThread
+{
+    int id;
+    QString name;
+    QList<ProfileEvent> events;
+
+    // Open scopes and the time spent in their children, used for folded stacks
+    QStringList stack;
+    QList<qint64> childTime;
+    QHash<QString, qint64> selfTime;
+};
+
+static QMutex profileLock;
+static QElapsedTimer profileTimer;
+static QList< QSharedPointer<ProfileThread> > profileThreads;
+static QThreadStorage< QSharedPointer<ProfileThread> > currentProfileThread;
+static QThreadStorage<QString> currentThreadName;
+static QMutex perfMapLock;
+
+#ifdef BR_WITH_ITT
+static __itt_domain *ittDomain = __itt_domain_create("OpenBR");
+#endif
+
+static ProfileThread *profileThread()
+{
+    if (!currentProfileThread.hasLocalData()) {
+        QSharedPointer<ProfileThread> thread(new ProfileThread());
+        QMutexLocker locker(&profileLock);
+        thread->id = profileThreads.size();
+        if (currentThreadName.hasLocalData())
+            thread->name = currentThreadName.localData();
+        profileThreads.append(thread);
+        currentProfileThread.setLocalData(thread);
+    }
+    return currentProfileThread.localData().data();
+}
+
+static qint64 profileTime()
+{
+    return profileTimer.nsecsElapsed() / 1000;
+}
+
+QString Profiler::label(const QObject *object)
+{
+    if (object == NULL)
+        return "Unknown";
+    QString name = object->metaObject()->className();
+    if (name.startsWith("br::"))
+        name = name.mid(4);
+    return name;
+}
+
+Profiler::Scope::Scope(const char *category, const QObject *object, int templates)
+    : category(category), templates(templates), start(-1), marked(false)
+{
+#ifdef BR_WITH_ITT
+    // Only pay for the task when VTune is collecting, the domain is NULL without a collector library
+    if (ittDomain && ittDomain->flags && object) {
+        __itt_task_begin(ittDomain, __itt_null, __itt_null, __itt_string_handle_create(object->metaObject()->className()));
+        marked = true;
+    }
+#endif
+
+    if (!enabled())
+        return;
+
+    if (!profileTimer.isValid()) {
+        QMutexLocker locker(&profileLock);
+        if (!profileTimer.isValid())
+            profileTimer.start();
+    }
+
+    ProfileThread *thread = profileThread();
+    thread->stack.append(label(object));
+    thread->childTime.append(0);
+    start = profileTime();
+}
+
+Profiler::Scope::~Scope()
+{
+#ifdef BR_WITH_ITT
+    if (marked)
+        __itt_task_end(ittDomain);
+#endif
+
+    if (start < 0)
+        return;
+
+    const qint64 duration = profileTime() - start;
+    ProfileThread *thread = profileThread();
+
+    ProfileEvent event;
+    event.category = category;
+    event.name = thread->stack.last();
+    event.start = start;
+    event.duration = duration;
+    event.templates = templates;
+    event.counter = false;
+    thread->events.append(event);
+
+    const qint64 self = duration - thread->childTime.takeLast();
+    thread->selfTime[thread->stack.join(";")] += self;
+    thread->stack.removeLast();
+    if (!thread->childTime.isEmpty())
+        thread->childTime.last() += duration;
+}
+
+void Profiler::counter(const QString &name, qint64 value)
+{
+    if (!enabled())
+        return;
+
+    if (!profileTimer.isValid()) {
+        QMutexLocker locker(&profileLock);
+        if (!profileTimer.isValid())
+            profileTimer.start();
+    }
+
+    ProfileEvent event;
+    event.category = "counter";
+    event.name = name;
+    event.start = profileTime();
+    event.duration = 0;
+    event.templates = int(value);
+    event.counter = true;
+    profileThread()->events.append(event);
+}
+
+void Profiler::nameThread(const QString &name)
+{
+    if (currentThreadName.hasLocalData() && (currentThreadName.localData() == name))
+        return;
+    currentThreadName.setLocalData(name);
+
+    const QByteArray utf8 = name.toUtf8();
+#if defined(__linux__)
+    pthread_setname_np(pthread_self(), utf8.left(15).constData());
+#elif defined(__APPLE__)
+    pthread_setname_np(utf8.constData());
+#endif
+#ifdef BR_WITH_ITT
+    __itt_thread_set_name(utf8.constData());
+#endif
+
+    if (enabled())
+        profileThread()->name = name;
+}
+
+void Profiler::mapCode(const void *address, qint64 size, const QString &name)
+{
+    if (!Globals || !Globals->perfMap || (address == NULL))
+        return;
+
+#ifdef __linux__
+    QMutexLocker locker(&perfMapLock);
+    QFile map(QString("/tmp/perf-%1.map").arg(QCoreApplication::applicationPid()));
+    if (!map.open(QFile::WriteOnly | QFile::Append | QFile::Text)) {
+        qWarning("Failed to open %s for writing.", qPrintable(map.fileName()));
+        return;
+    }
+    map.write(QString("%1 %2 %3\n").arg(qulonglong(quintptr(address)), 0, 16).arg(size, 0, 16).arg(name).toUtf8());
+#else
+    (void) size;
+    (void) name;
+#endif
+}
+
+struct ProfileSummary
+{
+    QString category, name;
+    qint64 calls, total, longest, templates;
+    ProfileSummary() : calls(0), total(0), longest(0), templates(0) {}
+    bool operator<(const ProfileSummary &other) const { return total > other.total; }
+};
+
+static QString jsonEscape(QString string)
+{
+    return string.replace("\\", "\\\\").replace("\"", "\\\"");
+}
+
+void Profiler::write(const QString &fileName)
+{
+    QMutexLocker locker(&profileLock);
+
+    QFile trace(fileName);
+    if (!trace.open(QFile::WriteOnly | QFile::Text))
+        qFatal("Failed to open profile: %s for writing", qPrintable(fileName));
+    QTextStream stream(&trace);
+    stream << "{\"traceEvents\":[\n";
+
+    QHash<QString, ProfileSummary> summaries;
+    QHash<QString, qint64> selfTime;
+    bool first = true;
+    foreach (const QSharedPointer<ProfileThread> &thread, profileThreads) {
+        stream << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << thread->id
+               << ",\"args\":{\"name\":\"" << (thread->name.isEmpty() ? QString("Thread %1").arg(thread->id) : jsonEscape(thread->name)) << "\"}}";
+        first = false;
+
+        foreach (const ProfileEvent &event, thread->events) {
+            if (event.counter) {
+                stream << ",\n{\"name\":\"" << jsonEscape(event.name) << "\",\"ph\":\"C\",\"pid\":0"
+                       << ",\"ts\":" << event.start << ",\"args\":{\"value\":" << event.templates << "}}";
+                continue;
+            }
+
+            stream << ",\n{\"name\":\"" << jsonEscape(event.name) << "\",\"cat\":\"" << event.category
+                   << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread->id
+                   << ",\"ts\":" << event.start << ",\"dur\":" << event.duration
+                   << ",\"args\":{\"templates\":" << event.templates << "}}";
+
+            const QString key = QString(event.category) + "/" + event.name;
+            ProfileSummary &summary = summaries[key];
+            summary.category = event.category;
+            summary.name = event.name;
+            summary.calls++;
+            summary.total += event.duration;
+            summary.longest = std::max(summary.longest, event.duration);
+            summary.templates += event.templates;
+        }
+
+        for (QHash<QString, qint64>::const_iterator i = thread->selfTime.constBegin(); i != thread->selfTime.constEnd(); ++i)
+            selfTime[i.key()] += i.value();
+    }
+    stream << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    QFile folded(fileName + ".folded");
+    if (folded.open(QFile::WriteOnly | QFile::Text)) {
+        QTextStream foldedStream(&folded);
+        for (QHash<QString, qint64>::const_iterator i = selfTime.constBegin(); i != selfTime.constEnd(); ++i)
+            foldedStream << i.key() << " " << i.value() << "\n";
+    } else {
+        qWarning("Failed to open: %s for writing", qPrintable(folded.fileName()));
+    }
+
+    QList<ProfileSummary> sorted = summaries.values();
+    std::sort(sorted.begin(), sorted.end());
+    qDebug("\nProfile written to %s\n%-10s %-40s %10s %12s %12s %12s %12s",
+           qPrintable(fileName), "Category", "Plugin", "Calls", "Total (s)", "Mean (ms)", "Max (ms)", "Templates/s");
+    foreach (const ProfileSummary &summary, sorted)
+        qDebug("%-10s %-40s %10lld %12.3f %12.3f %12.3f %12.1f",
+               qPrintable(summary.category), qPrintable(summary.name), summary.calls,
+               summary.total / 1e6, summary.total / 1e3 / summary.calls, summary.longest / 1e3,
+               summary.total ? summary.templates * 1e6 / summary.total : 0.0);
+
+    profileThreads.clear();
+}
+
+} // namespace br
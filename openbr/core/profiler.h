@@ -0,0 +1,71 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_PROFILER_H
+#define BR_PROFILER_H
+
+#include <QObject>
+#include <QString>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Records timed scopes when Globals->profile is set, and on Context::finalize
+// writes them to Globals->profile as Chrome trace-event JSON (chrome://tracing),
+// to <profile>.folded as collapsed stacks of self time in microseconds for
+// flamegraph.pl, and prints a per-plugin aggregate table.
+// Built with BR_WITH_ITT, scopes are also ITT tasks for VTune whenever a collector is attached.
+class BR_EXPORT Profiler
+{
+public:
+    static bool enabled() { return Globals && !Globals->profile.isEmpty(); }
+
+    // Name used for an object in the profile, its class name without namespace
+    static QString label(const QObject *object);
+
+    class BR_EXPORT Scope
+    {
+    public:
+        Scope(const char *category, const QObject *object, int templates = 0);
+        ~Scope();
+
+    private:
+        const char *category;
+        int templates;
+        qint64 start; // -1 if not profiling
+        bool marked; // An ITT task was begun
+    };
+
+    // Record the value of a named counter, such as a queue length, shown as a track of its own in the trace
+    static void counter(const QString &name, qint64 value);
+
+    // Names the calling thread as seen by debuggers, top -H, perf and VTune, and its track in the trace.
+    // Pool and stage workers call this as they pick up work; Linux truncates names to 15 characters.
+    static void nameThread(const QString &name);
+
+    // When Globals->perfMap is set, appends JIT compiled code to /tmp/perf-<pid>.map for perf to symbolize
+    static void mapCode(const void *address, qint64 size, const QString &name);
+
+    static void write(const QString &fileName);
+};
+
+} // namespace br
+
+// Profile the enclosing block as a call to OBJECT processing TEMPLATES templates
+#define BR_PROFILE(CATEGORY, OBJECT, TEMPLATES) br::Profiler::Scope brProfileScope(CATEGORY, OBJECT, TEMPLATES)
+
+#endif // BR_PROFILER_H
@@ -0,0 +1,129 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QList>
+#include <QStringList>
+#include <QThreadStorage>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "pyramid.h"
+
+using namespace cv;
+
+namespace br
+{
+
+// Most recently requested pyramids of each thread. Each one holds a reference to its source buffer,
+// so a matching data pointer can't belong to a different, reallocated image.
+// Consecutive stages applied to a template run on the same thread, so per thread lists keep their hits
+// however many threads are enrolling, and are released when their thread exits.
+static const int MaxPyramids = 4;
+static QThreadStorage< QList< QSharedPointer<ImagePyramid> > > threadPyramids;
+
+static bool sameBuffer(const Mat &a, const Mat &b)
+{
+    return (a.data == b.data) && (a.rows == b.rows) && (a.cols == b.cols) && (a.type() == b.type()) && (a.step[0] == b.step[0]);
+}
+
+QSharedPointer<ImagePyramid> ImagePyramid::get(const Mat &image)
+{
+    QList< QSharedPointer<ImagePyramid> > &pyramids = threadPyramids.localData();
+    for (int i=0; i<pyramids.size(); i++)
+        if (sameBuffer(pyramids[i]->base, image)) {
+            if (i > 0)
+                pyramids.move(i, 0);
+            return pyramids.first();
+        }
+
+    QSharedPointer<ImagePyramid> pyramid(new ImagePyramid(image));
+    pyramids.prepend(pyramid);
+    while (pyramids.size() > MaxPyramids)
+        pyramids.removeLast();
+    return pyramid;
+}
+
+Mat ImagePyramid::level(const Size &size)
+{
+    if (size == base.size())
+        return base;
+
+    QMutexLocker locker(&lock);
+    const QPair<int,int> key(size.width, size.height);
+    if (!levels.contains(key)) {
+        Mat resized;
+        resize(base, resized, size, 0, 0, INTER_LINEAR);
+        levels.insert(key, resized);
+    }
+    return levels[key];
+}
+
+Mat ImagePyramid::integral(const Size &size)
+{
+    const Mat image = level(size);
+
+    QMutexLocker locker(&lock);
+    const QPair<int,int> key(size.width, size.height);
+    if (!integrals.contains(key)) {
+        Mat sum;
+        cv::integral(image, sum);
+        integrals.insert(key, sum);
+    }
+    return integrals[key];
+}
+
+static int blockHistogramSize(const HOGDescriptor &hog)
+{
+    return (hog.blockSize.width/hog.cellSize.width) * (hog.blockSize.height/hog.cellSize.height) * hog.nbins;
+}
+
+Mat ImagePyramid::hogBlocks(const Size &size, const HOGDescriptor &hog)
+{
+    const Mat image = level(size);
+    if ((image.cols < hog.blockSize.width) || (image.rows < hog.blockSize.height))
+        return Mat();
+    const int blocksAcross = (image.cols - hog.blockSize.width) / hog.blockStride.width + 1;
+    const int blocksDown = (image.rows - hog.blockSize.height) / hog.blockStride.height + 1;
+
+    QMutexLocker locker(&lock);
+    const QString key = (QStringList() << QString::number(size.width) << QString::number(size.height)
+                                       << QString::number(hog.blockSize.width) << QString::number(hog.blockSize.height)
+                                       << QString::number(hog.blockStride.width) << QString::number(hog.blockStride.height)
+                                       << QString::number(hog.cellSize.width) << QString::number(hog.cellSize.height)
+                                       << QString::number(hog.nbins) << QString::number(hog.derivAperture) << QString::number(hog.winSigma)
+                                       << QString::number(hog.histogramNormType) << QString::number(hog.L2HysThreshold) << QString::number(hog.gammaCorrection)).join(",");
+    if (!hogs.contains(key)) {
+        // A single window spanning every block position yields the whole grid in one pass,
+        // its blocks ordered column by column like those of any smaller window
+        HOGDescriptor full;
+        hog.copyTo(full);
+        full.winSize = Size((blocksAcross-1)*hog.blockStride.width + hog.blockSize.width, (blocksDown-1)*hog.blockStride.height + hog.blockSize.height);
+
+        std::vector<float> values;
+        full.compute(image, values, Size(), Size(), std::vector<Point>(1, Point(0, 0)));
+        hogs.insert(key, Mat(values, true).reshape(1, blocksAcross));
+    }
+    return hogs[key];
+}
+
+Rect ImagePyramid::hogBlockWindow(const HOGDescriptor &hog, int x, int y)
+{
+    const int blocksAcross = (hog.winSize.width - hog.blockSize.width) / hog.blockStride.width + 1;
+    const int blocksDown = (hog.winSize.height - hog.blockSize.height) / hog.blockStride.height + 1;
+    const int histogramSize = blockHistogramSize(hog);
+    return Rect(y*histogramSize, x, blocksDown*histogramSize, blocksAcross);
+}
+
+} // namespace br
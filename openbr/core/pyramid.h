@@ -0,0 +1,66 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_PYRAMID_H
+#define BR_PYRAMID_H
+
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QSharedPointer>
+#include <opencv2/core/core.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Rescaled copies of one image, shared by every detector and feature extractor that visits it.
+// Pyramids are looked up by the identity of the image buffer, so consecutive multi-scale stages
+// applied to the same template reuse the levels and integral images computed by the first one.
+// Levels are always resized from the original image with linear interpolation, as cv::resize and
+// OpenCV's multi-scale detectors do, so reuse never changes a result.
+class BR_EXPORT ImagePyramid
+{
+    cv::Mat base;
+    QMutex lock;
+    QHash< QPair<int,int>, cv::Mat > levels, integrals;
+    QHash<QString, cv::Mat> hogs;
+
+    explicit ImagePyramid(const cv::Mat &image) : base(image) {}
+
+public:
+    // The pyramid of image, shared with anyone on this thread who asked for the same buffer recently
+    static QSharedPointer<ImagePyramid> get(const cv::Mat &image);
+
+    const cv::Mat &image() const { return base; }
+
+    // The image resized to size
+    cv::Mat level(const cv::Size &size);
+
+    // cv::integral of level(size)
+    cv::Mat integral(const cv::Size &size);
+
+    // Normalized HOG block histograms of level(size) at every multiple of hog.blockStride.
+    // Row x holds the blocks of column x from top to bottom, so the descriptor of the window whose
+    // top-left block is (x, y) is the region hogBlockWindow(hog, x, y) read row by row.
+    cv::Mat hogBlocks(const cv::Size &size, const cv::HOGDescriptor &hog);
+    static cv::Rect hogBlockWindow(const cv::HOGDescriptor &hog, int x, int y);
+};
+
+} // namespace br
+
+#endif // BR_PYRAMID_H
@@ -27,6 +27,7 @@
 #include <QRegularExpression>
 #include <QStack>
 #include <QUrl>
+#include <string.h>
 #include <openbr/openbr_plugin.h>
 
 #include "alphanum.hpp"
@@ -500,6 +501,40 @@ QString getAbsolutePath(const QString &filename)
     return QFileInfo(filename).absoluteFilePath();
 }
 
+MappedFile::MappedFile(const QString &fileName)
+    : file(fileName), begin(NULL), length(0)
+{
+    if (!file.open(QFile::ReadOnly))
+        qFatal("Failed to open %s for reading.", qPrintable(fileName));
+    length = file.size();
+    if (length == 0)
+        return;
+
+    begin = (const char*) file.map(0, length);
+    if (!begin) {
+        buffer = file.readAll();
+        begin = buffer.constData();
+        length = buffer.size();
+    }
+}
+
+QList< QPair<qint64,qint64> > MappedFile::lineChunks(int count) const
+{
+    QList< QPair<qint64,qint64> > chunks;
+    const qint64 step = std::max(qint64(1), length / std::max(1, count));
+    qint64 start = 0;
+    while (start < length) {
+        qint64 end = std::min(length, start + step);
+        if (end < length) {
+            const char *newline = (const char*) memchr(begin + end - 1, '\n', length - end + 1);
+            end = newline ? (newline - begin + 1) : length;
+        }
+        chunks.append(QPair<qint64,qint64>(start, end));
+        start = end;
+    }
+    return chunks;
+}
+
 const int base_block = 100000000;
 
 BlockCompression::BlockCompression(QIODevice *_basis)
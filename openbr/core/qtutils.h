@@ -89,6 +89,25 @@ namespace QtUtils
         return variantList;
     }
 
+    /**** Mapping Utilities ****/
+
+    // A read only file, memory mapped when possible and read otherwise
+    class MappedFile
+    {
+        QFile file;
+        QByteArray buffer;
+        const char *begin;
+        qint64 length;
+
+    public:
+        MappedFile(const QString &fileName);
+        const char *data() const { return begin; }
+        qint64 size() const { return length; }
+
+        // Up to count [begin, end) byte ranges covering the file, each ending after a newline or at the end of the file
+        QList< QPair<qint64,qint64> > lineChunks(int count) const;
+    };
+
     /**** Point Utilities ****/
     float euclideanLength(const QPointF &point);
 
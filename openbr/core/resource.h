@@ -17,6 +17,8 @@
 #ifndef BR_RESOURCE_H
 #define BR_RESOURCE_H
 
+#include <QElapsedTimer>
+#include <QFutureSynchronizer>
 #include <QHash>
 #include <QList>
 #include <QMutex>
@@ -24,6 +26,11 @@
 #include <QSharedPointer>
 #include <QString>
 #include <QThread>
+#include <QThreadStorage>
+#include <QVector>
+#include <openbr/core/metrics.h>
+#include <QtConcurrentRun>
+#include <algorithm>
 #include <openbr/openbr_plugin.h>
 
 namespace br
@@ -46,13 +53,54 @@ class DefaultResourceMaker : public ResourceMaker<T>
 // Manage multiple copies of a limited resource in a thread-safe manner.
 // TimeVaryingTransform makes a strong assumption that ResourceMaker::Make
 // is only called in acquire, not in the constructor.
+//
+// With setThreadAffine(true) each thread keeps the first resource it acquires,
+// later acquiring it again without touching the lock or semaphore, and returns it to
+// the shared pool when the thread exits. Nested acquires on one thread fall back to the pool.
+// warm() builds resources ahead of time, and wait statistics are printed on destruction
+// in verbose mode for resources given a name.
 template <typename T>
 class Resource
 {
+    struct Stats
+    {
+        QMutex lock;
+        qint64 acquires, pooled, waitNSecs, maxWaitNSecs, made;
+        br::Metrics::Counter pooledMetric, waitMetric; // Only exported for named resources
+        Stats() : acquires(0), pooled(0), waitNSecs(0), maxWaitNSecs(0), made(0) {}
+    };
+
+    // A thread's own resource, returned to the pool when the thread exits
+    struct Affinity
+    {
+        T *owned;
+        bool inUse;
+        QSharedPointer< QList<T*> > availableResources;
+        QSharedPointer<QMutex> lock;
+
+        Affinity(const QSharedPointer< QList<T*> > &_availableResources, const QSharedPointer<QMutex> &_lock)
+            : owned(NULL), inUse(false), availableResources(_availableResources), lock(_lock) {}
+
+        ~Affinity()
+        {
+            if (!owned) return;
+            QMutexLocker locker(lock.data());
+            availableResources->append(owned);
+        }
+    };
+
     QSharedPointer< ResourceMaker<T> > resourceMaker;
     QSharedPointer< QList<T*> > availableResources;
     QSharedPointer<QMutex> lock;
     QSharedPointer<QSemaphore> totalResources;
+    QSharedPointer< QThreadStorage<Affinity*> > affinity;
+    QSharedPointer<Stats> stats;
+    QString name;
+
+    static void makeInto(const ResourceMaker<T> *maker, T **resource)
+    {
+        *resource = maker->make();
+    }
 
 public:
     Resource(ResourceMaker<T> *rm = new DefaultResourceMaker<T>())
@@ -60,29 +108,79 @@ public:
         , availableResources(new QList<T*>())
         , lock(new QMutex())
         , totalResources(new QSemaphore(br::Globals->parallelism))
+        , stats(new Stats())
     {}
 
     ~Resource()
     {
+        if (!name.isEmpty() && br::Globals && br::Globals->verbose && (stats->acquires > 0))
+            qDebug("Resource %s: %lld acquires, %lld from the pool waiting %.3f ms on average and %.3f ms at most, %lld made",
+                   qPrintable(name), stats->acquires, stats->pooled,
+                   stats->pooled ? stats->waitNSecs / 1e6 / stats->pooled : 0.0, stats->maxWaitNSecs / 1e6, stats->made);
         qDeleteAll(*availableResources);
     }
 
     T *acquire() const
     {
-        totalResources->acquire();
+        Affinity *local = NULL;
+        if (affinity) {
+            if (!affinity->hasLocalData())
+                affinity->setLocalData(new Affinity(availableResources, lock));
+            local = affinity->localData();
+            if (local->owned && !local->inUse) {
+                local->inUse = true;
+                return local->owned;
+            }
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+
+        // A thread's first resource doesn't count against the pool limit, since it is never shared
+        const bool claim = local && !local->owned;
+        if (!claim)
+            totalResources->acquire();
         lock->lock();
 
-        if (availableResources->isEmpty())
+        bool made = false;
+        if (availableResources->isEmpty()) {
             availableResources->append(resourceMaker->make());
+            made = true;
+        }
         T* resource = availableResources->takeFirst();
 
         lock->unlock();
 
+        if (claim) {
+            local->owned = resource;
+            local->inUse = true;
+        }
+
+        const qint64 wait = timer.nsecsElapsed();
+        stats->pooledMetric.add();
+        stats->waitMetric.add(wait / 1000);
+        QMutexLocker locker(&stats->lock);
+        stats->acquires++;
+        stats->pooled++;
+        stats->waitNSecs += wait;
+        stats->maxWaitNSecs = std::max(stats->maxWaitNSecs, wait);
+        if (made) stats->made++;
+
         return resource;
     }
 
     void release(T *resource) const
     {
+        if (affinity && affinity->hasLocalData()) {
+            Affinity *local = affinity->localData();
+            if (local->owned == resource) {
+                local->inUse = false;
+                QMutexLocker locker(&stats->lock);
+                stats->acquires++;
+                return;
+            }
+        }
+
         lock->lock();
         availableResources->append(resource);
         lock->unlock();
@@ -98,6 +196,44 @@ public:
     {
         totalResources = QSharedPointer<QSemaphore>(new QSemaphore(max));
     }
+
+    void setThreadAffine(bool threadAffine)
+    {
+        if (threadAffine && !affinity) affinity = QSharedPointer< QThreadStorage<Affinity*> >(new QThreadStorage<Affinity*>());
+        else if (!threadAffine)        affinity.clear();
+    }
+
+    // Identifies the resource in verbose statistics and metrics
+    void setName(const QString &_name)
+    {
+        name = _name;
+        const QString label = QString("{resource=\"%1\"}").arg(name);
+        stats->pooledMetric = br::Metrics::Counter("br_resource_pool_acquires_total" + label, "Resources acquired from the shared pool.");
+        stats->waitMetric = br::Metrics::Counter("br_resource_pool_wait_microseconds_total" + label, "Time spent acquiring resources from the shared pool.");
+    }
+
+    // Make resources in parallel until count are available
+    void warm(int count)
+    {
+        lock->lock();
+        const int needed = count - availableResources->size();
+        lock->unlock();
+        if (needed <= 0) return;
+
+        QVector<T*> made(needed);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<needed; i++)
+            futures.addFuture(QtConcurrent::run(&Resource<T>::makeInto, (const ResourceMaker<T>*) resourceMaker.data(), &made[i]));
+        futures.waitForFinished();
+
+        lock->lock();
+        foreach (T *resource, made)
+            availableResources->append(resource);
+        lock->unlock();
+
+        QMutexLocker locker(&stats->lock);
+        stats->made += needed;
+    }
 };
 
 } // namespace br
@@ -0,0 +1,70 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "sampler.h"
+
+namespace br
+{
+
+StratifiedSampler::StratifiedSampler(const QString &key, int capacity, quint64 seed)
+    : key(key), capacity(capacity), rng(seed)
+{}
+
+void StratifiedSampler::add(const Template &t)
+{
+    Stratum &stratum = reservoirs[key.isEmpty() ? QString() : t.file.get<QString>(key)];
+    stratum.count++;
+    if ((capacity < 0) || (stratum.kept.size() < capacity)) {
+        stratum.kept.append(t);
+    } else {
+        // Keep the n-th template with probability capacity/n, replacing a uniformly chosen one
+        const int i = rng.uniform(0, stratum.count);
+        if (i < capacity)
+            stratum.kept[i] = t;
+    }
+}
+
+void StratifiedSampler::add(const TemplateList &templates)
+{
+    foreach (const Template &t, templates)
+        add(t);
+}
+
+void StratifiedSampler::add(TemplateIterator &data)
+{
+    TemplateList block;
+    while (data.next(block))
+        add(block);
+}
+
+QStringList StratifiedSampler::strata() const
+{
+    QStringList strata = reservoirs.keys();
+    strata.sort();
+    return strata;
+}
+
+int StratifiedSampler::count(const QString &stratum) const
+{
+    return reservoirs.value(stratum).count;
+}
+
+TemplateList StratifiedSampler::sample(const QString &stratum) const
+{
+    return reservoirs.value(stratum).kept;
+}
+
+} // namespace br
@@ -0,0 +1,77 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_SAMPLER_H
+#define BR_SAMPLER_H
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Uniform random samples of up to capacity templates for each value of a metadata key, taken in a single pass.
+// Every stratum is a reservoir (Algorithm R), so memory is bounded by the number of strata times the capacity
+// however many templates are added. The generator is seeded explicitly, the same input gives the same sample.
+class BR_EXPORT StratifiedSampler
+{
+public:
+    // A negative capacity keeps every template, an empty key puts every template in the same stratum.
+    StratifiedSampler(const QString &key, int capacity, quint64 seed = 0);
+
+    void add(const Template &t);
+    void add(const TemplateList &templates);
+
+    // Adds every remaining block of data.
+    void add(TemplateIterator &data);
+
+    // The value of the key for each stratum, in ascending order.
+    QStringList strata() const;
+
+    // The number of templates added to a stratum, including those that weren't kept.
+    int count(const QString &stratum) const;
+
+    // The templates kept for a stratum, in no particular order.
+    TemplateList sample(const QString &stratum) const;
+
+    // Shuffles with the sampler's generator, for reproducible choices among strata or samples.
+    template <typename T>
+    void shuffle(QList<T> &values)
+    {
+        for (int i=values.size()-1; i>0; i--)
+            values.swap(i, rng.uniform(0, i+1));
+    }
+
+private:
+    struct Stratum
+    {
+        int count;
+        TemplateList kept;
+        Stratum() : count(0) {}
+    };
+
+    QString key;
+    int capacity;
+    cv::RNG rng;
+    QHash<QString, Stratum> reservoirs;
+};
+
+} // namespace br
+
+#endif // BR_SAMPLER_H
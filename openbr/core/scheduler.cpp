@@ -0,0 +1,318 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QScopedPointer>
+#include <QThread>
+#include <exception>
+
+#include "numa.h"
+#include "profiler.h"
+#include "scheduler.h"
+
+namespace br
+{
+
+class WorkStealingPool::Worker : public QThread
+{
+public:
+    WorkStealingPool *pool;
+    int index;
+    QList<int> cpus;
+
+    Worker(WorkStealingPool *pool, int index, const QList<int> &cpus)
+        : pool(pool), index(index), cpus(cpus) {}
+
+private:
+    void run()
+    {
+        Profiler::nameThread(QString("br-worker-%1").arg(index));
+        if (!cpus.isEmpty() && !NUMA::bindCurrentThread(cpus))
+            qWarning("Failed to bind worker %d to %d CPUs starting at CPU %d.", index, cpus.size(), cpus.first());
+
+        forever {
+            QRunnable *runnable = pool->take(index);
+            if (runnable == NULL) {
+                if (!pool->wait())
+                    return;
+                continue;
+            }
+
+            const bool autoDelete = runnable->autoDelete();
+            runnable->run();
+            if (autoDelete)
+                delete runnable;
+        }
+    }
+};
+
+WorkStealingPool::WorkStealingPool(int threads, bool pinThreads)
+    : stopping(false)
+{
+    threads = std::max(1, threads);
+    for (int i=0; i<threads; i++)
+        deques.append(new Deque());
+    for (int i=0; i<threads; i++) {
+        QList<int> cpus;
+        if (pinThreads)
+            cpus.append(i % std::max(1, QThread::idealThreadCount()));
+        workers.append(new Worker(this, i, cpus));
+        workers.last()->start();
+    }
+}
+
+WorkStealingPool::WorkStealingPool(int threads, const QList<int> &cpus)
+    : stopping(false)
+{
+    threads = std::max(1, threads);
+    for (int i=0; i<threads; i++)
+        deques.append(new Deque());
+    for (int i=0; i<threads; i++) {
+        workers.append(new Worker(this, i, cpus));
+        workers.last()->start();
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    idleLock.lock();
+    stopping = true;
+    available.wakeAll();
+    idleLock.unlock();
+
+    foreach (Worker *worker, workers) {
+        worker->wait();
+        delete worker;
+    }
+    qDeleteAll(deques);
+}
+
+void WorkStealingPool::start(QRunnable *runnable)
+{
+    // Keep work started by one of our workers on that worker
+    Worker *worker = dynamic_cast<Worker*>(QThread::currentThread());
+    const int index = (worker && (worker->pool == this)) ? worker->index
+                                                           : (nextDeque.fetchAndAddRelaxed(1) & 0x7fffffff) % deques.size();
+
+    Deque *deque = deques[index];
+    deque->lock.lock();
+    deque->runnables.append(runnable);
+    deque->lock.unlock();
+
+    // Paired with the ordered increment of sleepers in wait(), so either the
+    // sleeper sees the new runnable or we see the sleeper.
+    queued.ref();
+    if (sleepers.fetchAndAddOrdered(0) > 0) {
+        QMutexLocker locker(&idleLock);
+        available.wakeOne();
+    }
+}
+
+QRunnable *WorkStealingPool::take(int index)
+{
+    if (queued.load() == 0)
+        return NULL;
+
+    const int n = deques.size();
+    for (int i=0; i<n; i++) {
+        Deque *deque = deques[(index + i) % n];
+        QMutexLocker locker(&deque->lock);
+        if (deque->runnables.isEmpty())
+            continue;
+
+        // Our own deque is used as a stack, others are stolen from the bottom
+        QRunnable *runnable = (i == 0) ? deque->runnables.takeLast() : deque->runnables.takeFirst();
+        queued.deref();
+        return runnable;
+    }
+    return NULL;
+}
+
+bool WorkStealingPool::help()
+{
+    Worker *worker = dynamic_cast<Worker*>(QThread::currentThread());
+    QRunnable *runnable = take((worker && (worker->pool == this)) ? worker->index : 0);
+    if (runnable == NULL)
+        return false;
+
+    const bool autoDelete = runnable->autoDelete();
+    runnable->run();
+    if (autoDelete)
+        delete runnable;
+    return true;
+}
+
+bool WorkStealingPool::isWorker() const
+{
+    Worker *worker = dynamic_cast<Worker*>(QThread::currentThread());
+    return worker && (worker->pool == this);
+}
+
+static QBasicMutex globalLock;
+static WorkStealingPool *globalPool = NULL;
+
+WorkStealingPool *WorkStealingPool::global()
+{
+    // Never deleted, workers may still be waiting when static objects are destroyed.
+    // A pool replaced after a parallelism change is retired instead, groups still
+    // holding it run whatever its exited workers leave behind.
+    const int threads = std::max(1, Globals->parallelism);
+    QMutexLocker locker(&globalLock);
+    if ((globalPool != NULL) && (globalPool->threadCount() != threads)) {
+        globalPool->retire();
+        globalPool = NULL;
+    }
+    if (globalPool == NULL)
+        globalPool = new WorkStealingPool(threads);
+    return globalPool;
+}
+
+bool WorkStealingPool::wait()
+{
+    QMutexLocker locker(&idleLock);
+    sleepers.ref();
+    while ((queued.fetchAndAddOrdered(0) == 0) && !stopping)
+        available.wait(&idleLock);
+    sleepers.deref();
+    return (queued.load() > 0) || !stopping;
+}
+
+// Workers exit once the deques drain, without being joined
+void WorkStealingPool::retire()
+{
+    QMutexLocker locker(&idleLock);
+    stopping = true;
+    available.wakeAll();
+}
+
+void TaskGroup::Task::run()
+{
+    try {
+        call();
+    } catch (const QException &e) {
+        group->fail(e.clone());
+    } catch (const std::exception &e) {
+        group->fail(new TaskException(e.what()));
+    } catch (...) {
+        group->fail(new TaskException("Unknown exception thrown by task."));
+    }
+    group->done();
+}
+
+TaskGroup::Task *TaskGroup::Queue::takeFirst()
+{
+    QMutexLocker locker(&lock);
+    return tasks.isEmpty() ? NULL : tasks.takeFirst();
+}
+
+TaskGroup::Task *TaskGroup::Queue::takeLast()
+{
+    QMutexLocker locker(&lock);
+    return tasks.isEmpty() ? NULL : tasks.takeLast();
+}
+
+void TaskGroup::Ticket::run()
+{
+    Task *task = queue->takeFirst();
+    if (task != NULL)
+        execute(task);
+}
+
+TaskGroup::TaskGroup(WorkStealingPool *pool)
+    : pool(pool), queue(new Queue()), error(NULL)
+{}
+
+TaskGroup::~TaskGroup()
+{
+    join();
+    if (error != NULL) {
+        qWarning("TaskGroup destroyed without rethrowing: %s", error->what());
+        delete error;
+    }
+}
+
+void TaskGroup::execute(Task *task)
+{
+    task->run();
+    delete task;
+}
+
+void TaskGroup::start(Task *task)
+{
+    task->group = this;
+    pending.ref();
+    queue->lock.lock();
+    queue->tasks.append(task);
+    queue->lock.unlock();
+    pool->start(new Ticket(queue));
+
+    // A task may start another in its own group while we wait
+    QMutexLocker locker(&lock);
+    finished.wakeAll();
+}
+
+void TaskGroup::done()
+{
+    QMutexLocker locker(&lock);
+    if (!pending.deref())
+        finished.wakeAll();
+}
+
+void TaskGroup::fail(QException *exception)
+{
+    QMutexLocker locker(&lock);
+    if (error == NULL) error = exception;
+    else               delete exception;
+}
+
+void TaskGroup::join()
+{
+    // Newest first, the oldest are the likeliest to be taken by a ticket already
+    forever {
+        Task *task = queue->takeLast();
+        if (task != NULL) {
+            execute(task);
+            continue;
+        }
+
+        // start() wakes us under the lock, so a task queued after the check isn't missed
+        QMutexLocker locker(&lock);
+        if (pending.load() == 0)
+            break;
+        queue->lock.lock();
+        const bool queued = !queue->tasks.isEmpty();
+        queue->lock.unlock();
+        if (!queued)
+            finished.wait(&lock);
+    }
+
+    // Let done() release the lock before we can be destroyed
+    QMutexLocker locker(&lock);
+}
+
+void TaskGroup::wait()
+{
+    join();
+
+    QMutexLocker locker(&lock);
+    if (error == NULL)
+        return;
+    QScopedPointer<QException> exception(error);
+    error = NULL;
+    locker.unlock();
+    exception->raise();
+}
+
+} // namespace br
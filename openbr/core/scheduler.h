@@ -0,0 +1,353 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_SCHEDULER_H
+#define BR_SCHEDULER_H
+
+#include <QAtomicInt>
+#include <QException>
+#include <QList>
+#include <QMutex>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QWaitCondition>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// A fixed set of worker threads, each with its own deque of runnables.
+// Runnables started from a worker are pushed onto that worker's deque and
+// popped LIFO, so a frame tends to stay on the core that last touched it.
+// Idle workers steal FIFO from the other deques. Runnables started from
+// outside the pool are distributed round-robin. Runnables with autoDelete()
+// set are deleted after they run, as in QThreadPool.
+class BR_EXPORT WorkStealingPool
+{
+public:
+    // If pinThreads is set, worker i is bound to logical CPU i modulo the CPU count.
+    WorkStealingPool(int threads = Globals->parallelism, bool pinThreads = false);
+
+    // Every worker may run on any of cpus, such as the CPUs of one NUMA node.
+    WorkStealingPool(int threads, const QList<int> &cpus);
+
+    // Runs any queued runnables, then joins the workers.
+    ~WorkStealingPool();
+
+    void start(QRunnable *runnable);
+    int threadCount() const { return workers.size(); }
+
+    // Runs one queued runnable on the calling thread, preferring its own
+    // deque when it is one of our workers. Returns false if none were queued.
+    bool help();
+
+    // True if the calling thread is one of our workers.
+    bool isWorker() const;
+
+    // The pool shared by nested parallel code, with Globals->parallelism
+    // workers. Replaced by a new pool when Globals->parallelism changes.
+    static WorkStealingPool *global();
+
+private:
+    class Worker;
+    friend class Worker;
+
+    struct Deque
+    {
+        QMutex lock;
+        QList<QRunnable *> runnables;
+    };
+
+    QList<Deque *> deques;
+    QList<Worker *> workers;
+    QAtomicInt queued, sleepers, nextDeque;
+
+    QMutex idleLock;
+    QWaitCondition available;
+    bool stopping;
+
+    QRunnable *take(int index);
+    bool wait();
+    void retire();
+};
+
+// Rethrown by TaskGroup::wait() for a task that threw something other than a
+// QException, which can't be copied across threads without C++11.
+class BR_EXPORT TaskException : public QException
+{
+public:
+    explicit TaskException(const QByteArray &message) : message(message) {}
+    ~TaskException() throw() {}
+
+    const char *what() const throw() { return message.constData(); }
+    void raise() const { throw *this; }
+    TaskException *clone() const { return new TaskException(*this); }
+
+private:
+    QByteArray message;
+};
+
+// Tasks started together and waited on together. Each task is queued on the
+// group and a ticket for it on the pool, whichever comes first runs it. The
+// waiting thread runs our tasks nobody has started yet, then blocks until the
+// rest finish. It never runs tasks of other groups, which may need a lock the
+// caller holds, so nested groups can't deadlock each other.
+//
+// The first exception thrown by a task is rethrown from wait(), the others
+// are dropped. A QException keeps its type, anything else becomes a
+// TaskException carrying what().
+//
+// run() copies a function and its arguments the way QtConcurrent::run does,
+// runMember() also takes the object to call the member function on.
+class BR_EXPORT TaskGroup
+{
+public:
+    TaskGroup(WorkStealingPool *pool = WorkStealingPool::global());
+    ~TaskGroup();
+
+    void wait();
+
+    template <typename Function>
+    void run(Function function)
+    { start(new Call0<Function>(function)); }
+
+    template <typename Function, typename A1>
+    void run(Function function, A1 a1)
+    { start(new Call1<Function,A1>(function, a1)); }
+
+    template <typename Function, typename A1, typename A2>
+    void run(Function function, A1 a1, A2 a2)
+    { start(new Call2<Function,A1,A2>(function, a1, a2)); }
+
+    template <typename Function, typename A1, typename A2, typename A3>
+    void run(Function function, A1 a1, A2 a2, A3 a3)
+    { start(new Call3<Function,A1,A2,A3>(function, a1, a2, a3)); }
+
+    template <typename Function, typename A1, typename A2, typename A3, typename A4>
+    void run(Function function, A1 a1, A2 a2, A3 a3, A4 a4)
+    { start(new Call4<Function,A1,A2,A3,A4>(function, a1, a2, a3, a4)); }
+
+    template <typename Function, typename A1, typename A2, typename A3, typename A4, typename A5>
+    void run(Function function, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5)
+    { start(new Call5<Function,A1,A2,A3,A4,A5>(function, a1, a2, a3, a4, a5)); }
+
+    template <typename Function, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6>
+    void run(Function function, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6)
+    { start(new Call6<Function,A1,A2,A3,A4,A5,A6>(function, a1, a2, a3, a4, a5, a6)); }
+
+    template <typename Function, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7>
+    void run(Function function, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6, A7 a7)
+    { start(new Call7<Function,A1,A2,A3,A4,A5,A6,A7>(function, a1, a2, a3, a4, a5, a6, a7)); }
+
+    template <typename Object, typename Member, typename A1>
+    void runMember(Object *object, Member member, A1 a1)
+    { start(new MemberCall1<Object,Member,A1>(object, member, a1)); }
+
+    template <typename Object, typename Member, typename A1, typename A2>
+    void runMember(Object *object, Member member, A1 a1, A2 a2)
+    { start(new MemberCall2<Object,Member,A1,A2>(object, member, a1, a2)); }
+
+    template <typename Object, typename Member, typename A1, typename A2, typename A3>
+    void runMember(Object *object, Member member, A1 a1, A2 a2, A3 a3)
+    { start(new MemberCall3<Object,Member,A1,A2,A3>(object, member, a1, a2, a3)); }
+
+    template <typename Object, typename Member, typename A1, typename A2, typename A3, typename A4>
+    void runMember(Object *object, Member member, A1 a1, A2 a2, A3 a3, A4 a4)
+    { start(new MemberCall4<Object,Member,A1,A2,A3,A4>(object, member, a1, a2, a3, a4)); }
+
+    template <typename Object, typename Member, typename A1, typename A2, typename A3, typename A4, typename A5>
+    void runMember(Object *object, Member member, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5)
+    { start(new MemberCall5<Object,Member,A1,A2,A3,A4,A5>(object, member, a1, a2, a3, a4, a5)); }
+
+    template <typename Object, typename Member, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6>
+    void runMember(Object *object, Member member, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6)
+    { start(new MemberCall6<Object,Member,A1,A2,A3,A4,A5,A6>(object, member, a1, a2, a3, a4, a5, a6)); }
+
+    template <typename Object, typename Member, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7>
+    void runMember(Object *object, Member member, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6, A7 a7)
+    { start(new MemberCall7<Object,Member,A1,A2,A3,A4,A5,A6,A7>(object, member, a1, a2, a3, a4, a5, a6, a7)); }
+
+private:
+    class Task
+    {
+    public:
+        virtual ~Task() {}
+
+    private:
+        TaskGroup *group;
+        void run();
+        virtual void call() = 0;
+        friend class TaskGroup;
+    };
+
+    // Tasks not yet started, shared with the tickets on the pool, which may
+    // run after the group is gone and then find nothing to do.
+    struct Queue
+    {
+        QMutex lock;
+        QList<Task *> tasks;
+
+        Task *takeFirst();
+        Task *takeLast();
+    };
+
+    class Ticket : public QRunnable
+    {
+    public:
+        Ticket(const QSharedPointer<Queue> &queue) : queue(queue) {}
+
+    private:
+        QSharedPointer<Queue> queue;
+        void run();
+    };
+
+    template <typename F>
+    struct Call0 : public Task
+    {
+        F f;
+        Call0(F f) : f(f) {}
+        void call() { f(); }
+    };
+
+    template <typename F, typename A1>
+    struct Call1 : public Task
+    {
+        F f; A1 a1;
+        Call1(F f, A1 a1) : f(f), a1(a1) {}
+        void call() { f(a1); }
+    };
+
+    template <typename F, typename A1, typename A2>
+    struct Call2 : public Task
+    {
+        F f; A1 a1; A2 a2;
+        Call2(F f, A1 a1, A2 a2) : f(f), a1(a1), a2(a2) {}
+        void call() { f(a1, a2); }
+    };
+
+    template <typename F, typename A1, typename A2, typename A3>
+    struct Call3 : public Task
+    {
+        F f; A1 a1; A2 a2; A3 a3;
+        Call3(F f, A1 a1, A2 a2, A3 a3) : f(f), a1(a1), a2(a2), a3(a3) {}
+        void call() { f(a1, a2, a3); }
+    };
+
+    template <typename F, typename A1, typename A2, typename A3, typename A4>
+    struct Call4 : public Task
+    {
+        F f; A1 a1; A2 a2; A3 a3; A4 a4;
+        Call4(F f, A1 a1, A2 a2, A3 a3, A4 a4) : f(f), a1(a1), a2(a2), a3(a3), a4(a4) {}
+        void call() { f(a1, a2, a3, a4); }
+    };
+
+    template <typename F, typename A1, typename A2, typename A3, typename A4, typename A5>
+    struct Call5 : public Task
+    {
+        F f; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5;
+        Call5(F f, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5) : f(f), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5) {}
+        void call() { f(a1, a2, a3, a4, a5); }
+    };
+
+    template <typename F, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6>
+    struct Call6 : public Task
+    {
+        F f; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5; A6 a6;
+        Call6(F f, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6) : f(f), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5), a6(a6) {}
+        void call() { f(a1, a2, a3, a4, a5, a6); }
+    };
+
+    template <typename F, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7>
+    struct Call7 : public Task
+    {
+        F f; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5; A6 a6; A7 a7;
+        Call7(F f, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6, A7 a7) : f(f), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5), a6(a6), a7(a7) {}
+        void call() { f(a1, a2, a3, a4, a5, a6, a7); }
+    };
+
+    template <typename O, typename M, typename A1>
+    struct MemberCall1 : public Task
+    {
+        O *o; M m; A1 a1;
+        MemberCall1(O *o, M m, A1 a1) : o(o), m(m), a1(a1) {}
+        void call() { (o->*m)(a1); }
+    };
+
+    template <typename O, typename M, typename A1, typename A2>
+    struct MemberCall2 : public Task
+    {
+        O *o; M m; A1 a1; A2 a2;
+        MemberCall2(O *o, M m, A1 a1, A2 a2) : o(o), m(m), a1(a1), a2(a2) {}
+        void call() { (o->*m)(a1, a2); }
+    };
+
+    template <typename O, typename M, typename A1, typename A2, typename A3>
+    struct MemberCall3 : public Task
+    {
+        O *o; M m; A1 a1; A2 a2; A3 a3;
+        MemberCall3(O *o, M m, A1 a1, A2 a2, A3 a3) : o(o), m(m), a1(a1), a2(a2), a3(a3) {}
+        void call() { (o->*m)(a1, a2, a3); }
+    };
+
+    template <typename O, typename M, typename A1, typename A2, typename A3, typename A4>
+    struct MemberCall4 : public Task
+    {
+        O *o; M m; A1 a1; A2 a2; A3 a3; A4 a4;
+        MemberCall4(O *o, M m, A1 a1, A2 a2, A3 a3, A4 a4) : o(o), m(m), a1(a1), a2(a2), a3(a3), a4(a4) {}
+        void call() { (o->*m)(a1, a2, a3, a4); }
+    };
+
+    template <typename O, typename M, typename A1, typename A2, typename A3, typename A4, typename A5>
+    struct MemberCall5 : public Task
+    {
+        O *o; M m; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5;
+        MemberCall5(O *o, M m, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5) : o(o), m(m), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5) {}
+        void call() { (o->*m)(a1, a2, a3, a4, a5); }
+    };
+
+    template <typename O, typename M, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6>
+    struct MemberCall6 : public Task
+    {
+        O *o; M m; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5; A6 a6;
+        MemberCall6(O *o, M m, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6) : o(o), m(m), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5), a6(a6) {}
+        void call() { (o->*m)(a1, a2, a3, a4, a5, a6); }
+    };
+
+    template <typename O, typename M, typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7>
+    struct MemberCall7 : public Task
+    {
+        O *o; M m; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5; A6 a6; A7 a7;
+        MemberCall7(O *o, M m, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6, A7 a7) : o(o), m(m), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5), a6(a6), a7(a7) {}
+        void call() { (o->*m)(a1, a2, a3, a4, a5, a6, a7); }
+    };
+
+    WorkStealingPool *pool;
+    QSharedPointer<Queue> queue;
+    QAtomicInt pending;
+    QMutex lock;
+    QWaitCondition finished;
+    QException *error; // First exception thrown by a task, guarded by lock
+
+    void start(Task *task);
+    void done();
+    void fail(QException *exception);
+    void join();
+    static void execute(Task *task);
+};
+
+} // namespace br
+
+#endif // BR_SCHEDULER_H
@@ -37,12 +37,8 @@
 #ifndef _INCLUDE_TANH_SSE_
 #define _INCLUDE_TANH_SSE_
 
-/* inline */
-#ifdef _TANH_USE_INLINE
-  #define _TANH_INLINE    inline
-#else
-  #define _TANH_INLINE
-#endif
+/* inline, so the header can be included by more than one translation unit */
+#define _TANH_INLINE    inline
 
 /* constants */
 #define _TANH_RANGE   5.f
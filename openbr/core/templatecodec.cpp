@@ -0,0 +1,568 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDataStream>
+#include <QPointF>
+#include <QRectF>
+#include <QStringList>
+#include <QtEndian>
+#include <limits>
+
+#include "templatecodec.h"
+
+using namespace br;
+
+// Value tags, new tags may only be appended
+enum ValueTag
+{
+    NullTag,
+    FalseTag,
+    TrueTag,
+    IntTag,       // Zigzag varint
+    UIntTag,      // Varint
+    LongLongTag,  // Zigzag varint
+    ULongLongTag, // Varint
+    FloatTag,     // Little endian
+    DoubleTag,    // Little endian
+    StringTag,    // UTF-8
+    PointTag,     // Two doubles
+    RectTag,      // Four doubles
+    ListTag,      // Varint count, then tagged values
+    StringListTag,// Varint count, then UTF-8 strings
+    VariantTag    // Varint length, then the QDataStream serialized QVariant
+};
+
+enum RecordFlag
+{
+    FTEFlag = 0x1
+};
+
+static const MetadataKey FTEKey("FTE");
+
+static void writeVarint(QByteArray &dst, quint64 value)
+{
+    while (value >= 0x80) {
+        dst.append(char(value | 0x80));
+        value >>= 7;
+    }
+    dst.append(char(value));
+}
+
+static void writeSigned(QByteArray &dst, qint64 value)
+{
+    writeVarint(dst, (quint64(value) << 1) ^ quint64(value >> 63));
+}
+
+static void writeDouble(QByteArray &dst, double value)
+{
+    quint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = qToLittleEndian(bits);
+    dst.append((const char*) &bits, sizeof(bits));
+}
+
+static void writeString(QByteArray &dst, const QString &string)
+{
+    const QByteArray utf8 = string.toUtf8();
+    writeVarint(dst, utf8.size());
+    dst.append(utf8);
+}
+
+static void writeValue(QByteArray &dst, const QVariant &value)
+{
+    switch (value.userType()) {
+      case QMetaType::UnknownType:
+        dst.append(char(NullTag));
+        break;
+      case QMetaType::Bool:
+        dst.append(char(value.toBool() ? TrueTag : FalseTag));
+        break;
+      case QMetaType::Int:
+        dst.append(char(IntTag));
+        writeSigned(dst, value.toInt());
+        break;
+      case QMetaType::UInt:
+        dst.append(char(UIntTag));
+        writeVarint(dst, value.toUInt());
+        break;
+      case QMetaType::LongLong:
+        dst.append(char(LongLongTag));
+        writeSigned(dst, value.toLongLong());
+        break;
+      case QMetaType::ULongLong:
+        dst.append(char(ULongLongTag));
+        writeVarint(dst, value.toULongLong());
+        break;
+      case QMetaType::Float: {
+        dst.append(char(FloatTag));
+        const float f = value.toFloat();
+        quint32 bits;
+        memcpy(&bits, &f, sizeof(bits));
+        bits = qToLittleEndian(bits);
+        dst.append((const char*) &bits, sizeof(bits));
+      } break;
+      case QMetaType::Double:
+        dst.append(char(DoubleTag));
+        writeDouble(dst, value.toDouble());
+        break;
+      case QMetaType::QString:
+        dst.append(char(StringTag));
+        writeString(dst, value.toString());
+        break;
+      case QMetaType::QPointF: {
+        dst.append(char(PointTag));
+        const QPointF point = value.toPointF();
+        writeDouble(dst, point.x());
+        writeDouble(dst, point.y());
+      } break;
+      case QMetaType::QRectF: {
+        dst.append(char(RectTag));
+        const QRectF rect = value.toRectF();
+        writeDouble(dst, rect.x());
+        writeDouble(dst, rect.y());
+        writeDouble(dst, rect.width());
+        writeDouble(dst, rect.height());
+      } break;
+      case QMetaType::QVariantList: {
+        dst.append(char(ListTag));
+        const QVariantList list = value.toList();
+        writeVarint(dst, list.size());
+        foreach (const QVariant &item, list)
+            writeValue(dst, item);
+      } break;
+      case QMetaType::QStringList: {
+        dst.append(char(StringListTag));
+        const QStringList list = value.toStringList();
+        writeVarint(dst, list.size());
+        foreach (const QString &item, list)
+            writeString(dst, item);
+      } break;
+      default: {
+        dst.append(char(VariantTag));
+        QByteArray serialized;
+        QDataStream stream(&serialized, QIODevice::WriteOnly);
+        stream << value;
+        writeVarint(dst, serialized.size());
+        dst.append(serialized);
+      }
+    }
+}
+
+// Bounds checked parsing of a record head
+struct HeadReader
+{
+    const char *data, *end;
+    bool ok;
+
+    HeadReader(const char *data, const char *end) : data(data), end(end), ok(true) {}
+
+    quint64 varint()
+    {
+        quint64 value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (data >= end)
+                break;
+            const uchar byte = uchar(*data++);
+            value |= quint64(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    qint64 signedVarint()
+    {
+        const quint64 value = varint();
+        return qint64(value >> 1) ^ -qint64(value & 1);
+    }
+
+    // Guards against lengths and counts larger than the rest of the head
+    int count()
+    {
+        const quint64 value = varint();
+        if (value > quint64(end - data)) {
+            ok = false;
+            return 0;
+        }
+        return int(value);
+    }
+
+    const char *bytes(int size)
+    {
+        if (end - data < size) {
+            ok = false;
+            return NULL;
+        }
+        const char *result = data;
+        data += size;
+        return result;
+    }
+
+    double real()
+    {
+        const char *src = bytes(sizeof(quint64));
+        if (!src)
+            return 0;
+        quint64 bits;
+        memcpy(&bits, src, sizeof(bits));
+        bits = qFromLittleEndian(bits);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    QString string()
+    {
+        const int size = count();
+        const char *src = bytes(size);
+        return src ? QString::fromUtf8(src, size) : QString();
+    }
+
+    QVariant value()
+    {
+        if (data >= end) {
+            ok = false;
+            return QVariant();
+        }
+
+        switch (uchar(*data++)) {
+          case NullTag:       return QVariant();
+          case FalseTag:      return QVariant(false);
+          case TrueTag:       return QVariant(true);
+          case IntTag:        return QVariant(int(signedVarint()));
+          case UIntTag:       return QVariant(uint(varint()));
+          case LongLongTag:   return QVariant(qlonglong(signedVarint()));
+          case ULongLongTag:  return QVariant(qulonglong(varint()));
+          case FloatTag: {
+            const char *src = bytes(sizeof(quint32));
+            if (!src)
+                return QVariant();
+            quint32 bits;
+            memcpy(&bits, src, sizeof(bits));
+            bits = qFromLittleEndian(bits);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            return QVariant(f);
+          }
+          case DoubleTag:     return QVariant(real());
+          case StringTag:     return QVariant(string());
+          case PointTag: {
+            const double x = real();
+            const double y = real();
+            return QVariant(QPointF(x, y));
+          }
+          case RectTag: {
+            const double x = real();
+            const double y = real();
+            const double width = real();
+            const double height = real();
+            return QVariant(QRectF(x, y, width, height));
+          }
+          case ListTag: {
+            const int size = count();
+            QVariantList list;
+            list.reserve(size);
+            for (int i=0; ok && (i<size); i++)
+                list.append(value());
+            return list;
+          }
+          case StringListTag: {
+            const int size = count();
+            QStringList list;
+            list.reserve(size);
+            for (int i=0; ok && (i<size); i++)
+                list.append(string());
+            return list;
+          }
+          case VariantTag: {
+            const int size = count();
+            const char *src = bytes(size);
+            if (!src)
+                return QVariant();
+            QDataStream stream(QByteArray::fromRawData(src, size));
+            QVariant variant;
+            stream >> variant;
+            if (stream.status() != QDataStream::Ok)
+                ok = false;
+            return variant;
+          }
+        }
+
+        ok = false;
+        return QVariant();
+    }
+};
+
+// Reads exactly size bytes, waiting on sequential devices like pipes and sockets for the rest to arrive
+static bool readFully(QIODevice *device, char *data, qint64 size)
+{
+    while (size > 0) {
+        const qint64 read = device->read(data, size);
+        if (read < 0)
+            return false;
+        if ((read == 0) && !device->waitForReadyRead(-1))
+            return false;
+        data += read;
+        size -= read;
+    }
+    return true;
+}
+
+static bool readVarint(QIODevice *device, quint64 &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char byte;
+        if (!readFully(device, &byte, 1))
+            return false;
+        value |= quint64(uchar(byte) & 0x7f) << shift;
+        if (!(uchar(byte) & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void writeFully(QIODevice *device, const char *data, qint64 size)
+{
+    while (size > 0) {
+        const qint64 written = device->write(data, size);
+        if (written <= 0)
+            qFatal("Template encoding failure, failed to write %lld bytes: %s", size, qPrintable(device->errorString()));
+        data += written;
+        size -= written;
+    }
+}
+
+QByteArray TemplateCodec::header()
+{
+    QByteArray header("BRTC");
+    header.append(char(Version));
+    return header;
+}
+
+bool TemplateCodec::isHeader(const QByteArray &data)
+{
+    if ((data.size() < HeaderSize) || !data.startsWith("BRTC"))
+        return false;
+    if (uchar(data[HeaderSize-1]) > Version)
+        qFatal("Templates encoded by a newer version %d of the codec, this version reads up to %d.", uchar(data[HeaderSize-1]), Version);
+    return true;
+}
+
+/* Encoder */
+void TemplateCodec::Encoder::resume(const Decoder &decoder)
+{
+    indices.clear();
+    for (int i=0; i<decoder.atoms.size(); i++)
+        indices.insert(decoder.atoms[i], i);
+}
+
+void TemplateCodec::Encoder::write(QIODevice *device, const Template &t)
+{
+    const QVector<FileMetadata::Entry> &entries = t.file.m_metadata.entries;
+
+    // Dictionary entries for keys this stream hasn't seen
+    QByteArray head;
+    writeVarint(head, indices.size());
+    QVector<int> fresh;
+    foreach (const FileMetadata::Entry &entry, entries)
+        if ((entry.first != FTEKey.atom) && !indices.contains(entry.first))
+            fresh.append(entry.first);
+    writeVarint(head, fresh.size());
+    foreach (int atom, fresh) {
+        writeString(head, MetadataKey::name(atom));
+        indices.insert(atom, indices.size());
+    }
+
+    // File, FTE is a flag rather than a metadata entry
+    head.append(char(t.file.fte ? FTEFlag : 0));
+    writeString(head, t.file.name);
+    writeVarint(head, entries.size() - (t.file.m_metadata.contains(FTEKey) ? 1 : 0));
+    foreach (const FileMetadata::Entry &entry, entries) {
+        if (entry.first == FTEKey.atom)
+            continue;
+        writeVarint(head, indices.value(entry.first));
+        writeValue(head, entry.second);
+    }
+
+    // Matrix headers, their data follows the head
+    quint64 payload = 0;
+    writeVarint(head, t.size());
+    foreach (const cv::Mat &m, t) {
+        const quint64 bytes = quint64(m.rows) * m.cols * m.elemSize();
+        if ((bytes > 0) && !m.isContinuous())
+            qFatal("Can't serialize non-continuous matrices.");
+        writeVarint(head, m.rows);
+        writeVarint(head, m.cols);
+        writeVarint(head, m.type());
+        writeVarint(head, bytes);
+        payload += bytes;
+    }
+
+    QByteArray prefix;
+    writeVarint(prefix, head.size());
+    writeVarint(prefix, payload);
+    writeFully(device, prefix.data(), prefix.size());
+    writeFully(device, head.data(), head.size());
+    foreach (const cv::Mat &m, t)
+        writeFully(device, (const char*) m.data, qint64(m.rows) * m.cols * m.elemSize());
+}
+
+void TemplateCodec::Encoder::write(QIODevice *device, const TemplateList &templates)
+{
+    QByteArray count;
+    writeVarint(count, templates.size());
+    writeFully(device, count.data(), count.size());
+    foreach (const Template &t, templates)
+        write(device, t);
+}
+
+/* Decoder */
+bool TemplateCodec::Decoder::readHead(QIODevice *device, QByteArray &head, qint64 &payload)
+{
+    quint64 headBytes, payloadBytes;
+    if (!readVarint(device, headBytes) || !readVarint(device, payloadBytes))
+        return false;
+    if ((headBytes > quint64(std::numeric_limits<int>::max())) || (payloadBytes > quint64(std::numeric_limits<qint64>::max())))
+        return false;
+    head.resize(int(headBytes));
+    payload = qint64(payloadBytes);
+    return readFully(device, head.data(), head.size());
+}
+
+// Dictionary entries already known, from re-reading a record after seeking backwards, are skipped
+bool TemplateCodec::Decoder::parseKeys(const char *&data, const char *end, QVector<int> &fresh) const
+{
+    HeadReader reader(data, end);
+    const quint64 first = reader.varint();
+    const int size = reader.count();
+    if (!reader.ok || (first > quint64(atoms.size())))
+        return false;
+    for (int i=0; reader.ok && (i<size); i++) {
+        const QString key = reader.string();
+        if (first + i >= quint64(atoms.size()))
+            fresh.append(MetadataKey::intern(key));
+    }
+    data = reader.data;
+    return reader.ok;
+}
+
+bool TemplateCodec::Decoder::read(QIODevice *device, Template &t)
+{
+    t = Template();
+    QByteArray head;
+    qint64 payload;
+    if (!readHead(device, head, payload))
+        return false;
+
+    const char *data = head.constData();
+    const char *end = data + head.size();
+    QVector<int> fresh;
+    if (!parseKeys(data, end, fresh))
+        return false;
+    const int known = atoms.size();
+
+    HeadReader reader(data, end);
+    const int flags = reader.ok && (reader.data < reader.end) ? uchar(*reader.data++) : 0;
+    t.file.name = reader.string();
+    t.file.fte = (flags & FTEFlag) != 0;
+
+    const int entries = reader.count();
+    t.file.m_metadata.entries.reserve(entries + 1);
+    for (int i=0; reader.ok && (i<entries); i++) {
+        const quint64 index = reader.varint();
+        const QVariant value = reader.value();
+        if (index >= quint64(known + fresh.size()))
+            return false;
+        t.file.m_metadata.insert(int(index) < known ? atoms[int(index)] : fresh[int(index) - known], value);
+    }
+    // Legacy galleries carry FTE as metadata
+    t.file.m_metadata.insert(FTEKey.atom, QVariant::fromValue(t.file.fte));
+
+    const int matrices = reader.count();
+    qint64 expected = 0;
+    QVector<qint64> lengths;
+    lengths.reserve(matrices);
+    for (int i=0; reader.ok && (i<matrices); i++) {
+        const quint64 rows = reader.varint();
+        const quint64 cols = reader.varint();
+        const quint64 type = reader.varint();
+        const quint64 bytes = reader.varint();
+        if ((rows > quint64(std::numeric_limits<int>::max())) || (cols > quint64(std::numeric_limits<int>::max())) ||
+            (type != quint64(CV_MAT_TYPE(int(type)))) || (bytes != rows * cols * CV_ELEM_SIZE(int(type))) ||
+            (bytes > quint64(payload - expected)))
+            return false;
+        t.append(cv::Mat(int(rows), int(cols), int(type)));
+        lengths.append(qint64(bytes));
+        expected += qint64(bytes);
+    }
+    if (!reader.ok || (reader.data != reader.end) || (expected != payload))
+        return false;
+
+    for (int i=0; i<t.size(); i++)
+        if (!readFully(device, (char*) t[i].data, lengths[i]))
+            return false;
+
+    atoms += fresh;
+    return true;
+}
+
+bool TemplateCodec::Decoder::read(QIODevice *device, TemplateList &templates)
+{
+    templates.clear();
+    quint64 count;
+    if (!readVarint(device, count))
+        return false;
+    templates.reserve(int(std::min(count, quint64(1 << 16))));
+    for (quint64 i=0; i<count; i++) {
+        Template t;
+        if (!read(device, t))
+            return false;
+        templates.append(t);
+    }
+    return true;
+}
+
+bool TemplateCodec::Decoder::define(QIODevice *device)
+{
+    QByteArray head;
+    qint64 payload;
+    if (!readHead(device, head, payload))
+        return false;
+
+    const char *data = head.constData();
+    QVector<int> fresh;
+    if (!parseKeys(data, data + head.size(), fresh))
+        return false;
+
+    if (device->isSequential()) {
+        char buffer[4096];
+        while (payload > 0) {
+            const qint64 chunk = std::min(payload, qint64(sizeof(buffer)));
+            if (!readFully(device, buffer, chunk))
+                return false;
+            payload -= chunk;
+        }
+    } else {
+        const qint64 next = device->pos() + payload;
+        if ((next > device->size()) || !device->seek(next))
+            return false;
+    }
+
+    atoms += fresh;
+    return true;
+}
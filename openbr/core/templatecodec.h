@@ -0,0 +1,84 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_TEMPLATECODEC_H
+#define BR_TEMPLATECODEC_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QIODevice>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// A versioned compact binary encoding of templates, used by .gal galleries and ProcessWrapper.
+// Compared to QDataStream serialization headers are varints, matrix lengths are 64-bit, strings are UTF-8,
+// and common metadata types are tagged instead of streamed as QVariant.
+// Each metadata key is spelled out in the first record that uses it and referenced by its index in the stream's dictionary afterwards,
+// so records can only be decoded after the records before them have been read or passed to Decoder::define().
+//
+// Stream: header(), then one record per template.
+// Record: varint head bytes, varint payload bytes, head, matrix data.
+// Head: varint first new key index, varint new keys, UTF-8 new keys, flags, UTF-8 name,
+//       varint metadata entries, (varint key index, tagged value) per entry,
+//       varint matrices, (varint rows, varint cols, varint type, varint bytes) per matrix.
+namespace TemplateCodec
+{
+    static const int Version = 1;
+    static const int HeaderSize = 5;
+
+    BR_EXPORT QByteArray header(); // "BRTC" followed by the version byte
+
+    // Returns true if data starts with a codec header, qFatal if it was written by a newer version
+    BR_EXPORT bool isHeader(const QByteArray &data);
+
+    class Decoder;
+
+    class BR_EXPORT Encoder
+    {
+        QHash<int,int> indices; // Key atom to dictionary index
+
+    public:
+        // Continue a stream whose records have been passed to decoder
+        void resume(const Decoder &decoder);
+
+        void write(QIODevice *device, const Template &t);
+        void write(QIODevice *device, const TemplateList &templates); // varint count, then the records
+    };
+
+    class BR_EXPORT Decoder
+    {
+        QVector<int> atoms; // Dictionary index to key atom
+        friend class Encoder;
+
+        bool readHead(QIODevice *device, QByteArray &head, qint64 &payload);
+        bool parseKeys(const char *&data, const char *end, QVector<int> &fresh) const;
+
+    public:
+        // Returns false at the end of the device or if the record is truncated or malformed
+        bool read(QIODevice *device, Template &t);
+        bool read(QIODevice *device, TemplateList &templates);
+
+        // Reads the dictionary entries of a record and skips the rest of it
+        bool define(QIODevice *device);
+    };
+}
+
+} // namespace br
+
+#endif // BR_TEMPLATECODEC_H
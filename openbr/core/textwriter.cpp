@@ -0,0 +1,162 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFileInfo>
+#include <QVector>
+#include <cmath>
+#include <cstdio>
+#include <openbr/openbr_plugin.h>
+
+#include "qtutils.h"
+#include "scheduler.h"
+#include "textwriter.h"
+
+using namespace br;
+
+// Bytes collected before they are written to the file or terminal
+static const int flushBytes = 1 << 20;
+
+// Rows formatted by one task
+static const int blockRows = 16;
+
+static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+TextWriter::TextWriter(const QString &fileName)
+{
+    const QString baseName = QFileInfo(fileName).baseName();
+    if (baseName == "terminal") {
+        target = TerminalTarget;
+    } else if (baseName == "buffer") {
+        target = BufferTarget;
+    } else {
+        target = FileTarget;
+        file.setFileName(fileName);
+        QtUtils::touchDir(file);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(fileName));
+    }
+}
+
+TextWriter::~TextWriter()
+{
+    if (target == BufferTarget) {
+        // Lines are joined without a final line break, as in QtUtils::writeFile
+        if (pending.endsWith('\n'))
+            pending.chop(1);
+        Globals->buffer = pending;
+    } else if (target == TerminalTarget) {
+        fwrite(pending.data(), 1, pending.size(), stdout);
+        fflush(stdout);
+    } else {
+        if (file.write(pending) != pending.size())
+            qFatal("Failed to write %s.", qPrintable(file.fileName()));
+        file.close();
+    }
+}
+
+void TextWriter::write(const QByteArray &text)
+{
+    pending += text;
+    if ((target == BufferTarget) || (pending.size() < flushBytes))
+        return;
+
+    if (target == TerminalTarget) {
+        fwrite(pending.data(), 1, pending.size(), stdout);
+    } else if (file.write(pending) != pending.size()) {
+        qFatal("Failed to write %s.", qPrintable(file.fileName()));
+    }
+    pending.clear();
+}
+
+void TextWriter::writeLine(const QString &line)
+{
+    write(line.toLocal8Bit() + '\n');
+}
+
+static void formatRows(const TextWriter::RowFormatter *formatter, int begin, int end, QByteArray *dst)
+{
+    for (int i=begin; i<end; i++)
+        formatter->format(i, *dst);
+}
+
+void TextWriter::writeRows(int rows, const RowFormatter &formatter)
+{
+    // Enough blocks in flight to keep every worker busy while the previous ones are written
+    const int window = 4 * WorkStealingPool::global()->threadCount();
+    QVector<QByteArray> blocks(window);
+    for (int begin=0; begin<rows; begin+=window*blockRows) {
+        int count = 0;
+        {
+            TaskGroup group;
+            for (int block=begin; (block<rows) && (count<window); block+=blockRows, count++) {
+                blocks[count].clear();
+                group.run(formatRows, &formatter, block, std::min(rows, block+blockRows), &blocks[count]);
+            }
+        }
+        for (int i=0; i<count; i++)
+            write(blocks[i]);
+    }
+}
+
+// QString::number(float) formats the value as a double with 'g' and 6 significant digits.
+// Fixed point values whose seventh digit isn't a near tie are rounded here, everything else is left to Qt.
+void TextWriter::appendNumber(QByteArray &dst, float value)
+{
+    const double v = value;
+    const double a = std::fabs(v);
+    if (!(a >= 1e-4) || !(a < 1e6)) { // Also catches zero and NaN
+        dst += QByteArray::number(v);
+        return;
+    }
+
+    // 10^e <= a < 10^(e+1)
+    int e = 5;
+    while ((e > -4) && (a < powersOfTen[e+4] / 1e4))
+        e--;
+
+    const double scaled = a * powersOfTen[5-e];
+    const double whole = std::floor(scaled);
+    const double fraction = scaled - whole;
+    const int digits = int(whole) + (fraction > 0.5 ? 1 : 0);
+    if ((whole < 1e5) || (digits >= 1000000) || (std::fabs(fraction - 0.5) < 1e-6)) {
+        dst += QByteArray::number(v);
+        return;
+    }
+
+    char text[16];
+    for (int i=5, d=digits; i>=0; i--, d/=10)
+        text[i] = char('0' + d % 10);
+    int significant = 6;
+    while (text[significant-1] == '0')
+        significant--;
+
+    if (v < 0)
+        dst += '-';
+    if (e >= 0) {
+        dst.append(text, std::min(significant, e+1));
+        for (int i=significant; i<e+1; i++)
+            dst += '0';
+        if (significant > e+1) {
+            dst += '.';
+            dst.append(text + e + 1, significant - e - 1);
+        }
+    } else {
+        dst += "0.";
+        for (int i=0; i<-e-1; i++)
+            dst += '0';
+        dst.append(text, significant);
+    }
+}
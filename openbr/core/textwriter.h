@@ -0,0 +1,63 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_TEXTWRITER_H
+#define BR_TEXTWRITER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Streams text output in order instead of collecting it as a QStringList for QtUtils::writeFile.
+// As with QtUtils::writeFile, the "terminal" base name prints to stdout and "buffer" stores the text in Context::buffer.
+class BR_EXPORT TextWriter
+{
+public:
+    // Appends the text of one row, including its line break. Called concurrently for different rows.
+    struct RowFormatter
+    {
+        virtual ~RowFormatter() {}
+        virtual void format(int row, QByteArray &dst) const = 0;
+    };
+
+    explicit TextWriter(const QString &fileName);
+
+    // Writes anything still pending.
+    ~TextWriter();
+
+    void write(const QByteArray &text);
+    void writeLine(const QString &line);
+
+    // Formats blocks of rows in parallel and writes them in row order, holding a bounded number of blocks at once.
+    void writeRows(int rows, const RowFormatter &formatter);
+
+    // Appends the same text as QString::number(value), without a QString for values written in fixed point.
+    static void appendNumber(QByteArray &dst, float value);
+
+private:
+    enum Target { FileTarget, TerminalTarget, BufferTarget };
+    Target target;
+    QFile file;
+    QByteArray pending;
+};
+
+} // namespace br
+
+#endif // BR_TEXTWRITER_H
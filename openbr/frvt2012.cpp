@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMutex>
 #include <openbr/openbr_plugin.h>
 #include <openbr/plugins/openbr_internal.h>
 
@@ -28,6 +29,38 @@ static QSharedPointer<Transform> frvt2012_age_transform;
 static QSharedPointer<Transform> frvt2012_gender_transform;
 static const int frvt2012_template_size = 768;
 
+#ifdef BR_EMBEDDED
+// Embedded builds plan enrollment once at initialization so that calls have a fixed cost and memory footprint:
+// the transform is simplified ahead of time, warmed up on an image of the largest planned size so lazily allocated
+// buffers and models are in place, and enrolls into a reused template list of a fixed capacity.
+static const int frvt2012_max_templates = 1;
+static const int frvt2012_max_image_width = 1024;
+static const int frvt2012_max_image_height = 1024;
+static TemplateList frvt2012_templates;
+static QMutex frvt2012_templates_lock;
+
+// The simplified tree shares child transforms with the original, so the original is kept alive alongside it
+static QSharedPointer<Transform> frvt2012_original_transform;
+
+static void noDelete(Transform *) {}
+
+static QSharedPointer<Transform> plan(Transform *transform)
+{
+    bool newTransform = false;
+    Transform *simplified = transform->simplify(newTransform);
+    frvt2012_original_transform = QSharedPointer<Transform>(transform);
+    QSharedPointer<Transform> planned = newTransform ? QSharedPointer<Transform>(simplified)
+                                                     : QSharedPointer<Transform>(transform, noDelete);
+
+    TemplateList warmup;
+    warmup.append(Template("warmup", cv::Mat::zeros(frvt2012_max_image_height, frvt2012_max_image_width, CV_8UC3)));
+    warmup >> *planned;
+
+    frvt2012_templates.reserve(frvt2012_max_templates);
+    return planned;
+}
+#endif // BR_EMBEDDED
+
 static void initialize(const string &configuration_location)
 {
     // Fake the command line arguments
@@ -55,8 +88,13 @@ int32_t get_pid(string &sdk_identifier, string &email_address)
 
 int32_t get_max_template_sizes(uint32_t &max_enrollment_template_size, uint32_t &max_recognition_template_size)
 {
+#ifdef BR_EMBEDDED
+    max_enrollment_template_size = frvt2012_max_templates * frvt2012_template_size;
+    max_recognition_template_size = frvt2012_max_templates * frvt2012_template_size;
+#else // BR_EMBEDDED
     max_enrollment_template_size = frvt2012_template_size;
     max_recognition_template_size = frvt2012_template_size;
+#endif // BR_EMBEDDED
     return 0;
 }
 
@@ -64,7 +102,12 @@ int32_t initialize_verification(string &configuration_location, vector<string> &
 {
     (void) descriptions;
     initialize(configuration_location);
-    frvt2012_transform = QSharedPointer<Transform>(Transform::make("Cvt(RGBGray)+Cascade(FrontalFace)!<FaceRecognitionRegistration>!<FaceRecognitionExtraction>+<FaceRecognitionEmbedding>+<FaceRecognitionQuantization>", NULL));
+    Transform *transform = Transform::make("Cvt(RGBGray)+Cascade(FrontalFace)!<FaceRecognitionRegistration>!<FaceRecognitionExtraction>+<FaceRecognitionEmbedding>+<FaceRecognitionQuantization>", NULL);
+#ifdef BR_EMBEDDED
+    frvt2012_transform = plan(transform);
+#else // BR_EMBEDDED
+    frvt2012_transform = QSharedPointer<Transform>(transform);
+#endif // BR_EMBEDDED
     return 0;
 }
 
@@ -77,11 +120,24 @@ int32_t convert_multiface_to_enrollment_template(const MULTIFACE &input_faces, u
 int32_t convert_multiface_to_verification_template(const MULTIFACE &input_faces, uint32_t &template_size, uint8_t* proprietary_template, uint8_t &quality)
 {
     // Enroll templates
+#ifdef BR_EMBEDDED
+    // Erasing keeps the capacity reserved by plan(), the list is shared so calls are serialized
+    QMutexLocker locker(&frvt2012_templates_lock);
+    TemplateList &templates = frvt2012_templates;
+    templates.erase(templates.begin(), templates.end());
+#else // BR_EMBEDDED
     TemplateList templates; templates.reserve(input_faces.size());
+#endif // BR_EMBEDDED
     foreach (const ONEFACE &oneface, input_faces)
         templates.append(templateFromONEFACE(oneface));
     templates >> *frvt2012_transform.data();
 
+#ifdef BR_EMBEDDED
+    // Never write past the planned template size
+    while (templates.size() > frvt2012_max_templates)
+        templates.removeLast();
+#endif // BR_EMBEDDED
+
     // Compute template size
     template_size = templates.size() * frvt2012_template_size;
 
@@ -1,3 +1,5 @@
+#include <QAction>
+
 #include "galleryviewer.h"
 
 using namespace br;
@@ -8,9 +10,16 @@ GalleryViewer::GalleryViewer(QWidget *parent)
     : QMainWindow(parent)
 {
     addToolBar(Qt::TopToolBarArea, &gGallery);
+    aPageFlip = gGallery.addWidget(&pfPageFlip);
     setCentralWidget(&tvgTemplateViewerGrid);
     setWindowFlags(Qt::Widget);
 
+    connect(&pfPageFlip, SIGNAL(first()), &tvgTemplateViewerGrid, SLOT(firstPage()));
+    connect(&pfPageFlip, SIGNAL(previous()), &tvgTemplateViewerGrid, SLOT(previousPage()));
+    connect(&pfPageFlip, SIGNAL(next()), &tvgTemplateViewerGrid, SLOT(nextPage()));
+    connect(&pfPageFlip, SIGNAL(last()), &tvgTemplateViewerGrid, SLOT(lastPage()));
+    connect(&tvgTemplateViewerGrid, SIGNAL(pageChanged(int,int)), this, SLOT(pageChanged(int,int)));
+
     connect(&tvgTemplateViewerGrid, SIGNAL(newInput(br::File)), &gGallery, SLOT(enroll(br::File)));
     connect(&tvgTemplateViewerGrid, SIGNAL(newInput(QImage)), &gGallery, SLOT(enroll(QImage)));
     connect(&tvgTemplateViewerGrid, SIGNAL(selectedInput(br::File)), &gGallery, SLOT(select(br::File)));
@@ -44,4 +53,11 @@ void GalleryViewer::setFiles(FileList files)
         tmTemplateMetadata.setFile(files.first());
 }
 
+/*** PRIVATE SLOTS ***/
+void GalleryViewer::pageChanged(int page, int pages)
+{
+    aPageFlip->setVisible(pages > 1);
+    pfPageFlip.setToolTip(QString("Page %1 of %2").arg(page+1).arg(pages));
+}
+
 #include "moc_galleryviewer.cpp"
@@ -6,6 +6,7 @@
 #include <openbr/openbr_plugin.h>
 
 #include "gallerytoolbar.h"
+#include "pageflipwidget.h"
 #include "templateviewergrid.h"
 #include "templatemetadata.h"
 
@@ -20,12 +21,19 @@ public:
     GalleryToolBar gGallery;
     TemplateViewerGrid tvgTemplateViewerGrid;
     TemplateMetadata tmTemplateMetadata;
+    PageFlipWidget pfPageFlip;
 
     explicit GalleryViewer(QWidget *parent = 0);
 
 public slots:
     void setAlgorithm(const QString &algorithm);
     void setFiles(br::FileList files);
+
+private:
+    QAction *aPageFlip;
+
+private slots:
+    void pageChanged(int page, int pages);
 };
 
 } // namespace br
@@ -1,19 +1,29 @@
 #include "rankretrieval.h"
 
+#include <QMutexLocker>
 #include <QtConcurrent>
+#include <algorithm>
 
 #include <openbr/openbr.h>
 #include <openbr/gui/faceviewer.h>
 
 using namespace br;
 
+static bool moreSimilar(const HNSWIndex::Match &a, const HNSWIndex::Match &b)
+{
+    return a.second > b.second;
+}
+
 RankRetrieval::RankRetrieval(QWidget *parent) :
     QWidget(parent),
     gridPage(0),
-    gridSize(9)
+    gridSize(9),
+    k(200),
+    targetsStale(true)
 {
     targetPath = Context::scratchPath();
 
+    connect(&enrollWatcher, SIGNAL(finished()), this, SLOT(targetsChanged()));
     connect(&compareWatcher, SIGNAL(finished()), this, SLOT(compareDone()));
 }
 
@@ -25,6 +35,7 @@ void RankRetrieval::clear()
 void RankRetrieval::setAlgorithm(const QString &algorithm)
 {
     br_set_property("algorithm",qPrintable(algorithm));
+    targetsChanged();
 }
 
 void RankRetrieval::setTargetGallery(const File &file)
@@ -40,8 +51,8 @@ void RankRetrieval::setTargetPath()
 
 void RankRetrieval::setQueryGallery(const File &file)
 {
-    QSharedPointer<Transform> transform = Transform::fromAlgorithm("algorithm");
-    Template queryTemplate(file);
+    QSharedPointer<Transform> transform = Transform::fromAlgorithm(Globals->algorithm);
+    queryTemplate = Template(file);
     queryTemplate >> *transform;
 
     query = queryTemplate;
@@ -59,9 +70,11 @@ void RankRetrieval::enroll()
 
 void RankRetrieval::compare()
 {
-    File targetGallery(targetPath + ".gal");
+    if (queryTemplate.isEmpty()) return;
 
-    compareWatcher.setFuture(QtConcurrent::run(Compare, targetGallery.flat(), query.flat(), QString("buffer.rr[byLine,limit=200]")));
+    gridPage = 0;
+    const int current = generation.fetchAndAddOrdered(1) + 1;
+    compareWatcher.setFuture(QtConcurrent::run(this, &RankRetrieval::search, queryTemplate, current));
 }
 
 void RankRetrieval::first()
@@ -114,22 +127,120 @@ void RankRetrieval::setIndex(int index)
 }
 
 void RankRetrieval::compareDone()
-{    
-    matches.clear();
+{
+    showResults();
+    if (matches.isEmpty())
+        qWarning("Error: No successful matches.");
+}
 
-    QStringList results = QString(Globals->buffer).split("\n");
+void RankRetrieval::targetsChanged()
+{
+    QMutexLocker locker(&sessionLock);
+    targetsStale = true;
+    index.clear();
+}
 
-    if (results.empty()) {
-        qWarning("Error: No successful matches.");
+void RankRetrieval::buildIndex()
+{
+    if (!indexWatcher.isRunning())
+        indexWatcher.setFuture(QtConcurrent::run(this, &RankRetrieval::insertTargets));
+}
+
+void RankRetrieval::showResults()
+{
+    QMutexLocker locker(&sessionLock);
+    matches = resultFiles;
+    scores = resultScores;
+    locker.unlock();
+    display();
+}
+
+void RankRetrieval::search(const Template &query, int generation)
+{
+    TemplateList targets;
+    QSharedPointer<Distance> distance;
+    QSharedPointer<HNSWIndex> index;
+    bool loaded = false;
+    {
+        QMutexLocker locker(&sessionLock);
+        if (targetsStale) {
+            this->targets = TemplateList::fromGallery(File(targetPath + ".gal"));
+            this->distance = Distance::fromAlgorithm(Globals->algorithm);
+            this->index.clear();
+            targetsStale = false;
+            loaded = true;
+        }
+        targets = this->targets;
+        distance = this->distance;
+        index = this->index;
+    }
+
+    if (loaded && (targets.size() >= IndexSize))
+        QMetaObject::invokeMethod(this, "buildIndex", Qt::QueuedConnection);
+
+    if (distance.isNull() || targets.isEmpty()) {
+        publish(QList<Match>(), targets, generation);
         return;
     }
 
-    foreach (const QString &line, results) {
-        File match(line);
-        matches.append(match);
+    if (!index.isNull()) {
+        publish(index->search(query, k), targets, generation);
+        return;
     }
 
-    display();
+    QList<Match> best;
+    for (int begin=0; begin<targets.size(); begin+=BlockSize) {
+        if (generation != this->generation.load())
+            return;
+        const QList<float> blockScores = distance->compare(targets.mid(begin, BlockSize), query);
+        for (int j=0; j<blockScores.size(); j++)
+            best.append(Match(begin+j, blockScores[j]));
+        const int n = std::min(k, best.size());
+        std::partial_sort(best.begin(), best.begin()+n, best.end(), moreSimilar);
+        best = best.mid(0, n);
+        publish(best, targets, generation);
+    }
+}
+
+// Hand the best matches so far to the GUI thread, unless a newer query has started
+void RankRetrieval::publish(const QList<Match> &best, const TemplateList &targets, int generation)
+{
+    FileList files;
+    QList<float> bestScores;
+    foreach (const Match &match, best) {
+        files.append(targets[match.first].file);
+        bestScores.append(match.second);
+    }
+
+    QMutexLocker locker(&sessionLock);
+    if (generation != this->generation.load())
+        return;
+    resultFiles = files;
+    resultScores = bestScores;
+    locker.unlock();
+    QMetaObject::invokeMethod(this, "showResults", Qt::QueuedConnection);
+}
+
+void RankRetrieval::insertTargets()
+{
+    TemplateList targets;
+    QSharedPointer<Distance> distance;
+    {
+        QMutexLocker locker(&sessionLock);
+        targets = this->targets;
+        distance = this->distance;
+    }
+    if (distance.isNull()) return;
+
+    QSharedPointer<HNSWIndex> index(new HNSWIndex());
+    index->setDistance(distance.data());
+    foreach (const Template &t, targets)
+        index->insert(t);
+
+    // Kept only if the session still holds the targets it was built from
+    QMutexLocker locker(&sessionLock);
+    if (!targetsStale && (this->distance == distance))
+        this->index = index;
 }
 
 void RankRetrieval::display()
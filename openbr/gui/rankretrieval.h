@@ -1,9 +1,13 @@
 #ifndef BR_RANKRETRIEVAL_H
 #define BR_RANKRETRIEVAL_H
 
+#include <QAtomicInt>
 #include <QFutureWatcher>
 #include <QFileDialog>
+#include <QMutex>
+#include <QSharedPointer>
 #include <openbr/openbr_plugin.h>
+#include <openbr/core/hnsw.h>
 #include <openbr/gui/faceviewer.h>
 
 namespace br {
@@ -18,9 +22,27 @@ class BR_EXPORT RankRetrieval : public QWidget
     QList<float> scores;
     QFutureWatcher<void> enrollWatcher;
     QFutureWatcher<void> compareWatcher;
+    QFutureWatcher<void> indexWatcher;
 
     QString targetPath;
 
+    // The search session, the target gallery stays resident between queries until it is enrolled to again.
+    // Galleries of at least IndexSize templates are indexed with a br::HNSWIndex in the background, searches
+    // before it is built compare against every target a block at a time and show the best matches after each block.
+    typedef HNSWIndex::Match Match;
+    static const int IndexSize = 10000;
+    static const int BlockSize = 4096;
+    int k;
+    Template queryTemplate;
+    QMutex sessionLock;
+    TemplateList targets;
+    QSharedPointer<Distance> distance;
+    QSharedPointer<HNSWIndex> index;
+    bool targetsStale;
+    QAtomicInt generation; // Incremented by each query, stale searches stop at their next block
+    FileList resultFiles; // The best matches found so far, guarded by sessionLock
+    QList<float> resultScores;
+
 public:
     explicit RankRetrieval(QWidget *parent = 0);
 
@@ -44,6 +66,9 @@ public slots:
 
 private slots:
     void compareDone();
+    void targetsChanged();
+    void buildIndex();
+    void showResults();
 
 signals:
     void newTargetFileList(FileList);
@@ -53,6 +78,9 @@ signals:
 private:
     void enroll();
     void display();
+    void search(const Template &query, int generation);
+    void publish(const QList<Match> &best, const TemplateList &targets, int generation);
+    void insertTargets();
 
 };
 
@@ -7,6 +7,7 @@
 #include <openbr/openbr.h>
 
 #include "templateviewer.h"
+#include "thumbnailcache.h"
 
 using namespace br;
 
@@ -28,6 +29,8 @@ TemplateViewer::TemplateViewer(QWidget *parent)
     setDefaultText("<b>Drag Photo or Folder Here</b>\n");
     format = "Photo";
     editable = false;
+    thumbnail = false;
+    connect(ThumbnailCache::instance(), SIGNAL(ready(QString)), this, SLOT(thumbnailReady(QString)));
     setFile(File());
     update();
 }
@@ -60,6 +63,12 @@ void TemplateViewer::setMousePoint(const QPointF &mousePoint)
     update();
 }
 
+// Photos set afterwards are shown from the ThumbnailCache, with the default text as a placeholder until they are decoded
+void TemplateViewer::setThumbnail(bool enabled)
+{
+    thumbnail = enabled;
+}
+
 void TemplateViewer::setFormat(const QString &format)
 {
     this->format = format;
@@ -69,7 +78,11 @@ void TemplateViewer::setFormat(const QString &format)
 /*** PRIVATE ***/
 void TemplateViewer::refreshImage()
 {
-    if (file.isNull() || (format == "Photo")) {
+    if (thumbnail && !file.isNull() && (format == "Photo")) {
+        QImage image;
+        ThumbnailCache::instance()->find(file.name, image);
+        setImage(image, true);
+    } else if (file.isNull() || (format == "Photo")) {
         setImage(file, true);
     } else {
         const QString path = QString(br::Globals->scratchPath()) + "/thumbnails";
@@ -103,6 +116,13 @@ QPointF TemplateViewer::getScreenPoint(const QPointF &ip) const
                    ip.y()*pixmap()->height()/imageHeight() + (height()-pixmap()->height())/2);
 }
 
+/*** PRIVATE SLOTS ***/
+void TemplateViewer::thumbnailReady(QString name)
+{
+    if (thumbnail && (name == file.name))
+        refreshImage();
+}
+
 /*** PROTECTED SLOTS ***/
 void TemplateViewer::dragEnterEvent(QDragEnterEvent *event)
 {
@@ -28,11 +28,13 @@ public slots:
     void setEditable(bool enabled);
     void setMousePoint(const QPointF &mousePoint);
     void setFormat(const QString &format);
+    void setThumbnail(bool enabled);
 
 protected:
     File file;
     QPointF mousePoint;
     QString format;
+    bool thumbnail;
 
     bool editable;
     QList<QPointF> landmarks;
@@ -43,6 +45,9 @@ protected:
 private:
     void refreshImage();
 
+private slots:
+    void thumbnailReady(QString name);
+
 protected slots:
     void dragEnterEvent(QDragEnterEvent *event);
     void dropEvent(QDropEvent *event);
@@ -1,4 +1,5 @@
 #include "templateviewergrid.h"
+#include "thumbnailcache.h"
 
 using namespace br;
 
@@ -7,15 +8,70 @@ using namespace br;
 TemplateViewerGrid::TemplateViewerGrid(QWidget *parent)
     : QWidget(parent)
 {
+    page = 0;
     setLayout(&gridLayout);
     setFiles(FileList(16));
     setFiles(FileList(1));
 }
 
+int TemplateViewerGrid::pages() const
+{
+    return std::max(1, (files.size() + PageSize - 1) / PageSize);
+}
+
 /*** PUBLIC SLOTS ***/
 void TemplateViewerGrid::setFiles(const FileList &files)
 {
-    const int size = std::max(1, (int)ceil(sqrt((float)files.size())));
+    this->files = files;
+    page = 0;
+    showPage();
+}
+
+void TemplateViewerGrid::setFormat(const QString &format)
+{
+    foreach (const QSharedPointer<TemplateViewer> &templateViewer, templateViewers)
+        templateViewer->setFormat(format);
+}
+
+void TemplateViewerGrid::setMousePoint(const QPointF &mousePoint)
+{
+    foreach (const QSharedPointer<TemplateViewer> &templateViewer, templateViewers)
+        templateViewer->setMousePoint(mousePoint);
+}
+
+void TemplateViewerGrid::setPage(int page)
+{
+    page = std::max(0, std::min(page, pages()-1));
+    if (page == this->page) return;
+    this->page = page;
+    showPage();
+}
+
+void TemplateViewerGrid::firstPage()
+{
+    setPage(0);
+}
+
+void TemplateViewerGrid::previousPage()
+{
+    setPage(page-1);
+}
+
+void TemplateViewerGrid::nextPage()
+{
+    setPage(page+1);
+}
+
+void TemplateViewerGrid::lastPage()
+{
+    setPage(pages()-1);
+}
+
+/*** PRIVATE ***/
+void TemplateViewerGrid::showPage()
+{
+    const FileList pageFiles = files.mid(page*PageSize, PageSize);
+    const int size = std::max(1, (int)ceil(sqrt((float)pageFiles.size())));
     while (templateViewers.size() < size*size) {
         templateViewers.append(QSharedPointer<TemplateViewer>(new TemplateViewer()));
         connect(templateViewers.last().data(), SIGNAL(newInput(br::File)), this, SIGNAL(newInput(br::File)));
@@ -30,14 +86,20 @@ void TemplateViewerGrid::setFiles(const FileList &files)
             child->widget()->setVisible(false);
     }
 
+    // A single template is shown at full resolution for editing, pages of several are shown as thumbnails
+    const bool thumbnails = files.size() > 1;
     for (int i=0; i<templateViewers.size(); i++) {
         if (i < size*size) {
             gridLayout.addWidget(templateViewers[i].data(), i/size, i%size, 1, 1);
             templateViewers[i]->setVisible(true);
         }
 
-        if (i < files.size()) {
-            templateViewers[i]->setFile(files[i]);
+        templateViewers[i]->setThumbnail(thumbnails);
+        if (i < pageFiles.size()) {
+            // The name is the placeholder until the thumbnail is decoded
+            if (thumbnails)
+                templateViewers[i]->setDefaultText("<b>" + pageFiles[i].baseName() + "</b>");
+            templateViewers[i]->setFile(pageFiles[i]);
         } else {
             templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
             templateViewers[i]->setFile(QString());
@@ -45,18 +107,18 @@ void TemplateViewerGrid::setFiles(const FileList &files)
 
         templateViewers[i]->setEditable(files.size() == 1);
     }
-}
 
-void TemplateViewerGrid::setFormat(const QString &format)
-{
-    foreach (const QSharedPointer<TemplateViewer> &templateViewer, templateViewers)
-        templateViewer->setFormat(format);
-}
+    // Decode the adjacent pages in the background so flipping to them is immediate
+    QStringList adjacent;
+    foreach (const File &file, files.mid((page+1)*PageSize, PageSize))
+        adjacent.append(file.name);
+    if (page > 0)
+        foreach (const File &file, files.mid((page-1)*PageSize, PageSize))
+            adjacent.append(file.name);
+    if (thumbnails)
+        ThumbnailCache::instance()->prefetch(adjacent);
 
-void TemplateViewerGrid::setMousePoint(const QPointF &mousePoint)
-{
-    foreach (const QSharedPointer<TemplateViewer> &templateViewer, templateViewers)
-        templateViewer->setMousePoint(mousePoint);
+    emit pageChanged(page, pages());
 }
 
 #include "moc_templateviewergrid.cpp"
@@ -19,16 +19,29 @@ class BR_EXPORT TemplateViewerGrid : public QWidget
 
     QGridLayout gridLayout;
     QList< QSharedPointer<TemplateViewer> > templateViewers;
+    FileList files;
+    int page;
+
+    void showPage();
 
 public:
+    static const int PageSize = 64;
+
     explicit TemplateViewerGrid(QWidget *parent = 0);
+    int pages() const;
 
 public slots:
     void setFiles(const br::FileList &file);
     void setFormat(const QString &format);
     void setMousePoint(const QPointF &mousePoint);
+    void setPage(int page);
+    void firstPage();
+    void previousPage();
+    void nextPage();
+    void lastPage();
 
 signals:
+    void pageChanged(int page, int pages);
     void newInput(br::File);
     void newInput(QImage);
     void newMousePoint(QPointF);
@@ -0,0 +1,98 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThread>
+
+#include "thumbnailcache.h"
+
+using namespace br;
+
+/*** STATIC ***/
+struct ThumbnailTask : public QRunnable
+{
+    ThumbnailCache *cache;
+    QString file;
+
+    ThumbnailTask(ThumbnailCache *cache, const QString &file) : cache(cache), file(file) {}
+    void run() { cache->decode(file); }
+};
+
+ThumbnailCache *ThumbnailCache::instance()
+{
+    // Never deleted, decoding may still be in flight when the application exits
+    static ThumbnailCache *cache = new ThumbnailCache();
+    return cache;
+}
+
+/*** PUBLIC ***/
+bool ThumbnailCache::find(const QString &file, QImage &thumbnail)
+{
+    QMutexLocker locker(&mutex);
+    if (const QImage *cached = thumbnails.object(file)) {
+        thumbnail = *cached;
+        return true;
+    }
+    request(file, 1);
+    return false;
+}
+
+void ThumbnailCache::prefetch(const QStringList &files)
+{
+    QMutexLocker locker(&mutex);
+    foreach (const QString &file, files)
+        if (!thumbnails.contains(file))
+            request(file, 0);
+}
+
+void ThumbnailCache::decode(const QString &file)
+{
+    // Readers that support it, such as JPEG, decode directly at the reduced size
+    QImageReader reader(file);
+    const QSize size = reader.size();
+    if (size.isValid() && ((size.width() > Size) || (size.height() > Size)))
+        reader.setScaledSize(size.scaled(Size, Size, Qt::KeepAspectRatio));
+    QImage image = reader.read();
+    if (!image.isNull() && ((image.width() > Size) || (image.height() > Size)))
+        image = image.scaled(Size, Size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    {
+        QMutexLocker locker(&mutex);
+        pending.remove(file);
+        // Failures are cached as null images so they aren't decoded again
+        thumbnails.insert(file, new QImage(image), std::max(1, image.byteCount() / 1024));
+    }
+    emit ready(file);
+}
+
+/*** PRIVATE ***/
+ThumbnailCache::ThumbnailCache()
+    : thumbnails(MaxKB)
+{
+    pool.setMaxThreadCount(std::max(2, QThread::idealThreadCount() / 2));
+}
+
+void ThumbnailCache::request(const QString &file, int priority)
+{
+    if (file.isEmpty() || pending.contains(file))
+        return;
+    pending.insert(file);
+    pool.start(new ThumbnailTask(this, file), priority);
+}
+
+#include "moc_thumbnailcache.cpp"
@@ -0,0 +1,69 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_THUMBNAILCACHE_H
+#define BR_THUMBNAILCACHE_H
+
+#include <QCache>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+// Thumbnails decoded in the background and kept in a bounded least recently used cache, shared by every viewer.
+// find() returns a cached thumbnail or queues it, and ready() is emitted once it has been decoded.
+// Images are decoded at no more than Size pixels on a side, so browsing large galleries never holds the full images.
+class BR_EXPORT ThumbnailCache : public QObject
+{
+    Q_OBJECT
+    QMutex mutex;
+    QCache<QString, QImage> thumbnails; // Cost in KB
+    QSet<QString> pending;
+    QThreadPool pool;
+
+    ThumbnailCache();
+    void request(const QString &file, int priority);
+
+public:
+    static const int Size = 256;
+    static const int MaxKB = 128 * 1024;
+
+    static ThumbnailCache *instance();
+
+    // False if the thumbnail isn't cached yet, it is then decoded ahead of any prefetching.
+    // Files that can't be read are cached as null thumbnails.
+    bool find(const QString &file, QImage &thumbnail);
+
+    // Decode thumbnails likely to be viewed next, such as the adjacent pages of a gallery
+    void prefetch(const QStringList &files);
+
+    // Called from the pool
+    void decode(const QString &file);
+
+signals:
+    void ready(QString file);
+};
+
+} // namespace br
+
+#endif // BR_THUMBNAILCACHE_H
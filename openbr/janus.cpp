@@ -1,13 +1,26 @@
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QtConcurrent>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <vector>
 #include "iarpa_janus.h"
 #include "iarpa_janus_io.h"
 #include "openbr_plugin.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/common.h"
+#include "openbr/core/ivf.h"
+#include "openbr/core/metrics.h"
 using namespace br;
 
 static QSharedPointer<Transform> transform;
 static QSharedPointer<Distance> distance;
 
+static const Metrics::Histogram augmentLatency = Metrics::latency("janus_augment");
+static const Metrics::Histogram verifyLatency = Metrics::latency("janus_verify");
+static const Metrics::Histogram searchLatency = Metrics::latency("janus_search");
+
 size_t janus_max_template_size()
 {
     return 102400;// 100 KB
@@ -53,6 +66,7 @@ janus_error janus_allocate_template(janus_template *template_)
 
 janus_error janus_augment(const janus_image image, const janus_attribute_list attributes, janus_template template_)
 {
+    Metrics::Timer timer(augmentLatency);
     Template t;
     for (size_t i=0; i<attributes.size; i++)
         t.file.set(janus_attribute_to_string(attributes.attributes[i]), attributes.values[i]);
@@ -150,52 +164,158 @@ janus_error janus_free_gallery(janus_gallery gallery_) {
     return JANUS_SUCCESS;
 }
 
-janus_error janus_flatten_gallery(janus_gallery gallery, janus_flat_gallery flat_gallery, size_t *bytes)
+// Flat gallery buffers are sized for every template at its largest, with its id and length
+static size_t flat_gallery_capacity(janus_gallery gallery)
+{
+    return gallery->size() * (sizeof(janus_template_id) + sizeof(size_t) + janus_max_template_size());
+}
+
+static janus_error flatten_entries(janus_gallery gallery, janus_flat_gallery flat_gallery, size_t capacity, size_t *bytes)
 {
     *bytes = 0;
     foreach (const janus_template &t, *gallery) {
+        if (*bytes + sizeof(janus_template_id) + sizeof(size_t) > capacity)
+            return JANUS_UNKNOWN_ERROR;
         janus_template_id template_id = t->file.get<janus_template_id>("TEMPLATE_ID");
-
-        janus_flat_template u = new janus_data[janus_max_template_size()];
-        size_t t_bytes = 0;
-        JANUS_ASSERT(janus_flatten_template(t, u, &t_bytes))
         memcpy(flat_gallery, &template_id, sizeof(template_id));
         flat_gallery += sizeof(template_id);
         *bytes += sizeof(template_id);
 
+        // The template is flattened directly after its length, or first to a buffer when it might not fit
+        size_t t_bytes = 0;
+        const size_t remaining = capacity - *bytes - sizeof(t_bytes);
+        if (remaining >= janus_max_template_size()) {
+            JANUS_ASSERT(janus_flatten_template(t, flat_gallery + sizeof(t_bytes), &t_bytes))
+        } else {
+            QByteArray buffer(int(janus_max_template_size()), 0);
+            JANUS_ASSERT(janus_flatten_template(t, reinterpret_cast<janus_flat_template>(buffer.data()), &t_bytes))
+            if (t_bytes > remaining)
+                return JANUS_UNKNOWN_ERROR;
+            memcpy(flat_gallery + sizeof(t_bytes), buffer.constData(), t_bytes);
+        }
         memcpy(flat_gallery, &t_bytes, sizeof(t_bytes));
-        flat_gallery += sizeof(t_bytes);
-        *bytes += sizeof(t_bytes);
+        flat_gallery += sizeof(t_bytes) + t_bytes;
+        *bytes += sizeof(t_bytes) + t_bytes;
+    }
+    return JANUS_SUCCESS;
+}
+
+// Flat galleries may begin with an index over their entries, built when the flatIndex or ivfLists property is set.
+// Layout: the magic string, the size of the serialized header, the header, the feature block, then the usual sequence of entries.
+// The header holds the entry count and offsets, the feature stride, and an inverted file index when ivfLists is set.
+// When every entry holds a single sub-template of the same size, the feature block holds those sub-templates contiguously at that stride,
+// otherwise the stride is zero and the block is empty.
+// The prefix must fit in the buffer, sized by flat_gallery_capacity(), in addition to the entries, otherwise flattening fails.
+// Searches read nprobe when a gallery is first searched.
+static const char IndexMagic[8] = { 'B', 'R', 'I', 'D', 'X', 0, 0, 0 };
+
+// The sub-templates of a flat template, referencing its data
+static TemplateList sub_templates(const janus_flat_template flat_template, size_t bytes)
+{
+    TemplateList templates;
+    janus_flat_template sub_template = flat_template;
+    while (sub_template < flat_template + bytes) {
+        const size_t sub_template_bytes = *reinterpret_cast<const size_t*>(sub_template);
+        sub_template += sizeof(sub_template_bytes);
+        templates.append(Template(cv::Mat(1, int(sub_template_bytes), CV_8UC1, sub_template)));
+        sub_template += sub_template_bytes;
+    }
+    return templates;
+}
+
+// The first sub-template of a flat template, as seen by the quantizer
+static Template ivf_feature(const janus_flat_template flat_template, size_t bytes)
+{
+    Template t;
+    if (bytes >= sizeof(size_t)) {
+        const size_t template_bytes = *reinterpret_cast<const size_t*>(flat_template);
+        if (template_bytes > 0 && sizeof(size_t) + template_bytes <= bytes)
+            t.append(cv::Mat(1, int(template_bytes), CV_8UC1, flat_template + sizeof(size_t)));
+    }
+    return t;
+}
 
-        memcpy(flat_gallery, u, t_bytes);
-        flat_gallery += t_bytes;
-        *bytes += t_bytes;
-        delete[] u;
+janus_error janus_flatten_gallery(janus_gallery gallery, janus_flat_gallery flat_gallery, size_t *bytes)
+{
+    const size_t capacity = flat_gallery_capacity(gallery);
+    const int lists = Globals->file.get<int>("ivfLists", 0);
+    if ((lists <= 0) && !Globals->file.get<bool>("flatIndex", false))
+        return flatten_entries(gallery, flat_gallery, capacity, bytes);
+
+    // Flatten the entries in place, then shift them past the prefix once its size is known
+    size_t entries_bytes = 0;
+    JANUS_ASSERT(flatten_entries(gallery, flat_gallery, capacity, &entries_bytes))
+
+    TemplateList features;
+    QVector<qint64> offsets;
+    quint64 stride = 0;
+    bool uniform = true;
+    for (size_t offset = 0; offset < entries_bytes;) {
+        offsets.append(offset);
+        janus_data *entry = flat_gallery + offset + sizeof(janus_template_id);
+        const size_t t_bytes = *reinterpret_cast<const size_t*>(entry);
+        const Template feature = ivf_feature(entry + sizeof(size_t), t_bytes);
+        if (lists > 0)
+            features.append(feature);
+
+        // Uniform when each entry is a single sub-template of a common size
+        const size_t feature_bytes = feature.isEmpty() ? 0 : feature.first().cols;
+        if ((feature_bytes == 0) || (sizeof(size_t) + feature_bytes != t_bytes) || ((stride != 0) && (stride != feature_bytes)))
+            uniform = false;
+        stride = feature_bytes;
+        offset += sizeof(janus_template_id) + sizeof(size_t) + t_bytes;
+    }
+    if (!uniform || offsets.isEmpty())
+        stride = 0;
+
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+    stream << quint64(offsets.size()) << offsets << stride << (lists > 0);
+    if (lists > 0) {
+        InvertedIndex index;
+        index.build(features, lists);
+        index.store(stream);
     }
+
+    // The features reference the entries, release them before moving the entries
+    features.clear();
+
+    const size_t header_bytes = header.size();
+    const size_t block_offset = sizeof(IndexMagic) + sizeof(header_bytes) + header_bytes;
+    const size_t prefix_bytes = block_offset + offsets.size() * stride;
+    if (prefix_bytes + entries_bytes > capacity)
+        return JANUS_UNKNOWN_ERROR;
+    memmove(flat_gallery + prefix_bytes, flat_gallery, entries_bytes);
+    memcpy(flat_gallery, IndexMagic, sizeof(IndexMagic));
+    memcpy(flat_gallery + sizeof(IndexMagic), &header_bytes, sizeof(header_bytes));
+    memcpy(flat_gallery + sizeof(IndexMagic) + sizeof(header_bytes), header.constData(), header_bytes);
+    for (int i=0; i<int(stride ? offsets.size() : 0); i++)
+        memcpy(flat_gallery + block_offset + i*stride,
+               flat_gallery + prefix_bytes + offsets[i] + sizeof(janus_template_id) + 2*sizeof(size_t),
+               stride);
+    *bytes = prefix_bytes + entries_bytes;
     return JANUS_SUCCESS;
 }
 
 janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, const janus_flat_template b, const size_t b_bytes, float *similarity)
 {
+    Metrics::Timer timer(verifyLatency);
     *similarity = 0;
 
-    int comparisons = 0;
-    janus_flat_template a_template = a;
-    while (a_template < a + a_bytes) {
-        const size_t a_template_bytes = *reinterpret_cast<size_t*>(a_template);
-        a_template += sizeof(a_template_bytes);
-        janus_flat_template b_template = b;
-        while (b_template < b + b_bytes) {
-                const size_t b_template_bytes = *reinterpret_cast<size_t*>(b_template);
-                b_template += sizeof(b_template_bytes);
-                *similarity += distance->compare(cv::Mat(1, a_template_bytes, CV_8UC1, a_template),
-                                                 cv::Mat(1, b_template_bytes, CV_8UC1, b_template));
-                comparisons++;
-
-                b_template += b_template_bytes;
-        }
-
-        a_template += a_template_bytes;
+    const TemplateList a_templates = sub_templates(a, a_bytes);
+    const TemplateList b_templates = sub_templates(b, b_bytes);
+    const int comparisons = a_templates.size() * b_templates.size();
+
+    // Many sub-templates are compared as one batch, split across threads by the distance
+    static const int minimumBatchComparisons = 64;
+    if (comparisons >= minimumBatchComparisons) {
+        QScopedPointer<MatrixOutput> scores(MatrixOutput::make(a_templates.files(), b_templates.files()));
+        distance->compare(a_templates, b_templates, scores.data());
+        *similarity = float(cv::sum(scores->data)[0]);
+    } else {
+        foreach (const Template &a_template, a_templates)
+            foreach (const Template &b_template, b_templates)
+                *similarity += distance->compare(a_template.m(), b_template.m());
     }
 
     if (*similarity != *similarity) // True for NaN
@@ -206,41 +326,228 @@ janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, cons
     return JANUS_SUCCESS;
 }
 
-janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+typedef QPair<float, int> SearchResult;
+
+// Least similar result on top, so the heap holds the best results seen so far
+typedef std::priority_queue<SearchResult, std::vector<SearchResult>, std::greater<SearchResult> > SearchHeap;
+
+// Keeps the best requested_returns of scored entries
+static void keep_best(SearchHeap &results, const SearchResult &result, int requested_returns)
 {
-    typedef QPair<float, int> Pair;
-    QList<Pair> comparisons; comparisons.reserve(requested_returns);
-    janus_flat_gallery target_gallery = gallery;
-    while (target_gallery < gallery + gallery_bytes) {
-        janus_template_id target_id = *reinterpret_cast<janus_template_id*>(target_gallery);
-        target_gallery += sizeof(target_id);
+    if (int(results.size()) < requested_returns) {
+        results.push(result);
+    } else if (results.top().first < result.first) {
+        results.pop();
+        results.push(result);
+    }
+}
 
-        const size_t target_template_bytes = *reinterpret_cast<size_t*>(target_gallery);
-        target_gallery += sizeof(target_template_bytes);
-        janus_flat_template target_template_flat = new janus_data[target_template_bytes];
-        memcpy(target_template_flat, target_gallery, target_template_bytes);
-        target_gallery += target_template_bytes;
+// Scores gallery entries [begin, end) against the probe in place
+struct SearchTask
+{
+    janus_flat_template probe;
+    size_t probe_bytes;
+    const QVector<janus_flat_gallery> *entries;
+    int begin, end, requested_returns;
+    SearchHeap results;
+    janus_error error;
+};
+
+static void search_entries(SearchTask *task)
+{
+    task->error = JANUS_SUCCESS;
+    for (int i=task->begin; i<task->end; i++) {
+        janus_flat_gallery entry = task->entries->at(i);
+        const janus_template_id target_id = *reinterpret_cast<janus_template_id*>(entry);
+        entry += sizeof(target_id);
+        const size_t target_template_bytes = *reinterpret_cast<size_t*>(entry);
+        entry += sizeof(target_template_bytes);
 
         float similarity;
-        JANUS_ASSERT(janus_verify(probe, probe_bytes, target_template_flat, target_template_bytes, &similarity))
-        if (comparisons.size() < requested_returns) {
-            comparisons.append(Pair(similarity, target_id));
-            std::sort(comparisons.begin(), comparisons.end());
+        task->error = janus_verify(task->probe, task->probe_bytes, entry, target_template_bytes, &similarity);
+        if (task->error != JANUS_SUCCESS)
+            return;
+
+        keep_best(task->results, SearchResult(similarity, target_id), task->requested_returns);
+    }
+}
+
+struct IndexedGallery
+{
+    quint64 count, stride;
+    QVector<qint64> offsets;
+    QSharedPointer<InvertedIndex> index; // Null unless built with ivfLists
+    size_t block_offset, prefix_bytes;
+};
+
+// Parsed prefixes, keyed by a hash of the serialized header and the gallery size rather than the buffer's address,
+// which the caller may reuse for another gallery. Nothing cached references the buffer, and only a few are kept.
+static const int max_indexed_galleries = 16;
+static QMutex indexed_galleries_lock;
+static QHash<QByteArray, QSharedPointer<IndexedGallery> > indexed_galleries;
+static QList<QByteArray> indexed_galleries_order; // Oldest first
+
+// Sets indexed to the parsed prefix of the gallery, or null when it has none, fails if the prefix doesn't fit in gallery_bytes
+static janus_error indexed_gallery(const janus_flat_gallery gallery, const size_t gallery_bytes, QSharedPointer<IndexedGallery> &indexed)
+{
+    indexed.clear();
+    const size_t minimum_bytes = sizeof(IndexMagic) + sizeof(size_t);
+    if ((gallery_bytes < minimum_bytes) || memcmp(gallery, IndexMagic, sizeof(IndexMagic)))
+        return JANUS_SUCCESS;
+
+    const size_t header_bytes = *reinterpret_cast<const size_t*>(gallery + sizeof(IndexMagic));
+    if ((header_bytes > gallery_bytes - minimum_bytes) || (header_bytes > size_t(std::numeric_limits<int>::max())))
+        return JANUS_UNKNOWN_ERROR;
+    QByteArray header = QByteArray::fromRawData(reinterpret_cast<const char*>(gallery + minimum_bytes), int(header_bytes));
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(header);
+    hash.addData(reinterpret_cast<const char*>(&gallery_bytes), sizeof(gallery_bytes));
+    const QByteArray key = hash.result();
+
+    QMutexLocker locker(&indexed_galleries_lock);
+    indexed = indexed_galleries.value(key);
+    if (indexed)
+        return JANUS_SUCCESS;
+
+    QSharedPointer<IndexedGallery> parsed(new IndexedGallery());
+    QDataStream stream(&header, QIODevice::ReadOnly);
+    bool ivf;
+    stream >> parsed->count >> parsed->offsets >> parsed->stride >> ivf;
+    if ((stream.status() != QDataStream::Ok) || (parsed->count != quint64(parsed->offsets.size())))
+        return JANUS_UNKNOWN_ERROR;
+    if (ivf) {
+        parsed->index = QSharedPointer<InvertedIndex>(new InvertedIndex());
+        parsed->index->load(stream);
+        if (stream.status() != QDataStream::Ok)
+            return JANUS_UNKNOWN_ERROR;
+        parsed->index->setNProbe(Globals->file.get<int>("nprobe", 8));
+    }
+
+    // Every entry header, and the feature block, must lie within the gallery
+    parsed->block_offset = minimum_bytes + header_bytes;
+    const size_t available = gallery_bytes - parsed->block_offset;
+    if ((parsed->stride > 0) && (parsed->count > available / parsed->stride))
+        return JANUS_UNKNOWN_ERROR;
+    parsed->prefix_bytes = parsed->block_offset + parsed->count * parsed->stride;
+    const size_t entry_header_bytes = sizeof(janus_template_id) + sizeof(size_t);
+    foreach (qint64 offset, parsed->offsets)
+        if ((offset < 0) || (entry_header_bytes > gallery_bytes - parsed->prefix_bytes) ||
+            (quint64(offset) > gallery_bytes - parsed->prefix_bytes - entry_header_bytes))
+            return JANUS_UNKNOWN_ERROR;
+
+    if (indexed_galleries_order.size() >= max_indexed_galleries)
+        indexed_galleries.remove(indexed_galleries_order.takeFirst());
+    indexed_galleries.insert(key, parsed);
+    indexed_galleries_order.append(key);
+    indexed = parsed;
+    return JANUS_SUCCESS;
+}
+
+// Scores a single sub-template probe against the fixed-stride feature block with the distance's batched comparison
+static janus_error search_features(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const IndexedGallery &indexed,
+                                   const QVector<int> &candidates, int requested_returns, SearchHeap &results)
+{
+    // The feature block of this gallery, at the parsed stride
+    TemplateList targets;
+    targets.reserve(candidates.size());
+    foreach (int i, candidates)
+        targets.append(Template(cv::Mat(1, int(indexed.stride), CV_8UC1, gallery + indexed.block_offset + i*indexed.stride)));
+    const TemplateList queries = sub_templates(probe, probe_bytes);
+
+    QScopedPointer<MatrixOutput> scores(MatrixOutput::make(targets.files(), queries.files()));
+    distance->compare(targets, queries, scores.data());
+
+    const float *similarities = scores->data.ptr<float>(0);
+    for (int i=0; i<candidates.size(); i++) {
+        if (similarities[i] != similarities[i]) // True for NaN
+            return JANUS_UNKNOWN_ERROR;
+        const janus_template_id target_id = *reinterpret_cast<const janus_template_id*>(gallery + indexed.prefix_bytes + indexed.offsets[candidates[i]]);
+        keep_best(results, SearchResult(similarities[i], target_id), requested_returns);
+    }
+    return JANUS_SUCCESS;
+}
+
+janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+{
+    Metrics::Timer timer(searchLatency);
+    *actual_returns = 0;
+    if (requested_returns <= 0)
+        return JANUS_SUCCESS;
+
+    QSharedPointer<IndexedGallery> indexed;
+    JANUS_ASSERT(indexed_gallery(gallery, gallery_bytes, indexed))
+    QVector<int> candidates;
+    if (indexed) {
+        if (indexed->index) {
+            // Only search the entries in the lists nearest the probe
+            candidates = indexed->index->candidates(ivf_feature(probe, probe_bytes));
+            foreach (int i, candidates)
+                if ((i < 0) || (quint64(i) >= indexed->count))
+                    return JANUS_UNKNOWN_ERROR;
         } else {
-            Pair temp = comparisons.first();
-            if (temp.first < similarity) {
-                comparisons.removeFirst();
-                comparisons.append(Pair(similarity, target_id));
-                std::sort(comparisons.begin(), comparisons.end());
+            candidates.resize(int(indexed->count));
+            for (int i=0; i<candidates.size(); i++)
+                candidates[i] = i;
+        }
+    }
+
+    QList<SearchResult> comparisons;
+    if (indexed && indexed->stride && (sub_templates(probe, probe_bytes).size() == 1)) {
+        SearchHeap results;
+        JANUS_ASSERT(search_features(probe, probe_bytes, gallery, *indexed, candidates, requested_returns, results))
+        while (!results.empty()) {
+            comparisons.append(results.top());
+            results.pop();
+        }
+    } else {
+        // Entries are scored where they lie in the flat gallery
+        QVector<janus_flat_gallery> entries;
+        if (indexed) {
+            foreach (int i, candidates)
+                entries.append(gallery + indexed->prefix_bytes + indexed->offsets[i]);
+        } else {
+            janus_flat_gallery target_gallery = gallery;
+            while (target_gallery < gallery + gallery_bytes) {
+                entries.append(target_gallery);
+                target_gallery += sizeof(janus_template_id);
+                const size_t target_template_bytes = *reinterpret_cast<size_t*>(target_gallery);
+                target_gallery += sizeof(target_template_bytes) + target_template_bytes;
+            }
+        }
+
+        // Split the entries across threads, each keeping its own bounded heap
+        static const int minimumEntriesPerTask = 256;
+        const int taskCount = std::max(1, std::min(std::max(1, abs(Globals->parallelism)), entries.size() / minimumEntriesPerTask));
+        QVector<SearchTask> tasks(taskCount);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<taskCount; i++) {
+            SearchTask &task = tasks[i];
+            task.probe = probe;
+            task.probe_bytes = probe_bytes;
+            task.entries = &entries;
+            task.begin = entries.size() * i / taskCount;
+            task.end = entries.size() * (i+1) / taskCount;
+            task.requested_returns = requested_returns;
+            if (taskCount > 1) futures.addFuture(QtConcurrent::run(search_entries, &task));
+            else               search_entries(&task);
+        }
+        futures.waitForFinished();
+
+        for (int i=0; i<taskCount; i++) {
+            JANUS_ASSERT(tasks[i].error)
+            while (!tasks[i].results.empty()) {
+                comparisons.append(tasks[i].results.top());
+                tasks[i].results.pop();
             }
         }
-        delete[] target_template_flat;
     }
+
+    std::sort(comparisons.begin(), comparisons.end(), std::greater<SearchResult>());
+    comparisons = comparisons.mid(0, requested_returns);
+
     *actual_returns = comparisons.size();
-    QList<Pair> temp; temp.reserve(comparisons.size());
-    std::reverse_copy(comparisons.begin(), comparisons.end(), std::back_inserter(temp));
-    comparisons = temp;
-    foreach(const Pair &comparison, comparisons) {
+    foreach(const SearchResult &comparison, comparisons) {
         *similarities = comparison.first; similarities++;
         *template_ids = comparison.second; template_ids++;
     }
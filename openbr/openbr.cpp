@@ -14,13 +14,17 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QSemaphore>
+#include <QThreadPool>
 #include <openbr/openbr_plugin.h>
 
 #include "core/bee.h"
 #include "core/cluster.h"
 #include "core/eval.h"
 #include "core/fuse.h"
+#include "core/metrics.h"
 #include "core/plot.h"
+#include "core/profiler.h"
 #include "core/qtutils.h"
 #include "plugins/openbr_internal.h"
 #include <opencv2/highgui/highgui.hpp>
@@ -173,6 +177,13 @@ bool br_is_classifier(const char *algorithm)
     return IsClassifier(algorithm);
 }
 
+float br_latency(const char *call, float quantile)
+{
+    // Looked up rather than registered, so unknown names don't add metrics
+    const Metrics::Histogram histogram = Metrics::Histogram::find(Metrics::latencyName(call));
+    return histogram.count() == 0 ? -1 : histogram.quantile(quantile);
+}
+
 void br_make_mask(const char *target_input, const char *query_input, const char *mask)
 {
     BEE::makeMask(target_input, query_input, mask);
@@ -305,6 +316,7 @@ const char *br_version()
 
 void br_slave_process(const char *baseName)
 {
+    Profiler::nameThread("br-process");
     WorkerProcess *worker = new WorkerProcess;
     worker->transform = Globals->algorithm;
     worker->baseName = baseName;
@@ -326,6 +338,19 @@ unsigned char *br_unload_img(br_template tmpl)
     return t->m().data;
 }
 
+br_template br_load_encoded_view(const char *data, int len)
+{
+    // OpenTransform decodes single row 8-bit matrices
+    Template *tmpl = new Template(cv::Mat(1, len, CV_8UC1, (void*) data));
+    return (br_template)tmpl;
+}
+
+br_template br_load_pixels_view(unsigned char *data, int rows, int cols, int channels, int step)
+{
+    Template *tmpl = new Template(cv::Mat(rows, cols, CV_8UC(channels), data, step));
+    return (br_template)tmpl;
+}
+
 br_template_list br_template_list_from_buffer(const char *buf, int len)
 {
     QByteArray arr(buf, len);
@@ -394,8 +419,12 @@ int br_get_metadata_string(char *buffer, int buffer_length, br_template tmpl, co
     return partialCopy(QtUtils::toString(qvar), buffer, buffer_length);
 }
 
+static const Metrics::Histogram enrollTemplateLatency = Metrics::latency("br_enroll_template");
+static const Metrics::Histogram enrollTemplateListLatency = Metrics::latency("br_enroll_template_list");
+
 br_template_list br_enroll_template(br_template tmpl)
 {
+    Metrics::Timer timer(enrollTemplateLatency);
     Template *t = reinterpret_cast<Template*>(tmpl);
     TemplateList *tl = new TemplateList();
     tl->append(*t);
@@ -405,10 +434,85 @@ br_template_list br_enroll_template(br_template tmpl)
 
 void br_enroll_template_list(br_template_list tl)
 {
+    Metrics::Timer timer(enrollTemplateListLatency);
     TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
     Enroll(*realTL);
 }
 
+namespace {
+
+// Enrollment with its own thread pool, see br_make_enroller
+struct Enroller
+{
+    QSharedPointer<Transform> transform;
+    QThreadPool pool;
+    int parallelism;
+};
+
+class EnrollTask : public QRunnable
+{
+    const Transform *transform;
+    const TemplateList *src;
+    TemplateList *dst;
+    QSemaphore *done;
+
+public:
+    EnrollTask(const Transform *transform, const TemplateList *src, TemplateList *dst, QSemaphore *done)
+        : transform(transform), src(src), dst(dst), done(done) {}
+
+    void run()
+    {
+        Profiler::nameThread("br-enroll");
+        // Parallelism is bounded by the handle's pool rather than br::Context::parallelism
+        const bool serial = Transform::setSerialProjection(true);
+        transform->project(*src, *dst);
+        Transform::setSerialProjection(serial);
+        done->release();
+    }
+};
+
+} // namespace
+
+br_enroller br_make_enroller(const char *algorithm, int parallelism)
+{
+    Enroller *enroller = new Enroller();
+    enroller->transform = Transform::fromAlgorithm(algorithm);
+    enroller->parallelism = std::max(1, parallelism);
+    enroller->pool.setMaxThreadCount(std::max(1, enroller->parallelism - 1));
+    return (br_enroller)enroller;
+}
+
+void br_enroller_enroll(br_enroller enroller, br_template_list tl)
+{
+    Enroller *realEnroller = reinterpret_cast<Enroller*>(enroller);
+    TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
+
+    // Contiguous chunks, the last of which is enrolled on the calling thread
+    const int chunks = std::min(realEnroller->parallelism, std::max(1, realTL->size()));
+    QList<TemplateList> src, dst;
+    for (int i=0; i<chunks; i++) {
+        const int begin = realTL->size() * qint64(i) / chunks;
+        const int end = realTL->size() * qint64(i+1) / chunks;
+        src.append(realTL->mid(begin, end-begin));
+        dst.append(TemplateList());
+    }
+
+    QSemaphore done;
+    for (int i=0; i<chunks-1; i++)
+        realEnroller->pool.start(new EnrollTask(realEnroller->transform.data(), &src[i], &dst[i], &done));
+    EnrollTask(realEnroller->transform.data(), &src.last(), &dst.last(), &done).run();
+    done.acquire(chunks);
+
+    realTL->clear();
+    foreach (const TemplateList &enrolled, dst)
+        realTL->append(enrolled);
+}
+
+void br_free_enroller(br_enroller enroller)
+{
+    delete reinterpret_cast<Enroller*>(enroller);
+}
+
 br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query)
 {
     TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
@@ -424,6 +528,37 @@ float br_get_matrix_output_at(br_matrix_output output, int row, int col)
     return matOut->data.at<float>(row, col);
 }
 
+const float *br_get_matrix_output_data(br_matrix_output output, int *rows, int *cols, int *stride)
+{
+    MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
+    *rows = matOut->data.rows;
+    *cols = matOut->data.cols;
+    *stride = matOut->data.step1();
+    return matOut->data.ptr<float>();
+}
+
+void br_compare_template_lists_into(br_template_list target, br_template_list query, float *scores, int stride)
+{
+    TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
+    TemplateList *queryTL = reinterpret_cast<TemplateList*>(query);
+    QScopedPointer<MatrixOutput> output(MatrixOutput::make(targetTL->files(), queryTL->files()));
+    output->data = cv::Mat(queryTL->size(), targetTL->size(), CV_32FC1, scores, stride * sizeof(float));
+    CompareTemplateLists(*targetTL, *queryTL, output.data());
+}
+
+const unsigned char *br_get_matrix_view(br_template tmpl, int index, int *rows, int *cols, int *type, int *step)
+{
+    Template *t = reinterpret_cast<Template*>(tmpl);
+    if ((index < 0) || (index >= t->size()))
+        return NULL;
+    const cv::Mat &m = t->at(index);
+    *rows = m.rows;
+    *cols = m.cols;
+    *type = m.type();
+    *step = m.step;
+    return m.data;
+}
+
 br_template br_get_template(br_template_list tl, int index)
 {
     TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
@@ -474,3 +609,16 @@ void br_deduplicate(const char *input_gallery, const char *output_gallery, const
 {
     br::Deduplicate(input_gallery, output_gallery, threshold);
 }
+
+void br_benchmark(const char *input_gallery, const char *json, const char *parallelism)
+{
+    QList<int> parallelisms;
+    foreach (const QString &value, QString(parallelism).split(',', QString::SkipEmptyParts))
+        parallelisms.append(value.toInt());
+    br::Benchmark(input_gallery, json, parallelisms);
+}
+
+void br_serve(const char *gallery, int port)
+{
+    br::Serve(gallery, port);
+}
@@ -74,12 +74,31 @@ BR_EXPORT void br_cat(int num_input_galleries, const char *input_galleries[], co
  * \param input_gallery Gallery to be deduplicated.
  * \param output_gallery Deduplicated gallery.
  * \param threshold Comparisons with a match score >= this value are designated to be duplicates.
- * \note If a gallery contains n duplicates, the first n-1 duplicates in the gallery will be removed and the nth will be kept.
+ * \note Duplicates are grouped transitively, the last template of each group is kept and the rest are removed.
+ * \note Comparisons are made in parallel blocks keeping only the duplicate pairs. With a \c k argument, e.g. <tt>faces.gal[k=10]</tt>, only the \c k nearest neighbors of each template found with br::HNSWIndex are compared.
  * \note Users are encouraged to use binary gallery formats as the entire gallery is read into memory in one call to Gallery::read.
  */
 
 BR_EXPORT void br_deduplicate(const char *input_gallery, const char *output_gallery, const char *threshold);
 
+/*!
+ * \brief Benchmarks enrollment, comparison and search throughput of the current algorithm.
+ * \param input_gallery Templates to enroll.
+ * \param json Optional file to write the JSON report to, printed to \c stdout by default.
+ * \param parallelism Optional comma separated list of parallelism values to benchmark.
+ * \see br::Benchmark
+ */
+BR_EXPORT void br_benchmark(const char *input_gallery, const char *json = "", const char *parallelism = "");
+
+/*!
+ * \brief Serves enrollment, verification and search of the current algorithm over HTTP.
+ * \param gallery Optional gallery to verify and search against.
+ * \param port Port to listen on.
+ * \note Requires building with \c BR_WITH_MONGOOSE.
+ * \see br::Serve
+ */
+BR_EXPORT void br_serve(const char *gallery = "", int port = 8080);
+
 /*!
  * \brief Clusters one or more similarity matrices into a list of subjects.
  *
@@ -88,6 +107,8 @@ BR_EXPORT void br_deduplicate(const char *input_gallery, const char *output_gall
  * \param simmats Array of \ref simmat composing one large self-similarity matrix arranged in row major order.
  * \param aggressiveness The higher the aggressiveness the larger the clusters. Suggested range is [0,10].
  * \param csv The cluster results file to generate. Results are stored one row per cluster and use gallery indices.
+ * \note Sparse <tt>.smtx</tt> matrices, e.g. from <tt>-compare ... scores.smtx[threshold=0.5,k=50]</tt>, are clustered without expanding them.
+ * \note A single enrolled gallery with a \c recall target, e.g. <tt>-algorithm FaceRecognition -cluster faces.gal[recall=0.95,k=20] 5 clusters.csv</tt>, is clustered from an approximate k-NN graph searched with br::HNSWIndex instead of a similarity matrix.
  */
 BR_EXPORT void br_cluster(int num_simmats, const char *simmats[], float aggressiveness, const char *csv);
 
@@ -156,6 +177,11 @@ BR_EXPORT void br_project(const char *input, const char *output);
  * \param csv Optional \c .csv file to contain performance metrics.
  * \param matches Optional integer number of matches to output around the EER, defualts to 0.
  * \return True accept rate at a false accept rate of one in one thousand.
+ * \note Setting \c bins on \em csv, e.g. <tt>results.csv[bins=65536]</tt>, evaluates a <tt>.mtx</tt> \em simmat a block of rows
+ *       at a time against score histograms of that many bins, keeping memory nearly constant at any matrix size. Scores are
+ *       then resolved to the bin width and \em matches is ignored.
+ * \note Setting \c points on \em csv, e.g. <tt>results.csv[points=100]</tt>, caps the rows written per curve and score
+ *       distribution, 500 by default.
  * \see br_plot
  */
 BR_EXPORT float br_eval(const char *simmat, const char *mask, const char *csv = "", int matches = 0);
@@ -268,11 +294,21 @@ BR_EXPORT void br_initialize_default();
  */
 BR_EXPORT bool br_is_classifier(const char *algorithm);
 
+/*!
+ * \brief Latency of a C API or Janus call in microseconds at a quantile.
+ * \param call Name of the timed function: \c br_enroll_template, \c br_enroll_template_list, \c janus_augment, \c janus_verify or \c janus_search.
+ * \param quantile Fraction of calls at most as slow as the result, e.g. \c 0.99.
+ * \return \c -1 if no calls to \em call were timed.
+ * \note Calls are only timed while br::Context::latency is set, e.g. <tt>br_set_property("latency", "latency.csv")</tt>.
+ */
+BR_EXPORT float br_latency(const char *call, float quantile);
+
 /*!
  * \brief Constructs a \ref mask from target and query inputs.
  * \param target_input The target br::Input.
  * \param query_input The query br::Input.
  * \param mask The file to contain the resulting \ref mask.
+ * \note Append <tt>[packed]</tt> to \c mask to store two bits per comparison instead of one byte.
  * \see br_combine_masks
  */
 BR_EXPORT void br_make_mask(const char *target_input, const char *query_input, const char *mask);
@@ -335,6 +371,8 @@ BR_EXPORT int br_objects(char * buffer, int buffer_length, const char *abstracti
  * \return Returns \c true on success. Returns false on a failure to compile the figures due to a missing, out of date, or incomplete \c R installation.
  * \note This function requires a current <a href="http://www.r-project.org/">R</a> installation with the following packages:
  * \code install.packages(c("ggplot2", "gplots", "reshape", "scales", "jpg", "png")) \endcode
+ * \note The \em files are merged into a single <i>destination</i>.data.csv read once by R. Setting \c points on \em destination,
+ *       e.g. <tt>report.pdf[points=50]</tt>, thins each curve of each file to that many evenly spaced rows.
  * \see br_eval
  */
 BR_EXPORT bool br_plot(int num_files, const char *files[], const char *destination, bool show = false);
@@ -487,6 +525,7 @@ typedef void* br_template;
 typedef void* br_template_list;
 typedef void* br_gallery;
 typedef void* br_matrix_output;
+typedef void* br_enroller;
 /*!
   * \brief Load an image from a string buffer.
   *   Easy way to pass an image in memory from another programming language to openbr.
@@ -501,6 +540,24 @@ BR_EXPORT br_template br_load_img(const char *data, int len);
   * \param tmpl Pointer to a br::Template.
   */
 BR_EXPORT unsigned char* br_unload_img(br_template tmpl);
+/*!
+  * \brief Wrap a caller-owned encoded image buffer in a br::Template without copying it.
+  *   The image is decoded during enrollment, the buffer must outlive the template.
+  * \param data The encoded image buffer.
+  * \param len The length of the buffer.
+  * \see br_load_img
+  */
+BR_EXPORT br_template br_load_encoded_view(const char *data, int len);
+/*!
+  * \brief Wrap caller-owned 8-bit pixels in a br::Template without copying them.
+  *   The buffer must outlive the template.
+  * \param data The first pixel.
+  * \param rows The number of rows.
+  * \param cols The number of columns.
+  * \param channels The number of interleaved channels, in BGR order for color images.
+  * \param step The number of bytes between the start of consecutive rows.
+  */
+BR_EXPORT br_template br_load_pixels_view(unsigned char *data, int rows, int cols, int channels, int step);
 /*!
   * \brief Deserialize a br::TemplateList from a buffer.
   *        Can be the buffer for a .gal file,
@@ -562,6 +619,24 @@ BR_EXPORT br_template_list br_enroll_template(br_template tmpl);
   * \param tl Pointer to a br::TemplateList.
   */
 BR_EXPORT void br_enroll_template_list(br_template_list tl);
+/*!
+  * \brief Make a reentrant enrollment handle for an algorithm.
+  *   Enrollment with the handle doesn't use br::Context::parallelism, so applications can call br_enroller_enroll concurrently from their own threads.
+  * \param algorithm The algorithm to enroll with.
+  * \param parallelism Threads used by each br_enroller_enroll call, including the calling thread. Values below two enroll on the calling thread only.
+  * \see br_free_enroller
+  */
+BR_EXPORT br_enroller br_make_enroller(const char *algorithm, int parallelism);
+/*!
+  * \brief Enroll a br::TemplateList in place with an enrollment handle, safe to call from any thread.
+  * \param enroller The enrollment handle.
+  * \param tl Pointer to a br::TemplateList.
+  */
+BR_EXPORT void br_enroller_enroll(br_enroller enroller, br_template_list tl);
+/*!
+  * \brief Free an enrollment handle, waiting for its threads to finish.
+  */
+BR_EXPORT void br_free_enroller(br_enroller enroller);
 /*!
   * \brief Compare br::TemplateLists from the C API!
   * \return Pointer to a br::MatrixOutput.
@@ -571,6 +646,32 @@ BR_EXPORT br_matrix_output br_compare_template_lists(br_template_list target, br
   * \brief Get a value in the br::MatrixOutput.
   */
 BR_EXPORT float br_get_matrix_output_at(br_matrix_output output, int row, int col);
+/*!
+  * \brief Get a view of every score in the br::MatrixOutput, valid until it is freed.
+  * \param output Pointer to a br::MatrixOutput.
+  * \param rows Set to the number of queries.
+  * \param cols Set to the number of targets.
+  * \param stride Set to the number of floats between the start of consecutive rows.
+  */
+BR_EXPORT const float *br_get_matrix_output_data(br_matrix_output output, int *rows, int *cols, int *stride);
+/*!
+  * \brief Compare br::TemplateLists from the C API, writing scores directly into a caller-provided buffer.
+  * \param scores Buffer of at least <tt>(queries-1)*stride + targets</tt> floats, row \c i holds the scores of query \c i.
+  * \param stride The number of floats between the start of consecutive rows, at least the number of targets.
+  * \see br_compare_template_lists
+  */
+BR_EXPORT void br_compare_template_lists_into(br_template_list target, br_template_list query, float *scores, int stride);
+/*!
+  * \brief Get a view of a matrix in a br::Template, such as an enrolled feature vector, valid until the template is freed.
+  * \param tmpl Pointer to a br::Template.
+  * \param index Index of the matrix in the template.
+  * \param rows Set to the number of rows.
+  * \param cols Set to the number of columns.
+  * \param type Set to the OpenCV type of the elements, e.g. \c CV_32FC1.
+  * \param step Set to the number of bytes between the start of consecutive rows.
+  * \return Pointer to the first element, or \c NULL if \c index is out of range.
+  */
+BR_EXPORT const unsigned char *br_get_matrix_view(br_template tmpl, int index, int *rows, int *cols, int *type, int *step);
 /*!
   * \brief Get a pointer to a br::Template at a specified index.
   * \param tl Pointer to a br::TemplateList.
@@ -14,20 +14,25 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QBuffer>
 #include <QCoreApplication>
 #include <QCryptographicHash>
-#include <QFutureSynchronizer>
+#include <QElapsedTimer>
 #include <QLocalSocket>
 #include <QMetaProperty>
 #include <qnumeric.h>
 #include <QPointF>
 #include <QProcess>
 #include <QRect>
+#include <QReadWriteLock>
 #include <QRegExp>
 #include <QThreadPool>
-#include <QtConcurrentRun>
+#include <QThreadStorage>
 #include <algorithm>
 #include <iostream>
+#ifdef __linux__
+#include <unistd.h>
+#endif // __linux__
 
 #ifndef BR_EMBEDDED
 #include <QApplication>
@@ -35,10 +40,16 @@
 
 #include "openbr_plugin.h"
 #include "version.h"
+#include "core/arena.h"
 #include "core/bee.h"
 #include "core/common.h"
+#include "core/memory.h"
+#include "core/metrics.h"
 #include "core/opencvutils.h"
+#include "core/profiler.h"
 #include "core/qtutils.h"
+#include "core/scheduler.h"
+#include "core/templatecodec.h"
 #include "openbr/plugins/openbr_internal.h"
 
 using namespace br;
@@ -56,6 +67,182 @@ static const QMetaObject *getInterface(const QObject *obj)
     return baseClass;
 }
 
+/* MetadataKey - public methods */
+struct MetadataKeys
+{
+    QReadWriteLock lock;
+    QHash<QString, int> atoms;
+    QVector<QString> names;
+};
+
+static MetadataKeys &metadataKeys()
+{
+    static MetadataKeys keys;
+    return keys;
+}
+
+int MetadataKey::intern(const QString &key)
+{
+    MetadataKeys &keys = metadataKeys();
+    {
+        QReadLocker locker(&keys.lock);
+        QHash<QString, int>::const_iterator it = keys.atoms.constFind(key);
+        if (it != keys.atoms.constEnd())
+            return it.value();
+    }
+
+    QWriteLocker locker(&keys.lock);
+    QHash<QString, int>::const_iterator it = keys.atoms.constFind(key);
+    if (it != keys.atoms.constEnd())
+        return it.value();
+    const int atom = keys.names.size();
+    keys.names.append(key);
+    keys.atoms.insert(key, atom);
+    return atom;
+}
+
+int MetadataKey::find(const QString &key)
+{
+    MetadataKeys &keys = metadataKeys();
+    QReadLocker locker(&keys.lock);
+    return keys.atoms.value(key, -1);
+}
+
+QString MetadataKey::name(int atom)
+{
+    MetadataKeys &keys = metadataKeys();
+    QReadLocker locker(&keys.lock);
+    return keys.names.value(atom);
+}
+
+/* FileMetadata - public methods */
+FileMetadata::FileMetadata(const QVariantMap &map)
+    : digest(0)
+{
+    entries.reserve(map.size());
+    for (QVariantMap::const_iterator it = map.begin(); it != map.end(); ++it)
+        insert(it.key(), it.value());
+}
+
+QStringList FileMetadata::keys() const
+{
+    QStringList keys;
+    keys.reserve(entries.size());
+    foreach (const Entry &entry, entries)
+        keys.append(MetadataKey::name(entry.first));
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+QVariantMap FileMetadata::toMap() const
+{
+    QVariantMap map;
+    foreach (const Entry &entry, entries)
+        map.insert(MetadataKey::name(entry.first), entry.second);
+    return map;
+}
+
+// 64-bit FNV-1a
+static quint64 fnv1a(const void *data, size_t size, quint64 hash = Q_UINT64_C(14695981039346656037))
+{
+    const uchar *bytes = static_cast<const uchar*>(data);
+    for (size_t i=0; i<size; i++)
+        hash = (hash ^ bytes[i]) * Q_UINT64_C(1099511628211);
+    return hash;
+}
+
+// Computed from the key names and the same value strings as File::flat(), rather than atoms, so fingerprints are stable across processes
+quint64 FileMetadata::fingerprint() const
+{
+    const quint64 cached = digest.load();
+    if (cached)
+        return cached;
+
+    QStringList items;
+    items.reserve(entries.size());
+    foreach (const Entry &entry, entries) {
+        const QString key = MetadataKey::name(entry.first);
+        items.append(entry.second.isNull() ? key : key + "=" + QtUtils::toString(entry.second));
+    }
+    std::sort(items.begin(), items.end());
+
+    quint64 hash = fnv1a("[", 1);
+    foreach (const QString &item, items) {
+        const QByteArray utf8 = item.toUtf8();
+        hash = fnv1a(utf8.constData(), utf8.size(), fnv1a(", ", 2, hash));
+    }
+    if (!hash) hash = 1;
+    digest.store(hash);
+    return hash;
+}
+
+/* FileMetadata - private methods */
+static bool entryAtomLess(const QPair<int, QVariant> &entry, int atom)
+{
+    return entry.first < atom;
+}
+
+int FileMetadata::indexOf(int atom) const
+{
+    if (atom < 0)
+        return -1;
+    QVector<Entry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), atom, entryAtomLess);
+    return ((it != entries.end()) && (it->first == atom)) ? int(it - entries.begin()) : -1;
+}
+
+QVariant FileMetadata::value(int atom) const
+{
+    const int index = indexOf(atom);
+    return (index >= 0) ? entries[index].second : QVariant();
+}
+
+void FileMetadata::insert(int atom, const QVariant &value)
+{
+    QVector<Entry>::iterator it = std::lower_bound(entries.begin(), entries.end(), atom, entryAtomLess);
+    if ((it != entries.end()) && (it->first == atom)) it->second = value;
+    else                                              entries.insert(it, Entry(atom, value));
+    digest.store(0);
+}
+
+void FileMetadata::remove(int atom)
+{
+    const int index = indexOf(atom);
+    if (index >= 0) {
+        entries.remove(index);
+        digest.store(0);
+    }
+}
+
+/* FileMetadata - global methods */
+// Matches the QDataStream format of QVariantMap, so galleries written before the table remain readable
+QDataStream &br::operator<<(QDataStream &stream, const FileMetadata &metadata)
+{
+    stream << quint32(metadata.entries.size());
+    for (int i=metadata.entries.size()-1; i>=0; i--)
+        stream << MetadataKey::name(metadata.entries[i].first) << metadata.entries[i].second;
+    return stream;
+}
+
+QDataStream &br::operator>>(QDataStream &stream, FileMetadata &metadata)
+{
+    metadata.entries.clear();
+    metadata.digest.store(0);
+    quint32 size;
+    stream >> size;
+    metadata.entries.reserve(size);
+    for (quint32 i=0; i<size; i++) {
+        QString key;
+        QVariant value;
+        stream >> key >> value;
+        if (stream.status() != QDataStream::Ok) {
+            metadata.entries.clear();
+            break;
+        }
+        metadata.insert(key, value);
+    }
+    return stream;
+}
+
 /* File - public methods */
 // Note that the convention for displaying metadata is as follows:
 // [] for lists in which argument order does not matter (e.g. [FTO=false, Index=0]),
@@ -80,10 +267,16 @@ QString File::hash() const
     return QtUtils::shortTextHash(flat());
 }
 
+quint64 File::fingerprint() const
+{
+    const QByteArray utf8 = name.toUtf8();
+    return fnv1a(utf8.constData(), utf8.size(), m_metadata.fingerprint());
+}
+
 void File::append(const QVariantMap &metadata)
 {
-    foreach (const QString &key, metadata.keys())
-        set(key, metadata[key]);
+    for (QVariantMap::const_iterator it = metadata.begin(); it != metadata.end(); ++it)
+        set(it.key(), it.value());
 }
 
 void File::append(const File &other)
@@ -96,7 +289,7 @@ void File::append(const File &other)
             name += value("separator").toString() + other.name;
         }
     }
-    append(other.m_metadata);
+    append(other.localMetadata());
     fte = fte | other.fte;
 }
 
@@ -112,7 +305,7 @@ QList<File> File::split(const QString &separator) const
     QList<File> files;
     foreach (const QString &word, name.split(separator, QString::SkipEmptyParts)) {
         File file(word);
-        file.append(m_metadata);
+        file.append(localMetadata());
         files.append(file);
     }
     return files;
@@ -148,7 +341,9 @@ bool File::contains(const QStringList &keys) const
 
 QVariant File::value(const QString &key) const
 {
-    return m_metadata.contains(key) ? m_metadata.value(key) : (key == "name" ? name : Globals->property(qPrintable(key)));
+    MetadataKey atom;
+    atom.atom = MetadataKey::find(key);
+    return m_metadata.contains(atom) ? m_metadata.value(atom) : (key == "name" ? name : Globals->property(qPrintable(key)));
 }
 
 QVariant File::parse(const QString &value)
@@ -185,11 +380,14 @@ bool File::getBool(const QString &key, bool defaultValue) const
     return variant.value<bool>();
 }
 
+static const MetadataKey PointsKey("Points");
+static const MetadataKey RectsKey("Rects");
+
 QList<QPointF> File::namedPoints() const
 {
     QList<QPointF> landmarks;
-    foreach (const QString &key, localMetadata().keys()) {
-        const QVariant &variant = m_metadata[key];
+    foreach (const QString &key, localKeys()) {
+        const QVariant variant = m_metadata.value(key);
         if (variant.canConvert<QPointF>()) {
             const QPointF point = variant.value<QPointF>();
             if (!qIsNaN(point.x()) && !qIsNaN(point.y()))
@@ -202,31 +400,31 @@ QList<QPointF> File::namedPoints() const
 QList<QPointF> File::points() const
 {
     QList<QPointF> points;
-    foreach (const QVariant &point, m_metadata["Points"].toList())
+    foreach (const QVariant &point, m_metadata.value(PointsKey).toList())
         points.append(point.toPointF());
     return points;
 }
 
 void File::appendPoint(const QPointF &point)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QList<QVariant> newPoints = m_metadata.value(PointsKey).toList();
     newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    m_metadata.insert(PointsKey, newPoints);
 }
 
 void File::appendPoints(const QList<QPointF> &points)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QList<QVariant> newPoints = m_metadata.value(PointsKey).toList();
     foreach (const QPointF &point, points)
         newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    m_metadata.insert(PointsKey, newPoints);
 }
 
 QList<QRectF> File::namedRects() const
 {
     QList<QRectF> rects;
-    foreach (const QString &key, localMetadata().keys()) {
-        const QVariant &variant = m_metadata[key];
+    foreach (const QString &key, localKeys()) {
+        const QVariant variant = m_metadata.value(key);
         if (variant.canConvert<QRectF>())
             rects.append(variant.value<QRectF>());
         else if (variant.canConvert<QList<QRectF> >()) {
@@ -243,16 +441,16 @@ QList<QRectF> File::namedRects() const
 QList<QRectF> File::rects() const
 {
     QList<QRectF> rects;
-    foreach (const QVariant &rect, m_metadata["Rects"].toList())
+    foreach (const QVariant &rect, m_metadata.value(RectsKey).toList())
         rects.append(rect.toRect());
     return rects;
 }
 
 void File::appendRect(const QRectF &rect)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QList<QVariant> newRects = m_metadata.value(RectsKey).toList();
     newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    m_metadata.insert(RectsKey, newRects);
 }
 
 void File::appendRect(const cv::Rect &rect)
@@ -262,10 +460,10 @@ void File::appendRect(const cv::Rect &rect)
 
 void File::appendRects(const QList<QRectF> &rects)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QList<QVariant> newRects = m_metadata.value(RectsKey).toList();
     foreach (const QRectF &rect, rects)
         newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    m_metadata.insert(RectsKey, newRects);
 }
 
 void File::appendRects(const QList<cv::Rect> &rects)
@@ -397,6 +595,14 @@ int FileList::failures() const
     return failures;
 }
 
+/* Template - public methods */
+Template Template::clone() const
+{
+    Template other(file);
+    foreach (const cv::Mat &m, *this) other += MatArena::clone(m);
+    return other;
+}
+
 /* Template - global methods */
 QDataStream &br::operator<<(QDataStream &stream, const Template &t)
 {
@@ -452,6 +658,18 @@ TemplateList TemplateList::fromGallery(const br::File &gallery)
 TemplateList TemplateList::fromBuffer(const QByteArray &buffer)
 {
     TemplateList templateList;
+    if (TemplateCodec::isHeader(buffer)) {
+        QBuffer device;
+        device.setData(buffer);
+        device.open(QBuffer::ReadOnly);
+        device.seek(TemplateCodec::HeaderSize);
+        TemplateCodec::Decoder decoder;
+        Template t;
+        while (decoder.read(&device, t))
+            templateList.append(t);
+        return templateList;
+    }
+
     QDataStream stream(buffer);
     while (!stream.atEnd()) {
         Template t;
@@ -1006,6 +1224,75 @@ int br::Context::blocks(int size) const
     return std::ceil(1.f*size/blockSize);
 }
 
+// The smaller of the cgroup (v2 or v1) and physical memory limits, 0 if neither is known
+static qint64 systemMemoryLimit()
+{
+    qint64 limit = 0;
+#ifdef __linux__
+    const char *paths[] = { "/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes" };
+    for (int i=0; i<2; i++) {
+        QFile cgroup(paths[i]);
+        if (!cgroup.open(QFile::ReadOnly))
+            continue;
+        bool ok;
+        const qint64 bytes = cgroup.readAll().trimmed().toLongLong(&ok); // "max" in v2 and huge values in v1 are unlimited
+        if (ok && (bytes > 0) && (bytes < (qint64(1) << 60)))
+            limit = bytes;
+        break;
+    }
+
+    const qint64 physical = qint64(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    if ((physical > 0) && ((limit == 0) || (physical < limit)))
+        limit = physical;
+#endif // __linux__
+    return limit;
+}
+
+qint64 br::Context::memoryBudget() const
+{
+    const QString limit = memoryLimit.trimmed().toUpper();
+    if (limit.isEmpty())
+        return 0;
+
+    if (limit == "AUTO") {
+        const qint64 bytes = systemMemoryLimit();
+        if (bytes == 0) qWarning("Unable to determine the system memory limit, memory will not be limited.");
+        return bytes;
+    }
+
+    QString digits = limit;
+    if (digits.endsWith('B'))
+        digits.chop(1);
+    qint64 scale = 1;
+    const QString suffixes = "KMGT";
+    const int suffix = digits.isEmpty() ? -1 : suffixes.indexOf(digits.at(digits.size()-1));
+    if (suffix != -1) {
+        scale = qint64(1) << (10 * (suffix + 1));
+        digits.chop(1);
+    }
+
+    bool ok;
+    const double value = digits.toDouble(&ok);
+    if (!ok || (value <= 0))
+        qFatal("Invalid memoryLimit: %s, expected a size such as 32G or auto.", qPrintable(memoryLimit));
+    return qint64(value * scale);
+}
+
+int br::Context::budgetedBlock(qint64 bytesPerItem, qint64 reserved, int fallback) const
+{
+    const qint64 budget = memoryBudget();
+    if (budget == 0)
+        return fallback;
+
+    const qint64 available = budget - reserved;
+    bytesPerItem = std::max(bytesPerItem, qint64(1));
+    if (available < bytesPerItem) {
+        qWarning("Memory limit of %lld MB leaves no room beyond the %lld MB in use, processing one item at a time.", budget >> 20, reserved >> 20);
+        return 1;
+    }
+    return int(std::min(available / bytesPerItem, qint64(INT_MAX)));
+}
+
 bool br::Context::contains(const QString &name)
 {
     return property(qPrintable(name)).isValid();
@@ -1062,6 +1349,9 @@ bool br::Context::checkSDKPath(const QString &sdkPath)
 // We create our own when the user hasn't
 static QCoreApplication *application = NULL;
 
+// Time spent in each initializer during the last Context::initialize()
+static QList< QPair<QString, qint64> > startupTimes;
+
 void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool useGui)
 {
     qInstallMessageHandler(messageHandler);
@@ -1142,19 +1432,40 @@ void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool useG
 
     QThreadPool::globalInstance()->setMaxThreadCount(Globals->parallelism);
 
-    // Trigger registered initializers
+    // Trigger registered initializers, timing each since they dominate startup
+    startupTimes.clear();
+    QElapsedTimer timer;
+    timer.start();
     QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
-    foreach (const QSharedPointer<Initializer> &initializer, initializers)
+    startupTimes.append(qMakePair(QString("Initializer registry"), timer.nsecsElapsed()));
+    foreach (const QSharedPointer<Initializer> &initializer, initializers) {
+        timer.restart();
         initializer->initialize();
+        startupTimes.append(qMakePair(Profiler::label(initializer.data()), timer.nsecsElapsed()));
+    }
 }
 
 void br::Context::finalize()
 {
+    // Globals->verbose is typically set after initialization, so startup timings are reported here
+    if (Globals->verbose) {
+        typedef QPair<QString, qint64> StartupTime;
+        foreach (const StartupTime &startupTime, startupTimes)
+            qDebug("Startup %s: %.3f ms", qPrintable(startupTime.first), startupTime.second / 1e6);
+    }
+
     // Trigger registered finalizers
     QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
         initializer->finalize();
 
+    if (!Globals->profile.isEmpty())
+        Profiler::write(Globals->profile);
+    if (!Globals->latency.isEmpty())
+        QtUtils::writeFile(Globals->latency, Metrics::latencyReport());
+    if (Globals->verbose || !Globals->profile.isEmpty())
+        MemoryAccount::report();
+
     delete Globals;
     Globals = NULL;
 
@@ -1267,6 +1578,8 @@ void br::Context::messageHandler(QtMsgType type, const QMessageLogContext &conte
 Context *br::Globals = NULL;
 
 /* Output - public methods */
+static QAtomicInt outputInstances;
+
 void Output::initialize(const FileList &targetFiles, const FileList &queryFiles)
 {
     this->targetFiles = targetFiles;
@@ -1278,6 +1591,11 @@ void Output::initialize(const FileList &targetFiles, const FileList &queryFiles)
         blockCols = Globals->blockSize;
 
     selfSimilar = (queryFiles == targetFiles) && (targetFiles.size() > 1) && (queryFiles.size() > 1);
+
+    // One slot per comparison thread, the last slot is shared by any threads beyond that
+    instance = outputInstances.fetchAndAddOrdered(1);
+    writerCount = std::max(1, abs(Globals->parallelism)) + 1;
+    nextSlot = 0;
 }
 
 void Output::setBlock(int rowBlock, int columnBlock)
@@ -1287,6 +1605,11 @@ void Output::setBlock(int rowBlock, int columnBlock)
     if (!next.isNull()) next->setBlock(rowBlock, columnBlock);
 }
 
+bool Output::checkpoint()
+{
+    return flush() && (next.isNull() || next->checkpoint());
+}
+
 void Output::setRelative(float value, int i, int j)
 {
     set(value, i+offset.y(), j+offset.x());
@@ -1307,10 +1630,23 @@ Output *Output::make(const File &file, const FileList &targetFiles, const FileLi
     return output;
 }
 
+/* Output - protected methods */
+int Output::writerSlot()
+{
+    // Slots are tagged with the initialization that assigned them, as initialize() may be called again
+    if (!writer.hasLocalData() || (writer.localData().first != instance))
+        writer.setLocalData(Writer(instance, std::min(int(nextSlot.fetchAndAddOrdered(1)), writerCount-1)));
+    return writer.localData().second;
+}
+
 /* MatrixOutput - public methods */
+static const MemoryAccount matrixOutputMemory("MatrixOutput");
+
 void MatrixOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
 {
     Output::initialize(targetFiles, queryFiles);
+    data.release();
+    data.allocator = matrixOutputMemory.allocator();
     data.create(queryFiles.size(), targetFiles.size(), CV_32FC1);
 }
 
@@ -1349,7 +1685,10 @@ TemplateList Gallery::read()
 {
     TemplateList templates;
     bool done = false;
-    while (!done) templates.append(readBlock(&done));
+    while (!done) {
+        BR_PROFILE("gallery", this, readBlockSize);
+        templates.append(readBlock(&done));
+    }
     return templates;
 }
 
@@ -1357,7 +1696,10 @@ FileList Gallery::files()
 {
     FileList files;
     bool done = false;
-    while (!done) files.append(readBlock(&done).files());
+    while (!done) {
+        BR_PROFILE("gallery", this, readBlockSize);
+        files.append(readBlock(&done).files());
+    }
     return files;
 }
 
@@ -1394,6 +1736,117 @@ void Gallery::init()
     }
 }
 
+/* TemplateIterator - public methods */
+TemplateIterator::TemplateIterator(const File &gallery)
+    : gallery(gallery), inMemory(gallery.getBool("reduce") || gallery.get<bool>("merge", false))
+{
+    // Reducing and merging need every template at once
+    if (inMemory) templates = TemplateList::fromGallery(gallery);
+    else          files = gallery.split();
+    rewind();
+}
+
+TemplateIterator::TemplateIterator(const TemplateList &templates)
+    : templates(templates), inMemory(true)
+{
+    rewind();
+}
+
+bool TemplateIterator::next(TemplateList &block)
+{
+    block.clear();
+    while (block.isEmpty()) {
+        if (!readBlock(block))
+            return false;
+
+        foreach (Transform *transform, transforms) {
+            TemplateList projected, ftes;
+            transform->projectUpdate(block, projected);
+            splitFTEs(projected, ftes);
+            block = projected;
+        }
+    }
+    return true;
+}
+
+void TemplateIterator::rewind()
+{
+    current.clear();
+    fileIndex = -1;
+    index = position = 0;
+    found = false;
+}
+
+TemplateList TemplateIterator::readAll()
+{
+    TemplateList all, block;
+    rewind();
+    while (next(block))
+        all.append(block);
+    rewind();
+    return all;
+}
+
+TemplateIterator TemplateIterator::projected(Transform *transform) const
+{
+    TemplateIterator view(*this);
+    view.transforms.append(transform);
+    view.rewind();
+    return view;
+}
+
+/* TemplateIterator - private methods */
+bool TemplateIterator::readBlock(TemplateList &block)
+{
+    if (inMemory) {
+        if (index >= templates.size())
+            return false;
+        block = templates.mid(index, Globals->blockSize);
+        index += block.size();
+        return true;
+    }
+
+    // Same selection as TemplateList::fromGallery, applied to each file of the gallery
+    const int pos = gallery.get<int>("pos", 0);
+    const int length = gallery.get<int>("length", -1);
+    const int step = std::max(gallery.get<int>("step", 1), 1);
+    while (block.isEmpty()) {
+        if (current.isNull()) {
+            if (++fileIndex >= files.size())
+                return false;
+            current = QSharedPointer<Gallery>(Gallery::make(files[fileIndex]));
+            position = 0;
+            found = false;
+        }
+
+        bool done = false;
+        TemplateList read = current->readBlock(&done);
+
+        // If file is a Format not a Gallery (e.g. XML Format vs. XML Gallery)
+        if (done && !found && read.isEmpty())
+            read.append(files[fileIndex]);
+        found = found || !read.isEmpty();
+
+        foreach (const Template &t, read) {
+            const int i = position++;
+            if ((i >= pos) && ((length < 0) || (i < pos + length)) && ((i - pos) % step == 0))
+                block.append(t);
+        }
+
+        if (done || ((length >= 0) && (position >= pos + length)))
+            current.clear();
+    }
+
+    if (Globals->crossValidate > 1) {
+        TemplateList partitioned = block.partition("Label");
+        block.clear();
+        foreach (const Template &t, partitioned)
+            if (!t.file.get<bool>("allPartitions", false) && !t.file.get<bool>("duplicatePartitions", false))
+                block.append(t);
+    }
+    return true;
+}
+
 /* Transform - public methods */
 Transform::Transform(bool _independent, bool _trainable)
 {
@@ -1471,6 +1924,7 @@ Transform *Transform::clone() const
 
 static void _project(const Transform *transform, const Template *src, Template *dst)
 {
+    BR_PROFILE("transform", transform, 1);
     try {
         transform->project(*src, *dst);
     } catch (...) {
@@ -1480,18 +1934,54 @@ static void _project(const Transform *transform, const Template *src, Template *
     }
 }
 
-// Default project(TemplateList) calls project(Template) separately for each element
+static void _projectRange(const Transform *transform, const TemplateList *src, TemplateList *dst, int begin, int end)
+{
+    for (int i=begin; i<end; i++)
+        _project(transform, &src->at(i), &(*dst)[i]);
+}
+
+static QThreadStorage<bool> serialProjection;
+
+bool Transform::setSerialProjection(bool serial)
+{
+    const bool previous = serialProjection.hasLocalData() && serialProjection.localData();
+    serialProjection.setLocalData(serial);
+    return previous;
+}
+
+// Default project(TemplateList) calls project(Template) separately for each element,
+// grouping consecutive elements into tasks sized from the measured cost of the first one
 void Transform::project(const TemplateList &src, TemplateList &dst) const
 {
     dst.reserve(src.size());
 
     for (int i=0; i<src.size(); i++)
         dst.append(Template());
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<dst.size(); i++)
-        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
-        else                          _project(this, &src[i], &dst[i]);
-    futures.waitForFinished();
+
+    const int size = dst.size();
+    if ((Globals->parallelism <= 1) || (size < 2) || (serialProjection.hasLocalData() && serialProjection.localData())) {
+        _projectRange(this, &src, &dst, 0, size);
+        return;
+    }
+
+    // Aim for roughly half a millisecond of work per task
+    static const qint64 targetTaskNSecs = 500000;
+    QElapsedTimer timer;
+    timer.start();
+    _project(this, &src[0], &dst[0]);
+    const qint64 cost = std::max(timer.nsecsElapsed(), qint64(1));
+
+    // Leave a few tasks per thread so uneven templates still balance
+    const int remaining = size - 1;
+    const int tasks = 4 * Globals->parallelism;
+    int grainSize = int(std::min(targetTaskNSecs / cost + 1, qint64((remaining + tasks - 1) / tasks)));
+    if (Globals->maxGrainSize > 0) grainSize = std::min(grainSize, Globals->maxGrainSize);
+    grainSize = std::max(grainSize, 1);
+
+    TaskGroup group;
+    for (int begin=1; begin<size; begin+=grainSize)
+        group.run(_projectRange, this, &src, &dst, begin, std::min(begin+grainSize, size));
+    group.wait();
 }
 
 TemplateEvent *Transform::getEvent(const QString &name)
@@ -1525,6 +2015,15 @@ void Transform::train(const QList<TemplateList> &data)
     train(combined);
 }
 
+void Transform::train(TemplateIterator &data)
+{
+    if (!trainable) {
+        qWarning("Train called on untrainable transform %s", this->metaObject()->className());
+        return;
+    }
+    train(data.readAll());
+}
+
 /* Distance - public methods */
 Distance *Distance::make(QString str, QObject *parent)
 {
@@ -1550,16 +2049,16 @@ void Distance::compare(const TemplateList &target, const TemplateList &query, Ou
     const bool stepTarget = target.size() > query.size();
     const int totalSize = std::max(target.size(), query.size());
     int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
-    QFutureSynchronizer<void> futures;
+    TaskGroup tasks;
     for (int i=0; i<totalSize; i+=stepSize) {
         const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
         const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
         const int targetOffset = stepTarget ? i : 0;
         const int queryOffset = stepTarget ? 0 : i;
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
-        else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+        if (Globals->parallelism) tasks.runMember(this, &Distance::profiledCompareBlock, targets, queries, output, targetOffset, queryOffset);
+        else                                                         profiledCompareBlock (targets, queries, output, targetOffset, queryOffset);
     }
-    futures.waitForFinished();
+    tasks.wait();
 }
 
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
@@ -1603,7 +2102,7 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
     return -std::numeric_limits<float>::max();
 }
 
-/* Distance - private methods */
+/* Distance - protected methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
     for (int i=0; i<query.size(); i++)
@@ -1612,6 +2111,16 @@ void Distance::compareBlock(const TemplateList &target, const TemplateList &quer
             else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
 }
 
+/* Distance - private methods */
+static const Metrics::Counter comparisonsMetric("br_comparisons_total", "Template comparisons made by br::Distance::compare().");
+
+void Distance::profiledCompareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+{
+    comparisonsMetric.add(qint64(target.size()) * query.size());
+    BR_PROFILE("distance", this, target.size() * query.size());
+    compareBlock(target, query, output, targetOffset, queryOffset);
+}
+
 void br::applyAdditionalProperties(const File &temp, Transform *target)
 {
     QVariantMap meta = temp.localMetadata();
@@ -19,6 +19,7 @@
 
 #ifdef __cplusplus
 
+#include <QAtomicInt>
 #include <QDataStream>
 #include <QDebug>
 #include <QDir>
@@ -28,6 +29,7 @@
 #include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMutex>
 #include <QPoint>
 #include <QPointF>
 #include <QRectF>
@@ -36,6 +38,7 @@
 #include <QString>
 #include <QStringList>
 #include <QThread>
+#include <QThreadStorage>
 #include <QTime>
 #include <QVariant>
 #include <QVector>
@@ -109,6 +112,86 @@ TYPE get_##NAME() const { return NAME; }                \
 void set_##NAME(TYPE the_##NAME) { NAME = the_##NAME; } \
 void reset_##NAME() { NAME = DEFAULT; }
 
+namespace TemplateCodec { class Encoder; class Decoder; }
+
+/*!
+ * \brief An interned metadata key.
+ *
+ * Every distinct key string is assigned a small integer atom the first time it is interned, shared by all br::File metadata tables.
+ * Code that repeatedly accesses the same key can construct a MetadataKey once and skip interning the string on every access.
+ */
+struct BR_EXPORT MetadataKey
+{
+    int atom; /*!< \brief The key's index in the global key table, or -1 if it has never been interned. */
+
+    MetadataKey() : atom(-1) {}
+    explicit MetadataKey(const QString &key) : atom(intern(key)) {} /*!< \brief Intern \em key. */
+
+    static int intern(const QString &key); /*!< \brief Returns the atom for \em key, assigning one if necessary. */
+    static int find(const QString &key); /*!< \brief Returns the atom for \em key, or -1 if it has never been interned. */
+    static QString name(int atom); /*!< \brief Returns the key string for \em atom. */
+};
+
+/*!
+ * \brief A br::File's private metadata table.
+ *
+ * Stored as a small vector of values sorted by key atom, see br::MetadataKey, rather than a map of strings.
+ * Key strings are stored once globally instead of once per file, and lookups are a binary search over integers.
+ * Like QVariantMap the table is implicitly shared.
+ */
+class BR_EXPORT FileMetadata
+{
+public:
+    FileMetadata() : digest(0) {}
+    FileMetadata(const QVariantMap &map); /*!< \brief Construct from a map. */
+
+    inline bool isEmpty() const { return entries.isEmpty(); } /*!< \brief Returns \c true if there are no keys. */
+    inline int size() const { return entries.size(); } /*!< \brief Returns the number of keys. */
+
+    inline bool contains(const QString &key) const { return indexOf(MetadataKey::find(key)) >= 0; } /*!< \brief Returns \c true if the key is present. */
+    inline bool contains(const MetadataKey &key) const { return indexOf(key.atom) >= 0; } /*!< \brief Returns \c true if the key is present. */
+    inline QVariant value(const QString &key) const { return value(MetadataKey::find(key)); } /*!< \brief Returns the key's value, or a null variant. */
+    inline QVariant value(const MetadataKey &key) const { return value(key.atom); } /*!< \brief Returns the key's value, or a null variant. */
+    inline void insert(const QString &key, const QVariant &value) { insert(MetadataKey::intern(key), value); } /*!< \brief Insert or overwrite the key. */
+    inline void insert(const MetadataKey &key, const QVariant &value) { insert(key.atom, value); } /*!< \brief Insert or overwrite the key. */
+    inline void remove(const QString &key) { remove(MetadataKey::find(key)); } /*!< \brief Remove the key. */
+
+    QStringList keys() const; /*!< \brief Returns the keys in ascending order, like QVariantMap::keys(). */
+    QVariantMap toMap() const; /*!< \brief Convert to a map. */
+    quint64 fingerprint() const; /*!< \brief A 64-bit hash of the keys and values, cached until the next write. */
+
+    /*!
+     * \brief Compare keys and values for equality.
+     *
+     * Tables sharing their data are equal, and tables with different cached fingerprints are not, without comparing values.
+     */
+    inline bool operator==(const FileMetadata &other) const
+    {
+        if (entries.isSharedWith(other.entries)) return true;
+        const quint64 a = digest.load(), b = other.digest.load();
+        if (a && b && (a != b)) return false;
+        return entries == other.entries;
+    }
+
+private:
+    typedef QPair<int, QVariant> Entry;
+    QVector<Entry> entries; // Sorted by atom
+    mutable QAtomicInteger<quint64> digest; // Cached fingerprint(), or 0 after a write. Concurrent readers computing it store the same value.
+
+    int indexOf(int atom) const;
+    QVariant value(int atom) const;
+    void insert(int atom, const QVariant &value);
+    void remove(int atom);
+
+    BR_EXPORT friend QDataStream &operator<<(QDataStream &stream, const FileMetadata &metadata);
+    BR_EXPORT friend QDataStream &operator>>(QDataStream &stream, FileMetadata &metadata);
+    friend class TemplateCodec::Encoder;
+    friend class TemplateCodec::Decoder;
+};
+
+BR_EXPORT QDataStream &operator<<(QDataStream &stream, const FileMetadata &metadata); /*!< \brief Serializes the metadata in the same format as a QVariantMap. */
+BR_EXPORT QDataStream &operator>>(QDataStream &stream, FileMetadata &metadata); /*!< \brief Deserializes metadata serialized as a QVariantMap. */
+
 /*!
  * \brief A file path with associated metadata.
  *
@@ -178,9 +261,10 @@ struct BR_EXPORT File
     inline operator QString() const { return name; } /*!< \brief Returns #name. */
     QString flat() const; /*!< \brief A stringified version of the file with metadata. */
     QString hash() const; /*!< \brief A hash of the file. */
+    quint64 fingerprint() const; /*!< \brief A 64-bit hash of the name and metadata, equal files have equal fingerprints. The metadata's share is cached until it is written. */
 
     inline QStringList localKeys() const { return m_metadata.keys(); } /*!< \brief Returns the private metadata keys. */
-    inline QVariantMap localMetadata() const { return m_metadata; } /*!< \brief Returns the private metadata. */
+    inline QVariantMap localMetadata() const { return m_metadata.toMap(); } /*!< \brief Returns the private metadata. */
 
     void append(const QVariantMap &localMetadata); /*!< \brief Add new metadata fields. */
     void append(const File &other); /*!< \brief Append another file using \c separator. */
@@ -217,6 +301,9 @@ struct BR_EXPORT File
     QVariant value(const QString &key) const; /*!< \brief Returns the value for the specified key. */
     static QVariant parse(const QString &value); /*!< \brief Try to convert the QString to a QPointF or QRectF if possible. */
     inline void set(const QString &key, const QVariant &value) { m_metadata.insert(key, value); } /*!< \brief Insert or overwrite the metadata key with the specified value. */
+    inline void set(const MetadataKey &key, const QVariant &value) { m_metadata.insert(key, value); } /*!< \brief Insert or overwrite the interned metadata key with the specified value. */
+    inline bool containsLocal(const MetadataKey &key) const { return m_metadata.contains(key); } /*!< \brief Returns \c true if the interned key is in the private metadata, ignoring global properties. */
+    inline QVariant localValue(const MetadataKey &key) const { return m_metadata.value(key); } /*!< \brief Returns the private value of the interned key, ignoring global properties. */
     void set(const QString &key, const QString &value); /*!< \brief Insert or overwrite the metadata key with the specified value. */
 
     /*!< \brief Specialization for list type. Insert or overwrite the metadata key with the specified value. */
@@ -261,7 +348,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) qFatal("Missing key: %s in: %s", qPrintable(key), qPrintable(flat()));
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, m_metadata.value(key).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else qFatal("Failed to convert value for key %s in: %s", qPrintable(key), qPrintable(flat()));
         }
@@ -274,7 +361,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) return defaultValue;
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, m_metadata.value(key).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else return defaultValue;
         }
@@ -312,7 +399,7 @@ struct BR_EXPORT File
     QList<QPointF> points() const; /*!< \brief Returns the file's points list. */
     void appendPoint(const QPointF &point); /*!< \brief Adds a point to the file's point list. */
     void appendPoints(const QList<QPointF> &points); /*!< \brief Adds landmarks to the file's landmark list. */
-    inline void clearPoints() { m_metadata["Points"] = QList<QVariant>(); } /*!< \brief Clears the file's landmark list. */
+    inline void clearPoints() { m_metadata.insert("Points", QList<QVariant>()); } /*!< \brief Clears the file's landmark list. */
     inline void setPoints(const QList<QPointF> &points) { clearPoints(); appendPoints(points); } /*!< \brief Overwrites the file's landmark list. */
 
     QList<QRectF> namedRects() const; /*!< \brief Returns rects convertible from metadata values. */
@@ -321,15 +408,17 @@ struct BR_EXPORT File
     void appendRect(const cv::Rect &rect); /*!< \brief Adds a rect to the file's rect list. */
     void appendRects(const QList<QRectF> &rects); /*!< \brief Adds rects to the file's rect list. */
     void appendRects(const QList<cv::Rect> &rects); /*!< \brief Adds rects to the file's rect list. */
-    inline void clearRects() { m_metadata["Rects"] = QList<QVariant>(); } /*!< \brief Clears the file's rect list. */
+    inline void clearRects() { m_metadata.insert("Rects", QList<QVariant>()); } /*!< \brief Clears the file's rect list. */
     inline void setRects(const QList<QRectF> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
     inline void setRects(const QList<cv::Rect> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
 
     bool fte;
 private:
-    QVariantMap m_metadata;
+    FileMetadata m_metadata;
     BR_EXPORT friend QDataStream &operator<<(QDataStream &stream, const File &file);
     BR_EXPORT friend QDataStream &operator>>(QDataStream &stream, File &file);
+    friend class TemplateCodec::Encoder;
+    friend class TemplateCodec::Decoder;
 
     void init(const QString &file);
 };
@@ -351,6 +440,7 @@ inline bool File::get<bool>(const QString &key) const
 BR_EXPORT QDebug operator<<(QDebug dbg, const File &file); /*!< \brief Prints br::File::flat() to \c stderr. */
 BR_EXPORT QDataStream &operator<<(QDataStream &stream, const File &file); /*!< \brief Serializes the file to a stream. */
 BR_EXPORT QDataStream &operator>>(QDataStream &stream, File &file); /*!< \brief Deserializes the file from a stream. */
+inline uint qHash(const File &file, uint seed = 0) { const quint64 f = file.fingerprint(); return uint(f ^ (f >> 32)) ^ seed; } /*!< \brief Hashes name and metadata, consistent with File::operator==. */
 
 /*!
  * \brief A list of files.
@@ -421,13 +511,10 @@ struct Template : public QList<cv::Mat>
 
     /*!
      * \brief Copies all the matrices and returns a new template.
+     *
+     * The copies are drawn from the calling thread's scratch arena, so they are recycled once released.
      */
-    Template clone() const
-    {
-        Template other(file);
-        foreach (const cv::Mat &m, *this) other += m.clone();
-        return other;
-    }
+    BR_EXPORT Template clone() const;
 };
 
 /*!
@@ -664,6 +751,61 @@ public:
     Q_PROPERTY(QString log READ get_log WRITE set_log RESET reset_log)
     BR_PROPERTY(QString, log, "")
 
+    /*!
+     * \brief Optional Chrome trace-event file to record transform, distance and gallery timings to.
+     * Collapsed stacks for flamegraphs are written to <tt>\<profile\>.folded</tt> and a summary is printed on finalize.
+     */
+    Q_PROPERTY(QString profile READ get_profile WRITE set_profile RESET reset_profile)
+    BR_PROPERTY(QString, profile, "")
+
+    /*!
+     * \brief Append JIT compiled Likely kernels to <tt>/tmp/perf-\<pid\>.map</tt> so \c perf can symbolize them.
+     */
+    Q_PROPERTY(bool perfMap READ get_perfMap WRITE set_perfMap RESET reset_perfMap)
+    BR_PROPERTY(bool, perfMap, false)
+
+    /*!
+     * \brief Optional <tt>.csv</tt> file to write latency quantiles of C API and Janus calls to on finalize.
+     * Calls are only timed while this is set, see br_latency.
+     */
+    Q_PROPERTY(QString latency READ get_latency WRITE set_latency RESET reset_latency)
+    BR_PROPERTY(QString, latency, "")
+
+    /*!
+     * \brief Optional file each Stream appends a JSON line of per-stage counters to when it finishes.
+     * Counters are frames in and out, mean and 99th percentile processing time, input queue occupancy,
+     * and the time the reader spent blocked waiting for one of \c activeFrames to be returned.
+     */
+    Q_PROPERTY(QString streamStats READ get_streamStats WRITE set_streamStats RESET reset_streamStats)
+    BR_PROPERTY(QString, streamStats, "")
+
+    /*!
+     * \brief Directory of content-addressed enrollment results reused by br::Enroll across runs, disabled if empty.
+     * \see ContentCacheTransform
+     */
+    Q_PROPERTY(QString enrollmentCache READ get_enrollmentCache WRITE set_enrollmentCache RESET reset_enrollmentCache)
+    BR_PROPERTY(QString, enrollmentCache, "")
+
+    /*!
+     * \brief Directory of trained models reused by br::Train when a stage sees the same description and training data, disabled if empty.
+     */
+    Q_PROPERTY(QString trainingCache READ get_trainingCache WRITE set_trainingCache RESET reset_trainingCache)
+    BR_PROPERTY(QString, trainingCache, "")
+
+    /*!
+     * \brief Train br::Train algorithms from blocks of the training gallery instead of loading all of it at once.
+     * \see TemplateIterator
+     */
+    Q_PROPERTY(bool streamTraining READ get_streamTraining WRITE set_streamTraining RESET reset_streamTraining)
+    BR_PROPERTY(bool, streamTraining, false)
+
+    /*!
+     * \brief Store trained algorithms in the uncompressed container whose matrices are memory mapped on load,
+     * sharing one read-only copy between processes. Either format is recognized when loading.
+     */
+    Q_PROPERTY(bool mappedModels READ get_mappedModels WRITE set_mappedModels RESET reset_mappedModels)
+    BR_PROPERTY(bool, mappedModels, false)
+
     /*!
      * \brief Path to use when resolving images specified with relative paths.
      * Multiple paths can be specified using a semicolon separator.
@@ -677,6 +819,13 @@ public:
     Q_PROPERTY(int parallelism READ get_parallelism WRITE set_parallelism RESET reset_parallelism)
     BR_PROPERTY(int, parallelism, std::max(1, QThread::idealThreadCount()+1))
 
+    /*!
+     * \brief Upper bound on the number of templates grouped into one task by the default Transform::project(TemplateList).
+     * The grain size is otherwise chosen from the measured cost of the first template, 0 means no bound.
+     */
+    Q_PROPERTY(int maxGrainSize READ get_maxGrainSize WRITE set_maxGrainSize RESET reset_maxGrainSize)
+    BR_PROPERTY(int, maxGrainSize, 0)
+
     /*!
      * \brief Whether or not to use GUI functions
      */
@@ -689,6 +838,31 @@ public:
     Q_PROPERTY(int blockSize READ get_blockSize WRITE set_blockSize RESET reset_blockSize)
     BR_PROPERTY(int, blockSize, parallelism * ((sizeof(void*) == 4) ? 128 : 1024))
 
+    /*!
+     * \brief The memory the process may use, such as \c 32G or \c 512M, or \c auto for the cgroup or physical memory limit.
+     *
+     * br::Compare, br::Enroll and br::Evaluate derive how many templates are in flight, gallery read sizes and output buffering
+     * from it, up to blockSize. Empty (default) for no limit.
+     * \see budgetedBlock
+     */
+    Q_PROPERTY(QString memoryLimit READ get_memoryLimit WRITE set_memoryLimit RESET reset_memoryLimit)
+    BR_PROPERTY(QString, memoryLimit, "")
+
+    /*!
+     * \brief Seconds between checkpoints of br::Compare progress written beside its output, \c 0 (default) for none.
+     * \see resume
+     */
+    Q_PROPERTY(int checkpointInterval READ get_checkpointInterval WRITE set_checkpointInterval RESET reset_checkpointInterval)
+    BR_PROPERTY(int, checkpointInterval, 0)
+
+    /*!
+     * \brief If \c true br::Compare skips the rows its output's checkpoint records as complete, and br::Enroll keeps the complete
+     * templates already in its output gallery and enrolls the rest, \c false by default.
+     * \see checkpointInterval
+     */
+    Q_PROPERTY(bool resume READ get_resume WRITE set_resume RESET reset_resume)
+    BR_PROPERTY(bool, resume, false)
+
     /*!
      * \brief If \c true no messages will be sent to the terminal, \c false by default.
      */
@@ -771,6 +945,19 @@ public:
      */
     int blocks(int size) const;
 
+    /*!
+     * \brief Returns memoryLimit in bytes, or \c 0 if there is no limit.
+     */
+    qint64 memoryBudget() const;
+
+    /*!
+     * \brief Returns how many items of \em bytesPerItem bytes fit in the memoryBudget() left after \em reserved bytes.
+     * \param bytesPerItem The memory held by each item in the block.
+     * \param reserved The memory already held while the block is processed.
+     * \param fallback Returned when there is no memoryLimit.
+     */
+    int budgetedBlock(qint64 bytesPerItem, qint64 reserved, int fallback) const;
+
     /*!
      * \brief Returns true if \em name is queryable using <a href="http://doc.qt.digia.com/qt/qobject.html#property">QObject::property</a>
      * \param name The property key to check for existance.
@@ -918,7 +1105,7 @@ struct Factory
             else if (names().contains("Default"))                 name = "Default";
             else    qFatal("%s registry does not contain object named: %s", qPrintable(baseClassName()), qPrintable(name));
         }
-        T *object = registry->value(name)->_make();
+        T *object = resolve()->value(name)->_make();
         static_cast<Object*>(object)->init(file);
         return object;
     }
@@ -931,7 +1118,7 @@ struct Factory
     {
         QList< QSharedPointer<T> > objects;
         foreach (const QString &name, names()) {
-            objects.append(QSharedPointer<T>(registry->value(name)->_make()));
+            objects.append(QSharedPointer<T>(resolve()->value(name)->_make()));
             objects.last()->init("");
         }
         return objects;
@@ -940,14 +1127,14 @@ struct Factory
     /*!
      * \brief Returns the names of the available plugins.
      */
-    static QStringList names() { return registry ? registry->keys() : QStringList(); }
+    static QStringList names() { return resolve() ? resolve()->keys() : QStringList(); }
 
     /*!
      * \brief Returns the parameters for a plugin.
      */
     static QString parameters(const QString &name)
     {
-        if (!registry) return QString();
+        if (!resolve()) return QString();
         QScopedPointer<T> object(make("." + name));
         return object->parameters().join(", ");
     }
@@ -955,26 +1142,51 @@ struct Factory
 protected:
     /*!
      * \brief For internal use. Nifty trick to register objects using a constructor.
+     *
+     * Runs during static initialization, so it only links the factory into a list.
+     * Names are computed and checked for duplicates on first use of the registry.
      */
-    Factory(QString name)
+    Factory(const char *_className) : className(_className)
     {
-        if (!registry) registry = new QMap<QString,Factory<T>*>();
-
-        const QString abstraction = baseClassName();
-        if (name.endsWith(abstraction)) name = name.left(name.size()-abstraction.size());
-        if (name.startsWith("br::")) name = name.right(name.size()-4);
-        if (registry->contains(name)) qFatal("%s registry already contains object named: %s", qPrintable(abstraction), qPrintable(name));
-        registry->insert(name, this);
+        QMutexLocker locker(&resolveLock);
+        next = pending.load();
+        pending.store(this);
     }
 
 private:
+    const char *className;
+    Factory<T> *next;
+
+    static QBasicAtomicPointer< Factory<T> > pending; // Released empty once the registry holds every factory
     static QMap<QString,Factory<T>*> *registry;
+    static QBasicMutex resolveLock;
+
+    static QMap<QString,Factory<T>*> *resolve()
+    {
+        if (!pending.loadAcquire()) return registry;
+
+        QMutexLocker locker(&resolveLock);
+        if (!registry) registry = new QMap<QString,Factory<T>*>();
+
+        const QString abstraction = baseClassName();
+        for (Factory<T> *factory = pending.load(); factory; factory = factory->next) {
+            QString name = factory->className;
+            if (name.endsWith(abstraction)) name = name.left(name.size()-abstraction.size());
+            if (name.startsWith("br::")) name = name.right(name.size()-4);
+            if (registry->contains(name)) qFatal("%s registry already contains object named: %s", qPrintable(abstraction), qPrintable(name));
+            registry->insert(name, factory);
+        }
+        pending.storeRelease(NULL);
+        return registry;
+    }
 
     static QString baseClassName() { return QString(T::staticMetaObject.className()).remove("br::"); }
     virtual T *_make() const = 0;
 };
 
+template <class T> QBasicAtomicPointer< Factory<T> > Factory<T>::pending = Q_BASIC_ATOMIC_INITIALIZER(0);
 template <class T> QMap<QString, Factory<T>*>* Factory<T>::registry = 0;
+template <class T> QBasicMutex Factory<T>::resolveLock;
 
 template <class _Abstraction, class _Implementation>
 class FactoryInstance : public Factory<_Abstraction>
@@ -1027,6 +1239,11 @@ public:
  *
  * An \em output is a br::File representing the result comparing templates.
  * br::File::suffix() is used to determine which plugin should handle the output.
+ *
+ * br::Distance::compare calls setRelative() concurrently from its comparison threads, each thread writing distinct (query, target) cells.
+ * An output either writes only to state indexed by the cell, as br::MatrixOutput does,
+ * or accumulates into per-thread state indexed by writerSlot() and merges it in its destructor.
+ * Only the last slot is shared between threads and needs locking.
  * \note Handle serialization to disk in the derived class destructor.
  */
 class BR_EXPORT Output : public Object
@@ -1047,13 +1264,25 @@ public:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
     virtual void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
     virtual void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    bool checkpoint(); /*!< \brief Make the scores of completed blocks durable, returns \c false if the output can't be resumed. */
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
 
+protected:
+    int writerSlots() const { return writerCount; } /*!< \brief Number of per-thread slots, one per comparison thread plus a shared overflow slot. */
+    int writerSlot(); /*!< \brief The calling thread's slot in [0, writerSlots()). */
+    bool sharedWriterSlot(int slot) const { return slot == writerCount-1; } /*!< \brief \c true if \em slot is shared by several threads. */
+
 private:
+    typedef QPair<int,int> Writer; // QPair<instance,slot>
+    QThreadStorage<Writer> writer;
+    QAtomicInt nextSlot;
+    int instance, writerCount;
+
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual bool flush() { return false; } /*!< \brief Write the scores of completed blocks to disk, \c false if they are only written on destruction. */
 };
 
 /*!
@@ -1125,8 +1354,8 @@ public:
     BR_PROPERTY(int, readBlockSize, Globals->blockSize)
 
     virtual ~Gallery() {}
-    TemplateList read(); /*!< \brief Retrieve all the stored templates. */
-    FileList files(); /*!< \brief Retrieve all the stored template files. */
+    virtual TemplateList read(); /*!< \brief Retrieve all the stored templates. */
+    virtual FileList files(); /*!< \brief Retrieve all the stored template files. */
     virtual TemplateList readBlock(bool *done) = 0; /*!< \brief Retrieve a portion of the stored templates. */
     void writeBlock(const TemplateList &templates); /*!< \brief Serialize a template list. */
     virtual void write(const Template &t) = 0; /*!< \brief Serialize a template. */
@@ -1135,11 +1364,50 @@ public:
 
     virtual qint64 totalSize() { return std::numeric_limits<qint64>::max(); }
     virtual qint64 position() { return 0; }
+    virtual bool seek(qint64 index) { (void) index; return false; } /*!< \brief Position the next read at the specified template, returns \c false if random access is unsupported. */
+    virtual bool threadAffine() const { return !next.isNull() && next->threadAffine(); } /*!< \brief Returns \c true if the gallery, or one it forwards writes to, must only be used from the thread that opened it. */
 
 private:
     QSharedPointer<Gallery> next;
 };
 
+class Transform;
+
+/*!
+ * \ingroup galleries
+ * \brief Block-wise access to training data that may not fit in memory.
+ *
+ * Reads a gallery one Gallery::readBlockSize block at a time, applying the same \c pos, \c length, \c step and
+ * cross-validation partitioning as TemplateList::fromGallery, and can be rewound by transforms that make several passes.
+ * Templates in all or duplicated partitions are skipped when cross validating, as br::Train does.
+ * A view returned by projected() passes each block through already trained transforms and drops failures to enroll.
+ * \see Transform::train(TemplateIterator &)
+ */
+class BR_EXPORT TemplateIterator
+{
+public:
+    explicit TemplateIterator(const File &gallery); /*!< \brief Iterate over a gallery on disk. */
+    explicit TemplateIterator(const TemplateList &templates); /*!< \brief Iterate over templates already in memory. */
+
+    bool next(TemplateList &block); /*!< \brief Retrieve the next non-empty block, returns \c false once the data is exhausted. */
+    void rewind(); /*!< \brief Restart iteration from the first template. */
+    TemplateList readAll(); /*!< \brief Retrieve every template at once, for transforms that can't train incrementally. */
+    TemplateIterator projected(Transform *transform) const; /*!< \brief A rewound view of this data with each block passed through \em transform. */
+
+private:
+    File gallery;
+    QList<File> files;
+    TemplateList templates;
+    bool inMemory;
+    QList<Transform*> transforms;
+
+    QSharedPointer<Gallery> current;
+    int fileIndex, index, position;
+    bool found;
+
+    bool readBlock(TemplateList &block);
+};
+
 /*!
  * \defgroup transforms Transforms
  * \brief Plugins that process a template.
@@ -1189,6 +1457,7 @@ public:
     static QSharedPointer<Transform> fromComparison(const QString &algorithm);
 
     virtual Transform *clone() const; /*!< \brief Copy the transform. */
+    static bool setSerialProjection(bool serial); /*!< \brief Prevent project() spawning threads from the calling thread, for callers that schedule their own threads. Returns the previous setting so it can be restored. */
 
     /*!< \brief Train the transform. */
     virtual void train(const TemplateList &data);
@@ -1203,6 +1472,17 @@ public:
      */
     virtual void train(const QList<TemplateList> &data);
 
+    /*!< \brief Train the transform from data read one block at a time, for training sets larger than memory.
+     * Implementations should rewind data before each pass they make over it. The default implementation reads everything
+     * and calls train(TemplateList), transforms that can learn incrementally or that train other transforms should override it.
+     */
+    virtual void train(TemplateIterator &data);
+
+    /*!< \brief Does train(TemplateIterator &) read its data only once? If so, projected data is not worth spilling to disk for it.
+     * True for the default implementation, overloads of train(TemplateIterator &) that rewind the data should return false.
+     */
+    virtual bool trainsInOnePass() const { return true; }
+
     /*!< \brief Apply the transform to a single template. Typically used by independent transforms */
     virtual void project(const Template &src, Template &dst) const = 0;
 
@@ -1214,6 +1494,15 @@ public:
      */
     virtual void project(const TemplateList &src, TemplateList &dst) const;
 
+    /*!< \brief Apply the transform to a single template in place.
+     * By default, project into a new template and assign it back. Transforms that only rearrange or drop matrices
+     * override it to modify \em srcdst directly, so a template passed along a br::PipeTransform isn't copied at every stage.
+     */
+    virtual void projectInPlace(Template &srcdst) const
+    {
+        srcdst = (*this)(srcdst);
+    }
+
     /*!< \brief Apply the transform to a single template, may update the transform's internal state
      * By default, just call project, we can always call a const function from a non-const function.
      * If a transform implements projectUpdate, it should report true to timeVarying so that it can be
@@ -1324,7 +1613,7 @@ protected:
  */
 inline Template &operator>>(Template &srcdst, const Transform &f)
 {
-    srcdst = f(srcdst);
+    f.projectInPlace(srcdst);
     return srcdst;
 }
 
@@ -1384,11 +1673,11 @@ public:
 
 protected:
     inline Distance *make(const QString &description) { return make(description, this); } /*!< \brief Make a subdistance. */
+    virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const; /*!< \brief Compare a block of templates, called in parallel by compare(). */
 
 private:
-    virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
-
     friend struct AlgorithmCore;
+    void profiledCompareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
     virtual bool compare(const File &targetGallery, const File &queryGallery, const File &output) const /*!< \brief Escape hatch for algorithms that need customized file I/O during comparison. */
         { (void) targetGallery; (void) queryGallery; (void) output; return false; }
 };
@@ -1495,6 +1784,24 @@ BR_EXPORT void Cat(const QStringList &inputGalleries, const QString &outputGalle
  */
 BR_EXPORT void Deduplicate(const File &inputGallery, const File &outputGallery, const QString &threshold);
 
+/*!
+ * \brief Measure enrollment, comparison and top-K search performance of an algorithm.
+ * \param input Gallery of templates to enroll. Metadata keys \c targets, \c queries and \c k control the size of the comparison and search benchmarks,
+ *              enrolled templates are replicated to reach \c targets.
+ * \param output JSON report of throughput, p50/p99 latency and peak RSS, printed to \c stdout if null.
+ * \param parallelisms Values of br::Context::parallelism to benchmark, the current value if empty.
+ * \see br_benchmark
+ */
+BR_EXPORT void Benchmark(const File &input, const File &output, const QList<int> &parallelisms = QList<int>());
+
+/*!
+ * \brief Serve enrollment, verification and search requests over HTTP until the process is stopped.
+ * \param gallery Optional gallery to verify and search against, loaded once and held in memory.
+ * \param port Port to listen on.
+ * \see br_serve
+ */
+BR_EXPORT void Serve(const File &gallery, int port = 8080);
+
 BR_EXPORT Transform *wrapTransform(Transform *base, const QString &target);
 
 BR_EXPORT Transform *pipeTransforms(QList<Transform *> &transforms);
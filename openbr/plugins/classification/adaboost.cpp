@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
 
@@ -22,13 +24,82 @@ using namespace cv;
 namespace br
 {
 
+// A decision stump of the built-in trainer, samples with x[feature] <= threshold score left
+struct BoostStump
+{
+    qint32 feature;
+    float threshold, left, right;
+
+    BoostStump() : feature(0), threshold(0), left(0), right(0) {}
+    inline float operator()(const float *x) const { return (x[feature] <= threshold) ? left : right; }
+};
+
+QDataStream &operator<<(QDataStream &stream, const BoostStump &stump)
+{
+    return stream << stump.feature << stump.threshold << stump.left << stump.right;
+}
+
+QDataStream &operator>>(QDataStream &stream, BoostStump &stump)
+{
+    return stream >> stump.feature >> stump.threshold >> stump.left >> stump.right;
+}
+
+// Training samples with every feature column sorted once up front
+struct PresortedSamples
+{
+    Mat values; // features x samples
+    Mat order; // features x samples, sample indices by increasing value
+
+    PresortedSamples(const Mat &samples)
+    {
+        transpose(samples, values);
+        order.create(values.rows, values.cols, CV_32SC1);
+        parallel_for_(Range(0, values.rows), Sorter(this));
+    }
+
+    struct Sorter : public ParallelLoopBody
+    {
+        PresortedSamples *presorted;
+        Sorter(PresortedSamples *presorted) : presorted(presorted) {}
+
+        struct Less
+        {
+            const float *values;
+            Less(const float *values) : values(values) {}
+            bool operator()(int a, int b) const { return values[a] < values[b]; }
+        };
+
+        void operator()(const Range &range) const
+        {
+            for (int j=range.start; j<range.end; j++) {
+                int *order = presorted->order.ptr<int>(j);
+                for (int i=0; i<presorted->order.cols; i++)
+                    order[i] = i;
+                std::sort(order, order + presorted->order.cols, Less(presorted->values.ptr<float>(j)));
+            }
+        }
+    };
+};
+
+struct StumpSplit
+{
+    int feature;
+    float threshold;
+    double criterion;
+    StumpSplit() : feature(-1), threshold(0), criterion(std::numeric_limits<double>::max()) {}
+};
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV's Ada Boost framework
+ *
+ * With \em presort set, Discrete, Real and Gentle stumps are instead trained by a built-in booster
+ * that sorts each feature column once and searches splits in parallel across features,
+ * considering a random \em featureFraction of the features each round.
  * \author Scott Klum \cite sklum
  * \brief http://docs.opencv.org/modules/ml/doc/boosting.html
  */
-class AdaBoostTransform : public Transform
+class AdaBoostTransform : public Transform, public WindowClassifier
 {
     Q_OBJECT
     Q_ENUMS(Type)
@@ -44,6 +115,8 @@ class AdaBoostTransform : public Transform
     Q_PROPERTY(bool overwriteMat READ get_overwriteMat WRITE set_overwriteMat RESET reset_overwriteMat STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
+    Q_PROPERTY(bool presort READ get_presort WRITE set_presort RESET reset_presort STORED false)
+    Q_PROPERTY(float featureFraction READ get_featureFraction WRITE set_featureFraction RESET reset_featureFraction STORED false)
 
 public:
     enum Type { Discrete = CvBoost::DISCRETE,
@@ -67,14 +140,197 @@ private:
     BR_PROPERTY(bool, overwriteMat, true)
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(QString, outputVariable, "")
+    BR_PROPERTY(bool, presort, false)
+    BR_PROPERTY(float, featureFraction, 1)
 
     CvBoost boost;
+    QList<BoostStump> stumps; // Built-in trainer's model, empty when boost holds the model
+    float negativeLabel, positiveLabel;
+
+    // Lower is better, weights are the positive and negative mass left and right of the threshold
+    static double splitCriterion(int type, double lp, double ln, double rp, double rn)
+    {
+        switch (type) {
+          case Discrete: return std::min(lp + rn, ln + rp);
+          case Real:     return sqrt(lp * ln) + sqrt(rp * rn);
+          default:       return -((lp + ln > 0 ? (lp - ln) * (lp - ln) / (lp + ln) : 0) +
+                                  (rp + rn > 0 ? (rp - rn) * (rp - rn) / (rp + rn) : 0));
+        }
+    }
+
+    // Sample indices by decreasing weight
+    struct Heavier
+    {
+        const double *weights;
+        Heavier(const double *weights) : weights(weights) {}
+        bool operator()(int a, int b) const { return weights[a] > weights[b]; }
+    };
+
+    // One round's split search state, shared read-only by the search tasks
+    struct SplitSearch
+    {
+        const PresortedSamples *presorted;
+        QVector<int> features;
+        QVector<double> positive, negative;
+        double totalPositive, totalNegative;
+        int type;
+    };
+
+    // Scans features [begin, end) of the candidate list in presorted order for the best threshold
+    static StumpSplit searchSplits(const SplitSearch *search, int begin, int end)
+    {
+        const PresortedSamples *presorted = search->presorted;
+        const int n = presorted->values.cols;
+        const double *positive = search->positive.data(), *negative = search->negative.data();
+
+        StumpSplit best;
+        for (int f=begin; f<end; f++) {
+            const int feature = search->features[f];
+            const float *values = presorted->values.ptr<float>(feature);
+            const int *order = presorted->order.ptr<int>(feature);
+            double lp = 0, ln = 0;
+            for (int k=0; k<n-1; k++) {
+                lp += positive[order[k]];
+                ln += negative[order[k]];
+                const float value = values[order[k]], next = values[order[k+1]];
+                if (value == next)
+                    continue;
+                const double criterion = splitCriterion(search->type, lp, ln, search->totalPositive - lp, search->totalNegative - ln);
+                if (criterion < best.criterion) {
+                    best.feature = feature;
+                    best.threshold = (value + next) / 2;
+                    best.criterion = criterion;
+                }
+            }
+        }
+        return best;
+    }
+
+    // Boosted stumps from presorted feature columns, with the split search parallel across features
+    void trainStumps(const Mat &samples, const Mat &labels)
+    {
+        QList<float> classes;
+        for (int i=0; i<labels.rows; i++)
+            if (!classes.contains(labels.at<float>(i, 0)))
+                classes.append(labels.at<float>(i, 0));
+        if (classes.size() != 2)
+            qFatal("Boosting requires exactly two classes, got %d.", classes.size());
+        std::sort(classes.begin(), classes.end());
+        negativeLabel = classes[0];
+        positiveLabel = classes[1];
+
+        const int n = samples.rows, dims = samples.cols;
+        QVector<float> y(n);
+        for (int i=0; i<n; i++)
+            y[i] = (labels.at<float>(i, 0) == positiveLabel) ? 1 : -1;
+
+        const PresortedSamples presorted(samples);
+        QVector<double> weights(n, 1.0 / n);
+        QVector<int> heaviest(n);
+        QVector<bool> kept(n);
+        SplitSearch search;
+        search.presorted = &presorted;
+        search.positive.resize(n);
+        search.negative.resize(n);
+        search.type = type;
+        RNG rng;
+        stumps.clear();
+        for (int round=0; round<weakCount; round++) {
+            // Normalize, then search splits over only the heaviest samples covering trimRate of the mass
+            double sum = 0;
+            for (int i=0; i<n; i++) sum += weights[i];
+            for (int i=0; i<n; i++) weights[i] /= sum;
+            if (trimRate > 0 && trimRate < 1) {
+                for (int i=0; i<n; i++) heaviest[i] = i;
+                std::sort(heaviest.begin(), heaviest.end(), Heavier(weights.data()));
+                kept.fill(false);
+                double mass = 0;
+                for (int i=0; i<n && mass < trimRate; i++) {
+                    kept[heaviest[i]] = true;
+                    mass += weights[heaviest[i]];
+                }
+            } else {
+                kept.fill(true);
+            }
+            search.totalPositive = search.totalNegative = 0;
+            for (int i=0; i<n; i++) {
+                const double w = kept[i] ? weights[i] : 0;
+                search.positive[i] = (y[i] > 0) ? w : 0;
+                search.negative[i] = (y[i] > 0) ? 0 : w;
+                search.totalPositive += search.positive[i];
+                search.totalNegative += search.negative[i];
+            }
+
+            // Optionally consider only a random subset of the features this round
+            search.features.clear();
+            for (int j=0; j<dims; j++)
+                if ((featureFraction >= 1) || (rng.uniform(0.f, 1.f) < featureFraction))
+                    search.features.append(j);
+            if (search.features.isEmpty())
+                search.features.append(rng.uniform(0, dims));
+
+            const int candidates = search.features.size();
+            const int tasks = std::min(candidates, 4 * std::max(Globals->parallelism, 1));
+            QList< QFuture<StumpSplit> > futures;
+            for (int t=0; t<tasks; t++)
+                futures.append(QtConcurrent::run(searchSplits, (const SplitSearch*) &search, t * candidates / tasks, (t+1) * candidates / tasks));
+            StumpSplit best;
+            foreach (const QFuture<StumpSplit> &future, futures)
+                if (future.result().criterion < best.criterion)
+                    best = future.result();
+            if (best.feature == -1)
+                break;
+
+            // Leaf responses from the full weight mass
+            double lp = 0, ln = 0, rp = 0, rn = 0;
+            const float *values = presorted.values.ptr<float>(best.feature);
+            for (int i=0; i<n; i++) {
+                const bool left = values[i] <= best.threshold;
+                if (y[i] > 0) (left ? lp : rp) += weights[i];
+                else          (left ? ln : rn) += weights[i];
+            }
+
+            BoostStump stump;
+            stump.feature = best.feature;
+            stump.threshold = best.threshold;
+            static const double eps = 1e-10;
+            if (type == Discrete) {
+                const double leftError = std::min(lp, ln), rightError = std::min(rp, rn);
+                const double error = std::min(std::max(leftError + rightError, eps), 1 - eps);
+                const double alpha = log((1 - error) / error);
+                stump.left = (lp >= ln) ? alpha : -alpha;
+                stump.right = (rp >= rn) ? alpha : -alpha;
+            } else if (type == Real) {
+                stump.left = 0.5 * log((lp + eps) / (ln + eps));
+                stump.right = 0.5 * log((rp + eps) / (rn + eps));
+            } else {
+                stump.left = (lp + ln > 0) ? (lp - ln) / (lp + ln) : 0;
+                stump.right = (rp + rn > 0) ? (rp - rn) / (rp + rn) : 0;
+            }
+            stumps.append(stump);
+
+            for (int i=0; i<n; i++) {
+                const float h = (values[i] <= stump.threshold) ? stump.left : stump.right;
+                if (type == Discrete) weights[i] *= ((h > 0) != (y[i] > 0)) ? exp(fabs(h)) : 1;
+                else                  weights[i] *= exp(-y[i] * h);
+            }
+        }
+    }
 
     void train(const TemplateList &data)
     {
         Mat samples = OpenCVUtils::toMat(data.data());
         Mat labels = OpenCVUtils::toMat(File::get<float>(data, inputVariable));
 
+        stumps.clear();
+        if (presort) {
+            if ((type != Logit) && (maxDepth == 1)) {
+                trainStumps(samples, labels);
+                return;
+            }
+            qWarning("Presorted boosting supports Discrete, Real and Gentle stumps, falling back to CvBoost.");
+        }
+
         Mat types = Mat(samples.cols + 1, 1, CV_8U);
         types.setTo(Scalar(CV_VAR_NUMERICAL));
         types.at<char>(samples.cols, 0) = CV_VAR_CATEGORICAL;
@@ -91,15 +347,28 @@ private:
                     params);
     }
 
+    float predict(const Mat &sample) const
+    {
+        if (!stumps.isEmpty()) {
+            const Mat continuous = sample.isContinuous() ? sample : sample.clone();
+            const float *x = continuous.ptr<float>();
+            float sum = 0;
+            foreach (const BoostStump &stump, stumps)
+                sum += stump(x);
+            if (returnConfidence)
+                return sum/weakCount;
+            return (sum > 0) ? positiveLabel : negativeLabel;
+        }
+
+        if (returnConfidence)
+            return boost.predict(sample,Mat(),Range::all(),false,true)/weakCount;
+        return boost.predict(sample);
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = src;
-        float response;
-        if (returnConfidence) {
-            response = boost.predict(src.m().reshape(1,1),Mat(),Range::all(),false,true)/weakCount;
-        } else {
-            response = boost.predict(src.m().reshape(1,1));
-        }
+        float response = predict(src.m().reshape(1,1));
 
         if (overwriteMat) {
             dst.m() = Mat(1, 1, CV_32F);
@@ -109,14 +378,34 @@ private:
         }
     }
 
+    bool classifyWindows(const Mat &image, const QList<Rect> &windows, QList<float> &responses) const
+    {
+        if (!overwriteMat)
+            return false;
+
+        // Every window is gathered into the same contiguous buffer
+        Mat sample;
+        foreach (const Rect &window, windows) {
+            Mat(image, window).convertTo(sample, CV_32F);
+            responses.append(predict(sample.reshape(1,1)));
+        }
+        return true;
+    }
+
     void load(QDataStream &stream)
     {
-        OpenCVUtils::loadModel(boost,stream);
+        // Built-in models follow a null CvBoost payload
+        QByteArray data;
+        stream >> data;
+        stumps.clear();
+        if (data.isNull()) stream >> negativeLabel >> positiveLabel >> stumps;
+        else               OpenCVUtils::loadModel(boost, data);
     }
 
     void store(QDataStream &stream) const
     {
-        OpenCVUtils::storeModel(boost,stream);
+        if (stumps.isEmpty()) OpenCVUtils::storeModel(boost,stream);
+        else                  stream << QByteArray() << negativeLabel << positiveLabel << stumps;
     }
 
 
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QVarLengthArray>
+#include <QtConcurrentRun>
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
 
@@ -22,13 +24,182 @@ using namespace cv;
 namespace br
 {
 
+// Random trees compiled into one contiguous node array for inference.
+// Children of a split are adjacent, the first is taken when sample[feature] <= threshold,
+// so a tree is walked without touching the OpenCV node structures.
+struct FlatForest
+{
+    struct Node
+    {
+        qint32 feature; // -1 for a leaf
+        float threshold;
+        qint32 child; // First child of a split, index into leaves for a leaf
+    };
+
+    struct Leaf
+    {
+        float value;
+        qint32 classIndex;
+        qint32 index; // Depth-first position of the leaf within its tree
+    };
+
+    QVector<Node> nodes;
+    QVector<Leaf> leaves;
+    QVector<qint32> roots, leafCounts;
+    qint32 classes; // 0 for regression
+
+    FlatForest() : classes(0) {}
+
+    int trees() const { return roots.size(); }
+
+    const Leaf &leaf(int tree, const float *sample) const
+    {
+        const Node *node = &nodes[roots[tree]];
+        while (node->feature >= 0)
+            node = &nodes[node->child + (sample[node->feature] > node->threshold ? 1 : 0)];
+        return leaves[node->child];
+    }
+
+    // Matches CvRTrees::predict and CvRTrees::predict_prob
+    float predict(const float *sample, bool probability) const
+    {
+        if (classes == 0) {
+            double sum = 0;
+            for (int i=0; i<trees(); i++)
+                sum += leaf(i, sample).value;
+            return sum / trees();
+        }
+
+        if (probability && (classes != 2))
+            qFatal("Confidence is only available for binary classification.");
+
+        QVarLengthArray<int, 16> votes(classes);
+        for (int i=0; i<classes; i++)
+            votes[i] = 0;
+        int maxVotes = 0;
+        float result = 0;
+        for (int i=0; i<trees(); i++) {
+            const Leaf &l = leaf(i, sample);
+            const int count = ++votes[l.classIndex];
+            if (count > maxVotes) {
+                maxVotes = count;
+                result = l.value;
+            }
+        }
+        return probability ? float(votes[1]) / trees() : result;
+    }
+
+    void append(const CvRTrees &forest)
+    {
+        for (int i=0; i<forest.get_tree_count(); i++) {
+            CvForestTree *tree = forest.get_tree(i);
+            if (tree->get_data()->is_classifier)
+                classes = tree->get_data()->get_num_classes();
+            append(tree->get_root());
+        }
+    }
+
+    void append(const FlatForest &other)
+    {
+        classes = other.classes;
+        const int nodeOffset = nodes.size(), leafOffset = leaves.size();
+        foreach (Node node, other.nodes) {
+            node.child += (node.feature >= 0) ? nodeOffset : leafOffset;
+            nodes.append(node);
+        }
+        leaves += other.leaves;
+        foreach (qint32 root, other.roots)
+            roots.append(root + nodeOffset);
+        leafCounts += other.leafCounts;
+    }
+
+private:
+    void append(const CvDTreeNode *root)
+    {
+        // Number the leaves in depth-first order
+        QHash<const CvDTreeNode*, int> leafIndex;
+        QList<const CvDTreeNode*> stack;
+        stack.append(root);
+        while (!stack.isEmpty()) {
+            const CvDTreeNode *node = stack.takeLast();
+            if (!node->left) {
+                leafIndex.insert(node, leafIndex.size());
+            } else {
+                stack.append(node->right);
+                stack.append(node->left);
+            }
+        }
+
+        // Breadth-first so siblings land next to each other
+        roots.append(nodes.size());
+        leafCounts.append(leafIndex.size());
+        QList<const CvDTreeNode*> queue;
+        queue.append(root);
+        nodes.append(Node());
+        for (int position = roots.last(); !queue.isEmpty(); position++) {
+            const CvDTreeNode *node = queue.takeFirst();
+            Node &flat = nodes[position];
+            if (!node->left) {
+                flat.feature = -1;
+                flat.threshold = 0;
+                flat.child = leaves.size();
+                Leaf l;
+                l.value = node->value;
+                l.classIndex = std::max(node->class_idx, 0);
+                l.index = leafIndex[node];
+                leaves.append(l);
+            } else {
+                // Only ordered (numerical) splits occur, an inversed split swaps the children
+                const CvDTreeSplit *split = node->split;
+                flat.feature = split->var_idx;
+                flat.threshold = split->ord.c;
+                flat.child = nodes.size();
+                queue.append(split->inversed ? node->right : node->left);
+                queue.append(split->inversed ? node->left : node->right);
+                nodes.append(Node());
+                nodes.append(Node());
+            }
+        }
+    }
+};
+
+QDataStream &operator<<(QDataStream &stream, const FlatForest::Node &node)
+{
+    return stream << node.feature << node.threshold << node.child;
+}
+
+QDataStream &operator>>(QDataStream &stream, FlatForest::Node &node)
+{
+    return stream >> node.feature >> node.threshold >> node.child;
+}
+
+QDataStream &operator<<(QDataStream &stream, const FlatForest::Leaf &leaf)
+{
+    return stream << leaf.value << leaf.classIndex << leaf.index;
+}
+
+QDataStream &operator>>(QDataStream &stream, FlatForest::Leaf &leaf)
+{
+    return stream >> leaf.value >> leaf.classIndex >> leaf.index;
+}
+
+QDataStream &operator<<(QDataStream &stream, const FlatForest &forest)
+{
+    return stream << forest.nodes << forest.leaves << forest.roots << forest.leafCounts << forest.classes;
+}
+
+QDataStream &operator>>(QDataStream &stream, FlatForest &forest)
+{
+    return stream >> forest.nodes >> forest.leaves >> forest.roots >> forest.leafCounts >> forest.classes;
+}
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV's random trees framework
  * \author Scott Klum \cite sklum
  * \brief http://docs.opencv.org/modules/ml/doc/random_trees.html
  */
-class ForestTransform : public Transform
+class ForestTransform : public Transform, public WindowClassifier
 {
     Q_OBJECT
 
@@ -41,13 +212,7 @@ class ForestTransform : public Transform
     {
         dst = src;
 
-        float response;
-        if (classification && returnConfidence) {
-            // Fuzzy class label
-            response = forest.predict_prob(src.m().reshape(1,1));
-        } else {
-            response = forest.predict(src.m().reshape(1,1));
-        }
+        float response = predict(src.m().reshape(1,1));
 
         if (overwriteMat) {
             dst.m() = Mat(1, 1, CV_32F);
@@ -57,14 +222,38 @@ class ForestTransform : public Transform
         }
     }
 
+    bool classifyWindows(const Mat &image, const QList<Rect> &windows, QList<float> &responses) const
+    {
+        if (!overwriteMat)
+            return false;
+
+        // Every window is gathered into the same contiguous buffer
+        Mat sample;
+        foreach (const Rect &window, windows) {
+            Mat(image, window).convertTo(sample, CV_32F);
+            responses.append(predict(sample.reshape(1,1)));
+        }
+        return true;
+    }
+
     void load(QDataStream &stream)
     {
-        OpenCVUtils::loadModel(forest,stream);
+        // Models from before the flattened layout hold a serialized CvRTrees instead of a null marker
+        QByteArray legacy;
+        stream >> legacy;
+        if (legacy.isNull()) {
+            stream >> flat;
+        } else {
+            CvRTrees forest;
+            OpenCVUtils::loadModel(forest, legacy);
+            flat = FlatForest();
+            flat.append(forest);
+        }
     }
 
     void store(QDataStream &stream) const
     {
-        OpenCVUtils::storeModel(forest,stream);
+        stream << QByteArray() << flat;
     }
 
     void init()
@@ -105,7 +294,27 @@ protected:
     BR_PROPERTY(bool, weight, false)
     BR_PROPERTY(TerminationCriteria, termCrit, Iter)
 
-    CvRTrees forest;
+    FlatForest flat;
+
+    float predict(const Mat &sample) const
+    {
+        if (sample.type() != CV_32FC1)
+            qFatal("Requires single channel 32-bit floating point samples.");
+        const Mat continuous = sample.isContinuous() ? sample : sample.clone();
+        return flat.predict(continuous.ptr<float>(), classification && returnConfidence); // Fuzzy class label
+    }
+
+    // Each job builds its CvRTrees on the worker thread so the forest draws from that thread's RNG
+    static FlatForest trainTrees(const Mat &samples, const Mat &labels, const Mat &types, const CvRTParams &params, int seed)
+    {
+        if (seed != 0)
+            theRNG() = RNG(uint64(seed) * 0x9E3779B97F4A7C15ULL);
+        CvRTrees forest;
+        forest.train(samples, CV_ROW_SAMPLE, labels, Mat(), Mat(), types, Mat(), params);
+        FlatForest result;
+        result.append(forest);
+        return result;
+    }
 
     void trainForest(const TemplateList &data)
     {
@@ -130,21 +339,35 @@ protected:
         }
 
         int minSamplesForSplit = data.size()*splitPercentage;
-        forest.train( samples, CV_ROW_SAMPLE, labels, Mat(), Mat(), types, Mat(),
-                    CvRTParams(maxDepth,
-                               minSamplesForSplit,
-                               0,
-                               false,
-                               2,
-                               usePrior ? priors : 0,
-                               false,
-                               0,
-                               maxTrees,
-                               forestAccuracy,
-                               termCrit));
+        CvRTParams params(maxDepth,
+                                minSamplesForSplit,
+                                0,
+                                false,
+                                2,
+                                usePrior ? priors : 0,
+                                false,
+                                0,
+                                maxTrees,
+                                forestAccuracy,
+                                termCrit);
+
+        // Trees are independent when the only stopping rule is the tree count, so train them as parallel jobs
+        const int jobs = (termCrit == Iter) ? std::max(std::min(Globals->parallelism, maxTrees), 1) : 1;
+        flat = FlatForest();
+        if (jobs == 1) {
+            flat = trainTrees(samples, labels, types, params, 0);
+        } else {
+            QList< QFuture<FlatForest> > futures;
+            for (int i=0; i<jobs; i++) {
+                params.term_crit.max_iter = maxTrees / jobs + (i < maxTrees % jobs ? 1 : 0);
+                futures.append(QtConcurrent::run(trainTrees, samples, labels, types, params, i+1));
+            }
+            foreach (const QFuture<FlatForest> &future, futures)
+                flat.append(future.result());
+        }
 
         if (Globals->verbose) {
-            qDebug() << "Number of trees:" << forest.get_tree_count();
+            qDebug() << "Number of trees:" << flat.trees();
 
             if (classification) {
                 QTime timer;
@@ -152,8 +375,8 @@ protected:
                 int correctClassification = 0;
                 float regressionError = 0;
                 for (int i=0; i<samples.rows; i++) {
-                    float prediction = forest.predict_prob(samples.row(i));
-                    int label = forest.predict(samples.row(i));
+                    float prediction = flat.predict(samples.ptr<float>(i), true);
+                    int label = flat.predict(samples.ptr<float>(i), false);
                     if (label == labels.at<float>(i,0)) {
                         correctClassification++;
                     }
@@ -184,83 +407,42 @@ class ForestInductionTransform : public ForestTransform
     Q_PROPERTY(bool useRegressionValue READ get_useRegressionValue WRITE set_useRegressionValue RESET reset_useRegressionValue STORED false)
     BR_PROPERTY(bool, useRegressionValue, false)
 
-    int totalSize;
-    QList< QList<const CvDTreeNode*> > nodes;
-
-    void fillNodes()
-    {
-        for (int i=0; i<forest.get_tree_count(); i++) {
-            nodes.append(QList<const CvDTreeNode*>());
-            const CvDTreeNode* node = forest.get_tree(i)->get_root();
-
-            // traverse the tree and save all the nodes in depth-first order
-            for(;;)
-            {
-                CvDTreeNode* parent;
-                for(;;)
-                {
-                    if( !node->left )
-                        break;
-                    node = node->left;
-                }
-
-                nodes.last().append(node);
-
-                for( parent = node->parent; parent && parent->right == node;
-                    node = parent, parent = parent->parent )
-                    ;
-
-                if( !parent )
-                    break;
-
-                node = parent->right;
-            }
-
-            totalSize += nodes.last().size();
-        }
-    }
-
-    void train(const TemplateList &data)
-    {
-        trainForest(data);
-        if (!useRegressionValue) fillNodes();
-    }
-
     void project(const Template &src, Template &dst) const
     {
         dst = src;
 
+        Mat sample = src.m().reshape(1,1);
+        if (!sample.isContinuous()) sample = sample.clone();
+        const float *x = sample.ptr<float>();
+
         Mat responses;
 
         if (useRegressionValue) {
-            responses = Mat::zeros(forest.get_tree_count(),1,CV_32F);
-            for (int i=0; i<forest.get_tree_count(); i++) {
-                responses.at<float>(i,0) = forest.get_tree(i)->predict(src.m().reshape(1,1))->value;
+            responses = Mat::zeros(flat.trees(),1,CV_32F);
+            for (int i=0; i<flat.trees(); i++) {
+                responses.at<float>(i,0) = flat.leaf(i, x).value;
             }
         } else {
+            int totalSize = 0;
+            for (int i=0; i<flat.trees(); i++)
+                totalSize += flat.leafCounts[i];
             responses = Mat::zeros(totalSize,1,CV_32F);
             int offset = 0;
-            for (int i=0; i<nodes.size(); i++) {
-                int index = nodes[i].indexOf(forest.get_tree(i)->predict(src.m().reshape(1,1)));
-                responses.at<float>(offset+index,0) = 1;
-                offset += nodes[i].size();
+            for (int i=0; i<flat.trees(); i++) {
+                responses.at<float>(offset+flat.leaf(i, x).index,0) = 1;
+                offset += flat.leafCounts[i];
             }
         }
 
         dst.m() = responses;
     }
 
-    void load(QDataStream &stream)
+    // Responses are feature vectors, not a single score
+    bool classifyWindows(const Mat &, const QList<Rect> &, QList<float> &) const
     {
-        OpenCVUtils::loadModel(forest,stream);
-        if (!useRegressionValue) fillNodes();
-
+        return false;
     }
 
-    void store(QDataStream &stream) const
-    {
-        OpenCVUtils::storeModel(forest,stream);
-    }
 };
 
 BR_REGISTER(Transform, ForestInductionTransform)
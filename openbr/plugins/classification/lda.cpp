@@ -23,6 +23,7 @@
 #include <openbr/core/common.h>
 #include <openbr/core/eigenutils.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -45,25 +46,155 @@ class EigenInitializer : public Initializer
 
 BR_REGISTER(Initializer, EigenInitializer)
 
+// Training samples as the columns of consecutive blocks of at most blockSize, regrouped from a template iterator
+class SampleBlocks
+{
+    TemplateIterator &data;
+    const int blockSize;
+    TemplateList pending;
+    bool done;
+
+public:
+    int rows, dims;
+
+    SampleBlocks(TemplateIterator &data, int blockSize)
+        : data(data), blockSize(std::max(blockSize, 1)), done(true), rows(-1), dims(-1) {}
+
+    void rewind()
+    {
+        data.rewind();
+        pending.clear();
+        done = false;
+    }
+
+    bool next(Eigen::MatrixXf &block)
+    {
+        TemplateList more;
+        while ((pending.size() < blockSize) && !done) {
+            if (data.next(more)) pending.append(more);
+            else                 done = true;
+        }
+        const TemplateList samples = pending.mid(0, blockSize);
+        pending = pending.mid(samples.size());
+        if (samples.isEmpty())
+            return false;
+
+        if (dims == -1) {
+            rows = samples.first().m().rows;
+            dims = samples.first().m().rows * samples.first().m().cols;
+        }
+
+        block.resize(dims, samples.size());
+        for (int i=0; i<samples.size(); i++) {
+            const cv::Mat &m = samples[i].m();
+            if ((m.type() != CV_32FC1) || (m.rows * m.cols != dims) || !m.isContinuous())
+                qFatal("Requires continuous single channel 32-bit floating point matrices of equal size.");
+            block.col(i) = Eigen::Map<const Eigen::VectorXf>(m.ptr<float>(), dims);
+        }
+        return true;
+    }
+};
+
+// Columns [begin, end) of a batched subspace projection
+static void projectColumns(const TemplateList *src, const Eigen::MatrixXf *projection, bool transposed, const Eigen::VectorXf *mean, cv::Mat *dst, int begin, int end)
+{
+    const int dimsIn = mean->rows();
+    Eigen::MatrixXf block(dimsIn, end-begin);
+    for (int i=begin; i<end; i++)
+        block.col(i-begin) = Eigen::Map<const Eigen::VectorXf>(src->at(i).m().ptr<float>(), dimsIn) - *mean;
+
+    // Row i of dst holds the projection of template i, i.e. a column-major dimsOut x N matrix
+    const int dimsOut = dst->cols;
+    Eigen::Map<Eigen::MatrixXf> outMap(dst->ptr<float>(begin), dimsOut, end-begin);
+    if (transposed) outMap.noalias() = projection->transpose() * block;
+    else            outMap.noalias() = *projection * block;
+}
+
+#ifdef BR_WITH_OPENCL
+// The whole batch as one product on the GPU against the projection resident in device
+static void projectDevice(const TemplateList &src, const Eigen::MatrixXf &projection, bool transposed, const Eigen::VectorXf &mean, OpenCVUtils::DeviceMatrix &device, cv::Mat &features)
+{
+    const int dimsIn = mean.rows();
+    cv::Mat centered(src.size(), dimsIn, CV_32FC1);
+    for (int i=0; i<src.size(); i++)
+        Eigen::Map<Eigen::RowVectorXf>(centered.ptr<float>(i), dimsIn) = Eigen::Map<const Eigen::RowVectorXf>(src[i].m().ptr<float>(), dimsIn) - mean.transpose();
+
+    // The column-major projection is its row-major transpose
+    const cv::Mat resident(projection.cols(), projection.rows(), CV_32FC1, (void*) projection.data());
+    device.multiply(centered, resident, transposed, features);
+}
+#endif // BR_WITH_OPENCL
+
+// Projects a whole template list as matrix-matrix products into rows of one preallocated feature matrix,
+// returns false if the templates aren't uniformly sized single channel floating point vectors
+static bool projectBatch(const TemplateList &src, TemplateList &dst, const Eigen::MatrixXf &projection, bool transposed, const Eigen::VectorXf &mean, OpenCVUtils::DeviceMatrix *device = NULL)
+{
+    if (src.size() < 2)
+        return false;
+    foreach (const Template &t, src)
+        if (t.isEmpty() || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (t.m().rows * t.m().cols != mean.rows()))
+            return false;
+
+    cv::Mat features(src.size(), transposed ? projection.cols() : projection.rows(), CV_32FC1);
+    static const int blockSize = 256;
+#ifdef BR_WITH_OPENCL
+    if (device && OpenCVUtils::openCLAvailable()) {
+        projectDevice(src, projection, transposed, mean, *device, features);
+    } else
+#else // BR_WITH_OPENCL
+    (void) device;
+#endif // BR_WITH_OPENCL
+    if ((Globals->parallelism > 1) && (src.size() > blockSize)) {
+        TaskGroup tasks;
+        for (int begin=0; begin<src.size(); begin+=blockSize)
+            tasks.run(projectColumns, &src, &projection, transposed, &mean, &features, begin, std::min(begin+blockSize, src.size()));
+        tasks.wait();
+    } else {
+        projectColumns(&src, &projection, transposed, &mean, &features, 0, src.size());
+    }
+
+    dst.reserve(dst.size() + src.size());
+    for (int i=0; i<src.size(); i++)
+        dst.append(Template(src[i].file, features.row(i)));
+    return true;
+}
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
+ *
+ * For training sets too large for a dense eigendecomposition, \em method selects a
+ * randomized SVD (Halko et al.) or an incremental SVD (Ross et al.) that both consume
+ * the samples \em blockSize at a time, so memory is bounded by the block and the subspace.
+ * Setting \em trainingGallery streams the samples from that gallery instead of the training set.
  * \author Brendan Klare \cite bklare
  * \author Josh Klontz \cite jklontz
  */
 class PCATransform : public Transform
 {
     Q_OBJECT
+    Q_ENUMS(Method)
     friend class DFFSTransform;
     friend class LDATransform;
 
+public:
+    enum Method { Exact,
+                  Randomized,
+                  Incremental };
+
 protected:
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
     Q_PROPERTY(int drop READ get_drop WRITE set_drop RESET reset_drop STORED false)
     Q_PROPERTY(bool whiten READ get_whiten WRITE set_whiten RESET reset_whiten STORED false)
+    Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+    Q_PROPERTY(int rank READ get_rank WRITE set_rank RESET reset_rank STORED false)
+    Q_PROPERTY(int blockSize READ get_blockSize WRITE set_blockSize RESET reset_blockSize STORED false)
+    Q_PROPERTY(int oversample READ get_oversample WRITE set_oversample RESET reset_oversample STORED false)
+    Q_PROPERTY(int powerIterations READ get_powerIterations WRITE set_powerIterations RESET reset_powerIterations STORED false)
+    Q_PROPERTY(QString trainingGallery READ get_trainingGallery WRITE set_trainingGallery RESET reset_trainingGallery STORED false)
 
     /*!
-     *     keep <  0: All eigenvalues are retained.
+     *     keep <  0: All eigenvalues are retained, only supported by the Exact method.
      *     keep =  0: No PCA performed, eigenvectors form an identity matrix.
      * 0 < keep <  1: Fraction of the variance to retain.
      *     keep >= 1: Number of leading eigenvectors to retain.
@@ -71,14 +202,40 @@ protected:
     BR_PROPERTY(float, keep, 0.95)
     BR_PROPERTY(int, drop, 0)
     BR_PROPERTY(bool, whiten, false)
+    BR_PROPERTY(Method, method, Exact)
+    BR_PROPERTY(int, rank, 256) // Leading eigenvectors approximated when keep is a fraction
+    BR_PROPERTY(int, blockSize, 4096)
+    BR_PROPERTY(int, oversample, 10)
+    BR_PROPERTY(int, powerIterations, 2)
+    BR_PROPERTY(QString, trainingGallery, QString())
 
     Eigen::VectorXf mean, eVals;
     Eigen::MatrixXf eVecs;
 
     int originalRows;
 
+#ifdef BR_WITH_OPENCL
+    mutable OpenCVUtils::DeviceMatrix device;
+#endif // BR_WITH_OPENCL
+
+    OpenCVUtils::DeviceMatrix *projectionDevice() const
+    {
+#ifdef BR_WITH_OPENCL
+        return &device;
+#else // BR_WITH_OPENCL
+        return NULL;
+#endif // BR_WITH_OPENCL
+    }
+
+    void invalidateProjectionDevice()
+    {
+#ifdef BR_WITH_OPENCL
+        device.invalidate();
+#endif // BR_WITH_OPENCL
+    }
+
 public:
-    PCATransform() : keep(0.95), drop(0), whiten(false) {}
+    PCATransform() : keep(0.95), drop(0), whiten(false), method(Exact), rank(256), blockSize(4096), oversample(10), powerIterations(2) {}
 
 private:
     double residualReconstructionError(const Template &src) const
@@ -94,6 +251,45 @@ private:
 
     void train(const TemplateList &trainingSet)
     {
+        invalidateProjectionDevice();
+        if (trainingGallery.isEmpty() && ((method == Exact) || (keep == 0))) {
+            trainExact(trainingSet);
+            return;
+        }
+
+        TemplateIterator data(trainingSet);
+        train(data);
+    }
+
+    void train(TemplateIterator &trainingData)
+    {
+        invalidateProjectionDevice();
+        QScopedPointer<TemplateIterator> gallery(trainingGallery.isEmpty() ? NULL : new TemplateIterator(File(trainingGallery)));
+        TemplateIterator &data = gallery.isNull() ? trainingData : *gallery;
+        if ((method == Exact) || (keep == 0)) {
+            trainExact(data.readAll());
+            return;
+        }
+
+        // The approximate solvers estimate at most rank eigenvectors, so they can't retain all of them
+        if (keep < 0)
+            qFatal("PCA keep must not be negative with the %s method, use keep = rank instead.", method == Randomized ? "Randomized" : "Incremental");
+
+        SampleBlocks samples(data, blockSize);
+        if (method == Randomized) trainRandomized(samples);
+        else                      trainIncremental(samples);
+    }
+
+    // The approximate solvers make several passes, a separate training gallery leaves the data unread
+    bool trainsInOnePass() const
+    {
+        return (method == Exact) || (keep == 0) || !trainingGallery.isEmpty();
+    }
+
+    void trainExact(const TemplateList &trainingSet)
+    {
+        if (trainingSet.isEmpty())
+            qFatal("Empty PCA training set.");
         if (trainingSet.first().m().type() != CV_32FC1)
             qFatal("Requires single channel 32-bit floating point matrices.");
 
@@ -109,6 +305,158 @@ private:
         trainCore(data);
     }
 
+    // Number of leading eigenvectors the approximate solvers need to estimate
+    int components(int dimsIn, int instances) const
+    {
+        const int wanted = (keep >= 1) ? int(keep) + drop : rank;
+        return std::max(std::min(wanted, std::min(dimsIn, instances)), 1);
+    }
+
+    static Eigen::MatrixXd orthonormalize(const Eigen::MatrixXd &m)
+    {
+        Eigen::HouseholderQR<Eigen::MatrixXd> qr(m);
+        return qr.householderQ() * Eigen::MatrixXd::Identity(m.rows(), m.cols());
+    }
+
+    // Randomized range finder with power iterations, one pass over the data per product
+    void trainRandomized(SampleBlocks &samples)
+    {
+        // First pass, mean and total variance
+        Eigen::VectorXd sum;
+        double sumSquares = 0;
+        int instances = 0;
+        Eigen::MatrixXf block;
+        samples.rewind();
+        while (samples.next(block)) {
+            if (instances == 0) sum = Eigen::VectorXd::Zero(samples.dims);
+            sum += block.rowwise().sum().cast<double>();
+            sumSquares += block.cast<double>().squaredNorm();
+            instances += block.cols();
+        }
+        if (instances < 2)
+            qFatal("PCA requires at least two training samples.");
+
+        const int dimsIn = samples.dims;
+        originalRows = samples.rows;
+        mean = (sum / instances).cast<float>();
+        const double totalEnergy = (sumSquares - instances * (sum / instances).squaredNorm()) / (instances - 1.0);
+
+        const int k = components(dimsIn, instances);
+        const int l = std::min(k + oversample, std::min(dimsIn, instances));
+
+        // Y = A * Omega, with the Gaussian test matrix drawn block by block as the samples arrive
+        cv::RNG rng(0xffffffff);
+        Eigen::MatrixXd Y = Eigen::MatrixXd::Zero(dimsIn, l);
+        samples.rewind();
+        while (samples.next(block)) {
+            block.colwise() -= mean;
+            cv::Mat omega(block.cols(), l, CV_32FC1);
+            rng.fill(omega, cv::RNG::NORMAL, 0, 1);
+            Y += (block * Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >(omega.ptr<float>(), block.cols(), l)).cast<double>();
+        }
+
+        // Power iterations, Y = A * A^T * Q
+        for (int q=0; q<powerIterations; q++) {
+            const Eigen::MatrixXf Q = orthonormalize(Y).cast<float>();
+            Y.setZero();
+            samples.rewind();
+            while (samples.next(block)) {
+                block.colwise() -= mean;
+                Y += (block * (block.transpose() * Q)).cast<double>();
+            }
+        }
+
+        // B * B^T = Q^T * A * A^T * Q, whose eigenvectors rotate Q onto the principal axes
+        const Eigen::MatrixXd Q = orthonormalize(Y);
+        const Eigen::MatrixXf Qf = Q.cast<float>();
+        Eigen::MatrixXd BBt = Eigen::MatrixXd::Zero(l, l);
+        samples.rewind();
+        while (samples.next(block)) {
+            block.colwise() -= mean;
+            const Eigen::MatrixXd B = (Qf.transpose() * block).cast<double>();
+            BBt += B * B.transpose();
+        }
+
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(BBt);
+        selectEigenvectors(eSolver.eigenvalues() / (instances - 1.0), Q * eSolver.eigenvectors(), totalEnergy);
+    }
+
+    // Incremental SVD with a mean update, one pass over the data
+    void trainIncremental(SampleBlocks &samples)
+    {
+        Eigen::VectorXd runningMean, singularValues;
+        Eigen::MatrixXd basis;
+        double sumSquares = 0;
+        int instances = 0, k = 0;
+        Eigen::MatrixXf block;
+        samples.rewind();
+        while (samples.next(block)) {
+            const int dimsIn = samples.dims;
+            const int n = block.cols();
+            if (instances == 0) {
+                runningMean = Eigen::VectorXd::Zero(dimsIn);
+                basis = Eigen::MatrixXd(dimsIn, 0);
+                singularValues = Eigen::VectorXd(0);
+                k = (keep >= 1) ? int(keep) + drop : rank;
+                k = std::max(std::min(k, dimsIn), 1);
+            }
+
+            const Eigen::MatrixXd X = block.cast<double>();
+            sumSquares += X.squaredNorm();
+            const Eigen::VectorXd blockMean = X.rowwise().sum() / n;
+            const int total = instances + n;
+
+            // [U*S, X - blockMean, mean correction] spans the updated scatter
+            const int m = basis.cols() + n + 1;
+            Eigen::MatrixXd M(dimsIn, m);
+            M.leftCols(basis.cols()) = basis * singularValues.asDiagonal();
+            M.middleCols(basis.cols(), n) = X.colwise() - blockMean;
+            M.col(m-1) = sqrt(double(instances) * n / total) * (blockMean - runningMean);
+            runningMean = (instances * runningMean + n * blockMean) / total;
+            instances = total;
+
+            // Eigendecomposition of whichever Gram matrix of M is smaller
+            Eigen::VectorXd lambda;
+            Eigen::MatrixXd U;
+            if (dimsIn <= m) {
+                Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(M * M.transpose());
+                lambda = eSolver.eigenvalues();
+                U = eSolver.eigenvectors();
+            } else {
+                Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(M.transpose() * M);
+                lambda = eSolver.eigenvalues();
+                U = M * eSolver.eigenvectors();
+            }
+
+            // Keep the k largest (eigenvalues are in increasing order)
+            const int kept = std::min(k, int(lambda.rows()));
+            basis = Eigen::MatrixXd(dimsIn, kept);
+            singularValues = Eigen::VectorXd(kept);
+            for (int i=0; i<kept; i++) {
+                const int index = lambda.rows() - (i+1);
+                singularValues(i) = sqrt(std::max(lambda(index), 0.0));
+                const double norm = U.col(index).norm();
+                basis.col(i) = (norm > 0) ? Eigen::VectorXd(U.col(index) / norm) : Eigen::VectorXd::Zero(dimsIn);
+            }
+        }
+        if (instances < 2)
+            qFatal("PCA requires at least two training samples.");
+
+        originalRows = samples.rows;
+        mean = runningMean.cast<float>();
+        const double totalEnergy = (sumSquares - instances * runningMean.squaredNorm()) / (instances - 1.0);
+
+        // Back to increasing order for selectEigenvectors
+        const int kept = singularValues.rows();
+        Eigen::VectorXd allEVals(kept);
+        Eigen::MatrixXd allEVecs(basis.rows(), kept);
+        for (int i=0; i<kept; i++) {
+            allEVals(kept-(i+1)) = singularValues(i) * singularValues(i) / (instances - 1.0);
+            allEVecs.col(kept-(i+1)) = basis.col(i);
+        }
+        selectEigenvectors(allEVals, allEVecs, totalEnergy);
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = cv::Mat(1, keep, CV_32FC1);
@@ -121,6 +469,12 @@ private:
         outMap = eVecs.transpose() * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectBatch(src, dst, eVecs, true, mean, projectionDevice()))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << keep << drop << whiten << originalRows << mean << eVals << eVecs;
@@ -129,6 +483,7 @@ private:
     void load(QDataStream &stream)
     {
         stream >> keep >> drop >> whiten >> originalRows >> mean >> eVals >> eVecs;
+        invalidateProjectionDevice();
     }
 
 protected:
@@ -146,9 +501,7 @@ protected:
             for (int i=0; i<dimsIn; i++) data.row(i).array() -= mean(i);
 
             // Calculate covariance matrix
-            Eigen::MatrixXd cov;
-            if (dominantEigenEstimation) cov = data.transpose() * data / (instances-1.0);
-            else                         cov = data * data.transpose() / (instances-1.0);
+            const Eigen::MatrixXd cov = EigenUtils::scatter(data, dominantEigenEstimation) / (instances-1.0);
 
             // Compute eigendecomposition. Returns eigenvectors/eigenvalues in increasing order by eigenvalue.
             Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(cov);
@@ -162,11 +515,17 @@ protected:
             allEVals = Eigen::VectorXd::Ones(dimsIn);
         }
 
+        selectEigenvectors(allEVals, allEVecs, allEVals.sum());
+    }
+
+    // Eigenvalues and eigenvectors in increasing order by eigenvalue, totalEnergy being the data's total variance
+    void selectEigenvectors(const Eigen::VectorXd &allEVals, const Eigen::MatrixXd &allEVecs, double totalEnergy)
+    {
+        const int dimsIn = allEVecs.rows();
         if (keep <= 0) {
-            keep = dimsIn - drop;
+            keep = allEVals.rows() - drop;
         } else if (keep < 1) {
             // Keep eigenvectors that retain a certain energy percentage.
-            const double totalEnergy = allEVals.sum();
             if (totalEnergy == 0) {
                 keep = 0;
             } else {
@@ -176,6 +535,8 @@ protected:
                     currentEnergy += allEVals(allEVals.rows()-(i+1));
                     i++;
                 }
+                if (currentEnergy / totalEnergy < keep)
+                    qWarning("Only %g of the variance is in the %d approximated eigenvectors, consider a larger rank.", currentEnergy / totalEnergy, i);
                 keep = i - drop;
             }
         } else {
@@ -254,6 +615,16 @@ class RowWisePCATransform : public PCATransform
         PCATransform::trainCore(data);
     }
 
+    void train(TemplateIterator &data)
+    {
+        train(data.readAll());
+    }
+
+    bool trainsInOnePass() const
+    {
+        return true;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = cv::Mat(src.m().rows, keep, CV_32FC1);
@@ -343,28 +714,69 @@ class LDATransform : public Transform
     Eigen::MatrixXf projection;
     float stdDev;
 
-    void train(const TemplateList &_trainingSet)
+#ifdef BR_WITH_OPENCL
+    mutable OpenCVUtils::DeviceMatrix device;
+#endif // BR_WITH_OPENCL
+
+    OpenCVUtils::DeviceMatrix *projectionDevice() const
     {
+#ifdef BR_WITH_OPENCL
+        return &device;
+#else // BR_WITH_OPENCL
+        return NULL;
+#endif // BR_WITH_OPENCL
+    }
+
+    void invalidateProjectionDevice()
+    {
+#ifdef BR_WITH_OPENCL
+        device.invalidate();
+#endif // BR_WITH_OPENCL
+    }
+
+    void train(const TemplateList &trainingSet)
+    {
+        TemplateIterator data(trainingSet);
+        train(data);
+    }
+
+    // Separate passes over the data for the labels, the PCA subspace, the PCA projected samples and,
+    // when binary, the normalization, so only the labels and projected samples are held in memory
+    void train(TemplateIterator &data)
+    {
+        invalidateProjectionDevice();
         // creates "Label"
-        TemplateList trainingSet = TemplateList::relabel(_trainingSet, inputVariable, isBinary);
-        int instances = trainingSet.size();
+        TemplateList labels, block;
+        data.rewind();
+        while (data.next(block))
+            foreach (const Template &t, block)
+                labels.append(Template(t.file));
+        labels = TemplateList::relabel(labels, inputVariable, isBinary);
 
         // Perform PCA dimensionality reduction
         PCATransform pca;
         pca.keep = pcaKeep;
         pca.whiten = pcaWhiten;
-        pca.train(trainingSet);
+        pca.train(data);
         mean = pca.mean;
 
         TemplateList ldaTrainingSet;
-        static_cast<Transform*>(&pca)->project(trainingSet, ldaTrainingSet);
+        data.rewind();
+        while (data.next(block)) {
+            TemplateList projected;
+            static_cast<Transform*>(&pca)->project(block, projected);
+            ldaTrainingSet.append(projected);
+        }
 
+        const int instances = ldaTrainingSet.size();
+        if (instances != labels.size())
+            qFatal("LDA training data changed between passes.");
         int dimsIn = ldaTrainingSet.first().m().rows * ldaTrainingSet.first().m().cols;
 
         // OpenBR ensures that class values range from 0 to numClasses-1.
         // Label exists because we created it earlier with relabel
-        QList<int> classes = File::get<int>(trainingSet, "Label");
-        QMap<int, int> classCounts = trainingSet.countValues<int>("Label");
+        QList<int> classes = File::get<int>(labels, "Label");
+        QMap<int, int> classCounts = labels.countValues<int>("Label");
         const int numClasses = classCounts.size();
 
         // Map Eigen into OpenCV
@@ -486,19 +898,22 @@ class LDATransform : public Transform
             assert(dimsOut == 1);
             float posVal = 0;
             float negVal = 0;
-            Eigen::MatrixXf results(trainingSet.size(),1);
-            for (int i = 0; i < trainingSet.size(); i++) {
-                Template t;
-                project(trainingSet[i],t);
-                //Note: the positive class is assumed to be 0 b/c it will
-                // typically be the first gallery template in the TemplateList structure
-                if (classes[i] == 0)
-                    posVal += t.m().at<float>(0,0);
-                else if (classes[i] == 1)
-                    negVal += t.m().at<float>(0,0);
-                else
-                    qFatal("Binary mode only supports two class problems.");
-                results(i) = t.m().at<float>(0,0);  //used for normalization
+            Eigen::MatrixXf results(instances,1);
+            data.rewind();
+            for (int i = 0; data.next(block);) {
+                for (int j = 0; j < block.size(); i++, j++) {
+                    Template t;
+                    project(block[j],t);
+                    //Note: the positive class is assumed to be 0 b/c it will
+                    // typically be the first gallery template in the TemplateList structure
+                    if (classes[i] == 0)
+                        posVal += t.m().at<float>(0,0);
+                    else if (classes[i] == 1)
+                        negVal += t.m().at<float>(0,0);
+                    else
+                        qFatal("Binary mode only supports two class problems.");
+                    results(i) = t.m().at<float>(0,0);  //used for normalization
+                }
             }
             posVal /= classCounts[0];
             negVal /= classCounts[1];
@@ -511,10 +926,15 @@ class LDATransform : public Transform
             }
 
             if (normalize)
-                stdDev = sqrt(results.array().square().sum() / trainingSet.size());
+                stdDev = sqrt(results.array().square().sum() / instances);
         }
     }
 
+    bool trainsInOnePass() const
+    {
+        return false;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = cv::Mat(1, dimsOut, CV_32FC1);
@@ -529,6 +949,17 @@ class LDATransform : public Transform
             dst.m().at<float>(0,0) = dst.m().at<float>(0,0) / stdDev;
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectBatch(src, dst, projection, true, mean, projectionDevice())) {
+            Transform::project(src, dst);
+            return;
+        }
+        if (normalize && isBinary)
+            for (int i=0; i<dst.size(); i++)
+                dst[i].m().at<float>(0,0) /= stdDev;
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
@@ -551,6 +982,7 @@ class LDATransform : public Transform
         stream >> projection;
         if (normalize && isBinary)
             stream >> stdDev;
+        invalidateProjectionDevice();
     }
 };
 
@@ -764,9 +1196,7 @@ class WCDATransform : public Transform
         data.colwise() -= mean;
 
         // Calculate and normalize covariance matrix
-        MatrixXf cov;
-        if (dominantEigenEstimation) cov = data.transpose() * data;
-        else                         cov = data * data.transpose();
+        MatrixXf cov = EigenUtils::scatter(data, dominantEigenEstimation);
         cov /= (instances-1);
 
         // Compute eigendecomposition, returning eigenvectors/eigenvalues in increasing order by eigenvalue.
@@ -811,6 +1241,12 @@ class WCDATransform : public Transform
         outMap = projection * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectBatch(src, dst, projection, false, mean))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << mean << compressed << a << b;
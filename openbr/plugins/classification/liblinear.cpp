@@ -1,4 +1,6 @@
 #include <QTemporaryFile>
+#include <QVarLengthArray>
+#include <QtConcurrentRun>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 
@@ -45,6 +47,50 @@ static void loadModel(model &m, QDataStream &stream)
     m = *load_model(qPrintable(tempFile.fileName()));
 }
 
+// One class against the rest, returns that class's weight vector
+static QVector<double> trainOneVsRest(const problem *prob, const parameter *param, double label)
+{
+    QVector<double> y(prob->l);
+    for (int i=0; i<prob->l; i++)
+        y[i] = (prob->y[i] == label) ? 1 : -1;
+
+    problem sub = *prob;
+    sub.y = y.data();
+    model *binary = train_svm(&sub, param);
+
+    // The binary weights favor binary->label[0]
+    const double sign = (binary->label[0] == 1) ? 1 : -1;
+    QVector<double> w(prob->n);
+    for (int j=0; j<prob->n; j++)
+        w[j] = sign * binary->w[j];
+    free_and_destroy_model(&binary);
+    return w;
+}
+
+// Equivalent to liblinear's one-vs-rest training with the classes solved in parallel
+static model *trainParallel(const problem *prob, const parameter *param, const QList<double> &classes)
+{
+    QList< QFuture< QVector<double> > > futures;
+    foreach (double label, classes)
+        futures.append(QtConcurrent::run(trainOneVsRest, prob, param, label));
+
+    // Allocated as liblinear would, so the model can be saved and freed by it
+    model *m = (model*) malloc(sizeof(model));
+    m->param = *param;
+    m->nr_class = classes.size();
+    m->nr_feature = prob->n;
+    m->bias = prob->bias;
+    m->label = (int*) malloc(sizeof(int) * classes.size());
+    m->w = (double*) malloc(sizeof(double) * prob->n * classes.size());
+    for (int k=0; k<classes.size(); k++) {
+        m->label[k] = int(classes[k]);
+        const QVector<double> w = futures[k].result();
+        for (int j=0; j<prob->n; j++)
+            m->w[j*classes.size() + k] = w[j];
+    }
+    return m;
+}
+
 class Linear : public Transform
 {
     Q_OBJECT
@@ -80,6 +126,73 @@ private:
     BR_PROPERTY(bool, weight, false)
 
     model m;
+    Mat weights; // Dense copy of m.w, one row per decision value
+
+    bool isProbabilistic() const
+    {
+        return (solver == L2R_LR) || (solver == L2R_LR_DUAL) || (solver == L1R_LR);
+    }
+
+    bool isRegression() const
+    {
+        return (solver == L2R_L2LOSS_SVR) || (solver == L2R_L1LOSS_SVR_DUAL) || (solver == L2R_L2LOSS_SVR_DUAL);
+    }
+
+    void compile()
+    {
+        const int nr_w = ((m.nr_class == 2) && (solver != MCSVM_CS)) ? 1 : m.nr_class;
+        weights.create(nr_w, m.nr_feature, CV_32FC1);
+        for (int i=0; i<nr_w; i++)
+            for (int j=0; j<m.nr_feature; j++)
+                weights.at<float>(i, j) = m.w[j*nr_w + i];
+    }
+
+    // Matches predict_values and predict_probability on decision values of one sample
+    float predictDense(const float *decision) const
+    {
+        const int nr_w = weights.rows;
+        if (isRegression())
+            return decision[0];
+
+        if (isProbabilistic()) {
+            QVarLengthArray<double, 16> probability(m.nr_class);
+            if (m.nr_class == 2) {
+                probability[0] = 1 / (1 + exp(-decision[0]));
+                probability[1] = 1 - probability[0];
+            } else {
+                double sum = 0;
+                for (int i=0; i<m.nr_class; i++)
+                    sum += probability[i] = 1 / (1 + exp(-decision[i]));
+                for (int i=0; i<m.nr_class; i++)
+                    probability[i] /= sum;
+            }
+            if (returnDFVal)
+                return probability[0];
+            int best = 0;
+            for (int i=1; i<m.nr_class; i++)
+                if (probability[i] > probability[best]) best = i;
+            return m.label[best];
+        }
+
+        if (returnDFVal)
+            return decision[0];
+        if (nr_w == 1)
+            return (decision[0] > 0) ? m.label[0] : m.label[1];
+        int best = 0;
+        for (int i=1; i<nr_w; i++)
+            if (decision[i] > decision[best]) best = i;
+        return m.label[best];
+    }
+
+    void setPrediction(Template &dst, float prediction) const
+    {
+        if (overwriteMat) {
+            dst.m() = Mat(1, 1, CV_32F);
+            dst.m().at<float>(0, 0) = prediction;
+        } else {
+            dst.file.set(outputVariable,prediction);
+        }
+    }
 
     void train(const TemplateList &data)
     {
@@ -134,7 +247,16 @@ private:
             param.weight = NULL;
         }
 
-        m = *train_svm(&prob, &param);
+        // One-vs-rest problems are independent, so solve them concurrently
+        QList<double> classes;
+        for (int i=0; i<prob.l; i++)
+            if (!classes.contains(prob.y[i]))
+                classes.append(prob.y[i]);
+        if ((classes.size() > 2) && (Globals->parallelism > 1) && !weight && !isRegression() && (solver != MCSVM_CS))
+            m = *trainParallel(&prob, &param, classes);
+        else
+            m = *train_svm(&prob, &param);
+        compile();
 
         delete[] param.weight;
         delete[] param.weight_label;
@@ -148,44 +270,33 @@ private:
         dst = src;
 
         Mat sample = src.m().reshape(1,1);
-        feature_node *x_space = new feature_node[sample.cols+1];
+        if (sample.type() != CV_32FC1) sample.convertTo(sample, CV_32F);
+        if (sample.cols != weights.cols)
+            qFatal("Expected %d features but got %d.", weights.cols, sample.cols);
 
-        for (int j=0; j<sample.cols; j++) {
-            x_space[j].index = j+1;
-            x_space[j].value = sample.at<float>(0,j);
-        }
-        x_space[sample.cols].index = -1;
-
-        float prediction;
-        double prob_estimates[m.nr_class];
-
-        if (solver == L2R_L2LOSS_SVR        ||
-            solver == L2R_L1LOSS_SVR_DUAL   ||
-            solver == L2R_L2LOSS_SVR_DUAL   ||
-            solver == L2R_L2LOSS_SVC_DUAL   ||
-            solver == L2R_L2LOSS_SVC        ||
-            solver == L2R_L1LOSS_SVC_DUAL   ||
-            solver == MCSVM_CS              ||
-            solver == L1R_L2LOSS_SVC)
-        {
-            prediction = predict_values(&m,x_space,prob_estimates);
-            if (returnDFVal) prediction = prob_estimates[0];
-        } else if (solver == L2R_LR         ||
-                   solver == L2R_LR_DUAL    ||
-                   solver == L1R_LR)
-        {
-            prediction = predict_probability(&m,x_space,prob_estimates);
-            if (returnDFVal) prediction = prob_estimates[0];
-        }
+        Mat decision;
+        gemm(sample, weights, 1, Mat(), 0, decision, GEMM_2_T);
+        setPrediction(dst, predictDense(decision.ptr<float>()));
+    }
 
-        if (overwriteMat) {
-            dst.m() = Mat(1, 1, CV_32F);
-            dst.m().at<float>(0, 0) = prediction;
-        } else {
-            dst.file.set(outputVariable,prediction);
+    // All templates are scored with a single matrix product
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        bool batchable = !src.isEmpty();
+        foreach (const Template &t, src)
+            batchable = batchable && !t.isEmpty() && (t.m().type() == CV_32FC1) && t.m().isContinuous() && (int(t.m().total()) == weights.cols);
+        if (!batchable) {
+            Transform::project(src, dst);
+            return;
         }
 
-        delete[] x_space;
+        Mat decisions;
+        gemm(OpenCVUtils::toMat(src.data()), weights, 1, Mat(), 0, decisions, GEMM_2_T);
+        dst.reserve(src.size());
+        for (int i=0; i<src.size(); i++) {
+            dst.append(src[i]);
+            setPrediction(dst.last(), predictDense(decisions.ptr<float>(i)));
+        }
     }
 
     void store(QDataStream &stream) const
@@ -196,6 +307,7 @@ private:
     void load(QDataStream &stream)
     {
         loadModel(m,stream);
+        compile();
     }
 };
 
@@ -18,12 +18,32 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/tanh_sse.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// CvANN_MLP's symmetric sigmoid, beta * (1 - exp(-alpha x)) / (1 + exp(-alpha x)) = beta * tanh(alpha x / 2), in place
+static void sigmoidSym(Mat &m, float alpha, float beta)
+{
+    float *p = m.ptr<float>();
+    const int n = m.total();
+    const float a = alpha / 2;
+    int i = 0;
+#ifdef __SSE__
+    // fast_tanh_sse clamps the whole vector if any lane is out of range, so clamp each lane first
+    const __m128 lo = _mm_set1_ps(-_TANH_RANGE), hi = _mm_set1_ps(_TANH_RANGE), va = _mm_set1_ps(a), vb = _mm_set1_ps(beta);
+    for (; i+4<=n; i+=4) {
+        const __m128 x = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(_mm_loadu_ps(p+i), va)));
+        _mm_storeu_ps(p+i, _mm_mul_ps(vb, fast_tanh_sse(x)));
+    }
+#endif // __SSE__
+    for (; i<n; i++)
+        p[i] = beta * fast_tanh(a * p[i]);
+}
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV's multi-layer perceptron framework
@@ -58,6 +78,76 @@ private:
 
     CvANN_MLP mlp;
 
+    // Float copies of the network for batched forward passes, empty for the Gaussian kernel
+    QList<Mat> layerWeights, layerBiases;
+    Mat inputScale, inputShift, outputScale, outputShift;
+    float activationAlpha, activationBeta;
+
+    void compile()
+    {
+        layerWeights.clear();
+        layerBiases.clear();
+        const CvMat *sizes = mlp.get_layer_sizes();
+        if ((kernel == Gaussian) || !sizes || (sizes->cols * sizes->rows < 2))
+            return;
+
+        // Defaults CvANN_MLP::set_activ_func substitutes for zero parameters
+        activationAlpha = (fabs(alpha) < FLT_EPSILON) ? 2.f/3 : alpha;
+        activationBeta = (fabs(beta) < FLT_EPSILON) ? 1.7159f : beta;
+
+        const int layers = sizes->cols * sizes->rows;
+        const int *size = sizes->data.i;
+        Mat scale(1, 2*size[0], CV_64FC1, mlp.get_weights(0));
+        inputScale = Mat(scale.reshape(2, 1)).clone();
+        for (int l=1; l<layers; l++) {
+            Mat weights(size[l-1]+1, size[l], CV_64FC1, mlp.get_weights(l));
+            Mat w, b;
+            weights.rowRange(0, size[l-1]).convertTo(w, CV_32F);
+            weights.row(size[l-1]).convertTo(b, CV_32F);
+            layerWeights.append(w);
+            layerBiases.append(b);
+        }
+        Mat output(1, 2*size[layers-1], CV_64FC1, mlp.get_weights(layers));
+        outputScale = Mat(output.reshape(2, 1)).clone();
+
+        // Interleaved (scale, shift) pairs
+        std::vector<Mat> channels;
+        split(inputScale, channels);
+        channels[0].convertTo(inputScale, CV_32F);
+        channels[1].convertTo(inputShift, CV_32F);
+        split(outputScale, channels);
+        channels[0].convertTo(outputScale, CV_32F);
+        channels[1].convertTo(outputShift, CV_32F);
+    }
+
+    // One row of outputs per row of samples, as CvANN_MLP::predict
+    bool forward(const Mat &samples, Mat &outputs) const
+    {
+        if (layerWeights.isEmpty() || (samples.type() != CV_32FC1) || (samples.cols != inputScale.cols))
+            return false;
+
+        Mat layer(samples.rows, samples.cols, CV_32FC1);
+        for (int i=0; i<samples.rows; i++)
+            layer.row(i) = samples.row(i).mul(inputScale) + inputShift;
+
+        for (int l=0; l<layerWeights.size(); l++) {
+            Mat next;
+            gemm(layer, layerWeights[l], 1, repeat(layerBiases[l], layer.rows, 1), 1, next);
+            if (kernel == Sigmoid) sigmoidSym(next, activationAlpha, activationBeta);
+            layer = next;
+        }
+
+        for (int i=0; i<layer.rows; i++)
+            layer.row(i) = layer.row(i).mul(outputScale) + outputShift;
+        outputs = layer;
+        return true;
+    }
+
+    void setOutputs(Template &dst, const float *response) const
+    {
+        for (int i=0; i<outputVariables.size(); i++) dst.file.set(outputVariables.at(i),response[i]);
+    }
+
     void init()
     {
         if (kernel == Gaussian)
@@ -83,6 +173,7 @@ private:
             labels.col(i) += OpenCVUtils::toMat(File::get<float>(data, inputVariables.at(i)));
 
         mlp.train(_data,labels,Mat());
+        compile();
 
         if (Globals->verbose)
             for (int i=0; i<neuronsPerLayer.size(); i++) qDebug() << *mlp.get_weights(i);
@@ -94,15 +185,36 @@ private:
 
         // See above for response dimensionality
         Mat response(outputVariables.size(), 1, CV_32FC1);
-        mlp.predict(src.m().reshape(1,1),response);
+        if (!forward(src.m().reshape(1,1), response))
+            mlp.predict(src.m().reshape(1,1),response);
 
         // Apparently mlp.predict reshapes the response matrix?
-        for (int i=0; i<outputVariables.size(); i++) dst.file.set(outputVariables.at(i),response.at<float>(0,i));
+        setOutputs(dst, response.ptr<float>(0));
+    }
+
+    // Each layer is one matrix product over every template
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        bool batchable = !src.isEmpty();
+        foreach (const Template &t, src)
+            batchable = batchable && !t.isEmpty() && (t.m().total() == src.first().m().total()) && t.m().isContinuous();
+        Mat responses;
+        if (!batchable || !forward(OpenCVUtils::toMat(src.data()), responses)) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        dst.reserve(src.size());
+        for (int i=0; i<src.size(); i++) {
+            dst.append(src[i]);
+            setOutputs(dst.last(), responses.ptr<float>(i));
+        }
     }
 
     void load(QDataStream &stream)
     {
         OpenCVUtils::loadModel(mlp, stream);
+        compile();
     }
 
     void store(QDataStream &stream) const
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QTemporaryFile>
+#include <QVarLengthArray>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 
@@ -26,6 +27,109 @@ using namespace cv;
 namespace br
 {
 
+// CvSVM with its decision functions compiled for evaluating many samples with matrix products.
+// Linear kernels fold the support vectors into one weight vector per decision function,
+// RBF kernels keep the support vectors and evaluate every sample against them at once.
+class CompiledSVM : public SVM
+{
+    Mat weights; // decision functions x dims (Linear) or x support vectors (RBF)
+    Mat supportVectors, supportNorms; // RBF only
+    Mat rho; // 1 x decision functions
+    QList< QPair<int,int> > classPairs;
+    bool compiled;
+
+public:
+    CompiledSVM() : compiled(false) {}
+
+    void compile()
+    {
+        compiled = false;
+        const int kernel = params.kernel_type;
+        if (((kernel != CvSVM::LINEAR) && (kernel != CvSVM::RBF)) || var_idx || (sv_total == 0))
+            return;
+
+        const int dims = get_var_count();
+        const bool classifier = (params.svm_type == CvSVM::C_SVC) || (params.svm_type == CvSVM::NU_SVC);
+        const int classes = (classifier && class_labels) ? class_labels->cols : 0;
+        const int functions = classifier ? classes * (classes - 1) / 2 : 1;
+
+        Mat svs(sv_total, dims, CV_32FC1);
+        for (int i=0; i<sv_total; i++)
+            memcpy(svs.ptr<float>(i), sv[i], dims * sizeof(float));
+
+        Mat alphas = Mat::zeros(functions, sv_total, CV_32FC1);
+        rho.create(1, functions, CV_32FC1);
+        classPairs.clear();
+        for (int f=0; f<functions; f++) {
+            const CvSVMDecisionFunc &df = decision_func[f];
+            for (int k=0; k<df.sv_count; k++)
+                alphas.at<float>(f, df.sv_index ? df.sv_index[k] : k) += df.alpha[k];
+            rho.at<float>(0, f) = df.rho;
+        }
+        for (int i=0; i<classes; i++)
+            for (int j=i+1; j<classes; j++)
+                classPairs.append(QPair<int,int>(i, j));
+
+        if (kernel == CvSVM::LINEAR) {
+            weights = alphas * svs;
+            supportVectors.release();
+        } else {
+            weights = alphas;
+            supportVectors = svs;
+            reduce(svs.mul(svs), supportNorms, 1, CV_REDUCE_SUM);
+            supportNorms = supportNorms.t();
+        }
+        compiled = true;
+    }
+
+    // One CvSVM::predict result per row of samples, returns false if the model isn't compiled
+    bool predict(const Mat &samples, bool returnDFVal, QList<float> &results) const
+    {
+        if (!compiled || (samples.type() != CV_32FC1) || (samples.cols != get_var_count()))
+            return false;
+
+        // Decision values, samples x functions
+        Mat values;
+        if (supportVectors.empty()) {
+            gemm(samples, weights, 1, Mat(), 0, values, GEMM_2_T);
+        } else {
+            Mat kernel, sampleNorms;
+            gemm(samples, supportVectors, -2, Mat(), 0, kernel, GEMM_2_T);
+            reduce(samples.mul(samples), sampleNorms, 1, CV_REDUCE_SUM);
+            for (int i=0; i<kernel.rows; i++)
+                kernel.row(i) += supportNorms + sampleNorms.at<float>(i, 0);
+            kernel *= -params.gamma;
+            exp(kernel, kernel);
+            gemm(kernel, weights, 1, Mat(), 0, values, GEMM_2_T);
+        }
+        for (int i=0; i<values.rows; i++)
+            values.row(i) -= rho;
+
+        const int svmType = params.svm_type;
+        for (int i=0; i<values.rows; i++) {
+            const float *value = values.ptr<float>(i);
+            if ((svmType == CvSVM::EPS_SVR) || (svmType == CvSVM::NU_SVR)) {
+                results.append(value[0]);
+            } else if (svmType == CvSVM::ONE_CLASS) {
+                results.append(returnDFVal ? value[0] : (value[0] > 0 ? 1 : 0));
+            } else if (returnDFVal && (classPairs.size() == 1)) {
+                results.append(value[0]);
+            } else {
+                // One vote per pair, ties go to the lower class as in CvSVM::predict
+                QVarLengthArray<int, 16> votes(class_labels->cols);
+                for (int c=0; c<votes.size(); c++) votes[c] = 0;
+                for (int f=0; f<classPairs.size(); f++)
+                    votes[value[f] > 0 ? classPairs[f].first : classPairs[f].second]++;
+                int best = 0;
+                for (int c=1; c<votes.size(); c++)
+                    if (votes[c] > votes[best]) best = c;
+                results.append(class_labels->data.i[best]);
+            }
+        }
+        return true;
+    }
+};
+
 static void trainSVM(SVM &svm, Mat data, Mat lab, int kernel, int type, float C, float gamma, int folds, bool balanceFolds, int termCriteria)
 {
     if (data.type() != CV_32FC1)
@@ -108,7 +212,7 @@ private:
     BR_PROPERTY(int, folds, 5)
     BR_PROPERTY(bool, balanceFolds, false)
 
-    SVM svm;
+    CompiledSVM svm;
     QHash<QString, int> labelMap;
     QHash<int, QVariant> reverseLookup;
 
@@ -129,6 +233,7 @@ private:
         }
 
         trainSVM(svm, data, lab, kernel, type, C, gamma, folds, balanceFolds, termCriteria);
+        svm.compile();
     }
 
     void project(const Template &src, Template &dst) const
@@ -136,8 +241,38 @@ private:
         if (returnDFVal && reverseLookup.size() > 2)
             qFatal("Decision function for multiclass classification not implemented.");
 
+        QList<float> predictions;
+        const Mat sample = src.m().reshape(1, 1);
+        if (!svm.predict(sample, returnDFVal, predictions))
+            predictions.append(svm.SVM::predict(sample, returnDFVal));
+        setPrediction(src, dst, predictions.first());
+    }
+
+    // Every template is evaluated in one batch of matrix products
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (returnDFVal && reverseLookup.size() > 2)
+            qFatal("Decision function for multiclass classification not implemented.");
+
+        QList<float> predictions;
+        bool batchable = !src.isEmpty();
+        foreach (const Template &t, src)
+            batchable = batchable && !t.isEmpty() && (t.m().total() == src.first().m().total()) && t.m().isContinuous();
+        if (!batchable || !svm.predict(OpenCVUtils::toMat(src.data()), returnDFVal, predictions)) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        dst.reserve(src.size());
+        for (int i=0; i<src.size(); i++) {
+            dst.append(Template());
+            setPrediction(src[i], dst[i], predictions[i]);
+        }
+    }
+
+    void setPrediction(const Template &src, Template &dst, float prediction) const
+    {
         dst = src;
-        float prediction = svm.predict(src.m().reshape(1, 1), returnDFVal);
         if (returnDFVal) {
             dst.m() = Mat(1, 1, CV_32F);
             dst.m().at<float>(0, 0) = prediction;
@@ -164,6 +299,7 @@ private:
     void load(QDataStream &stream)
     {
         OpenCVUtils::loadModel(svm, stream);
+        svm.compile();
         stream >> labelMap >> reverseLookup;
     }
 
@@ -213,7 +349,7 @@ private:
     BR_PROPERTY(int, folds, 5)
     BR_PROPERTY(bool, balanceFolds, false)
 
-    SVM svm;
+    CompiledSVM svm;
 
     void train(const TemplateList &src)
     {
@@ -237,13 +373,42 @@ private:
         deltaLab = deltaLab.rowRange(0, index);
 
         trainSVM(svm, deltaData, deltaLab, kernel, type, -1, -1, folds, balanceFolds, termCriteria);
+        svm.compile();
     }
 
     float compare(const Mat &a, const Mat &b) const
     {
         Mat delta;
         absdiff(a, b, delta);
-        return svm.predict(delta.reshape(1, 1));
+        return svm.SVM::predict(delta.reshape(1, 1));
+    }
+
+    // Each query's differences to every target are evaluated as one batch
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        bool batchable = !target.isEmpty();
+        foreach (const Template &t, target)
+            batchable = batchable && (t.size() == 1) && t.m().isContinuous() && (t.m().total() == target.first().m().total());
+        if (!batchable) {
+            Distance::compareBlock(target, query, output, targetOffset, queryOffset);
+            return;
+        }
+
+        const Mat targets = OpenCVUtils::toMat(target.data());
+        Mat deltas;
+        for (int i=0; i<query.size(); i++) {
+            QList<float> scores;
+            if ((query[i].size() == 1) && (query[i].m().total() == size_t(targets.cols))) {
+                const Mat q = query[i].m().reshape(1, 1);
+                absdiff(targets, repeat(q.isContinuous() ? q : q.clone(), targets.rows, 1), deltas);
+                svm.predict(deltas, false, scores);
+            }
+            for (int j=0; j<target.size(); j++) {
+                if (query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                else if (j < scores.size()) output->setRelative(scores[j], i+queryOffset, j+targetOffset);
+                else                        output->setRelative(Distance::compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+            }
+        }
     }
 
     void store(QDataStream &stream) const
@@ -254,6 +419,7 @@ private:
     void load(QDataStream &stream)
     {
         OpenCVUtils::loadModel(svm, stream);
+        svm.compile();
     }
 };
 
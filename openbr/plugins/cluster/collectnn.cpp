@@ -22,6 +22,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Collect nearest neighbors and append them to metadata.
+ *
+ * The input is either a row of scores, or neighbors already collected in the \c neighbors metadata by GalleryCompareTransform::nearest.
  * \author Charles Otto \cite caotto
  */
 class CollectNNTransform : public UntrainableMetaTransform
@@ -36,18 +38,28 @@ class CollectNNTransform : public UntrainableMetaTransform
         dst.file = src.file;
         dst.clear();
         dst.m() = cv::Mat();
-        Neighbors neighbors;
+        const int self = src.file.get<int>("FrameNumber");
+
+        // Already ordered from most to least similar
+        if (src.file.contains("neighbors")) {
+            Neighbors selected;
+            foreach (const Neighbor &neighbor, src.file.get<Neighbors>("neighbors"))
+                if ((neighbor.first != self) && (selected.size() < keep))
+                    selected.append(neighbor);
+            dst.file.set("neighbors", QVariant::fromValue(selected));
+            return;
+        }
+
+        Neighbors heap;
+        const float *scores = src.m().ptr<float>(0);
         for (int i=0; i < src.m().cols;i++) {
             // skip self compares
-            if (i == src.file.get<int>("FrameNumber"))
+            if (i == self)
                 continue;
-            neighbors.append(Neighbor(i, src.m().at<float>(0,i)));
+            insertNeighbor(heap, Neighbor(i, scores[i]), keep);
         }
-        int actuallyKeep = std::min(keep, neighbors.size());
-        std::partial_sort(neighbors.begin(), neighbors.begin()+actuallyKeep, neighbors.end(), compareNeighbors);
-
-        Neighbors selected = neighbors.mid(0, actuallyKeep);
-        dst.file.set("neighbors", QVariant::fromValue(selected));
+        std::sort_heap(heap.begin(), heap.end(), compareNeighbors);
+        dst.file.set("neighbors", QVariant::fromValue(heap));
     }
 };
 
@@ -14,19 +14,100 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <opencv2/flann/flann.hpp>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// The k nearest centers of each row of samples by squared Euclidean distance.
+// Distances are expanded as |x|^2 - 2x.c + |c|^2 so each block of samples is assigned by a single matrix multiply.
+struct CenterSearch
+{
+    Mat samples, centers, centerNorms;
+    int k;
+    Mat indices, dists;
+};
+
+static void nearestCentersBlock(CenterSearch *search, int begin, int end)
+{
+    const Mat block = search->samples.rowRange(begin, end);
+    const Mat &centers = search->centers;
+    Mat products;
+    gemm(block, centers, -2, Mat(), 0, products, GEMM_2_T);
+
+    std::vector< std::pair<float,int> > row(centers.rows);
+    for (int i=0; i<block.rows; i++) {
+        const float sampleNorm = block.row(i).dot(block.row(i));
+        const float *product = products.ptr<float>(i);
+        for (int j=0; j<centers.rows; j++)
+            row[j] = std::pair<float,int>(std::max(sampleNorm + product[j] + search->centerNorms.at<float>(j), 0.f), j);
+        std::partial_sort(row.begin(), row.begin()+search->k, row.end());
+        for (int j=0; j<search->k; j++) {
+            search->indices.at<int>(begin+i, j) = row[j].second;
+            search->dists.at<float>(begin+i, j) = row[j].first;
+        }
+    }
+}
+
+static void nearestCenters(const Mat &samples, const Mat &centers, int k, Mat &indices, Mat &dists)
+{
+    if ((samples.type() != CV_32FC1) || (samples.cols != centers.cols))
+        qFatal("Expected %d column single channel floating point samples.", centers.cols);
+
+    CenterSearch search;
+    search.samples = samples;
+    search.centers = centers;
+    search.k = std::min(k, centers.rows);
+    search.centerNorms.create(centers.rows, 1, CV_32FC1);
+    for (int j=0; j<centers.rows; j++)
+        search.centerNorms.at<float>(j) = centers.row(j).dot(centers.row(j));
+    search.indices.create(samples.rows, search.k, CV_32SC1);
+    search.dists.create(samples.rows, search.k, CV_32FC1);
+
+    // Blocks of samples small enough that their products with the centers stay around 16 MB
+    const int step = std::max(1, (4 << 20) / std::max(1, centers.rows));
+    TaskGroup tasks;
+    for (int begin=0; begin<samples.rows; begin+=step) {
+        const int end = std::min(begin+step, samples.rows);
+        if (Globals->parallelism && (samples.rows > step)) tasks.run(nearestCentersBlock, &search, begin, end);
+        else                                                         nearestCentersBlock(&search, begin, end);
+    }
+    tasks.wait();
+
+    indices = search.indices;
+    dists = search.dists;
+}
+
+// Lowers each of minDists[begin, end) to the squared distance from its row of samples to center
+static void lowerMinDistsBlock(const Mat &samples, const Mat &center, double *minDists, int begin, int end)
+{
+    for (int i=begin; i<end; i++)
+        minDists[i] = std::min(minDists[i], norm(samples.row(i), center, NORM_L2SQR));
+}
+
+static void lowerMinDists(const Mat &samples, const Mat &center, std::vector<double> &minDists)
+{
+    const int step = 4096;
+    TaskGroup tasks;
+    for (int begin=0; begin<samples.rows; begin+=step) {
+        const int end = std::min(begin+step, samples.rows);
+        if (Globals->parallelism && (samples.rows > step)) tasks.run(lowerMinDistsBlock, samples, center, &minDists[0], begin, end);
+        else                                                         lowerMinDistsBlock(samples, center, &minDists[0], begin, end);
+    }
+    tasks.wait();
+}
+
 /*!
  * \ingroup transforms
- * \brief Wraps OpenCV kmeans and flann.
+ * \brief K-means clustering.
+ *
+ * Centers are seeded with k-means++ on the first block of training data, then refined with Lloyd iterations
+ * if the training data fits in one block, or mini-batch k-means updates (Sculley 2010) over each block otherwise.
+ * Projection returns the indices of the \em kSearch nearest centers.
  * \author Josh Klontz \cite jklontz
  */
 class KMeansTransform : public Transform
@@ -38,34 +119,141 @@ class KMeansTransform : public Transform
     BR_PROPERTY(int, kSearch, 1)
 
     Mat centers;
-    mutable QScopedPointer<flann::Index> index;
-    mutable QMutex mutex;
 
-    void reindex()
+    // Arthur and Vassilvitskii 2007, each center is drawn with probability proportional to its squared distance from the centers so far
+    void seed(const Mat &samples)
     {
-        index.reset(new flann::Index(centers, flann::LinearIndexParams()));
+        if (samples.rows < kTrain)
+            qFatal("Insufficient samples to seed %d centers.", kTrain);
+
+        RNG &rng = theRNG();
+        centers.create(kTrain, samples.cols, CV_32FC1);
+        samples.row(rng.uniform(0, samples.rows)).copyTo(centers.row(0));
+
+        std::vector<double> minDists(samples.rows, std::numeric_limits<double>::max());
+        lowerMinDists(samples, centers.row(0), minDists);
+
+        for (int c=1; c<kTrain; c++) {
+            double total = 0;
+            for (int i=0; i<samples.rows; i++)
+                total += minDists[i];
+
+            int choice = 0;
+            double r = rng.uniform(0., total);
+            while ((choice < samples.rows-1) && (r >= minDists[choice]))
+                r -= minDists[choice++];
+            samples.row(choice).copyTo(centers.row(c));
+
+            lowerMinDists(samples, centers.row(c), minDists);
+        }
     }
 
     void train(const TemplateList &data)
     {
-        Mat bestLabels;
-        const double compactness = kmeans(OpenCVUtils::toMatByRow(data.data()), kTrain, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
+        const Mat samples = OpenCVUtils::toMatByRow(data.data());
+        seed(samples);
+
+        double compactness = 0;
+        const int iterations = 10;
+        for (int iteration=0; iteration<iterations; iteration++) {
+            Mat indices, dists;
+            nearestCenters(samples, centers, 1, indices, dists);
+
+            Mat sums = Mat::zeros(centers.size(), CV_32FC1);
+            std::vector<int> counts(kTrain, 0);
+            compactness = 0;
+            for (int i=0; i<samples.rows; i++) {
+                const int c = indices.at<int>(i, 0);
+                Mat sum = sums.row(c);
+                sum += samples.row(i);
+                counts[c]++;
+                compactness += dists.at<float>(i, 0);
+            }
+
+            // Empty clusters keep their previous center
+            for (int c=0; c<kTrain; c++)
+                if (counts[c] > 0)
+                    centers.row(c) = sums.row(c) / counts[c];
+        }
+        qDebug("KMeans compactness = %f", compactness);
+    }
+
+    // Mini-batch k-means (Sculley 2010) when the data spans more than one block,
+    // seeded by k-means++ on the first block
+    void train(TemplateIterator &data)
+    {
+        TemplateList first, block;
+        data.rewind();
+        while ((first.size() < kTrain) && data.next(block))
+            first.append(block);
+        if (!data.next(block)) {
+            train(first);
+            return;
+        }
+
+        seed(OpenCVUtils::toMatByRow(first.data()));
+        first.clear();
+
+        std::vector<int> counts(kTrain, 0);
+        double compactness = 0;
+        const int passes = 10;
+        for (int pass=0; pass<passes; pass++) {
+            compactness = 0;
+            data.rewind();
+            while (data.next(block)) {
+                // Assign the whole block to the current centers, then step each center toward its samples
+                const Mat samples = OpenCVUtils::toMatByRow(block.data());
+                Mat indices, dists;
+                nearestCenters(samples, centers, 1, indices, dists);
+                for (int i=0; i<samples.rows; i++) {
+                    const int c = indices.at<int>(i, 0);
+                    const float eta = 1.f / ++counts[c];
+                    Mat center = centers.row(c);
+                    center = (1 - eta) * center + eta * samples.row(i);
+                    compactness += dists.at<float>(i, 0);
+                }
+            }
+        }
         qDebug("KMeans compactness = %f", compactness);
-        reindex();
+    }
+
+    bool trainsInOnePass() const
+    {
+        return false;
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QMutexLocker locker(&mutex);
-        Mat dists, indicies;
-        index->knnSearch(src, indicies, dists, kSearch);
-        dst = indicies.reshape(1, 1);
+        Mat indices, dists;
+        nearestCenters(src, centers, kSearch, indices, dists);
+        dst = indices.reshape(1, 1);
+    }
+
+    // Templates are stacked so the whole list is assigned by one matrix multiply per block
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (src.isEmpty())
+            return;
+
+        foreach (const Template &t, src)
+            if ((t.size() != 1) || (t.m().type() != CV_32FC1) || (t.m().cols != centers.cols) || !t.m().isContinuous()) {
+                Transform::project(src, dst);
+                return;
+            }
+
+        Mat indices, dists;
+        nearestCenters(OpenCVUtils::toMatByRow(src.data()), centers, kSearch, indices, dists);
+        int row = 0;
+        foreach (const Template &t, src) {
+            dst.append(t);
+            dst.last().m() = indices.rowRange(row, row + t.m().rows).clone().reshape(1, 1);
+            row += t.m().rows;
+        }
     }
 
     void load(QDataStream &stream)
     {
         stream >> centers;
-        reindex();
     }
 
     void store(QDataStream &stream) const
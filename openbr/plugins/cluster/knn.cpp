@@ -16,6 +16,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/hnsw.h>
 
 using namespace cv;
 
@@ -25,6 +26,10 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief K nearest neighbors classifier.
+ *
+ * When \c galleryName is a .hnsw gallery, neighbors are found by searching its graph rather than comparing against every template.
+ * Otherwise, lists of templates are classified \c batchSize at a time, comparing each batch against the gallery with the distance's
+ * blocked Distance::compare() rather than one template at a time. Larger batches trade latency for throughput.
  * \author Josh Klontz \cite jklontz
  */
 class KNNTransform : public Transform
@@ -37,6 +42,7 @@ class KNNTransform : public Transform
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
     Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
     BR_PROPERTY(int, k, 1)
     BR_PROPERTY(br::Distance*, distance, NULL)
     BR_PROPERTY(bool, weighted, false)
@@ -44,8 +50,10 @@ class KNNTransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(QString, outputVariable, "KNN")
     BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(int, batchSize, 64)
 
     TemplateList gallery;
+    QSharedPointer<HNSWIndex> index;
 
     void train(const TemplateList &data)
     {
@@ -53,10 +61,52 @@ class KNNTransform : public Transform
         gallery = data;
     }
 
+    // Only the k best scores are needed unless subjects are removed from consideration
+    int candidates() const
+    {
+        return ((k < 1) || (numSubjects > 1)) ? std::numeric_limits<int>::max() : k;
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        QList< QPair<float, int> > sortedScores = Common::Sort(distance->compare(gallery, src), true);
+        QList< QPair<float, int> > sortedScores;
+        if (index.isNull()) {
+            sortedScores = Common::Sort(distance->compare(gallery, src), true, candidates());
+        } else {
+            const int count = (k < 1) ? gallery.size() : k * numSubjects;
+            foreach (const HNSWIndex::Match &match, index->search(src, count))
+                sortedScores.append(QPair<float, int>(match.second, match.first));
+        }
+        vote(sortedScores, dst);
+    }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!index.isNull() || (batchSize <= 1) || gallery.isEmpty()) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        dst.reserve(src.size());
+        for (int begin=0; begin<src.size(); begin+=batchSize) {
+            const TemplateList batch = src.mid(begin, batchSize);
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(gallery.files(), batch.files()));
+            distance->compare(gallery, batch, scores.data());
+
+            for (int i=0; i<batch.size(); i++) {
+                const float *row = scores->data.ptr<float>(i);
+                QList<float> line; line.reserve(gallery.size());
+                for (int j=0; j<gallery.size(); j++)
+                    line.append(row[j]);
+
+                dst.append(Template(batch[i].file));
+                vote(Common::Sort(line, true, candidates()), dst.last());
+            }
+        }
+    }
+
+    void vote(QList< QPair<float, int> > sortedScores, Template &dst) const
+    {
         QStringList subjects;
         for (int i=0; i<numSubjects; i++) {
             QHash<QString, float> votes;
@@ -88,8 +138,18 @@ class KNNTransform : public Transform
 
     void init()
     {
-        if (!galleryName.isEmpty())
+        index.clear();
+        if (galleryName.isEmpty())
+            return;
+
+        if (File(galleryName).suffix() == "hnsw") {
+            index = QSharedPointer<HNSWIndex>(new HNSWIndex());
+            index->read(galleryName);
+            index->setDistance(distance);
+            gallery = index->templates();
+        } else {
             gallery = TemplateList::fromGallery(galleryName);
+        }
     }
 };
 
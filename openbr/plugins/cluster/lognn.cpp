@@ -14,16 +14,89 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <fstream>
+#include <QFile>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/cluster.h>
 
 namespace br
 {
 
+// Encodes and writes neighbor lists on its own thread, producers only wait when the queue is full
+class NeighborWriter : public QThread
+{
+    QFile file;
+    bool binary, closing;
+    int capacity;
+    QQueue<Neighbors> queue;
+    QMutex mutex;
+    QWaitCondition notEmpty, notFull;
+
+public:
+    NeighborWriter(const QString &fileName, int capacity)
+        : file(fileName), binary(isBinarykNN(fileName)), closing(false), capacity(std::max(capacity, 1))
+    {
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(fileName));
+        file.write(kNNHeader(binary));
+        start();
+    }
+
+    ~NeighborWriter()
+    {
+        mutex.lock();
+        closing = true;
+        notEmpty.wakeAll();
+        mutex.unlock();
+        wait();
+        file.close();
+    }
+
+    void enqueue(const Neighbors &neighbors)
+    {
+        QMutexLocker locker(&mutex);
+        while (queue.size() >= capacity)
+            notFull.wait(&mutex);
+        queue.enqueue(neighbors);
+        notEmpty.wakeOne();
+    }
+
+private:
+    void run()
+    {
+        forever {
+            // Take everything that is waiting so producers can refill the queue while it is written
+            QList<Neighbors> batch;
+            mutex.lock();
+            while (queue.isEmpty() && !closing)
+                notEmpty.wait(&mutex);
+            while (!queue.isEmpty())
+                batch.append(queue.dequeue());
+            notFull.wakeAll();
+            const bool done = closing && batch.isEmpty();
+            mutex.unlock();
+
+            if (done)
+                return;
+
+            QByteArray bytes;
+            foreach (const Neighbors &neighbors, batch)
+                bytes.append(encodeNeighbors(neighbors, binary));
+            file.write(bytes);
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Log nearest neighbors to specified file.
+ *
+ * Neighbor lists are written in the order they arrive by a background thread, which holds up to \em queueSize lists waiting to be written.
+ * A \c .bknn fileName is written in the binary format read by br::loadkNN(), otherwise one line of text is written per template.
  * \author Charles Otto \cite caotto
  */
 class LogNNTransform : public TimeVaryingTransform
@@ -31,43 +104,33 @@ class LogNNTransform : public TimeVaryingTransform
     Q_OBJECT
 
     Q_PROPERTY(QString fileName READ get_fileName WRITE set_fileName RESET reset_fileName STORED false)
+    Q_PROPERTY(int queueSize READ get_queueSize WRITE set_queueSize RESET reset_queueSize STORED false)
     BR_PROPERTY(QString, fileName, "")
+    BR_PROPERTY(int, queueSize, 1024)
 
-    std::fstream fout;
+    QScopedPointer<NeighborWriter> writer;
 
     void projectUpdate(const Template &src, Template &dst)
     {
         dst = src;
-
-        if (!dst.file.contains("neighbors")) {
-            fout << std::endl;
+        if (writer.isNull())
             return;
-        }
-
-        Neighbors neighbors = dst.file.get<Neighbors>("neighbors");
-        if (neighbors.isEmpty() ) {
-            fout << std::endl;
-            return;
-        }
-
-        QString aLine;
-        aLine.append(QString::number(neighbors[0].first)+":"+QString::number(neighbors[0].second));
-        for (int i=1; i < neighbors.size();i++)
-            aLine.append(","+QString::number(neighbors[i].first)+":"+QString::number(neighbors[i].second));
 
-        fout << qPrintable(aLine) << std::endl;
+        // Templates without neighbors are logged as empty lists
+        writer->enqueue(dst.file.contains("neighbors") ? dst.file.get<Neighbors>("neighbors") : Neighbors());
     }
 
     void init()
     {
+        writer.reset();
         if (!fileName.isEmpty())
-            fout.open(qPrintable(fileName), std::ios_base::out);
+            writer.reset(new NeighborWriter(fileName, queueSize));
     }
 
     void finalize(TemplateList &output)
     {
         (void) output;
-        fout.close();
+        writer.reset();
     }
 
 public:
@@ -1,7 +1,9 @@
 set(BR_WITH_EIGEN3 ON CACHE BOOL "Build Eigen3 plugins")
+set(BR_WITH_EIGEN3_MKL OFF CACHE BOOL "Use MKL as the BLAS/LAPACKE backend for Eigen3")
 
 if(${BR_WITH_EIGEN3})
   find_package(Eigen3 REQUIRED)
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${EIGEN3_LIBS})
   install(FILES ${EIGEN3_LICENSE} RENAME Eigen3 DESTINATION share/openbr/licenses)
 else()
   set(BR_EXCLUDED_PLUGINS ${BR_EXCLUDED_PLUGINS} plugins/classification/lda.cpp)
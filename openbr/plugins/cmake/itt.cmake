@@ -0,0 +1,10 @@
+set(BR_WITH_ITT OFF CACHE BOOL "Mark transform, distance and gallery scopes as ITT tasks for VTune")
+
+if(${BR_WITH_ITT})
+  find_path(ITT_INCLUDE_DIR ittnotify.h)
+  find_library(ITT_LIBRARY ittnotify)
+  mark_as_advanced(ITT_INCLUDE_DIR ITT_LIBRARY)
+  include_directories(${ITT_INCLUDE_DIR})
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${ITT_LIBRARY})
+  add_definitions(-DBR_WITH_ITT)
+endif()
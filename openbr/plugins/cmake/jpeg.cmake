@@ -0,0 +1,8 @@
+set(BR_WITH_JPEG OFF CACHE BOOL "Build with libjpeg for reduced resolution JPEG decoding")
+
+if(${BR_WITH_JPEG})
+  find_package(JPEG REQUIRED)
+  add_definitions(-DBR_WITH_JPEG)
+  include_directories(${JPEG_INCLUDE_DIR})
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${JPEG_LIBRARIES})
+endif()
@@ -0,0 +1,10 @@
+set(BR_WITH_LZ4 OFF CACHE BOOL "Compress cgal gallery blocks with LZ4 instead of zlib")
+
+if(${BR_WITH_LZ4})
+  find_path(LZ4_INCLUDE_DIR lz4.h)
+  find_library(LZ4_LIBRARY lz4)
+  mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARY)
+  include_directories(${LZ4_INCLUDE_DIR})
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${LZ4_LIBRARY})
+  add_definitions(-DBR_WITH_LZ4)
+endif()
@@ -0,0 +1,5 @@
+set(BR_WITH_OPENCL OFF CACHE BOOL "Offload GEMM-able distances and subspace projections to OpenCL, requires OpenCV built with its ocl module")
+
+if(${BR_WITH_OPENCL})
+  add_definitions(-DBR_WITH_OPENCL)
+endif()
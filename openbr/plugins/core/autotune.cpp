@@ -0,0 +1,216 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QSettings>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Picks how to parallelize \c transform by timing a sample of the data.
+ *
+ * The first projection of at least \c sample templates projects the first \c sample of them once to warm up,
+ * then times each plan on them and keeps the fastest:
+ * - \c Direct relies on br::Transform::project(const TemplateList &, TemplateList &), which chunks templates across threads.
+ * - \c Distributed projects every template as its own task, like DistributeTemplateTransform.
+ * - \c Nested projects templates one after another, leaving the threads to parallelism inside the transform,
+ *   such as ForkTransform and IndependentTransform branches or parallel distances.
+ *
+ * Other threads projecting while one tunes use \c Direct instead of waiting.
+ * The plan is reported and, when \c plan names a file, stored there keyed by the transform description and
+ * br::Context::parallelism, so later runs skip the timing. Time varying transforms are always projected \c Direct.
+ */
+class AutoTuneTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(int sample READ get_sample WRITE set_sample RESET reset_sample STORED false)
+    Q_PROPERTY(QString plan READ get_plan WRITE set_plan RESET reset_plan STORED false)
+
+public:
+    /*!< */
+    enum Plan { Untuned,
+                Direct,
+                Distributed,
+                Nested };
+
+private:
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, sample, 64)
+    BR_PROPERTY(QString, plan, "")
+
+    mutable QAtomicInt chosen, tuning;
+
+    void init()
+    {
+        if (!transform)
+            return;
+        trainable = transform->trainable;
+        tuning.store(0);
+        chosen.store(transform->timeVarying() ? Direct : storedPlan());
+    }
+
+    QString key() const
+    {
+        return QCryptographicHash::hash(transform->description().toUtf8(), QCryptographicHash::Md5).toHex() +
+               "/" + QString::number(Globals->parallelism);
+    }
+
+    Plan storedPlan() const
+    {
+        if (plan.isEmpty())
+            return Untuned;
+        const int stored = QSettings(plan, QSettings::IniFormat).value(key(), Untuned).toInt();
+        return ((stored >= Direct) && (stored <= Nested)) ? Plan(stored) : Untuned;
+    }
+
+    void save(Plan best) const
+    {
+        if (plan.isEmpty())
+            return;
+        QSettings settings(plan, QSettings::IniFormat);
+        settings.setValue(key(), int(best));
+    }
+
+    static void _project(const Transform *transform, const Template *src, TemplateList *dst)
+    {
+        TemplateList input;
+        input.append(*src);
+        transform->project(input, *dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst, Plan with) const
+    {
+        if (with == Distributed) {
+            QVector<TemplateList> results(src.size());
+            TaskGroup tasks;
+            for (int i=0; i<src.size(); i++)
+                tasks.run(_project, transform, &src[i], &results[i]);
+            tasks.wait();
+            foreach (const TemplateList &result, results)
+                dst.append(result);
+        } else if (with == Nested) {
+            const bool serial = Transform::setSerialProjection(true);
+            transform->project(src, dst);
+            Transform::setSerialProjection(serial);
+        } else {
+            transform->project(src, dst);
+        }
+    }
+
+    Plan tune(const TemplateList &src) const
+    {
+        const TemplateList probe = src.mid(0, sample);
+        static const char *names[] = { "Untuned", "Direct", "Distributed", "Nested" };
+
+        // Lazily loaded models and cold caches would otherwise slow whichever plan runs first
+        {
+            TemplateList output;
+            project(probe, output, Direct);
+        }
+
+        Plan best = Direct;
+        double bestRate = 0;
+        QStringList report;
+        for (int candidate=Direct; candidate<=Nested; candidate++) {
+            TemplateList output;
+            QElapsedTimer timer;
+            timer.start();
+            project(probe, output, Plan(candidate));
+            const double rate = probe.size() / std::max(timer.nsecsElapsed() / 1e9, 1e-9);
+            report.append(QString("%1 %2/s").arg(names[candidate], QString::number(rate, 'f', 1)));
+            if (rate > bestRate) {
+                best = Plan(candidate);
+                bestRate = rate;
+            }
+        }
+
+        qDebug("AutoTune picked %s for %s with %d threads (%s)", names[best], qPrintable(transform->objectName()),
+               Globals->parallelism, qPrintable(report.join(", ")));
+        save(best);
+        return best;
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        // One caller tunes, the rest project Direct rather than wait for it
+        if ((chosen.load() == Untuned) && (src.size() >= sample) && tuning.testAndSetOrdered(0, 1))
+            chosen.store(tune(src));
+        project(src, dst, chosen.load() == Untuned ? Direct : Plan(chosen.load()));
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        transform->project(src, dst);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        transform->projectUpdate(src, dst);
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        transform->projectUpdate(src, dst);
+    }
+
+    bool timeVarying() const
+    {
+        return transform->timeVarying();
+    }
+
+    void train(const QList<TemplateList> &data)
+    {
+        transform->train(data);
+    }
+
+    void train(TemplateIterator &data)
+    {
+        transform->train(data);
+    }
+
+    bool trainsInOnePass() const
+    {
+        return transform->trainsInOnePass();
+    }
+
+    void finalize(TemplateList &output)
+    {
+        transform->finalize(output);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, AutoTuneTransform)
+
+} // namespace br
+
+#include "core/autotune.moc"
@@ -14,37 +14,147 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicInt>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QLinkedList>
+#include <QSaveFile>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/memory.h>
+#include <openbr/core/metrics.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
 
+static const Metrics::Counter cacheHits("br_cache_hits_total", "CacheTransform lookups answered from memory or disk.");
+static const Metrics::Counter cacheDiskHits("br_cache_disk_hits_total", "CacheTransform lookups answered from the spill directory.");
+static const Metrics::Counter cacheMisses("br_cache_misses_total", "CacheTransform lookups that projected the template.");
+static const MemoryAccount cacheMemory("CacheTransform");
+
+/*!
+ * \brief Process-wide least recently used store for br::CacheTransform, split into independently locked shards.
+ */
+class TemplateCache
+{
+    // Items are indexed by a 64-bit key derived from File::fingerprint(), the prefix and file themselves confirm a hit
+    struct Item
+    {
+        quint64 key;
+        QString prefix;
+        File file;
+        Template t;
+        qint64 bytes;
+    };
+
+    struct Shard
+    {
+        QMutex lock;
+        QLinkedList<Item> items; // Most recently used first
+        QHash<quint64, QLinkedList<Item>::iterator> index;
+        qint64 bytes;
+        Shard() : bytes(0) {}
+    };
+
+    static const int numShards = 16;
+    Shard shards[numShards];
+    QAtomicInt capacityMB;
+
+    Shard &shard(quint64 key) { return shards[key % numShards]; }
+
+    static qint64 bytes(const Template &t)
+    {
+        return qint64(t.bytes()) + 256;
+    }
+
+public:
+    QAtomicInt hits, diskHits, misses;
+
+    TemplateCache() : capacityMB(0) {}
+
+    // The budget is shared, so the largest request wins
+    void reserve(int megabytes)
+    {
+        int current;
+        while (megabytes > (current = capacityMB.load()))
+            if (capacityMB.testAndSetOrdered(current, megabytes))
+                break;
+    }
+
+    bool find(quint64 key, const QString &prefix, const File &file, Template &t)
+    {
+        Shard &s = shard(key);
+        QMutexLocker locker(&s.lock);
+        QHash<quint64, QLinkedList<Item>::iterator>::iterator it = s.index.find(key);
+        if ((it == s.index.end()) || (it.value()->prefix != prefix) || (it.value()->file != file))
+            return false;
+        Item item = *it.value();
+        s.items.erase(it.value());
+        s.items.prepend(item);
+        it.value() = s.items.begin();
+        t = item.t;
+        return true;
+    }
+
+    void insert(quint64 key, const QString &prefix, const File &file, const Template &t)
+    {
+        Shard &s = shard(key);
+        QMutexLocker locker(&s.lock);
+        if (s.index.contains(key))
+            return;
+
+        Item item;
+        item.key = key;
+        item.prefix = prefix;
+        item.file = file;
+        item.t = t;
+        item.bytes = bytes(t);
+        s.items.prepend(item);
+        s.index.insert(key, s.items.begin());
+        s.bytes += item.bytes;
+        cacheMemory.allocated(item.bytes);
+
+        const qint64 budget = qint64(capacityMB.load()) * 1024 * 1024 / numShards;
+        while ((s.bytes > budget) && !s.items.isEmpty()) {
+            s.bytes -= s.items.last().bytes;
+            cacheMemory.freed(s.items.last().bytes);
+            s.index.remove(s.items.last().key);
+            s.items.removeLast();
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Caches br::Transform::project() results.
  * \author Josh Klontz \cite jklontz
+ *
+ * Results are kept in a process-wide least recently used cache bounded by \em capacity megabytes,
+ * keyed by the child transform's description and the source file so different caches never collide.
+ * If \em spill is set then computed templates are also written to that directory, named by File::hash(),
+ * and read back on a memory miss before recomputing, which lets results outlive eviction and the process.
+ * Process-wide hit and miss counts are reported on destruction in verbose mode.
  */
 class CacheTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(int capacity READ get_capacity WRITE set_capacity RESET reset_capacity STORED false)
+    Q_PROPERTY(QString spill READ get_spill WRITE set_spill RESET reset_spill STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, capacity, 1024)
+    BR_PROPERTY(QString, spill, "")
 
-    static QHash<QString, Template> cache;
-    static QMutex cacheLock;
+    static TemplateCache cache;
+    QString prefix, spillDir;
+    quint64 prefixHash;
 
 public:
     ~CacheTransform()
     {
-        if (cache.isEmpty()) return;
-
-        // Write to cache
-        QFile file("Cache");
-        if (!file.open(QFile::WriteOnly))
-            qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
-        QDataStream stream(&file);
-        stream << cache;
-        file.close();
+        if (Globals->verbose)
+            qDebug("Cache: %d hits (%d from disk), %d misses", cache.hits.load(), cache.diskHits.load(), cache.misses.load());
     }
 
 private:
@@ -53,16 +163,14 @@ private:
         if (!transform) return;
 
         trainable = transform->trainable;
-        if (!cache.isEmpty()) return;
-
-        // Read from cache
-        QFile file("Cache");
-        if (file.exists()) {
-            if (!file.open(QFile::ReadOnly))
-                qFatal("Unable to open %s for reading.", qPrintable(file.fileName()));
-            QDataStream stream(&file);
-            stream >> cache;
-            file.close();
+        cache.reserve(capacity);
+
+        const QString description = transform->description();
+        prefix = description + "\n";
+        prefixHash = quint64(qHash(prefix)) * Q_UINT64_C(0x9E3779B97F4A7C15);
+        if (!spill.isEmpty()) {
+            spillDir = spill + "/" + QtUtils::shortTextHash(description);
+            QDir().mkpath(spillDir);
         }
     }
 
@@ -71,22 +179,69 @@ private:
         transform->train(data);
     }
 
+    QString spillPath(const File &file) const
+    {
+        return spillDir + "/" + file.hash() + ".tmpl";
+    }
+
+    // File::hash() is short, so the full key is stored alongside the template and checked on read
+    bool readSpill(const File &file, const QString &key, Template &dst) const
+    {
+        QFile f(spillPath(file));
+        if (!f.open(QFile::ReadOnly))
+            return false;
+        QDataStream stream(&f);
+        QString storedKey;
+        stream >> storedKey;
+        if (storedKey != key)
+            return false;
+        stream >> dst;
+        return stream.status() == QDataStream::Ok;
+    }
+
+    void writeSpill(const File &file, const QString &key, const Template &t) const
+    {
+        QSaveFile f(spillPath(file));
+        if (!f.open(QFile::WriteOnly)) {
+            qWarning("Unable to open %s for writing.", qPrintable(f.fileName()));
+            return;
+        }
+        QDataStream stream(&f);
+        stream << key << t;
+        f.commit();
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        const QString &file = src.file;
-        if (cache.contains(file)) {
-            dst = cache[file];
+        const quint64 id = prefixHash ^ src.file.fingerprint();
+        if (cache.find(id, prefix, src.file, dst)) {
+            cache.hits.ref();
+            cacheHits.add();
+            return;
+        }
+
+        // The spill key is only built on a memory miss
+        const QString key = spillDir.isEmpty() ? QString() : prefix + src.file.flat();
+        if (!spillDir.isEmpty() && readSpill(src.file, key, dst)) {
+            cache.hits.ref();
+            cache.diskHits.ref();
+            cacheHits.add();
+            cacheDiskHits.add();
         } else {
+            cache.misses.ref();
+            cacheMisses.add();
             transform->project(src, dst);
-            cacheLock.lock();
-            cache[file] = dst;
-            cacheLock.unlock();
+            if (dst.file.fte)
+                return;
+            if (!spillDir.isEmpty())
+                writeSpill(src.file, key, dst);
         }
+
+        cache.insert(id, prefix, src.file, dst);
     }
 };
 
-QHash<QString, Template> CacheTransform::cache;
-QMutex CacheTransform::cacheLock;
+TemplateCache CacheTransform::cache;
 
 BR_REGISTER(Transform, CacheTransform)
 
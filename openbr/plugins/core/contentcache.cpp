@@ -0,0 +1,246 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFutureSynchronizer>
+#include <QSaveFile>
+#include <QtConcurrentRun>
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Persistent, content-addressed cache of enrollment results.
+ *
+ * Each source template is passed through the stages of the child transform (the children of a br::PipeTransform, or the transform itself)
+ * until it holds image data, which is then hashed together with its metadata.
+ * The result of every later stage is addressed by chaining this content hash with a fingerprint of each stage so far,
+ * formed from the stage's description and its serialized model, so renaming or moving images still hits the cache
+ * while retraining or reconfiguring a stage invalidates it along with everything after it.
+ *
+ * Final results are stored under \em directory, as are intermediate results when \em intermediates is set.
+ * On a rerun the deepest stored stage is loaded and only the remaining stages are computed, so changing the
+ * back end of an algorithm reuses the expensive front end.
+ *
+ * \see Globals::enrollmentCache
+ */
+class ContentCacheTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(QString directory READ get_directory WRITE set_directory RESET reset_directory STORED false)
+    Q_PROPERTY(bool intermediates READ get_intermediates WRITE set_intermediates RESET reset_intermediates STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(QString, directory, "")
+    BR_PROPERTY(bool, intermediates, false)
+
+    QList<Transform *> stages;
+    QList<QByteArray> fingerprints;
+    bool enabled;
+
+    void init()
+    {
+        stages.clear();
+        fingerprints.clear();
+        enabled = false;
+        if (!transform) return;
+
+        trainable = transform->trainable;
+        if (directory.isEmpty()) directory = Globals->enrollmentCache;
+        if (directory.isEmpty()) return;
+        if (transform->timeVarying()) {
+            qWarning("ContentCache: %s is time varying and will not be cached.", qPrintable(transform->description()));
+            return;
+        }
+
+        CompositeTransform *pipe = dynamic_cast<CompositeTransform*>(transform);
+        if (pipe && (QString(transform->metaObject()->className()) == "br::PipeTransform")) stages = pipe->transforms;
+        else                                                                                  stages.append(transform);
+
+        foreach (const Transform *stage, stages) {
+            QByteArray model;
+            QDataStream stream(&model, QFile::WriteOnly);
+            stage->store(stream);
+            QCryptographicHash hash(QCryptographicHash::Sha1);
+            hash.addData(stage->description().toUtf8());
+            hash.addData(model);
+            fingerprints.append(hash.result());
+        }
+
+        QDir().mkpath(directory);
+        enabled = true;
+    }
+
+    void train(const QList<TemplateList> &data)
+    {
+        transform->train(data);
+        init();
+    }
+
+    static QByteArray contentHash(const TemplateList &templates)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        foreach (const Template &t, templates) {
+            foreach (const cv::Mat &m, t) {
+                const qint32 header[3] = { m.rows, m.cols, m.type() };
+                hash.addData((const char*) header, sizeof(header));
+                for (int i=0; i<m.rows; i++)
+                    hash.addData((const char*) m.ptr(i), int(m.cols * m.elemSize()));
+            }
+
+            // Everything but the file name, which is deliberately not part of the content
+            QByteArray metadata;
+            QDataStream stream(&metadata, QFile::WriteOnly);
+            stream << t.file.localMetadata();
+            hash.addData(metadata);
+        }
+        return hash.result();
+    }
+
+    QString path(const QByteArray &key) const
+    {
+        const QString hex = key.toHex();
+        return directory + "/" + hex.left(2) + "/" + hex.mid(2) + ".tl";
+    }
+
+    bool read(const QByteArray &key, TemplateList &active, TemplateList &ftes) const
+    {
+        QFile file(path(key));
+        if (!file.open(QFile::ReadOnly))
+            return false;
+        QDataStream stream(&file);
+        TemplateList a, f;
+        stream >> a >> f;
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        active = a;
+        ftes = f;
+        return true;
+    }
+
+    void write(const QByteArray &key, const TemplateList &active, const TemplateList &ftes) const
+    {
+        const QString fileName = path(key);
+        QDir().mkpath(QFileInfo(fileName).path());
+        QSaveFile file(fileName);
+        if (!file.open(QFile::WriteOnly)) {
+            qWarning("Unable to open %s for writing.", qPrintable(fileName));
+            return;
+        }
+        QDataStream stream(&file);
+        stream << active << ftes;
+        file.commit();
+    }
+
+    static bool hasData(const TemplateList &templates)
+    {
+        foreach (const Template &t, templates)
+            if (!t.isNull())
+                return true;
+        return false;
+    }
+
+    void enroll(const Template *src, TemplateList *dst) const
+    {
+        TemplateList active, ftes;
+        active.append(*src);
+
+        // Decode until there is content to address
+        int stage = 0;
+        while ((stage < stages.size()) && !hasData(active) && !active.isEmpty())
+            projectStage(stage++, active, ftes);
+
+        if (stage < stages.size() && !active.isEmpty()) {
+            QList<QByteArray> keys;
+            QByteArray key = contentHash(active);
+            for (int i=stage; i<stages.size(); i++) {
+                key = QCryptographicHash::hash(key + fingerprints[i], QCryptographicHash::Sha1);
+                keys.append(key);
+            }
+
+            // Resume from the deepest stored stage
+            int skip = 0;
+            for (int i=keys.size()-1; i>=0; i--)
+                if (read(keys[i], active, ftes)) {
+                    skip = i + 1;
+                    break;
+                }
+
+            for (int i=skip; i<keys.size(); i++) {
+                projectStage(stage + i, active, ftes);
+                if (intermediates || (i == keys.size()-1))
+                    write(keys[i], active, ftes);
+            }
+
+            // Cached results may have been computed for an identical image under a different name
+            if (skip > 0) {
+                for (int i=0; i<active.size(); i++) active[i].file.name = src->file.name;
+                for (int i=0; i<ftes.size(); i++)   ftes[i].file.name = src->file.name;
+            }
+        }
+
+        *dst = active;
+        dst->append(ftes);
+    }
+
+    void projectStage(int index, TemplateList &active, TemplateList &ftes) const
+    {
+        TemplateList res;
+        stages[index]->project(active, res);
+        splitFTEs(res, ftes);
+        active = res;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        TemplateList temp;
+        project(TemplateList() << src, temp);
+        if (temp.size() != 1) qFatal("ContentCache single template projection expects a one-to-one transform.");
+        dst = temp.first();
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!enabled) {
+            transform->project(src, dst);
+            return;
+        }
+
+        QVector<TemplateList> results(src.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<src.size(); i++)
+            if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(this, &ContentCacheTransform::enroll, &src[i], &results[i]));
+            else                          enroll(&src[i], &results[i]);
+        futures.waitForFinished();
+
+        TemplateList ftes;
+        foreach (TemplateList result, results) {
+            splitFTEs(result, ftes);
+            dst.append(result);
+        }
+        dst.append(ftes);
+    }
+};
+
+BR_REGISTER(Transform, ContentCacheTransform)
+
+} // namespace br
+
+#include "core/contentcache.moc"
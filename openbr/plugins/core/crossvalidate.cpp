@@ -27,6 +27,28 @@ static void _train(Transform *transform, TemplateList data) // think data has to
     transform->train(data);
 }
 
+// Trains the stages of a pipe from begin onwards on data already projected through the stages before it
+static void _trainStages(CompositeTransform *pipe, int begin, TemplateList data)
+{
+    int last = pipe->transforms.size()-1;
+    while ((last >= begin) && !pipe->transforms[last]->trainable)
+        last--;
+
+    for (int i=begin; i<=last; i++) {
+        Transform *stage = pipe->transforms[i];
+        if (stage->trainable)
+            stage->train(data);
+        if (i == last)
+            break;
+
+        TemplateList projected, ftes;
+        if (stage->timeVarying()) stage->projectUpdate(data, projected);
+        else                      stage->project(data, projected);
+        splitFTEs(projected, ftes);
+        data = projected;
+    }
+}
+
 /*!
  * \ingroup transforms
  * \brief Cross validate a trainable transform.
@@ -50,14 +72,20 @@ static void _train(Transform *transform, TemplateList data) // think data has to
  *                            by the child transforms of CrossValidateTransform.  Again, care
  *                            has been take such that one can train with these templates in the
  *                            used Gallery successfully (they will simply be omitted).
+ * \note  With \em sharePreprocessing the leading untrainable stages of a Pipe description are projected once and
+ *        shared by every fold, and \em concurrentFolds limits how many folds train at once (all of them if 0).
  */
 class CrossValidateTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(QString description READ get_description WRITE set_description RESET reset_description STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(bool sharePreprocessing READ get_sharePreprocessing WRITE set_sharePreprocessing RESET reset_sharePreprocessing STORED false)
+    Q_PROPERTY(int concurrentFolds READ get_concurrentFolds WRITE set_concurrentFolds RESET reset_concurrentFolds STORED false)
     BR_PROPERTY(QString, description, "Identity")
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(bool, sharePreprocessing, false)
+    BR_PROPERTY(int, concurrentFolds, 0)
 
     // numPartitions copies of transform specified by description.
     QList<br::Transform*> transforms;
@@ -78,6 +106,39 @@ class CrossValidateTransform : public MetaTransform
             return;
         }
 
+        // Leading untrainable stages are identical in every fold, so their output is computed once and shared
+        CompositeTransform *pipe = dynamic_cast<CompositeTransform*>(transforms.first());
+        int prefix = 0;
+        if (sharePreprocessing && pipe && (QString(pipe->metaObject()->className()) == "br::PipeTransform"))
+            while ((prefix < pipe->transforms.size()) && !pipe->transforms[prefix]->trainable && !pipe->transforms[prefix]->timeVarying())
+                prefix++;
+
+        // Bounds how many folds, and therefore training set copies, are alive at once
+        QThreadPool pool;
+        pool.setMaxThreadCount(concurrentFolds > 0 ? concurrentFolds : numPartitions);
+
+        if (prefix > 0) {
+            TemplateList shared = data.partition(inputVariable);
+            for (int i=0; i<prefix; i++) {
+                TemplateList projected, ftes;
+                pipe->transforms[i]->project(shared, projected);
+                splitFTEs(projected, ftes);
+                shared = projected;
+            }
+
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<numPartitions; i++) {
+                // Remove data designated for testing, projected templates keep the partition of their source
+                TemplateList partitionedData;
+                foreach (const Template &t, shared)
+                    if (t.file.get<int>("Partition", 0) != i)
+                        partitionedData.append(t);
+                futures.addFuture(QtConcurrent::run(&pool, _trainStages, static_cast<CompositeTransform*>(transforms[i]), prefix, partitionedData));
+            }
+            futures.waitForFinished();
+            return;
+        }
+
         QFutureSynchronizer<void> futures;
         for (int i=0; i<numPartitions; i++) {
             TemplateList partitionedData = data;
@@ -86,7 +147,7 @@ class CrossValidateTransform : public MetaTransform
                     // Remove data, it's designated for testing
                     partitionedData.removeAt(j);
             // Train on the remaining templates
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], partitionedData));
+            futures.addFuture(QtConcurrent::run(&pool, _train, transforms[i], partitionedData));
         }
         futures.waitForFinished();
     }
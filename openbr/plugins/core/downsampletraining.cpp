@@ -15,77 +15,65 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/sampler.h>
 
 namespace br
 {
 
-static TemplateList Downsample(const TemplateList &templates, int classes, int instances, float fraction, const QString &inputVariable, const QStringList &gallery, const QStringList &subjects)
+// Templates are read once, each class is sampled as they arrive so only the templates that could be kept are held in memory
+static TemplateList Downsample(TemplateIterator &data, int classes, int instances, float fraction, const QString &inputVariable, const QStringList &gallery, const QStringList &subjects, int seed)
 {
-    // Return early when no downsampling is required
-    if ((classes == std::numeric_limits<int>::max()) &&
-            (instances == std::numeric_limits<int>::max()) &&
-            (fraction >= 1) &&
-            (gallery.isEmpty()) &&
-            (subjects.isEmpty()))
-        return templates;
-
     const bool atLeast = instances < 0;
     instances = abs(instances);
-
-    QList<QString> allLabels = File::get<QString>(templates, inputVariable);
-
-    QList<QString> uniqueLabels = allLabels.toSet().toList();
-    qSort(uniqueLabels);
-
-    QMap<QString,int> counts = templates.countValues<QString>(inputVariable, instances != std::numeric_limits<int>::max());
-
-    if ((instances != std::numeric_limits<int>::max()) && (classes != std::numeric_limits<int>::max()))
-        foreach (const QString &label, counts.keys())
-            if (counts[label] < instances)
-                counts.remove(label);
-
-    uniqueLabels = counts.keys();
-    if ((classes != std::numeric_limits<int>::max()) && (uniqueLabels.size() < classes))
-        qWarning("Downsample requested %d classes but only %d are available.", classes, uniqueLabels.size());
-
-    QList<QString> selectedLabels = uniqueLabels;
-    if (classes < uniqueLabels.size()) {
-        std::random_shuffle(selectedLabels.begin(), selectedLabels.end());
-        selectedLabels = selectedLabels.mid(0, classes);
+    const bool limited = (instances != std::numeric_limits<int>::max());
+
+    StratifiedSampler sampler(inputVariable, (atLeast || !limited) ? -1 : instances, seed);
+    TemplateList block;
+    data.rewind();
+    while (data.next(block))
+        foreach (const Template &t, block) {
+            if (t.file.fte || t.file.get<bool>("PossibleFTE", false))
+                continue;
+            if (!gallery.isEmpty() && !gallery.contains(t.file.get<QString>("Gallery")))
+                continue;
+            if (!subjects.isEmpty() && subjects.contains(t.file.get<QString>(inputVariable)))
+                continue;
+            sampler.add(t);
+        }
+
+    QStringList labels;
+    foreach (const QString &label, sampler.strata())
+        if (!limited || (classes == std::numeric_limits<int>::max()) || (sampler.count(label) >= instances))
+            labels.append(label);
+
+    if ((classes != std::numeric_limits<int>::max()) && (labels.size() < classes))
+        qWarning("Downsample requested %d classes but only %d are available.", classes, labels.size());
+
+    if (classes < labels.size()) {
+        sampler.shuffle(labels);
+        labels = labels.mid(0, classes);
     }
 
     TemplateList downsample;
-    for (int i=0; i<selectedLabels.size(); i++) {
-        const QString selectedLabel = selectedLabels[i];
-        QList<int> indices;
-        for (int j=0; j<allLabels.size(); j++)
-            if ((allLabels[j] == selectedLabel) && (!templates.value(j).file.get<bool>("FTE", false)) && (!templates.value(j).file.get<bool>("PossibleFTE", false)))
-                indices.append(j);
-
-        std::random_shuffle(indices.begin(), indices.end());
-        const int max = atLeast ? indices.size() : std::min(indices.size(), instances);
-        for (int j=0; j<max; j++)
-            downsample.append(templates.value(indices[j]));
-    }
+    foreach (const QString &label, labels)
+        downsample.append(sampler.sample(label));
 
     if (fraction < 1) {
-        std::random_shuffle(downsample.begin(), downsample.end());
+        sampler.shuffle(downsample);
         downsample = downsample.mid(0, downsample.size()*fraction);
     }
 
-    if (!gallery.isEmpty())
-        for (int i=downsample.size()-1; i>=0; i--)
-            if (!gallery.contains(downsample[i].file.get<QString>("Gallery")))
-                downsample.removeAt(i);
-
-    if (!subjects.isEmpty())
-        for (int i=downsample.size()-1; i>=0; i--)
-            if (subjects.contains(downsample[i].file.get<QString>(inputVariable)))
-                downsample.removeAt(i);
-
     return downsample;
 }
 
+/*!
+ * \ingroup transforms
+ * \brief Trains transform on a class-balanced random subset of the training data.
+ *
+ * Keeps up to \c instances templates of up to \c classes values of \c inputVariable, a negative \c instances keeps
+ * every template of classes with at least that many. The subset is drawn in a single pass over the data with
+ * per-class reservoirs, reproducibly for a given \c seed.
+ */
 class DownsampleTrainingTransform : public Transform
 {
     Q_OBJECT
@@ -96,6 +84,7 @@ class DownsampleTrainingTransform : public Transform
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(QStringList gallery READ get_gallery WRITE set_gallery RESET reset_gallery STORED false)
     Q_PROPERTY(QStringList subjects READ get_subjects WRITE set_subjects RESET reset_subjects STORED false)
+    Q_PROPERTY(int seed READ get_seed WRITE set_seed RESET reset_seed STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
     BR_PROPERTY(int, classes, std::numeric_limits<int>::max())
     BR_PROPERTY(int, instances, std::numeric_limits<int>::max())
@@ -103,6 +92,7 @@ class DownsampleTrainingTransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(QStringList, gallery, QStringList())
     BR_PROPERTY(QStringList, subjects, QStringList())
+    BR_PROPERTY(int, seed, 0)
 
 
     Transform *simplify(bool &newTForm)
@@ -117,14 +107,46 @@ class DownsampleTrainingTransform : public Transform
     }
 
 
+    bool downsampling() const
+    {
+        return (classes != std::numeric_limits<int>::max()) ||
+               (instances != std::numeric_limits<int>::max()) ||
+               (fraction < 1) ||
+               !gallery.isEmpty() ||
+               !subjects.isEmpty();
+    }
+
     void train(const TemplateList &data)
     {
         if (!transform || !transform->trainable)
             return;
 
-        TemplateList downsampled = Downsample(data, classes, instances, fraction, inputVariable, gallery, subjects);
+        if (!downsampling()) {
+            transform->train(data);
+            return;
+        }
+
+        TemplateIterator iterator(data);
+        transform->train(Downsample(iterator, classes, instances, fraction, inputVariable, gallery, subjects, seed));
+    }
+
+    void train(TemplateIterator &data)
+    {
+        if (!transform || !transform->trainable)
+            return;
+
+        if (!downsampling()) {
+            transform->train(data);
+            return;
+        }
 
-        transform->train(downsampled);
+        transform->train(Downsample(data, classes, instances, fraction, inputVariable, gallery, subjects, seed));
+    }
+
+    // Downsampling reads the data once and trains on the sample in memory
+    bool trainsInOnePass() const
+    {
+        return !transform || downsampling() || transform->trainsInOnePass();
     }
 };
 
@@ -69,6 +69,12 @@ class ExpandTransform : public UntrainableMetaTransform
         dst = src;
         qDebug("Called Expand project(Template,Template), nothing will happen");
     }
+
+    virtual void projectInPlace(Template &srcdst) const
+    {
+        (void) srcdst;
+        qDebug("Called Expand projectInPlace(Template), nothing will happen");
+    }
 };
 
 BR_REGISTER(Transform, ExpandTransform)
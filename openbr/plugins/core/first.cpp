@@ -38,6 +38,13 @@ class FirstTransform : public UntrainableMetaTransform
         dst.file = src.file;
         dst = src.m();
     }
+
+    void projectInPlace(Template &srcdst) const
+    {
+        // Keeps the same matrix as project(), src.m() is the last one
+        if (srcdst.size() > 1)
+            srcdst.erase(srcdst.begin(), srcdst.end() - 1);
+    }
 };
 
 BR_REGISTER(Transform, FirstTransform)
@@ -14,9 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/profiler.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -26,12 +26,39 @@ static void _train(Transform *transform, const QList<TemplateList> *data)
     transform->train(*data);
 }
 
+// A branch that throws fails to enroll the template rather than every branch, so its error is kept to be reported in order
+static void _projectTemplate(const Transform *transform, const Template *src, Template *dst, QString *error)
+{
+    try {
+        BR_PROFILE("transform", transform, 1);
+        *dst = (*transform)(*src);
+    } catch (const std::exception &e) {
+        *error = QString::fromLocal8Bit(e.what());
+    } catch (...) {
+        *error = "unknown exception";
+    }
+}
+
+static void _projectList(const Transform *transform, const TemplateList *src, TemplateList *dst)
+{
+    BR_PROFILE("transform", transform, src->size());
+    transform->project(*src, *dst);
+}
+
+// Branches are queued on the shared pool, the waiting thread runs any nobody has started
+static bool _concurrentBranches(int branches)
+{
+    return (branches > 1) && (Globals->parallelism > 1);
+}
+
 /*!
  * \ingroup transforms
  * \brief Transforms in parallel.
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is seperately given to each transform and the results are appended together.
+ * Branches share the source read-only, and are projected concurrently on the shared br::WorkStealingPool,
+ * as for a single latency sensitive template.
  *
  * \see PipeTransform
  */
@@ -42,10 +69,24 @@ class ForkTransform : public CompositeTransform
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<transforms.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
-        futures.waitForFinished();
+            tasks.run(_train, transforms[i], &data);
+        tasks.wait();
+    }
+
+    // Branches make their passes over the data in turn, since the data may be projected by a shared stream
+    void train(TemplateIterator &data)
+    {
+        if (!trainable) return;
+        foreach (Transform *transform, transforms)
+            if (transform->trainable)
+                transform->train(data);
+    }
+
+    bool trainsInOnePass() const
+    {
+        return trainsChildrenInOnePass();
     }
 
     // same as _project, but calls projectUpdate on sub-transforms
@@ -54,6 +95,7 @@ class ForkTransform : public CompositeTransform
         foreach (Transform *f, transforms) {
             try {
                 Template res;
+                BR_PROFILE("transform", f, 1);
                 f->projectUpdate(src, res);
                 dst.merge(res);
             } catch (...) {
@@ -71,7 +113,10 @@ class ForkTransform : public CompositeTransform
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
         foreach (Transform *f, transforms) {
             TemplateList m;
-            f->projectUpdate(src, m);
+            {
+                BR_PROFILE("transform", f, src.size());
+                f->projectUpdate(src, m);
+            }
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
             for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
         }
@@ -110,15 +155,31 @@ protected:
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
-        foreach (const Transform *f, transforms) {
-            try {
-                dst.merge((*f)(src));
-            } catch (...) {
-                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
+        QVector<Template> results(transforms.size());
+        QVector<QString> errors(transforms.size());
+        if (_concurrentBranches(transforms.size())) {
+            TaskGroup tasks;
+            for (int i=1; i<transforms.size(); i++)
+                tasks.run(_projectTemplate, transforms[i], &src, &results[i], &errors[i]);
+            _projectTemplate(transforms[0], &src, &results[0], &errors[0]);
+            tasks.wait();
+        } else {
+            for (int i=0; i<transforms.size(); i++) {
+                _projectTemplate(transforms[i], &src, &results[i], &errors[i]);
+                if (!errors[i].isNull())
+                    break;
+            }
+        }
+
+        // Merged in order, so the result doesn't depend on which branch finished first
+        for (int i=0; i<transforms.size(); i++) {
+            if (!errors[i].isNull()) {
+                qWarning("Exception triggered when processing %s with transform %s: %s", qPrintable(src.file.flat()), qPrintable(transforms[i]->objectName()), qPrintable(errors[i]));
                 dst = Template(src.file);
                 dst.file.fte = true;
                 break;
             }
+            dst.merge(results[i]);
         }
     }
 
@@ -126,9 +187,20 @@ protected:
     {
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
-        foreach (const Transform *f, transforms) {
-            TemplateList m;
-            f->project(src, m);
+
+        QVector<TemplateList> results(transforms.size());
+        if (_concurrentBranches(transforms.size())) {
+            TaskGroup tasks;
+            for (int i=1; i<transforms.size(); i++)
+                tasks.run(_projectList, transforms[i], &src, &results[i]);
+            _projectList(transforms[0], &src, &results[0]);
+            tasks.wait();
+        } else {
+            for (int i=0; i<transforms.size(); i++)
+                _projectList(transforms[i], &src, &results[i]);
+        }
+
+        foreach (const TemplateList &m, results) {
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
             for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
         }
@@ -15,15 +15,160 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/hnsw.h>
+#include <openbr/core/numa.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
 
+// Gallery templates whose matrices reference consecutive rows of contiguous matrices,
+// loaded once and shared by every GalleryCompareTransform comparing against the same gallery.
+// On NUMA machines the rows are split into one partition per node, each allocated and filled by,
+// then compared on, a pool of threads bound to that node so their reads stay local.
+struct PackedGallery
+{
+    struct Partition
+    {
+        int begin, end;
+        cv::Mat features;
+        QSharedPointer<WorkStealingPool> pool; // NULL if there is a single node
+    };
+
+    TemplateList templates;
+    QList<Partition> partitions;
+
+    static QMutex lock;
+    static QHash< QString, QWeakPointer<PackedGallery> > galleries;
+
+    static QSharedPointer<PackedGallery> get(const QString &galleryName, bool numa)
+    {
+        const QString key = galleryName + (numa ? "[numa]" : "");
+        QMutexLocker locker(&lock);
+        QSharedPointer<PackedGallery> gallery = galleries.value(key).toStrongRef();
+        if (gallery.isNull()) {
+            gallery = QSharedPointer<PackedGallery>(new PackedGallery());
+            gallery->templates = TemplateList::fromGallery(galleryName);
+            gallery->pack(numa ? NUMA::nodes() : QList< QList<int> >());
+            galleries.insert(key, gallery);
+        }
+        return gallery;
+    }
+
+    // Joins the node pools of galleries still referenced, their partitions stay in place but are compared serially
+    static void release()
+    {
+        QMutexLocker locker(&lock);
+        foreach (const QWeakPointer<PackedGallery> &weak, galleries) {
+            QSharedPointer<PackedGallery> gallery = weak.toStrongRef();
+            if (gallery.isNull()) continue;
+            for (int i=0; i<gallery->partitions.size(); i++)
+                gallery->partitions[i].pool.clear();
+        }
+        galleries.clear();
+    }
+
+private:
+    // Runs on the partition's node, so the pages are first touched there
+    static void fill(PackedGallery *gallery, int partition, int rows, int cols, int type)
+    {
+        Partition &p = gallery->partitions[partition];
+        p.features = cv::Mat::zeros(p.end - p.begin, rows*cols*CV_MAT_CN(type), CV_MAT_DEPTH(type));
+        for (int i=p.begin; i<p.end; i++) {
+            Template &t = gallery->templates[i];
+            if (t.isEmpty() || t.m().empty()) continue;
+            cv::Mat row = p.features.row(i - p.begin).reshape(CV_MAT_CN(type), rows);
+            t.m().copyTo(row);
+            t.m() = row;
+        }
+    }
+
+    // Templates that aren't a single matrix of a common size and type are left as loaded
+    void pack(const QList< QList<int> > &nodes)
+    {
+        int rows = 0, cols = 0, type = -1;
+        foreach (const Template &t, templates) {
+            if (t.isEmpty() || t.m().empty()) continue;
+            if (t.size() != 1) return;
+            if (type == -1) {
+                rows = t.m().rows;
+                cols = t.m().cols;
+                type = t.m().type();
+            } else if ((t.m().rows != rows) || (t.m().cols != cols) || (t.m().type() != type)) {
+                return;
+            }
+        }
+        if (type == -1) return;
+
+        if (nodes.size() < 2) {
+            Partition p;
+            p.begin = 0;
+            p.end = templates.size();
+            partitions.append(p);
+            fill(this, 0, rows, cols, type);
+            return;
+        }
+
+        // Rows and threads are shared out in proportion to each node's CPUs
+        int cpus = 0;
+        foreach (const QList<int> &node, nodes)
+            cpus += node.size();
+        for (int i=0, seen=0; i<nodes.size(); i++) {
+            Partition p;
+            p.begin = int(qint64(templates.size()) * seen / cpus);
+            seen += nodes[i].size();
+            p.end = int(qint64(templates.size()) * seen / cpus);
+            const int threads = std::max(1, int(qint64(std::max(1, Globals->parallelism)) * nodes[i].size() / cpus));
+            p.pool = QSharedPointer<WorkStealingPool>(new WorkStealingPool(threads, nodes[i]));
+            partitions.append(p);
+        }
+
+        QList<TaskGroup*> fills;
+        for (int i=0; i<partitions.size(); i++) {
+            fills.append(new TaskGroup(partitions[i].pool.data()));
+            fills.last()->run(fill, this, i, rows, cols, type);
+        }
+        qDeleteAll(fills); // Each waits for its partition
+    }
+};
+
+QMutex PackedGallery::lock;
+QHash< QString, QWeakPointer<PackedGallery> > PackedGallery::galleries;
+
+/*!
+ * \ingroup initializers
+ * \brief Joins the NUMA node pools of packed galleries.
+ */
+class PackedGalleries : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        PackedGallery::release();
+    }
+};
+
+BR_REGISTER(Initializer, PackedGalleries)
+
 /*!
  * \ingroup transforms
  * \brief Compare each template to a fixed gallery (with name = galleryName), using the specified distance.
  * dst will contain a 1 by n vector of scores.
+ * When galleryName is a .hnsw gallery, only the \c k nearest templates found by searching its graph are scored,
+ * where \c k is read from the gallery's metadata and defaults to 10, the rest are reported as <tt>-FLT_MAX</tt>.
+ * When \c nearest is positive, dst instead contains no matrix and the \c nearest most similar gallery templates are stored in the \c neighbors metadata,
+ * scored a block of the gallery at a time so no full row of scores is kept.
+ * Gallery templates read from \c galleryName are packed into consecutive rows of one contiguous matrix shared by all transforms using the gallery,
+ * so distances that score a whole gallery at once, such as DistDistance, stream through memory once per query.
+ * When \c numa is set on a machine with several NUMA nodes, the packed gallery is split into one partition per node,
+ * placed in that node's memory and compared by threads bound to it, with the partitions' scores or nearest neighbors merged.
+ * \c numa is off by default since its pools add threads beyond \c parallelism, they are joined by br::Context::finalize().
+ * When cross validating, each query is only compared to gallery templates of its own partition and those in all partitions,
+ * the scores of the other pairs, which the cross validation mask ignores, are reported as <tt>-FLT_MAX</tt> without being computed.
  * \author Charles Otto \cite caotto
  */
 class GalleryCompareTransform : public Transform
@@ -32,9 +177,52 @@ class GalleryCompareTransform : public Transform
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED true)
     Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
     BR_PROPERTY(br::Distance*, distance, NULL)
+    Q_PROPERTY(int nearest READ get_nearest WRITE set_nearest RESET reset_nearest STORED false)
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa STORED false)
     BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(int, nearest, 0)
+    BR_PROPERTY(bool, numa, false)
 
     TemplateList gallery;
+    QSharedPointer<PackedGallery> packed;
+    QSharedPointer<HNSWIndex> index;
+    int k;
+
+    // Cross validation partitions of the gallery, looked up once. For each query partition, the gallery templates it is
+    // compared to and their columns, the templates in all partitions (-1) are compared to queries of any other partition.
+    QHash<int, TemplateList> partitionTemplates;
+    QHash<int, QVector<int> > partitionColumns;
+
+    void indexPartitions()
+    {
+        partitionTemplates.clear();
+        partitionColumns.clear();
+        if (Globals->crossValidate < 2)
+            return;
+
+        const QList<int> partitions = gallery.files().crossValidationPartitions();
+        QSet<int> ids = partitions.toSet();
+        ids.insert(-1);
+        foreach (int id, ids)
+            for (int j=0; j<partitions.size(); j++)
+                if ((partitions[j] == id) || (partitions[j] == -1)) {
+                    partitionTemplates[id].append(gallery[j]);
+                    partitionColumns[id].append(j);
+                }
+    }
+
+    QList<float> compareWithinPartition(const Template &src) const
+    {
+        const int partition = src.file.get<int>("Partition", 0);
+        const int key = partitionColumns.contains(partition) ? partition : -1;
+        const QVector<int> columns = partitionColumns.value(key);
+        const QList<float> scores = distance->compare(partitionTemplates.value(key), src);
+
+        QList<float> line = QVector<float>(gallery.size(), -FLT_MAX).toList();
+        for (int j=0; j<columns.size(); j++)
+            line[columns[j]] = scores[j];
+        return line;
+    }
 
     void project(const Template &src, Template &dst) const
     {
@@ -42,19 +230,116 @@ class GalleryCompareTransform : public Transform
         if (gallery.isEmpty())
             return;
 
-        QList<float> line = distance->compare(gallery, src);
+        if (nearest > 0) {
+            dst.m() = cv::Mat();
+            dst.file.set("neighbors", QVariant::fromValue(nearestNeighbors(src)));
+            return;
+        }
+
+        QList<float> line;
+        if (!partitionColumns.isEmpty() && index.isNull() && (src.file.get<int>("Partition", 0) != -1)) {
+            line = compareWithinPartition(src);
+        } else if (partitioned()) {
+            QVector< QList<float> > scores(packed->partitions.size());
+            runPartitions(comparePartition, &src, scores.data(), NULL);
+            foreach (const QList<float> &partition, scores)
+                line.append(partition);
+        } else if (index.isNull()) {
+            line = distance->compare(gallery, src);
+        } else {
+            line = QVector<float>(gallery.size(), -FLT_MAX).toList();
+            foreach (const HNSWIndex::Match &match, index->search(src, k))
+                line[match.first] = match.second;
+        }
         dst.m() = OpenCVUtils::toMat(line, 1);
     }
 
+    bool partitioned() const
+    {
+        return !packed.isNull() && (packed->partitions.size() > 1) && !packed->partitions.first().pool.isNull();
+    }
+
+    // Scores src against each partition on its node, the calling thread waits without taking a core of any node
+    void runPartitions(void (*function)(const GalleryCompareTransform*, int, const Template*, QList<float>*, Neighbors*),
+                       const Template *src, QList<float> *scores, Neighbors *heaps) const
+    {
+        QList<TaskGroup*> partitions;
+        for (int i=0; i<packed->partitions.size(); i++) {
+            partitions.append(new TaskGroup(packed->partitions[i].pool.data()));
+            partitions.last()->run(function, this, i, src, scores ? &scores[i] : NULL, heaps ? &heaps[i] : NULL);
+        }
+        qDeleteAll(partitions);
+    }
+
+    static void comparePartition(const GalleryCompareTransform *transform, int partition, const Template *src, QList<float> *scores, Neighbors *)
+    {
+        const PackedGallery::Partition &p = transform->packed->partitions[partition];
+        *scores = transform->distance->compare(transform->gallery.mid(p.begin, p.end - p.begin), *src);
+    }
+
+    static void nearestPartition(const GalleryCompareTransform *transform, int partition, const Template *src, QList<float> *, Neighbors *heap)
+    {
+        const PackedGallery::Partition &p = transform->packed->partitions[partition];
+        transform->nearestInRange(*src, p.begin, p.end, *heap);
+    }
+
+    // Adds the nearest of gallery[begin, end) to the unsorted heap
+    void nearestInRange(const Template &src, int begin, int end, Neighbors &heap) const
+    {
+        static const int blockSize = 1024;
+        for (int i=begin; i<end; i+=blockSize) {
+            const QList<float> scores = distance->compare(gallery.mid(i, std::min(blockSize, end - i)), src);
+            for (int j=0; j<scores.size(); j++)
+                insertNeighbor(heap, Neighbor(i+j, scores[j]), nearest);
+        }
+    }
+
+    Neighbors nearestNeighbors(const Template &src) const
+    {
+        if (!index.isNull())
+            return index->search(src, nearest);
+
+        Neighbors heap;
+        heap.reserve(nearest);
+        if (partitioned()) {
+            // The nearest overall are among the nearest of each partition
+            QVector<Neighbors> heaps(packed->partitions.size());
+            runPartitions(nearestPartition, &src, NULL, heaps.data());
+            foreach (const Neighbors &partition, heaps)
+                foreach (const Neighbor &neighbor, partition)
+                    insertNeighbor(heap, neighbor, nearest);
+        } else {
+            nearestInRange(src, 0, gallery.size(), heap);
+        }
+        std::sort_heap(heap.begin(), heap.end(), compareNeighbors);
+        return heap;
+    }
+
     void init()
     {
-        if (!galleryName.isEmpty())
-            gallery = TemplateList::fromGallery(galleryName);
+        index.clear();
+        packed.clear();
+        if (galleryName.isEmpty())
+            return;
+
+        if (File(galleryName).suffix() == "hnsw") {
+            index = QSharedPointer<HNSWIndex>(new HNSWIndex());
+            index->read(galleryName);
+            index->setDistance(distance);
+            k = File(galleryName).get<int>("k", 10);
+            gallery = index->templates();
+        } else {
+            packed = PackedGallery::get(galleryName, numa);
+            gallery = packed->templates;
+        }
+        indexPartitions();
     }
 
     void train(const TemplateList &data)
     {
+        packed.clear();
         gallery = data;
+        indexPartitions();
     }
 
     void store(QDataStream &stream) const
@@ -67,6 +352,7 @@ class GalleryCompareTransform : public Transform
     {
         br::Object::load(stream);
         stream >> gallery;
+        indexPartitions();
     }
 
 public:
@@ -14,20 +14,41 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// Selects one matrix of each template when streaming training data to the corresponding clone
+class IndependentSelectTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+public:
+    int index;
+
+    IndependentSelectTransform(int index) : index(index) {}
+
+private:
+    void project(const Template &src, Template &dst) const
+    {
+        dst.file = src.file;
+        if (index < src.size()) dst.append(src[index]);
+        else                    dst.file.fte = true;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Clones the transform so that it can be applied independently.
  * \author Josh Klontz \cite jklontz
  * \em Independent transforms expect single-matrix templates.
+ * Matrices are projected in parallel on the shared br::WorkStealingPool, as for a single latency sensitive template,
+ * split into contiguous ranges, at most one per thread.
+ * Lists of templates are projected by each clone as a list, so batched implementations of br::Transform::project(const TemplateList &, TemplateList &) are used.
  */
 class IndependentTransform : public MetaTransform
 {
@@ -149,24 +170,124 @@ class IndependentTransform : public MetaTransform
         while (transforms.size() < templatesList.size())
             transforms.append(transform->clone());
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<templatesList.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i]));
-        futures.waitForFinished();
+            tasks.run(_train, transforms[i], &templatesList[i]);
+        tasks.wait();
+    }
+
+    // Each clone makes its own passes over the data in turn, since views of the same data may share a stream
+    void train(TemplateIterator &data)
+    {
+        if (!trainable) return;
+
+        // The number of matrices per template is taken from the first block
+        TemplateList block;
+        int size = 0;
+        data.rewind();
+        if (data.next(block))
+            foreach (const Template &t, block)
+                size = std::max(size, t.size());
+
+        while (transforms.size() < size)
+            transforms.append(transform->clone());
+
+        for (int i=0; i<size; i++) {
+            IndependentSelectTransform select(i);
+            TemplateIterator view = data.projected(&select);
+            transforms[i]->train(view);
+        }
+    }
+
+    bool trainsInOnePass() const
+    {
+        return false;
+    }
+
+    static void _project(const QList<Transform*> *transforms, const Template *src, QList<Template> *dsts, int begin, int end)
+    {
+        for (int i=begin; i<end; i++)
+            transforms->at(i%transforms->size())->project(Template(src->file, src->at(i)), (*dsts)[i]);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        dst.file = src.file;
-        QList<Mat> mats;
-        for (int i=0; i<src.size(); i++) {
-            transforms[i%transforms.size()]->project(Template(src.file, src[i]), dst);
-            mats.append(dst);
-            dst.clear();
+        QList<Template> dsts;
+        for (int i=0; i<src.size(); i++)
+            dsts.append(Template(src.file));
+
+        // Ranges are queued on the shared pool for whichever workers are free, the calling thread takes the first range
+        const int ranges = std::min(src.size(), std::max(1, Globals->parallelism));
+        if (ranges > 1) {
+            TaskGroup tasks;
+            for (int i=1; i<ranges; i++)
+                tasks.run(_project, &transforms, &src, &dsts, src.size()*i/ranges, src.size()*(i+1)/ranges);
+            _project(&transforms, &src, &dsts, 0, src.size()/ranges);
+            tasks.wait();
+        } else {
+            _project(&transforms, &src, &dsts, 0, src.size());
         }
+
+        dst.file = dsts.isEmpty() ? src.file : dsts.last().file;
+        QList<Mat> mats;
+        foreach (const Template &t, dsts)
+            mats.append(t);
         dst.append(mats);
     }
 
+    static void _projectList(const Transform *transform, const TemplateList *src, TemplateList *dst)
+    {
+        transform->project(*src, *dst);
+    }
+
+    // Lists reach the clones as lists, matrix i of each template going to clone i, so transforms with
+    // a batched project(TemplateList) see the whole batch. The clones keep the metadata they produce.
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        int size = 0;
+        foreach (const Template &t, src)
+            size = std::max(size, t.size());
+
+        QVector<TemplateList> columns(size), results(size);
+        QVector< QVector<int> > rows(size);
+        for (int j=0; j<src.size(); j++)
+            for (int i=0; i<src[j].size(); i++) {
+                columns[i].append(Template(src[j].file, src[j][i]));
+                rows[i].append(j);
+            }
+
+        // Single matrix templates are passed straight through, whatever the clone does with the list
+        if ((size == 1) && (rows[0].size() == src.size())) {
+            _projectList(transforms[0], &columns[0], &dst);
+            return;
+        }
+
+        if (size > 1) {
+            TaskGroup tasks;
+            for (int i=1; i<size; i++)
+                tasks.run(_projectList, transforms[i%transforms.size()], &columns[i], &results[i]);
+            _projectList(transforms[0], &columns[0], &results[0]);
+            tasks.wait();
+        } else if (size == 1) {
+            _projectList(transforms[0], &columns[0], &results[0]);
+        }
+
+        dst.reserve(dst.size() + src.size());
+        const int offset = dst.size();
+        QVector< QList<Mat> > mats(src.size());
+        foreach (const Template &t, src)
+            dst.append(Template(t.file));
+        for (int i=0; i<size; i++) {
+            if (results[i].size() != rows[i].size()) qFatal("TemplateList is of an unexpected size.");
+            for (int k=0; k<rows[i].size(); k++) {
+                dst[offset + rows[i][k]].file = results[i][k].file;
+                mats[rows[i][k]].append(results[i][k]);
+            }
+        }
+        for (int j=0; j<src.size(); j++)
+            dst[offset + j].append(mats[j]);
+    }
+
     void projectUpdate(const Template &src, Template &dst)
     {
         dst.file = src.file;
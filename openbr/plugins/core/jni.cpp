@@ -44,6 +44,21 @@ class JNIInitializer : public Initializer
     {
         jvm->DestroyJavaVM();
     }
+
+    // The calling thread's environment, attaching it to the JavaVM the first time.
+    // Threads stay attached as daemons so workers don't pay for attaching on every call.
+    static JNIEnv *environment()
+    {
+        JNIEnv *env = NULL;
+        const jint status = jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
+        if (status == JNI_EDETACHED) {
+            if (jvm->AttachCurrentThreadAsDaemon(reinterpret_cast<void**>(&env), NULL) != JNI_OK)
+                qFatal("Failed to attach thread to the JavaVM");
+        } else if (status != JNI_OK) {
+            qFatal("Failed to initialize JNI environment");
+        }
+        return env;
+    }
 };
 
 JavaVM *JNIInitializer::jvm;
@@ -54,47 +69,121 @@ BR_REGISTER(Initializer, JNIInitializer)
 /*!
  * \ingroup transforms
  * \brief Execute Java code from OpenBR using the JNI
+ *
+ * If \c className has a static <tt>projectBatch(String[] names, java.nio.ByteBuffer[] matrices, int[] shapes)</tt> method,
+ * each block of templates is passed to it in one call. \c matrices holds a direct buffer over the data of every matrix,
+ * a view rather than a copy that must not be modified or kept after the call, and \c shapes holds the template index,
+ * rows, columns and OpenCV type of each matrix in turn. Otherwise the static <tt>project(String name)</tt> method is
+ * called once per template.
  * \author Jordan Cheney \cite jcheney
  */
-
 class JNITransform : public UntrainableTransform
 {
     Q_OBJECT
     Q_PROPERTY(QString className READ get_className WRITE set_className RESET reset_className STORED false)
     BR_PROPERTY(QString, className, "")
 
-    void project(const Template &src, Template &dst) const
+    // Global references and method IDs are valid on every thread, so they're looked up once
+    jclass cls;
+    jclass stringClass, bufferClass;
+    jmethodID projectMethod, batchMethod;
+
+    void init()
     {
-        (void)dst; //Eliminates a compiler warning.
+        cls = stringClass = bufferClass = NULL;
+        projectMethod = batchMethod = NULL;
+        if (className.isEmpty())
+            return;
+
+        JNIEnv *env = JNIInitializer::environment();
+        cls = globalClass(env, className.toLocal8Bit().constData());
+        if (cls == NULL) qFatal("Class not found");
+        stringClass = globalClass(env, "java/lang/String");
+        bufferClass = globalClass(env, "java/nio/ByteBuffer");
+
+        batchMethod = env->GetStaticMethodID(cls, "projectBatch", "([Ljava/lang/String;[Ljava/nio/ByteBuffer;[I)V");
+        if (batchMethod == NULL) env->ExceptionClear(); // NoSuchMethodError, fall back to project
+        projectMethod = env->GetStaticMethodID(cls, "project", "(Ljava/lang/String;)V");
+        if (projectMethod == NULL) env->ExceptionClear();
+        if ((batchMethod == NULL) && (projectMethod == NULL)) qFatal("MethodID not found");
+    }
 
-		JNIEnv *env;
+    static jclass globalClass(JNIEnv *env, const char *name)
+    {
+        jclass local = env->FindClass(name);
+        if (local == NULL)
+            return NULL;
+        jclass global = static_cast<jclass>(env->NewGlobalRef(local));
+        env->DeleteLocalRef(local);
+        return global;
+    }
 
-        //Attach current thread to the thread of the JavaVM and access env
-        JNIInitializer::jvm->AttachCurrentThreadAsDaemon((void**)&env, NULL);
-        if (JNIInitializer::jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
-            qFatal("Failed to initialize JNI environment");
+    static void checkException(JNIEnv *env)
+    {
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+            qFatal("Java exception thrown by JNI transform");
         }
+    }
 
-        //Convert QString to const char*
-        QByteArray tmpClass = className.toLocal8Bit();
-        const char* charClassName = tmpClass.constData();
-
-        //Call java method
-        jclass cls = env->FindClass(charClassName);
-        if (cls == NULL) { qFatal("Class not found"); }
-        jmethodID mid = env->GetStaticMethodID(cls, "project", "(Ljava/lang/String;)V");
-        if (mid == NULL) { qFatal("MethodID not found"); }
+    void project(const Template &src, Template &dst) const
+    {
+        TemplateList srcs, dsts;
+        srcs.append(src);
+        project(srcs, dsts);
+        dst = dsts.first();
+    }
 
-        QByteArray tmp = src.file.name.toLocal8Bit();
-        const char* fileName = tmp.constData();
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        dst = src;
+        if (src.isEmpty())
+            return;
+
+        JNIEnv *env = JNIInitializer::environment();
+
+        if (batchMethod == NULL) {
+            foreach (const Template &t, src) {
+                jstring name = env->NewStringUTF(t.file.name.toUtf8().constData());
+                env->CallStaticVoidMethod(cls, projectMethod, name);
+                env->DeleteLocalRef(name);
+                checkException(env);
+            }
+            return;
+        }
 
-        //Convert char* to java compatible string
-        jstring jfileName = env->NewStringUTF(fileName);
+        // Buffers must address continuous data, the few matrices that aren't are copied and kept alive for the call
+        QList<cv::Mat> matrices;
+        QVector<jint> shapes;
+        for (int i=0; i<src.size(); i++)
+            foreach (const cv::Mat &m, src[i]) {
+                matrices.append(m.isContinuous() ? m : m.clone());
+                shapes << i << m.rows << m.cols << m.type();
+            }
+
+        // Threads stay attached, so local references are released with the frame instead of on detach
+        if (env->PushLocalFrame(src.size() + matrices.size() + 4) != JNI_OK)
+            qFatal("Failed to allocate JNI local references");
+
+        jobjectArray names = env->NewObjectArray(src.size(), stringClass, NULL);
+        for (int i=0; i<src.size(); i++)
+            env->SetObjectArrayElement(names, i, env->NewStringUTF(src[i].file.name.toUtf8().constData()));
+
+        jobjectArray buffers = env->NewObjectArray(matrices.size(), bufferClass, NULL);
+        for (int i=0; i<matrices.size(); i++) {
+            const cv::Mat &m = matrices[i];
+            if (!m.empty()) // Left null, direct buffers can't be empty
+                env->SetObjectArrayElement(buffers, i, env->NewDirectByteBuffer(m.data, jlong(m.total() * m.elemSize())));
+        }
 
-        env->CallStaticObjectMethod(cls, mid, jfileName);
+        jintArray jshapes = env->NewIntArray(shapes.size());
+        env->SetIntArrayRegion(jshapes, 0, shapes.size(), shapes.data());
 
-        JNIInitializer::jvm->DetachCurrentThread();
-	}
+        env->CallStaticVoidMethod(cls, batchMethod, names, buffers, jshapes);
+        env->PopLocalFrame(NULL);
+        checkException(env);
+    }
 };
 
 BR_REGISTER(Transform, JNITransform)
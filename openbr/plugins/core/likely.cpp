@@ -1,4 +1,8 @@
+#include <QHash>
+#include <QList>
+#include <QMutex>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/profiler.h>
 #include <openbr/core/qtutils.h>
 
 #include <likely.h>
@@ -7,6 +11,14 @@
 namespace br
 {
 
+// Likely doesn't report the size of compiled code, each function starts its own page aligned section,
+// so the rest of its first page bounds it for perf's symbol map
+static void mapFunction(const void *function, const QString &name)
+{
+    const qint64 page = 4096;
+    Profiler::mapCode(function, page - qint64(quintptr(function) % page), "likely:" + name);
+}
+
 /*!
  * \ingroup transforms
  * \brief Generic interface to Likely JIT compiler
@@ -39,6 +51,7 @@ class LikelyTransform : public Transform
         function = (Function) likely_function(env->expr);
         if (!function)
             qFatal("Failed to compile: %s", qPrintable(sourceFile));
+        mapFunction((const void*) function, QFileInfo(sourceFile).baseName());
     }
 
     void train(const TemplateList &trainingData)
@@ -97,6 +110,83 @@ class LikelyTransform : public Transform
 
 BR_REGISTER(Transform, LikelyTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief JIT compiles an element-wise Likely expression of \c src into a 32-bit float kernel.
+ *
+ * Created by FuseTransform for runs of pixel transforms with a br::PixelTransform::likelyExpression.
+ * Compiled kernels are cached by expression and shared for the life of the process.
+ */
+class LikelyKernelTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString expression READ get_expression WRITE set_expression RESET reset_expression STORED false)
+    BR_PROPERTY(QString, expression, "src")
+
+    typedef likely_mat (*Function)(likely_const_mat);
+    Function function;
+
+    // Each environment owns the code of its compiled function, so both live as long as the cache
+    class Cache
+    {
+        QMutex lock;
+        QHash<QString, Function> functions;
+        QList<likely_const_env> envs;
+
+    public:
+        ~Cache()
+        {
+            foreach (likely_const_env env, envs)
+                likely_release_env(env);
+        }
+
+        Function compile(const QString &expression)
+        {
+            QMutexLocker locker(&lock);
+            if (functions.contains(expression))
+                return functions.value(expression);
+
+            const QString source = QString("src :->\n"
+                                           "{\n"
+                                           "  dst := (imitate-size src (imitate-dimensions f32 src.type))\n"
+                                           "  (dst src) :=>\n"
+                                           "    dst :<- %1\n"
+                                           "}\n").arg(expression);
+
+            likely_settings settings = likely_default_settings(likely_file_void, false);
+            const likely_const_env parent = likely_standard(settings, NULL, likely_file_void);
+            const likely_const_env env = likely_lex_parse_and_eval(qPrintable(source), likely_file_lisp, parent);
+            likely_release_env(parent);
+
+            const Function function = env ? (Function) likely_function(env->expr) : NULL;
+            if (!function) {
+                likely_release_env(env);
+                qFatal("Failed to compile: %s", qPrintable(expression));
+            }
+            functions.insert(expression, function);
+            envs.append(env);
+            return function;
+        }
+    };
+
+    void init()
+    {
+        static Cache cache;
+        function = cache.compile(expression);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const likely_const_mat srcl = likelyFromOpenCVMat(src);
+        const likely_const_mat dstl = function(srcl);
+        dst = likelyToOpenCVMat(dstl);
+        likely_release_mat(dstl);
+        likely_release_mat(srcl);
+    }
+};
+
+BR_REGISTER(Transform, LikelyKernelTransform)
+
 } // namespace br
 
 #include "core/likely.moc"
@@ -14,13 +14,148 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCryptographicHash>
+#include <QTemporaryFile>
 #include <QtConcurrent>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
+#include <openbr/core/profiler.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
 
+/*!
+ * \ingroup Transforms
+ * \brief Pixel transforms in series, computed in a single tiled pass.
+ *
+ * Each block of rows is passed through every br::PixelTransform while it is still in cache,
+ * and only the final result is allocated at full size.
+ * Templates the kernels can't handle are projected through the transforms one at a time.
+ * When built with Likely and every transform has a br::PixelTransform::likelyExpression, floating point templates
+ * are instead projected by one JIT compiled kernel, see LikelyKernelTransform.
+ * Typically introduced by PipeTransform::simplify rather than written by hand.
+ *
+ * \see PipeTransform
+ */
+class FuseTransform : public CompositeTransform
+{
+    Q_OBJECT
+
+    static const int tileBytes = 32*1024;
+
+    QSharedPointer<Transform> jit; // Only available when built with Likely
+
+    void init()
+    {
+        CompositeTransform::init();
+
+        jit.clear();
+        QString expression = "src";
+        foreach (const Transform *f, transforms) {
+            const PixelTransform *kernel = dynamic_cast<const PixelTransform *>(f);
+            expression = kernel ? kernel->likelyExpression(expression) : QString();
+            if (expression.isEmpty())
+                return;
+        }
+
+        if (!Factory<Transform>::names().contains("LikelyKernel"))
+            return;
+
+        // Transform::make would wrap the kernel in an Independent transform that never sees the expression
+        File kernel(".LikelyKernel");
+        kernel.set("expression", expression);
+        jit = QSharedPointer<Transform>(Factory<Transform>::make(kernel));
+    }
+
+    // Pixel transforms are untrainable and not time varying
+    void train(const QList<TemplateList> &data)
+    {
+        (void) data;
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        project(src, dst);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        project(src, dst);
+    }
+
+protected:
+    void _project(const TemplateList &src, TemplateList &dst) const
+    {
+        Transform::project(src, dst);
+    }
+
+    void _project(const Template &src, Template &dst) const
+    {
+        QList<const PixelTransform *> kernels;
+        QList<int> types;
+        if (src.size() == 1) {
+            int type = src.m().type();
+            foreach (const Transform *f, transforms) {
+                const PixelTransform *kernel = dynamic_cast<const PixelTransform *>(f);
+                type = kernel ? kernel->outputType(type) : -1;
+                if (type < 0)
+                    break;
+                kernels.append(kernel);
+                types.append(type);
+            }
+        }
+
+        if (jit && (kernels.size() == transforms.size())) {
+            // The JIT kernel computes in floating point, so only matches when every stage outputs floats
+            bool floats = true;
+            foreach (int type, types)
+                floats = floats && (CV_MAT_DEPTH(type) == CV_32F);
+            if (floats) {
+                jit->project(src, dst);
+                return;
+            }
+        }
+
+        if (kernels.size() != transforms.size()) {
+            dst = src;
+            foreach (const Transform *f, transforms) {
+                dst >> *f;
+                if (dst.file.fte)
+                    break;
+            }
+            return;
+        }
+
+        const cv::Mat &m = src.m();
+        size_t rowBytes = m.cols * m.elemSize();
+        foreach (int type, types)
+            rowBytes = std::max(rowBytes, size_t(m.cols * CV_ELEM_SIZE(type)));
+        const int tileRows = std::max(1, int(tileBytes / std::max(rowBytes, size_t(1))));
+
+        cv::Mat result = MatArena::mat(m.rows, m.cols, types.last());
+        QList<cv::Mat> buffers;
+        for (int i=0; i<types.size()-1; i++)
+            buffers.append(MatArena::mat(std::min(tileRows, m.rows), m.cols, types[i]));
+
+        for (int row=0; row<m.rows; row+=tileRows) {
+            const int rows = std::min(tileRows, m.rows - row);
+            cv::Mat in = m.rowRange(row, row + rows);
+            for (int i=0; i<kernels.size(); i++) {
+                cv::Mat out = (i == kernels.size()-1) ? result.rowRange(row, row + rows)
+                                                      : buffers[i].rowRange(0, rows);
+                kernels[i]->projectTile(in, out);
+                in = out;
+            }
+        }
+
+        dst = Template(src.file, result);
+    }
+};
+
+BR_REGISTER(Transform, FuseTransform)
+
 /*!
  * \ingroup Transforms
  * \brief Transforms in series.
@@ -40,13 +175,81 @@ class PipeTransform : public CompositeTransform
         TemplateList ftes;
         for (int i=startIndex; i<stopIndex; i++) {
             TemplateList res;
-            transforms[i]->project(*srcdst, res);
+            {
+                BR_PROFILE("transform", transforms[i], srcdst->size());
+                transforms[i]->project(*srcdst, res);
+            }
 
             splitFTEs(res, ftes);
             *srcdst = res;
         }
     }
 
+    // Identifies a stage's training run by its description and the data reaching it
+    static QByteArray trainingKey(const Transform *stage, const QList<TemplateList> &data)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(stage->description().toUtf8());
+        foreach (const TemplateList &list, data) {
+            hash.addData(QByteArray::number(list.size()));
+            foreach (const Template &t, list) {
+                hash.addData(t.file.flat().toUtf8());
+                foreach (const cv::Mat &m, t) {
+                    const qint32 header[3] = { m.rows, m.cols, m.type() };
+                    hash.addData((const char*) header, sizeof(header));
+                    for (int i=0; i<m.rows; i++)
+                        hash.addData((const char*) m.ptr(i), int(m.cols * m.elemSize()));
+                }
+            }
+        }
+        return hash.result();
+    }
+
+    // Trains the stage, reusing the model from a previous run on identical data if Globals->trainingCache is set
+    static void trainStage(Transform *stage, const QList<TemplateList> &data)
+    {
+        if (Globals->trainingCache.isEmpty()) {
+            stage->train(data);
+            return;
+        }
+
+        const QString description = stage->description();
+        const QString fileName = Globals->trainingCache + "/" + QString(trainingKey(stage, data).toHex()) + ".model";
+
+        QFile fin(fileName);
+        if (fin.exists()) {
+            QtUtils::BlockCompression reader(&fin);
+            if (reader.open(QIODevice::ReadOnly)) {
+                QDataStream stream(&reader);
+                QString storedDescription;
+                stream >> storedDescription;
+                if (storedDescription == description) {
+                    qDebug("Loading %s from %s", qPrintable(description), qPrintable(fileName));
+                    stage->load(stream);
+                    return;
+                }
+            }
+        }
+
+        stage->train(data);
+
+        // Written to a temporary file first so concurrent runs never see a partial model
+        QFile fout(fileName + ".tmp");
+        QtUtils::touchDir(fout);
+        QtUtils::BlockCompression writer;
+        writer.setBasis(&fout);
+        if (!writer.open(QFile::WriteOnly)) {
+            qWarning("Unable to open %s for writing.", qPrintable(fout.fileName()));
+            return;
+        }
+        QDataStream stream(&writer);
+        stream << description;
+        stage->store(stream);
+        writer.close();
+        QFile::remove(fileName);
+        QFile::rename(fout.fileName(), fileName);
+    }
+
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
@@ -58,7 +261,7 @@ class PipeTransform : public CompositeTransform
             // Conditional statement covers likely case that first transform is untrainable
             if (transforms[i]->trainable) {
                 qDebug() << "Training " << transforms[i]->description() << "\n...";
-                transforms[i]->train(dataLines);
+                trainStage(transforms[i], dataLines);
             }
 
             // if the transform is time varying, we can't project it in parallel
@@ -108,11 +311,71 @@ class PipeTransform : public CompositeTransform
         }
     }
 
+    // Writes every projected block of data to a temporary gallery, serializing one block while the next is projected
+    static void spill(TemplateIterator &data, QTemporaryFile &file)
+    {
+        file.setFileTemplate(QDir::tempPath() + "/br_train_XXXXXX.gal");
+        if (!file.open())
+            qFatal("Failed to create a temporary training gallery in %s.", qPrintable(QDir::tempPath()));
+        file.close();
+
+        QScopedPointer<Gallery> gallery(Gallery::make(file.fileName()));
+        QFuture<void> writing;
+        TemplateList block;
+        data.rewind();
+        while (data.next(block)) {
+            writing.waitForFinished();
+            writing = QtConcurrent::run(gallery.data(), &Gallery::writeBlock, block);
+        }
+        writing.waitForFinished();
+    }
+
+    // Each trainable stage streams the data through the stages before it, one block at a time.
+    // Before a trainable stage that makes several passes, data projected through earlier stages is spilled to disk once,
+    // so neither its passes nor later stages repeat those projections, keeping memory bounded by the block size.
+    void train(TemplateIterator &data)
+    {
+        if (!trainable) return;
+
+        // Time varying stages need to see all of the data in order
+        foreach (const Transform *transform, transforms)
+            if (transform->timeVarying()) {
+                Transform::train(data);
+                return;
+            }
+
+        // Only the latest spill is kept, the previous one is deleted once the next has been written from it
+        QScopedPointer<QTemporaryFile> spilled;
+        TemplateIterator view(data);
+        bool projected = false;
+        for (int i=0; i<transforms.size(); i++) {
+            if (transforms[i]->trainable) {
+                if (projected && !transforms[i]->trainsInOnePass()) {
+                    QScopedPointer<QTemporaryFile> next(new QTemporaryFile());
+                    spill(view, *next);
+                    view = TemplateIterator(File(next->fileName()));
+                    spilled.reset(next.take());
+                    projected = false;
+                }
+                qDebug() << "Training " << transforms[i]->description() << "\n...";
+                transforms[i]->train(view);
+            }
+            view = view.projected(transforms[i]);
+            projected = true;
+        }
+    }
+
+    bool trainsInOnePass() const
+    {
+        return trainsChildrenInOnePass();
+    }
+
     void projectUpdate(const Template &src, Template &dst)
     {
         dst = src;
         foreach (Transform *f, transforms) {
             try {
+                BR_PROFILE("transform", f, 1);
                 f->projectUpdate(dst);
                 if (dst.file.fte)
                     break;
@@ -133,7 +396,10 @@ class PipeTransform : public CompositeTransform
         dst = src;
         foreach (Transform *f, transforms) {
             TemplateList res;
-            f->projectUpdate(dst, res);
+            {
+                BR_PROFILE("transform", f, dst.size());
+                f->projectUpdate(dst, res);
+            }
             splitFTEs(res, ftes);
             dst = res;
         }
@@ -162,6 +428,52 @@ class PipeTransform : public CompositeTransform
         }
     }
 
+    // Runs of adjacent pixel transforms are replaced by a FuseTransform
+    Transform *simplify(bool &newTransform)
+    {
+        Transform *simplified = CompositeTransform::simplify(newTransform);
+        PipeTransform *pipe = dynamic_cast<PipeTransform *>(simplified);
+        if (!pipe)
+            return simplified;
+
+        QList<Transform *> fused, fuses;
+        const QList<Transform *> &children = pipe->transforms;
+        for (int i=0; i<children.size(); i++) {
+            int j = i;
+            while ((j < children.size()) && dynamic_cast<PixelTransform *>(children[j]))
+                j++;
+            if (j - i < 2) {
+                fused.append(children[i]);
+                continue;
+            }
+
+            CompositeTransform *fuse = dynamic_cast<CompositeTransform *>(Transform::make("Fuse", NULL));
+            fuse->transforms = children.mid(i, j - i);
+            fuse->init();
+            fused.append(fuse);
+            fuses.append(fuse);
+            i = j - 1;
+        }
+
+        if (fuses.empty())
+            return simplified;
+
+        if (!newTransform) {
+            // make a copy of the current object, with empty transforms
+            QList<Transform *> temp = transforms;
+            transforms = QList<Transform *>();
+            pipe = dynamic_cast<PipeTransform *>(Transform::make(description(false), NULL));
+            transforms = temp;
+            newTransform = true;
+        }
+
+        foreach (Transform *fuse, fuses)
+            fuse->setParent(pipe);
+        pipe->transforms = fused;
+        pipe->init();
+        return pipe;
+    }
+
     void init()
     {
         QList<Transform *> flattened;
@@ -187,30 +499,69 @@ protected:
     {
         TemplateList ftes;
         dst = src;
+        const Transform *deferred = NULL;
         foreach (const Transform *f, transforms) {
+            if (deferred && !dynamic_cast<const MetadataTransform *>(f)) {
+                materialize(dst, deferred);
+                splitFTEs(dst, ftes);
+                deferred = NULL;
+            }
+
             TemplateList res;
-            f->project(dst, res);
+            {
+                BR_PROFILE("transform", f, dst.size());
+                f->project(dst, res);
+            }
             splitFTEs(res, ftes);
             dst = res;
+
+            foreach (const Template &t, dst)
+                if (t.file.contains("Deferred")) {
+                    deferred = f;
+                    break;
+                }
         }
+        if (deferred)
+            materialize(dst, deferred);
         dst.append(ftes);
     }
 
+   // Stages such as Read(lazy=true) mark templates Deferred, and are projected again before the first stage that needs pixels
+   static void materialize(TemplateList &templates, const Transform *deferred)
+   {
+       for (int i=0; i<templates.size(); i++)
+           if (templates[i].file.contains("Deferred"))
+               templates[i] >> *deferred;
+   }
+
    // Single template const project, pass the template through each sub-transform, one after the other
    virtual void _project(const Template &src, Template &dst) const
    {
        dst = src;
+       const Transform *deferred = NULL;
        foreach (const Transform *f, transforms) {
            try {
+               if (deferred && !dynamic_cast<const MetadataTransform *>(f)) {
+                   dst >> *deferred;
+                   deferred = NULL;
+                   if (dst.file.fte)
+                       break;
+               }
+
+               BR_PROFILE("transform", f, 1);
                dst >> *f;
                if (dst.file.fte)
                    break;
+               if (dst.file.contains("Deferred"))
+                   deferred = f;
            } catch (...) {
                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
                dst = Template(src.file);
                dst.file.fte = true;
            }
        }
+       if (deferred && !dst.file.fte)
+           dst >> *deferred;
    }
 };
 
@@ -20,17 +20,52 @@
 #include <QLocalSocket>
 #include <QMutex>
 #include <QProcess>
+#include <QSharedMemory>
 #include <QUuid>
 #include <QWaitCondition>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/templatecodec.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// Counts the bytes serialized to it, to size a shared memory payload before writing it
+class CountingDevice : public QIODevice
+{
+public:
+    qint64 count;
+    CountingDevice() : count(0) { open(QIODevice::WriteOnly); }
+
+protected:
+    qint64 readData(char *, qint64) { return -1; }
+    qint64 writeData(const char *, qint64 len) { count += len; return len; }
+};
+
+// Serializes directly into a fixed region of memory
+class MemoryDevice : public QIODevice
+{
+public:
+    MemoryDevice(char *data, qint64 capacity) : data(data), capacity(capacity), written(0) { open(QIODevice::WriteOnly); }
+
+protected:
+    char *data;
+    qint64 capacity, written;
+
+    qint64 readData(char *, qint64) { return -1; }
+    qint64 writeData(const char *src, qint64 len)
+    {
+        if (written + len > capacity)
+            return -1;
+        memcpy(data + written, src, len);
+        written += len;
+        return len;
+    }
+};
+
 class CommunicationManager : public QObject
 {
     Q_OBJECT
@@ -67,6 +102,8 @@ public:
         connect(&outbound, SIGNAL(stateChanged(QLocalSocket::LocalSocketState)), this, SLOT(outboundStateChanged(QLocalSocket::LocalSocketState) ) );
 
         inbound = NULL;
+        sharedMemory = peerSharedMemory = false;
+        sharedGeneration = 0;
         basis->start();
     }
 
@@ -89,6 +126,13 @@ public:
         SHOULD_END
     };
 
+    // How a payload reached the socket, either serialized inline or as a reference to the sender's shared memory segment
+    enum PayloadType
+    {
+        INLINE_PAYLOAD,
+        SHARED_PAYLOAD
+    };
+
 
 public slots:
     // matching server signals
@@ -318,6 +362,18 @@ public:
     QLocalSocket outbound;
     QLocalServer server;
 
+    // Payloads are exchanged one request and one reply at a time,
+    // so each side needs a single segment for the payloads it sends, replaced by a larger one when it is outgrown.
+    bool sharedMemory; // Send payloads through shared memory
+    bool peerSharedMemory; // The last payload received came through shared memory, replies will too
+    QString sharedKey;
+    int sharedGeneration;
+    QSharedMemory outgoing, incoming;
+
+    // Each direction of the connection is one br::TemplateCodec stream, so metadata keys are only spelled out once per worker
+    TemplateCodec::Encoder encoder;
+    TemplateCodec::Decoder decoder;
+
 
     void waitForInbound()
     {
@@ -347,12 +403,39 @@ public:
     }
 
 
-    template<typename T>
-    bool readData(T &input)
+    bool readData(TemplateList &input)
     {
         emit pulseReadSerialized();
-        QDataStream deserializer(readArray);
-        deserializer >> input;
+        QBuffer buffer(&readArray);
+        buffer.open(QBuffer::ReadOnly);
+        QDataStream deserializer(&buffer);
+        quint8 payload;
+        deserializer >> payload;
+        peerSharedMemory = (payload == SHARED_PAYLOAD);
+        if (!peerSharedMemory)
+            return decode(&buffer, input);
+
+        QString segment;
+        qint64 bytes;
+        deserializer >> segment >> bytes;
+        if (incoming.key() != segment) {
+            incoming.detach();
+            incoming.setKey(segment);
+            if (!incoming.attach(QSharedMemory::ReadOnly))
+                qFatal("Failed to attach to shared memory segment %s: %s", qPrintable(segment), qPrintable(incoming.errorString()));
+        }
+
+        // The sender won't reuse its segment until we reply
+        QByteArray data = QByteArray::fromRawData(static_cast<const char*>(incoming.constData()), int(bytes));
+        QBuffer payloadBuffer(&data);
+        payloadBuffer.open(QBuffer::ReadOnly);
+        return decode(&payloadBuffer, input);
+    }
+
+    bool decode(QIODevice *device, TemplateList &input)
+    {
+        if (!decoder.read(device, input))
+            qFatal("%s received a malformed template payload.", qPrintable(key));
         return true;
     }
 
@@ -367,14 +450,39 @@ public:
         return res;
     }
 
-    template<typename T>
-    bool sendData(const T &output)
+    bool sendData(const TemplateList &output)
     {
         QBuffer buffer;
         buffer.open(QBuffer::ReadWrite);
-
         QDataStream serializer(&buffer);
-        serializer << output;
+
+        if (!sharedMemory && !peerSharedMemory) {
+            serializer << quint8(INLINE_PAYLOAD);
+            encoder.write(&buffer, output);
+            writeArray = buffer.data();
+            emit pulseSendSerialized();
+            return true;
+        }
+
+        // Sized with a copy of the encoder, so the dictionary entries are written by the real pass
+        CountingDevice counter;
+        TemplateCodec::Encoder sizing = encoder;
+        sizing.write(&counter, output);
+
+        if (!outgoing.isAttached() || (outgoing.size() < counter.count)) {
+            outgoing.detach();
+            if (sharedKey.isEmpty())
+                sharedKey = QUuid::createUuid().toString();
+            outgoing.setKey(sharedKey + "_" + QString::number(sharedGeneration++));
+            // Leave room to grow, so similarly sized payloads reuse the segment
+            if (!outgoing.create(int(std::max(counter.count + counter.count/2, qint64(1 << 20)))))
+                qFatal("Failed to create shared memory segment: %s", qPrintable(outgoing.errorString()));
+        }
+
+        MemoryDevice device(static_cast<char*>(outgoing.data()), outgoing.size());
+        encoder.write(&device, output);
+
+        serializer << quint8(SHARED_PAYLOAD) << outgoing.key() << counter.count;
         writeArray = buffer.data();
         emit pulseSendSerialized();
         return true;
@@ -544,13 +652,18 @@ struct ProcessData
 /*!
  * \ingroup transforms
  * \brief Interface to a separate process
+ *
+ * If \c sharedMemory is true, templates are passed to and from the worker through shared memory segments,
+ * and only small control messages are sent over the local socket.
  * \author Charles Otto \cite caotto
  */
 class ProcessWrapperTransform : public WrapperTransform
 {
     Q_OBJECT
     Q_PROPERTY(int concurrentCount READ get_concurrentCount WRITE set_concurrentCount RESET reset_concurrentCount STORED false)
+    Q_PROPERTY(bool sharedMemory READ get_sharedMemory WRITE set_sharedMemory RESET reset_sharedMemory STORED false)
     BR_PROPERTY(int, concurrentCount, 2)
+    BR_PROPERTY(bool, sharedMemory, true)
 
     QString baseKey;
 
@@ -605,14 +718,13 @@ class ProcessWrapperTransform : public WrapperTransform
     static QSemaphore counter;
     mutable int tcount;
     mutable QByteArray serialized;
+    mutable QMutex serializedLock; // Guards the copy and release of serialized, not the transmission
     void transmitTForm(CommunicationManager *localComm) const
     {
+        counter.acquire(1);
+        QMutexLocker lock(&serializedLock);
         if (serialized.isEmpty() )
             qFatal("Trying to transmit empty transform!");
-
-        counter.acquire(1);
-        static QMutex transmission;
-        QMutexLocker lock(&transmission);
         tcount--;
 
         localComm->writeArray = serialized;
@@ -647,6 +759,7 @@ class ProcessWrapperTransform : public WrapperTransform
         argumentList.append(baseKey);
 
         data->comm.key = "master_"+baseKey.mid(1,5);
+        data->comm.sharedMemory = sharedMemory;
 
         data->comm.startServer(baseKey+"_master");
 
@@ -17,11 +17,15 @@
 #include <QElapsedTimer>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/metrics.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
 {
 
+static const Metrics::Counter templatesEnrolled("br_templates_enrolled_total", "Templates that reached the end of enrollment.");
+static const Metrics::Counter templatesFailed("br_templates_failed_to_enroll_total", "Templates that reached the end of enrollment marked as failures to enroll.");
+
 class ProgressCounterTransform : public TimeVaryingTransform
 {
     Q_OBJECT
@@ -47,6 +51,9 @@ class ProgressCounterTransform : public TimeVaryingTransform
                 last_frame = frame;
 
                 Globals->currentStep++;
+                templatesEnrolled.add();
+                if (dst[i].file.fte || dst[i].file.getBool("FTE"))
+                    templatesFailed.add();
             }
         }
 
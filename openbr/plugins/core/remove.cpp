@@ -37,6 +37,11 @@ class RemoveTransform : public UntrainableMetaTransform
         dst = src;
         dst.removeAt(index);
     }
+
+    void projectInPlace(Template &srcdst) const
+    {
+        srcdst.removeAt(index);
+    }
 };
 
 BR_REGISTER(Transform, RemoveTransform)
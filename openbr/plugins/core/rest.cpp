@@ -34,6 +34,11 @@ class RestTransform : public UntrainableMetaTransform
         dst = src;
         dst.removeFirst();
     }
+
+    void projectInPlace(Template &srcdst) const
+    {
+        srcdst.removeFirst();
+    }
 };
 
 BR_REGISTER(Transform, RestTransform)
@@ -22,6 +22,12 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief A globally shared transform.
+ *
+ * Resolving an already shared transform, as clones made by DistributeTemplateTransform and StreamTransform do,
+ * reads an immutable published map without locking; only the first use of a description takes the mutex.
+ * The shared transform is projected concurrently from every thread without synchronization,
+ * which is safe for transforms whose project() is const in practice: untrainable and trained transforms alike,
+ * but not time varying transforms or those caching state in mutable members without their own locks.
  * \author Josh Klontz \cite jklontz
  */
 class SingletonTransform : public MetaTransform
@@ -30,33 +36,59 @@ class SingletonTransform : public MetaTransform
     Q_PROPERTY(QString description READ get_description WRITE set_description RESET reset_description STORED false)
     BR_PROPERTY(QString, description, "Identity")
 
-    static QMutex mutex;
-    static QHash<QString,Transform*> transforms;
-    static QHash<QString,int> trainingReferenceCounts;
-    static QHash<QString,TemplateList> trainingData;
+    struct Shared
+    {
+        Transform *transform;
+        QAtomicInt trainingReferences;
+        TemplateList trainingData; // Guarded by mutex
+
+        Shared(Transform *transform) : transform(transform), trainingReferences(0) {}
+    };
+
+    typedef QHash<QString,Shared*> Registry;
 
+    static QMutex mutex; // Serializes publishing and training
+    static QAtomicPointer<const Registry> registry;
+    static QList<const Registry*> retired; // Earlier snapshots, possibly still being read
+
+    Shared *shared;
     Transform *transform;
 
-    void init()
+    // The first to resolve a description owns its transform, storing and loading it
+    static Shared *resolve(const QString &description, QObject *owner)
     {
+        const Registry *current = registry.loadAcquire();
+        if (current && current->contains(description))
+            return current->value(description);
+
         QMutexLocker locker(&mutex);
-        if (!transforms.contains(description)) {
-            transforms.insert(description, make(description));
-            trainingReferenceCounts.insert(description, 0);
-        }
+        current = registry.loadAcquire();
+        if (current && current->contains(description))
+            return current->value(description);
+
+        Registry *next = current ? new Registry(*current) : new Registry();
+        Shared *created = new Shared(Transform::make(description, owner));
+        next->insert(description, created);
+        if (current)
+            retired.append(current);
+        registry.storeRelease(next);
+        return created;
+    }
 
-        transform = transforms[description];
-        trainingReferenceCounts[description]++;
+    void init()
+    {
+        shared = resolve(description, this);
+        transform = shared->transform;
+        shared->trainingReferences.ref();
     }
 
     void train(const TemplateList &data)
     {
         QMutexLocker locker(&mutex);
-        trainingData[description].append(data);
-        trainingReferenceCounts[description]--;
-        if (trainingReferenceCounts[description] > 0) return;
-        transform->train(trainingData[description]);
-        trainingData[description].clear();
+        shared->trainingData.append(data);
+        if (shared->trainingReferences.deref()) return;
+        transform->train(shared->trainingData);
+        shared->trainingData.clear();
     }
 
     void project(const Template &src, Template &dst) const
@@ -78,9 +110,8 @@ class SingletonTransform : public MetaTransform
 };
 
 QMutex SingletonTransform::mutex;
-QHash<QString,Transform*> SingletonTransform::transforms;
-QHash<QString,int> SingletonTransform::trainingReferenceCounts;
-QHash<QString,TemplateList> SingletonTransform::trainingData;
+QAtomicPointer<const SingletonTransform::Registry> SingletonTransform::registry;
+QList<const SingletonTransform::Registry*> SingletonTransform::retired;
 
 BR_REGISTER(Transform, SingletonTransform)
 
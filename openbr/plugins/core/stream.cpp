@@ -15,6 +15,14 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif // not _WIN32
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QReadWriteLock>
 #include <QWaitCondition>
 #include <QThreadPool>
@@ -27,8 +35,11 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/metrics.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/profiler.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 using namespace std;
@@ -41,6 +52,75 @@ class FrameData
 public:
     int sequenceNumber;
     TemplateList data;
+    // When the frame was read, in milliseconds since the data source opened
+    qint64 readTime;
+    // Index of the input template the frame was read from when multiplexing
+    int source;
+};
+
+// Counters of one processing stage, updated by whichever threads run it
+class StageStats
+{
+public:
+    StageStats()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        QMutexLocker lock(&guard);
+        framesIn = framesOut = busy = 0;
+        occupancySum = occupancyCount = occupancyMax = 0;
+        durations.clear();
+        nextDuration = 0;
+    }
+
+    // A frame arrived at the stage, queued frames including it are waiting for the stage
+    void arrived(int queued)
+    {
+        QMutexLocker lock(&guard);
+        framesIn++;
+        occupancySum += queued;
+        occupancyCount++;
+        occupancyMax = std::max(occupancyMax, qint64(queued));
+    }
+
+    // The stage spent nsecs processing frames frames
+    void processed(int frames, qint64 nsecs)
+    {
+        QMutexLocker lock(&guard);
+        framesOut += frames;
+        busy += nsecs;
+        if (durations.size() < maxDurations) durations.append(nsecs);
+        else                                 durations[nextDuration] = nsecs;
+        nextDuration = (nextDuration + 1) % maxDurations;
+    }
+
+    QJsonObject toJson() const
+    {
+        QMutexLocker lock(&guard);
+        QVector<qint64> sorted = durations;
+        std::sort(sorted.begin(), sorted.end());
+
+        QJsonObject json;
+        json["framesIn"] = double(framesIn);
+        json["framesOut"] = double(framesOut);
+        json["meanMs"] = durations.isEmpty() ? 0.0 : busy / 1e6 / (framesOut ? framesOut : 1);
+        json["p99Ms"] = sorted.isEmpty() ? 0.0 : sorted[std::min(int(sorted.size() * 0.99), sorted.size()-1)] / 1e6;
+        json["meanQueue"] = occupancyCount ? double(occupancySum) / occupancyCount : 0.0;
+        json["maxQueue"] = double(occupancyMax);
+        return json;
+    }
+
+private:
+    static const int maxDurations = 4096;
+
+    mutable QMutex guard;
+    qint64 framesIn, framesOut, busy;
+    qint64 occupancySum, occupancyCount, occupancyMax;
+    QVector<qint64> durations; // The most recent processing times, for percentiles
+    int nextDuration;
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -200,10 +280,200 @@ private:
     QList<FrameData *> buffer2;
 };
 
+// Smallest power of two greater than or equal to n
+static int ringCapacity(int n)
+{
+    int capacity = 1;
+    while (capacity < n)
+        capacity <<= 1;
+    return capacity;
+}
+
+// Lock-free alternative to DoubleBuffer for 1 - 1 boundaries. A bounded
+// single producer/single consumer ring, the producer owns tail and the
+// consumer owns head. Indices run modulo twice the capacity so a full ring
+// can be distinguished from an empty one. Calls to addItem (and to
+// tryGetItem) must be serialized, which the single threaded stages on
+// either side of the boundary already guarantee.
+class RingBuffer : public SharedBuffer
+{
+public:
+    RingBuffer(int maxItems)
+    {
+        capacity = ringCapacity(maxItems);
+        slots = new FrameData *[capacity];
+    }
+
+    ~RingBuffer()
+    {
+        delete[] slots;
+    }
+
+    int size()
+    {
+        return (tail.loadAcquire() - head.loadAcquire()) & (2*capacity - 1);
+    }
+
+    // called from the producer thread
+    void addItem(FrameData *input)
+    {
+        const int t = tail.load();
+        if (((t - head.loadAcquire()) & (2*capacity - 1)) == capacity)
+            qFatal("Ring buffer overflow, more than %d frames queued.", capacity);
+        slots[t & (capacity - 1)] = input;
+        tail.storeRelease((t + 1) & (2*capacity - 1));
+    }
+
+    FrameData *tryGetItem()
+    {
+        const int h = head.load();
+        if (h == tail.loadAcquire())
+            return NULL;
+        FrameData *output = slots[h & (capacity - 1)];
+        head.storeRelease((h + 1) & (2*capacity - 1));
+        return output;
+    }
+
+    virtual void reset()
+    {
+        if (this->size() != 0)
+            qDebug("Ring buffer has non-zero size during reset!");
+    }
+
+private:
+    int capacity;
+    FrameData **slots;
+
+    // Keep the producer and consumer indices on separate cache lines
+    QAtomicInt head;
+    char padding[64];
+    QAtomicInt tail;
+};
+
+// Lock-free alternative to SequencingBuffer for n - 1 boundaries. Each frame
+// is stored in the slot given by its sequence number, so producers never
+// contend with each other and the consumer only has to check the slot of
+// next_target. Frames in flight are drawn from a pool of at most maxItems,
+// and are returned in order, so their sequence numbers always fall within a
+// window of maxItems and can't collide in the ring.
+class SequencingRingBuffer : public SharedBuffer
+{
+public:
+    SequencingRingBuffer(int maxItems)
+    {
+        next_target = 0;
+        capacity = ringCapacity(maxItems);
+        slots = new QAtomicPointer<FrameData>[capacity];
+    }
+
+    ~SequencingRingBuffer()
+    {
+        delete[] slots;
+    }
+
+    void addItem(FrameData *input)
+    {
+        if (!slots[input->sequenceNumber & (capacity - 1)].testAndSetRelease(NULL, input))
+            qFatal("Sequencing ring buffer overflow, more than %d frames in flight.", capacity);
+        count.ref();
+    }
+
+    // Calls must be serialized, the consuming stage's status lock does so.
+    FrameData *tryGetItem()
+    {
+        QAtomicPointer<FrameData> &slot = slots[next_target & (capacity - 1)];
+        FrameData *output = slot.loadAcquire();
+        if (output == NULL)
+            return NULL;
+
+        if (next_target != output->sequenceNumber) {
+            qFatal("mismatched targets!");
+        }
+
+        slot.storeRelease(NULL);
+        count.deref();
+        next_target = next_target + 1;
+        return output;
+    }
+
+    virtual int size()
+    {
+        return count.load();
+    }
+
+    virtual void reset()
+    {
+        if (size() != 0)
+            qDebug("Sequencing buffer has non-zero size during reset!");
+        next_target = 0;
+    }
+
+private:
+    int capacity;
+    int next_target;
+    QAtomicInt count;
+    QAtomicPointer<FrameData> *slots;
+};
+
+// Reads a file's encoded bytes for ReadTransform/OpenTransform to decode, an empty matrix if it can't be read
+static Mat readEncoded(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly) || (file.size() == 0))
+        return Mat();
+#ifndef _WIN32
+    posix_fadvise(file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif // not _WIN32
+    Mat bytes(1, int(file.size()), CV_8UC1);
+    if (file.read((char*) bytes.data, file.size()) != file.size())
+        return Mat();
+    return bytes;
+}
+
+// Reads one file on the prefetch pool
+class ReadAheadTask : public QRunnable, public QFutureInterface<Mat>
+{
+    QString fileName;
+
+public:
+    explicit ReadAheadTask(const QString &fileName) : fileName(fileName) {}
+
+    QFuture<Mat> start(QThreadPool *pool)
+    {
+        reportStarted();
+        QFuture<Mat> result = future();
+        pool->start(this);
+        return result;
+    }
+
+    void run()
+    {
+        Profiler::nameThread("br-readahead");
+        reportResult(readEncoded(fileName));
+        reportFinished();
+    }
+};
+
+static bool isPrefetchable(const Template &t)
+{
+    static const QStringList imageSuffixes = QStringList() << "bmp" << "dib" << "jpeg" << "jpg" << "jpe" << "jp2" << "png" << "pbm"
+                                                           << "pgm" << "ppm" << "sr" << "ras" << "tiff" << "tif" << "webp";
+    return t.isEmpty() && !t.file.isNull() && (t.file.split().size() == 1) && imageSuffixes.contains(t.file.suffix().toLower());
+}
+
 // Given a template as input, open the file contained as a gallery, and return templates one at a time on
 // calls to getNextTemplate
 struct StreamGallery
 {
+    StreamGallery(int blockSize = 100) : galleryOk(false), lastBlock(true), nextIdx(0), blockSize(blockSize), prefetch(0) {}
+
+    // Read the bytes of up to depth upcoming images ahead of the pipeline with threads I/O threads
+    void setPrefetch(int depth, int threads)
+    {
+        prefetch = depth;
+        ioPool.setMaxThreadCount(std::max(threads, 1));
+    }
+
     bool open(Template &input)
     {
         // Create a gallery
@@ -217,9 +487,21 @@ struct StreamGallery
 
         // Set up state variables for future reads
         galleryOk = true;
-        gallery->readBlockSize = 100;
+        gallery->readBlockSize = blockSize;
         nextIdx = 0;
         lastBlock = false;
+        pending.clear();
+
+        // Resumed streams start after the templates a previous run completed, read past when the gallery can't seek
+        const qint64 skip = input.file.get<qint64>("skip", 0);
+        if ((skip > 0) && !gallery->seek(skip)) {
+            qint64 skipped = 0;
+            while ((skipped < skip) && !lastBlock) {
+                currentData = gallery->readBlock(&lastBlock);
+                nextIdx = int(std::min(qint64(currentData.size()), skip - skipped));
+                skipped += nextIdx;
+            }
+        }
         return galleryOk;
     }
 
@@ -229,25 +511,45 @@ struct StreamGallery
     {
         galleryOk = false;
         currentData.clear();
+        pending.clear();
         nextIdx = 0;
         lastBlock = true;
     }
 
     bool getNextTemplate(Template &output)
     {
-        // If we still have data available, we return one of those
-        if ((nextIdx >= currentData.size()) && !lastBlock) {
-            currentData = gallery->readBlock(&lastBlock);
-            nextIdx = 0;
+        // Keep the read-ahead window full, a window of one is the plain sequential read
+        while (pending.size() < std::max(prefetch, 1)) {
+            // If we still have data available, we return one of those
+            if ((nextIdx >= currentData.size()) && !lastBlock) {
+                BR_PROFILE("gallery", gallery.data(), gallery->readBlockSize);
+                currentData = gallery->readBlock(&lastBlock);
+                nextIdx = 0;
+            }
+
+            if (nextIdx >= currentData.size())
+                break;
+
+            Pending next;
+            next.t = currentData[nextIdx++];
+            if ((prefetch > 0) && isPrefetchable(next.t))
+                next.bytes = (new ReadAheadTask(next.t.file.resolved()))->start(&ioPool);
+            pending.enqueue(next);
         }
 
-        if (nextIdx >= currentData.size()) {
+        if (pending.isEmpty()) {
             galleryOk = false;
             return false;
         }
 
-        // Return the indicated template, and advance the index
-        output = currentData[nextIdx++];
+        // Return the indicated template, with its bytes if they were read ahead
+        Pending next = pending.dequeue();
+        output = next.t;
+        if (next.bytes.isStarted()) {
+            const Mat bytes = next.bytes.result();
+            if (bytes.data)
+                output.append(bytes);
+        }
         return true;
     }
 
@@ -259,6 +561,92 @@ protected:
 
     TemplateList currentData;
     int nextIdx;
+
+    // Templates read from the gallery at a time, no more than the frames the stream holds
+    int blockSize;
+
+    struct Pending
+    {
+        Template t;
+        QFuture<Mat> bytes;
+    };
+
+    int prefetch;
+    QQueue<Pending> pending;
+    QThreadPool ioPool;
+};
+
+// Reads one source of a multiplexed stream on its own thread, a few templates ahead of the pipeline, so a source
+// that is slow to produce a frame doesn't hold up the others. lock and ready are shared by every reader of a stream.
+class SourceReader : public QThread
+{
+public:
+    SourceReader(StreamGallery *gallery, int index, QMutex *lock, QWaitCondition *ready)
+        : gallery(gallery), index(index), lock(lock), ready(ready), done(false), stopping(false) {}
+
+    ~SourceReader()
+    {
+        stop();
+        delete gallery;
+    }
+
+    // Called with lock held, returns false if no template is waiting
+    bool take(Template &output)
+    {
+        if (frames.isEmpty())
+            return false;
+        output = frames.dequeue();
+        space.wakeOne();
+        return true;
+    }
+
+    // Called with lock held, true once every template has been taken
+    bool exhausted() const
+    {
+        return done && frames.isEmpty();
+    }
+
+    void stop()
+    {
+        {
+            QMutexLocker locker(lock);
+            stopping = true;
+            space.wakeOne();
+        }
+        wait();
+    }
+
+private:
+    static const int depth = 2;
+
+    StreamGallery *gallery;
+    int index;
+    QMutex *lock;
+    QWaitCondition *ready, space;
+    QQueue<Template> frames;
+    bool done, stopping;
+
+    void run()
+    {
+        Profiler::nameThread(QString("br-source-%1").arg(index));
+        forever {
+            Template t;
+            const bool ok = gallery->getNextTemplate(t);
+
+            QMutexLocker locker(lock);
+            while (ok && (frames.size() >= depth) && !stopping)
+                space.wait(lock);
+            if (stopping)
+                return;
+            if (ok)
+                frames.enqueue(t);
+            else
+                done = true;
+            ready->wakeAll();
+            if (done)
+                return;
+        }
+    }
 };
 
 // Interface for sequentially getting data from some data source.
@@ -267,13 +655,17 @@ protected:
 class DataSource
 {
 public:
-    DataSource(int maxFrames=500)
+    DataSource(int maxFrames=500, bool lockFree=false) : frameSource(std::min(maxFrames, 100)), latency(0), framesRead(0), framesDropped(0),
+                                                         prefetch(0), ioThreads(1), maxFrames(maxFrames), multiplexed(false)
     {
+        if (lockFree) allFrames = new RingBuffer(maxFrames);
+        else          allFrames = new DoubleBuffer();
+
         // The sequence number of the last frame
-        final_frame = -1;
+        final_frame.store(-1);
         for (int i=0; i < maxFrames;i++)
         {
-            allFrames.addItem(new FrameData());
+            allFrames->addItem(new FrameData());
         }
     }
 
@@ -281,16 +673,50 @@ public:
     {
         while (true)
         {
-            FrameData *frame = allFrames.tryGetItem();
+            FrameData *frame = allFrames->tryGetItem();
             if (frame == NULL)
                 break;
             delete frame;
         }
+        delete allFrames;
+        qDeleteAll(sources);
     }
 
     void close()
     {
         frameSource.close();
+        // Readers are stopped without holding multiplexLock, they take it to finish
+        qDeleteAll(sources);
+        sources.clear();
+        sourceIDs.clear();
+    }
+
+    void setPrefetch(int depth, int threads)
+    {
+        prefetch = depth;
+        ioThreads = threads;
+        frameSource.setPrefetch(depth, threads);
+    }
+
+    // Decimate frames at the source to hold their end-to-end latency under ms milliseconds, 0 keeps every frame
+    void setLatency(int ms)
+    {
+        latency = ms;
+    }
+
+    int dropped() const
+    {
+        return framesDropped;
+    }
+
+    bool exhausted() const
+    {
+        return is_broken;
+    }
+
+    int read() const
+    {
+        return framesRead;
     }
 
     int size()
@@ -298,7 +724,9 @@ public:
         return this->templates.size();
     }
 
-    bool open(const TemplateList &input)
+    // With multiplex set every template is opened at once and frames are read from them in turn,
+    // otherwise the templates are read one after another as a single video
+    bool open(const TemplateList &input, bool multiplex = false)
     {
         // Set up variables specific to us
         current_template_idx = 0;
@@ -308,12 +736,17 @@ public:
         allReturned = false;
 
         // The last frame isn't initialized yet
-        final_frame = -1;
+        final_frame.store(-1);
         // Start our sequence numbers from the input index
         next_sequence_number = 0;
+        framesRead = framesDropped = 0;
+        sourceFramesRead = QVector<int>(input.size(), 0);
+        latencyEstimate.store(0);
+        clock.start();
 
         // Actually open the data source
-        bool open_res = openNextTemplate();
+        multiplexed = multiplex;
+        bool open_res = multiplexed ? openAllTemplates() : openNextTemplate();
 
         // We couldn't open the data source
         if (!open_res) {
@@ -338,7 +771,7 @@ public:
 
         // Try to get a FrameData from the pool, if we can't it means too many
         // frames are already out, and we will return NULL to indicate failure
-        FrameData *aFrame = allFrames.tryGetItem();
+        FrameData *aFrame = allFrames->tryGetItem();
         if (aFrame == NULL)
             return NULL;
 
@@ -348,13 +781,12 @@ public:
         // The datasource broke, update final_frame
         if (!res)
         {
-            QMutexLocker lock(&last_frame_update);
-            final_frame = aFrame->sequenceNumber;
-            aFrame->data().clear();
+            final_frame.storeRelease(aFrame->sequenceNumber);
+            aFrame->data.clear();
         }
 
         // If this is the last frame, say so
-        if (aFrame->sequenceNumber == final_frame) {
+        if (aFrame->sequenceNumber == final_frame.load()) {
             last_frame = true;
             is_broken = true;
         }
@@ -368,21 +800,29 @@ public:
     {
         int frameNumber = inputFrame->sequenceNumber;
 
+        // A moving average of the time frames spend in the stream. Frames may be returned by several
+        // threads of the end stage, so each update is a compare and swap and none is lost.
+        if (latency > 0) {
+            const int elapsed = int(clock.elapsed() - inputFrame->readTime);
+            int estimate;
+            do {
+                estimate = latencyEstimate.loadAcquire();
+            } while (!latencyEstimate.testAndSetOrdered(estimate, (3 * estimate + elapsed) / 4));
+        }
+
         inputFrame->data.clear();
         inputFrame->sequenceNumber = -1;
-        allFrames.addItem(inputFrame);
+        allFrames->addItem(inputFrame);
 
-        bool rval = false;
+        // final_frame was published before the last frame entered the
+        // stream, so we only need the lock to signal waitLast.
+        if (frameNumber != final_frame.loadAcquire())
+            return false;
 
+        // We just received the last frame, better pulse
         QMutexLocker lock(&last_frame_update);
-
-        if (frameNumber == final_frame) {
-            // We just received the last frame, better pulse
-            allReturned = true;
-            rval = true;
-        }
-
-        return rval;
+        allReturned = true;
+        return true;
     }
 
     void wake()
@@ -428,42 +868,116 @@ protected:
         return true;
     }
 
-    bool getNextFrame(FrameData &output)
+    bool openAllTemplates()
     {
-        bool got_frame = false;
-
-        Template aTemplate;
-
-        while (!got_frame)
-        {
-            got_frame = frameSource.getNextTemplate(aTemplate);
-
-            // OK we got a frame
-            if (got_frame) {
-                // set the sequence number and tempalte of this frame
-                output.sequenceNumber = next_sequence_number;
-                output.data.append(aTemplate);
-                // set the frame number in the template's metadata
-                output.data.last().file.set("FrameNumber", output.sequenceNumber);
-                next_sequence_number++;
-                return true;
+        close();
+        for (int i=0; i<templates.size(); i++) {
+            Template curr = templates[i];
+            StreamGallery *gallery = new StreamGallery(std::min(maxFrames, 100));
+            gallery->setPrefetch(prefetch, ioThreads);
+            if (!gallery->open(curr)) {
+                delete gallery;
+                continue;
+            }
+            sources.append(new SourceReader(gallery, i, &multiplexLock, &sourceReady));
+            sourceIDs.append(i);
+        }
+        nextSource = 0;
+        foreach (SourceReader *source, sources)
+            source->start();
+        return !sources.isEmpty();
+    }
+
+    // Read the next template from the current template in our list, or when multiplexing from the next source
+    // in turn that has one waiting, so a stalled source gives up its turn rather than blocking the rest
+    bool readTemplate(Template &output, int &source)
+    {
+        if (multiplexed) {
+            QMutexLocker locker(&multiplexLock);
+            while (!sources.isEmpty()) {
+                bool removed = false;
+                for (int i=0; i<sources.size(); i++) {
+                    const int index = (nextSource + i) % sources.size();
+                    if (sources[index]->take(output)) {
+                        source = sourceIDs[index];
+                        nextSource = index + 1;
+                        return true;
+                    }
+
+                    // This source is exhausted, the rest keep their turns. Its thread has finished with the lock.
+                    if (sources[index]->exhausted()) {
+                        SourceReader *reader = sources.takeAt(index);
+                        sourceIDs.removeAt(index);
+                        locker.unlock();
+                        delete reader;
+                        locker.relock();
+                        if (index < nextSource)
+                            nextSource--;
+                        removed = true;
+                        break;
+                    }
+                }
+                if (!removed && !sources.isEmpty())
+                    sourceReady.wait(&multiplexLock);
             }
+            return false;
+        }
 
-            // advance to the next tempalte in our list
+        source = 0;
+        while (!frameSource.getNextTemplate(output)) {
+            // advance to the next tempalte in our list, if we can't open one there is nothing to do
             this->current_template_idx++;
-            bool open_res = this->openNextTemplate();
-
-            // couldn't get the next template? nothing to do, otherwise we try to read
-            // a frame at the top of this loop.
-            if (!open_res) {
-                output.sequenceNumber = next_sequence_number;
+            if (!this->openNextTemplate())
                 return false;
-            }
         }
+        return true;
+    }
 
+    bool getNextFrame(FrameData &output)
+    {
+        Template aTemplate;
+        int source = 0;
+
+        while (readTemplate(aTemplate, source)) {
+            const int frameNumber = sourceFramesRead[source]++;
+            if (dropFrame(framesRead++))
+                continue;
+
+            // set the sequence number and tempalte of this frame
+            output.sequenceNumber = next_sequence_number;
+            output.readTime = clock.elapsed();
+            output.source = source;
+            output.data.append(aTemplate);
+            // set the frame number in the template's metadata, dropped frames keep their numbers
+            output.data.last().file.set("FrameNumber", frameNumber);
+            if (latency > 0)
+                output.data.last().file.set("DroppedFrames", framesDropped);
+            if (multiplexed)
+                output.data.last().file.set("Source", source);
+            next_sequence_number++;
+            return true;
+        }
+
+        output.sequenceNumber = next_sequence_number;
         return false;
     }
 
+    // Once frames take longer than the latency target keep only one in every latency estimate / target of them,
+    // the rest are read from the gallery and discarded so live sources don't fall further behind
+    bool dropFrame(int frameNumber)
+    {
+        if (latency <= 0)
+            return false;
+        const int estimate = latencyEstimate.loadAcquire();
+        if (estimate <= latency)
+            return false;
+        const int stride = (estimate + latency - 1) / latency;
+        if (frameNumber % stride == 0)
+            return false;
+        framesDropped++;
+        return true;
+    }
+
     // Index of the template in the templatelist we are currently reading from
     int current_template_idx;
 
@@ -473,12 +987,27 @@ protected:
     // processor for the current template
     StreamGallery frameSource;
 
+    // readers for every open template when multiplexing, sourceIDs are their indices in templates
+    QList<SourceReader *> sources;
+    QList<int> sourceIDs;
+    int nextSource;
+    QMutex multiplexLock;
+    QWaitCondition sourceReady;
+    QVector<int> sourceFramesRead;
+
     int next_sequence_number;
-    int final_frame;
+    int latency, framesRead, framesDropped;
+    int prefetch, ioThreads;
+    int maxFrames;
+    bool multiplexed;
+    QElapsedTimer clock;
+    QAtomicInt latencyEstimate;
+    QAtomicInt final_frame;
     bool is_broken;
     bool allReturned;
 
-    DoubleBuffer allFrames;
+    // Pool of FrameData available to be read into
+    SharedBuffer *allFrames;
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
@@ -509,6 +1038,7 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        executor = NULL;
     }
     virtual ~ProcessingStage() {}
 
@@ -517,6 +1047,7 @@ public:
     virtual bool tryAcquireNextStage(FrameData *& input, bool &final)=0;
 
     int stage_id;
+    QString threadName; // Taken by the threads whose loops start at the stage
 
     virtual void reset()=0;
 
@@ -529,8 +1060,27 @@ protected:
     ProcessingStage *nextStage;
     QList<ProcessingStage *> * stages;
     QThreadPool *threads;
+    // If set, used instead of threads
+    WorkStealingPool *executor;
     Transform *transform;
+    // When multiplexing, the copy of transform holding the state of each source
+    QList<Transform *> sourceTransforms;
+
+    Transform *sourceTransform(const FrameData *input) const
+    {
+        return sourceTransforms.isEmpty() ? transform : sourceTransforms[input->source];
+    }
+
+    StageStats stats;
+    Metrics::Gauge queueDepth;
 
+    void arrived(int queued)
+    {
+        stats.arrived(queued);
+        queueDepth.set(queued);
+        if (Profiler::enabled())
+            Profiler::counter(QString("Stage %1 queue").arg(stage_id), queued);
+    }
 };
 
 class MultiThreadStage : public ProcessingStage
@@ -546,12 +1096,20 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
+        arrived(1);
+        QElapsedTimer timer;
+        timer.start();
+
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
-        transform->project(input->data, res);
+        {
+            BR_PROFILE("transform", transform, input->data.size());
+            transform->project(input->data, res);
+        }
         input->data = res;
         input->data.append(ftes);
+        stats.processed(1, timer.nsecsElapsed());
 
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
@@ -576,22 +1134,145 @@ public:
     }
 };
 
+// A multi-threaded stage that projects frames together in batches of up to batchSize, then lets each frame
+// of the batch continue through the stream on its own. A partial batch is projected when a frame arrives
+// after the first frame of the batch has waited timeout milliseconds, or when an empty frame arrives, such as
+// the one ending the stream.
+class BatchStage : public MultiThreadStage
+{
+public:
+    BatchStage(int _input, int batchSize, int timeout) : MultiThreadStage(_input), batchSize(batchSize), timeout(timeout) {}
+
+    FrameData *run(FrameData *input, bool &should_continue, bool &final)
+    {
+        if (input == NULL)
+            qFatal("null input to batch stage");
+
+        final = false;
+        should_continue = false;
+
+        QList<FrameData *> batch;
+        QMutexLocker lock(&pendingGuard);
+        if (pending.isEmpty())
+            waiting.start();
+        pending.append(input);
+        arrived(pending.size());
+        if ((pending.size() >= batchSize) || input->data.isEmpty() || (waiting.elapsed() >= timeout))
+            batch.swap(pending);
+        lock.unlock();
+
+        // The frame waits with the rest of its batch
+        if (batch.isEmpty())
+            return NULL;
+
+        QElapsedTimer timer;
+        timer.start();
+        project(batch);
+        stats.processed(batch.size(), timer.nsecsElapsed());
+
+        // This thread carries the first frame that can enter the next stage, the others get threads of their own
+        FrameData *next = NULL;
+        foreach (FrameData *frame, batch) {
+            bool ignored = false;
+            if (!nextStage->tryAcquireNextStage(frame, ignored))
+                continue;
+            if (next == NULL) next = frame;
+            else              startThread(frame);
+        }
+
+        should_continue = (next != NULL);
+        return next;
+    }
+
+    void reset()
+    {
+        QMutexLocker lock(&pendingGuard);
+        if (!pending.isEmpty())
+            qDebug("Batch stage %d has frames pending during reset!", this->stage_id);
+        pending.clear();
+    }
+
+    void status()
+    {
+        QMutexLocker lock(&pendingGuard);
+        qDebug("batch stage %d, pending %d of %d frames", this->stage_id, pending.size(), batchSize);
+    }
+
+private:
+    int batchSize, timeout;
+    QMutex pendingGuard;
+    QList<FrameData *> pending;
+    QElapsedTimer waiting;
+
+    // Project every frame of the batch in one call and give each frame back its own outputs
+    void project(const QList<FrameData *> &batch)
+    {
+        TemplateList src;
+        QList<TemplateList> ftes;
+        foreach (FrameData *frame, batch) {
+            ftes.append(TemplateList());
+            splitFTEs(frame->data, ftes.last());
+            src.append(frame->data);
+        }
+
+        TemplateList res;
+        {
+            BR_PROFILE("transform", transform, src.size());
+            transform->project(src, res);
+        }
+
+        // Outputs can only be attributed to frames when the transform maps templates one to one,
+        // otherwise the frames are projected again one at a time
+        int offset = 0;
+        for (int i=0; i<batch.size(); i++) {
+            TemplateList &data = batch[i]->data;
+            if (res.size() == src.size()) {
+                const int count = data.size();
+                data = res.mid(offset, count);
+                offset += count;
+            } else {
+                TemplateList frameRes;
+                transform->project(data, frameRes);
+                data = frameRes;
+            }
+            data.append(ftes[i]);
+        }
+    }
+
+    void startThread(FrameData *item)
+    {
+        BasicLoop *next = new BasicLoop();
+        next->stages = stages;
+        next->start_idx = nextStage->stage_id;
+        next->startItem = item;
+
+        if (this->executor)
+            this->executor->start(next);
+        else
+            this->threads->start(next, nextStage->stage_id);
+    }
+};
+
 class SingleThreadStage : public ProcessingStage
 {
 public:
-    SingleThreadStage(bool input_variance) : ProcessingStage(1)
+    // maxFrames bounds the number of frames in flight, and sizes the
+    // lock-free buffers used if lockFree is set.
+    SingleThreadStage(bool input_variance, bool lockFree = false, int maxFrames = 100) : ProcessingStage(1)
     {
         currentStatus = STOPPING;
         next_target = 0;
         // If the previous stage is single-threaded, queued inputs
         // are stored in a double buffer
         if (input_variance) {
-            this->inputBuffer = new DoubleBuffer();
+            if (lockFree) this->inputBuffer = new RingBuffer(maxFrames);
+            else          this->inputBuffer = new DoubleBuffer();
         }
         // If it's multi-threaded we need to put the inputs back in order
         // before we can use them, so we use a sequencing buffer.
         else {
-            this->inputBuffer = new SequencingBuffer();
+            if (lockFree) this->inputBuffer = new SequencingRingBuffer(maxFrames);
+            else          this->inputBuffer = new SequencingBuffer();
         }
     }
 
@@ -628,12 +1309,18 @@ public:
 
         next_target = input->sequenceNumber + 1;
 
+        QElapsedTimer timer;
+        timer.start();
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
-        transform->projectUpdate(input->data, res);
+        {
+            BR_PROFILE("transform", transform, input->data.size());
+            sourceTransform(input)->projectUpdate(input->data, res);
+        }
         input->data = res;
         input->data.append(ftes);
+        stats.processed(1, timer.nsecsElapsed());
 
         should_continue = nextStage->tryAcquireNextStage(input,final);
 
@@ -666,8 +1353,12 @@ public:
         // This is intended to ensure progression, we do queued late stage
         // jobs before queued early stage jobs, and so tend to finish frames
         // rather than go stage by stage. In Qt 5.1, priorities are priorities
-        // so we use the stage_id directly.
-        this->threads->start(next, stage_id);
+        // so we use the stage_id directly. The work-stealing executor gets the
+        // same effect by running the most recently started job on each worker first.
+        if (this->executor)
+            this->executor->start(next);
+        else
+            this->threads->start(next, stage_id);
     }
 
 
@@ -676,6 +1367,7 @@ public:
     {
         final = false;
         inputBuffer->addItem(input);
+        arrived(inputBuffer->size());
 
         QReadLocker lock(&statusLock);
         // Thread is already running, we should just return
@@ -713,7 +1405,7 @@ public:
 class EndStage : public SingleThreadStage
 {
 public:
-    EndStage(bool input_variance) : SingleThreadStage(input_variance) {}
+    EndStage(bool input_variance, bool lockFree = false, int maxFrames = 100) : SingleThreadStage(input_variance, lockFree, maxFrames) {}
 
     ~EndStage() {}
 
@@ -790,10 +1482,32 @@ BR_REGISTER(Transform, CollectOutputTransform)
 class ReadStage : public SingleThreadStage
 {
 public:
-    ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
+    ReadStage(int activeFrames = 100, bool lockFree = false) : SingleThreadStage(true, lockFree, activeFrames), dataSource(activeFrames, lockFree), blockedTime(0) { }
 
     DataSource dataSource;
 
+    // Time the reader spent stopped because all activeFrames were in the stream, in nanoseconds
+    QElapsedTimer blocked;
+    qint64 blockedTime;
+
+    // Read a frame, timing the read and noting when the reader blocks
+    FrameData *readFrame(bool &last_frame)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        FrameData *frame = dataSource.tryGetFrame(last_frame);
+        if (frame) {
+            stats.processed(1, timer.nsecsElapsed());
+            if (blocked.isValid()) {
+                blockedTime += blocked.nsecsElapsed();
+                blocked.invalidate();
+            }
+        } else if (!dataSource.exhausted() && !blocked.isValid()) {
+            blocked.start();
+        }
+        return frame;
+    }
+
     void reset()
     {
         dataSource.close();
@@ -813,7 +1527,7 @@ public:
         // frame if a frame is currently available.
         QWriteLocker lock(&statusLock);
         bool last_frame = false;
-        FrameData *newFrame = dataSource.tryGetFrame(last_frame);
+        FrameData *newFrame = readFrame(last_frame);
 
         // Were we able to get a frame?
         if (newFrame) startThread(newFrame);
@@ -862,7 +1576,7 @@ public:
         bool last_frame = false;
         // Try to get a frame from the data source, if we get one we will
         // continue to the first stage.
-        input = dataSource.tryGetFrame(last_frame);
+        input = readFrame(last_frame);
 
         if (!input) {
             return false;
@@ -884,6 +1598,8 @@ void BasicLoop::run()
     FrameData *target_item = startItem;
     bool should_continue = true;
     bool the_end = false;
+    // Loops carry frames through every stage, naming the thread after each one would cost a system call per stage
+    Profiler::nameThread(stages->at(current_idx)->threadName);
     forever
     {
         target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
@@ -908,10 +1624,31 @@ class DirectStreamTransform : public CompositeTransform
 public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
+    Q_PROPERTY(bool lockFree READ get_lockFree WRITE set_lockFree RESET reset_lockFree STORED false)
+    Q_PROPERTY(bool workStealing READ get_workStealing WRITE set_workStealing RESET reset_workStealing STORED false)
+    Q_PROPERTY(bool pinThreads READ get_pinThreads WRITE set_pinThreads RESET reset_pinThreads STORED false)
+    Q_PROPERTY(int prefetch READ get_prefetch WRITE set_prefetch RESET reset_prefetch STORED false)
+    Q_PROPERTY(int ioThreads READ get_ioThreads WRITE set_ioThreads RESET reset_ioThreads STORED false)
+    Q_PROPERTY(int latency READ get_latency WRITE set_latency RESET reset_latency STORED false)
+    Q_PROPERTY(int frameBatch READ get_frameBatch WRITE set_frameBatch RESET reset_frameBatch STORED false)
+    Q_PROPERTY(int frameBatchTimeout READ get_frameBatchTimeout WRITE set_frameBatchTimeout RESET reset_frameBatchTimeout STORED false)
+    Q_PROPERTY(bool multiplex READ get_multiplex WRITE set_multiplex RESET reset_multiplex STORED false)
+    Q_PROPERTY(int sources READ get_sources WRITE set_sources RESET reset_sources STORED false)
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(bool, lockFree, false)
+    BR_PROPERTY(bool, workStealing, false)
+    BR_PROPERTY(bool, pinThreads, false)
+    BR_PROPERTY(int, prefetch, 0)
+    BR_PROPERTY(int, ioThreads, 8)
+    BR_PROPERTY(int, latency, 0)
+    BR_PROPERTY(int, frameBatch, 1)
+    BR_PROPERTY(int, frameBatchTimeout, 50)
+    BR_PROPERTY(bool, multiplex, false)
+    BR_PROPERTY(int, sources, 1)
 
     friend class StreamTransfrom;
+    friend class StreamPools;
 
     void subProject(QList<TemplateList> &data, int end_idx)
     {
@@ -972,6 +1709,49 @@ public:
         init();
     }
 
+    // Streamed counterpart of train(QList<TemplateList>), each trainable stage sees blocks projected by a
+    // separate stream of the stages before it
+    void train(TemplateIterator &data)
+    {
+        if (!trainable) {
+            qWarning("Attempted to train untrainable transform, nothing will happen.");
+            return;
+        }
+
+        for (int i=0; i < transforms.size(); i++) {
+            if (!transforms[i]->trainable)
+                continue;
+
+            if (i == 0) {
+                transforms[i]->train(data);
+                continue;
+            }
+
+            QScopedPointer<DirectStreamTransform> prefix((DirectStreamTransform *) Transform::make("DirectStream", parent()));
+            prefix->transforms = transforms.mid(0, i);
+            prefix->activeFrames = activeFrames;
+            prefix->lockFree = lockFree;
+            prefix->prefetch = prefetch;
+            prefix->ioThreads = ioThreads;
+            prefix->workStealing = workStealing;
+            prefix->pinThreads = pinThreads;
+            prefix->latency = latency;
+            prefix->frameBatch = frameBatch;
+            prefix->frameBatchTimeout = frameBatchTimeout;
+            prefix->multiplex = multiplex;
+            prefix->sources = sources;
+            prefix->init();
+
+            TemplateIterator view = data.projected(prefix.data());
+            transforms[i]->train(view);
+        }
+    }
+
+    bool trainsInOnePass() const
+    {
+        return trainsChildrenInOnePass();
+    }
+
     bool timeVarying() const { return true; }
 
     void project(const Template &src, Template &dst) const
@@ -1004,19 +1784,135 @@ public:
         // on all child transforms as part of projectUpdate
     }
 
+    // smartCopy rebuilds a transform from its description, so trained state is carried over by serializing it
+    static void copyState(const Transform *from, Transform *to)
+    {
+        QByteArray state;
+        QDataStream out(&state, QIODevice::WriteOnly);
+        from->store(out);
+        QDataStream in(state);
+        to->load(in);
+    }
+
+    // Give every time-varying stage a copy of its transform for each of sources inputs, the first input uses the
+    // transform itself. Time-invariant stages are shared by all of them.
+    void addSourceTransforms(int sources)
+    {
+        for (int i=0; i < transforms.size(); i++) {
+            if (!stage_variance[i])
+                continue;
+
+            ProcessingStage *stage = processingStages[i+1];
+            stage->sourceTransforms.append(transforms[i]);
+            for (int j=1; j < sources; j++) {
+                bool newTransform = false;
+                Transform *copy = transforms[i]->smartCopy(newTransform);
+                if (newTransform) {
+                    copyState(transforms[i], copy);
+                    sourceCopies.append(copy);
+                }
+                stage->sourceTransforms.append(copy);
+            }
+        }
+    }
+
+    void removeSourceTransforms()
+    {
+        foreach (ProcessingStage *stage, processingStages)
+            stage->sourceTransforms.clear();
+        qDeleteAll(sourceCopies);
+        sourceCopies.clear();
+    }
+
+    Transform *sourceTransform(int i, int source) const
+    {
+        const QList<Transform *> &copies = processingStages[i+1]->sourceTransforms;
+        return copies.isEmpty() ? transforms[i] : copies[source];
+    }
+
+    // One of several streams processing the templates of a parallel projectUpdate
+    struct SourceWorker
+    {
+        const TemplateList *src;
+        QAtomicInt *next;
+        QMutex *endPointGuard;
+    };
+
+    // Stream templates of src, claimed one at a time, through a copy of this stream and hand each one's output
+    // to our endPoint as soon as it is finished
+    void projectSources(SourceWorker *worker)
+    {
+        QScopedPointer<DirectStreamTransform> stream((DirectStreamTransform *) Transform::make("DirectStream", this));
+        foreach (Transform *transform, transforms) {
+            bool newTransform = false;
+            Transform *copy = transform->smartCopy(newTransform);
+            if (newTransform)
+                copy->setParent(stream.data());
+            stream->transforms.append(copy);
+        }
+        stream->activeFrames = activeFrames;
+        stream->lockFree = lockFree;
+        stream->prefetch = prefetch;
+        stream->ioThreads = ioThreads;
+        stream->latency = latency;
+        stream->frameBatch = frameBatch;
+        stream->frameBatchTimeout = frameBatchTimeout;
+        stream->init();
+
+        for (int i = worker->next->fetchAndAddOrdered(1); i < worker->src->size(); i = worker->next->fetchAndAddOrdered(1)) {
+            TemplateList output;
+            stream->projectUpdate(TemplateList() << worker->src->at(i), output);
+
+            QMutexLocker lock(worker->endPointGuard);
+            endPoint->projectUpdate(output);
+        }
+    }
+
     // start processing, consider all templates in src a continuous
-    // 'video'
+    // 'video', or separate videos sharing the stream when multiplexing
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
         dst = src;
         if (src.empty())
             return;
 
-        bool res = readStage->dataSource.open(src);
+        // Templates are independent videos streamed in parallel, each stays in order but their outputs interleave.
+        // The copies of this stream share a thread pool keyed on this stream, the threads waiting on them are the
+        // global pool's, so their waits can't be circular.
+        if ((sources > 1) && (src.size() > 1)) {
+            QAtomicInt next(0);
+            QMutex endPointGuard;
+            SourceWorker worker;
+            worker.src = &src;
+            worker.next = &next;
+            worker.endPointGuard = &endPointGuard;
+
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i < std::min(sources, src.size()); i++)
+                futures.addFuture(QtConcurrent::run(this, &DirectStreamTransform::projectSources, &worker));
+            futures.waitForFinished();
+
+            dst.clear();
+            endPoint->finalize(dst);
+            return;
+        }
+
+        const bool multiplexed = multiplex && (src.size() > 1);
+        readStage->dataSource.setPrefetch(prefetch, ioThreads);
+        readStage->dataSource.setLatency(latency);
+        bool res = readStage->dataSource.open(src, multiplexed);
         if (!res) {
             qDebug("stream failed to open %s", qPrintable(dst[0].file.name));
             return;
         }
+        const int sources = multiplexed ? src.size() : 1;
+        if (multiplexed)
+            addSourceTransforms(sources);
+
+        foreach (ProcessingStage *stage, processingStages)
+            stage->stats.reset();
+        readStage->blockedTime = 0;
+        readStage->blocked.invalidate();
 
         // Start the first thread in the stream.
         QWriteLocker lock(&readStage->statusLock);
@@ -1024,7 +1920,7 @@ public:
 
         // We have to get a frame before starting the thread
         bool last_frame = false;
-        FrameData *firstFrame = readStage->dataSource.tryGetFrame(last_frame);
+        FrameData *firstFrame = readStage->readFrame(last_frame);
         if (firstFrame == NULL)
             qFatal("Failed to read first frame of video");
 
@@ -1034,27 +1930,33 @@ public:
         // Wait for the stream to process the last frame available from
         // the data source.
         readStage->dataSource.waitLast();
+        if (readStage->dataSource.dropped() > 0)
+            qDebug("Stream dropped %d of %d frames to hold %d ms latency.", readStage->dataSource.dropped(), readStage->dataSource.read(), latency);
 
         // Now that there are no more incoming frames, call finalize
         // on each transform in turn to collect any last templates
         // they wish to issue.
         TemplateList final_output;
 
-        // Push finalize through the stages
-        for (int i=0; i < this->transforms.size(); i++)
+        // Push finalize through the stages, separately for every source
+        for (int source=0; source < sources; source++)
         {
-            TemplateList output_set;
-            transforms[i]->finalize(output_set);
-            if (output_set.empty())
-                continue;
-
-            for (int j=i+1; j < transforms.size();j++)
+            for (int i=0; i < this->transforms.size(); i++)
             {
-                transforms[j]->projectUpdate(output_set);
+                TemplateList output_set;
+                sourceTransform(i, source)->finalize(output_set);
+                if (output_set.empty())
+                    continue;
+
+                for (int j=i+1; j < transforms.size();j++)
+                {
+                    sourceTransform(j, source)->projectUpdate(output_set);
+                }
+                final_output.append(output_set);
             }
-            final_output.append(output_set);
         }
         endPoint->projectUpdate(final_output);
+        removeSourceTransforms();
 
         // Clear dst, since we set it to src so that the datasource could open it
         dst.clear();
@@ -1065,16 +1967,48 @@ public:
         endPoint->finalize(output);
         dst.append(output);
 
+        if (!Globals->streamStats.isEmpty())
+            writeStats(Globals->streamStats);
+
         foreach (ProcessingStage *stage, processingStages)
             stage->reset();
     }
 
+    // Append this run's stage counters to fileName as a line of JSON
+    void writeStats(const QString &fileName) const
+    {
+        QJsonArray stages;
+        foreach (const ProcessingStage *stage, processingStages) {
+            QJsonObject json = stage->stats.toJson();
+            json["stage"] = stage->stage_id;
+            if (stage == readStage)             json["name"] = QString("Read");
+            else if (stage == collectionStage)  json["name"] = QString("End");
+            else                                json["name"] = Profiler::label(stage->transform);
+            stages.append(json);
+        }
+
+        QJsonObject json;
+        json["stages"] = stages;
+        json["blockedMs"] = readStage->blockedTime / 1e6;
+        json["dropped"] = readStage->dataSource.dropped();
+
+        static QMutex statsLock;
+        QMutexLocker lock(&statsLock);
+        QFile file(fileName);
+        if (!file.open(QFile::WriteOnly | QFile::Append)) {
+            qWarning("Failed to open %s for writing.", qPrintable(fileName));
+            return;
+        }
+        file.write(QJsonDocument(json).toJson(QJsonDocument::Compact) + "\n");
+    }
+
 
     // Create and link stages
     void init()
     {
         if (transforms.isEmpty()) return;
 
+        removeSourceTransforms();
         for (int i=0; i < processingStages.size();i++)
             delete processingStages[i];
         processingStages.clear();
@@ -1094,6 +2028,15 @@ public:
         }
         else it = pools.find(this->parent());
         threads = it.value();
+
+        // Work-stealing executors are shared on the same terms, the first
+        // stream to create one decides whether its workers are pinned.
+        executor = NULL;
+        if (workStealing) {
+            if (!stealingPools.contains(this->parent()))
+                stealingPools.insert(this->parent(), new WorkStealingPool(Globals->parallelism, pinThreads));
+            executor = stealingPools.value(this->parent());
+        }
         poolLock.unlock();
 
         // Are our children time varying or not? This decides whether
@@ -1104,14 +2047,25 @@ public:
             stage_variance.append(transform->timeVarying());
         }
 
+        // Frames held by batch stages can't be read into, so together they must leave some of activeFrames free
+        int batchSize = frameBatch;
+        if (batchSize > 1) {
+            const int batchStages = stage_variance.count(false);
+            if (batchStages * (batchSize - 1) >= activeFrames) {
+                batchSize = std::max(1, (activeFrames - 1) / std::max(batchStages, 1));
+                qWarning("Stream frame batches reduced to %d frames to fit within %d active frames.", batchSize, activeFrames);
+            }
+        }
+
         // Additionally, we have a separate stage responsible for reading
         // frames from the data source
-        readStage = new ReadStage(activeFrames);
+        readStage = new ReadStage(activeFrames, lockFree);
 
         processingStages.push_back(readStage);
         readStage->stage_id = 0;
         readStage->stages = &this->processingStages;
         readStage->threads = this->threads;
+        readStage->executor = this->executor;
 
         // Initialize and link a processing stage for each of our child
         // transforms.
@@ -1122,7 +2076,9 @@ public:
             if (stage_variance[i])
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
+                processingStages.append(new SingleThreadStage(prev_stage_variance, lockFree, activeFrames));
+            else if (batchSize > 1)
+                processingStages.append(new BatchStage(Globals->parallelism, batchSize, frameBatchTimeout));
             else
                 processingStages.append(new MultiThreadStage(Globals->parallelism));
 
@@ -1134,6 +2090,7 @@ public:
 
             processingStages.last()->stages = &this->processingStages;
             processingStages.last()->threads = this->threads;
+            processingStages.last()->executor = this->executor;
 
             processingStages.last()->transform = transforms[i];
             prev_stage_variance = stage_variance[i];
@@ -1141,7 +2098,7 @@ public:
 
         // We also have the last stage, which just puts the output of the
         // previous stages on a template list.
-        collectionStage = new EndStage(prev_stage_variance);
+        collectionStage = new EndStage(prev_stage_variance, lockFree, activeFrames);
         collectionStage->transform = this->endPoint;
 
 
@@ -1149,10 +2106,17 @@ public:
         collectionStage->stage_id = next_stage_id;
         collectionStage->stages = &this->processingStages;
         collectionStage->threads = this->threads;
+        collectionStage->executor = this->executor;
 
         // the last transform stage points to collection stage
         processingStages[processingStages.size() - 2]->nextStage = collectionStage;
 
+        foreach (ProcessingStage *stage, processingStages) {
+            stage->queueDepth = Metrics::Gauge(QString("br_stream_queue_depth{stage=\"%1\"}").arg(stage->stage_id),
+                                               "Frames queued at a stream stage when a frame last arrived.");
+            stage->threadName = QString("br-stage-%1").arg(stage->stage_id);
+        }
+
         // And the collection stage points to the read stage, because this is
         // a ring buffer.
         collectionStage->nextStage = readStage;
@@ -1160,6 +2124,8 @@ public:
 
     ~DirectStreamTransform()
     {
+        qDeleteAll(sourceCopies);
+
         // Delete all the stages
         for (int i = 0; i < processingStages.size(); i++) {
 // TODO: Are we releasing memory which is already freed?
@@ -1176,6 +2142,9 @@ protected:
 
     QList<ProcessingStage *> processingStages;
 
+    // Time-varying transforms copied for the extra sources of a multiplexed stream
+    QList<Transform *> sourceCopies;
+
     // This is a map from parent transforms (of Streams) to thread pools. Rather
     // than starting threads on the global thread pool, Stream uses separate thread pools
     // keyed on their parent transform. This is necessary because stream's project starts
@@ -1192,8 +2161,10 @@ protected:
     // Waiting for a QFutureSynchronzier isn't really possible here since stream runs an indeteriminate
     // number of jobs.
     static QHash<QObject *, QThreadPool *> pools;
+    static QHash<QObject *, WorkStealingPool *> stealingPools;
     static QMutex poolsAccess;
     QThreadPool *threads;
+    WorkStealingPool *executor;
 
     void _project(const Template &src, Template &dst) const
     {
@@ -1208,10 +2179,31 @@ protected:
 };
 
 QHash<QObject *, QThreadPool *> DirectStreamTransform::pools;
+QHash<QObject *, WorkStealingPool *> DirectStreamTransform::stealingPools;
 QMutex DirectStreamTransform::poolsAccess;
 
 BR_REGISTER(Transform, DirectStreamTransform)
 
+/*!
+ * \ingroup initializers
+ * \brief Joins the work-stealing executors used by streams.
+ */
+class StreamPools : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker poolLock(&DirectStreamTransform::poolsAccess);
+        qDeleteAll(DirectStreamTransform::stealingPools);
+        DirectStreamTransform::stealingPools.clear();
+    }
+};
+
+BR_REGISTER(Initializer, StreamPools)
+
 class StreamTransform : public WrapperTransform
 {
     Q_OBJECT
@@ -1223,9 +2215,29 @@ public:
 
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(bool lockFree READ get_lockFree WRITE set_lockFree RESET reset_lockFree STORED false)
+    Q_PROPERTY(bool workStealing READ get_workStealing WRITE set_workStealing RESET reset_workStealing STORED false)
+    Q_PROPERTY(bool pinThreads READ get_pinThreads WRITE set_pinThreads RESET reset_pinThreads STORED false)
+    Q_PROPERTY(int prefetch READ get_prefetch WRITE set_prefetch RESET reset_prefetch STORED false)
+    Q_PROPERTY(int ioThreads READ get_ioThreads WRITE set_ioThreads RESET reset_ioThreads STORED false)
+    Q_PROPERTY(int latency READ get_latency WRITE set_latency RESET reset_latency STORED false)
+    Q_PROPERTY(int frameBatch READ get_frameBatch WRITE set_frameBatch RESET reset_frameBatch STORED false)
+    Q_PROPERTY(int frameBatchTimeout READ get_frameBatchTimeout WRITE set_frameBatchTimeout RESET reset_frameBatchTimeout STORED false)
+    Q_PROPERTY(bool multiplex READ get_multiplex WRITE set_multiplex RESET reset_multiplex STORED false)
+    Q_PROPERTY(int sources READ get_sources WRITE set_sources RESET reset_sources STORED false)
 
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(bool, lockFree, false)
+    BR_PROPERTY(bool, workStealing, false)
+    BR_PROPERTY(bool, pinThreads, false)
+    BR_PROPERTY(int, prefetch, 0)
+    BR_PROPERTY(int, ioThreads, 8)
+    BR_PROPERTY(int, latency, 0)
+    BR_PROPERTY(int, frameBatch, 1)
+    BR_PROPERTY(int, frameBatchTimeout, 50)
+    BR_PROPERTY(bool, multiplex, false)
+    BR_PROPERTY(int, sources, 1)
 
     bool timeVarying() const { return true; }
 
@@ -1248,6 +2260,16 @@ public:
         basis->train(data);
     }
 
+    void train(TemplateIterator &data)
+    {
+        basis->train(data);
+    }
+
+    bool trainsInOnePass() const
+    {
+        return basis->trainsInOnePass();
+    }
+
     virtual void finalize(TemplateList &output)
     {
         (void) output;
@@ -1266,6 +2288,16 @@ public:
         basis = QSharedPointer<DirectStreamTransform>((DirectStreamTransform *) Transform::make("DirectStream",this));
         basis->transforms.clear();
         basis->activeFrames = this->activeFrames;
+        basis->lockFree = this->lockFree;
+        basis->prefetch = this->prefetch;
+        basis->ioThreads = this->ioThreads;
+        basis->workStealing = this->workStealing;
+        basis->pinThreads = this->pinThreads;
+        basis->latency = this->latency;
+        basis->frameBatch = this->frameBatch;
+        basis->frameBatchTimeout = this->frameBatchTimeout;
+        basis->multiplex = this->multiplex;
+        basis->sources = this->sources;
         basis->endPoint = this->endPoint;
 
         // We need at least a CompositeTransform * to acess transform's children.
@@ -1339,6 +2371,16 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->lockFree = this->lockFree;
+        res->prefetch = this->prefetch;
+        res->ioThreads = this->ioThreads;
+        res->workStealing = this->workStealing;
+        res->pinThreads = this->pinThreads;
+        res->latency = this->latency;
+        res->frameBatch = this->frameBatch;
+        res->frameBatchTimeout = this->frameBatchTimeout;
+        res->multiplex = this->multiplex;
+        res->sources = this->sources;
         return res;
     }
 
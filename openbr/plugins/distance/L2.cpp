@@ -14,28 +14,31 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <Eigen/Dense>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_fixed.h>
 
 namespace br
 {
 
 /*!
  * \ingroup distances
- * \brief L2 distance computed using eigen.
+ * \brief L2 distance computed using SIMD kernels unrolled for common feature dimensions.
  * \author Josh Klontz \cite jklontz
  */
 class L2Distance : public UntrainableDistance
 {
     Q_OBJECT
 
+    FloatDistanceKernels kernels;
+
+    void init()
+    {
+        kernels = FloatDistanceKernels(FloatL2);
+    }
+
     float compare(const cv::Mat &a, const cv::Mat &b) const
     {
-        const int size = a.rows * a.cols;
-        Eigen::Map<Eigen::VectorXf> aMap((float*)a.data, size);
-        Eigen::Map<Eigen::VectorXf> bMap((float*)b.data, size);
-        return (aMap-bMap).squaredNorm();
+        return kernels(a.ptr<float>(), b.ptr<float>(), a.rows * a.cols);
     }
 };
 
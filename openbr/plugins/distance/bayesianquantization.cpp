@@ -14,19 +14,68 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// Sums the quantized log likelihoods of size dimensions, dimension i's 256 entries start at table[i*256]
+typedef qint32 (*LikelihoodKernel)(const uchar *a, const uchar *b, const qint16 *table, int size);
+
+static qint32 likelihood_scalar(const uchar *a, const uchar *b, const qint16 *table, int size)
+{
+    qint32 likelihood = 0;
+    for (int i=0; i<size; i++)
+        likelihood += table[i*256+abs(a[i]-b[i])];
+    return likelihood;
+}
+
+#ifdef BR_SIMD_DISPATCH
+
+// Eight dimensions at a time, each lane gathers the 32 bits at its entry and keeps the sign extended low half.
+// The table is padded by one entry so the last gather stays in bounds.
+BR_TARGET("avx2")
+static qint32 likelihood_avx2(const uchar *a, const uchar *b, const qint16 *table, int size)
+{
+    const __m256i offsets = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    __m256i sum = _mm256_setzero_si256();
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256i A = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a+i)));
+        const __m256i B = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b+i)));
+        const __m256i index = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(A, B)), _mm256_add_epi32(offsets, _mm256_set1_epi32(i*256)));
+        const __m256i entries = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 2);
+        sum = _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_slli_epi32(entries, 16), 16));
+    }
+
+    __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(1, 0, 3, 2)));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(total) + likelihood_scalar(a+i, b+i, table+i*256, size-i);
+}
+
+#endif // BR_SIMD_DISPATCH
+
+static LikelihoodKernel likelihood_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return likelihood_avx2;
+#endif
+    return likelihood_scalar;
+}
+
 /*!
  * \ingroup distances
  * \brief Bayesian quantization distance
+ *
+ * The log likelihood table is quantized to 16 bits, halving its cache footprint, and gathered eight dimensions at a time on AVX2 hardware.
+ * Blocks of templates are compared \c blockDimensions at a time so a slice of the table stays in cache across targets.
  * \author Josh Klontz \cite jklontz
  */
 class BayesianQuantizationDistance : public Distance
@@ -34,24 +83,60 @@ class BayesianQuantizationDistance : public Distance
     Q_OBJECT
 
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(int blockDimensions READ get_blockDimensions WRITE set_blockDimensions RESET reset_blockDimensions STORED false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(int, blockDimensions, 512)
 
     QVector<float> loglikelihoods;
+    QVector<qint16> quantized; // loglikelihoods * scale, plus one entry of padding
+    float scale;
+    LikelihoodKernel kernel;
+
+    void init()
+    {
+        kernel = likelihood_kernel();
+        scale = 1;
+        quantize();
+    }
 
-    static void computeLogLikelihood(const Mat &data, const QList<int> &labels, float *loglikelihood)
+    // Pairs of values by absolute difference, from a histogram of the values
+    static void countPairs(const QVector<quint64> &histogram, quint64 *pairs)
+    {
+        for (int x=0; x<256; x++) {
+            if (histogram[x] == 0) continue;
+            pairs[0] += histogram[x]*(histogram[x]-1)/2;
+            for (int y=x+1; y<256; y++)
+                pairs[y-x] += histogram[x]*histogram[y];
+        }
+    }
+
+    // Genuine pairs are counted within each label's group of templates and impostors are the remaining pairs,
+    // so the cost scales with the group sizes rather than all pairs of templates
+    static void computeLogLikelihood(const Mat &data, const QList< QVector<int> > &groups, float *loglikelihood)
     {
         const QList<uchar> vals = OpenCVUtils::matrixToVector<uchar>(data);
-        if (vals.size() != labels.size())
-            qFatal("Logic error.");
 
-        QVector<quint64> genuines(256, 0), impostors(256,0);
-        for (int i=0; i<vals.size(); i++)
-            for (int j=i+1; j<vals.size(); j++)
-                if (labels[i] == labels[j]) genuines[abs(vals[i]-vals[j])]++;
-                else                        impostors[abs(vals[i]-vals[j])]++;
+        QVector<quint64> histogram(256, 0), genuines(256, 0), impostors(256, 0);
+        foreach (uchar val, vals)
+            histogram[val]++;
+        countPairs(histogram, impostors.data());
+
+        foreach (const QVector<int> &group, groups) {
+            if (group.size() > 256) {
+                QVector<quint64> groupHistogram(256, 0);
+                foreach (int index, group)
+                    groupHistogram[vals[index]]++;
+                countPairs(groupHistogram, genuines.data());
+            } else {
+                for (int i=0; i<group.size(); i++)
+                    for (int j=i+1; j<group.size(); j++)
+                        genuines[abs(vals[group[i]]-vals[group[j]])]++;
+            }
+        }
 
         quint64 totalGenuines(0), totalImpostors(0);
         for (int i=0; i<256; i++) {
+            impostors[i] -= genuines[i];
             totalGenuines += genuines[i];
             totalImpostors += impostors[i];
         }
@@ -60,6 +145,25 @@ class BayesianQuantizationDistance : public Distance
             loglikelihood[i] = log((float(genuines[i]+1)/totalGenuines)/(float(impostors[i]+1)/totalImpostors));
     }
 
+    // The scale keeps every entry in 16 bits and every sum over the dimensions in 32 bits
+    void quantize()
+    {
+        quantized.clear();
+        if (loglikelihoods.isEmpty())
+            return;
+
+        float maxAbs = 0;
+        foreach (float loglikelihood, loglikelihoods)
+            maxAbs = std::max(maxAbs, fabsf(loglikelihood));
+        const int dimensions = loglikelihoods.size() / 256;
+        scale = (maxAbs > 0) ? float(std::min(32767., double(std::numeric_limits<qint32>::max()) / dimensions)) / maxAbs : 1;
+
+        quantized.resize(loglikelihoods.size() + 1);
+        for (int i=0; i<loglikelihoods.size(); i++)
+            quantized[i] = qint16(qRound(loglikelihoods[i] * scale));
+        quantized.last() = 0;
+    }
+
     void train(const TemplateList &src)
     {
         if ((src.first().size() > 1) || (src.first().m().type() != CV_8UC1))
@@ -67,23 +171,58 @@ class BayesianQuantizationDistance : public Distance
 
         const Mat data = OpenCVUtils::toMat(src.data());
         const QList<int> templateLabels = src.indexProperty(inputVariable);
+        QHash< int, QVector<int> > labelGroups;
+        for (int i=0; i<templateLabels.size(); i++)
+            labelGroups[templateLabels[i]].append(i);
+        const QList< QVector<int> > groups = labelGroups.values();
         loglikelihoods = QVector<float>(data.cols*256, 0);
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), templateLabels, &loglikelihoods.data()[i*256]));
-        futures.waitForFinished();
+            tasks.run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), groups, &loglikelihoods.data()[i*256]);
+        tasks.wait();
+        quantize();
     }
 
     float compare(const cv::Mat &a, const cv::Mat &b) const
     {
-        const uchar *aData = a.data;
-        const uchar *bData = b.data;
         const int size = a.rows * a.cols;
-        float likelihood = 0;
-        for (int i=0; i<size; i++)
-            likelihood += loglikelihoods[i*256+abs(aData[i]-bData[i])];
-        return likelihood;
+        if (size * 256 > loglikelihoods.size())
+            qFatal("Expected at most %d dimensions.", loglikelihoods.size() / 256);
+        return kernel(a.data, b.data, quantized.constData(), size) / scale;
+    }
+
+    // One query against many targets, a slice of the table at a time
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        const int dimensions = loglikelihoods.size() / 256;
+        QVector<const uchar*> targets(target.size(), NULL);
+        for (int j=0; j<target.size(); j++)
+            if ((target[j].size() == 1) && target[j].m().isContinuous() && (int(target[j].m().total() * target[j].m().elemSize()) == dimensions))
+                targets[j] = target[j].m().data;
+
+        QVector<qint32> likelihoods(target.size());
+        for (int i=0; i<query.size(); i++) {
+            if ((query[i].size() != 1) || !query[i].m().isContinuous() || (int(query[i].m().total() * query[i].m().elemSize()) != dimensions)) {
+                for (int j=0; j<target.size(); j++)
+                    output->setRelative(Distance::compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+                continue;
+            }
+
+            const uchar *q = query[i].m().data;
+            likelihoods.fill(0);
+            const int step = std::max(1, blockDimensions);
+            for (int begin=0; begin<dimensions; begin+=step) {
+                const int size = std::min(step, dimensions - begin);
+                const qint16 *table = quantized.constData() + begin*256;
+                for (int j=0; j<target.size(); j++)
+                    if (targets[j])
+                        likelihoods[j] += kernel(targets[j] + begin, q + begin, table, size);
+            }
+
+            for (int j=0; j<target.size(); j++)
+                output->setRelative(targets[j] ? likelihoods[j] / scale : Distance::compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+        }
     }
 
     void store(QDataStream &stream) const
@@ -94,6 +233,7 @@ class BayesianQuantizationDistance : public Distance
     void load(QDataStream &stream)
     {
         stream >> loglikelihoods;
+        quantize();
     }
 };
 
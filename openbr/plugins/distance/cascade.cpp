@@ -0,0 +1,130 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Two-stage search, a cheap distance over every target followed by an expensive distance over the best few.
+ *
+ * For each query, every target is scored with \c coarse, and the \c shortlist targets with the highest coarse scores are rescored with \c fine.
+ * All other pairs are reported as <tt>-FLT_MAX</tt>, so the result is suitable for top-K outputs like \ref rankOutput.
+ * Unlike \ref PipeDistance and \ref SumDistance, \c fine is evaluated on only \c shortlist pairs per query.
+ * When br::Context::crossValidate is set, targets in another \c Partition than the query, other than those in all partitions, are never shortlisted.
+ */
+class CascadeDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *coarse READ get_coarse WRITE set_coarse RESET reset_coarse STORED false)
+    Q_PROPERTY(br::Distance *fine READ get_fine WRITE set_fine RESET reset_fine STORED false)
+    Q_PROPERTY(int shortlist READ get_shortlist WRITE set_shortlist RESET reset_shortlist STORED false)
+    BR_PROPERTY(br::Distance*, coarse, NULL)
+    BR_PROPERTY(br::Distance*, fine, NULL)
+    BR_PROPERTY(int, shortlist, 100)
+
+    void init()
+    {
+        if (!coarse || !fine)
+            qFatal("CascadeDistance requires a coarse and a fine distance.");
+    }
+
+    void train(const TemplateList &data)
+    {
+        TaskGroup tasks;
+        tasks.runMember(coarse, &Distance::train, data);
+        tasks.runMember(fine, &Distance::train, data);
+        tasks.wait();
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return fine->compare(a, b);
+    }
+
+    // Target partitions when cross validating, otherwise empty
+    static QList<int> partitions(const TemplateList &targets)
+    {
+        return Globals->crossValidate > 0 ? targets.files().crossValidationPartitions() : QList<int>();
+    }
+
+    // Rescores the shortlisted targets, the coarse scores are replaced in place
+    void rerank(const TemplateList &targets, const QList<int> &targetPartitions, const Template &query, float *scores) const
+    {
+        const int queryPartition = query.file.get<int>("Partition", 0);
+        QList< QPair<float,int> > ranked;
+        ranked.reserve(targets.size());
+        for (int i=0; i<targets.size(); i++) {
+            // Pairs across folds would be excluded from evaluation, so they mustn't take shortlist places
+            if (!targetPartitions.isEmpty() && (targetPartitions[i] != -1) && (targetPartitions[i] != queryPartition))
+                continue;
+            if (scores[i] != -std::numeric_limits<float>::max())
+                ranked.append(QPair<float,int>(scores[i], i));
+        }
+
+        const int size = std::min(shortlist, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + size, ranked.end(), qGreater< QPair<float,int> >());
+
+        for (int i=0; i<targets.size(); i++)
+            scores[i] = -std::numeric_limits<float>::max();
+        for (int i=0; i<size; i++)
+            scores[ranked[i].second] = fine->compare(targets[ranked[i].second], query);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores = coarse->compare(targets, query).toVector();
+        rerank(targets, partitions(targets), query, scores.data());
+        return scores.toList();
+    }
+
+    void rerankQuery(const TemplateList &targets, const QList<int> *targetPartitions, const Template &query, MatrixOutput *scores, int row, Output *output, int queryIndex) const
+    {
+        float *data = scores->data.ptr<float>(row);
+        rerank(targets, *targetPartitions, query, data);
+        for (int i=0; i<targets.size(); i++)
+            output->setRelative(data[i], queryIndex, i);
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        // Queries are processed in chunks to bound the memory used by the coarse scores,
+        // each is scored against every target so the shortlist spans the whole gallery
+        static const int chunkSize = 64;
+        const QList<int> targetPartitions = partitions(target);
+        for (int i=0; i<query.size(); i+=chunkSize) {
+            const TemplateList queries = query.mid(i, chunkSize);
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(target.files(), queries.files()));
+            coarse->compare(target, queries, scores.data());
+
+            TaskGroup tasks;
+            for (int j=0; j<queries.size(); j++) {
+                if (Globals->parallelism) tasks.runMember(this, &CascadeDistance::rerankQuery, target, &targetPartitions, queries[j], scores.data(), j, output, i+j);
+                else                                                              rerankQuery (target, &targetPartitions, queries[j], scores.data(), j, output, i+j);
+            }
+            tasks.wait();
+        }
+    }
+};
+
+BR_REGISTER(Distance, CascadeDistance)
+
+} // namespace br
+
+#include "distance/cascade.moc"
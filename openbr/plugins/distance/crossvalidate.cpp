@@ -35,6 +35,16 @@ class CrossValidateDistance : public UntrainableDistance
         const int partitionB = b.file.get<int>(key, 0);
         return (partitionA != partitionB) ? -std::numeric_limits<float>::max() : 0;
     }
+
+    // Partitions are looked up once per template instead of once per pair
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        const QList<int> targetPartitions = target.files().crossValidationPartitions();
+        const QList<int> queryPartitions = query.files().crossValidationPartitions();
+        for (int i=0; i<query.size(); i++)
+            for (int j=0; j<target.size(); j++)
+                output->setRelative((queryPartitions[i] != targetPartitions[j]) ? -std::numeric_limits<float>::max() : 0, i+queryOffset, j+targetOffset);
+    }
 };
 
 BR_REGISTER(Distance, CrossValidateDistance)
@@ -16,6 +16,8 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+#include <openbr/core/distance_fixed.h>
 
 using namespace cv;
 
@@ -25,6 +27,11 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Standard distance metrics
+ *
+ * When built with \c BR_WITH_OPENCL and \c openCL is true, L2, Cosine and Dot comparisons against a contiguous gallery,
+ * such as the one held by GalleryCompareTransform, run on the GPU with the gallery kept resident in device memory.
+ * Pairwise L1, L2, Cosine and Dot comparisons of continuous single channel float matrices use the kernels in
+ * distance_fixed.h, selected when the distance is initialized.
  * \author Josh Klontz \cite jklontz
  */
 class DistDistance : public UntrainableDistance
@@ -33,6 +40,7 @@ class DistDistance : public UntrainableDistance
     Q_ENUMS(Metric)
     Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
     Q_PROPERTY(bool negLogPlusOne READ get_negLogPlusOne WRITE set_negLogPlusOne RESET reset_negLogPlusOne STORED false)
+    Q_PROPERTY(bool openCL READ get_openCL WRITE set_openCL RESET reset_openCL STORED false)
 
 public:
     /*!< */
@@ -49,6 +57,44 @@ public:
 private:
     BR_PROPERTY(Metric, metric, L2)
     BR_PROPERTY(bool, negLogPlusOne, true)
+    BR_PROPERTY(bool, openCL, true)
+
+#ifdef BR_WITH_OPENCL
+    mutable OpenCVUtils::DeviceMatrix device;
+#endif // BR_WITH_OPENCL
+
+    FloatDistanceKernels kernels;
+    bool useKernels;
+
+    void init()
+    {
+        useKernels = (metric == L1) || (metric == L2) || (metric == Cosine) || (metric == Dot);
+        if      (metric == L1)     kernels = FloatDistanceKernels(FloatL1);
+        else if (metric == L2)     kernels = FloatDistanceKernels(FloatL2);
+        else if (metric == Cosine) kernels = FloatDistanceKernels(FloatCosine);
+        else if (metric == Dot)    kernels = FloatDistanceKernels(FloatDot);
+    }
+
+    bool useDevice() const
+    {
+#ifdef BR_WITH_OPENCL
+        return openCL && OpenCVUtils::openCLAvailable();
+#else // BR_WITH_OPENCL
+        return false;
+#endif // BR_WITH_OPENCL
+    }
+
+    // Scores from inner products and squared norms
+    float fromDot(float dot, float queryNorm, float targetNorm) const
+    {
+        if (metric == Dot)
+            return dot;
+        if (metric == Cosine)
+            return dot / (sqrt(queryNorm) * sqrt(targetNorm));
+        float result = sqrt(std::max(0.f, queryNorm + targetNorm - 2*dot));
+        if (negLogPlusOne) result = -log(result+1);
+        return result;
+    }
 
     float compare(const Mat &a, const Mat &b) const
     {
@@ -56,6 +102,17 @@ private:
             (a.type() != b.type()))
                 return -std::numeric_limits<float>::max();
 
+        if (useKernels && (a.type() == CV_32FC1) && a.isContinuous() && b.isContinuous()) {
+            float result = kernels(a.ptr<float>(), b.ptr<float>(), a.rows * a.cols);
+            if ((metric == Cosine) || (metric == Dot))
+                return result;
+            if (metric == L2)
+                result = sqrt(result);
+            if (result != result)
+                qFatal("NaN result.");
+            return negLogPlusOne ? -log(result+1) : result;
+        }
+
 // TODO: this max value is never returned based on the switch / default
         float result = std::numeric_limits<float>::max();
         switch (metric) {
@@ -111,6 +168,187 @@ private:
 
         return dot / (sqrt(magA)*sqrt(magB));
     }
+
+    // Copies each template's matrix into a row of a contiguous matrix, returns false if the templates can't be packed
+    static bool pack(const TemplateList &templates, const Size &size, Mat &packed, QVector<bool> &valid)
+    {
+        packed = Mat::zeros(templates.size(), size.area(), CV_32FC1);
+        valid = QVector<bool>(templates.size(), false);
+        for (int i=0; i<templates.size(); i++) {
+            const Template &t = templates[i];
+            if (t.isEmpty() || t.first().empty())
+                continue;
+            const Mat &m = t.first();
+            if ((t.size() != 1) || (m.type() != CV_32FC1) || (m.size() != size))
+                return false;
+            (m.isContinuous() ? m : Mat(m.clone())).reshape(1, 1).copyTo(packed.row(i));
+            valid[i] = true;
+        }
+        return true;
+    }
+
+    // The rows of one contiguous matrix that valid targets reference, such as the gallery of GalleryCompareTransform, returns false otherwise.
+    // Every row must have the query's size and constant stride within a single allocation, which must also hold the rows of invalid targets.
+    static bool packedRows(const TemplateList &targets, const Size &size, Mat &rows, QVector<bool> &valid)
+    {
+        const size_t step = size.area() * sizeof(float);
+        const uchar *base = NULL, *datastart = NULL, *dataend = NULL;
+        valid = QVector<bool>(targets.size(), false);
+        for (int i=0; i<targets.size(); i++) {
+            const Template &t = targets[i];
+            if (t.isEmpty() || t.first().empty())
+                continue;
+            const Mat &m = t.first();
+            if ((t.size() != 1) || (m.type() != CV_32FC1) || (m.size() != size) || !m.isContinuous())
+                return false;
+            if (base == NULL) {
+                base = m.data - i*step;
+                datastart = m.datastart;
+                dataend = m.dataend;
+            } else if ((m.data != base + i*step) || (m.datastart != datastart) || (m.dataend != dataend)) {
+                return false;
+            }
+            valid[i] = true;
+        }
+        if ((base == NULL) || (base < datastart) || (base + targets.size()*step > dataend))
+            return false;
+        rows = Mat(targets.size(), size.area(), CV_32FC1, (void*) base);
+        return true;
+    }
+
+    // One query against a packed gallery is a single matrix-vector product over memory the gallery already occupies
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        if (((metric != L2) && (metric != Cosine) && (metric != Dot)) ||
+            (query.size() != 1) || (query.m().type() != CV_32FC1) || !query.m().isContinuous())
+            return Distance::compare(targets, query);
+
+        Mat rows;
+        QVector<bool> valid;
+        if (!packedRows(targets, query.m().size(), rows, valid))
+            return Distance::compare(targets, query);
+
+        const Mat q = query.m().reshape(1, 1);
+        const float queryNorm = (metric == Dot) ? 0 : q.dot(q);
+        Mat dots;
+
+#ifdef BR_WITH_OPENCL
+        if (useDevice()) {
+            Mat targetNorms;
+            device.multiply(q, rows, true, dots, &targetNorms);
+            QList<float> scores; scores.reserve(targets.size());
+            for (int i=0; i<targets.size(); i++)
+                scores.append(valid[i] ? fromDot(dots.at<float>(i), queryNorm, targetNorms.at<float>(i)) : -std::numeric_limits<float>::max());
+            return scores;
+        }
+#endif // BR_WITH_OPENCL
+
+        gemm(rows, q, 1, noArray(), 0, dots, GEMM_2_T);
+
+        QList<float> scores; scores.reserve(targets.size());
+        for (int i=0; i<targets.size(); i++) {
+            if (!valid[i]) {
+                scores.append(-std::numeric_limits<float>::max());
+                continue;
+            }
+
+            const float dot = dots.at<float>(i);
+            if (metric == Dot) {
+                scores.append(dot);
+                continue;
+            }
+
+            const float targetNorm = rows.row(i).dot(rows.row(i));
+            if (metric == Cosine) {
+                scores.append(dot / (sqrt(queryNorm) * sqrt(targetNorm)));
+            } else {
+                float result = sqrt(std::max(0.f, queryNorm + targetNorm - 2*dot));
+                if (negLogPlusOne) result = -log(result+1);
+                scores.append(result);
+            }
+        }
+        return scores;
+    }
+
+    // L2, Cosine and Dot can be expressed in terms of inner products, so the block is computed with a single GEMM per tile
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        if (target.isEmpty() || query.isEmpty())
+            return;
+
+        if ((metric != L2) && (metric != Cosine) && (metric != Dot)) {
+            Distance::compareBlock(target, query, output, targetOffset, queryOffset);
+            return;
+        }
+
+        Size size;
+        foreach (const Template &t, target + query)
+            if (!t.isEmpty() && !t.first().empty()) {
+                size = t.first().size();
+                break;
+            }
+
+        Mat targets, queries;
+        QVector<bool> validTargets, validQueries;
+
+#ifdef BR_WITH_OPENCL
+        // The whole block is one product against the rows of the resident gallery
+        if ((size.area() > 0) && useDevice() && packedRows(target, size, targets, validTargets) && pack(query, size, queries, validQueries)) {
+            Mat scores, targetNorms, queryNorms;
+            device.multiply(queries, targets, true, scores, &targetNorms);
+            reduce(queries.mul(queries), queryNorms, 1, CV_REDUCE_SUM);
+            for (int q=0; q<queries.rows; q++)
+                for (int t=0; t<targets.rows; t++)
+                    output->setRelative((validTargets[t] && validQueries[q]) ? fromDot(scores.at<float>(q, t), queryNorms.at<float>(q), targetNorms.at<float>(t)) : -std::numeric_limits<float>::max(),
+                                        q+queryOffset, t+targetOffset);
+            return;
+        }
+#endif // BR_WITH_OPENCL
+
+        if ((size.area() == 0) || !pack(target, size, targets, validTargets) || !pack(query, size, queries, validQueries)) {
+            Distance::compareBlock(target, query, output, targetOffset, queryOffset);
+            return;
+        }
+
+        Mat targetNorms, queryNorms;
+        if (metric != Dot) {
+            reduce(targets.mul(targets), targetNorms, 1, CV_REDUCE_SUM);
+            reduce(queries.mul(queries), queryNorms, 1, CV_REDUCE_SUM);
+        }
+
+        // Tiles are sized so the packed inputs and the score tile stay cache resident
+        static const int tileSize = 256;
+        Mat scores;
+        for (int i=0; i<queries.rows; i+=tileSize) {
+            const Range queryRange(i, std::min(i+tileSize, queries.rows));
+            for (int j=0; j<targets.rows; j+=tileSize) {
+                const Range targetRange(j, std::min(j+tileSize, targets.rows));
+                gemm(queries.rowRange(queryRange), targets.rowRange(targetRange), 1, noArray(), 0, scores, GEMM_2_T);
+
+                for (int q=queryRange.start; q<queryRange.end; q++) {
+                    const float *dots = scores.ptr<float>(q - queryRange.start);
+                    for (int t=targetRange.start; t<targetRange.end; t++) {
+                        if (!validTargets[t] || !validQueries[q]) {
+                            output->setRelative(-std::numeric_limits<float>::max(), q+queryOffset, t+targetOffset);
+                            continue;
+                        }
+
+                        const float dot = dots[t - targetRange.start];
+                        float result;
+                        if (metric == Dot) {
+                            result = dot;
+                        } else if (metric == Cosine) {
+                            result = dot / (sqrt(queryNorms.at<float>(q)) * sqrt(targetNorms.at<float>(t)));
+                        } else {
+                            result = sqrt(std::max(0.f, queryNorms.at<float>(q) + targetNorms.at<float>(t) - 2*dot));
+                            if (negLogPlusOne) result = -log(result+1);
+                        }
+                        output->setRelative(result, q+queryOffset, t+targetOffset);
+                    }
+                }
+            }
+        }
+    }
 };
 
 BR_REGISTER(Distance, DistDistance)
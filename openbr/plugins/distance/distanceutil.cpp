@@ -0,0 +1,216 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/common.h>
+#include <openbr/core/scheduler.h>
+
+namespace br
+{
+
+QBitArray MaskDistance::independentMask(const QList<const MaskDistance*> &masks, const MetadataColumns &targets)
+{
+    QBitArray accepted(targets.size(), true);
+    foreach (const MaskDistance *mask, masks)
+        if (!mask->queryDependent())
+            accepted &= mask->mask(targets, Template());
+    return accepted;
+}
+
+QBitArray MaskDistance::combinedMask(const QList<const MaskDistance*> &masks, const MetadataColumns &targets, const Template &query, const QBitArray &independent)
+{
+    if (query.isEmpty())
+        return QBitArray(targets.size(), false);
+
+    QBitArray accepted = independent;
+    foreach (const MaskDistance *mask, masks)
+        if (mask->queryDependent())
+            accepted &= mask->mask(targets, query);
+    return accepted;
+}
+
+void MaskDistance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+{
+    const QList<const MaskDistance*> masks = QList<const MaskDistance*>() << this;
+    const MetadataColumns columns(target, maskKeys());
+    const QBitArray independent = independentMask(masks, columns);
+    for (int i=0; i<query.size(); i++) {
+        const QBitArray accepted = combinedMask(masks, columns, query[i], independent);
+        for (int j=0; j<target.size(); j++)
+            if (target[j].isEmpty() || !accepted.testBit(j)) output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+            else output->setRelative(0, i+queryOffset, j+targetOffset);
+    }
+}
+
+void ListDistance::compareMasked(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset, bool sum) const
+{
+    QList<const MaskDistance*> masks;
+    QList<const Distance*> others;
+    QStringList keys;
+    foreach (const Distance *distance, distances) {
+        if (const MaskDistance *mask = qobject_cast<const MaskDistance*>(distance)) {
+            masks.append(mask);
+            keys.append(mask->maskKeys());
+        } else {
+            others.append(distance);
+        }
+    }
+
+    // In series the last distance gives the score, which is 0 for an accepted pair if it's a mask
+    const bool maskLast = !sum && !masks.isEmpty() && qobject_cast<const MaskDistance*>(distances.last());
+
+    keys.removeDuplicates();
+    const MetadataColumns columns(target, keys);
+    const QBitArray independent = MaskDistance::independentMask(masks, columns);
+    QVector<QBitArray> accepted(query.size());
+    for (int i=0; i<query.size(); i++)
+        accepted[i] = MaskDistance::combinedMask(masks, columns, query[i], independent);
+
+    // Each tile of targets goes through every query and distance while it is still in cache.
+    // Each distance compares the tile's candidates at once, and candidates it rejects are dropped from the later distances.
+    static const int tileSize = 256;
+    for (int begin=0; begin<target.size(); begin+=tileSize) {
+        const int end = std::min(target.size(), begin+tileSize);
+        for (int i=0; i<query.size(); i++) {
+            QList<int> remaining;
+            TemplateList candidates;
+            for (int j=begin; j<end; j++) {
+                if (accepted[i].testBit(j) && !target[j].isEmpty()) {
+                    remaining.append(j);
+                    candidates.append(target[j]);
+                } else {
+                    output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                }
+            }
+
+            const QList<int> indices = remaining;
+            QVector<float> results(end - begin, (sum || others.isEmpty()) ? 0 : -std::numeric_limits<float>::max());
+            foreach (const Distance *distance, others) {
+                if (candidates.isEmpty()) break;
+                const QList<float> scores = distance->compare(candidates, query[i]);
+                QList<int> kept;
+                TemplateList keptCandidates;
+                for (int k=0; k<remaining.size(); k++) {
+                    float &result = results[remaining[k]-begin];
+                    if (scores[k] == -std::numeric_limits<float>::max()) {
+                        result = scores[k];
+                        continue;
+                    }
+                    result = sum ? result + scores[k] : scores[k];
+                    kept.append(remaining[k]);
+                    keptCandidates.append(candidates[k]);
+                }
+                remaining = kept;
+                candidates = keptCandidates;
+            }
+
+            foreach (int j, indices) {
+                const float result = results[j-begin];
+                const float score = (maskLast && (result != -std::numeric_limits<float>::max())) ? 0 : result;
+                output->setRelative(score, i+queryOffset, j+targetOffset);
+            }
+        }
+    }
+}
+
+// Scores a range of explicitly enumerated pairs
+struct PairComparer
+{
+    const Distance *distance;
+    const TemplateList *src;
+    const QVector< QPair<int,int> > *pairs;
+    float *scores;
+
+    void compare(int begin, int end) const
+    {
+        for (int i=begin; i<end; i++)
+            scores[i] = distance->compare((*src)[(*pairs)[i].first], (*src)[(*pairs)[i].second]);
+    }
+};
+
+void trainingScores(const Distance *distance, const TemplateList &src, const QList<int> &labels, bool crossModality, qint64 maxImpostors, QList<float> &genuines, QList<float> &impostors)
+{
+    QStringList modalities;
+    if (crossModality)
+        foreach (const Template &t, src)
+            modalities.append(t.file.get<QString>("MODALITY"));
+
+    // Genuine pairs
+    QHash< int, QList<int> > groups;
+    for (int i=0; i<labels.size(); i++)
+        groups[labels[i]].append(i);
+
+    QVector< QPair<int,int> > pairs;
+    foreach (const QList<int> &group, groups)
+        for (int i=0; i<group.size(); i++)
+            for (int j=0; j<i; j++)
+                if (!crossModality || (modalities[group[i]] != modalities[group[j]]))
+                    pairs.append(qMakePair(group[i], group[j]));
+
+    QVector<float> scores(pairs.size());
+    PairComparer comparer;
+    comparer.distance = distance;
+    comparer.src = &src;
+    comparer.pairs = &pairs;
+    comparer.scores = scores.data();
+    const int step = std::max(1, int(pairs.size() / std::max(1, 4*WorkStealingPool::global()->threadCount())));
+    TaskGroup tasks;
+    for (int i=0; i<pairs.size(); i+=step)
+        tasks.runMember(&comparer, &PairComparer::compare, i, std::min(pairs.size(), i+step));
+    tasks.wait();
+    foreach (float score, scores)
+        if (score != -std::numeric_limits<float>::max())
+            genuines.append(score);
+
+    // Impostor pairs, each counted once from the last of its rows to be compared
+    const qint64 n = src.size();
+    QList<int> rows;
+    if (n*(n-1)/2 <= maxImpostors) {
+        for (int i=0; i<n; i++)
+            rows.append(i);
+    } else {
+        rows = Common::RandSample(int(std::max(qint64(1), maxImpostors / std::max(qint64(1), n-1))), n, 0, true);
+        std::sort(rows.begin(), rows.end());
+    }
+
+    QVector<bool> sampled(n, false);
+    foreach (int row, rows)
+        sampled[row] = true;
+
+    const int blockRows = std::max(qint64(1), (qint64(1) << 24) / std::max(qint64(1), n)); // Bounds each block of scores to 64 MB
+    for (int begin=0; begin<rows.size(); begin+=blockRows) {
+        const QList<int> block = rows.mid(begin, blockRows);
+        TemplateList queries;
+        foreach (int row, block)
+            queries.append(src[row]);
+
+        QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(n), FileList(queries.size())));
+        distance->compare(src, queries, matrixOutput.data());
+
+        for (int q=0; q<block.size(); q++) {
+            const int i = block[q];
+            const float *row = matrixOutput->data.ptr<float>(q);
+            for (int j=0; j<n; j++) {
+                if ((j == i) || (sampled[j] && (j > i)) || (labels[i] == labels[j])) continue;
+                if (row[j] == -std::numeric_limits<float>::max()) continue;
+                if (crossModality && (modalities[i] == modalities[j])) continue;
+                impostors.append(row[j]);
+            }
+        }
+    }
+}
+
+} // namespace br
@@ -1,3 +1,4 @@
+#include <queue>
 #include <openbr/plugins/openbr_internal.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -9,6 +10,14 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Computes Earth Mover's Distance
+ *
+ * Single row histograms of equal mass use the closed form 1-D EMD, the L1 distance between their cumulative sums.
+ * Otherwise pairs are first bounded from below by the distance between signature centroids and by the 1-D EMD of the
+ * column marginals, both valid for histograms of equal mass, and exact EMD is only computed when the bound can matter:
+ * - Pairs whose bound exceeds \c threshold score their bound.
+ * - With \c k > 0, comparing a query against a list of targets visits targets in order of increasing bound and stops once
+ *   the bound reaches the k-th smallest exact distance, the remaining targets scoring their bound.
+ * - Empty templates and failures to enroll score -FLT_MAX.
  * \author Scott Klum \cite sklum
  * \brief https://www.cs.duke.edu/~tomasi/papers/rubner/rubnerTr98.pdf
  */
@@ -18,6 +27,8 @@ class EMDDistance : public UntrainableDistance
 
     Q_ENUMS(Metric)
     Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
 
 public:
     enum Metric { L1 = CV_DIST_L1,
@@ -26,32 +37,158 @@ public:
 
 private:
     BR_PROPERTY(Metric, metric, L2)
+    BR_PROPERTY(float, threshold, std::numeric_limits<float>::max())
+    BR_PROPERTY(int, k, 0)
 
-    float compare(const Template &a, const Template &b) const
+    struct Signature
     {
-        const int dims_a = a.m().rows > 1 ? 3 : 2;
-        const int dims_b = b.m().rows > 1 ? 3 : 2;
+        Mat sig; // Weight followed by column and, for multiple rows, row coordinates
+        double mass;
+        float centroid[2];
+        QVector<double> columns; // Mass per column
+    };
 
-        Mat sig_a(a.m().cols, dims_a, CV_32FC1);
-        Mat sig_b(b.m().cols, dims_b, CV_32FC1);
+    static Signature signature(const Mat &m)
+    {
+        Signature s;
+        const int dims = m.rows > 1 ? 3 : 2;
+        s.sig = Mat(m.rows*m.cols, dims, CV_32FC1);
+        s.mass = 0;
+        s.columns = QVector<double>(m.cols, 0);
+        double x = 0, y = 0;
 
-        for (int i=0; i<a.m().rows; i++) {
-            for (int j=0; j<a.m().cols; j++) {
-                sig_a.at<float>(i*a.m().cols+j,0) = a.m().at<float>(i,j);
-                sig_a.at<float>(i*a.m().cols+j,1) = j;
-                if (dims_a == 3) sig_a.at<float>(i*a.m().cols+j,2) = i;
+        for (int i=0; i<m.rows; i++) {
+            for (int j=0; j<m.cols; j++) {
+                const float weight = m.at<float>(i,j);
+                float *row = s.sig.ptr<float>(i*m.cols+j);
+                row[0] = weight;
+                row[1] = j;
+                if (dims == 3) row[2] = i;
+                s.mass += weight;
+                s.columns[j] += weight;
+                x += weight * j;
+                y += weight * i;
             }
         }
 
-        for (int i=0; i<b.m().rows; i++) {
-            for (int j=0; j<b.m().cols; j++) {
-                sig_b.at<float>(i*b.m().cols+j,0) = b.m().at<float>(i,j);
-                sig_b.at<float>(i*b.m().cols+j,1) = j;
-                if (dims_b == 3) sig_a.at<float>(i*b.m().cols+j,2) = i;
+        s.centroid[0] = s.mass > 0 ? x / s.mass : 0;
+        s.centroid[1] = s.mass > 0 ? y / s.mass : 0;
+        return s;
+    }
+
+    static bool equalMass(const Signature &a, const Signature &b)
+    {
+        return fabs(a.mass - b.mass) <= 1e-5 * std::max(a.mass, b.mass);
+    }
+
+    // Closed form EMD between 1-D histograms of equal mass with unit bin spacing
+    static float emd1D(const QVector<double> &a, const QVector<double> &b, double mass)
+    {
+        double cumulative = 0, work = 0;
+        for (int i=0; i<std::max(a.size(), b.size()); i++) {
+            cumulative += (i < a.size() ? a[i] : 0) - (i < b.size() ? b[i] : 0);
+            work += fabs(cumulative);
+        }
+        return mass > 0 ? work / mass : 0;
+    }
+
+    float lowerBound(const Signature &a, const Signature &b) const
+    {
+        if (!equalMass(a, b))
+            return 0;
+
+        const float dx = fabs(a.centroid[0] - b.centroid[0]), dy = fabs(a.centroid[1] - b.centroid[1]);
+        float centroid;
+        if      (metric == L1) centroid = dx + dy;
+        else if (metric == L2) centroid = sqrt(dx*dx + dy*dy);
+        else                   centroid = std::max(dx, dy);
+
+        // Every ground distance is at least the column offset
+        return std::max(centroid, emd1D(a.columns, b.columns, a.mass));
+    }
+
+    float exact(const Signature &a, const Signature &b) const
+    {
+        if ((a.sig.cols == 2) && (b.sig.cols == 2) && equalMass(a, b))
+            return emd1D(a.columns, b.columns, a.mass);
+        return EMD(a.sig, b.sig, metric);
+    }
+
+    // Failures to enroll have no signature, they score -FLT_MAX as in Distance::compare
+    static bool comparable(const Template &t)
+    {
+        return !t.isEmpty() && !t.file.fte && !t.m().empty();
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        if (!comparable(a) || !comparable(b))
+            return -std::numeric_limits<float>::max();
+        const Signature sa = signature(a.m()), sb = signature(b.m());
+        if (threshold < std::numeric_limits<float>::max()) {
+            const float bound = lowerBound(sa, sb);
+            if (bound > threshold)
+                return bound;
+        }
+        return exact(sa, sb);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        if (k <= 0)
+            return Distance::compare(targets, query);
+
+        QList<float> scores;
+        if (!comparable(query)) {
+            for (int i=0; i<targets.size(); i++)
+                scores.append(-std::numeric_limits<float>::max());
+            return scores;
+        }
+
+        const Signature sq = signature(query.m());
+        QVector<Signature> signatures(targets.size());
+        QList< QPair<float,int> > bounds;
+        for (int i=0; i<targets.size(); i++) {
+            if (!comparable(targets[i])) {
+                scores.append(-std::numeric_limits<float>::max());
+                continue;
             }
+            signatures[i] = signature(targets[i].m());
+            scores.append(lowerBound(signatures[i], sq));
+            bounds.append(QPair<float,int>(scores[i], i));
         }
+        qSort(bounds);
+
+        // Largest of the k smallest exact distances on top
+        std::priority_queue<float> best;
+        for (int i=0; i<bounds.size(); i++) {
+            const float bound = bounds[i].first;
+            if ((int(best.size()) >= k) && (bound >= best.top()))
+                break;
+            if (bound > threshold)
+                break;
+            const float distance = exact(signatures[bounds[i].second], sq);
+            scores[bounds[i].second] = distance;
+            best.push(distance);
+            if (int(best.size()) > k)
+                best.pop();
+        }
+        return scores;
+    }
 
-        return EMD(sig_a,sig_b,metric);
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        if (k <= 0) {
+            Distance::compareBlock(target, query, output, targetOffset, queryOffset);
+            return;
+        }
+
+        // Pruning against a block's k-th best is conservative, the global k-th best can only be smaller
+        for (int i=0; i<query.size(); i++) {
+            const QList<float> scores = compare(target, query[i]);
+            for (int j=0; j<target.size(); j++)
+                output->setRelative(scores[j], i+queryOffset, j+targetOffset);
+        }
     }
 };
 
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/predicate.h>
 
 namespace br
 {
@@ -22,29 +23,49 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Checks target metadata against filters.
+ *
+ * br::Context::filters are compiled into a br::MetadataPredicate on first use, and again whenever they have changed.
  * \author Josh Klontz \cite jklontz
  */
-class FilterDistance : public UntrainableDistance
+class FilterDistance : public MaskDistance
 {
     Q_OBJECT
 
+    mutable QMutex lock;
+    mutable Context::Filters filters; // The filters predicate was compiled from
+    mutable QSharedPointer<MetadataPredicate> predicate;
+
+    // The predicate for the current br::Context::filters
+    QSharedPointer<MetadataPredicate> current() const
+    {
+        QMutexLocker locker(&lock);
+        if (!predicate || (!filters.isSharedWith(Globals->filters) && (filters != Globals->filters))) {
+            filters = Globals->filters;
+            predicate = QSharedPointer<MetadataPredicate>(new MetadataPredicate(MetadataPredicate::fromFilters(filters)));
+        }
+        return predicate;
+    }
+
+    bool queryDependent() const
+    {
+        return false;
+    }
+
+    QStringList maskKeys() const
+    {
+        return current()->keys();
+    }
+
+    QBitArray mask(const MetadataColumns &targets, const Template &query) const
+    {
+        (void) query; // Query template isn't checked
+        return (*current())(targets);
+    }
+
     float compare(const Template &a, const Template &b) const
     {
         (void) b; // Query template isn't checked
-        foreach (const QString &key, Globals->filters.keys()) {
-            bool keep = false;
-            const QString metadata = a.file.get<QString>(key, "");
-            if (Globals->filters[key].isEmpty()) continue;
-            if (metadata.isEmpty()) return -std::numeric_limits<float>::max();
-            foreach (const QString &value, Globals->filters[key]) {
-                if (metadata == value) {
-                    keep = true;
-                    break;
-                }
-            }
-            if (!keep) return -std::numeric_limits<float>::max();
-        }
-        return 0;
+        return (*current())(a.file) ? 0 : -std::numeric_limits<float>::max();
     }
 };
 
@@ -17,8 +17,7 @@
 #include <numeric>
 
 #include <openbr/plugins/openbr_internal.h>
-
-#include <QtConcurrent>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -53,10 +52,10 @@ private:
         QList<TemplateList> partitionedSrc = src.split(splits);
 
         // Train on each of the partitions
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<distances.size(); i++)
-            futures.addFuture(QtConcurrent::run(distances[i], &Distance::train, partitionedSrc[i]));
-        futures.waitForFinished();
+            tasks.runMember(distances[i], &Distance::train, partitionedSrc[i]);
+        tasks.wait();
     }
 
     float compare(const Template &a, const Template &b) const
@@ -91,6 +90,61 @@ private:
         }
         return 0;
     }
+
+    // Each tile of targets is split into one template list per matrix and compared against every query while it is still in cache,
+    // each distance comparing a query against the whole tile at once
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        static const int tileSize = 256;
+        const int n = distances.size();
+        for (int begin=0; begin<target.size(); begin+=tileSize) {
+            const int end = std::min(target.size(), begin+tileSize);
+            QList<int> indices;
+            QList<TemplateList> tiles;
+            for (int k=0; k<n; k++)
+                tiles.append(TemplateList());
+            for (int j=begin; j<end; j++) {
+                if (target[j].size() != n) continue;
+                indices.append(j);
+                for (int k=0; k<n; k++)
+                    tiles[k].append(Template(target[j].file, target[j][k]));
+            }
+
+            for (int i=0; i<query.size(); i++) {
+                QVector<float> results(end - begin, -std::numeric_limits<float>::max());
+                if (query[i].size() == n) {
+                    QVector<double> sums(indices.size(), 0);
+                    QVector<float> extremes(indices.size(), 0);
+                    int count = 0;
+                    for (int k=0; k<n; k++) {
+                        const float weight = weights.isEmpty() ? 1 : weights[k];
+                        if (weight == 0) continue;
+                        const QList<float> scores = distances[k]->compare(tiles[k], Template(query[i].file, query[i][k]));
+                        for (int t=0; t<indices.size(); t++) {
+                            const float score = weight*scores[t];
+                            sums[t] += score;
+                            if      (count == 0)         extremes[t] = score;
+                            else if (operation == Min)   extremes[t] = std::min(extremes[t], score);
+                            else if (operation == Max)   extremes[t] = std::max(extremes[t], score);
+                        }
+                        count++;
+                    }
+
+                    for (int t=0; t<indices.size(); t++) {
+                        float &result = results[indices[t]-begin];
+                        switch (operation) {
+                          case Mean: result = sums[t]/(float)count; break;
+                          case Sum:  result = sums[t];              break;
+                          default:   result = extremes[t];
+                        }
+                    }
+                }
+
+                for (int j=begin; j<end; j++)
+                    output->setRelative(results[j-begin], i+queryOffset, j+targetOffset);
+            }
+        }
+    }
 };
 
 BR_REGISTER(Distance, FuseDistance)
@@ -0,0 +1,92 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+#include <openbr/core/mih.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Hamming distance between bit-packed codes, see \ref BinarizeTransform and \ref KernelHashTransform.
+ *
+ * The similarity is the negated number of differing bits, counted with the widest popcount instruction available.
+ * When \c radius is non-negative, each block of targets is indexed with multi-index hashing
+ * and only targets within \c radius bits of a query are scored, the rest are reported as <tt>-FLT_MAX</tt>.
+ * This makes a binary-coded gallery a cheap pre-filter before an expensive distance.
+ */
+class HammingDistance : public UntrainableDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    BR_PROPERTY(int, radius, -1)
+
+    float compare(const uchar *a, const uchar *b, size_t size) const
+    {
+        return -hamming(a, b, size);
+    }
+
+    static bool valid(const Template &t, size_t bytes)
+    {
+        return !t.isEmpty() && t.m().isContinuous() && (t.m().total() * t.m().elemSize() == bytes);
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        size_t bytes = 0;
+        foreach (const Template &t, target)
+            if (!t.isEmpty() && !t.m().empty()) {
+                bytes = t.m().total() * t.m().elemSize();
+                break;
+            }
+
+        MultiIndexHash index;
+        if (radius >= 0)
+            index.build(target);
+
+        for (int i=0; i<query.size(); i++) {
+            const bool validQuery = (bytes > 0) && valid(query[i], bytes);
+            if (radius < 0 || !validQuery) {
+                for (int j=0; j<target.size(); j++)
+                    output->setRelative((validQuery && valid(target[j], bytes)) ? -hamming(target[j].m().data, query[i].m().data, bytes)
+                                                                               : -std::numeric_limits<float>::max(),
+                                        i+queryOffset, j+targetOffset);
+                continue;
+            }
+
+            const QVector<int> matches = index.search(query[i].m().data, radius);
+            int next = 0;
+            for (int j=0; j<target.size(); j++) {
+                if ((next < matches.size()) && (matches[next] == j)) {
+                    output->setRelative(-hamming(target[j].m().data, query[i].m().data, bytes), i+queryOffset, j+targetOffset);
+                    next++;
+                } else {
+                    output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                }
+            }
+        }
+    }
+};
+
+BR_REGISTER(Distance, HammingDistance)
+
+} // namespace br
+
+#include "distance/hamming.moc"
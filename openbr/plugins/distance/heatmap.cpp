@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -22,6 +23,9 @@ namespace br
 /*!
  * \ingroup distances
  * \brief 1v1 heat map comparison
+ *
+ * Patches are trained and compared in parallel, in at most br::Context::parallelism contiguous ranges of patches.
+ * Each range reads its patches in place from the templates, so training doesn't copy the data per patch.
  * \author Scott Klum \cite sklum
  */
 class HeatMapDistance : public Distance
@@ -36,25 +40,38 @@ class HeatMapDistance : public Distance
 
     QList<br::Distance*> distances;
 
-    void train(const TemplateList &src)
+    // Ranges of patches for each thread
+    QList< QPair<int,int> > ranges() const
     {
-        QList<TemplateList> patches;
+        const int count = std::max(1, std::min(distances.size(), Globals->parallelism));
+        QList< QPair<int,int> > result;
+        for (int i=0; i<count; i++)
+            result.append(QPair<int,int>(distances.size()*i/count, distances.size()*(i+1)/count));
+        return result;
+    }
 
-        // Split src into list of TemplateLists of corresponding patches across all Templates
-        for (int i=0; i<step; i++) {
-            TemplateList patchBuffer;
+    static void trainPatches(const QList<br::Distance*> &distances, const TemplateList &src, int begin, int end)
+    {
+        for (int i=begin; i<end; i++) {
+            // Corresponding patches across all templates, sharing their data
+            TemplateList patches;
+            patches.reserve(src.size());
             for (int j=0; j<src.size(); j++)
-                patchBuffer.append(Template(src[j].file, src[j][i]));
-            patches.append(patchBuffer);
-            patchBuffer.clear();
+                patches.append(Template(src[j].file, src[j][i]));
+            distances[i]->train(patches);
         }
+    }
 
-        while (distances.size() < patches.size())
+    void train(const TemplateList &src)
+    {
+        while (distances.size() < step)
             distances.append(make(description));
 
-        // Train on a distance for each patch
-        for (int i=0; i<distances.size(); i++)
-            distances[i]->train(patches[i]);
+        TaskGroup tasks;
+        typedef QPair<int,int> Range;
+        foreach (const Range &range, ranges())
+            tasks.run(trainPatches, distances, src, range.first, range.second);
+        tasks.wait();
     }
 
     float compare(const cv::Mat &target, const cv::Mat &query) const
@@ -66,12 +83,22 @@ class HeatMapDistance : public Distance
         return 0;
     }
 
+    static void comparePatches(const QList<br::Distance*> &distances, const Template &target, const Template &query, Output *output, const QPair<int,int> &range)
+    {
+        for (int j=range.first; j<range.second; j++)
+            output->setRelative(distances[j]->compare(target[j], query[j]), j, 0);
+    }
+
     void compare(const TemplateList &target, const TemplateList &query, Output *output) const
     {
+        typedef QPair<int,int> Range;
+        const QList<Range> patchRanges = ranges();
         for (int i=0; i<target.size(); i++) {
             if (target[i].size() != step || query[i].size() != step) qFatal("Heatmap step not equal to the number of patches.");
-            for (int j=0; j<step; j++)
-                output->setRelative(distances[j]->compare(target[i][j],query[i][j]), j, 0);
+            TaskGroup tasks;
+            foreach (const Range &range, patchRanges)
+                tasks.run(comparePatches, distances, target[i], query[i], output, range);
+            tasks.wait();
         }
      }
 
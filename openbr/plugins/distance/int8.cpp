@@ -0,0 +1,47 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Fast inner product or cosine similarity of symmetric int8 codes.
+ *
+ * Expects templates from Int8QuantizeTransform, compared with AVX-512 VNNI, AVX2 or ARM dot product instructions when available.
+ */
+class Int8Distance : public UntrainableDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine RESET reset_cosine STORED false)
+    BR_PROPERTY(bool, cosine, true)
+
+    float compare(const unsigned char *a, const unsigned char *b, size_t size) const
+    {
+        const int8_t *A = reinterpret_cast<const int8_t*>(a);
+        const int8_t *B = reinterpret_cast<const int8_t*>(b);
+        return cosine ? int8_cosine(A, B, size) : int8_dot(A, B, size);
+    }
+};
+
+BR_REGISTER(Distance, Int8Distance)
+
+} // namespace br
+
+#include "distance/int8.moc"
@@ -14,7 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCache>
+#include <QMutex>
+#include <QSharedPointer>
 #include <opencv2/features2d/features2d.hpp>
+#include <opencv2/flann/flann.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
 
@@ -26,6 +30,10 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV Key Point Matcher
+ *
+ * With \c index true the descriptors of each target are indexed once, with FLANN randomized kd-trees for float descriptors
+ * or LSH for binary descriptors, and the index is cached for up to \c cacheSize targets and reused across queries.
+ * Query descriptors are then matched against the target index with the same ratio test.
  * \author Josh Klontz \cite jklontz
  */
 class KeyPointMatcherDistance : public UntrainableDistance
@@ -33,30 +41,90 @@ class KeyPointMatcherDistance : public UntrainableDistance
     Q_OBJECT
     Q_PROPERTY(QString matcher READ get_matcher WRITE set_matcher RESET reset_matcher STORED false)
     Q_PROPERTY(float maxRatio READ get_maxRatio WRITE set_maxRatio RESET reset_maxRatio STORED false)
+    Q_PROPERTY(bool index READ get_index WRITE set_index RESET reset_index STORED false)
+    Q_PROPERTY(int checks READ get_checks WRITE set_checks RESET reset_checks STORED false)
+    Q_PROPERTY(int cacheSize READ get_cacheSize WRITE set_cacheSize RESET reset_cacheSize STORED false)
     BR_PROPERTY(QString, matcher, "BruteForce")
     BR_PROPERTY(float, maxRatio, 0.8)
+    BR_PROPERTY(bool, index, false)
+    BR_PROPERTY(int, checks, 32)
+    BR_PROPERTY(int, cacheSize, 10000)
 
     Ptr<DescriptorMatcher> descriptorMatcher;
 
+    struct TargetIndex
+    {
+        Mat source, descriptors; // The source keeps the target's data, and therefore the cache key, alive
+        flann::Index index;
+        bool binary;
+
+        TargetIndex(const Mat &source)
+            : source(source), descriptors(source.isContinuous() ? source : source.clone()), binary(source.depth() == CV_8U)
+        {
+            if (binary) index.build(descriptors, flann::LshIndexParams(12, 20, 2), cvflann::FLANN_DIST_HAMMING);
+            else        index.build(descriptors, flann::KDTreeIndexParams(4), cvflann::FLANN_DIST_L2);
+        }
+    };
+
+    mutable QMutex cacheLock;
+    mutable QCache<const uchar*, QSharedPointer<TargetIndex> > cache;
+
     void init()
     {
         descriptorMatcher = DescriptorMatcher::create(matcher.toStdString());
         if (descriptorMatcher.empty())
             qFatal("Failed to create DescriptorMatcher: %s", qPrintable(matcher));
+        cache.setMaxCost(cacheSize);
+    }
+
+    QSharedPointer<TargetIndex> targetIndex(const Mat &target) const
+    {
+        QMutexLocker locker(&cacheLock);
+        if (QSharedPointer<TargetIndex> *cached = cache.object(target.data))
+            return *cached;
+        locker.unlock();
+
+        // Built outside the lock, a target indexed by two threads at once is simply built twice
+        QSharedPointer<TargetIndex> built(new TargetIndex(target));
+        locker.relock();
+        cache.insert(target.data, new QSharedPointer<TargetIndex>(built));
+        return built;
+    }
+
+    QList<float> indexedDistances(const Mat &target, const Mat &query) const
+    {
+        const QSharedPointer<TargetIndex> targetIndex = this->targetIndex(target);
+
+        Mat indices, dists;
+        targetIndex->index.knnSearch(query, indices, dists, 2, flann::SearchParams(checks));
+        if (targetIndex->binary) dists.convertTo(dists, CV_32F);
+        else                     sqrt(dists, dists); // Squared L2 from FLANN
+
+        QList<float> distances;
+        for (int i=0; i<dists.rows; i++) {
+            const float *row = dists.ptr<float>(i);
+            if ((indices.at<int>(i, 1) < 0) || (row[0] / row[1] > maxRatio)) continue;
+            distances.append(row[0]);
+        }
+        return distances;
     }
 
     float compare(const Mat &a, const Mat &b) const
     {
         if ((a.rows < 2) || (b.rows < 2)) return 0;
 
-        std::vector< std::vector<DMatch> > matches;
-        if (a.rows < b.rows) descriptorMatcher->knnMatch(a, b, matches, 2);
-        else                 descriptorMatcher->knnMatch(b, a, matches, 2);
-
         QList<float> distances;
-        foreach (const std::vector<DMatch> &match, matches) {
-            if (match[0].distance / match[1].distance > maxRatio) continue;
-            distances.append(match[0].distance);
+        if (index) {
+            distances = indexedDistances(a, b);
+        } else {
+            std::vector< std::vector<DMatch> > matches;
+            if (a.rows < b.rows) descriptorMatcher->knnMatch(a, b, matches, 2);
+            else                 descriptorMatcher->knnMatch(b, a, matches, 2);
+
+            foreach (const std::vector<DMatch> &match, matches) {
+                if (match[0].distance / match[1].distance > maxRatio) continue;
+                distances.append(match[0].distance);
+            }
         }
         qSort(distances);
 
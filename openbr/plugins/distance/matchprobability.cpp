@@ -14,48 +14,51 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
 
 namespace br
 {
 
-float KDEPointer(const QList<float> *scores, double x, double h)
-{
-    return Common::KernelDensityEstimation(*scores, x, h);
-}
-
 /* Kernel Density Estimator */
+// The density is approximated from scores binned onto its 255 evaluation points, see Common::BinnedKernelDensity(),
+// and the counts and moments are kept so more scores can be added later without revisiting the earlier ones.
 struct KDE
 {
     float min, max;
     double mean, stddev;
     QList<float> bins;
+    QVector<double> counts;
+    double n, sum, sumSquares;
 
-    KDE() : min(0), max(1), mean(0), stddev(1) {}
+    KDE() : min(0), max(1), mean(0), stddev(1), n(0), sum(0), sumSquares(0) {}
 
     KDE(const QList<float> &scores, bool trainKDE)
+        : n(0), sum(0), sumSquares(0)
     {
         Common::MinMax(scores, &min, &max);
-        Common::MeanStdDev(scores, &mean, &stddev);
-
-        if (!trainKDE)
-            return;
-
-        double h = Common::KernelDensityBandwidth(scores);
-        const int size = 255;
-        bins.reserve(size);
+        if (trainKDE)
+            counts = QVector<double>(255, 0);
+        add(scores);
+    }
 
-        QFutureSynchronizer<float> futures;
+    // Scores outside the initial range are counted at its ends
+    void add(const QList<float> &scores)
+    {
+        foreach (float score, scores) {
+            sum += score;
+            sumSquares += double(score) * score;
+        }
+        n += scores.size();
+        mean = n > 0 ? sum / n : 0;
+        stddev = n > 0 ? sqrt(std::max(sumSquares / n - mean * mean, 0.0)) : 0;
 
-        for (int i=0; i < size; i++)
-            futures.addFuture(QtConcurrent::run(KDEPointer, &scores, min + (max-min)*i/(size-1), h));
-        futures.waitForFinished();
+        if (counts.isEmpty())
+            return;
 
-        foreach(const QFuture<float> & future, futures.futures())
-            bins.append(future.result());
+        Common::LinearBin(scores, min, max, counts);
+        const double h = pow(4 * pow(stddev, 5.0) / (3 * n), 0.2);
+        bins = Common::BinnedKernelDensity(counts, min, max, n, h);
     }
 
     float operator()(float score, bool gaussian = true) const
@@ -66,21 +69,55 @@ struct KDE
 
         if (score <= min) return bins.first();
         if (score >= max) return bins.last();
-        const float x = (score-min)/(max-min)*bins.size();
+        const float x = (score-min)/(max-min)*(bins.size()-1);
         const float y1 = bins[floor(x)];
         const float y2 = bins[ceil(x)];
         return y1 + (y2-y1)*(x-floor(x));
     }
 };
 
+// Models older than the counts and moments hold only min, max, mean, stddev and bins.
+// The current layout starts with a NaN that no minimum score takes, followed by a version.
+static const quint64 KDEMagic = Q_UINT64_C(0x7FF84B4445000000);
+static const quint32 KDEMagicSingle = 0x7FC4B44E;
+static const quint32 KDEVersion = 2;
+
 QDataStream &operator<<(QDataStream &stream, const KDE &kde)
 {
-    return stream << kde.min << kde.max << kde.mean << kde.stddev << kde.bins;
+    if (stream.floatingPointPrecision() == QDataStream::DoublePrecision) stream << KDEMagic;
+    else                                                                stream << KDEMagicSingle;
+    return stream << KDEVersion << kde.min << kde.max << kde.mean << kde.stddev << kde.bins << kde.counts << kde.n << kde.sum << kde.sumSquares;
 }
 
 QDataStream &operator>>(QDataStream &stream, KDE &kde)
 {
-    return stream >> kde.min >> kde.max >> kde.mean >> kde.stddev >> kde.bins;
+    // The marker occupies the bytes of the old layout's min
+    bool current;
+    if (stream.floatingPointPrecision() == QDataStream::DoublePrecision) {
+        quint64 bits;
+        stream >> bits;
+        current = (bits == KDEMagic);
+        double min;
+        memcpy(&min, &bits, sizeof(min));
+        kde.min = min;
+    } else {
+        quint32 bits;
+        stream >> bits;
+        current = (bits == KDEMagicSingle);
+        memcpy(&kde.min, &bits, sizeof(kde.min));
+    }
+
+    if (!current) {
+        kde.counts.clear();
+        kde.n = kde.sum = kde.sumSquares = 0;
+        return stream >> kde.max >> kde.mean >> kde.stddev >> kde.bins;
+    }
+
+    quint32 version;
+    stream >> version;
+    if (version != KDEVersion)
+        qFatal("Unsupported KDE version %u.", version);
+    return stream >> kde.min >> kde.max >> kde.mean >> kde.stddev >> kde.bins >> kde.counts >> kde.n >> kde.sum >> kde.sumSquares;
 }
 
 /* Match Probability */
@@ -90,6 +127,11 @@ struct MP
     MP() {}
     MP(const QList<float> &genuineScores, const QList<float> &impostorScores, bool trainKDE)
         : genuine(genuineScores, trainKDE), impostor(impostorScores, trainKDE) {}
+    void add(const QList<float> &genuineScores, const QList<float> &impostorScores)
+    {
+        genuine.add(genuineScores);
+        impostor.add(impostorScores);
+    }
     float operator()(float score, bool gaussian = true) const
     {
         const float g = genuine(score, gaussian);
@@ -111,6 +153,10 @@ QDataStream &operator>>(QDataStream &stream, MP &nmp)
 /*!
  * \ingroup distances
  * \brief Match Probability \cite klare12
+ *
+ * Trained on every genuine pair and on at most about \c maxImpostors impostor pairs, from a random sample of training templates compared against all others.
+ * When \c incremental is set, training again adds the new scores to the estimated distributions instead of replacing them,
+ * so the normalization can be recalibrated as data arrives.
  * \author Josh Klontz \cite jklontz
  */
 class MatchProbabilityDistance : public Distance
@@ -120,31 +166,30 @@ class MatchProbabilityDistance : public Distance
     Q_PROPERTY(bool gaussian READ get_gaussian WRITE set_gaussian RESET reset_gaussian STORED false)
     Q_PROPERTY(bool crossModality READ get_crossModality WRITE set_crossModality RESET reset_crossModality STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(qint64 maxImpostors READ get_maxImpostors WRITE set_maxImpostors RESET reset_maxImpostors STORED false)
+    Q_PROPERTY(bool incremental READ get_incremental WRITE set_incremental RESET reset_incremental STORED false)
 
     MP mp;
+    bool trained;
+
+    void init()
+    {
+        trained = false;
+    }
 
     void train(const TemplateList &src)
     {
         distance->train(src);
 
-        const QList<int> labels = src.indexProperty(inputVariable);
-        QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(src.size()), FileList(src.size())));
-        distance->compare(src, src, matrixOutput.data());
-
         QList<float> genuineScores, impostorScores;
-        genuineScores.reserve(labels.size());
-        impostorScores.reserve(labels.size()*labels.size());
-        for (int i=0; i<src.size(); i++) {
-            for (int j=0; j<i; j++) {
-                const float score = matrixOutput.data()->data.at<float>(i, j);
-                if (score == -std::numeric_limits<float>::max()) continue;
-                if (crossModality && src[i].file.get<QString>("MODALITY") == src[j].file.get<QString>("MODALITY")) continue;
-                if (labels[i] == labels[j]) genuineScores.append(score);
-                else                        impostorScores.append(score);
-            }
-        }
+        trainingScores(distance, src, src.indexProperty(inputVariable), crossModality, maxImpostors, genuineScores, impostorScores);
 
-        mp = MP(genuineScores, impostorScores, !gaussian);
+        if (incremental && trained) {
+            mp.add(genuineScores, impostorScores);
+        } else {
+            mp = MP(genuineScores, impostorScores, !gaussian);
+            trained = true;
+        }
     }
 
     float compare(const Template &target, const Template &query) const
@@ -179,6 +224,7 @@ class MatchProbabilityDistance : public Distance
     {
         distance->load(stream);
         stream >> mp;
+        trained = true;
     }
 
 protected:
@@ -186,6 +232,8 @@ protected:
     BR_PROPERTY(bool, gaussian, true)
     BR_PROPERTY(bool, crossModality, false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(qint64, maxImpostors, 10000000)
+    BR_PROPERTY(bool, incremental, false)
 };
 
 BR_REGISTER(Distance, MatchProbabilityDistance)
@@ -25,44 +25,70 @@ namespace br
  * \brief Checks target metadata against query metadata.
  * \author Scott Klum \cite sklum
  */
-class MetadataDistance : public UntrainableDistance
+class MetadataDistance : public MaskDistance
 {
     Q_OBJECT
 
     Q_PROPERTY(QStringList filters READ get_filters WRITE set_filters RESET reset_filters STORED false)
     BR_PROPERTY(QStringList, filters, QStringList())
 
-    float compare(const Template &a, const Template &b) const
+    // The query value, which may be a range
+    static QString queryValue(const Template &query, const QString &key)
     {
-        foreach (const QString &key, filters) {
-            QString aValue = a.file.get<QString>(key, QString());
-            QString bValue = b.file.get<QString>(key, QString());
+        const QString value = query.file.get<QString>(key, QString());
+        return value.isEmpty() ? QtUtils::toString(query.file.get<QPointF>(key, QPointF())) : value;
+    }
 
-            // The query value may be a range. Let's check.
-            if (bValue.isEmpty()) bValue = QtUtils::toString(b.file.get<QPointF>(key, QPointF()));
+    static bool matches(const QString &aValue, const QString &bValue)
+    {
+        bool ok;
+        QPointF range = QtUtils::toPoint(bValue,&ok);
 
-            if (aValue.isEmpty() || bValue.isEmpty()) continue;
+        if (ok) /* Range */ {
+            int value = range.x();
+            int upperBound = range.y();
 
-            bool keep = false;
-            bool ok;
+            while (value <= upperBound) {
+                if (aValue == QString::number(value))
+                    return true;
+                value++;
+            }
+            return false;
+        }
+        return aValue == bValue;
+    }
+
+    QStringList maskKeys() const
+    {
+        return filters;
+    }
 
-            QPointF range = QtUtils::toPoint(bValue,&ok);
+    QBitArray mask(const MetadataColumns &targets, const Template &query) const
+    {
+        QBitArray accepted(targets.size(), true);
+        foreach (const QString &key, filters) {
+            const QString bValue = queryValue(query, key);
+            if (bValue.isEmpty()) continue;
+
+            // Targets without a value are kept
+            const QStringList values = targets.values(key);
+            QVector<bool> selected(values.size());
+            for (int i=0; i<values.size(); i++)
+                selected[i] = values[i].isEmpty() || matches(values[i], bValue);
+            accepted &= targets.select(key, selected, true);
+        }
+        return accepted;
+    }
 
-            if (ok) /* Range */ {
-                int value = range.x();
-                int upperBound = range.y();
+    float compare(const Template &a, const Template &b) const
+    {
+        foreach (const QString &key, filters) {
+            const QString aValue = a.file.get<QString>(key, QString());
+            const QString bValue = queryValue(b, key);
 
-                while (value <= upperBound) {
-                    if (aValue == QString::number(value)) {
-                        keep = true;
-                        break;
-                    }
-                    value++;
-                }
-            }
-            else if (aValue == bValue) keep = true;
+            if (aValue.isEmpty() || bValue.isEmpty()) continue;
 
-            if (!keep) return -std::numeric_limits<float>::max();
+            if (!matches(aValue, bValue)) return -std::numeric_limits<float>::max();
         }
         return 0;
     }
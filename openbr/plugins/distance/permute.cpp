@@ -19,8 +19,6 @@
 
 #include <openbr/plugins/openbr_internal.h>
 
-#include <QtConcurrent>
-
 using namespace std;
 
 namespace br
@@ -29,6 +27,10 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Compares all permutations of matrices from one template to the other, and fuses the scores via the operation specified.
+ *
+ * The n*n scores between matrices are computed once per pair of templates, with one list comparison per matrix of \c b.
+ * Mean and Sum follow in closed form, as every score appears in (n-1)! permutations,
+ * while Max and Min search the permutations depth first, pruning partial permutations that can't beat the best found.
  * \author Scott Klum \cite sklum
  * \note Operation: Mean, sum, min, max are supported.
  */
@@ -51,33 +53,73 @@ private:
         distance->train(src);
     }
 
+    // Best sum (largest, or the negated smallest) assigning a matrix of a to each of the columns [column, n) of b
+    static void search(const QVector<double> &scores, int n, int column, QVector<bool> &used, double partial,
+                       const QVector<double> &remainingBound, double &best)
+    {
+        if (column == n) {
+            best = std::max(best, partial);
+            return;
+        }
+        if (partial + remainingBound[column] <= best)
+            return;
+        for (int i=0; i<n; i++) {
+            if (used[i]) continue;
+            used[i] = true;
+            search(scores, n, column+1, used, partial + scores[i*n+column], remainingBound, best);
+            used[i] = false;
+        }
+    }
+
     float compare(const Template &a, const Template &b) const
     {
-        QList<int> indices;
-        for (int i=0; i<a.size(); i++)
-            indices << i;
-
-        QList<float> scores;
-        do {
-            QList<float> permScores;
-            for (int i=0; i<a.size(); i++)
-                permScores.append(distance->compare(Template(a.file, a[indices[i]]),Template(b.file, b[i])));
-            scores.append(std::accumulate(permScores.begin(),permScores.end(),0.0));
-        } while ( next_permutation(indices.begin(),indices.end()) );
+        const int n = a.size();
+        if (b.size() < n)
+            return -std::numeric_limits<float>::max();
 
+        TemplateList targets;
+        for (int i=0; i<n; i++)
+            targets.append(Template(a.file, a[i]));
+
+        // scores[i*n+j] compares a[i] to b[j]
+        QVector<double> scores(n*n);
+        for (int j=0; j<n; j++) {
+            const QList<float> column = distance->compare(targets, Template(b.file, b[j]));
+            for (int i=0; i<n; i++)
+                scores[i*n+j] = column[i];
+        }
+
+        double permutations = 1;
+        for (int i=2; i<=n; i++)
+            permutations *= i;
+
+        const double total = std::accumulate(scores.begin(), scores.end(), 0.0);
         switch (operation) {
           case Mean:
-            return std::accumulate(scores.begin(),scores.end(),0.0)/(float)scores.size();
-            break;
+            return n > 0 ? total / n : 0;
           case Sum:
-            return std::accumulate(scores.begin(),scores.end(),0.0);
-            break;
+            return n > 0 ? total * permutations / n : 0;
           case Min:
-            return *std::min_element(scores.begin(),scores.end());
-            break;
-          case Max:
-            return *std::max_element(scores.begin(),scores.end());
-            break;
+          case Max: {
+            // Min is the negated Max of the negated scores
+            if (operation == Min)
+                for (int i=0; i<scores.size(); i++)
+                    scores[i] = -scores[i];
+
+            // Optimistic completion of the columns not yet assigned, from the best score in each column
+            QVector<double> remainingBound(n+1, 0);
+            for (int j=n-1; j>=0; j--) {
+                double columnBest = -std::numeric_limits<double>::max();
+                for (int i=0; i<n; i++)
+                    columnBest = std::max(columnBest, scores[i*n+j]);
+                remainingBound[j] = remainingBound[j+1] + columnBest;
+            }
+
+            QVector<bool> used(n, false);
+            double best = -std::numeric_limits<double>::max();
+            search(scores, n, 0, used, 0, remainingBound, best);
+            return operation == Min ? -best : best;
+          }
           default:
             qFatal("Invalid operation.");
         }
@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -29,6 +28,7 @@ namespace br
  * The templates are compared using each br::Distance in order.
  * If the result of the comparison with any given distance is -FLOAT_MAX then this result is returned early.
  * Otherwise the returned result is the value of comparing the templates using the last br::Distance.
+ * br::MaskDistance elements are evaluated for all targets first, so the other distances are only computed for accepted targets.
  */
 class PipeDistance : public ListDistance
 {
@@ -36,10 +36,10 @@ class PipeDistance : public ListDistance
 
     void train(const TemplateList &data)
     {
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         foreach (br::Distance *distance, distances)
-            futures.addFuture(QtConcurrent::run(distance, &Distance::train, data));
-        futures.waitForFinished();
+            tasks.runMember(distance, &Distance::train, data);
+        tasks.wait();
     }
 
     float compare(const Template &a, const Template &b) const
@@ -52,6 +52,11 @@ class PipeDistance : public ListDistance
         }
         return result;
     }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        compareMasked(target, query, output, targetOffset, queryOffset, false);
+    }
 };
 
 BR_REGISTER(Distance, PipeDistance)
@@ -24,7 +24,7 @@ namespace br
  * \brief Sets distance to -FLOAT_MAX if a target template has/doesn't have a key.
  * \author Scott Klum \cite sklum
  */
-class RejectDistance : public UntrainableDistance
+class RejectDistance : public MaskDistance
 {
     Q_OBJECT
 
@@ -33,6 +33,25 @@ class RejectDistance : public UntrainableDistance
     Q_PROPERTY(bool rejectIfContains READ get_rejectIfContains WRITE set_rejectIfContains RESET reset_rejectIfContains STORED false)
     BR_PROPERTY(bool, rejectIfContains, false)
 
+    bool queryDependent() const
+    {
+        return false;
+    }
+
+    QStringList maskKeys() const
+    {
+        return keys;
+    }
+
+    QBitArray mask(const MetadataColumns &targets, const Template &query) const
+    {
+        (void) query;
+        QBitArray accepted(targets.size(), true);
+        foreach (const QString &key, keys)
+            accepted &= rejectIfContains ? ~targets.contains(key) : targets.contains(key);
+        return accepted;
+    }
+
     float compare(const Template &a, const Template &b) const
     {
         // We don't look at the query
@@ -0,0 +1,153 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Pools the scores between every pair of matrices in two multi-matrix templates, such as video tracks.
+ *
+ * Each matrix of the query is compared against all matrices of the target in one call to the child's
+ * br::Distance::compare(const TemplateList &, const Template &), which distances like DistDistance compute as a single
+ * blocked matrix product. Invalid comparisons are ignored.
+ * - \c Mean averages the scores.
+ * - \c Max keeps the best score and \c Min the worst.
+ * - \c Softmax weights each score by its softmax at \c temperature, approaching \c Mean as it grows and \c Max as it shrinks.
+ *
+ * With \c centroids true, \c Mean compares the mean matrix of each template instead, in O(n+m) rather than O(n*m).
+ * This is exact for inner products and a cheap approximation otherwise.
+ */
+class SetDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Pooling)
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(Pooling pooling READ get_pooling WRITE set_pooling RESET reset_pooling STORED false)
+    Q_PROPERTY(float temperature READ get_temperature WRITE set_temperature RESET reset_temperature STORED false)
+    Q_PROPERTY(bool centroids READ get_centroids WRITE set_centroids RESET reset_centroids STORED false)
+
+public:
+    /*!< */
+    enum Pooling { Mean,
+                   Max,
+                   Min,
+                   Softmax };
+
+private:
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(Pooling, pooling, Mean)
+    BR_PROPERTY(float, temperature, 1)
+    BR_PROPERTY(bool, centroids, false)
+
+    bool trainable()
+    {
+        return distance->trainable();
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    // Empty when the matrices differ in size or type
+    static cv::Mat centroid(const Template &t)
+    {
+        cv::Mat sum;
+        foreach (const cv::Mat &m, t) {
+            if (m.size() != t.first().size() || m.type() != t.first().type())
+                return cv::Mat();
+            cv::Mat converted;
+            m.convertTo(converted, CV_32F);
+            if (sum.empty()) sum = converted;
+            else             sum += converted;
+        }
+        cv::Mat result;
+        sum.convertTo(result, t.first().type(), 1.0 / t.size());
+        return result;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return -std::numeric_limits<float>::max();
+
+        if (centroids && (pooling == Mean)) {
+            const cv::Mat ca = centroid(a), cb = centroid(b);
+            if (!ca.empty() && !cb.empty())
+                return distance->compare(ca, cb);
+        }
+
+        TemplateList targets;
+        foreach (const cv::Mat &m, a)
+            targets.append(Template(a.file, m));
+
+        QVector<float> scores;
+        scores.reserve(a.size() * b.size());
+        foreach (const cv::Mat &m, b)
+            foreach (float score, distance->compare(targets, Template(b.file, m)))
+                if (score != -std::numeric_limits<float>::max())
+                    scores.append(score);
+
+        if (scores.isEmpty())
+            return -std::numeric_limits<float>::max();
+        return pool(scores);
+    }
+
+    float pool(const QVector<float> &scores) const
+    {
+        if (pooling == Max)
+            return *std::max_element(scores.begin(), scores.end());
+        if (pooling == Min)
+            return *std::min_element(scores.begin(), scores.end());
+
+        double sum = 0;
+        if (pooling == Mean) {
+            foreach (float score, scores)
+                sum += score;
+            return sum / scores.size();
+        }
+
+        // Shifted by the best score so the exponentials can't overflow
+        const float best = *std::max_element(scores.begin(), scores.end());
+        double weights = 0;
+        foreach (float score, scores) {
+            const double weight = exp((score - best) / temperature);
+            sum += weight * score;
+            weights += weight;
+        }
+        return sum / weights;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+    }
+};
+
+BR_REGISTER(Distance, SetDistance)
+
+} // namespace br
+
+#include "distance/set.moc"
@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -32,10 +31,10 @@ class SumDistance : public ListDistance
 
     void train(const TemplateList &data)
     {
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         foreach (br::Distance *distance, distances)
-            futures.addFuture(QtConcurrent::run(distance, &Distance::train, data));
-        futures.waitForFinished();
+            tasks.runMember(distance, &Distance::train, data);
+        tasks.wait();
     }
 
     float compare(const Template &target, const Template &query) const
@@ -51,6 +50,11 @@ class SumDistance : public ListDistance
 
         return result;
     }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        compareMasked(target, query, output, targetOffset, queryOffset, true);
+    }
 };
 
 BR_REGISTER(Distance, SumDistance)
@@ -25,8 +25,10 @@ class ZScoreDistance : public Distance
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(bool crossModality READ get_crossModality WRITE set_crossModality RESET reset_crossModality STORED false)
+    Q_PROPERTY(qint64 maxPairs READ get_maxPairs WRITE set_maxPairs RESET reset_maxPairs STORED false)
     BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
     BR_PROPERTY(bool, crossModality, false)
+    BR_PROPERTY(qint64, maxPairs, 10000000)
 
     float min, max;
     double mean, stddev;
@@ -35,19 +37,12 @@ class ZScoreDistance : public Distance
     {
         distance->train(src);
 
-        QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(src.size()), FileList(src.size())));
-        distance->compare(src, src, matrixOutput.data());
-
-        QList<float> scores;
-        scores.reserve(src.size()*src.size());
-        for (int i=0; i<src.size(); i++) {
-            for (int j=0; j<i; j++) {
-                const float score = matrixOutput.data()->data.at<float>(i, j);
-                if (score == -std::numeric_limits<float>::max()) continue;
-                if (crossModality && src[i].file.get<QString>("MODALITY") == src[j].file.get<QString>("MODALITY")) continue;
-                scores.append(score);
-            }
-        }
+        // Every template is its own label, so all pairs are sampled alike
+        QList<int> labels;
+        for (int i=0; i<src.size(); i++)
+            labels.append(i);
+        QList<float> genuines, scores;
+        trainingScores(distance, src, labels, crossModality, maxPairs, genuines, scores);
 
         Common::MinMax(scores, &min, &max);
         Common::MeanStdDev(scores, &mean, &stddev);
@@ -14,7 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QRegularExpression>
+#include <QtConcurrent>
+#include <algorithm>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
@@ -34,32 +35,76 @@ class csvFormat : public Format
 {
     Q_OBJECT
 
+    struct Rows
+    {
+        QVector<float> values;
+        QVector<int> widths;
+        bool isUChar;
+    };
+
+    static bool isSeparator(char c)
+    {
+        return (c == '\n') || (c == '\r') || (c == '|');
+    }
+
+    // Parses the lines in [begin, end), words are separated by commas and the spaces around them
+    static Rows parse(const char *begin, const char *end)
+    {
+        Rows rows;
+        rows.isUChar = true;
+        const char *line = begin;
+        while (line < end) {
+            const char *eol = line;
+            while ((eol < end) && !isSeparator(*eol)) eol++;
+
+            int width = 0;
+            const char *word = line;
+            while (word < eol) {
+                const char *comma = std::find(word, eol, ',');
+                const char *wordBegin = word, *wordEnd = comma;
+                while ((wordBegin < wordEnd) && (*wordBegin == ' ')) wordBegin++;
+                while ((wordEnd > wordBegin) && (wordEnd[-1] == ' ')) wordEnd--;
+                if (wordBegin < wordEnd) {
+                    const float val = QByteArray::fromRawData(wordBegin, wordEnd - wordBegin).toFloat();
+                    rows.values.append(val);
+                    rows.isUChar = rows.isUChar && (val == float(uchar(val)));
+                    width++;
+                }
+                word = (comma == eol) ? eol : comma + 1;
+            }
+            if (width > 0)
+                rows.widths.append(width);
+            line = eol + 1;
+        }
+        return rows;
+    }
+
     Template read() const
     {
-        QFile f(file.name);
-        f.open(QFile::ReadOnly);
-        QStringList lines(QString(f.readAll()).split(QRegularExpression("[\n|\r\n|\r]"), QString::SkipEmptyParts));
-        f.close();
+        // Chunks of whole lines are parsed in parallel directly from the mapped file
+        const QtUtils::MappedFile f(file.name);
+        QList< QFuture<Rows> > futures;
+        typedef QPair<qint64,qint64> Chunk;
+        foreach (const Chunk &chunk, f.lineChunks(std::max(1, QThreadPool::globalInstance()->maxThreadCount())))
+            futures.append(QtConcurrent::run(&csvFormat::parse, f.data() + chunk.first, f.data() + chunk.second));
 
         bool isUChar = true;
-        QList< QList<float> > valsList;
-        foreach (const QString &line, lines) {
-            QList<float> vals;
-            foreach (const QString &word, line.split(QRegExp(" *, *"), QString::SkipEmptyParts)) {
-                bool ok;
-                const float val = word.toFloat(&ok);
-                vals.append(val);
-                isUChar = isUChar && (val == float(uchar(val)));
-            }
-            if (!vals.isEmpty())
-                valsList.append(vals);
+        QVector<float> values;
+        QVector<int> widths;
+        foreach (QFuture<Rows> future, futures) {
+            const Rows rows = future.result();
+            values += rows.values;
+            widths += rows.widths;
+            isUChar = isUChar && rows.isUChar;
         }
 
-        Mat m(valsList.size(), valsList[0].size(), CV_32FC1);
-        for (int i=0; i<valsList.size(); i++)
-            for (int j=0; j<valsList[i].size(); j++)
-                m.at<float>(i,j) = valsList[i][j];
+        if (widths.isEmpty())
+            qFatal("%s is empty.", qPrintable(file.name));
+        foreach (int width, widths)
+            if (width != widths.first())
+                qFatal("Rows of %s have different numbers of values.", qPrintable(file.name));
 
+        Mat m = Mat(widths.size(), widths.first(), CV_32FC1, values.data()).clone();
         if (isUChar) m.convertTo(m, CV_8U);
         return Template(m);
     }
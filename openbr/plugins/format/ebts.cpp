@@ -19,6 +19,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -28,176 +29,189 @@ namespace br
 /*!
  * \ingroup formats
  * \brief Reads FBI EBTS transactions.
+ *
+ * The transaction is memory mapped and scanned in place, images are decoded straight from the mapping.
+ * By default the first type 10 (facial) image is read. If \c all is set, every type 10 image is decoded in parallel
+ * into a matrix of its own, follow with br::ExpandTransform to enroll them as separate templates.
  * \author Scott Klum \cite sklum
  * https://www.fbibiospecs.org/ebts.html
  */
 class ebtsFormat : public Format
 {
     Q_OBJECT
+    Q_PROPERTY(bool all READ get_all WRITE set_all RESET reset_all STORED false)
+    BR_PROPERTY(bool, all, false)
 
-    struct Field {
-        int type;
-        QList<QByteArray> data;
+    // Tagged fields are "<record>.<field>:<data>", separated by GS and with the record terminated by FS
+    enum Separator { FS = 0x1C, GS = 0x1D, RS = 0x1E, US = 0x1F };
+
+    // A [begin, end) range of the mapped transaction
+    struct Bytes
+    {
+        const char *begin, *end;
+        Bytes() : begin(NULL), end(NULL) {}
+        Bytes(const char *begin, const char *end) : begin(begin), end(end) {}
+        bool isEmpty() const { return begin == end; }
+        int size() const { return int(end - begin); }
+        const char *find(char c, const char *from) const
+        {
+            if (from >= end) return end;
+            const char *found = (const char*) memchr(from, c, end - from);
+            return found ? found : end;
+        }
+        QString toString() const { return QString::fromLatin1(begin, size()); }
+        int toInt() const
+        {
+            int value = 0;
+            for (const char *c = begin; (c < end) && (*c >= '0') && (*c <= '9'); c++)
+                value = 10*value + (*c - '0');
+            return value;
+        }
     };
 
-    struct Record {
+    struct Record
+    {
         int type;
-        quint32 bytes;
-        int position; // Starting position of record
-
-        QHash<int,QList<QByteArray> > fields;
+        Bytes bytes;
+        QHash<int,Bytes> fields; // Tagged records only
     };
 
-    quint32 recordBytes(const QByteArray &byteArray, const float recordType, int from) const
+    static qint64 recordBytes(const Bytes &data, int type)
     {
-        bool ok;
-        quint32 size;
-
-        if (recordType == 4 || recordType == 7) {
-            // read first four bytes
-            ok = true;
-            size = qFromBigEndian<quint32>((const uchar*)byteArray.mid(from,4).constData());
-        } else {
-            int index = byteArray.indexOf(QChar(0x1D), from);
-            size = byteArray.mid(from, index-from).split(':').last().toInt(&ok);
+        if ((type == 4) || (type == 7)) {
+            // Binary records begin with their length as four big-endian bytes
+            if (data.size() < 4) return -1;
+            return qFromBigEndian<quint32>((const uchar*)data.begin);
         }
 
-        return ok ? size : -1;
+        // The first field of a tagged record is its length
+        const char *colon = data.find(':', data.begin);
+        const char *separator = data.find(GS, colon);
+        if (colon == data.end) return -1;
+        return Bytes(colon+1, separator).toInt();
     }
 
-    void parseRecord(const QByteArray &byteArray, Record &record) const
+    static void parseFields(Record &record)
     {
-        if (record.type == 4 || record.type == 7) {
-            // Just a binary blob
-            // Read everything after the first four bytes
-            // Not current supported
-        } else {
-            // Continue reading fields until we get all the data
-            unsigned int position = record.position;
-            while (position < record.position + record.bytes) {
-                int index = byteArray.indexOf(QChar(0x1D), position);
-                Field field = parseField(byteArray.mid(position, index-position),QChar(0x1F));
-                if (field.type == 999 ) {
-                    // Data begin after the field identifier and the colon
-                    int dataBegin = byteArray.indexOf(':', position)+1;
-                    field.data.clear();
-                    field.data.append(byteArray.mid(dataBegin, record.bytes-(dataBegin-record.position)));
-
-                    // Data fields are always last in the record
-                    record.fields.insert(field.type,field.data);
-                    break;
-                }
-                // Advance the position accounting for the separator
-                position += index-position+1;
-                record.fields.insert(field.type,field.data);
-            }
+        if ((record.type == 4) || (record.type == 7))
+            return; // Binary blobs aren't currently supported
+
+        const Bytes &bytes = record.bytes;
+        const char *position = bytes.begin;
+        while (position < bytes.end) {
+            const char *colon = bytes.find(':', position);
+            if (colon == bytes.end) break;
+            const char *dot = Bytes(position, colon).find('.', position);
+            const int tag = Bytes((dot == colon) ? position : dot+1, colon).toInt();
+
+            // Image data may contain separators, it runs to the end of the record
+            const char *end = (tag == 999) ? bytes.end : bytes.find(GS, colon);
+            const char *dataEnd = ((end > colon+1) && (end[-1] == FS)) ? end-1 : end;
+            record.fields.insert(tag, Bytes(colon+1, dataEnd));
+            if (tag == 999) break;
+            position = end + 1;
         }
     }
 
-    Field parseField(const QByteArray &byteArray, const QChar &sep) const
+    static QList<Bytes> split(const Bytes &bytes, char separator)
     {
-        bool ok;
-        Field f;
-
-        QList<QByteArray> data = byteArray.split(':');
-
-        f.type = data.first().split('.').last().toInt(&ok);
-        f.data = data.last().split(sep.toLatin1());
+        QList<Bytes> items;
+        const char *position = bytes.begin;
+        while (true) {
+            const char *end = bytes.find(separator, position);
+            items.append(Bytes(position, end));
+            if (end == bytes.end) break;
+            position = end + 1;
+        }
+        return items;
+    }
 
-        return f;
+    static void decode(const Bytes *image, Mat *dst)
+    {
+        *dst = imdecode(Mat(1, image->size(), CV_8UC1, (void*) image->begin), CV_LOAD_IMAGE_COLOR);
     }
 
     Template read() const
     {
-        QByteArray byteArray;
-        QtUtils::readFile(file, byteArray);
+        const QtUtils::MappedFile mapped(file.name);
+        const Bytes transaction(mapped.data(), mapped.data() + mapped.size());
 
         Template t;
 
-        Mat m;
-
-        QList<Record> records;
-
-        // Read the type one record (every EBTS file will have one of these)
+        // Every transaction begins with a type 1 record, its third field lists the remaining records
         Record r1;
         r1.type = 1;
-        r1.position = 0;
-        r1.bytes = recordBytes(byteArray,r1.type,r1.position);
-
-        // The fields in a type 1 record are strictly defined
-        QList<QByteArray> data = byteArray.mid(r1.position,r1.bytes).split(QChar(0x1D).toLatin1());
-        foreach (const QByteArray &datum, data) {
-            Field f = parseField(datum,QChar(0x1F));
-            r1.fields.insert(f.type,f.data);
+        r1.bytes = Bytes(transaction.begin, transaction.begin + std::max(qint64(0), std::min(qint64(transaction.size()), recordBytes(transaction, 1))));
+        parseFields(r1);
+
+        // Subfields are separated by RS, each after the first is "<type> US <IDC>"
+        QList<Record> records;
+        const QList<Bytes> contents = split(r1.fields.value(3), RS);
+        const char *position = r1.bytes.end;
+        for (int i=1; (i<contents.size()) && (position < transaction.end); i++) {
+            Record r;
+            r.type = Bytes(contents[i].begin, contents[i].find(US, contents[i].begin)).toInt();
+            const qint64 bytes = recordBytes(Bytes(position, transaction.end), r.type);
+            if (bytes <= 0) {
+                qWarning("ebtsFormat::read invalid record length in %s.", qPrintable(file.name));
+                break;
+            }
+            r.bytes = Bytes(position, position + std::min(bytes, qint64(transaction.end - position)));
+            parseFields(r);
+            records.append(r);
+            position = r.bytes.end;
         }
 
-        records.append(r1);
+        // Demographics come from the type 2 record
+        foreach (const Record &r2, records) {
+            if (r2.type != 2)
+                continue;
 
-        // Read the type two record (every EBTS file will have one of these)
-        Record r2;
-        r2.type = 2;
-        r2.position = r1.bytes;
-        r2.bytes = recordBytes(byteArray,r2.type,r2.position);
+            if (r2.fields.contains(18)) {
+                const QStringList names = r2.fields.value(18).toString().split(',');
+                if (names.size() > 1) t.file.set("FIRSTNAME", names.at(1));
+                t.file.set("LASTNAME", names.at(0));
+            }
 
-        // The fields in a type 2 record are strictly defined
-        data = byteArray.mid(r2.position,r2.bytes).split(QChar(0x1D).toLatin1());
-        foreach (const QByteArray &datum, data) {
-            Field f = parseField(datum,QChar(0x1F));
-            r2.fields.insert(f.type,f.data);
-        }
+            if (r2.fields.contains(22)) t.file.set("DOB", r2.fields.value(22).toInt());
+            if (r2.fields.contains(24)) t.file.set("GENDER", r2.fields.value(24).toString());
+            if (r2.fields.contains(25)) t.file.set("RACE", r2.fields.value(25).toString());
 
-        // Demographics
-        if (r2.fields.contains(18)) {
-            QString name = r2.fields.value(18).first();
-            QStringList names = name.split(',');
-            t.file.set("FIRSTNAME", names.at(1));
-            t.file.set("LASTNAME", names.at(0));
+            if (t.file.contains("DOB")) {
+                const QDate dob = QDate::fromString(t.file.get<QString>("DOB"), "yyyyMMdd");
+                const QDate current = QDate::currentDate();
+                int age = current.year() - dob.year();
+                if (current.month() < dob.month()) age--;
+                t.file.set("Age", age);
+            }
+            break;
         }
 
-        if (r2.fields.contains(22)) t.file.set("DOB", r2.fields.value(22).first().toInt());
-        if (r2.fields.contains(24)) t.file.set("GENDER", QString(r2.fields.value(24).first()));
-        if (r2.fields.contains(25)) t.file.set("RACE", QString(r2.fields.value(25).first()));
+        QList<Bytes> images;
+        foreach (const Record &r, records)
+            if ((r.type == 10) && r.fields.contains(999)) {
+                images.append(r.fields.value(999));
+                if (!all) break; // The first type 10 record is the frontal
+            }
 
-        if (t.file.contains("DOB")) {
-            const QDate dob = QDate::fromString(t.file.get<QString>("DOB"), "yyyyMMdd");
-            const QDate current = QDate::currentDate();
-            int age = current.year() - dob.year();
-            if (current.month() < dob.month()) age--;
-            t.file.set("Age", age);
+        if (images.isEmpty()) {
+            qWarning("ebtsFormat::cannot find image data within file.");
+            return t;
         }
 
-        records.append(r2);
-
-        // The third field of the first record contains informations about all the remaining records in the transaction
-        // We don't care about the first two and the final items
-        QList<QByteArray> recordTypes = r1.fields.value(3);
-        for (int i=2; i<recordTypes.size()-1; i++) {
-            // The first two bytes indicate the record index (and we don't want the separator), but we only care about the type
-            QByteArray recordType = recordTypes[i].mid(3);
-            Record r;
-            r.type = recordType.toInt();
-            records.append(r);
+        QVector<Mat> decoded(images.size());
+        {
+            TaskGroup group;
+            for (int i=1; i<images.size(); i++)
+                group.run(decode, &images[i], &decoded[i]);
+            decode(&images[0], &decoded[0]);
         }
 
-        QList<int> frontalIdxs;
-        int position = r1.bytes + r2.bytes;
-        for (int i=2; i<records.size(); i++) {
-            records[i].position = position;
-            records[i].bytes = recordBytes(byteArray,records[i].type,position);
-
-            parseRecord(byteArray, records[i]);
-            if (records[i].type == 10) frontalIdxs.append(i);
-            position += records[i].bytes;
+        for (int i=0; i<decoded.size(); i++) {
+            if (!decoded[i].data) qWarning("ebtsFormat::read failed to decode image data.");
+            t.append(decoded[i]);
         }
 
-        if (!frontalIdxs.isEmpty()) {
-            // We use the first type 10 record to get the frontal
-            QByteArray frontal = records[frontalIdxs.first()].fields.value(999).first();
-            m = imdecode(Mat(3, frontal.size(), CV_8UC3, frontal.data()), CV_LOAD_IMAGE_COLOR);
-            if (!m.data) qWarning("ebtsFormat::read failed to decode image data.");
-            t.m() = m;
-        } else qWarning("ebtsFormat::cannot find image data within file.");
-
         return t;
     }
 
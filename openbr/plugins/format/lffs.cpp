@@ -33,9 +33,14 @@ class lffsFormat : public Format
 
     Template read() const
     {
-        QByteArray byteArray;
-        QtUtils::readFile(file.name, byteArray);
-        return Mat(1, byteArray.size(), CV_8UC1, byteArray.data()).clone();
+        // Read straight into the matrix rather than through an intermediate buffer
+        QFile f(file.name);
+        if (!f.open(QFile::ReadOnly))
+            qFatal("Unable to open %s for reading.", qPrintable(file.name));
+        Mat m(1, int(f.size()), CV_8UC1);
+        if (f.read((char*) m.data, f.size()) != f.size())
+            qFatal("Failed to read %s.", qPrintable(file.name));
+        return m;
     }
 
     void write(const Template &t) const
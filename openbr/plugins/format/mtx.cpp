@@ -58,6 +58,39 @@ class maskFormat : public mtxFormat
 
 BR_REGISTER(Format, maskFormat)
 
+/*!
+ * \ingroup formats
+ * \brief Reads a sparse similarity matrix written by br::smtxOutput as a dense matrix.
+ */
+class smtxFormat : public mtxFormat
+{
+    Q_OBJECT
+
+    void write(const Template &t) const
+    {
+        const cv::Mat &m = t;
+        if (m.type() != CV_32FC1)
+            qFatal("Sparse matrices can only contain single channel float scores.");
+
+        BEE::SparseMatrix sparse;
+        sparse.rows = m.rows;
+        sparse.cols = m.cols;
+        sparse.rowPointers.append(0);
+        for (int i=0; i<m.rows; i++) {
+            const float *scores = m.ptr<float>(i);
+            for (int j=0; j<m.cols; j++) {
+                if (scores[j] == -std::numeric_limits<float>::max()) continue;
+                sparse.columns.append(j);
+                sparse.values.append(scores[j]);
+            }
+            sparse.rowPointers.append(sparse.values.size());
+        }
+        BEE::writeSparseMatrix(sparse, file);
+    }
+};
+
+BR_REGISTER(Format, smtxFormat)
+
 } // namespace br
 
 #include "format/mtx.moc"
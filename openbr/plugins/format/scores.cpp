@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+#include <algorithm>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 #include <openbr/core/opencvutils.h>
@@ -45,24 +48,57 @@ class scoresFormat : public Format
     BR_PROPERTY(bool, groundTruth, false)
     BR_PROPERTY(QString, delimiter, "\t")
 
-    Template read() const
+    static bool isSpace(char c)
     {
-        QFile f(file.name);
-        if (!f.open(QFile::ReadOnly | QFile::Text))
-            qFatal("Failed to open %s for reading.", qPrintable(f.fileName()));
-        QList<float> values;
-        while (!f.atEnd()) {
-            const QStringList words = QString(f.readLine()).split(delimiter);
-            if (words.size() <= column) qFatal("Expected file to have at least %d columns.", column+1);
-            const QString &word = words[column];
+        return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+    }
+
+    // Parses the lines in [begin, end), each ending with a newline or at end
+    static QVector<float> parse(const char *begin, const char *end, const QByteArray &delimiter, int column)
+    {
+        QVector<float> values;
+        const char *line = begin;
+        while (line < end) {
+            const char *eol = (const char*) memchr(line, '\n', end - line);
+            if (!eol) eol = end;
+
+            const char *word = line;
+            for (int i=0; i<column; i++) {
+                const char *next = std::search(word, eol, delimiter.constBegin(), delimiter.constEnd());
+                if (next == eol) qFatal("Expected file to have at least %d columns.", column+1);
+                word = next + delimiter.size();
+            }
+            const char *wordEnd = std::search(word, eol, delimiter.constBegin(), delimiter.constEnd());
+            while ((word < wordEnd) && isSpace(*word)) word++;
+            while ((wordEnd > word) && isSpace(wordEnd[-1])) wordEnd--;
+
+            const QByteArray text = QByteArray::fromRawData(word, wordEnd - word);
             bool ok;
-            float value = word.toFloat(&ok);
-            if (!ok) value = (QtUtils::toBool(word) ? BEE::Match : BEE::NonMatch);
+            float value = text.toFloat(&ok);
+            if (!ok) value = (QtUtils::toBool(QString::fromUtf8(text)) ? BEE::Match : BEE::NonMatch);
             values.append(value);
+            line = eol + 1;
         }
+        return values;
+    }
+
+    Template read() const
+    {
+        // Chunks of whole lines are parsed in parallel directly from the mapped file
+        const QtUtils::MappedFile f(file.name);
+        const QByteArray delimiterBytes = delimiter.toUtf8();
+        QList< QFuture< QVector<float> > > futures;
+        typedef QPair<qint64,qint64> Chunk;
+        foreach (const Chunk &chunk, f.lineChunks(std::max(1, QThreadPool::globalInstance()->maxThreadCount())))
+            futures.append(QtConcurrent::run(&scoresFormat::parse, f.data() + chunk.first, f.data() + chunk.second, delimiterBytes, column));
+
+        QVector<float> values;
+        foreach (QFuture< QVector<float> > future, futures)
+            values += future.result();
+
         if (values.size() == 1)
             qWarning("Only one value read, double check file line endings.");
-        Mat result = OpenCVUtils::toMat(values);
+        Mat result = Mat(values.size(), 1, CV_32FC1, values.data()).clone();
         if (groundTruth) result.convertTo(result, CV_8U);
         return result;
     }
@@ -14,10 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtNetwork>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/downloader.h>
 
 using namespace cv;
 
@@ -37,16 +37,11 @@ class urlFormat : public Format
     {
         Template t;
 
-        QNetworkAccessManager networkAccessManager;
-        QNetworkRequest request(QString(file.name).remove(".url"));
-        request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork);
-        QNetworkReply *reply = networkAccessManager.get(request);
-
-        while (!reply->isFinished()) QCoreApplication::processEvents();
-        if (reply->error()) qWarning("%s (%s)", qPrintable(reply->errorString()), qPrintable(QString::number(reply->error())));
-
-        QByteArray data = reply->readAll();
-        delete reply;
+        // Shares the process wide connections of br::DownloadBatch rather than connecting anew for every image
+        QByteArray data;
+        QString error;
+        DownloadBatch(QList<QUrl>() << QUrl(QString(file.name).remove(".url"))).next(data, error);
+        if (!error.isEmpty()) qWarning("%s", qPrintable(error));
 
         Mat m = imdecode(Mat(1, data.size(), CV_8UC1, data.data()), 1);
         if (m.data) t.append(m);
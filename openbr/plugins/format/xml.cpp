@@ -14,9 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#ifndef BR_EMBEDDED
-#include <QtXml>
-#endif // BR_EMBEDDED
+#include <QXmlStreamReader>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -41,42 +39,36 @@ class xmlFormat : public Format
     {
         Template t;
 
-#ifndef BR_EMBEDDED
         QString fileName = file.get<QString>("path") + file.name;
 
-        QDomDocument doc(fileName);
         QFile f(fileName);
-
         if (!f.open(QIODevice::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(file.flat()));
-        if (!doc.setContent(&f)) qWarning("Unable to parse %s.", qPrintable(file.flat()));
-        f.close();
-
-        QDomElement docElem = doc.documentElement();
-        QDomNode subject = docElem.firstChild();
-        while (!subject.isNull()) {
-            QDomNode fileNode = subject.firstChild();
 
-            while (!fileNode.isNull()) {
-                QDomElement e = fileNode.toElement();
-
-                if (e.tagName() == "FORMAL_IMG") {
-                    QByteArray byteArray = QByteArray::fromBase64(qPrintable(e.text()));
-                    Mat m = imdecode(Mat(3, byteArray.size(), CV_8UC3, byteArray.data()), CV_LOAD_IMAGE_COLOR);
-                    if (!m.data) qWarning("xmlFormat::read failed to decode image data.");
-                    t.append(m);
-                } else if ((e.tagName() == "RELEASE_IMG") ||
-                           (e.tagName() == "PREBOOK_IMG") ||
-                           (e.tagName() == "LPROFILE") ||
-                           (e.tagName() == "RPROFILE")) {
-                    // Ignore these other image fields for now
-                } else {
-                    t.file.set(e.tagName(), e.text());
+        // Fields are the grandchildren of the root element
+        QXmlStreamReader xml(&f);
+        if (xml.readNextStartElement()) {
+            while (xml.readNextStartElement()) {
+                while (xml.readNextStartElement()) {
+                    const QString tagName = xml.name().toString();
+                    if (tagName == "FORMAL_IMG") {
+                        QByteArray byteArray = QByteArray::fromBase64(xml.readElementText(QXmlStreamReader::IncludeChildElements).toLatin1());
+                        Mat m = imdecode(Mat(3, byteArray.size(), CV_8UC3, byteArray.data()), CV_LOAD_IMAGE_COLOR);
+                        if (!m.data) qWarning("xmlFormat::read failed to decode image data.");
+                        t.append(m);
+                    } else if ((tagName == "RELEASE_IMG") ||
+                               (tagName == "PREBOOK_IMG") ||
+                               (tagName == "LPROFILE") ||
+                               (tagName == "RPROFILE")) {
+                        // Ignore these other image fields for now
+                        xml.skipCurrentElement();
+                    } else {
+                        t.file.set(tagName, xml.readElementText(QXmlStreamReader::IncludeChildElements));
+                    }
                 }
-
-                fileNode = fileNode.nextSibling();
             }
-            subject = subject.nextSibling();
         }
+        if (xml.hasError()) qWarning("Unable to parse %s.", qPrintable(file.flat()));
+        f.close();
 
         // Calculate age
         if (t.file.contains("DOB")) {
@@ -86,7 +78,6 @@ class xmlFormat : public Format
             if (current.month() < dob.month()) age--;
             t.file.set("Age", age);
         }
-#endif // BR_EMBEDDED
 
         return t;
     }
@@ -14,8 +14,6 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QJsonObject>
-#include <QJsonParseError>
 #include <QUrl>
 
 #ifdef _WIN32
@@ -24,18 +22,109 @@
 #endif // _WIN32
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/jsonutils.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/templatecodec.h>
 #include <openbr/universal_template.h>
 
 namespace br
 {
 
+/*!
+ * \brief Base class for galleries serialized as a sequence of variable length records.
+ *
+ * If the gallery is written with the \c index metadata key, a sidecar <tt>.idx</tt> file of template byte offsets is also written.
+ * Reading \c index galleries without a sidecar builds one.
+ * When a valid sidecar is present the gallery supports seek(), totalSize() and position() are measured in templates,
+ * and the \c shards and \c shard metadata keys restrict reading to one of \c shards disjoint ranges of templates.
+ */
 class BinaryGallery : public Gallery
 {
     Q_OBJECT
 
+    QVector<qint64> offsets; // Byte offset of each template
+    bool indexed;            // Offsets are valid for random access reads
+    qint64 current, begin, end; // Template indices
+
+    QString indexFileName() const
+    {
+        return file.name + ".idx";
+    }
+
+    // Index layout: quint64 gallery size in bytes, followed by one qint64 offset per template
+    bool loadIndex()
+    {
+        QFile index(indexFileName());
+        if (!index.open(QFile::ReadOnly))
+            return false;
+        const QByteArray data = index.readAll();
+        if ((data.size() < int(sizeof(quint64))) || ((data.size() - sizeof(quint64)) % sizeof(qint64) != 0))
+            return false;
+        const quint64 gallerySize = *reinterpret_cast<const quint64*>(data.data());
+        if (gallerySize != quint64(QFileInfo(file.name).size()))
+            return false;
+        const int count = (data.size() - sizeof(quint64)) / sizeof(qint64);
+        offsets.resize(count);
+        memcpy(offsets.data(), data.data() + sizeof(quint64), count * sizeof(qint64));
+        return true;
+    }
+
+    void storeIndex()
+    {
+        QFile index(indexFileName());
+        if (!index.open(QFile::WriteOnly))
+            qFatal("Can't open gallery index: %s for writing", qPrintable(index.fileName()));
+        const quint64 gallerySize = QFileInfo(file.name).size();
+        index.write((const char*) &gallerySize, sizeof(quint64));
+        index.write((const char*) offsets.data(), offsets.size() * sizeof(qint64));
+    }
+
+    // Scan the gallery once to recover template offsets
+    void buildIndex()
+    {
+        offsets.clear();
+        gallery.seek(0);
+        while (!gallery.atEnd()) {
+            const qint64 offset = gallery.pos();
+            const Template t = readTemplate();
+            if (!t.isEmpty() || !t.file.isNull())
+                offsets.append(offset);
+        }
+        storeIndex();
+    }
+
+    // Truncate a template left incomplete by an interrupted writer, so a resumed enrollment appends after the last complete one
+    void recover()
+    {
+        gallery.setFileName(file);
+        if (!gallery.open(QFile::ReadOnly))
+            return;
+        stream.setDevice(&gallery);
+        qint64 complete = 0;
+        while (!gallery.atEnd()) {
+            readTemplate();
+            if (stream.status() != QDataStream::Ok)
+                break;
+            complete = gallery.pos();
+        }
+        const qint64 size = gallery.size();
+        gallery.close();
+        stream.resetStatus();
+
+        if (complete < size) {
+            qWarning("Removing %lld bytes of an incomplete template from %s.", size - complete, qPrintable(file.name));
+            if (!QFile::resize(file.name, complete))
+                qFatal("Unable to truncate %s.", qPrintable(file.name));
+            QFile::remove(indexFileName());
+        }
+    }
+
+protected:
     void init()
     {
+        indexed = false;
+        current = begin = end = 0;
+
         const QString baseName = file.baseName();
 
         if (baseName == "stdin") {
@@ -67,17 +156,36 @@ class BinaryGallery : public Gallery
         stream.setDevice(&gallery);
     }
 
+private:
     void readOpen()
     {
         if (!gallery.isOpen()) {
             gallery.setFileName(file);
             if (!gallery.exists())
                 qFatal("File %s does not exist", qPrintable(gallery.fileName()));
+            if (file.getBool("resume"))
+                recover();
 
             QFile::OpenMode mode = QFile::ReadOnly;
             if (!gallery.open(mode))
                 qFatal("Can't open gallery: %s for reading", qPrintable(gallery.fileName()));
             stream.setDevice(&gallery);
+
+            indexed = loadIndex();
+            if (!indexed && file.getBool("index")) {
+                buildIndex();
+                indexed = true;
+            }
+
+            if (indexed) {
+                const int shards = std::max(1, file.get<int>("shards", 1));
+                const int shard = file.get<int>("shard", 0);
+                if ((shard < 0) || (shard >= shards))
+                    qFatal("Invalid shard %d of %d.", shard, shards);
+                begin = offsets.size() * qint64(shard) / shards;
+                end = offsets.size() * qint64(shard+1) / shards;
+                seek(begin);
+            }
         }
     }
 
@@ -93,9 +201,18 @@ class BinaryGallery : public Gallery
             QFile::OpenMode mode = QFile::WriteOnly;
 
             // Do we append?
-            if (file.get<bool>("append"))
+            if (file.get<bool>("append")) {
                 mode |= QFile::Append;
 
+                // Recover the offsets of the existing templates
+                if (file.getBool("index") && gallery.exists()) {
+                    if (!loadIndex()) {
+                        readOpen(); // Builds the index
+                        gallery.close();
+                    }
+                }
+            }
+
             if (!gallery.open(mode))
                 qFatal("Can't open gallery: %s for writing", qPrintable(gallery.fileName()));
             stream.setDevice(&gallery);
@@ -105,6 +222,22 @@ class BinaryGallery : public Gallery
     TemplateList readBlock(bool *done)
     {
         readOpen();
+
+        if (indexed) {
+            if (current >= end)
+                seek(begin);
+
+            TemplateList templates;
+            while ((templates.size() < readBlockSize) && (current < end)) {
+                templates.append(readTemplate());
+                current++;
+                templates.last().file.set("progress", position());
+            }
+
+            *done = current >= end;
+            return templates;
+        }
+
         if (gallery.atEnd())
             gallery.seek(0);
 
@@ -128,24 +261,48 @@ class BinaryGallery : public Gallery
     void write(const Template &t)
     {
         writeOpen();
-        writeTemplate(t);
+        if (file.getBool("index") && !gallery.isSequential()) {
+            const qint64 offset = gallery.pos();
+            writeTemplate(t);
+            if (gallery.pos() != offset)
+                offsets.append(offset);
+        } else {
+            writeTemplate(t);
+        }
         if (gallery.isSequential())
             gallery.flush();
     }
 
+    bool seek(qint64 index)
+    {
+        readOpen();
+        if (!indexed || (index < 0) || (index > offsets.size()))
+            return false;
+        current = index;
+        return gallery.seek((index == offsets.size()) ? gallery.size() : offsets[index]);
+    }
+
 protected:
     QFile gallery;
     QDataStream stream;
 
+    ~BinaryGallery()
+    {
+        const bool writing = gallery.isOpen() && gallery.isWritable() && !gallery.isSequential();
+        gallery.close();
+        if (writing && file.getBool("index"))
+            storeIndex();
+    }
+
     qint64 totalSize()
     {
         readOpen();
-        return gallery.size();
+        return indexed ? end - begin : gallery.size();
     }
 
     qint64 position()
     {
-        return gallery.pos();
+        return indexed ? current - begin : gallery.pos();
     }
 
     virtual Template readTemplate() = 0;
@@ -157,17 +314,84 @@ protected:
  * \brief A binary gallery.
  *
  * Designed to be a literal translation of templates to disk.
- * Compatible with TemplateList::fromBuffer.
+ * New galleries are written with br::TemplateCodec, set \c legacy to write the QDataStream serialization of older versions.
+ * Both are readable by TemplateList::fromBuffer, and appending to an existing gallery continues in its format.
  * \author Josh Klontz \cite jklontz
  */
 class galGallery : public BinaryGallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool legacy READ get_legacy WRITE set_legacy RESET reset_legacy STORED false)
+    BR_PROPERTY(bool, legacy, false)
+
+    enum Format { Unknown, Legacy, Compact };
+    Format format;
+    TemplateCodec::Encoder encoder;
+    TemplateCodec::Decoder decoder;
+    qint64 defined; // Byte offset up to which the decoder has read the dictionary
+    bool started;   // The header of a sequential gallery has been read
+
+    void init()
+    {
+        BinaryGallery::init();
+        format = Unknown;
+        defined = TemplateCodec::HeaderSize;
+        started = false;
+    }
+
+    // Legacy galleries start with the quint32 matrix count of their first template, which can't match the codec header
+    Format detect()
+    {
+        if (gallery.isSequential())
+            return TemplateCodec::isHeader(gallery.peek(TemplateCodec::HeaderSize)) ? Compact : Legacy;
+        QFile existing(gallery.fileName());
+        if (!existing.open(QFile::ReadOnly) || (existing.size() == 0))
+            return Unknown;
+        return TemplateCodec::isHeader(existing.read(TemplateCodec::HeaderSize)) ? Compact : Legacy;
+    }
 
     Template readTemplate()
     {
+        if (format == Unknown)
+            format = detect();
+
         Template t;
-        stream >> t;
+        if (format != Compact) {
+            stream >> t;
+            return t;
+        }
+
+        if (gallery.isSequential()) {
+            if (!started) {
+                gallery.read(TemplateCodec::HeaderSize);
+                started = true;
+            }
+        } else {
+            qint64 pos = gallery.pos();
+            if (pos < TemplateCodec::HeaderSize) {
+                pos = TemplateCodec::HeaderSize;
+                gallery.seek(pos);
+            }
+
+            // After seeking past records that haven't been read, collect their dictionary entries
+            if (pos > defined) {
+                gallery.seek(defined);
+                while ((gallery.pos() < pos) && decoder.define(&gallery))
+                    defined = gallery.pos();
+                gallery.seek(pos);
+            }
+        }
+
+        const qint64 start = gallery.pos();
+        if (!decoder.read(&gallery, t)) {
+            // A truncated template is left for recover()
+            if (!gallery.atEnd())
+                qFatal("Corrupt template at byte %lld of %s.", start, qPrintable(file.name));
+            stream.setStatus(QDataStream::ReadPastEnd);
+            return Template();
+        }
+        if (!gallery.isSequential() && (start <= defined))
+            defined = std::max(defined, gallery.pos());
         return t;
     }
 
@@ -175,7 +399,27 @@ class galGallery : public BinaryGallery
     {
         if (t.isEmpty() && t.file.isNull())
             return;
-        else if (t.file.fte) {
+
+        if (format == Unknown) {
+            // Appending, continue the existing dictionary
+            format = gallery.isSequential() ? Unknown : detect();
+            if (format == Compact) {
+                QFile existing(gallery.fileName());
+                existing.open(QFile::ReadOnly);
+                existing.seek(TemplateCodec::HeaderSize);
+                while (!existing.atEnd())
+                    if (!decoder.define(&existing))
+                        qFatal("Can't append to %s, it ends with an incomplete template.", qPrintable(file.name));
+                encoder.resume(decoder);
+            } else if (format == Unknown) {
+                format = legacy ? Legacy : Compact;
+                if (format == Compact)
+                    gallery.write(TemplateCodec::header());
+            }
+        }
+
+        Template dst = t;
+        if (t.file.fte) {
              // Only write metadata for failure to enroll, but remove any stored QVariants of type cv::Mat
             File f = t.file;
             QVariantMap metadata = f.localMetadata();
@@ -185,10 +429,11 @@ class galGallery : public BinaryGallery
                 if (strcmp(i.value().typeName(),"cv::Mat") == 0)
                     f.remove(i.key());
             }
-            stream << Template(f);
+            dst = Template(f);
         }
-        else
-            stream << t;
+
+        if (format == Compact) encoder.write(&gallery, dst);
+        else                   stream << dst;
     }
 };
 
@@ -197,14 +442,51 @@ BR_REGISTER(Gallery, galGallery)
 /*!
  * \ingroup galleries
  * \brief A contiguous array of br_universal_template.
+ *
+ * Files are memory mapped and decoded in place. Set \c dropMetadata to skip decoding everything but the feature vector and \c Label.
  * \author Josh Klontz \cite jklontz
  */
 class utGallery : public BinaryGallery
 {
     Q_OBJECT
 
+    uchar *mapped;
+    qint64 mappedSize;
+    int dropMetadata; // -1 until read from the file
+
+public:
+    utGallery() : mapped(NULL), mappedSize(0), dropMetadata(-1) {}
+
+private:
     Template readTemplate()
     {
+        if (dropMetadata == -1)
+            dropMetadata = file.getBool("dropMetadata") ? 1 : 0;
+
+        if (!gallery.isSequential()) {
+            const qint64 offset = gallery.pos();
+            const qint64 header = sizeof(br_universal_template);
+            remap(offset + header);
+
+            if (mapped && (offset + header <= mappedSize)) {
+                const br_universal_template *ut = reinterpret_cast<const br_universal_template*>(mapped + offset);
+                const qint64 bytes = header + ut->urlSize + ut->fvSize;
+                if (remap(offset + bytes)) {
+                    ut = reinterpret_cast<const br_universal_template*>(mapped + offset); // The mapping may have moved
+                    gallery.seek(offset + bytes);
+                    return decode(*ut, reinterpret_cast<const char*>(ut->data));
+                }
+                if (mapped)
+                    qFatal("Unexepected EOF while reading universal template data, needed: %d more of: %d bytes.", int(offset + bytes - mappedSize), int(bytes - header));
+            } else if (mapped) {
+                if (offset != mappedSize)
+                    qWarning("Failed to read universal template header!");
+                close();
+                return Template();
+            }
+            // Otherwise the file couldn't be mapped and is read below
+        }
+
         Template t;
         br_universal_template ut;
         if (gallery.read((char*)&ut, sizeof(br_universal_template)) == sizeof(br_universal_template)) {
@@ -220,72 +502,98 @@ class utGallery : public BinaryGallery
                 bytesNeeded -= bytesRead;
                 dst += bytesRead;
             }
+            t = decode(ut, data.data());
+        } else {
+            if (!gallery.atEnd())
+                qWarning("Failed to read universal template header!");
+            close();
+        }
+        return t;
+    }
 
+    void close()
+    {
+        gallery.close();
+        mapped = NULL;
+        mappedSize = 0;
+    }
+
+    // Maps the file again if it grew since it was mapped and end lies beyond the mapping, returns true if end is mapped
+    bool remap(qint64 end)
+    {
+        if ((end > mappedSize) && (gallery.size() > mappedSize)) {
+            if (mapped) gallery.unmap(mapped);
+            mapped = gallery.map(0, gallery.size());
+            mappedSize = mapped ? gallery.size() : 0;
+        }
+        return mapped && (end <= mappedSize);
+    }
+
+    // The feature vector is copied once, directly from data into the template's matrix
+    Template decode(const br_universal_template &ut, const char *data) const
+    {
+        Template t;
+        if (!dropMetadata) {
             t.file.set("ImageID", QVariant(QByteArray((const char*)ut.imageID, 16).toHex()));
             t.file.set("AlgorithmID", ut.algorithmID);
-            t.file.set("URL", QString(data.data()));
-            char *dataStart = data.data() + ut.urlSize;
-            uint32_t dataSize = ut.fvSize;
-            if ((ut.algorithmID <= -1) && (ut.algorithmID >= -3)) {
-                t.file.set("FrontalFace", QRectF(ut.x, ut.y, ut.width, ut.height));
-                uint32_t *rightEyeX = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                uint32_t *rightEyeY = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                uint32_t *leftEyeX = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                uint32_t *leftEyeY = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                dataSize -= sizeof(uint32_t)*4;
-                t.file.set("First_Eye", QPointF(*rightEyeX, *rightEyeY));
-                t.file.set("Second_Eye", QPointF(*leftEyeX, *leftEyeY));
-            }
-            else if (ut.algorithmID == 7) {
-                // binary data consisting of a single channel matrix, of a supported type.
-                // 4 element header:
-                // uint16 datatype (single channel opencv datatype code)
-                // uint32 matrix rows
-                // uint32 matrix cols
-                // uint16 matrix depth (max 512)
-                // Followed by serialized data, in row-major order (in r/c), with depth values
-                // for each layer listed in order (i.e. rgb, rgb etc.)
-                // #### NOTE! matlab's default order is col-major, so some work should
-                // be done on the matlab side to make sure that the initial serialization is correct.
-                uint16_t dataType = *reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint16_t);
-
-                uint32_t matrixRows = *reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-
-                uint32_t matrixCols = *reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-
-                uint16_t matrixDepth= *reinterpret_cast<uint16_t*>(dataStart);
-                dataStart += sizeof(uint16_t);
-
-                // Set metadata
-                t.file.set("Label", ut.label);
-                t.file.set("X", ut.x);
-                t.file.set("Y", ut.y);
-                t.file.set("Width", ut.width);
-                t.file.set("Height", ut.height);
+            t.file.set("URL", QString(data));
+        }
 
-                t.append(cv::Mat(matrixRows, matrixCols, CV_MAKETYPE(dataType, matrixDepth), dataStart).clone() /* We don't want a shallow copy! */);
-                return t;
+        const char *dataStart = data + ut.urlSize;
+        uint32_t dataSize = ut.fvSize;
+        if ((ut.algorithmID <= -1) && (ut.algorithmID >= -3)) {
+            if (!dropMetadata) {
+                const uint32_t *eyes = reinterpret_cast<const uint32_t*>(dataStart);
+                t.file.set("FrontalFace", QRectF(ut.x, ut.y, ut.width, ut.height));
+                t.file.set("First_Eye", QPointF(eyes[0], eyes[1]));
+                t.file.set("Second_Eye", QPointF(eyes[2], eyes[3]));
             }
-            else {
+            dataStart += sizeof(uint32_t)*4;
+            dataSize -= sizeof(uint32_t)*4;
+        }
+        else if (ut.algorithmID == 7) {
+            // binary data consisting of a single channel matrix, of a supported type.
+            // 4 element header:
+            // uint16 datatype (single channel opencv datatype code)
+            // uint32 matrix rows
+            // uint32 matrix cols
+            // uint16 matrix depth (max 512)
+            // Followed by serialized data, in row-major order (in r/c), with depth values
+            // for each layer listed in order (i.e. rgb, rgb etc.)
+            // #### NOTE! matlab's default order is col-major, so some work should
+            // be done on the matlab side to make sure that the initial serialization is correct.
+            uint16_t dataType = *reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint16_t);
+
+            uint32_t matrixRows = *reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+
+            uint32_t matrixCols = *reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+
+            uint16_t matrixDepth= *reinterpret_cast<const uint16_t*>(dataStart);
+            dataStart += sizeof(uint16_t);
+
+            // Set metadata
+            t.file.set("Label", ut.label);
+            if (!dropMetadata) {
                 t.file.set("X", ut.x);
                 t.file.set("Y", ut.y);
                 t.file.set("Width", ut.width);
                 t.file.set("Height", ut.height);
             }
-            t.file.set("Label", ut.label);
-            t.append(cv::Mat(1, dataSize, CV_8UC1, dataStart).clone() /* We don't want a shallow copy! */);
-        } else {
-            if (!gallery.atEnd())
-                qWarning("Failed to read universal template header!");
-            gallery.close();
+
+            t.append(cv::Mat(matrixRows, matrixCols, CV_MAKETYPE(dataType, matrixDepth), (void*) dataStart).clone() /* We don't want a shallow copy! */);
+            return t;
+        }
+        else if (!dropMetadata) {
+            t.file.set("X", ut.x);
+            t.file.set("Y", ut.y);
+            t.file.set("Width", ut.width);
+            t.file.set("Height", ut.height);
         }
+        t.file.set("Label", ut.label);
+        t.append(cv::Mat(1, dataSize, CV_8UC1, (void*) dataStart).clone() /* We don't want a shallow copy! */);
         return t;
     }
 
@@ -388,33 +696,40 @@ BR_REGISTER(Gallery, urlGallery)
 /*!
  * \ingroup galleries
  * \brief Newline-separated JSON objects.
+ *
+ * One metadata object per line (NDJSON), with \c index the gallery can be read in parallel as \c shards.
  * \author Josh Klontz \cite jklontz
  */
 class jsonGallery : public BinaryGallery
 {
     Q_OBJECT
 
+    QByteArray buffer; // Reused between templates
+
     Template readTemplate()
     {
-        QJsonParseError error;
-        const QByteArray line = gallery.readLine().simplified();
-        if (line.isEmpty())
+        buffer = gallery.readLine();
+        int size = buffer.size();
+        while ((size > 0) && isspace(uchar(buffer[size-1])))
+            size--;
+        if (size == 0)
             return Template();
-        File file = QJsonDocument::fromJson(line, &error).object().toVariantMap();
-        if (error.error != QJsonParseError::NoError) {
-            qWarning("Couldn't parse: %s\n", line.data());
-            qFatal("%s\n", qPrintable(error.errorString()));
+
+        Template t;
+        QString error;
+        if (!JSONUtils::parse(buffer.constData(), size, t.file, &error)) {
+            qWarning("Couldn't parse: %s\n", buffer.constData());
+            qFatal("%s\n", qPrintable(error));
         }
-        return file;
+        return t;
     }
 
     void writeTemplate(const Template &t)
     {
-        const QByteArray json = QJsonDocument(QJsonObject::fromVariantMap(t.file.localMetadata())).toJson().replace('\n', "");
-        if (!json.isEmpty()) {
-            gallery.write(json);
-            gallery.write("\n");
-        }
+        buffer.clear();
+        JSONUtils::append(buffer, t.file);
+        buffer.append('\n');
+        gallery.write(buffer);
     }
 };
 
@@ -0,0 +1,312 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QtConcurrent>
+#include <limits>
+#ifdef BR_WITH_LZ4
+#include <lz4.h>
+#endif // BR_WITH_LZ4
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief A block compressed binary gallery.
+ *
+ * Templates are serialized as in a \c .gal gallery and compressed in blocks of \c blockTemplates,
+ * with zlib at \c compression level, or with LZ4 when built with \c BR_WITH_LZ4 and \c lz4 is true.
+ * A trailing block index gives totalSize() without decompressing.
+ * Reading decompresses up to \c prefetch blocks ahead on the global thread pool, overlapping decompression with the comparisons of earlier blocks.
+ */
+class cgalGallery : public FileGallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int blockTemplates READ get_blockTemplates WRITE set_blockTemplates RESET reset_blockTemplates STORED false)
+    Q_PROPERTY(int compression READ get_compression WRITE set_compression RESET reset_compression STORED false)
+    Q_PROPERTY(bool lz4 READ get_lz4 WRITE set_lz4 RESET reset_lz4 STORED false)
+    Q_PROPERTY(int prefetch READ get_prefetch WRITE set_prefetch RESET reset_prefetch STORED false)
+    BR_PROPERTY(int, blockTemplates, 256)
+    BR_PROPERTY(int, compression, 1)
+    BR_PROPERTY(bool, lz4, true)
+    BR_PROPERTY(int, prefetch, 0) // Defaults to the number of threads
+
+    enum Codec { Zlib = 0, LZ4 = 1 };
+    static const quint32 Magic = 0x47435242; // "BRCG"
+    static const quint32 IndexMagic = 0x49435242; // "BRCI"
+    static const quint32 Version = 1;
+
+    // Each block is its header followed by compressedSize bytes
+    struct BlockHeader
+    {
+        quint32 compressedSize, rawSize, count;
+    };
+
+    struct BlockIndex
+    {
+        qint64 offset;
+        quint32 count;
+    };
+
+    quint32 codec;
+    QByteArray block; // Serialized templates not yet written
+    QScopedPointer<QDataStream> blockStream;
+    int blockCount;
+    QList<BlockIndex> index;
+
+    QList<qint64> offsets; // Of the blocks still to be read
+    QQueue< QFuture<TemplateList> > inflight;
+    qint64 templatesRead, templatesTotal;
+
+    ~cgalGallery()
+    {
+        if (f.isOpen() && (f.openMode() & QIODevice::WriteOnly)) {
+            flushBlock();
+
+            // Index trailer
+            const qint64 indexOffset = f.pos();
+            QDataStream stream(&f);
+            foreach (const BlockIndex &entry, index)
+                stream << entry.offset << entry.count;
+            stream << quint32(index.size()) << indexOffset << IndexMagic;
+        }
+        foreach (QFuture<TemplateList> future, inflight)
+            future.waitForFinished();
+    }
+
+    void init()
+    {
+        FileGallery::init();
+        blockCount = 0;
+        templatesRead = 0;
+        templatesTotal = -1;
+    }
+
+    static QByteArray compress(const QByteArray &raw, quint32 codec, int level)
+    {
+#ifdef BR_WITH_LZ4
+        if (codec == LZ4) {
+            QByteArray compressed(LZ4_compressBound(raw.size()), Qt::Uninitialized);
+            compressed.resize(LZ4_compress_default(raw.constData(), compressed.data(), raw.size(), compressed.size()));
+            return compressed;
+        }
+#endif // BR_WITH_LZ4
+        (void) codec;
+        return qCompress(raw, level);
+    }
+
+    static TemplateList decode(const QByteArray &compressed, BlockHeader header, quint32 codec)
+    {
+        QByteArray raw;
+        if (codec == LZ4) {
+#ifdef BR_WITH_LZ4
+            raw.resize(header.rawSize);
+            if (LZ4_decompress_safe(compressed.constData(), raw.data(), compressed.size(), raw.size()) != int(header.rawSize))
+                qFatal("Corrupt LZ4 block.");
+#else // BR_WITH_LZ4
+            qFatal("Reading LZ4 compressed galleries requires building with BR_WITH_LZ4.");
+#endif // BR_WITH_LZ4
+        } else {
+            raw = qUncompress(compressed);
+        }
+
+        TemplateList templates;
+        templates.reserve(header.count);
+        QDataStream stream(raw);
+        for (quint32 i=0; i<header.count; i++) {
+            Template t;
+            stream >> t;
+            templates.append(t);
+        }
+        return templates;
+    }
+
+    // Block offsets from the trailing index, or by walking the block headers of a gallery that wasn't closed
+    QList<qint64> readOffsets(QList<quint32> *counts = NULL)
+    {
+        QList<qint64> result;
+        QDataStream stream(&f);
+        const qint64 trailerSize = sizeof(quint32) + sizeof(qint64) + sizeof(quint32);
+        if (f.size() >= 3*qint64(sizeof(quint32)) + trailerSize) {
+            quint32 blocks, magic;
+            qint64 indexOffset;
+            f.seek(f.size() - trailerSize);
+            stream >> blocks >> indexOffset >> magic;
+            if ((magic == IndexMagic) && (indexOffset + blocks*qint64(sizeof(qint64) + sizeof(quint32)) + trailerSize == f.size())) {
+                f.seek(indexOffset);
+                for (quint32 i=0; i<blocks; i++) {
+                    BlockIndex entry;
+                    stream >> entry.offset >> entry.count;
+                    result.append(entry.offset);
+                    if (counts) counts->append(entry.count);
+                }
+                return result;
+            }
+        }
+
+        qint64 offset = 3*sizeof(quint32);
+        while (offset + qint64(sizeof(BlockHeader)) <= f.size()) {
+            BlockHeader header;
+            f.seek(offset);
+            stream >> header.compressedSize >> header.rawSize >> header.count;
+            if (offset + qint64(sizeof(BlockHeader)) + header.compressedSize > f.size())
+                break;
+            result.append(offset);
+            if (counts) counts->append(header.count);
+            offset += sizeof(BlockHeader) + header.compressedSize;
+        }
+        return result;
+    }
+
+    void readHeader()
+    {
+        QDataStream stream(&f);
+        quint32 magic, version;
+        stream >> magic >> version >> codec;
+        if ((magic != Magic) || (version != Version))
+            qFatal("%s is not a cgal gallery.", qPrintable(file.name));
+    }
+
+    // Reads the next block's compressed bytes on this thread and decompresses them on the thread pool
+    void startNextBlock()
+    {
+        const qint64 offset = offsets.takeFirst();
+        f.seek(offset);
+        QDataStream stream(&f);
+        BlockHeader header;
+        stream >> header.compressedSize >> header.rawSize >> header.count;
+        const QByteArray compressed = f.read(header.compressedSize);
+        inflight.enqueue(QtConcurrent::run(&cgalGallery::decode, compressed, header, codec));
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (readOpen()) {
+            readHeader();
+            QList<quint32> counts;
+            offsets = readOffsets(&counts);
+            templatesRead = 0;
+            templatesTotal = 0;
+            foreach (quint32 count, counts)
+                templatesTotal += count;
+        }
+
+        const int depth = (prefetch > 0) ? prefetch : std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+        TemplateList templates;
+        while (templates.size() < readBlockSize) {
+            while (!offsets.isEmpty() && (inflight.size() < depth))
+                startNextBlock();
+            if (inflight.isEmpty())
+                break;
+            templates.append(inflight.dequeue().result());
+        }
+
+        for (int i=0; i<templates.size(); i++)
+            templates[i].file.set("progress", templatesRead++);
+
+        *done = offsets.isEmpty() && inflight.isEmpty();
+        if (*done)
+            f.close(); // The next block starts over
+        return templates;
+    }
+
+    void flushBlock()
+    {
+        if (blockCount == 0)
+            return;
+
+        blockStream.reset();
+        const QByteArray compressed = compress(block, codec, compression);
+        BlockIndex entry;
+        entry.offset = f.pos();
+        entry.count = blockCount;
+        index.append(entry);
+
+        QDataStream stream(&f);
+        stream << quint32(compressed.size()) << quint32(block.size()) << quint32(blockCount);
+        f.write(compressed);
+
+        block.clear();
+        blockCount = 0;
+    }
+
+    void write(const Template &t)
+    {
+        if (!f.isOpen()) {
+            writeOpen();
+#ifdef BR_WITH_LZ4
+            codec = lz4 ? LZ4 : Zlib;
+#else // BR_WITH_LZ4
+            codec = Zlib;
+#endif // BR_WITH_LZ4
+            QDataStream stream(&f);
+            stream << Magic << Version << codec;
+        }
+
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        if (blockStream.isNull())
+            blockStream.reset(new QDataStream(&block, QIODevice::WriteOnly));
+
+        if (t.file.fte) {
+            // Only write metadata for failure to enroll, but remove any stored QVariants of type cv::Mat
+            File fte = t.file;
+            const QVariantMap metadata = fte.localMetadata();
+            for (QVariantMap::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it)
+                if (strcmp(it.value().typeName(), "cv::Mat") == 0)
+                    fte.remove(it.key());
+            *blockStream << Template(fte);
+        } else {
+            *blockStream << t;
+        }
+
+        if (++blockCount >= blockTemplates)
+            flushBlock();
+    }
+
+    qint64 totalSize()
+    {
+        if (templatesTotal >= 0)
+            return templatesTotal;
+        if (f.isOpen())
+            return std::numeric_limits<qint64>::max(); // Still being written
+
+        readOpen();
+        readHeader();
+        QList<quint32> counts;
+        readOffsets(&counts);
+        f.close();
+
+        templatesTotal = 0;
+        foreach (quint32 count, counts)
+            templatesTotal += count;
+        return templatesTotal;
+    }
+
+    qint64 position()
+    {
+        return templatesRead;
+    }
+};
+
+BR_REGISTER(Gallery, cgalGallery)
+
+} // namespace br
+
+#include "gallery/cgal.moc"
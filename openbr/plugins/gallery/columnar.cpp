@@ -0,0 +1,209 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief A columnar gallery of feature vectors and metadata.
+ *
+ * The single matrix of every template is stored in one contiguous feature matrix and read back as views of its rows.
+ * Metadata keys in \c columns are stored as dictionary encoded br::MetadataColumns,
+ * which br::MaskDistance evaluates once per distinct value to build candidate bitmaps before any distance is computed.
+ * Other metadata is stored per template.
+ * Templates are buffered until the gallery is closed, all templates must have the same matrix size and type or no matrix.
+ */
+class colGallery : public FileGallery
+{
+    Q_OBJECT
+    Q_PROPERTY(QStringList columns READ get_columns WRITE set_columns RESET reset_columns STORED false)
+    BR_PROPERTY(QStringList, columns, QStringList() << "Age" << "Gender" << "Label")
+
+    static const quint32 Magic = 0x4f435242; // "BRCO"
+    static const quint32 Version = 1;
+
+    TemplateList templates; // Buffered for writing, or read
+    int templatesRead;
+
+    ~colGallery()
+    {
+        if (f.isOpen() && (f.openMode() & QIODevice::WriteOnly))
+            flush();
+    }
+
+    void init()
+    {
+        FileGallery::init();
+        templatesRead = 0;
+    }
+
+    void flush()
+    {
+        int rows = 0, cols = 0, type = -1;
+        QStringList names;
+        QBitArray fte(templates.size()), hasMatrix(templates.size());
+        for (int i=0; i<templates.size(); i++) {
+            const Template &t = templates[i];
+            names.append(t.file.name);
+            fte.setBit(i, t.file.fte);
+            if (t.size() > 1)
+                qFatal("%s requires templates with at most one matrix.", qPrintable(file.name));
+            if (t.isEmpty() || t.m().empty())
+                continue;
+            hasMatrix.setBit(i);
+            if (type == -1) {
+                rows = t.m().rows;
+                cols = t.m().cols;
+                type = t.m().type();
+            } else if ((t.m().rows != rows) || (t.m().cols != cols) || (t.m().type() != type)) {
+                qFatal("%s requires matrices of the same size and type.", qPrintable(file.name));
+            }
+        }
+
+        const MetadataColumns metadata(templates, columns);
+        QList<QVariantMap> other;
+        foreach (const Template &t, templates) {
+            QVariantMap map = t.file.localMetadata();
+            for (QVariantMap::iterator it = map.begin(); it != map.end();) {
+                // Columns keep values that can be converted to a string, failures to enroll don't keep matrices
+                if ((columns.contains(it.key()) && it.value().canConvert<QString>()) ||
+                    (t.file.fte && (strcmp(it.value().typeName(), "cv::Mat") == 0)))
+                    it = map.erase(it);
+                else
+                    ++it;
+            }
+            other.append(map);
+        }
+
+        QDataStream stream(&f);
+        stream << Magic << Version << qint32(templates.size()) << names << fte << hasMatrix << metadata << other;
+        stream << qint32(rows) << qint32(cols) << qint32(type);
+
+        if (type != -1) {
+            const cv::Mat zeros = cv::Mat::zeros(rows, cols, type);
+            for (int i=0; i<templates.size(); i++) {
+                const cv::Mat m = hasMatrix.testBit(i) ? templates[i].m() : zeros;
+                if (m.isContinuous()) {
+                    stream.writeRawData((const char*) m.data, m.rows * m.cols * m.elemSize());
+                } else {
+                    for (int r=0; r<m.rows; r++)
+                        stream.writeRawData((const char*) m.ptr(r), m.cols * m.elemSize());
+                }
+            }
+        }
+        templates.clear();
+    }
+
+    void load()
+    {
+        QDataStream stream(&f);
+        quint32 magic, version;
+        qint32 count, rows, cols, type;
+        QStringList names;
+        QBitArray fte, hasMatrix;
+        MetadataColumns metadata;
+        QList<QVariantMap> other;
+        stream >> magic >> version;
+        if ((magic != Magic) || (version != Version))
+            qFatal("%s is not a columnar gallery.", qPrintable(file.name));
+        stream >> count >> names >> fte >> hasMatrix >> metadata >> other >> rows >> cols >> type;
+
+        // One allocation for every feature vector
+        cv::Mat features;
+        if (type != -1) {
+            features.create(count, rows * cols, type);
+            const int rowBytes = features.cols * features.elemSize();
+            for (int i=0; i<count; i++)
+                if (stream.readRawData((char*) features.ptr(i), rowBytes) != rowBytes)
+                    qFatal("Unexpected EOF while reading %s.", qPrintable(file.name));
+        }
+
+        const QStringList keys = metadata.keys();
+        templates.clear();
+        templates.reserve(count);
+        for (int i=0; i<count; i++) {
+            File templateFile;
+            templateFile.name = names[i];
+            templateFile.fte = fte.testBit(i);
+            foreach (const QString &key, keys) {
+                const QVariant value = metadata.value(key, i);
+                if (value.isValid())
+                    templateFile.set(key, value);
+            }
+            for (QVariantMap::const_iterator it = other[i].constBegin(); it != other[i].constEnd(); ++it)
+                templateFile.set(it.key(), it.value());
+
+            Template t(templateFile);
+            if (hasMatrix.testBit(i))
+                t.append(features.row(i).reshape(0, rows));
+            templates.append(t);
+        }
+        templatesRead = 0;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (readOpen())
+            load();
+
+        TemplateList block = templates.mid(templatesRead, readBlockSize);
+        for (int i=0; i<block.size(); i++)
+            block[i].file.set("progress", templatesRead++);
+
+        *done = templatesRead >= templates.size();
+        if (*done) {
+            templates.clear();
+            f.close(); // The next block starts over
+        }
+        return block;
+    }
+
+    void write(const Template &t)
+    {
+        writeOpen();
+        if (t.isEmpty() && t.file.isNull())
+            return;
+        templates.append(t);
+    }
+
+    qint64 totalSize()
+    {
+        if (f.isOpen())
+            return (f.openMode() & QIODevice::WriteOnly) ? std::numeric_limits<qint64>::max() : qint64(templates.size());
+
+        readOpen();
+        QDataStream stream(&f);
+        quint32 magic, version;
+        qint32 count;
+        stream >> magic >> version >> count;
+        f.close();
+        return count;
+    }
+
+    qint64 position()
+    {
+        return templatesRead;
+    }
+};
+
+BR_REGISTER(Gallery, colGallery)
+
+} // namespace br
+
+#include "gallery/columnar.moc"
@@ -17,6 +17,7 @@
 #include <QStandardPaths>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/dirwalker.h>
 
 namespace br
 {
@@ -24,6 +25,9 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Crawl a root location for image files.
+ *
+ * Roots are walked in parallel by a br::DirectoryWalker with \c crawlThreads threads,
+ * and images are returned in blocks of Gallery::readBlockSize as they are found.
  * \author Josh Klontz \cite jklontz
  */
 class crawlGallery : public Gallery
@@ -35,68 +39,72 @@ class crawlGallery : public Gallery
     Q_PROPERTY(int images READ get_images WRITE set_images RESET reset_images STORED false)
     Q_PROPERTY(bool json READ get_json WRITE set_json RESET reset_json STORED false)
     Q_PROPERTY(int timeLimit READ get_timeLimit WRITE set_timeLimit RESET reset_timeLimit STORED false)
+    Q_PROPERTY(int crawlThreads READ get_crawlThreads WRITE set_crawlThreads RESET reset_crawlThreads STORED false)
     BR_PROPERTY(bool, autoRoot, false)
     BR_PROPERTY(int, depth, INT_MAX)
     BR_PROPERTY(bool, depthFirst, false)
     BR_PROPERTY(int, images, INT_MAX)
     BR_PROPERTY(bool, json, false)
     BR_PROPERTY(int, timeLimit, INT_MAX)
+    BR_PROPERTY(int, crawlThreads, 0)
 
     QTime elapsed;
-    TemplateList templates;
-
-    void crawl(QFileInfo url, int currentDepth = 0)
-    {
-        if ((templates.size() >= images) || (currentDepth >= depth) || (elapsed.elapsed()/1000 >= timeLimit))
-            return;
-
-        if (url.filePath().startsWith("file://"))
-            url = QFileInfo(url.filePath().mid(7));
-
-        if (url.isDir()) {
-            const QDir dir(url.absoluteFilePath());
-            const QFileInfoList files = dir.entryInfoList(QDir::Files);
-            const QFileInfoList subdirs = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
-            foreach (const QFileInfo &first, depthFirst ? subdirs : files)
-                crawl(first, currentDepth + 1);
-            foreach (const QFileInfo &second, depthFirst ? files : subdirs)
-                crawl(second, currentDepth + 1);
-        } else if (url.isFile()) {
-            const QString suffix = url.suffix();
-            if ((suffix == "bmp") || (suffix == "jpg") || (suffix == "jpeg") || (suffix == "png") || (suffix == "tiff")) {
-                File f;
-                if (json) f.set("URL", "file://"+url.canonicalFilePath());
-                else      f.name = "file://"+url.canonicalFilePath();
-                templates.append(f);
-            }
-        }
-    }
+    QStringList roots;
+    QScopedPointer<DirectoryWalker> walker;
+    int crawled;
 
     void init()
     {
-        elapsed.start();
         const QString root = file.name.mid(0, file.name.size()-6); // Remove .crawl suffix";
         if (!root.isEmpty()) {
-            crawl(root);
+            roots.append(root);
         } else {
             if (autoRoot) {
-                foreach (const QString &path, QStandardPaths::standardLocations(QStandardPaths::HomeLocation))
-                    crawl(path);
+                roots.append(QStandardPaths::standardLocations(QStandardPaths::HomeLocation));
             } else {
                 QFile file;
                 file.open(stdin, QFile::ReadOnly);
                 while (!file.atEnd()) {
                     const QString url = QString::fromLocal8Bit(file.readLine()).simplified();
                     if (!url.isEmpty())
-                        crawl(url);
+                        roots.append(url);
                 }
             }
         }
+
+        for (int i=0; i<roots.size(); i++) {
+            if (roots[i].startsWith("file://"))
+                roots[i] = roots[i].mid(7);
+            roots[i] = QFileInfo(roots[i]).canonicalFilePath();
+        }
     }
 
     TemplateList readBlock(bool *done)
     {
-        *done = true;
+        if (walker.isNull()) {
+            elapsed.start();
+            walker.reset(new DirectoryWalker(roots, crawlThreads, depth, depthFirst));
+            crawled = 0;
+        }
+
+        TemplateList templates;
+        foreach (const DirectoryWalker::Entry &entry, walker->next(readBlockSize, done)) {
+            if (crawled >= images)
+                break;
+            const QString suffix = QFileInfo(entry.path).suffix();
+            if ((suffix == "bmp") || (suffix == "jpg") || (suffix == "jpeg") || (suffix == "png") || (suffix == "tiff")) {
+                File f;
+                if (json) f.set("URL", "file://"+entry.path);
+                else      f.name = "file://"+entry.path;
+                templates.append(f);
+                crawled++;
+            }
+        }
+
+        if ((crawled >= images) || (elapsed.elapsed()/1000 >= timeLimit))
+            *done = true;
+        if (*done)
+            walker.reset(); // The next block starts over
         return templates;
     }
 
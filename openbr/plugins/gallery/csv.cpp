@@ -16,6 +16,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/filelistcache.h>
 
 namespace br
 {
@@ -28,6 +29,7 @@ namespace br
  * Columns should be comma separated with first row containing headers.
  * The first column in the file should be the path to the file to enroll.
  * Other columns will be treated as file metadata.
+ * Whole reads are cached in a FileListCache next to the file unless \c cache is false.
  *
  * \see txtGallery
  */
@@ -35,7 +37,9 @@ class csvGallery : public FileGallery
 {
     Q_OBJECT
     Q_PROPERTY(int fileIndex READ get_fileIndex WRITE set_fileIndex RESET reset_fileIndex)
+    Q_PROPERTY(bool cache READ get_cache WRITE set_cache RESET reset_cache STORED false)
     BR_PROPERTY(int, fileIndex, 0)
+    BR_PROPERTY(bool, cache, true)
 
     FileList files;
     QStringList headers;
@@ -86,6 +90,22 @@ class csvGallery : public FileGallery
         QtUtils::writeFile(file, lines);
     }
 
+    TemplateList read()
+    {
+        // The arguments the gallery was opened with
+        File arguments = file;
+        arguments.name.clear();
+        const QString parameters = arguments.flat();
+
+        FileList fileList;
+        if (cache && FileListCache::read(f.fileName(), parameters, fileList))
+            return fileList;
+        const TemplateList templates = Gallery::read();
+        if (cache && QFileInfo(f.fileName()).exists())
+            FileListCache::write(f.fileName(), parameters, templates.files());
+        return templates;
+    }
+
     TemplateList readBlock(bool *done)
     {
         readOpen();
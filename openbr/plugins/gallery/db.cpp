@@ -14,7 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef BR_EMBEDDED
 #include <QtSql>
+#endif // BR_EMBEDDED
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
@@ -25,25 +27,131 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Database input.
+ *
+ * With a \c query the gallery reads the files it selects.
+ * Without a \c subset, rows are decoded from a forward-only cursor one Gallery::readBlockSize block at a time, in the order the query returns them.
+ * A \c subset groups rows by label, so the whole result is read first.
+ *
+ * Without a \c query the database stores serialized templates in \c table.
+ * Writes are prepared inserts committed in transactions of \c batchSize templates, and reads page through the table by row id.
+ * Databases are opened in write-ahead logging mode so readers don't block the writer.
+ * Connections are thread affine, so output transforms write to this gallery synchronously.
  * \author Josh Klontz \cite jklontz
  */
 class dbGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(QString table READ get_table WRITE set_table RESET reset_table STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    BR_PROPERTY(QString, table, "templates")
+    BR_PROPERTY(int, batchSize, 1000)
+
+#ifndef BR_EMBEDDED
+    QString connection;
+    QSqlDatabase db;
+    QScopedPointer<QSqlQuery> cursor, insert;
+    int pendingInserts;
+    qint64 lastId, rowsRead;
+
+    ~dbGallery()
+    {
+        if (!db.isOpen())
+            return;
+        if (pendingInserts > 0)
+            commit();
+        cursor.reset();
+        insert.reset();
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(connection);
+    }
+
+    void init()
+    {
+        pendingInserts = 0;
+        lastId = 0;
+        rowsRead = 0;
+        connection = QString("dbGallery%1").arg(quintptr(this));
+    }
+
+    void open()
+    {
+        if (db.isOpen())
+            return;
+        db = QSqlDatabase::addDatabase("QSQLITE", connection);
+        db.setDatabaseName(file);
+        if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
+
+        QSqlQuery q(db);
+        q.exec("PRAGMA journal_mode=WAL");
+        q.exec("PRAGMA synchronous=NORMAL"); // Durable at checkpoints, which is enough for a WAL database
+    }
+
+    void commit()
+    {
+        if (!db.commit()) qFatal("%s.", qPrintable(db.lastError().text()));
+        pendingInserts = 0;
+    }
+
+    void createTable()
+    {
+        QSqlQuery q(db);
+        if (!q.exec("CREATE TABLE IF NOT EXISTS " + table + " (id INTEGER PRIMARY KEY, name TEXT, template BLOB)"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+    }
+#endif // BR_EMBEDDED
 
     TemplateList readBlock(bool *done)
     {
+        *done = true;
         TemplateList templates;
+
+#ifndef BR_EMBEDDED
+        open();
+        if (!file.contains("query")) readTemplates(templates, done);
+        else                         readQuery(templates, done);
+#endif // BR_EMBEDDED
+
+        return templates;
+    }
+
+#ifndef BR_EMBEDDED
+    // Keyset pagination, so each block is one indexed range scan
+    void readTemplates(TemplateList &templates, bool *done)
+    {
+        createTable();
+        QSqlQuery q(db);
+        q.setForwardOnly(true);
+        if (!q.prepare("SELECT id, template FROM " + table + " WHERE id > ? ORDER BY id LIMIT ?"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        q.addBindValue(lastId);
+        q.addBindValue(readBlockSize);
+        if (!q.exec()) qFatal("%s.", qPrintable(q.lastError().text()));
+
+        while (q.next()) {
+            lastId = q.value(0).toLongLong();
+            const QByteArray data = q.value(1).toByteArray();
+            QDataStream stream(data);
+            Template t;
+            stream >> t;
+            templates.append(t);
+            templates.last().file.set("progress", rowsRead++);
+        }
+
+        *done = (templates.size() < readBlockSize);
+        if (*done) {
+            lastId = 0; // The next block starts over
+            rowsRead = 0;
+        }
+    }
+
+    void readQuery(TemplateList &templates, bool *done)
+    {
         br::File import = file.get<QString>("import", "");
         QString query = file.get<QString>("query");
         QString subset = file.get<QString>("subset", "");
 
-#ifndef BR_EMBEDDED
-        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
-        db.setDatabaseName(file);
-        if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
-
-        if (!import.isNull()) {
+        if (!import.isNull() && cursor.isNull()) {
             qDebug("Parsing %s", qPrintable(import.name));
             QStringList lines = QtUtils::readLines(import);
             QList<QStringList> cells; cells.reserve(lines.size());
@@ -69,23 +177,30 @@ class dbGallery : public Gallery
                 variantLists.append(variantList);
             }
 
-            const QString &table = import.baseName();
-            qDebug("Creating table %s", qPrintable(table));
+            const QString importTable = import.baseName();
+            qDebug("Creating table %s", qPrintable(importTable));
+            db.transaction(); // One commit for the whole import rather than one per row
             QSqlQuery q(db);
-            if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
+            if (!q.exec("CREATE TABLE " + importTable + " (" + columns.join(", ") + ");"))
                 qFatal("%s.", qPrintable(q.lastError().text()));
-            if (!q.prepare("insert into " + table + " values (" + qMarks.join(", ") + ")"))
+            if (!q.prepare("insert into " + importTable + " values (" + qMarks.join(", ") + ")"))
                 qFatal("%s.", qPrintable(q.lastError().text()));
             foreach (const QVariantList &vl, variantLists)
                 q.addBindValue(vl);
             if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
+            commit();
         }
 
-        QSqlQuery q(db);
-        if (query.startsWith('\'') && query.endsWith('\''))
-            query = query.mid(1, query.size()-2);
-        if (!q.exec(query))
-            qFatal("%s.", qPrintable(q.lastError().text()));
+        if (cursor.isNull()) {
+            cursor.reset(new QSqlQuery(db));
+            cursor->setForwardOnly(true);
+            if (query.startsWith('\'') && query.endsWith('\''))
+                query = query.mid(1, query.size()-2);
+            if (!cursor->exec(query))
+                qFatal("%s.", qPrintable(cursor->lastError().text()));
+            rowsRead = 0;
+        }
+        QSqlQuery &q = *cursor;
 
         if ((q.record().count() == 0) || (q.record().count() > 3))
             qFatal("Query record expected one to three fields, got %d.", q.record().count());
@@ -96,11 +211,29 @@ class dbGallery : public Gallery
         if (q.record().count() >= 2)
             labelName = q.record().fieldName(1);
 
+        if (subset.isEmpty()) {
+            // Rows with a filter are split between training and testing as with seed 0 below
+            *done = false;
+            while (templates.size() < readBlockSize) {
+                if (!q.next()) {
+                    *done = true;
+                    break;
+                }
+                if (hasFilter && (qHash(q.value(2).toString()) % 2 != 0)) continue;
+                templates.append(File(q.value(0).toString()));
+                templates.last().file.set(labelName, hasMetadata ? q.value(1).toString() : QString());
+                templates.last().file.set("progress", rowsRead++);
+            }
+            if (*done)
+                cursor.reset(); // The next block starts over
+            return;
+        }
+
         // subset = seed:subjectMaxSize:numSubjects:subjectMinSize or
         // subset = seed:{Metadata,...,Metadata}:numSubjects
         int seed = 0, subjectMaxSize = std::numeric_limits<int>::max(), numSubjects = std::numeric_limits<int>::max(), subjectMinSize = 0;
         QList<QRegExp> metadataFields;
-        if (!subset.isEmpty()) {
+        {
             const QStringList &words = subset.split(":");
             QtUtils::checkArgsSize("Input", words, 2, 4);
             if      (words[0] == "train") seed = 0;
@@ -129,6 +262,7 @@ class dbGallery : public Gallery
             else
                 entries[hasFilter ? q.value(2).toString() : ""].append(QPair<QString,QString>(q.value(0).toString(), hasMetadata ? q.value(1).toString() : ""));
         }
+        cursor.reset();
 
         QStringList labels = entries.keys();
         qSort(labels);
@@ -165,23 +299,59 @@ class dbGallery : public Gallery
                 numSubjects--;
             }
         }
-
-        db.close();
+    }
 #endif // BR_EMBEDDED
 
-        *done = true;
-        return templates;
+    // Qt database connections must only be used from the thread that opened them
+    bool threadAffine() const
+    {
+        return true;
     }
 
     void write(const Template &t)
     {
+#ifndef BR_EMBEDDED
+        if (insert.isNull()) {
+            open();
+            createTable();
+            insert.reset(new QSqlQuery(db));
+            if (!insert->prepare("INSERT INTO " + table + " (name, template) VALUES (?, ?)"))
+                qFatal("%s.", qPrintable(insert->lastError().text()));
+        }
+
+        if (pendingInserts == 0)
+            db.transaction();
+
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << t;
+        insert->bindValue(0, t.file.name);
+        insert->bindValue(1, data);
+        if (!insert->exec()) qFatal("%s.", qPrintable(insert->lastError().text()));
+
+        if (++pendingInserts >= batchSize)
+            commit();
+#else // BR_EMBEDDED
         (void) t;
         qFatal("Not supported.");
+#endif // BR_EMBEDDED
     }
 
-    void init()
+    qint64 totalSize()
     {
-        //
+#ifndef BR_EMBEDDED
+        if (file.contains("query"))
+            return Gallery::totalSize();
+
+        open();
+        createTable();
+        QSqlQuery q(db);
+        if (!q.exec("SELECT COUNT(*) FROM " + table) || !q.next())
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        return q.value(0).toLongLong();
+#else // BR_EMBEDDED
+        return Gallery::totalSize();
+#endif // BR_EMBEDDED
     }
 };
 
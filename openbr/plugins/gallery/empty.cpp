@@ -18,6 +18,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/dirwalker.h>
 
 namespace br
 {
@@ -25,6 +26,10 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Reads/writes templates to/from folders.
+ *
+ * By default the folder is listed in natural order at once.
+ * When \c stream is true it is instead listed by a br::DirectoryWalker in blocks of Gallery::readBlockSize,
+ * in no particular order, so enrollment starts while the walk continues and totalSize() is unknown.
  * \author Josh Klontz \cite jklontz
  * \param regexp An optional regular expression to match against the files extension.
  */
@@ -32,20 +37,28 @@ class EmptyGallery : public Gallery
 {
     Q_OBJECT
     Q_PROPERTY(QString regexp READ get_regexp WRITE set_regexp RESET reset_regexp STORED false)
+    Q_PROPERTY(bool stream READ get_stream WRITE set_stream RESET reset_stream STORED false)
+    Q_PROPERTY(int crawlThreads READ get_crawlThreads WRITE set_crawlThreads RESET reset_crawlThreads STORED false)
     BR_PROPERTY(QString, regexp, QString())
+    BR_PROPERTY(bool, stream, false)
+    BR_PROPERTY(int, crawlThreads, 0)
 
     qint64 gallerySize;
+    QScopedPointer<DirectoryWalker> walker;
+    qint64 walkedFiles;
+    QRegExp re;
 
     void init()
     {
         QDir dir(file.name);
         QtUtils::touchDir(dir);
-        QDirIterator it(dir.absolutePath(), QDir::Files | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
-        gallerySize = 0;
-        while (it.hasNext()) {
-            it.next();
-            gallerySize++;
-        }
+        gallerySize = -1; // Counted when first needed
+        re = QRegExp(regexp, Qt::CaseSensitive, QRegExp::Wildcard);
+    }
+
+    bool keep(const QString &fileName) const
+    {
+        return regexp.isEmpty() || re.exactMatch(fileName);
     }
 
     TemplateList readBlock(bool *done)
@@ -56,6 +69,22 @@ class EmptyGallery : public Gallery
         // Enrolling a null file is used as an idiom to initialize an algorithm
         if (file.isNull()) return templates;
 
+        if (stream) {
+            if (walker.isNull()) {
+                walker.reset(new DirectoryWalker(QStringList() << QDir(file.name).absolutePath(), crawlThreads));
+                walkedFiles = 0;
+            }
+            foreach (const DirectoryWalker::Entry &entry, walker->next(readBlockSize, done)) {
+                if (!keep(QFileInfo(entry.path).fileName()))
+                    continue;
+                templates.append(File(entry.path, entry.label));
+                templates.last().file.set("progress", walkedFiles++);
+            }
+            if (*done)
+                walker.reset(); // The next block starts over
+            return templates;
+        }
+
         // Add immediate subfolders
         QDir dir(file);
         QList< QFuture<TemplateList> > futures;
@@ -70,15 +99,9 @@ class EmptyGallery : public Gallery
         foreach (const QString &fileName, QtUtils::getFiles(file.name, false))
             templates.append(File(fileName, dir.dirName()));
 
-        if (!regexp.isEmpty()) {
-            QRegExp re(regexp);
-            re.setPatternSyntax(QRegExp::Wildcard);
-            for (int i=templates.size()-1; i>=0; i--) {
-                if (!re.exactMatch(templates[i].file.fileName())) {
-                    templates.removeAt(i);
-                }
-            }
-        }
+        for (int i=templates.size()-1; i>=0; i--)
+            if (!keep(templates[i].file.fileName()))
+                templates.removeAt(i);
 
         for (int i = 0; i < templates.size(); i++) templates[i].file.set("progress", i);
 
@@ -107,6 +130,16 @@ class EmptyGallery : public Gallery
 
     qint64 totalSize()
     {
+        if (stream)
+            return Gallery::totalSize();
+
+        if (gallerySize == -1) {
+            DirectoryWalker counter(QStringList() << QDir(file.name).absolutePath(), crawlThreads);
+            bool walked = false;
+            gallerySize = 0;
+            while (!walked)
+                gallerySize += counter.next(readBlockSize, &walked).size();
+        }
         return gallerySize;
     }
 
@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtNetwork>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/downloader.h>
 
 namespace br
 {
@@ -38,17 +37,22 @@ class googleGallery : public Gallery
         QString query = file.name.left(file.name.size()-7); // remove ".google"
 
 #ifndef BR_EMBEDDED
-        QNetworkAccessManager networkAccessManager;
-        for (int i=0; i<100; i+=20) { // Retrieve 100 images
-            QNetworkRequest request(search.arg(query, QString::number(i)));
-            QNetworkReply *reply = networkAccessManager.get(request);
-
-            while (!reply->isFinished())
-                QThread::yieldCurrentThread();
+        QList<QUrl> pages;
+        for (int i=0; i<100; i+=20) // Retrieve 100 images
+            pages.append(QUrl(search.arg(query, QString::number(i))));
 
-            QString data(reply->readAll());
-            delete reply;
+        // Pages are requested concurrently but parsed in order
+        QVector<QString> results(pages.size());
+        {
+            DownloadBatch batch(pages);
+            QByteArray page;
+            QString error;
+            int index;
+            while ((index = batch.next(page, error)) != -1)
+                results[index] = QString(page);
+        }
 
+        foreach (const QString &data, results) {
             QStringList words = data.split("imgurl=");
             words.takeFirst(); // Remove header
             foreach (const QString &word, words) {
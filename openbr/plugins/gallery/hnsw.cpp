@@ -0,0 +1,134 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/hnsw.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief A graph index of enrolled templates for sub-linear nearest neighbor search.
+ *
+ * Each written template is inserted into a br::HNSWIndex as it arrives, so appending to an existing gallery extends the graph without rebuilding it.
+ * Links are scored with \c distance, or with the distance of the current algorithm when \c distance is empty,
+ * in which case appending to the gallery also requires an algorithm.
+ * Reading returns every template, so the gallery can be used anywhere a .gal can.
+ * KNN and GalleryCompare will search the graph when their \c galleryName is a .hnsw gallery,
+ * examining \c ef candidates per query as read from the gallery's metadata, 64 by default.
+ */
+class hnswGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(QString distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(int M READ get_M WRITE set_M RESET reset_M STORED false)
+    Q_PROPERTY(int efConstruction READ get_efConstruction WRITE set_efConstruction RESET reset_efConstruction STORED false)
+    BR_PROPERTY(QString, distance, "") /*!< \brief Description of the distance used to build the graph. */
+    BR_PROPERTY(int, M, 16) /*!< \brief Links per node and layer. */
+    BR_PROPERTY(int, efConstruction, 100) /*!< \brief Candidates examined when inserting a template. */
+
+    QSharedPointer<HNSWIndex> index;
+    QSharedPointer<Distance> metric;
+    TemplateList templates;
+    qint64 block;
+    bool loaded, modified;
+
+    void init()
+    {
+        block = 0;
+        loaded = modified = false;
+    }
+
+    ~hnswGallery()
+    {
+        if (modified)
+            index->write(file, distance);
+    }
+
+    void load()
+    {
+        if (loaded)
+            return;
+        loaded = true;
+        index = QSharedPointer<HNSWIndex>(new HNSWIndex(M, efConstruction));
+        if (QFileInfo(file).exists()) {
+            const QString built = index->read(file);
+            if (distance.isEmpty())
+                distance = built;
+        }
+        templates = index->templates();
+    }
+
+    void openWriter()
+    {
+        if (!metric.isNull())
+            return;
+
+        if (file.get<bool>("append", false))
+            load();
+        else {
+            loaded = true;
+            index = QSharedPointer<HNSWIndex>(new HNSWIndex(M, efConstruction));
+        }
+
+        if (distance.isEmpty()) {
+            if (Globals->algorithm.isEmpty())
+                qFatal("hnswGallery requires a distance or an algorithm.");
+            metric = Distance::fromAlgorithm(Globals->algorithm);
+        } else {
+            metric = QSharedPointer<Distance>(Distance::make(distance, NULL));
+        }
+        index->setDistance(metric.data());
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        load();
+        TemplateList result = templates.mid(block*readBlockSize, readBlockSize);
+        for (int i=0; i<result.size(); i++)
+            result[i].file.set("progress", block*readBlockSize + i);
+        *done = (block+1)*readBlockSize >= templates.size();
+        block = *done ? 0 : block+1;
+        return result;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+        openWriter();
+        index->insert(t);
+        modified = true;
+    }
+
+    qint64 totalSize()
+    {
+        load();
+        return templates.size();
+    }
+
+    qint64 position()
+    {
+        return block * readBlockSize;
+    }
+};
+
+BR_REGISTER(Gallery, hnswGallery)
+
+} // namespace br
+
+#include "gallery/hnsw.moc"
@@ -0,0 +1,107 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/ivf.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief An approximate nearest neighbor index of enrolled templates.
+ *
+ * Written templates are assigned to coarse lists with br::InvertedIndex when the gallery is closed.
+ * Reading returns every template, so the gallery can be used anywhere a .gal can.
+ * When used as the target gallery of br_compare(), each query is only compared against the templates in its \c nprobe nearest lists,
+ * where \c nprobe is read from the gallery's metadata and defaults to 8.
+ * Pairs that aren't compared are reported with a score of <tt>-FLT_MAX</tt>.
+ */
+class ivfGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int lists READ get_lists WRITE set_lists RESET reset_lists STORED false)
+    Q_PROPERTY(QString quantizer READ get_quantizer WRITE set_quantizer RESET reset_quantizer STORED false)
+    BR_PROPERTY(int, lists, 0) /*!< \brief Number of coarse lists, sqrt of the gallery size by default. */
+    BR_PROPERTY(QString, quantizer, "KMeans") /*!< \brief Transform trained to assign templates to lists. */
+
+    TemplateList templates;
+    qint64 block;
+    bool loaded, modified;
+
+    void init()
+    {
+        block = 0;
+        loaded = modified = false;
+    }
+
+    ~ivfGallery()
+    {
+        if (!modified)
+            return;
+
+        InvertedIndex::write(file, templates, lists, quantizer);
+    }
+
+    void load()
+    {
+        if (loaded)
+            return;
+        loaded = true;
+        if (!QFileInfo(file).exists())
+            return;
+        InvertedIndex index;
+        index.read(file, templates);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        load();
+        TemplateList result = templates.mid(block*readBlockSize, readBlockSize);
+        for (int i=0; i<result.size(); i++)
+            result[i].file.set("progress", block*readBlockSize + i);
+        *done = (block+1)*readBlockSize >= templates.size();
+        block = *done ? 0 : block+1;
+        return result;
+    }
+
+    void write(const Template &t)
+    {
+        if (!modified && file.get<bool>("append", false))
+            load();
+        if (t.isEmpty() && t.file.isNull())
+            return;
+        templates.append(t);
+        modified = true;
+    }
+
+    qint64 totalSize()
+    {
+        load();
+        return templates.size();
+    }
+
+    qint64 position()
+    {
+        return block * readBlockSize;
+    }
+};
+
+BR_REGISTER(Gallery, ivfGallery)
+
+} // namespace br
+
+#include "gallery/ivf.moc"
@@ -34,11 +34,16 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Read key frames of a video with LibAV
+ *
+ * Only the packets of key frames reach the decoder, the rest of the stream is demuxed but never decoded.
+ * \c gop keeps every gop-th key frame, for example <tt>archive.mp4[gop=10]</tt>.
  * \author Ben Klein \cite bhklein
  */
 class keyframesGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(int gop READ get_gop WRITE set_gop RESET reset_gop STORED false)
+    BR_PROPERTY(int, gop, 1)
 
 public:
     int64_t idx;
@@ -59,6 +64,7 @@ public:
         fps = 0.f;
         time_base = 0.f;
         idx = 0;
+        keyframe = 0;
     }
 
     ~keyframesGallery()
@@ -89,6 +95,7 @@ public:
         if (avCodec == NULL)
             qFatal("Unsupported codec for %s!", qPrintable(file.name));
 
+        avCodecCtx->skip_frame = AVDISCARD_NONKEY;
         if (avcodec_open2(avCodecCtx, avCodec, NULL) < 0)
             qFatal("Could not open codec for file %s", qPrintable(file.name));
 
@@ -116,6 +123,7 @@ public:
             qFatal("Could not seek to beginning keyframe for %s!", qPrintable(file.name));
         avcodec_flush_buffers(avCodecCtx);
 
+        keyframe = 0;
         opened = true;
     }
 
@@ -133,20 +141,22 @@ public:
         int ret = 0;
         while (!ret) {
             if (av_read_frame(avFormatCtx, &packet) >= 0) {
-                if (packet.stream_index == streamID) {
+                if ((packet.stream_index == streamID) && (packet.flags & AV_PKT_FLAG_KEY) && (keyframe++ % std::max(gop, 1) == 0))
                     avcodec_decode_video2(avCodecCtx, frame, &ret, &packet);
-                    idx = packet.dts; // decompression timestamp
-                    av_free_packet(&packet);
-                } else {
-                    av_free_packet(&packet);
-                }
-            } else {
                 av_free_packet(&packet);
-                release();
-                *done = true;
-                return TemplateList();
+            } else {
+                // Drain the key frame the decoder may still be holding
+                packet.data = NULL;
+                packet.size = 0;
+                avcodec_decode_video2(avCodecCtx, frame, &ret, &packet);
+                if (!ret) {
+                    release();
+                    *done = true;
+                    return TemplateList();
+                }
             }
         }
+        idx = av_frame_get_best_effort_timestamp(frame);
 
         // Convert from native format
         sws_scale(avSwsCtx,
@@ -157,12 +167,9 @@ public:
                   cvt_frame->linesize);
 
         // Write AVFrame to cv::Mat
-        output.m() = Mat(avCodecCtx->height, avCodecCtx->width, CV_8UC3, cvt_frame->data[0]).clone();
+        output.m() = frames.get(avCodecCtx->height, avCodecCtx->width, CV_8UC3);
+        Mat(avCodecCtx->height, avCodecCtx->width, CV_8UC3, cvt_frame->data[0]).copyTo(output.m());
         if (output.m().data) {
-            if (av_seek_frame(avFormatCtx, streamID, idx+1, 0) < 0)
-                *done = true;
-            avcodec_flush_buffers(avCodecCtx);
-
             QString URL = file.get<QString>("URL", file.name);
             output.file.set("URL", URL + "#t=" + QString::number((int)(idx * time_base)) + "s");
             output.file.set("timestamp", QString::number((int)(idx * time_base * 1000)));
@@ -205,8 +212,10 @@ protected:
     AVFrame *frame;
     AVFrame *cvt_frame;
     uint8_t *buffer;
+    OpenCVUtils::FramePool frames;
     bool opened;
     int streamID;
+    int64_t keyframe;
     float fps;
     float time_base;
 };
@@ -0,0 +1,359 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+#include <openbr/core/qtutils.h>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+// Hardware device contexts and codec hardware configurations arrived with FFmpeg 4.0
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+}
+#define BR_LIBAV_HWACCEL
+#endif
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief Read every frame of a video with LibAV, optionally decoding on the GPU.
+ *
+ * \c hwaccel names a LibAV hardware device type, such as \c vaapi, \c cuda or \c qsv, or \c auto to use the first one available.
+ * Frames are decoded on the device and copied back to memory, when the device or codec isn't supported decoding falls back to software.
+ * \c pixelFormat is the format frames are delivered in, either \c BGR or \c Gray.
+ * Gray frames of YUV video are the luma plane itself, so no color conversion is made for transforms like Cascade that only need intensity.
+ * Select this gallery with the \c plugin argument, for example <tt>camera.mp4[plugin=libav,hwaccel=vaapi,pixelFormat=Gray]</tt>.
+ *
+ * Frames can be sampled before they are decoded rather than dropped afterwards, for example <tt>archive.mp4[plugin=libav,keyframes=true,gop=10]</tt>:
+ * - \c keyframes reads only key frames, the packets of other frames are never decoded.
+ * - \c skipNonReference has the decoder discard frames that no other frame references, such as most B-frames.
+ * - \c gop decodes only every gop-th group of pictures, the packets of the others are skipped.
+ * - \c interval seeks to the first key frame at least \c interval seconds after each returned frame.
+ * - \c n returns every n-th decoded frame, the others are never converted from the decoder's format.
+ */
+class libavGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(QString hwaccel READ get_hwaccel WRITE set_hwaccel RESET reset_hwaccel STORED false)
+    Q_PROPERTY(QString device READ get_device WRITE set_device RESET reset_device STORED false)
+    Q_PROPERTY(QString pixelFormat READ get_pixelFormat WRITE set_pixelFormat RESET reset_pixelFormat STORED false)
+    Q_PROPERTY(bool keyframes READ get_keyframes WRITE set_keyframes RESET reset_keyframes STORED false)
+    Q_PROPERTY(bool skipNonReference READ get_skipNonReference WRITE set_skipNonReference RESET reset_skipNonReference STORED false)
+    Q_PROPERTY(int gop READ get_gop WRITE set_gop RESET reset_gop STORED false)
+    Q_PROPERTY(float interval READ get_interval WRITE set_interval RESET reset_interval STORED false)
+    Q_PROPERTY(int n READ get_n WRITE set_n RESET reset_n STORED false)
+    BR_PROPERTY(QString, hwaccel, "")
+    BR_PROPERTY(QString, device, "") /*!< \brief Device to open for \c hwaccel, the LibAV default when empty. */
+    BR_PROPERTY(QString, pixelFormat, "BGR")
+    BR_PROPERTY(bool, keyframes, false)
+    BR_PROPERTY(bool, skipNonReference, false)
+    BR_PROPERTY(int, gop, 1)
+    BR_PROPERTY(float, interval, 0)
+    BR_PROPERTY(int, n, 1)
+
+public:
+    libavGallery()
+        : formatCtx(NULL), codecCtx(NULL), swsCtx(NULL), frame(NULL), swFrame(NULL), hwDevice(NULL),
+          hwPixelFormat(AV_PIX_FMT_NONE), streamID(-1), idx(0), decoded(0), keyframeIndex(-1), nextTimestamp(AV_NOPTS_VALUE), timeBase(0), fps(0), opened(false)
+    {
+        av_register_all();
+        avformat_network_init();
+    }
+
+    ~libavGallery()
+    {
+        release();
+    }
+
+protected:
+    AVFormatContext *formatCtx;
+    AVCodecContext *codecCtx;
+    SwsContext *swsCtx;
+    AVFrame *frame, *swFrame;
+    AVBufferRef *hwDevice;
+    OpenCVUtils::FramePool frames;
+    AVPixelFormat hwPixelFormat;
+    int streamID;
+    qint64 idx, decoded, keyframeIndex, nextTimestamp;
+    double timeBase, fps;
+    bool opened;
+
+    void open()
+    {
+        if (avformat_open_input(&formatCtx, QtUtils::getAbsolutePath(file.name).toStdString().c_str(), NULL, NULL) != 0)
+            qFatal("Failed to open %s for reading.", qPrintable(file.name));
+        if (avformat_find_stream_info(formatCtx, NULL) < 0)
+            qFatal("Failed to read stream info for %s.", qPrintable(file.name));
+
+        AVCodec *codec = NULL;
+        streamID = av_find_best_stream(formatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        if ((streamID < 0) || (codec == NULL))
+            qFatal("Failed to find a decodable video stream for %s", qPrintable(file.name));
+
+        AVStream *stream = formatCtx->streams[streamID];
+        timeBase = av_q2d(stream->time_base);
+        fps = av_q2d(stream->avg_frame_rate);
+        codecCtx = avcodec_alloc_context3(codec);
+        if (avcodec_parameters_to_context(codecCtx, stream->codecpar) < 0)
+            qFatal("Failed to read codec parameters for %s.", qPrintable(file.name));
+
+        if (!hwaccel.isEmpty())
+            openHardware(codec);
+
+        if (keyframes)             codecCtx->skip_frame = AVDISCARD_NONKEY;
+        else if (skipNonReference) codecCtx->skip_frame = AVDISCARD_NONREF;
+
+        if (avcodec_open2(codecCtx, codec, NULL) < 0)
+            qFatal("Could not open codec for file %s", qPrintable(file.name));
+
+        frame = av_frame_alloc();
+        swFrame = av_frame_alloc();
+        idx = decoded = 0;
+        keyframeIndex = -1;
+        nextTimestamp = AV_NOPTS_VALUE;
+        opened = true;
+    }
+
+#ifdef BR_LIBAV_HWACCEL
+    static AVPixelFormat hardwareFormat(AVCodecContext *ctx, const AVPixelFormat *formats)
+    {
+        const libavGallery *gallery = static_cast<const libavGallery*>(ctx->opaque);
+        for (const AVPixelFormat *format = formats; *format != AV_PIX_FMT_NONE; format++)
+            if (*format == gallery->hwPixelFormat)
+                return *format;
+
+        qWarning("Hardware decoding unavailable for %s, decoding in software.", qPrintable(gallery->file.name));
+        return avcodec_default_get_format(ctx, formats);
+    }
+
+    // The hardware pixel format the codec decodes to on a device of the given type, AV_PIX_FMT_NONE if it can't
+    static AVPixelFormat hardwarePixelFormat(const AVCodec *codec, AVHWDeviceType type)
+    {
+        for (int i=0;; i++) {
+            const AVCodecHWConfig *config = avcodec_get_hw_config(codec, i);
+            if (config == NULL)
+                return AV_PIX_FMT_NONE;
+            if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && (config->device_type == type))
+                return config->pix_fmt;
+        }
+    }
+
+    void openHardware(AVCodec *codec)
+    {
+        QList<AVHWDeviceType> types;
+        if (hwaccel == "auto") {
+            for (AVHWDeviceType type = av_hwdevice_iterate_types(AV_HWDEVICE_TYPE_NONE); type != AV_HWDEVICE_TYPE_NONE; type = av_hwdevice_iterate_types(type))
+                types.append(type);
+        } else {
+            const AVHWDeviceType type = av_hwdevice_find_type_by_name(qPrintable(hwaccel));
+            if (type == AV_HWDEVICE_TYPE_NONE)
+                qWarning("Unknown hardware device type %s, decoding in software.", qPrintable(hwaccel));
+            else
+                types.append(type);
+        }
+
+        foreach (AVHWDeviceType type, types) {
+            hwPixelFormat = hardwarePixelFormat(codec, type);
+            if (hwPixelFormat == AV_PIX_FMT_NONE)
+                continue;
+            if (av_hwdevice_ctx_create(&hwDevice, type, device.isEmpty() ? NULL : qPrintable(device), NULL, 0) < 0)
+                continue;
+
+            codecCtx->hw_device_ctx = av_buffer_ref(hwDevice);
+            codecCtx->opaque = this;
+            codecCtx->get_format = hardwareFormat;
+            return;
+        }
+
+        hwPixelFormat = AV_PIX_FMT_NONE;
+        if (!types.isEmpty())
+            qWarning("No %s device can decode %s, decoding in software.", qPrintable(hwaccel), qPrintable(file.name));
+    }
+#else // not BR_LIBAV_HWACCEL
+    void openHardware(AVCodec *codec)
+    {
+        (void) codec;
+        qWarning("Hardware decoding requires FFmpeg 4.0 or later, decoding %s in software.", qPrintable(file.name));
+    }
+#endif // BR_LIBAV_HWACCEL
+
+    // Whether a packet of the video stream should reach the decoder
+    bool sample(const AVPacket &packet)
+    {
+        const bool key = (packet.flags & AV_PKT_FLAG_KEY) != 0;
+        if (key)
+            keyframeIndex++;
+        if (keyframes && !key)
+            return false;
+        return (gop <= 1) || ((keyframeIndex >= 0) && (keyframeIndex % gop == 0));
+    }
+
+    // Seek to the first key frame at least interval seconds after the given timestamp, returns false past the end of the stream
+    bool seekAfter(qint64 pts)
+    {
+        nextTimestamp = pts + qint64(interval / timeBase);
+        if (avformat_seek_file(formatCtx, streamID, nextTimestamp, nextTimestamp, INT64_MAX, 0) < 0)
+            return false;
+        avcodec_flush_buffers(codecCtx);
+        keyframeIndex = -1;
+        return true;
+    }
+
+    // Decode the next frame of the video stream, returns false at the end of the stream
+    bool decode()
+    {
+        AVPacket packet;
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+
+        forever {
+            const int status = avcodec_receive_frame(codecCtx, frame);
+            if (status == 0)
+                return true;
+            if (status != AVERROR(EAGAIN))
+                return false;
+
+            // Once the input is exhausted the decoder is drained of the frames it still holds
+            if (av_read_frame(formatCtx, &packet) < 0) {
+                if (avcodec_send_packet(codecCtx, NULL) < 0)
+                    return false;
+                continue;
+            }
+            if ((packet.stream_index == streamID) && sample(packet))
+                avcodec_send_packet(codecCtx, &packet);
+            av_packet_unref(&packet);
+        }
+    }
+
+    // The decoded frame in memory and in the requested pixel format
+    Mat convert()
+    {
+        AVFrame *source = frame;
+#ifdef BR_LIBAV_HWACCEL
+        if ((hwPixelFormat != AV_PIX_FMT_NONE) && (frame->format == hwPixelFormat)) {
+            av_frame_unref(swFrame);
+            if (av_hwframe_transfer_data(swFrame, frame, 0) < 0)
+                return Mat();
+            source = swFrame;
+        }
+#endif // BR_LIBAV_HWACCEL
+
+        const bool gray = (pixelFormat == "Gray");
+        const AVPixelFormat format = AVPixelFormat(source->format);
+        const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(format);
+        if (gray && descriptor && !(descriptor->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL)) &&
+            (descriptor->comp[0].plane == 0) && (descriptor->comp[0].step == 1) && (descriptor->comp[0].depth == 8)) {
+            // The luma plane of 8-bit YUV is already the gray image
+            Mat m = frames.get(source->height, source->width, CV_8UC1);
+            Mat(source->height, source->width, CV_8UC1, source->data[0], source->linesize[0]).copyTo(m);
+            return m;
+        }
+
+        // Frames are converted straight into a recycled buffer
+        Mat m = frames.get(source->height, source->width, gray ? CV_8UC1 : CV_8UC3);
+        swsCtx = sws_getCachedContext(swsCtx, source->width, source->height, format,
+                                      source->width, source->height, gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_BGR24,
+                                      SWS_BILINEAR, NULL, NULL, NULL);
+        uint8_t *data[4] = { m.data, NULL, NULL, NULL };
+        int linesize[4] = { int(m.step), 0, 0, 0 };
+        sws_scale(swsCtx, source->data, source->linesize, 0, source->height, data, linesize);
+        return m;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (!opened)
+            open();
+
+        *done = false;
+        qint64 pts = AV_NOPTS_VALUE;
+        forever {
+            if ((nextTimestamp == INT64_MAX) || !decode()) {
+                release();
+                *done = true;
+                return TemplateList();
+            }
+
+            // Frames decoded before a seek target, and all but every n-th frame, are dropped unconverted
+            pts = av_frame_get_best_effort_timestamp(frame);
+            if ((nextTimestamp != AV_NOPTS_VALUE) && (pts != AV_NOPTS_VALUE) && (pts < nextTimestamp))
+                continue;
+            if (decoded++ % std::max(n, 1) == 0)
+                break;
+        }
+
+        Template output;
+        output.file = file;
+        output.m() = convert();
+        if (!output.m().data) {
+            release();
+            *done = true;
+            return TemplateList();
+        }
+
+        const QString URL = file.get<QString>("URL", file.name);
+        output.file.set("URL", URL + "#t=" + QString::number((int)(pts * timeBase)) + "s");
+        output.file.set("timestamp", QString::number((qint64)(pts * timeBase * 1000)));
+        output.file.set("frame", (fps > 0) ? qint64(pts * timeBase * fps + 0.5) : decoded-1);
+        output.file.set("progress", idx);
+        idx++;
+
+        if ((interval > 0) && (pts != AV_NOPTS_VALUE) && !seekAfter(pts))
+            nextTimestamp = INT64_MAX; // Nothing further to seek to
+
+        TemplateList dst;
+        dst.append(output);
+        return dst;
+    }
+
+    void release()
+    {
+        if (swsCtx)    sws_freeContext(swsCtx);
+        if (frame)     av_frame_free(&frame);
+        if (swFrame)   av_frame_free(&swFrame);
+        if (codecCtx)  avcodec_free_context(&codecCtx);
+        if (formatCtx) avformat_close_input(&formatCtx);
+        if (hwDevice)  av_buffer_unref(&hwDevice);
+        swsCtx = NULL;
+        opened = false;
+    }
+
+    void write(const Template &t)
+    {
+        (void)t; qFatal("Not implemented");
+    }
+};
+
+BR_REGISTER(Gallery, libavGallery)
+
+} // namespace br
+
+#include "gallery/libav.moc"
@@ -0,0 +1,281 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup initializers
+ * \brief Initialization support for mgalGallery.
+ *
+ * Mappings are retained until finalization because templates read from them reference the mapped memory.
+ */
+class MappedGalleries : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        mappings.clear();
+        retired.clear();
+    }
+
+public:
+    struct Mapping
+    {
+        QFile file;
+        const uchar *data;
+        qint64 size;
+
+        Mapping(const QString &fileName) : file(fileName), data(NULL), size(0) {}
+        ~Mapping() { if (data) file.unmap(const_cast<uchar*>(data)); }
+    };
+
+    static QHash<QString, QSharedPointer<Mapping> > mappings;
+    static QList< QSharedPointer<Mapping> > retired; // Superseded mappings that may still be referenced
+    static QMutex lock;
+
+    static QSharedPointer<Mapping> map(const QString &fileName)
+    {
+        QMutexLocker locker(&lock);
+        const QString key = QFileInfo(fileName).absoluteFilePath();
+        const qint64 size = QFileInfo(fileName).size();
+        if (!mappings.contains(key) || (mappings[key]->size != size)) {
+            if (mappings.contains(key))
+                retired.append(mappings.take(key));
+            QSharedPointer<Mapping> mapping(new Mapping(fileName));
+            if (!mapping->file.open(QFile::ReadOnly))
+                qFatal("Can't open gallery: %s for reading", qPrintable(fileName));
+            mapping->size = mapping->file.size();
+            if (mapping->size > 0) {
+                mapping->data = mapping->file.map(0, mapping->size);
+                if (!mapping->data)
+                    qFatal("Failed to map gallery: %s", qPrintable(fileName));
+            }
+            mappings.insert(key, mapping);
+        }
+        return mappings[key];
+    }
+};
+
+QHash<QString, QSharedPointer<MappedGalleries::Mapping> > MappedGalleries::mappings;
+QList< QSharedPointer<MappedGalleries::Mapping> > MappedGalleries::retired;
+QMutex MappedGalleries::lock;
+
+BR_REGISTER(Initializer, MappedGalleries)
+
+/*!
+ * \ingroup galleries
+ * \brief A memory-mapped binary gallery for read-only template storage.
+ *
+ * Templates are laid out so that every matrix is 64-byte aligned.
+ * When read, matrices are headers pointing directly into the mapped file rather than copies,
+ * so loading is proportional to the metadata size and processes reading the same gallery share the page cache.
+ * Matrices read from this gallery are read-only and remain valid until br::Context::finalize().
+ *
+ * Layout (native byte order):
+ * \verbatim
+   header   : char magic[8] = "BRMGAL\0\0", quint32 version, quint32 reserved
+   template : quint32 metadata bytes, br::File (QDataStream), quint32 matrices, matrix...
+   matrix   : qint32 rows, qint32 cols, qint32 type, padding to 64 bytes, data
+   \endverbatim
+ */
+class mgalGallery : public Gallery
+{
+    Q_OBJECT
+
+    static const int alignment = 64;
+    static const quint32 version = 1;
+
+    QSharedPointer<MappedGalleries::Mapping> mapping;
+    qint64 offset, writePosition;
+    QFile gallery;
+
+    static const char *magic() { return "BRMGAL\0\0"; }
+    static qint64 align(qint64 position) { return (position + alignment - 1) / alignment * alignment; }
+
+    void init()
+    {
+        offset = writePosition = 0;
+        Gallery::init();
+    }
+
+    void readOpen()
+    {
+        if (mapping)
+            return;
+
+        mapping = MappedGalleries::map(file);
+        if ((mapping->size < 16) || memcmp(mapping->data, magic(), 8))
+            qFatal("%s is not a mapped gallery.", qPrintable(file.name));
+        const quint32 fileVersion = *reinterpret_cast<const quint32*>(mapping->data + 8);
+        if (fileVersion != version)
+            qFatal("Unsupported mapped gallery version %d in %s, expected %d.", fileVersion, qPrintable(file.name), version);
+        offset = 16;
+    }
+
+    void writeOpen()
+    {
+        if (gallery.isOpen())
+            return;
+
+        gallery.setFileName(file);
+        if (file.get<bool>("remove"))
+            gallery.remove();
+        QtUtils::touchDir(gallery);
+
+        const bool append = file.get<bool>("append") && gallery.exists() && (gallery.size() > 0);
+        if (!gallery.open(append ? (QFile::ReadWrite | QFile::Append) : QFile::WriteOnly))
+            qFatal("Can't open gallery: %s for writing", qPrintable(gallery.fileName()));
+
+        writePosition = gallery.size();
+        if (!append) {
+            const quint32 header[2] = { version, 0 };
+            writeData(magic(), 8);
+            writeData((const char*) header, sizeof(header));
+        }
+    }
+
+    void writeData(const char *data, qint64 size)
+    {
+        if (gallery.write(data, size) != size)
+            qFatal("Failed to write to gallery: %s", qPrintable(gallery.fileName()));
+        writePosition += size;
+    }
+
+    template <typename T>
+    T take()
+    {
+        if (offset + qint64(sizeof(T)) > mapping->size)
+            qFatal("Unexpected end of mapped gallery %s.", qPrintable(file.name));
+        const T value = *reinterpret_cast<const T*>(mapping->data + offset);
+        offset += sizeof(T);
+        return value;
+    }
+
+    Template readTemplate()
+    {
+        Template t;
+
+        const quint32 metadataBytes = take<quint32>();
+        if (offset + metadataBytes > mapping->size)
+            qFatal("Unexpected end of mapped gallery %s.", qPrintable(file.name));
+        QDataStream metadata(QByteArray::fromRawData(reinterpret_cast<const char*>(mapping->data + offset), metadataBytes));
+        metadata.setVersion(QDataStream::Qt_5_0);
+        metadata >> t.file;
+        offset += metadataBytes;
+
+        const quint32 matrices = take<quint32>();
+        for (quint32 i=0; i<matrices; i++) {
+            const qint32 rows = take<qint32>();
+            const qint32 cols = take<qint32>();
+            const qint32 type = take<qint32>();
+            offset = align(offset);
+            const qint64 bytes = qint64(rows) * cols * CV_ELEM_SIZE(type);
+            if (offset + bytes > mapping->size)
+                qFatal("Unexpected end of mapped gallery %s.", qPrintable(file.name));
+            if (bytes > 0) t.append(cv::Mat(rows, cols, type, const_cast<uchar*>(mapping->data + offset)));
+            else           t.append(cv::Mat());
+            offset += bytes;
+        }
+        return t;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readOpen();
+        if (offset >= mapping->size)
+            offset = 16;
+
+        TemplateList templates;
+        while ((templates.size() < readBlockSize) && (offset < mapping->size)) {
+            templates.append(readTemplate());
+            templates.last().file.set("progress", position());
+        }
+
+        *done = offset >= mapping->size;
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+        writeOpen();
+
+        QByteArray metadata;
+        QDataStream stream(&metadata, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_0);
+
+        // Only write metadata for failure to enroll, but remove any stored QVariants of type cv::Mat
+        QList<cv::Mat> matrices = t;
+        if (t.file.fte) {
+            File f = t.file;
+            foreach (const QString &key, f.localKeys())
+                if (strcmp(f.value(key).typeName(), "cv::Mat") == 0)
+                    f.remove(key);
+            stream << f;
+            matrices.clear();
+        } else {
+            stream << t.file;
+        }
+
+        const quint32 metadataBytes = metadata.size();
+        writeData((const char*) &metadataBytes, sizeof(quint32));
+        writeData(metadata.data(), metadataBytes);
+
+        const quint32 count = matrices.size();
+        writeData((const char*) &count, sizeof(quint32));
+        foreach (const cv::Mat &matrix, matrices) {
+            const cv::Mat m = matrix.isContinuous() ? matrix : matrix.clone();
+            const qint32 header[3] = { m.rows, m.cols, m.type() };
+            writeData((const char*) header, sizeof(header));
+            const qint64 padding = align(writePosition) - writePosition;
+            if (padding > 0)
+                writeData(QByteArray(padding, '\0').data(), padding);
+            writeData((const char*) m.data, qint64(m.rows) * m.cols * m.elemSize());
+        }
+    }
+
+    qint64 totalSize()
+    {
+        readOpen();
+        return mapping->size;
+    }
+
+    qint64 position()
+    {
+        return offset;
+    }
+
+public:
+    ~mgalGallery()
+    {
+        gallery.close();
+    }
+};
+
+BR_REGISTER(Gallery, mgalGallery)
+
+} // namespace br
+
+#include "gallery/mapped.moc"
@@ -15,10 +15,79 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/memory.h>
 
 namespace br
 {
 
+/*!
+ * \brief Templates of a single fixed-size matrix, packed one per row of a contiguous matrix.
+ *
+ * Metadata is held column-wise, one vector of values per key, so templates don't each carry a separate map.
+ * Templates read back reference their row of the packed matrix rather than a copy of it.
+ */
+struct PackedTemplates
+{
+    cv::Mat features;
+    int rows, cols, type;
+    QVector<QString> names;
+    QVector<bool> valid; // False for templates that failed to enroll
+    QHash<QString, QVector<QVariant> > metadata; // Null where unset
+
+    PackedTemplates() : rows(0), cols(0), type(-1) {}
+
+    int size() const
+    {
+        return names.size();
+    }
+
+    void append(const Template &t)
+    {
+        const bool empty = t.isEmpty() || t.m().empty();
+        if (!empty) {
+            if ((t.size() != 1) || !t.m().isContinuous())
+                qFatal("Packed memory galleries require templates of a single continuous matrix.");
+            if (type == -1) {
+                rows = t.m().rows;
+                cols = t.m().cols;
+                type = t.m().type();
+                features = cv::Mat(0, rows*cols, type);
+                features.push_back(cv::Mat::zeros(names.size(), rows*cols, type));
+            } else if ((t.m().rows != rows) || (t.m().cols != cols) || (t.m().type() != type)) {
+                qFatal("Packed memory galleries require templates of the same size and type.");
+            }
+        }
+
+        const int index = names.size();
+        names.append(t.file.name);
+        valid.append(!empty);
+        if (type != -1)
+            features.push_back(empty ? cv::Mat(cv::Mat::zeros(1, rows*cols, type)) : t.m().reshape(0, 1));
+
+        for (QHash<QString, QVector<QVariant> >::iterator it = metadata.begin(); it != metadata.end(); ++it)
+            it.value().append(QVariant());
+        const QVariantMap local = t.file.localMetadata();
+        for (QVariantMap::const_iterator it = local.begin(); it != local.end(); ++it) {
+            QVector<QVariant> &column = metadata[it.key()];
+            column.resize(index+1);
+            column[index] = it.value();
+        }
+    }
+
+    Template at(int index) const
+    {
+        File file(names[index]);
+        for (QHash<QString, QVector<QVariant> >::const_iterator it = metadata.begin(); it != metadata.end(); ++it)
+            if (it.value()[index].isValid())
+                file.set(it.key(), it.value()[index]);
+
+        Template t(file);
+        if (valid[index]) t.append(features.row(index).reshape(0, rows));
+        else              t.append(cv::Mat());
+        return t;
+    }
+};
+
 /*!
  * \ingroup initializers
  * \brief Initialization support for memGallery.
@@ -33,41 +102,71 @@ class MemoryGalleries : public Initializer
     void finalize() const
     {
         galleries.clear();
+        packedGalleries.clear();
+        memory.freed(memory.current());
     }
 
 public:
+    static const MemoryAccount memory; /*!< \brief Bytes of templates held by memory galleries. */
     static QHash<File, TemplateList> galleries; /*!< TODO */
+    static QHash<File, PackedTemplates> packedGalleries; /*!< \brief Galleries stored with \c packed. */
 };
 
 QHash<File, TemplateList> MemoryGalleries::galleries;
+QHash<File, PackedTemplates> MemoryGalleries::packedGalleries;
+const MemoryAccount MemoryGalleries::memory("memGallery");
 
 BR_REGISTER(Initializer, MemoryGalleries)
 
 /*!
  * \ingroup galleries
  * \brief A gallery held in memory.
+ *
+ * If \c packed is true, templates must each be a single matrix of the same size and type,
+ * and are stored as rows of one contiguous matrix with their metadata stored column-wise.
  * \author Josh Klontz \cite jklontz
  */
 class memGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool packed READ get_packed WRITE set_packed RESET reset_packed STORED false)
+    BR_PROPERTY(bool, packed, false)
+
     int block;
-    qint64 gallerySize;
 
     void init()
     {
         block = 0;
         File galleryFile = file.name.mid(0, file.name.size()-4);
-        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::galleries.contains(file)) {
+        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::galleries.contains(file) && !MemoryGalleries::packedGalleries.contains(file)) {
             QSharedPointer<Gallery> gallery(Factory<Gallery>::make(galleryFile));
-            MemoryGalleries::galleries[file] = gallery->read();
-            gallerySize = MemoryGalleries::galleries[file].size();
+            if (packed) {
+                // Pack block by block so the gallery is never held twice
+                PackedTemplates &templates = MemoryGalleries::packedGalleries[file];
+                bool done = false;
+                while (!done)
+                    foreach (const Template &t, gallery->readBlock(&done)) {
+                        templates.append(t);
+                        MemoryGalleries::memory.allocated(t.bytes());
+                    }
+            } else {
+                const TemplateList templates = gallery->read();
+                MemoryGalleries::galleries[file] = templates;
+                MemoryGalleries::memory.allocated(templates.bytes<qint64>());
+            }
         }
     }
 
     TemplateList readBlock(bool *done)
     {
-        TemplateList templates = MemoryGalleries::galleries[file].mid(block*readBlockSize, readBlockSize);
+        TemplateList templates;
+        if (packed) {
+            const PackedTemplates &packedTemplates = MemoryGalleries::packedGalleries[file];
+            for (int i=block*readBlockSize; i<std::min(packedTemplates.size(), (block+1)*readBlockSize); i++)
+                templates.append(packedTemplates.at(i));
+        } else {
+            templates = MemoryGalleries::galleries[file].mid(block*readBlockSize, readBlockSize);
+        }
         for (qint64 i = 0; i < templates.size();i++) {
             templates[i].file.set("progress", i + block * readBlockSize);
         }
@@ -79,12 +178,14 @@ class memGallery : public Gallery
 
     void write(const Template &t)
     {
-        MemoryGalleries::galleries[file].append(t);
+        if (packed) MemoryGalleries::packedGalleries[file].append(t);
+        else        MemoryGalleries::galleries[file].append(t);
+        MemoryGalleries::memory.allocated(t.bytes());
     }
 
     qint64 totalSize()
     {
-        return gallerySize;
+        return packed ? MemoryGalleries::packedGalleries[file].size() : MemoryGalleries::galleries[file].size();
     }
 
     qint64 position()
@@ -114,7 +215,7 @@ FileList FileList::fromGallery(const File &rFile, bool cache)
 
     TemplateList templates;
     // OK we read the data in some form, does the gallery type containing matrices?
-    if ((QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
+    if ((QStringList() << "gal" << "mgal" << "ivf" << "hnsw" << "shards" << "mem" << "template" << "ut").contains(file.suffix())) {
         // Retrieve it block by block, dropping matrices from read templates.
         QScopedPointer<Gallery> gallery(Gallery::make(file));
         gallery->set_readBlockSize(10);
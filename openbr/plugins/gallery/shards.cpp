@@ -0,0 +1,297 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QLockFile>
+#include <QSaveFile>
+#include <QtConcurrent>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \brief The segments and tombstones of a shards gallery.
+ *
+ * Stored as text in the gallery's \c manifest file, one segment, tombstone or obsolete segment per line.
+ * Each segment and tombstone has a generation, and a tombstone deletes the templates with its name from every older segment.
+ */
+struct ShardManifest
+{
+    typedef QPair<int, QString> Entry; // Generation and name
+
+    QList<Entry> segments, tombstones;
+    QStringList obsolete; // Segments replaced by a merge, removed by the next merge
+    QHash<QString, int> deleted; // Newest tombstone generation of each name
+    int next;
+
+    ShardManifest() : next(0) {}
+
+    static QString path(const QString &dir)
+    {
+        return dir + "/manifest";
+    }
+
+    static ShardManifest read(const QString &dir)
+    {
+        ShardManifest manifest;
+        QFile file(path(dir));
+        if (!file.open(QFile::ReadOnly | QFile::Text))
+            return manifest;
+
+        while (!file.atEnd()) {
+            const QString line = QString::fromUtf8(file.readLine()).trimmed();
+            const QString type = line.section(' ', 0, 0);
+            if (type == "next") {
+                manifest.next = line.section(' ', 1, 1).toInt();
+            } else if (type == "obsolete") {
+                manifest.obsolete.append(line.section(' ', 1));
+            } else if ((type == "segment") || (type == "tombstone")) {
+                const Entry entry(line.section(' ', 1, 1).toInt(), line.section(' ', 2));
+                if (type == "segment") manifest.segments.append(entry);
+                else                   manifest.tombstones.append(entry);
+            } else if (!line.isEmpty()) {
+                qFatal("Invalid shards manifest line: %s", qPrintable(line));
+            }
+        }
+
+        foreach (const Entry &tombstone, manifest.tombstones)
+            manifest.deleted[tombstone.second] = std::max(manifest.deleted.value(tombstone.second, -1), tombstone.first);
+        return manifest;
+    }
+
+    // Replaces the manifest atomically, so readers always see a consistent set of segments
+    void write(const QString &dir) const
+    {
+        QSaveFile file(path(dir));
+        if (!file.open(QFile::WriteOnly | QFile::Text))
+            qFatal("Can't open shards manifest %s for writing.", qPrintable(file.fileName()));
+
+        QStringList lines;
+        lines.append("next " + QString::number(next));
+        foreach (const Entry &segment, segments)
+            lines.append("segment " + QString::number(segment.first) + " " + segment.second);
+        foreach (const Entry &tombstone, tombstones)
+            lines.append("tombstone " + QString::number(tombstone.first) + " " + tombstone.second);
+        foreach (const QString &segment, obsolete)
+            lines.append("obsolete " + segment);
+
+        file.write((lines.join("\n") + "\n").toUtf8());
+        if (!file.commit())
+            qFatal("Failed to write shards manifest %s.", qPrintable(file.fileName()));
+    }
+
+    bool isDeleted(const QString &name, int generation) const
+    {
+        return deleted.value(name, -1) > generation;
+    }
+};
+
+/*!
+ * \ingroup galleries
+ * \brief An append-only directory of immutable .gal segments, for galleries that grow and shrink while being searched.
+ *
+ * Written templates are buffered and committed as a new segment every \c segmentSize templates and when the gallery is closed.
+ * Writing a template with the \c tombstone metadata key set deletes every previously written template with the same file name, without rewriting any segment.
+ * Once more than \c maxSegments segments exist, a background merge compacts them into one segment with the deleted templates removed.
+ * Reading takes a snapshot of the manifest, so searches see a consistent gallery while others append, delete and merge.
+ * Segments replaced by a merge are removed by the following merge, so readers of an older snapshot can finish.
+ */
+class shardsGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int segmentSize READ get_segmentSize WRITE set_segmentSize RESET reset_segmentSize STORED false)
+    Q_PROPERTY(int maxSegments READ get_maxSegments WRITE set_maxSegments RESET reset_maxSegments STORED false)
+    BR_PROPERTY(int, segmentSize, 10000) /*!< \brief Templates buffered before a segment is committed. */
+    BR_PROPERTY(int, maxSegments, 8) /*!< \brief Segments allowed before a merge is started. */
+
+    TemplateList pending;
+    ShardManifest snapshot;
+    bool reading;
+    int segment;
+    qint64 count;
+    QScopedPointer<Gallery> current;
+    QFuture<void> merge;
+
+    void init()
+    {
+        QtUtils::touchDir(QDir(file.name));
+        reading = false;
+        segment = 0;
+        count = 0;
+    }
+
+    ~shardsGallery()
+    {
+        commit();
+        merge.waitForFinished();
+    }
+
+    static QString segmentPath(const QString &dir, const QString &name)
+    {
+        return dir + "/" + name;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (!reading) {
+            snapshot = ShardManifest::read(file.name);
+            reading = true;
+            segment = 0;
+            count = 0;
+        }
+
+        while (segment < snapshot.segments.size()) {
+            const ShardManifest::Entry &entry = snapshot.segments[segment];
+            if (current.isNull()) {
+                current.reset(Gallery::make(segmentPath(file.name, entry.second)));
+                current->set_readBlockSize(readBlockSize);
+            }
+
+            bool segmentDone;
+            TemplateList templates = current->readBlock(&segmentDone);
+            if (segmentDone) {
+                current.reset();
+                segment++;
+            }
+
+            for (int i=templates.size()-1; i>=0; i--)
+                if (snapshot.isDeleted(templates[i].file.name, entry.first))
+                    templates.removeAt(i);
+            if (templates.isEmpty())
+                continue;
+
+            for (int i=0; i<templates.size(); i++)
+                templates[i].file.set("progress", count++);
+            *done = segment >= snapshot.segments.size();
+            reading = !*done;
+            return templates;
+        }
+
+        *done = true;
+        reading = false;
+        return TemplateList();
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        if (t.file.getBool("tombstone")) {
+            // Pending templates predate the tombstone, commit them so it applies
+            commit();
+            QLockFile lock(file.name + "/manifest.lock");
+            lock.lock();
+            ShardManifest manifest = ShardManifest::read(file.name);
+            manifest.tombstones.append(ShardManifest::Entry(manifest.next, t.file.name));
+            manifest.write(file.name);
+            return;
+        }
+
+        pending.append(t);
+        if (pending.size() >= segmentSize)
+            commit();
+    }
+
+    void commit()
+    {
+        if (pending.isEmpty())
+            return;
+
+        int segments;
+        {
+            QLockFile lock(file.name + "/manifest.lock");
+            lock.lock();
+            ShardManifest manifest = ShardManifest::read(file.name);
+            const int generation = manifest.next++;
+            const QString name = QString("segment-%1.gal").arg(generation);
+            {
+                QScopedPointer<Gallery> gallery(Gallery::make(segmentPath(file.name, name)));
+                gallery->writeBlock(pending);
+            }
+            manifest.segments.append(ShardManifest::Entry(generation, name));
+            manifest.write(file.name);
+            segments = manifest.segments.size();
+        }
+        pending.clear();
+
+        if ((segments > maxSegments) && merge.isFinished())
+            merge = QtConcurrent::run(&shardsGallery::compact, QString(file.name));
+    }
+
+    // Merges every committed segment into one, dropping deleted templates
+    static void compact(const QString dir)
+    {
+        QLockFile merging(dir + "/merge.lock");
+        if (!merging.tryLock(0))
+            return; // Another process is merging
+
+        const ShardManifest before = ShardManifest::read(dir);
+        if (before.segments.size() < 2)
+            return;
+
+        int newest = -1;
+        foreach (const ShardManifest::Entry &entry, before.segments)
+            newest = std::max(newest, entry.first);
+        const QString name = QString("merged-%1-%2.gal").arg(newest).arg(before.next);
+
+        {
+            QScopedPointer<Gallery> merged(Gallery::make(segmentPath(dir, name)));
+            foreach (const ShardManifest::Entry &entry, before.segments) {
+                QScopedPointer<Gallery> gallery(Gallery::make(segmentPath(dir, entry.second)));
+                TemplateList templates;
+                foreach (const Template &t, gallery->read())
+                    if (!before.isDeleted(t.file.name, entry.first))
+                        templates.append(t);
+                merged->writeBlock(templates);
+            }
+        }
+
+        QLockFile lock(dir + "/manifest.lock");
+        lock.lock();
+        ShardManifest after = ShardManifest::read(dir);
+
+        // Segments committed during the merge are newer than every merged segment and are kept
+        QList<ShardManifest::Entry> segments;
+        segments.append(ShardManifest::Entry(newest, name));
+        foreach (const ShardManifest::Entry &entry, after.segments)
+            if (!before.segments.contains(entry))
+                segments.append(entry);
+        after.segments = segments;
+
+        // Tombstones no newer than the merged segment only apply to segments that were merged
+        QList<ShardManifest::Entry> tombstones;
+        foreach (const ShardManifest::Entry &tombstone, after.tombstones)
+            if (tombstone.first > newest)
+                tombstones.append(tombstone);
+        after.tombstones = tombstones;
+
+        foreach (const QString &obsolete, after.obsolete)
+            QFile::remove(segmentPath(dir, obsolete));
+        after.obsolete.clear();
+        foreach (const ShardManifest::Entry &entry, before.segments)
+            after.obsolete.append(entry.second);
+        after.write(dir);
+    }
+};
+
+BR_REGISTER(Gallery, shardsGallery)
+
+} // namespace br
+
+#include "gallery/shards.moc"
@@ -17,6 +17,7 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
@@ -68,10 +69,11 @@ public:
             return TemplateList();
         }
 
-        // This clone is critical, if we don't do it then the output matrix will
+        // This copy is critical, if we don't do it then the output matrix will
         // be an alias of an internal buffer of the video source, leading to various
-        // problems later.
-        output.m() = temp.clone();
+        // problems later. Copying into a recycled buffer avoids allocating every frame.
+        output.m() = frames.get(temp.rows, temp.cols, temp.type());
+        temp.copyTo(output.m());
 
         output.file.set("progress", idx);
         idx++;
@@ -89,6 +91,7 @@ public:
 
 protected:
     cv::VideoCapture video;
+    OpenCVUtils::FramePool frames;
 };
 
 BR_REGISTER(Gallery,videoGallery)
@@ -14,10 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtXml>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/bee.h>
+#include <openbr/core/filelistcache.h>
 
 namespace br
 {
@@ -25,150 +24,76 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief A \ref sigset input.
+ *
+ * Blocks are streamed with BEE::SigsetReader, reading the whole gallery parses it in parallel with BEE::readSigset.
+ * Whole reads are cached in a FileListCache next to the sigset unless \c cache is false.
  * \author Josh Klontz \cite jklontz
  */
 class xmlGallery : public FileGallery
 {
     Q_OBJECT
     Q_PROPERTY(bool ignoreMetadata READ get_ignoreMetadata WRITE set_ignoreMetadata RESET reset_ignoreMetadata STORED false)
+    Q_PROPERTY(bool cache READ get_cache WRITE set_cache RESET reset_cache STORED false)
     BR_PROPERTY(bool, ignoreMetadata, false)
-    FileList files;
-
-    QXmlStreamReader reader;
+    BR_PROPERTY(bool, cache, true)
+    FileList written;
 
-    QString currentSignatureName;
-    bool signatureActive;
+    QScopedPointer<BEE::SigsetReader> reader;
+    File next;
+    bool hasNext;
 
     ~xmlGallery()
     {
         f.close();
-        if (!files.isEmpty())
-            BEE::writeSigset(file, files, ignoreMetadata);
+        if (!written.isEmpty())
+            BEE::writeSigset(file, written, ignoreMetadata);
     }
 
-    TemplateList readBlock(bool *done)
+    TemplateList read()
+    {
+        return files();
+    }
+
+    FileList files()
     {
-        if (readOpen())
-            reader.setDevice(&f);
+        // The arguments the gallery was opened with
+        File arguments = file;
+        arguments.name.clear();
+        const QString parameters = arguments.flat() + (ignoreMetadata ? "ignoreMetadata" : "");
+        FileList fileList;
+        if (cache && FileListCache::read(f.fileName(), parameters, fileList))
+            return fileList;
+        fileList = BEE::readSigset(file, ignoreMetadata);
+        if (cache)
+            FileListCache::write(f.fileName(), parameters, fileList);
+        return fileList;
+    }
 
-        if (reader.atEnd())
+    TemplateList readBlock(bool *done)
+    {
+        if (readOpen() || reader.isNull()) {
             f.seek(0);
+            reader.reset(new BEE::SigsetReader(&f, file, ignoreMetadata));
+            hasNext = reader->read(next);
+        }
 
+        // One presentation is read ahead so done is only set when none remain
         TemplateList templates;
-        qint64 count = 0;
-
-        while (!reader.atEnd())
-        {
-            // if an identity is active we try to read presentations
-            if (signatureActive)
-            {
-                while (signatureActive)
-                {
-                    QXmlStreamReader::TokenType signatureToken = reader.readNext();
-
-                    // did the signature end?
-                    if (signatureToken == QXmlStreamReader::EndElement && reader.name() == "biometric-signature") {
-                        signatureActive = false;
-                        break;
-                    }
-
-                    // did we reach the end of the document? Theoretically this shoudln't happen without reaching the end of
-                    if (signatureToken == QXmlStreamReader::EndDocument)
-                        break;
-
-                    // a presentation!
-                    if (signatureToken == QXmlStreamReader::StartElement && reader.name() == "presentation") {
-                        templates.append(Template(File("",currentSignatureName)));
-                        foreach (const QXmlStreamAttribute &attribute, reader.attributes()) {
-                            // file-name is stored directly on file, not as a key/value pair
-                            if (attribute.name() == "file-name")
-                                templates.last().file.name = attribute.value().toString();
-                            // other values are directly set as metadata
-                            else if (!ignoreMetadata) templates.last().file.set(attribute.name().toString(), attribute.value().toString());
-                        }
-
-                        // a presentation can have bounding boxes as child elements
-                        QList<QRectF> rects = templates.last().file.rects();
-                        while (true)
-                        {
-                            QXmlStreamReader::TokenType pToken = reader.readNext();
-                            if (pToken == QXmlStreamReader::EndElement && reader.name() == "presentation")
-                                break;
-
-                            if (pToken == QXmlStreamReader::StartElement)
-                            {
-                                if (reader.attributes().hasAttribute("x")
-                                    && reader.attributes().hasAttribute("y")
-                                    && reader.attributes().hasAttribute("width")
-                                    && reader.attributes().hasAttribute("height") )
-                                {
-                                    // get bounding box properties as attributes, just going to assume this all works
-                                    qreal x = reader.attributes().value("x").string()->toDouble();
-                                    qreal y = reader.attributes().value("y").string()->toDouble();
-                                    qreal width =  reader.attributes().value("width").string()->toDouble();
-                                    qreal height = reader.attributes().value("height").string()->toDouble();
-                                    rects += QRectF(x, y, width, height);
-                                }
-                            }
-                        }
-                        templates.last().file.setRects(rects);
-                        templates.last().file.set("progress", f.pos());
-
-                        // we read another complete template
-                        count++;
-                    }
-                }
-            }
-            // otherwise, keep reading elements until the next identity is reacehed
-            else
-            {
-                QXmlStreamReader::TokenType token = reader.readNext();
-
-                // end of file?
-                if (token == QXmlStreamReader::EndDocument)
-                    break;
-
-                // we are only interested in new elements
-                if (token != QXmlStreamReader::StartElement)
-                    continue;
-
-                QStringRef elName = reader.name();
-
-                // biometric-signature-set is the root element
-                if (elName == "biometric-signature-set")
-                    continue;
-
-                // biometric-signature -- an identity
-                if (elName == "biometric-signature")
-                {
-                    // read the name associated with the current signature
-                    if (!reader.attributes().hasAttribute("name"))
-                    {
-                        qDebug() << "Biometric signature missing name";
-                        continue;
-                    }
-                    currentSignatureName = reader.attributes().value("name").toString();
-                    signatureActive = true;
-
-                    // If we've already read enough templates for this block, then break here.
-                    // We wait untill the start of the next signature to be sure that done should
-                    // actually be false (i.e. there are actually items left in this file)
-                    if (count >= this->readBlockSize) {
-                        *done = false;
-                        return templates;
-                    }
-
-                }
-            }
+        while (hasNext && (templates.size() < readBlockSize)) {
+            templates.append(next);
+            templates.last().file.set("progress", f.pos());
+            hasNext = reader->read(next);
         }
-        *done = true;
 
+        *done = !hasNext;
+        if (*done)
+            reader.reset(); // The next block starts over
         return templates;
     }
 
     void write(const Template &t)
     {
-        files.append(t.file);
+        written.append(t.file);
     }
 
     void init()
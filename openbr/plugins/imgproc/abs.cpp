@@ -24,7 +24,7 @@ namespace br
  * \brief Computes the absolute value of each element.
  * \author Josh Klontz \cite jklontz
  */
-class AbsTransform : public UntrainableTransform
+class AbsTransform : public PixelTransform
 {
     Q_OBJECT
 
@@ -32,6 +32,16 @@ class AbsTransform : public UntrainableTransform
     {
         dst = cv::abs(src);
     }
+
+    int outputType(int type) const
+    {
+        return type;
+    }
+
+    void projectTile(const cv::Mat &src, cv::Mat &dst) const
+    {
+        cv::absdiff(src, cv::Scalar::all(0), dst);
+    }
 };
 
 BR_REGISTER(Transform, AbsTransform)
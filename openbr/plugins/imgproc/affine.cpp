@@ -72,7 +72,8 @@ private:
         return Point2f(a.x - dy, a.y + dx);
     }
 
-    void project(const Template &src, Template &dst) const
+    // Returns false when there aren't enough landmarks to register, in which case the image is only resized
+    bool registration(const Template &src, Template &dst, Mat &affineTransform) const
     {
         const bool twoPoints = ((x3 == -1) || (y3 == -1));
 
@@ -93,8 +94,7 @@ private:
             const QList<Point2f> landmarks = OpenCVUtils::toPoints(src.file.points());
 
             if ((landmarks.size() < 2) || (!twoPoints && (landmarks.size() < 3))) {
-                resize(src, dst, Size(width, height));
-                return;
+                return false;
             } else {
                 srcPoints[0] = landmarks[0];
                 srcPoints[1] = landmarks[1];
@@ -107,8 +107,7 @@ private:
         }
         if (twoPoints) srcPoints[2] = getThirdAffinePoint(srcPoints[0], srcPoints[1]);
 
-        Mat affineTransform = getAffineTransform(srcPoints, dstPoints);
-        warpAffine(src, dst, affineTransform, Size(width, height), method);
+        affineTransform = getAffineTransform(srcPoints, dstPoints);
         if (storeAffine) {
             QList<float> affineParams;
             for (int i = 0 ; i < 2; i++)
@@ -116,6 +115,74 @@ private:
                     affineParams.append(affineTransform.at<double>(i, j));
             dst.file.setList("affineParameters", affineParams);
         }
+        return true;
+    }
+
+    // Writes into a preallocated width x height output when one is given
+    void warp(const Mat &src, const Mat &affineTransform, Mat &dst) const
+    {
+        if (affineTransform.empty()) resize(src, dst, Size(width, height));
+        else                         warpAffine(src, dst, affineTransform, Size(width, height), method);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat affineTransform;
+        registration(src, dst, affineTransform);
+        Mat m;
+        warp(src, affineTransform, m);
+        dst = m;
+    }
+
+    struct BatchWarp : public ParallelLoopBody
+    {
+        const AffineTransform *transform;
+        const TemplateList *src;
+        const QList<Mat> *affineTransforms;
+        Mat *slots;
+
+        BatchWarp(const AffineTransform *transform, const TemplateList *src, const QList<Mat> *affineTransforms, Mat *slots)
+            : transform(transform), src(src), affineTransforms(affineTransforms), slots(slots) {}
+
+        void operator()(const Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+                transform->warp(src->at(i), affineTransforms->at(i), slots[i]);
+        }
+    };
+
+    // Many crops at once, e.g. every face in a frame after RectsToTemplates, are warped into views
+    // of one contiguous (templates x height) x width buffer instead of a fresh matrix each
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        bool batchable = (src.size() > 1);
+        for (int i=0; batchable && (i<src.size()); i++)
+            batchable = !src[i].isNull() && (src[i].m().type() == src.first().m().type());
+        if (!batchable) {
+            UntrainableTransform::project(src, dst);
+            return;
+        }
+
+        dst.reserve(src.size());
+        QList<Mat> affineTransforms;
+        for (int i=0; i<src.size(); i++) {
+            dst.append(Template(src[i].file));
+            Mat affineTransform;
+            registration(src[i], dst[i], affineTransform);
+            affineTransforms.append(affineTransform);
+        }
+
+        Mat buffer(src.size() * height, width, src.first().m().type());
+        std::vector<Mat> slots;
+        for (int i=0; i<src.size(); i++)
+            slots.push_back(buffer.rowRange(i*height, (i+1)*height));
+
+        const BatchWarp batchWarp(this, &src, &affineTransforms, &slots[0]);
+        if (Globals->parallelism > 1) parallel_for_(Range(0, src.size()), batchWarp);
+        else                          batchWarp(Range(0, src.size()));
+
+        for (int i=0; i<src.size(); i++)
+            dst[i] = slots[i];
     }
 };
 
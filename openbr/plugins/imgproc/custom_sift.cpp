@@ -103,6 +103,7 @@
 \**********************************************************************************************/
 
 #include <iostream>
+#include <map>
 #include <stdarg.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/nonfree/features2d.hpp>
@@ -160,7 +161,8 @@ static Mat createInitialImage( const Mat& img, bool doubleImageSize, float sigma
 }
 
 
-static void buildGaussianPyramid( const Mat& base, vector<Mat>& pyr, int nOctaves, int nOctaveLayers, double sigma )
+// Only the first nLevels images of the pyramid are built, later ones are left empty
+static void buildGaussianPyramid( const Mat& base, vector<Mat>& pyr, int nOctaves, int nOctaveLayers, double sigma, int nLevels = INT_MAX )
 {
     vector<double> sig(nOctaveLayers + 3);
     pyr.resize(nOctaves*(nOctaveLayers + 3));
@@ -180,6 +182,8 @@ static void buildGaussianPyramid( const Mat& base, vector<Mat>& pyr, int nOctave
     {
         for( int i = 0; i < nOctaveLayers + 3; i++ )
         {
+            if( o*(nOctaveLayers + 3) + i >= nLevels )
+                return;
             Mat& dst = pyr[o*(nOctaveLayers + 3) + i];
             if( o == 0  &&  i == 0 )
                 dst = base;
@@ -200,43 +204,69 @@ static void buildGaussianPyramid( const Mat& base, vector<Mat>& pyr, int nOctave
 }
 
 
-static void buildDoGPyramid( const vector<Mat>& gpyr, vector<Mat>& dogpyr, int nOctaveLayers )
+// Per-pixel gradient magnitude and orientation (degrees) of a pyramid level, computed once and shared by all its keypoints.
+// The one pixel border, which descriptors never sample, is left zero.
+static void calcGradientMaps( const Mat& img, Mat& mag, Mat& ori )
 {
-    int nOctaves = (int)gpyr.size()/(nOctaveLayers + 3);
-    dogpyr.resize( nOctaves*(nOctaveLayers + 2) );
-
-    for( int o = 0; o < nOctaves; o++ )
+    mag = Mat::zeros(img.size(), CV_32F);
+    ori = Mat::zeros(img.size(), CV_32F);
+    if( img.rows < 3 || img.cols < 3 )
+        return;
+
+    const int len = img.cols - 2;
+    AutoBuffer<float> buf(len*2);
+    float *X = buf, *Y = X + len;
+    for( int r = 1; r < img.rows - 1; r++ )
     {
-        for( int i = 0; i < nOctaveLayers + 2; i++ )
+        const sift_wt *prev = img.ptr<sift_wt>(r-1), *cur = img.ptr<sift_wt>(r), *next = img.ptr<sift_wt>(r+1);
+        for( int c = 1; c < img.cols - 1; c++ )
         {
-            const Mat& src1 = gpyr[o*(nOctaveLayers + 3) + i];
-            const Mat& src2 = gpyr[o*(nOctaveLayers + 3) + i + 1];
-            Mat& dst = dogpyr[o*(nOctaveLayers + 2) + i];
-            subtract(src2, src1, dst, noArray(), DataType<sift_wt>::type);
+            X[c-1] = (float)(cur[c+1] - cur[c-1]);
+            Y[c-1] = (float)(prev[c] - next[c]);
         }
+        fastAtan2(Y, X, ori.ptr<float>(r) + 1, len, true);
+        magnitude(X, Y, mag.ptr<float>(r) + 1, len);
     }
 }
 
-static void calcSIFTDescriptor( const Mat& img, Point2f ptf, float ori, float scl,
+static int descriptorRadius( float scl, int d )
+{
+    return cvRound(SIFT_DESCR_SCL_FCTR * scl * 1.4142135623730951f * (d + 1) * 0.5f);
+}
+
+// Gaussian weights over the (2*radius+1)^2 sample window of a keypoint of the given scale.
+// The rotation preserves distances, so the weights don't depend on the keypoint's orientation.
+static void calcWeightTable( float scl, int d, vector<float>& table )
+{
+    const int radius = descriptorRadius(scl, d);
+    const float hist_width = SIFT_DESCR_SCL_FCTR * scl;
+    const float exp_scale = -1.f/(d * d * 0.5f) / (hist_width * hist_width);
+    table.resize((radius*2+1)*(radius*2+1));
+    for( int i = -radius, k = 0; i <= radius; i++ )
+        for( int j = -radius; j <= radius; j++, k++ )
+            table[k] = std::exp((float)(i*i + j*j)*exp_scale);
+}
+
+static void calcSIFTDescriptor( const Mat& magMap, const Mat& oriMap, const vector<float>& weights, Point2f ptf, float ori, float scl,
                                int d, int n, float* dst )
 {
     Point pt(cvRound(ptf.x), cvRound(ptf.y));
     float cos_t = cosf(ori*(float)(CV_PI/180));
     float sin_t = sinf(ori*(float)(CV_PI/180));
     float bins_per_rad = n / 360.f;
-    float exp_scale = -1.f/(d * d * 0.5f);
     float hist_width = SIFT_DESCR_SCL_FCTR * scl;
-    int radius = cvRound(hist_width * 1.4142135623730951f * (d + 1) * 0.5f);
+    const int tableRadius = descriptorRadius(scl, d);
+    int radius = tableRadius;
     // Clip the radius to the diagonal of the image to avoid autobuffer too large exception
-    radius = std::min(radius, (int) sqrt((double) img.cols*img.cols + img.rows*img.rows));
+    radius = std::min(radius, (int) sqrt((double) magMap.cols*magMap.cols + magMap.rows*magMap.rows));
     cos_t /= hist_width;
     sin_t /= hist_width;
 
     int i, j, k, len = (radius*2+1)*(radius*2+1), histlen = (d+2)*(d+2)*(n+2);
-    int rows = img.rows, cols = img.cols;
+    int rows = magMap.rows, cols = magMap.cols;
 
-    AutoBuffer<float> buf(len*6 + histlen);
-    float *X = buf, *Y = X + len, *Mag = Y, *Ori = Mag + len, *W = Ori + len;
+    AutoBuffer<float> buf(len*5 + histlen);
+    float *Mag = buf, *Ori = Mag + len, *W = Ori + len;
     float *RBin = W + len, *CBin = RBin + len, *hist = CBin + len;
 
     for( i = 0; i < d+2; i++ )
@@ -247,6 +277,12 @@ static void calcSIFTDescriptor( const Mat& img, Point2f ptf, float ori, float sc
     }
 
     for( i = -radius, k = 0; i <= radius; i++ )
+    {
+        const int r = pt.y + i;
+        if( r <= 0 || r >= rows - 1 )
+            continue;
+        const float *magRow = magMap.ptr<float>(r), *oriRow = oriMap.ptr<float>(r);
+        const float *weightRow = &weights[(i + tableRadius)*(tableRadius*2+1) + tableRadius];
         for( j = -radius; j <= radius; j++ )
         {
             // Calculate sample's histogram array coords rotated relative to ori.
@@ -256,23 +292,19 @@ static void calcSIFTDescriptor( const Mat& img, Point2f ptf, float ori, float sc
             float r_rot = j * sin_t + i * cos_t;
             float rbin = r_rot + d/2 - 0.5f;
             float cbin = c_rot + d/2 - 0.5f;
-            int r = pt.y + i, c = pt.x + j;
+            int c = pt.x + j;
 
             if( rbin > -1 && rbin < d && cbin > -1 && cbin < d &&
-                r > 0 && r < rows - 1 && c > 0 && c < cols - 1 )
+                c > 0 && c < cols - 1 )
             {
-                float dx = (float)(img.at<sift_wt>(r, c+1) - img.at<sift_wt>(r, c-1));
-                float dy = (float)(img.at<sift_wt>(r-1, c) - img.at<sift_wt>(r+1, c));
-                X[k] = dx; Y[k] = dy; RBin[k] = rbin; CBin[k] = cbin;
-                W[k] = (c_rot * c_rot + r_rot * r_rot)*exp_scale;
+                Mag[k] = magRow[c]; Ori[k] = oriRow[c]; W[k] = weightRow[j];
+                RBin[k] = rbin; CBin[k] = cbin;
                 k++;
             }
         }
+    }
 
     len = k;
-    fastAtan2(Y, X, Ori, len, true);
-    magnitude(X, Y, Mag, len);
-    exp(W, W, len);
 
     for( k = 0; k < len; k++ )
     {
@@ -359,25 +391,67 @@ static void calcSIFTDescriptor( const Mat& img, Point2f ptf, float ori, float sc
 #endif
 }
 
+static inline int keypointLevel(const KeyPoint &kpt, int nOctaveLayers, int firstOctave, Point2f &ptf, float &angle, float &scl)
+{
+    int octave, layer;
+    float scale;
+    unpackOctave(kpt, octave, layer, scale);
+    CV_Assert(octave >= firstOctave && layer <= nOctaveLayers+2);
+    ptf = Point2f(kpt.pt.x*scale, kpt.pt.y*scale);
+    scl = kpt.size*scale*0.5f;
+    angle = 360.f - kpt.angle;
+    if(std::abs(angle - 360.f) < FLT_EPSILON)
+        angle = 0.f;
+    return (octave - firstOctave)*(nOctaveLayers + 3) + layer;
+}
+
+class SIFTDescriptorInvoker : public ParallelLoopBody
+{
+public:
+    SIFTDescriptorInvoker(const vector<Mat>& _mags, const vector<Mat>& _oris, const std::map< float, vector<float> >& _weights,
+                          const vector<KeyPoint>& _keypoints, Mat& _descriptors, int _nOctaveLayers, int _firstOctave, int _n, int _d)
+        : mags(_mags), oris(_oris), weights(_weights), keypoints(_keypoints), descriptors(_descriptors),
+          nOctaveLayers(_nOctaveLayers), firstOctave(_firstOctave), n(_n), d(_d) {}
+
+    void operator()(const Range& range) const
+    {
+        for( int i = range.start; i < range.end; i++ )
+        {
+            Point2f ptf;
+            float angle, scl;
+            const int level = keypointLevel(keypoints[i], nOctaveLayers, firstOctave, ptf, angle, scl);
+            calcSIFTDescriptor(mags[level], oris[level], weights.find(scl)->second, ptf, angle, scl, d, n, descriptors.ptr<float>(i));
+        }
+    }
+
+private:
+    const vector<Mat>& mags;
+    const vector<Mat>& oris;
+    const std::map< float, vector<float> >& weights;
+    const vector<KeyPoint>& keypoints;
+    Mat& descriptors;
+    int nOctaveLayers, firstOctave, n, d;
+};
+
 static void calcDescriptors(const vector<Mat>& gpyr, const vector<KeyPoint>& keypoints,
                             Mat& descriptors, int nOctaveLayers, int firstOctave, int n /* bins */, int d /* width */)
 {
+    // Gradient maps of each level and weight tables of each scale are shared by all keypoints that use them
+    vector<Mat> mags(gpyr.size()), oris(gpyr.size());
+    std::map< float, vector<float> > weights;
     for( size_t i = 0; i < keypoints.size(); i++ )
     {
-        KeyPoint kpt = keypoints[i];
-        int octave, layer;
-        float scale;
-        unpackOctave(kpt, octave, layer, scale);
-        CV_Assert(octave >= firstOctave && layer <= nOctaveLayers+2);
-        float size=kpt.size*scale;
-        Point2f ptf(kpt.pt.x*scale, kpt.pt.y*scale);
-        const Mat& img = gpyr[(octave - firstOctave)*(nOctaveLayers + 3) + layer];
-
-        float angle = 360.f - kpt.angle;
-        if(std::abs(angle - 360.f) < FLT_EPSILON)
-            angle = 0.f;
-        calcSIFTDescriptor(img, ptf, angle, size*0.5f, d, n, descriptors.ptr<float>((int)i));
+        Point2f ptf;
+        float angle, scl;
+        const int level = keypointLevel(keypoints[i], nOctaveLayers, firstOctave, ptf, angle, scl);
+        if( mags[level].empty() )
+            calcGradientMaps(gpyr[level], mags[level], oris[level]);
+        if( weights.find(scl) == weights.end() )
+            calcWeightTable(scl, d, weights[scl]);
     }
+
+    parallel_for_(Range(0, (int)keypoints.size()),
+                  SIFTDescriptorInvoker(mags, oris, weights, keypoints, descriptors, nOctaveLayers, firstOctave, n, d));
 }
 
 static int descriptorSize(int bins, int width)
@@ -407,9 +481,17 @@ static void extractSIFT(const Mat &image, vector<KeyPoint> &keypoints, Mat &desc
     const Mat base = createInitialImage(image, firstOctave < 0, (float)sigma, initSigma);
     const int nOctaves = actualNOctaves > 0 ? actualNOctaves : cvRound(log( (double)std::min( base.cols, base.rows ) ) / log(2.) - 2) - firstOctave;
 
-    vector<Mat> gpyr, dogpyr;
-    buildGaussianPyramid(base, gpyr, nOctaves, nOctaveLayers, sigma);
-    buildDoGPyramid(gpyr, dogpyr, nOctaveLayers);
+    // Descriptors only sample the Gaussian pyramid, and only up to the deepest level a keypoint refers to
+    int nLevels = 0;
+    for (size_t i=0; i<keypoints.size(); i++) {
+        int octave, layer;
+        float scale;
+        unpackOctave(keypoints[i], octave, layer, scale);
+        nLevels = std::max(nLevels, (octave - firstOctave)*(nOctaveLayers + 3) + layer + 1);
+    }
+
+    vector<Mat> gpyr;
+    buildGaussianPyramid(base, gpyr, nOctaves, nOctaveLayers, sigma, nLevels);
 
     descriptors.create((int)keypoints.size(), descriptorSize(bins, width), CV_32F);
     calcDescriptors(gpyr, keypoints, descriptors, nOctaveLayers, firstOctave, bins, width);
@@ -433,11 +515,13 @@ class CustomSIFTTransform : public UntrainableTransform
     Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
     Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
     Q_PROPERTY(float initSigma READ get_initSigma WRITE set_initSigma RESET reset_initSigma STORED false)
+    Q_PROPERTY(int gridStep READ get_gridStep WRITE set_gridStep RESET reset_gridStep STORED false)
     BR_PROPERTY(int, size, 1)
     BR_PROPERTY(QList<int>, sizes, QList<int>())
     BR_PROPERTY(int, bins, 8)
     BR_PROPERTY(int, width, 4)
     BR_PROPERTY(float, initSigma, 0.5f)
+    BR_PROPERTY(int, gridStep, 0) // Describe a dense grid with this spacing instead of the template's points
 
     void init()
     {
@@ -447,8 +531,17 @@ class CustomSIFTTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
+        QList<QPointF> points;
+        if (gridStep > 0) {
+            for (int y=gridStep/2; y<src.m().rows; y+=gridStep)
+                for (int x=gridStep/2; x<src.m().cols; x+=gridStep)
+                    points.append(QPointF(x, y));
+        } else {
+            points = src.file.points();
+        }
+
         std::vector<KeyPoint> keyPoints;
-        foreach (const QPointF &val, src.file.points())
+        foreach (const QPointF &val, points)
             foreach (const int sz, sizes)
                 keyPoints.push_back(KeyPoint(val.x(), val.y(), sz));
 
@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
 
 using namespace cv;
 
@@ -28,7 +29,7 @@ namespace br
  * \brief Colorspace conversion.
  * \author Josh Klontz \cite jklontz
  */
-class CvtTransform : public UntrainableTransform
+class CvtTransform : public PixelTransform
 {
     Q_OBJECT
     Q_ENUMS(ColorSpace)
@@ -53,8 +54,13 @@ private:
 
     void project(const Template &src, Template &dst) const
     {
-        if (src.m().channels() > 1 || colorSpace == CV_GRAY2BGR) cvtColor(src, dst, colorSpace);
-        else dst = src;
+        if (src.m().channels() > 1 || colorSpace == CV_GRAY2BGR) {
+            Mat m = MatArena::mat();
+            cvtColor(src, m, colorSpace);
+            dst = m;
+        } else {
+            dst = src;
+        }
 
         if (channel != -1) {
             std::vector<Mat> mv;
@@ -62,6 +68,24 @@ private:
             dst = mv[channel % (int)mv.size()];
         }
     }
+
+    // Channel selection is left to project()
+    int outputType(int type) const
+    {
+        if (channel != -1)
+            return -1;
+        if ((CV_MAT_CN(type) == 1) && (colorSpace != Color))
+            return type;
+        if ((colorSpace == Gray) || (colorSpace == RGBGray))
+            return CV_MAKETYPE(CV_MAT_DEPTH(type), 1);
+        return CV_MAKETYPE(CV_MAT_DEPTH(type), 3);
+    }
+
+    void projectTile(const Mat &src, Mat &dst) const
+    {
+        if (src.channels() > 1 || colorSpace == CV_GRAY2BGR) cvtColor(src, dst, colorSpace);
+        else src.copyTo(dst);
+    }
 };
 
 BR_REGISTER(Transform, CvtTransform)
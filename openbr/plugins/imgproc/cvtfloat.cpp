@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
 
 using namespace cv;
 
@@ -26,13 +27,30 @@ namespace br
  * \brief Convert to floating point format.
  * \author Josh Klontz \cite jklontz
  */
-class CvtFloatTransform : public UntrainableTransform
+class CvtFloatTransform : public PixelTransform
 {
     Q_OBJECT
 
     void project(const Template &src, Template &dst) const
     {
-        src.m().convertTo(dst, CV_32F);
+        Mat m = MatArena::mat();
+        src.m().convertTo(m, CV_32F);
+        dst = m;
+    }
+
+    int outputType(int type) const
+    {
+        return CV_MAKETYPE(CV_32F, CV_MAT_CN(type));
+    }
+
+    void projectTile(const Mat &src, Mat &dst) const
+    {
+        src.convertTo(dst, CV_32F);
+    }
+
+    QString likelyExpression(const QString &src) const
+    {
+        return src;
     }
 };
 
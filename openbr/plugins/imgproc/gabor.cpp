@@ -57,6 +57,7 @@ private:
     Mat kReal, kImaginary;
 
     friend class GaborJetTransform;
+    friend class GaborBankTransform;
 
     static void makeWavelet(float lambda, float theta, float psi, float sigma, float gamma, Mat &kReal, Mat &kImaginary)
     {
@@ -200,6 +201,122 @@ class GaborJetTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, GaborJetTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief A bank of gabor wavelets applied to the whole image in the frequency domain.
+ *
+ * Produces one matrix per wavelet, in the same order as GaborJetTransform, each matching
+ * a GaborTransform with those parameters on a floating point image.
+ * The image is reflected at the border and transformed once, then each wavelet's real and imaginary kernels,
+ * packed into one complex spectrum cached per transform size, yield both components from a single inverse transform.
+ */
+class GaborBankTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_ENUMS(br::GaborTransform::Component)
+    Q_PROPERTY(QList<float> lambdas READ get_lambdas WRITE set_lambdas RESET reset_lambdas STORED false)
+    Q_PROPERTY(QList<float> thetas READ get_thetas WRITE set_thetas RESET reset_thetas STORED false)
+    Q_PROPERTY(QList<float> psis READ get_psis WRITE set_psis RESET reset_psis STORED false)
+    Q_PROPERTY(QList<float> sigmas READ get_sigmas WRITE set_sigmas RESET reset_sigmas STORED false)
+    Q_PROPERTY(QList<float> gammas READ get_gammas WRITE set_gammas RESET reset_gammas STORED false)
+    Q_PROPERTY(br::GaborTransform::Component component READ get_component WRITE set_component RESET reset_component STORED false)
+    BR_PROPERTY(QList<float>, lambdas, QList<float>())
+    BR_PROPERTY(QList<float>, thetas, QList<float>())
+    BR_PROPERTY(QList<float>, psis, QList<float>())
+    BR_PROPERTY(QList<float>, sigmas, QList<float>())
+    BR_PROPERTY(QList<float>, gammas, QList<float>())
+    BR_PROPERTY(GaborTransform::Component, component, GaborTransform::Phase)
+
+    QList<Mat> kReals, kImaginaries;
+    int border_x, border_y;
+
+    mutable QMutex spectraLock;
+    mutable QHash< QPair<int,int>, QList<Mat> > spectra;
+
+    void init()
+    {
+        kReals.clear();
+        kImaginaries.clear();
+        border_x = border_y = 0;
+        foreach (float lambda, lambdas)
+            foreach (float theta, thetas)
+                foreach (float psi, psis)
+                    foreach (float sigma, sigmas)
+                        foreach (float gamma, gammas) {
+                            Mat kReal, kImaginary;
+                            GaborTransform::makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+                            kReals.append(kReal);
+                            kImaginaries.append(kImaginary);
+                            border_x = std::max(border_x, kReal.cols/2);
+                            border_y = std::max(border_y, kReal.rows/2);
+                        }
+        QMutexLocker locker(&spectraLock);
+        spectra.clear();
+    }
+
+    // Kernel i arranged so that a product of spectra performs the same correlation as filter2D
+    QList<Mat> spectraFor(const Size &size) const
+    {
+        QMutexLocker locker(&spectraLock);
+        const QPair<int,int> key(size.height, size.width);
+        if (spectra.contains(key))
+            return spectra[key];
+
+        QList<Mat> result;
+        for (int k=0; k<kReals.size(); k++) {
+            const Mat &kReal = kReals[k], &kImaginary = kImaginaries[k];
+            const int anchor_x = kReal.cols/2, anchor_y = kReal.rows/2;
+            Mat kernel = Mat::zeros(size, CV_32FC2);
+            for (int i=0; i<kReal.rows; i++)
+                for (int j=0; j<kReal.cols; j++)
+                    kernel.at<Vec2f>((anchor_y - i + size.height) % size.height, (anchor_x - j + size.width) % size.width) =
+                        Vec2f(kReal.at<float>(i, j), kImaginary.at<float>(i, j));
+            Mat spectrum;
+            dft(kernel, spectrum);
+            result.append(spectrum);
+        }
+        spectra.insert(key, result);
+        return result;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m;
+        src.m().convertTo(m, CV_32F);
+        if (m.channels() != 1)
+            qFatal("GaborBank expects single channel matrices.");
+
+        const Size size(getOptimalDFTSize(m.cols + 2*border_x), getOptimalDFTSize(m.rows + 2*border_y));
+        Mat padded, image;
+        copyMakeBorder(m, padded, border_y, size.height - m.rows - border_y, border_x, size.width - m.cols - border_x, BORDER_REFLECT_101);
+        dft(padded, image, DFT_COMPLEX_OUTPUT);
+
+        dst = Template(src.file);
+        const Rect roi(border_x, border_y, m.cols, m.rows);
+        foreach (const Mat &spectrum, spectraFor(size)) {
+            Mat product, response;
+            mulSpectrums(image, spectrum, product, 0);
+            idft(product, response, DFT_SCALE | DFT_COMPLEX_OUTPUT);
+
+            Mat components[2];
+            split(response(roi), components);
+            const Mat &real = components[0], &imaginary = components[1];
+
+            Mat result;
+            if      (component == GaborTransform::Real)      result = real.clone();
+            else if (component == GaborTransform::Imaginary) result = imaginary.clone();
+            else {
+                Mat magnitude, phase;
+                cartToPolar(real, imaginary, magnitude, phase);
+                result = (component == GaborTransform::Magnitude) ? magnitude : phase;
+            }
+            dst.append(result);
+        }
+    }
+};
+
+BR_REGISTER(Transform, GaborBankTransform)
+
 } // namespace br
 
 #include "imgproc/gabor.moc"
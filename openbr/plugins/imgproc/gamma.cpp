@@ -26,7 +26,7 @@ namespace br
  * \brief Gamma correction
  * \author Josh Klontz \cite jklontz
  */
-class GammaTransform : public UntrainableTransform
+class GammaTransform : public PixelTransform
 {
     Q_OBJECT
     Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
@@ -46,6 +46,19 @@ class GammaTransform : public UntrainableTransform
         if (src.m().depth() == CV_8U) LUT(src, lut, dst);
         else                          pow(src, gamma, dst);
     }
+
+    int outputType(int type) const
+    {
+        if (CV_MAT_DEPTH(type) == CV_8U) return CV_MAKETYPE(CV_32F, CV_MAT_CN(type));
+        if ((CV_MAT_DEPTH(type) == CV_32F) || (CV_MAT_DEPTH(type) == CV_64F)) return type;
+        return -1;
+    }
+
+    void projectTile(const Mat &src, Mat &dst) const
+    {
+        if (src.depth() == CV_8U) LUT(src, lut, dst);
+        else                      pow(src, gamma, dst);
+    }
 };
 
 BR_REGISTER(Transform, GammaTransform)
@@ -17,6 +17,8 @@
 #include <opencv2/objdetect/objdetect.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+#include <openbr/core/pyramid.h>
 
 using namespace cv;
 
@@ -27,15 +29,47 @@ namespace br
  * \ingroup transforms
  * \brief OpenCV HOGDescriptor wrapper
  * \author Austin Blanton \cite imaus10
+ *
+ * In \em dense mode the block histograms of each image are computed once and shared through br::ImagePyramid.
+ * Each of the template's rects then becomes a descriptor gathered from them,
+ * snapped to the block grid, or the whole grid is returned when there are no rects.
  */
 class HoGDescriptorTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(bool dense READ get_dense WRITE set_dense RESET reset_dense STORED false)
+    BR_PROPERTY(bool, dense, false)
 
     HOGDescriptor hog;
 
+    void projectDense(const Template &src, Template &dst) const
+    {
+        const QList<Rect> rects = OpenCVUtils::toRects(src.file.rects());
+        foreach (const Mat &m, src) {
+            const Mat blocks = ImagePyramid::get(m)->hogBlocks(m.size(), hog);
+            if (rects.isEmpty()) {
+                dst += blocks;
+                continue;
+            }
+
+            foreach (const Rect &rect, rects) {
+                if ((rect.width != hog.winSize.width) || (rect.height != hog.winSize.height))
+                    qFatal("Dense HoG expects %dx%d rects.", hog.winSize.width, hog.winSize.height);
+                const Rect window = ImagePyramid::hogBlockWindow(hog, cvRound(float(rect.x) / hog.blockStride.width), cvRound(float(rect.y) / hog.blockStride.height));
+                if ((window.x < 0) || (window.y < 0) || (window.x + window.width > blocks.cols) || (window.y + window.height > blocks.rows))
+                    qFatal("Dense HoG rect outside of the image.");
+                dst += Mat(blocks(window).clone()).reshape(1, hog.getDescriptorSize());
+            }
+        }
+    }
+
     void project(const Template &src, Template &dst) const
     {
+        if (dense) {
+            projectDense(src, dst);
+            return;
+        }
+
         std::vector<float> descriptorVals;
         std::vector<Point> locations;
         Size winStride = Size(0,0);
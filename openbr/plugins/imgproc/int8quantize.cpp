@@ -0,0 +1,92 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Symmetric int8 quantization of floats, for Int8Distance.
+ *
+ * Each dimension is scaled so its largest training magnitude maps to 127, and codes are clamped to [-127, 127].
+ * With \c perDimension false a single scale is shared by every dimension, preserving inner products up to a constant.
+ */
+class Int8QuantizeTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(bool perDimension READ get_perDimension WRITE set_perDimension RESET reset_perDimension STORED false)
+    BR_PROPERTY(bool, perDimension, true)
+
+    Mat scales; // dst = round(src * scales)
+
+    void train(const TemplateList &data)
+    {
+        Mat m;
+        OpenCVUtils::toMat(data.data()).convertTo(m, CV_32F);
+        m = abs(m);
+
+        Mat extremes;
+        if (perDimension) {
+            reduce(m, extremes, 0, CV_REDUCE_MAX);
+        } else {
+            double maxVal;
+            minMaxLoc(m, NULL, &maxVal);
+            extremes = Mat(1, m.cols, CV_32FC1, Scalar(maxVal));
+        }
+
+        scales = Mat(1, m.cols, CV_32FC1);
+        for (int i=0; i<m.cols; i++) {
+            const float extreme = extremes.at<float>(0, i);
+            scales.at<float>(0, i) = (extreme > 0) ? 127.f / extreme : 1.f;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat &m = src.m();
+        Mat row;
+        (m.isContinuous() ? m : m.clone()).reshape(1, 1).convertTo(row, CV_32F);
+        if (row.cols != scales.cols)
+            qFatal("Expected %d dimensions, got %d.", scales.cols, row.cols);
+
+        Mat codes;
+        multiply(row, scales, row);
+        row.convertTo(codes, CV_8S);
+        codes = max(codes, -127);
+        dst = codes.reshape(1, m.rows);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << scales;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> scales;
+    }
+};
+
+BR_REGISTER(Transform, Int8QuantizeTransform)
+
+} // namespace br
+
+#include "imgproc/int8quantize.moc"
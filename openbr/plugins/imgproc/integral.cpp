@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/pyramid.h>
 
 namespace br
 {
@@ -32,7 +33,7 @@ class IntegralTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        cv::integral(src, dst);
+        dst = ImagePyramid::get(src)->integral(src.m().size());
     }
 };
 
@@ -14,43 +14,100 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <limits>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// dst = a + b, one cell's worth of bins
+static inline void addBins(qint32 *dst, const qint32 *a, const qint32 *b, int bins)
+{
+    int k = 0;
+#ifdef __SSE2__
+    for (; k+4<=bins; k+=4)
+        _mm_storeu_si128((__m128i*)(dst+k), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(a+k)), _mm_loadu_si128((const __m128i*)(b+k))));
+#endif
+    for (; k<bins; k++)
+        dst[k] = a[k] + b[k];
+}
+
+static inline void addBins(quint16 *dst, const quint16 *a, const quint16 *b, int bins)
+{
+    int k = 0;
+#ifdef __SSE2__
+    for (; k+8<=bins; k+=8)
+        _mm_storeu_si128((__m128i*)(dst+k), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(a+k)), _mm_loadu_si128((const __m128i*)(b+k))));
+#endif
+    for (; k<bins; k++)
+        dst[k] = a[k] + b[k];
+}
+
+// Processes one strip of radius image rows at a time, keeping a running histogram of the strip so far,
+// so each cell costs its pixel increments plus a single vector add of the cell above.
+template <typename T>
+static void integralHistogram(const Mat &m, int bins, int radius, Mat &integral)
+{
+    const int rows = m.rows/radius;
+    const int cols = m.cols/radius;
+    integral = Mat::zeros(rows+1, cols+1, CV_MAKETYPE(DataType<T>::depth, bins));
+
+    QVector<T> strip(bins);
+    for (int i=1; i<=rows; i++) {
+        strip.fill(0);
+        const T *above = integral.ptr<T>(i-1);
+        T *current = integral.ptr<T>(i);
+        for (int j=1; j<=cols; j++) {
+            for (int k=0; k<radius; k++) {
+                const quint8 *pixels = m.ptr<quint8>((i-1)*radius+k) + (j-1)*radius;
+                for (int l=0; l<radius; l++)
+                    strip[pixels[l]]++;
+            }
+            addBins(current + j*bins, above + j*bins, strip.data(), bins);
+        }
+    }
+}
+
 /*!
  * \ingroup transforms
  * \brief An integral histogram
  * \author Josh Klontz \cite jklontz
+ *
+ * The output is a multi-channel integral image with one channel per bin,
+ * the layout read by IntegralSamplerTransform and RecursiveIntegralSamplerTransform.
+ * With \em compact set, images with fewer than 65536 sampled pixels use 16-bit counts.
+ * Input values must be less than \em bins, quantize the image first when using fewer than 256 bins.
  */
 class IntegralHistTransform : public UntrainableTransform
 {
     Q_OBJECT
     Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
     Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    Q_PROPERTY(bool compact READ get_compact WRITE set_compact RESET reset_compact STORED false)
     BR_PROPERTY(int, bins, 256)
     BR_PROPERTY(int, radius, 16)
+    BR_PROPERTY(bool, compact, false)
 
     void project(const Template &src, Template &dst) const
     {
         const Mat &m = src.m();
         if (m.type() != CV_8UC1) qFatal("IntegralHist requires 8UC1 matrices.");
-
-        Mat integral(m.rows/radius+1, (m.cols/radius+1)*bins, CV_32SC1);
-        integral.setTo(0);
-        for (int i=1; i<integral.rows; i++) {
-            for (int j=1; j<integral.cols; j+=bins) {
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) += integral.at<qint32>(i-1, j     +k);
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) += integral.at<qint32>(i  , j-bins+k);
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) -= integral.at<qint32>(i-1, j-bins+k);
-                for (int k=0; k<radius; k++)
-                    for (int l=0; l<radius; l++)
-                        integral.at<qint32>(i, j+m.at<quint8>((i-1)*radius+k,(j/bins-1)*radius+l))++;
-            }
+        if (bins > CV_CN_MAX) qFatal("IntegralHist supports at most %d bins.", CV_CN_MAX);
+        if (bins < 256) {
+            // Pixels index the bins directly, so the input must already be quantized
+            double maxVal;
+            minMaxLoc(m, NULL, &maxVal);
+            if (maxVal >= bins) qFatal("IntegralHist input value %d is out of range for %d bins.", int(maxVal), bins);
         }
+
+        const qint64 samples = qint64(m.rows/radius) * (m.cols/radius) * radius * radius;
+        Mat integral;
+        if (compact && (samples <= std::numeric_limits<quint16>::max())) integralHistogram<quint16>(m, bins, radius, integral);
+        else                                                              integralHistogram<qint32>(m, bins, radius, integral);
         dst = integral;
     }
 };
@@ -44,12 +44,20 @@ class IntegralSamplerTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        typedef Eigen::Map< const Eigen::Matrix<qint32,Eigen::Dynamic,1> > InputDescriptor;
+        const Mat &m = src.m();
+        if      (m.depth() == CV_32S) dst.m() = sample<qint32>(m);
+        else if (m.depth() == CV_16U) dst.m() = sample<quint16>(m);
+        else                          qFatal("Expected CV_32S or CV_16U matrix depth.");
+    }
+
+    // T is the integral image's accumulator type, 16-bit integrals come from IntegralHist(compact=true)
+    template <typename T>
+    Mat sample(const Mat &m) const
+    {
+        typedef Eigen::Map< const Eigen::Matrix<T,Eigen::Dynamic,1> > InputDescriptor;
         typedef Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,1> > SecondOrderInputDescriptor;
         typedef Eigen::Map< Eigen::Matrix<float,Eigen::Dynamic,1> > OutputDescriptor;
 
-        const Mat &m = src.m();
-        if (m.depth() != CV_32S) qFatal("Expected CV_32S matrix depth.");
         const int channels = m.channels();
         const int rowStep = channels * m.cols;
 
@@ -66,7 +74,7 @@ class IntegralSamplerTransform : public UntrainableTransform
         }
         Mat n(descriptors, channels, CV_32FC1);
 
-        const qint32 *dataIn = (qint32*)m.data;
+        const T *dataIn = (const T*)m.data;
         float *dataOut = (float*)n.data;
         idealSize = min(m.rows, m.cols)-1;
         int index = 0;
@@ -80,7 +88,7 @@ class IntegralSamplerTransform : public UntrainableTransform
                     InputDescriptor c(dataIn+(i              *rowStep+(j-currentSize)*channels), channels, 1);
                     InputDescriptor d(dataIn+(i              *rowStep+ j             *channels), channels, 1);
                     OutputDescriptor y(dataOut+(index*channels), channels, 1);
-                    y = (d-b-c+a).cast<float>()/(currentSize*currentSize);
+                    y = (d.template cast<qint32>()-b.template cast<qint32>()-c.template cast<qint32>()+a.template cast<qint32>()).template cast<float>()/(currentSize*currentSize);
                     index++;
                 }
             }
@@ -111,7 +119,7 @@ class IntegralSamplerTransform : public UntrainableTransform
         if (descriptors != index)
             qFatal("Allocated %d descriptors but computed %d.", descriptors, index);
 
-        dst.m() = n;
+        return n;
     }
 };
 
@@ -22,6 +22,9 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Kernel hash
+ *
+ * If \c packed is true, each hash is one-hot encoded into \c dimsOut bits and the bits are packed into a single row of bytes,
+ * so \ref HammingDistance counts twice the number of differing hashes.
  * \author Josh Klontz \cite jklontz
  */
 class KernelHashTransform : public UntrainableTransform
@@ -29,8 +32,10 @@ class KernelHashTransform : public UntrainableTransform
     Q_OBJECT
     Q_PROPERTY(uchar dimsIn READ get_dimsIn WRITE set_dimsIn RESET reset_dimsIn STORED false)
     Q_PROPERTY(uchar dimsOut READ get_dimsOut WRITE set_dimsOut RESET reset_dimsOut STORED false)
+    Q_PROPERTY(bool packed READ get_packed WRITE set_packed RESET reset_packed STORED false)
     BR_PROPERTY(uchar, dimsIn, 8)
     BR_PROPERTY(uchar, dimsOut, 7)
+    BR_PROPERTY(bool, packed, false)
 
     void project(const Template &src, Template &dst) const
     {
@@ -48,6 +53,17 @@ class KernelHashTransform : public UntrainableTransform
                                    + uint(pow(float(dimsIn),0.f))*srcData[i    *step+(j+1)]
                                    /*+ uint(pow(float(dimsIn),0.f))*srcData[(i+1)*step+(j+1)]*/) % dimsOut;
             }
+
+        if (packed) {
+            const cv::Mat &hashes = dst.m();
+            const int bits = hashes.rows * hashes.cols * dimsOut;
+            cv::Mat code = cv::Mat::zeros(1, (bits + 7) / 8, CV_8UC1);
+            for (int i=0; i<int(hashes.total()); i++) {
+                const int bit = i*dimsOut + hashes.data[i];
+                code.data[bit / 8] |= uchar(1 << (bit % 8));
+            }
+            dst.m() = code;
+        }
     }
 };
 
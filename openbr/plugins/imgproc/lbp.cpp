@@ -21,29 +21,113 @@
 #include <limits>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 using namespace cv;
 
 namespace br
 {
 
+// Neighbor offsets in units of radius as (row, column), most significant bit first
+static const int lbpNeighbors[8][2] = { {-1,-1}, {-1,0}, {-1,1}, {0,1}, {1,1}, {1,0}, {1,-1}, {0,-1} };
+
+// Raw 8-bit codes of the pixels in [begin, end) of the row at p, with rows step floats apart
+typedef void (*LBPRowKernel)(const float *p, int step, int radius, int begin, int end, uchar *codes);
+
+static void lbp_row_scalar(const float *p, int step, int radius, int begin, int end, uchar *codes)
+{
+    int offsets[8];
+    for (int k=0; k<8; k++)
+        offsets[k] = lbpNeighbors[k][0]*radius*step + lbpNeighbors[k][1]*radius;
+
+    for (int c=begin; c<end; c++) {
+        const float cval = p[c];
+        uchar code = 0;
+        for (int k=0; k<8; k++)
+            if (p[c+offsets[k]] >= cval)
+                code |= 128 >> k;
+        codes[c] = code;
+    }
+}
+
+#ifdef __SSE2__
+
+// Sixteen pixels at a time, packing the comparison masks down to bytes
+static void lbp_row_sse2(const float *p, int step, int radius, int begin, int end, uchar *codes)
+{
+    int offsets[8];
+    for (int k=0; k<8; k++)
+        offsets[k] = lbpNeighbors[k][0]*radius*step + lbpNeighbors[k][1]*radius;
+
+    int c = begin;
+    for (; c+16<=end; c+=16) {
+        const float *center = p + c;
+        const __m128 c0 = _mm_loadu_ps(center), c1 = _mm_loadu_ps(center+4), c2 = _mm_loadu_ps(center+8), c3 = _mm_loadu_ps(center+12);
+        __m128i code = _mm_setzero_si128();
+        for (int k=0; k<8; k++) {
+            const float *q = center + offsets[k];
+            const __m128i m01 = _mm_packs_epi32(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(q),   c0)),
+                                                _mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(q+4), c1)));
+            const __m128i m23 = _mm_packs_epi32(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(q+8), c2)),
+                                                _mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(q+12),c3)));
+            code = _mm_or_si128(code, _mm_and_si128(_mm_packs_epi16(m01, m23), _mm_set1_epi8(char(128 >> k))));
+        }
+        _mm_storeu_si128((__m128i*)(codes + c), code);
+    }
+    lbp_row_scalar(p, step, radius, c, end, codes);
+}
+
+#endif // __SSE2__
+
+#ifdef BR_SIMD_DISPATCH
+
+// Thirty-two pixels at a time, the in-lane packs leave groups of four pixels interleaved, undone by one permute
+BR_TARGET("avx2")
+static void lbp_row_avx2(const float *p, int step, int radius, int begin, int end, uchar *codes)
+{
+    int offsets[8];
+    for (int k=0; k<8; k++)
+        offsets[k] = lbpNeighbors[k][0]*radius*step + lbpNeighbors[k][1]*radius;
+
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int c = begin;
+    for (; c+32<=end; c+=32) {
+        const float *center = p + c;
+        const __m256 c0 = _mm256_loadu_ps(center), c1 = _mm256_loadu_ps(center+8), c2 = _mm256_loadu_ps(center+16), c3 = _mm256_loadu_ps(center+24);
+        __m256i code = _mm256_setzero_si256();
+        for (int k=0; k<8; k++) {
+            const float *q = center + offsets[k];
+            const __m256i m01 = _mm256_packs_epi32(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(q),    c0, _CMP_GE_OQ)),
+                                                   _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(q+8),  c1, _CMP_GE_OQ)));
+            const __m256i m23 = _mm256_packs_epi32(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(q+16), c2, _CMP_GE_OQ)),
+                                                   _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(q+24), c3, _CMP_GE_OQ)));
+            code = _mm256_or_si256(code, _mm256_and_si256(_mm256_packs_epi16(m01, m23), _mm256_set1_epi8(char(128 >> k))));
+        }
+        _mm256_storeu_si256((__m256i*)(codes + c), _mm256_permutevar8x32_epi32(code, order));
+    }
+    lbp_row_sse2(p, step, radius, c, end, codes);
+}
+
+#endif // BR_SIMD_DISPATCH
+
+static LBPRowKernel lbp_row_kernel()
+{
+#ifdef BR_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return lbp_row_avx2;
+#endif
+#ifdef __SSE2__
+    return lbp_row_sse2;
+#else
+    return lbp_row_scalar;
+#endif
+}
+
 /*!
- * \ingroup transforms
- * \brief Ahonen, T.; Hadid, A.; Pietikainen, M.;
- * "Face Description with Local Binary Patterns: Application to Face Recognition"
- * Pattern Analysis and Machine Intelligence, IEEE Transactions, vol.28, no.12, pp.2037-2041, Dec. 2006
- * \author Josh Klontz \cite jklontz
+ * \brief Uniform pattern mapping shared by LBPTransform and LBPHistTransform.
  */
-class LBPTransform : public UntrainableTransform
+struct LBPPattern
 {
-    Q_OBJECT
-    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
-    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
-    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
-    BR_PROPERTY(int, radius, 1)
-    BR_PROPERTY(int, maxTransitions, 8)
-    BR_PROPERTY(bool, rotationInvariant, false)
-
     uchar lut[256];
     uchar null;
 
@@ -72,7 +156,7 @@ class LBPTransform : public UntrainableTransform
         return min;
     }
 
-    void init()
+    void init(int maxTransitions, bool rotationInvariant)
     {
         bool set[256];
         uchar uid = 0;
@@ -97,32 +181,140 @@ class LBPTransform : public UntrainableTransform
                 lut[i] = null; // Set to null id
     }
 
+    // Mapped codes of row r, pixels within radius of the border get the null pattern
+    void row(const Mat &m, int radius, int r, uchar *codes) const
+    {
+        static const LBPRowKernel kernel = lbp_row_kernel();
+
+        if ((r < radius) || (r >= m.rows-radius) || (m.cols <= 2*radius)) {
+            memset(codes, null, m.cols);
+            return;
+        }
+
+        kernel(m.ptr<float>(r), int(m.step1()), radius, radius, m.cols-radius, codes);
+        for (int c=radius; c<m.cols-radius; c++)
+            codes[c] = lut[codes[c]];
+        memset(codes, null, radius);
+        memset(codes+m.cols-radius, null, radius);
+    }
+};
+
+/*!
+ * \ingroup transforms
+ * \brief Ahonen, T.; Hadid, A.; Pietikainen, M.;
+ * "Face Description with Local Binary Patterns: Application to Face Recognition"
+ * Pattern Analysis and Machine Intelligence, IEEE Transactions, vol.28, no.12, pp.2037-2041, Dec. 2006
+ * \author Josh Klontz \cite jklontz
+ */
+class LBPTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
+    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
+    BR_PROPERTY(int, radius, 1)
+    BR_PROPERTY(int, maxTransitions, 8)
+    BR_PROPERTY(bool, rotationInvariant, false)
+
+    LBPPattern pattern;
+
+    void init()
+    {
+        pattern.init(maxTransitions, rotationInvariant);
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        Mat m; src.m().convertTo(m, CV_32F); assert(m.channels() == 1);
         Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
+        for (int r=0; r<m.rows; r++)
+            pattern.row(m, radius, r, n.ptr(r));
+        dst += n;
+    }
+};
+
+BR_REGISTER(Transform, LBPTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Local binary pattern histograms of rectangular regions, computed without forming the pattern image.
+ *
+ * Regions are laid out as by RectRegionsTransform, and each produces one 1 x \em dims CV_32FC1 histogram counting
+ * the pattern codes below \em dims, by default every code including the one shared by non-uniform patterns.
+ * Patterns are computed as by LBPTransform, a row at a time, and counted directly into every region covering that row.
+ *
+ * \see LBPTransform
+ * \see RectRegionsTransform
+ * \see HistTransform
+ */
+class LBPHistTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
+    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    Q_PROPERTY(int dims READ get_dims WRITE set_dims RESET reset_dims STORED false)
+    BR_PROPERTY(int, radius, 1)
+    BR_PROPERTY(int, maxTransitions, 8)
+    BR_PROPERTY(bool, rotationInvariant, false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+    BR_PROPERTY(int, dims, -1)
+
+    LBPPattern pattern;
+
+    void init()
+    {
+        pattern.init(maxTransitions, rotationInvariant);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int widthStep = this->widthStep == -1 ? width : this->widthStep;
+        const int heightStep = this->heightStep == -1 ? height : this->heightStep;
+        const int dims = this->dims == -1 ? pattern.null + 1 : this->dims;
+
+        Mat m; src.m().convertTo(m, CV_32F); assert(m.channels() == 1);
+        const int xMax = m.cols - width;
+        const int yMax = m.rows - height;
+        const int numX = (xMax < 0) ? 0 : xMax / widthStep + 1;
+        const int numY = (yMax < 0) ? 0 : yMax / heightStep + 1;
+
+        QList<Mat> hists;
+        for (int i=0; i<numX*numY; i++)
+            hists.append(Mat::zeros(1, dims, CV_32FC1));
+
+        // Only rows covered by some region are computed
+        const int rowEnd = (numY == 0) ? 0 : (numY-1)*heightStep + height;
+        QVector<uchar> codes(m.cols);
+        for (int r=0; r<rowEnd; r++) {
+            pattern.row(m, radius, r, codes.data());
+
+            // Region rows y*heightStep <= r < y*heightStep+height
+            const int yFirst = (r < height) ? 0 : (r - height) / heightStep + 1;
+            const int yLast = std::min(numY-1, r / heightStep);
+            for (int y=yFirst; y<=yLast; y++) {
+                for (int x=0; x<numX; x++) {
+                    float *hist = hists[x*numY + y].ptr<float>();
+                    const uchar *code = codes.data() + x*widthStep;
+                    for (int c=0; c<width; c++)
+                        if (code[c] < dims)
+                            hist[code[c]]++;
+                }
             }
         }
 
-        dst += n;
+        dst = Template(src.file, hists);
     }
 };
 
-BR_REGISTER(Transform, LBPTransform)
+BR_REGISTER(Transform, LBPHistTransform)
 
 } // namespace br
 
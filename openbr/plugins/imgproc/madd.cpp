@@ -24,7 +24,7 @@ namespace br
  * \brief dst = a*src+b
  * \author Josh Klontz \cite jklontz
  */
-class MAddTransform : public UntrainableTransform
+class MAddTransform : public PixelTransform
 {
     Q_OBJECT
     Q_PROPERTY(double a READ get_a WRITE set_a RESET reset_a STORED false)
@@ -36,6 +36,21 @@ class MAddTransform : public UntrainableTransform
     {
         src.m().convertTo(dst.m(), src.m().depth(), a, b);
     }
+
+    int outputType(int type) const
+    {
+        return type;
+    }
+
+    void projectTile(const Mat &src, Mat &dst) const
+    {
+        src.convertTo(dst, src.depth(), a, b);
+    }
+
+    QString likelyExpression(const QString &src) const
+    {
+        return QString("(+ (* %1 %2) %3)").arg(src, QString::number(a, 'e', 17), QString::number(b, 'e', 17));
+    }
 };
 
 BR_REGISTER(Transform, MAddTransform)
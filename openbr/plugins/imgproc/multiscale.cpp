@@ -18,6 +18,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/pyramid.h>
 
 using namespace cv;
 
@@ -170,10 +171,10 @@ private:
         else
             startScale = qRound((float) cols / (float) windowWidth);
 
+        QSharedPointer<ImagePyramid> pyramid = ImagePyramid::get(src);
         for (float scale = startScale; scale >= minScale; scale -= (1.0 - scaleFactor)) {
-            Template scaleImg(dst.file, Mat());
+            Template scaleImg(dst.file, pyramid->level(Size(qRound(cols / scale), qRound(rows / scale))));
             scaleImg.file.set("scale", scale);
-            resize(src, scaleImg, Size(qRound(cols / scale), qRound(rows / scale)));
             transform->project(scaleImg, dst);
             if (takeLargestScale && !dst.file.rects().empty())
                 return;
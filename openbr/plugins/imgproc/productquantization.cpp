@@ -14,11 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/distance_sse.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -30,6 +30,9 @@ QVector<Mat> ProductQuantizationLUTs;
 /*!
  * \ingroup distances
  * \brief Distance in a product quantized space \cite jegou11
+ *
+ * Blocks of comparisons build a table of each query's distances to every center once,
+ * then score each target by summing one table entry per subspace.
  * \author Josh Klontz \cite jklontz
  */
 class ProductQuantizationDistance : public UntrainableDistance
@@ -63,6 +66,69 @@ class ProductQuantizationDistance : public UntrainableDistance
         if (!bayesian) distance = -log(distance+1);
         return distance;
     }
+
+    // Expands the query's row of each subspace's triangular LUT into 256 contiguous entries
+    static void buildTable(const Template &query, QVector<float> &table)
+    {
+        int total = 0;
+        foreach (const Mat &m, query)
+            total += m.total()-sizeof(quint16);
+        table.resize(total*256);
+
+        float *entry = table.data();
+        foreach (const Mat &m, query) {
+            const int elements = m.total()-sizeof(quint16);
+            const quint16 index = *reinterpret_cast<const quint16*>(m.data);
+            const uchar *codes = m.data + sizeof(quint16);
+            const float *lut = (const float*)ProductQuantizationLUTs[index].data;
+            for (int j=0; j<elements; j++) {
+                const float *subspace = lut + j*256*(256+1)/2;
+                const int q = codes[j];
+                for (int c=0; c<256; c++) {
+                    const int y = max(q, c);
+                    const int x = min(q, c);
+                    *entry++ = subspace[x + (y+1)*y/2];
+                }
+            }
+        }
+    }
+
+    static bool compatible(const Template &a, const Template &b)
+    {
+        if (a.isEmpty() || (a.size() != b.size()))
+            return false;
+        for (int i=0; i<a.size(); i++)
+            if (a[i].total() != b[i].total())
+                return false;
+        return true;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        QVector<float> table;
+        for (int i=0; i<query.size(); i++) {
+            const bool valid = !query[i].isEmpty();
+            if (valid)
+                buildTable(query[i], table);
+
+            for (int j=0; j<target.size(); j++) {
+                if (!valid || !compatible(query[i], target[j])) {
+                    output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                    continue;
+                }
+
+                float distance = 0;
+                const float *subspaces = table.constData();
+                foreach (const Mat &m, target[j]) {
+                    const int elements = m.total()-sizeof(quint16);
+                    distance += pq_adc(subspaces, m.data + sizeof(quint16), elements);
+                    subspaces += elements*256;
+                }
+                if (!bayesian) distance = -log(distance+1);
+                output->setRelative(distance, i+queryOffset, j+targetOffset);
+            }
+        }
+    }
 };
 
 BR_REGISTER(Distance, ProductQuantizationDistance)
@@ -224,12 +290,12 @@ private:
             subluts.append(lut.row(i));
         }
 
-        QFutureSynchronizer<void> futures;
+        TaskGroup tasks;
         for (int i=0; i<lut.rows; i++) {
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &ProductQuantizationTransform::_train, subdata[i], labels, &subluts[i], &centers[i]));
-            else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i]);
+            if (Globals->parallelism) tasks.runMember(this, &ProductQuantizationTransform::_train, subdata[i], labels, &subluts[i], &centers[i]);
+            else                                                                           _train (subdata[i], labels, &subluts[i], &centers[i]);
         }
-        futures.waitForFinished();
+        tasks.wait();
     }
 
     int getIndex(const Mat &m, const Mat &center) const
@@ -42,7 +42,6 @@ class RecursiveIntegralSamplerTransform : public Transform
 
     Transform *subTransform;
 
-    typedef Eigen::Map< const Eigen::Matrix<qint32,Eigen::Dynamic,1> > InputDescriptor;
     typedef Eigen::Map< Eigen::Matrix<float,Eigen::Dynamic,1> > OutputDescriptor;
     typedef Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,1> > SecondOrderInputDescriptor;
 
@@ -57,14 +56,23 @@ class RecursiveIntegralSamplerTransform : public Transform
         }
     }
 
+    template <typename T>
     static void integralHistogram(const Mat &src, const int x, const int y, const int width, const int height, Mat &dst, int index)
     {
+        typedef Eigen::Map< const Eigen::Matrix<T,Eigen::Dynamic,1> > InputDescriptor;
         const int channels = src.channels();
         OutputDescriptor(dst.ptr<float>(index), channels, 1) =
-            (  InputDescriptor(src.ptr<qint32>(y+height, x+width), channels, 1)
-             - InputDescriptor(src.ptr<qint32>(y,        x+width), channels, 1)
-             - InputDescriptor(src.ptr<qint32>(y+height, x),       channels, 1)
-             + InputDescriptor(src.ptr<qint32>(y,        x),       channels, 1)).cast<float>()/(height*width);
+            (  InputDescriptor(src.ptr<T>(y+height, x+width), channels, 1).template cast<qint32>()
+             - InputDescriptor(src.ptr<T>(y,        x+width), channels, 1).template cast<qint32>()
+             - InputDescriptor(src.ptr<T>(y+height, x),       channels, 1).template cast<qint32>()
+             + InputDescriptor(src.ptr<T>(y,        x),       channels, 1).template cast<qint32>()).template cast<float>()/(height*width);
+    }
+
+    // Integral images are CV_32S, or CV_16U from IntegralHist(compact=true)
+    static void integralHistogram(const Mat &src, const int x, const int y, const int width, const int height, Mat &dst, int index)
+    {
+        if (src.depth() == CV_16U) integralHistogram<quint16>(src, x, y, width, height, dst, index);
+        else                       integralHistogram<qint32>(src, x, y, width, height, dst, index);
     }
 
     void computeDescriptor(const Mat &src, Mat &dst) const
@@ -115,8 +123,8 @@ class RecursiveIntegralSamplerTransform : public Transform
 
     void train(const TemplateList &src)
     {
-        if (src.first().m().depth() != CV_32S)
-            qFatal("Expected CV_32S depth!");
+        if ((src.first().m().depth() != CV_32S) && (src.first().m().depth() != CV_16U))
+            qFatal("Expected CV_32S or CV_16U depth!");
 
         if (subTransform != NULL) {
             TemplateList subSrc; subSrc.reserve(src.size());
@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
 
 using namespace cv;
 
@@ -56,9 +57,11 @@ private:
 
     void project(const Template &src, Template &dst) const
     {
-        if (!preserveAspect)
-            resize(src, dst, Size((columns == -1) ? src.m().cols*rows/src.m().rows : columns, rows), 0, 0, method);
-        else {
+        if (!preserveAspect) {
+            Mat m = MatArena::mat();
+            resize(src, m, Size((columns == -1) ? src.m().cols*rows/src.m().rows : columns, rows), 0, 0, method);
+            dst = m;
+        } else {
             float inRatio = (float) src.m().rows / src.m().cols;
             float outRatio = (float) rows / columns;
             dst = Mat::zeros(rows, columns, src.m().type());
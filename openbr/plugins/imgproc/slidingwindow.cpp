@@ -118,7 +118,35 @@ private:
 
         Template windowTemplate(src.file, src);
         QList<float> confidences = dst.file.getList<float>("Confidences", QList<float>());
+
+        // Classifiers that support it score a whole row of windows per call
+        const WindowClassifier *classifier = dynamic_cast<const WindowClassifier*>(transform);
+        bool batched = (classifier != NULL);
+
         for (float y = 0; y + windowHeight < src.m().rows; y += windowHeight*stepFraction) {
+            if (batched) {
+                QList<float> xs;
+                QList<Rect> windows;
+                for (float x = 0; x + windowWidth < src.m().cols; x += windowWidth*stepFraction) {
+                    xs.append(x);
+                    windows.append(Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2, windowHeight - ignoreBorder * 2));
+                }
+
+                QList<float> responses;
+                batched = classifier->classifyWindows(src, windows, responses);
+                if (batched) {
+                    for (int i=0; i<responses.size(); i++) {
+                        if (responses[i] > threshold) {
+                            dst.file.appendRect(QRectF(xs[i]*scale, y*scale, windowWidth*scale, windowHeight*scale));
+                            confidences.append(responses[i]);
+                            if (takeFirst)
+                                return;
+                        }
+                    }
+                    continue;
+                }
+            }
+
             for (float x = 0; x + windowWidth < src.m().cols; x += windowWidth*stepFraction) {
                 Mat windowMat(src, Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2, windowHeight - ignoreBorder * 2));
                 windowTemplate.replace(0,windowMat);
@@ -17,6 +17,7 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -25,14 +26,20 @@ namespace br
  * \ingroup transforms
  * \brief Decodes images
  * \author Josh Klontz \cite jklontz
+ *
+ * A positive \em maxSize lets JPEGs decode directly at a reduced resolution, see OpenCVUtils::imdecode.
  */
 class DecodeTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(int maxSize READ get_maxSize WRITE set_maxSize RESET reset_maxSize STORED false)
+    BR_PROPERTY(int, maxSize, 0)
 
     void project(const Template &src, Template &dst) const
     {
-        dst.append(cv::imdecode(src.m(), cv::IMREAD_UNCHANGED));
+        int scale;
+        dst.append(OpenCVUtils::imdecode(src.m(), cv::IMREAD_UNCHANGED, maxSize, &scale));
+        scaleLandmarks(dst.file, scale);
     }
 };
 
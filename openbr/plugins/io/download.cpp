@@ -14,10 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtNetwork>
+#include <QtCore>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/downloader.h>
 
 using namespace cv;
 
@@ -27,6 +28,9 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Downloads an image from a URL
+ *
+ * The templates of a list are downloaded concurrently with at most \c maxRequests in flight, see br::DownloadBatch,
+ * and each is decoded as soon as its download finishes. Transient failures are retried up to \c retries times.
  * \author Josh Klontz \cite jklontz
  */
 class DownloadTransform : public UntrainableMetaTransform
@@ -34,6 +38,8 @@ class DownloadTransform : public UntrainableMetaTransform
     Q_OBJECT
     Q_ENUMS(Mode)
     Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode STORED false)
+    Q_PROPERTY(int maxRequests READ get_maxRequests WRITE set_maxRequests RESET reset_maxRequests STORED false)
+    Q_PROPERTY(int retries READ get_retries WRITE set_retries RESET reset_retries STORED false)
 
 public:
     enum Mode { Permissive,
@@ -41,63 +47,69 @@ public:
                 Decoded };
 private:
     BR_PROPERTY(Mode, mode, Encoded)
-
-    // The reasons for this data structure are as follows:
-    // 1) The QNetworkAccessManager must be used in the thread that _created_ it,
-    //    hence the use of `QThreadStorage`.
-    // 2) The QThreadStorage must be deleted _after_ the threads that added QNetworkAccessManager
-    //    to it are deleted, hence the `static` ensuring that `nam` is deleted at program termination,
-    //    long after the threads that created QNetworkAccessManager are deleted.
-    static QThreadStorage<QNetworkAccessManager*> nam;
+    BR_PROPERTY(int, maxRequests, 16)
+    BR_PROPERTY(int, retries, 3)
 
     void project(const Template &src, Template &dst) const
     {
-        dst.file = src.file;
-        QString url = src.file.get<QString>("URL", src.file.name).simplified();
-        if (!url.contains("://"))
-            url = "file://" + url;
-        dst.file.set("URL", url);
+        TemplateList dsts;
+        project(TemplateList() << src, dsts);
+        dst = dsts.first();
+    }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
         static const QRegularExpression regExp("file:///[A-Z]:/");
 
-        if (url.contains(regExp))
-            url = url.mid(8);
-        else if (url.startsWith("file://"))
-            url = url.mid(7);
-
-        QIODevice *device = NULL;
-        if (QFileInfo(url).exists()) {
-            device = new QFile(url);
-            device->open(QIODevice::ReadOnly);
-        } else {
-            if (!nam.hasLocalData())
-                nam.setLocalData(new QNetworkAccessManager());
-            const QUrl qURL(url, QUrl::StrictMode);
-            if (qURL.isValid() && !qURL.isRelative()) {
-                QNetworkRequest req = QNetworkRequest(qURL);
-                req.setRawHeader("User-Agent", "br");
-                QNetworkReply *reply = nam.localData()->get(req);
-
-                reply->waitForReadyRead(-1);
-                while (!reply->isFinished())
-                    QCoreApplication::processEvents();
-
-                if (reply->error() != QNetworkReply::NoError) {
-                    qDebug() << reply->errorString() << url;
-                    reply->deleteLater();
-                } else {
-                    device = reply;
-                }
+        // Local files are read while the remote ones download
+        QList<int> local, remote;
+        QStringList paths;
+        QList<QUrl> urls;
+        foreach (const Template &t, src) {
+            dst.append(Template(t.file));
+            File &file = dst.last().file;
+            QString url = file.get<QString>("URL", file.name).simplified();
+            if (!url.contains("://"))
+                url = "file://" + url;
+            file.set("URL", url);
+
+            QString path = url;
+            if (path.contains(regExp))
+                path = path.mid(8);
+            else if (path.startsWith("file://"))
+                path = path.mid(7);
+
+            const QUrl qURL(path, QUrl::StrictMode);
+            if (QFileInfo(path).exists()) {
+                local.append(dst.size()-1);
+                paths.append(path);
+            } else if (qURL.isValid() && !qURL.isRelative()) {
+                remote.append(dst.size()-1);
+                urls.append(qURL);
+            } else {
+                decode(QByteArray(), dst.last());
             }
         }
+        DownloadBatch batch(urls, maxRequests, retries);
+
+        for (int i=0; i<local.size(); i++) {
+            QFile file(paths[i]);
+            file.open(QIODevice::ReadOnly);
+            decode(file.readAll(), dst[local[i]]);
+        }
 
         QByteArray data;
-        if (device) {
-            data = device->readAll();
-            delete device;
-            device = NULL;
+        QString error;
+        int index;
+        while ((index = batch.next(data, error)) != -1) {
+            if (!error.isEmpty())
+                qDebug() << error << urls[index].toString();
+            decode(data, dst[remote[index]]);
         }
+    }
 
+    void decode(const QByteArray &data, Template &dst) const
+    {
         if (!data.isEmpty()) {
             Mat encoded(1, data.size(), CV_8UC1, (void*)data.data());
             encoded = encoded.clone();
@@ -113,11 +125,10 @@ private:
             dst.file.set("AlgorithmID", data.isEmpty() ? 0 : (mode == Decoded ? 5 : 3));
         } else {
             dst.file.fte = true;
-            qWarning("Error opening %s", qPrintable(url));
+            qWarning("Error opening %s", qPrintable(dst.file.get<QString>("URL")));
         }
     }
 };
-QThreadStorage<QNetworkAccessManager*> DownloadTransform::nam;
 
 BR_REGISTER(Transform, DownloadTransform)
 
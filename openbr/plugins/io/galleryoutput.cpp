@@ -15,16 +15,30 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/asyncwriter.h>
 
 namespace br
 {
 
+/*!
+ * \ingroup transforms
+ * \brief Appends the templates passing through to the \c outputString gallery.
+ *
+ * Templates are written in groups of \c commitSize, by a background thread unless \c asynchronous is disabled,
+ * with at most \c queueSize groups waiting. Every template has been written once the transform is finalized.
+ */
 class GalleryOutputTransform : public TimeVaryingTransform
 {
     Q_OBJECT
 
     Q_PROPERTY(QString outputString READ get_outputString WRITE set_outputString RESET reset_outputString STORED false)
+    Q_PROPERTY(bool asynchronous READ get_asynchronous WRITE set_asynchronous RESET reset_asynchronous STORED false)
+    Q_PROPERTY(int commitSize READ get_commitSize WRITE set_commitSize RESET reset_commitSize STORED false)
+    Q_PROPERTY(int queueSize READ get_queueSize WRITE set_queueSize RESET reset_queueSize STORED false)
     BR_PROPERTY(QString, outputString, "")
+    BR_PROPERTY(bool, asynchronous, true)
+    BR_PROPERTY(int, commitSize, 64)
+    BR_PROPERTY(int, queueSize, 8)
 
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
@@ -35,20 +49,28 @@ class GalleryOutputTransform : public TimeVaryingTransform
             if (dst[i].file.getBool("FTE"))
                 dst[i].file.fte = true;
         }
-        writer->writeBlock(dst);
+        commits->append(dst);
     }
 
     void train(const TemplateList& data)
     {
         (void) data;
     }
-    ;
+
+    void finalize(TemplateList &output)
+    {
+        commits->flush();
+        TimeVaryingTransform::finalize(output);
+    }
+
     void init()
     {
-        writer = QSharedPointer<Gallery>(Gallery::make(outputString));
+        // Finish the previous gallery before reopening it
+        commits.reset();
+        commits.reset(new GroupCommit(QSharedPointer<Gallery>(Gallery::make(outputString)), commitSize, asynchronous, queueSize));
     }
 
-    QSharedPointer<Gallery> writer;
+    QScopedPointer<GroupCommit> commits;
 public:
     GalleryOutputTransform() : TimeVaryingTransform(false,false) {}
 };
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/asyncwriter.h>
 
 namespace br
 {
@@ -26,6 +27,8 @@ namespace br
  * template's filename, and the galleryFormat property.
  * Templates received in projectUpdate will be output to the gallery with a filename combining their original filename and
  * their FrameNumber property, with the file extension specified by the fileFormat property.
+ * Templates are written in groups of \c commitSize, by a background thread unless \c asynchronous is disabled,
+ * with at most \c queueSize groups waiting. The gallery is complete once the transform is finalized.
  * \author Charles Otto \cite caotto
  */
 class IncrementalOutputTransform : public TimeVaryingTransform
@@ -34,8 +37,14 @@ class IncrementalOutputTransform : public TimeVaryingTransform
 
     Q_PROPERTY(QString galleryFormat READ get_galleryFormat WRITE set_galleryFormat RESET reset_galleryFormat STORED false)
     Q_PROPERTY(QString fileFormat READ get_fileFormat WRITE set_fileFormat RESET reset_fileFormat STORED false)
+    Q_PROPERTY(bool asynchronous READ get_asynchronous WRITE set_asynchronous RESET reset_asynchronous STORED false)
+    Q_PROPERTY(int commitSize READ get_commitSize WRITE set_commitSize RESET reset_commitSize STORED false)
+    Q_PROPERTY(int queueSize READ get_queueSize WRITE set_queueSize RESET reset_queueSize STORED false)
     BR_PROPERTY(QString, galleryFormat, "")
     BR_PROPERTY(QString, fileFormat, ".png")
+    BR_PROPERTY(bool, asynchronous, true)
+    BR_PROPERTY(int, commitSize, 64)
+    BR_PROPERTY(int, queueSize, 8)
 
     bool galleryUp;
 
@@ -48,7 +57,7 @@ class IncrementalOutputTransform : public TimeVaryingTransform
             QFileInfo finfo(src[0].file.name);
             QString galleryName = finfo.baseName() + galleryFormat;
 
-            writer = QSharedPointer<Gallery> (Factory<Gallery>::make(galleryName));
+            writer.reset(new GroupCommit(QSharedPointer<Gallery>(Factory<Gallery>::make(galleryName)), commitSize, asynchronous, queueSize));
             galleryUp = true;
         }
 
@@ -65,7 +74,7 @@ class IncrementalOutputTransform : public TimeVaryingTransform
             idx++;
             Template out = t;
             out.file.name = outputName;
-            writer->write(out);
+            writer->append(out);
         }
     }
 
@@ -74,14 +83,15 @@ class IncrementalOutputTransform : public TimeVaryingTransform
         (void) data;
     }
 
-    // Drop the current gallery.
+    // Finish writing and drop the current gallery.
     void finalize(TemplateList &data)
     {
         (void) data;
+        writer.reset();
         galleryUp = false;
     }
 
-    QSharedPointer<Gallery> writer;
+    QScopedPointer<GroupCommit> writer;
 public:
     IncrementalOutputTransform() : TimeVaryingTransform(false,false) {galleryUp = false;}
 };
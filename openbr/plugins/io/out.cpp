@@ -14,7 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QElapsedTimer>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/checkpoint.h>
 
 namespace br
 {
@@ -28,11 +30,17 @@ class OutputTransform : public TimeVaryingTransform
     Q_PROPERTY(QString targetName READ get_targetName WRITE set_targetName RESET reset_targetName STORED false)
     Q_PROPERTY(QString queryName  READ get_queryName WRITE set_queryName RESET reset_queryName STORED false)
     Q_PROPERTY(bool transposeMode  READ get_transposeMode WRITE set_transposeMode RESET reset_transposeMode STORED false)
+    // columns buffered before writing a block in transpose mode
+    Q_PROPERTY(int bufferedSize READ get_bufferedSize WRITE set_bufferedSize RESET reset_bufferedSize STORED false)
+    // continue from the output's br::Checkpoint, the stream skips the templates it records as complete
+    Q_PROPERTY(bool resume READ get_resume WRITE set_resume RESET reset_resume STORED false)
 
     BR_PROPERTY(QString, outputString, "")
     BR_PROPERTY(QString, targetName, "")
     BR_PROPERTY(QString, queryName, "")
     BR_PROPERTY(bool, transposeMode, false)
+    BR_PROPERTY(int, bufferedSize, 100)
+    BR_PROPERTY(bool, resume, false)
 
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
@@ -72,7 +80,7 @@ class OutputTransform : public TimeVaryingTransform
                 currentBlockRow++;
                 blockDone = true;
             }
-            // in transpose mode, we buffer 100 cols before writing the block
+            // in transpose mode, we buffer bufferedSize cols before writing the block
             else if (currentCol == bufferedSize) {
                 currentBlockCol++;
                 blockDone = true;
@@ -84,6 +92,8 @@ class OutputTransform : public TimeVaryingTransform
                 output->setBlock(currentBlockRow, currentBlockCol);
                 currentRow = 0;
                 currentCol = 0;
+                progress.completed += progress.bufferedSize;
+                saveCheckpoint();
             }
         }
     }
@@ -107,10 +117,8 @@ class OutputTransform : public TimeVaryingTransform
         currentRow = 0;
         currentCol = 0;
 
-        bufferedSize = 100;
-
         if (transposeMode) {
-            // buffer 100 cols at a time
+            // buffer bufferedSize cols at a time
             fragmentsPerRow = bufferedSize;
             // a single col contains comparisons to all query files
             fragmentsPerCol = queryFiles.size();
@@ -124,7 +132,24 @@ class OutputTransform : public TimeVaryingTransform
             fragmentsPerCol = 1;
         }
 
-        output = QSharedPointer<Output>(Output::make(outputString+"[targetGallery="+targetName+",queryGallery="+queryName+"]", targetFiles, queryFiles));
+        outputName = File(outputString).name;
+        progress = Checkpoint();
+        progress.bufferedSize = transposeMode ? bufferedSize : 1;
+        progress.rows = queryFiles.size();
+        progress.columns = targetFiles.size();
+        if (resume) {
+            Checkpoint previous;
+            if (!previous.load(outputName) || (previous.rows != progress.rows) || (previous.columns != progress.columns)
+                    || (previous.bufferedSize != progress.bufferedSize))
+                qFatal("Checkpoint %s does not match the comparison being resumed.", qPrintable(Checkpoint::fileName(outputName)));
+            progress.completed = previous.completed;
+            if (transposeMode) currentBlockCol = progress.completed / progress.bufferedSize;
+            else               currentBlockRow = progress.completed;
+        }
+        checkpointing = Globals->checkpointInterval > 0;
+        checkpointTimer.start();
+
+        output = QSharedPointer<Output>(Output::make(outputString+"[targetGallery="+targetName+",queryGallery="+queryName+(resume ? ",resume=true" : "")+"]", targetFiles, queryFiles));
         output->blockRows = fragmentsPerCol;
         output->blockCols = fragmentsPerRow;
         output->initialize(targetFiles, queryFiles);
@@ -132,9 +157,25 @@ class OutputTransform : public TimeVaryingTransform
         output->setBlock(currentBlockRow, currentBlockCol);
     }
 
-    QSharedPointer<Output> output;
+    // Once Context::checkpointInterval has passed, record the streamed templates whose blocks the output has made durable
+    void saveCheckpoint()
+    {
+        if (!checkpointing || (checkpointTimer.elapsed() < 1000 * qint64(Globals->checkpointInterval)))
+            return;
+        if (!output->checkpoint()) {
+            qWarning("%s can't be checkpointed.", qPrintable(outputName));
+            checkpointing = false;
+            return;
+        }
+        progress.save(outputName);
+        checkpointTimer.restart();
+    }
 
-    int bufferedSize;
+    QSharedPointer<Output> output;
+    QString outputName;
+    Checkpoint progress;
+    bool checkpointing;
+    QElapsedTimer checkpointTimer;
 
     int currentRow;
     int currentCol;
@@ -148,7 +189,17 @@ class OutputTransform : public TimeVaryingTransform
     int scoresPerMat;
 
 public:
-    OutputTransform() : TimeVaryingTransform(false,false) {}
+    OutputTransform() : TimeVaryingTransform(false,false), checkpointing(false) {}
+
+    ~OutputTransform()
+    {
+        // The checkpoint of a finished comparison is no longer needed once the output has written its last block
+        const qint64 streamed = progress.completed + (transposeMode ? currentCol : 0);
+        const bool finished = !output.isNull() && (streamed >= (transposeMode ? progress.columns : progress.rows));
+        output.clear();
+        if (finished && (checkpointing || resume))
+            QFile::remove(Checkpoint::fileName(outputName));
+    }
 };
 
 BR_REGISTER(Transform, OutputTransform)
@@ -14,9 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFile>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -27,12 +29,22 @@ namespace br
  * \ingroup transforms
  * \brief Read images
  * \author Josh Klontz \cite jklontz
+ *
+ * A positive \em maxSize lets JPEGs decode directly at a reduced resolution, see OpenCVUtils::imdecode.
+ * Landmarks are scaled to match.
+ *
+ * With \em lazy true, images are not decoded when first projected. Instead the \c Width and \c Height metadata are set
+ * from the image header, and the template is marked \c Deferred. PipeTransform runs the metadata transforms that follow
+ * on it, then projects this transform again to decode the image just before the first stage that needs pixels.
+ * Images filtered out in the meantime are never decoded.
  */
 class ReadTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
     Q_ENUMS(Mode)
     Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode)
+    Q_PROPERTY(int maxSize READ get_maxSize WRITE set_maxSize RESET reset_maxSize STORED false)
+    Q_PROPERTY(bool lazy READ get_lazy WRITE set_lazy RESET reset_lazy STORED false)
 
 public:
     enum Mode
@@ -46,24 +58,53 @@ public:
 
 private:
     BR_PROPERTY(Mode, mode, Color)
+    BR_PROPERTY(int, maxSize, 0)
+    BR_PROPERTY(bool, lazy, false)
 
     void project(const Template &src, Template &dst) const
     {
         dst.file = src.file;
+
+        // The second projection of a deferred template decodes it
+        if (src.file.contains("Deferred")) {
+            dst.file.remove("Deferred");
+        } else if (lazy && src.empty()) {
+            const cv::Size size = OpenCVUtils::imageSize(src.file.resolved());
+            if (size.area() > 0) {
+                dst.file.set("Width", size.width);
+                dst.file.set("Height", size.height);
+            }
+            dst.file.set("Deferred", true);
+            return;
+        }
+
         if (Globals->verbose)
             qDebug("Opening %s", qPrintable(src.file.flat()));
 
+        int scale = 1;
         if (src.empty()) {
-            const Mat img = imread(src.file.resolved().toStdString(), mode);
+            Mat img;
+            if (maxSize > 0) {
+                QFile file(src.file.resolved());
+                if (file.open(QFile::ReadOnly)) {
+                    QByteArray data = file.readAll();
+                    if (!data.isEmpty())
+                        img = OpenCVUtils::imdecode(Mat(1, data.size(), CV_8UC1, data.data()), mode, maxSize, &scale);
+                }
+            } else {
+                img = imread(src.file.resolved().toStdString(), mode);
+            }
             if (img.data) dst.append(img);
             else          dst.file.fte = true;
         } else {
             foreach (const Mat &m, src) {
-                const Mat img = imdecode(m, mode);
-                if (img.data) dst.append(img);
+                int imageScale;
+                const Mat img = OpenCVUtils::imdecode(m, mode, maxSize, &imageScale);
+                if (img.data) { dst.append(img); scale = std::max(scale, imageScale); }
                 else          dst.file.fte = true;
             }
         }
+        scaleLandmarks(dst.file, scale);
         if (dst.file.fte)
             qWarning("Error opening %s", qPrintable(src.file.flat()));
     }
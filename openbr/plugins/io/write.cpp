@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/asyncwriter.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -25,6 +26,10 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Write all mats to disk as images.
+ *
+ * Unless \c asynchronous is disabled images are encoded and saved by \c writers background threads, with at most \c queueSize
+ * images waiting, so the pipeline doesn't stall on compression and disk latency. Set \c ordered to save them one at a time
+ * in the order they were received. Every image has been saved once the transform is finalized.
  * \author Brendan Klare \cite bklare
  */
 class WriteTransform : public TimeVaryingTransform
@@ -33,24 +38,51 @@ class WriteTransform : public TimeVaryingTransform
     Q_PROPERTY(QString outputDirectory READ get_outputDirectory WRITE set_outputDirectory RESET reset_outputDirectory STORED false)
     Q_PROPERTY(QString imageName READ get_imageName WRITE set_imageName RESET reset_imageName STORED false)
     Q_PROPERTY(QString imgExtension READ get_imgExtension WRITE set_imgExtension RESET reset_imgExtension STORED false)
+    Q_PROPERTY(bool asynchronous READ get_asynchronous WRITE set_asynchronous RESET reset_asynchronous STORED false)
+    Q_PROPERTY(int writers READ get_writers WRITE set_writers RESET reset_writers STORED false)
+    Q_PROPERTY(int queueSize READ get_queueSize WRITE set_queueSize RESET reset_queueSize STORED false)
+    Q_PROPERTY(bool ordered READ get_ordered WRITE set_ordered RESET reset_ordered STORED false)
     BR_PROPERTY(QString, outputDirectory, "Temp")
     BR_PROPERTY(QString, imageName, "image")
     BR_PROPERTY(QString, imgExtension, "jpg")
+    BR_PROPERTY(bool, asynchronous, true)
+    BR_PROPERTY(int, writers, 2)
+    BR_PROPERTY(int, queueSize, 64)
+    BR_PROPERTY(bool, ordered, false)
+
+    struct SaveImage : public QRunnable
+    {
+        Mat m;
+        QString fileName;
+        SaveImage(const Mat &m, const QString &fileName) : m(m), fileName(fileName) {}
+        void run() { OpenCVUtils::saveImage(m, fileName); }
+    };
 
     int cnt;
+    QSharedPointer<AsyncWriter> writer;
 
     void init() {
         cnt = 0;
         if (! QDir(outputDirectory).exists())
             QDir().mkdir(outputDirectory);
+        writer = asynchronous ? QSharedPointer<AsyncWriter>(new AsyncWriter(writers, queueSize, ordered)) : QSharedPointer<AsyncWriter>();
     }
 
     void projectUpdate(const Template &src, Template &dst)
     {
         dst = src;
-        OpenCVUtils::saveImage(dst.m(), QString("%1/%2_%3.%4").arg(outputDirectory).arg(imageName).arg(cnt++, 5, 10, QChar('0')).arg(imgExtension));
+        const QString fileName = QString("%1/%2_%3.%4").arg(outputDirectory).arg(imageName).arg(cnt++, 5, 10, QChar('0')).arg(imgExtension);
+        // Copied because later transforms may reuse the data before it is saved
+        if (writer) writer->start(new SaveImage(dst.m().clone(), fileName));
+        else        OpenCVUtils::saveImage(dst.m(), fileName);
     }
 
+    void finalize(TemplateList &output)
+    {
+        if (writer)
+            writer->flush();
+        TimeVaryingTransform::finalize(output);
+    }
 };
 
 BR_REGISTER(Transform, WriteTransform)
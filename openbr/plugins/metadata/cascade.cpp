@@ -19,8 +19,10 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/pyramid.h>
 #include <openbr/core/resource.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
     
@@ -158,7 +160,102 @@ static void trainCascade(const TrainParams &params)
 namespace br
 {
         
-class CascadeResourceMaker : public ResourceMaker<CascadeClassifier>
+// Runs new format cascades over the shared ImagePyramid instead of rescaling the image itself
+class PyramidCascadeClassifier : public CascadeClassifier
+{
+public:
+    // The scan of one scale
+    struct Level
+    {
+        double factor;
+        Size scaledImageSize, processingRectSize;
+        int stripCount, stripSize, yStep;
+    };
+
+    struct Detections
+    {
+        std::vector<Rect> candidates;
+        std::vector<int> rejectLevels;
+        std::vector<double> levelWeights;
+        bool scanned;
+    };
+
+    bool usesPyramid(const Mat &image) const
+    {
+        return !isOldFormatCascade() && (image.channels() == 1);
+    }
+
+    // The scales detectMultiScale visits, smallest windows first
+    QList<Level> levels(const Mat &image, double scaleFactor, Size minObjectSize) const
+    {
+        const int PTS_PER_THREAD = 1000;
+        const Size originalWindowSize = getOriginalWindowSize();
+        const bool hog = getFeatureType() == FeatureEvaluator::HOG;
+
+        QList<Level> levels;
+        for (double factor = 1; ; factor *= scaleFactor) {
+            Level level;
+            level.factor = factor;
+            const Size windowSize(cvRound(originalWindowSize.width*factor), cvRound(originalWindowSize.height*factor));
+            level.scaledImageSize = Size(cvRound(image.cols/factor), cvRound(image.rows/factor));
+            level.processingRectSize = Size(level.scaledImageSize.width - originalWindowSize.width, level.scaledImageSize.height - originalWindowSize.height);
+
+            if ((level.processingRectSize.width <= 0) || (level.processingRectSize.height <= 0))
+                break;
+            if ((windowSize.width > image.cols) || (windowSize.height > image.rows))
+                break;
+            if ((windowSize.width < minObjectSize.width) || (windowSize.height < minObjectSize.height))
+                continue;
+
+            level.yStep = hog ? 4 : (factor > 2. ? 1 : 2);
+            level.stripCount = ((level.processingRectSize.width/level.yStep)*(level.processingRectSize.height + level.yStep-1)/level.yStep + PTS_PER_THREAD/2)/PTS_PER_THREAD;
+            level.stripCount = std::min(std::max(level.stripCount, 1), 100);
+            level.stripSize = (((level.processingRectSize.height + level.stripCount - 1)/level.stripCount + level.yStep-1)/level.yStep)*level.yStep;
+            levels.append(level);
+        }
+        return levels;
+    }
+
+    // Appends the candidates found at one scale
+    void detectLevel(ImagePyramid &pyramid, const Level &level, Detections &detections, bool outputRejectLevels)
+    {
+        detections.scanned = detectSingleScale(pyramid.level(level.scaledImageSize), level.stripCount, level.processingRectSize, level.stripSize, level.yStep, level.factor,
+                                               detections.candidates, detections.rejectLevels, detections.levelWeights, outputRejectLevels);
+    }
+
+    static void group(std::vector<Rect> &objects, std::vector<int> &rejectLevels, std::vector<double> &levelWeights, int minNeighbors, bool outputRejectLevels)
+    {
+        const double GROUP_EPS = 0.2;
+        if (outputRejectLevels) groupRectangles(objects, rejectLevels, levelWeights, minNeighbors, GROUP_EPS);
+        else                    groupRectangles(objects, minNeighbors, GROUP_EPS);
+    }
+
+    // CascadeClassifier::detectMultiScale, level for level
+    void detectMultiScale(const Mat &image, std::vector<Rect> &objects, std::vector<int> &rejectLevels, std::vector<double> &levelWeights,
+                          double scaleFactor, int minNeighbors, int flags, Size minObjectSize, bool outputRejectLevels)
+    {
+        if (!usesPyramid(image)) {
+            if (outputRejectLevels) CascadeClassifier::detectMultiScale(image, objects, rejectLevels, levelWeights, scaleFactor, minNeighbors, flags, minObjectSize, Size(), true);
+            else                    CascadeClassifier::detectMultiScale(image, objects, scaleFactor, minNeighbors, flags, minObjectSize);
+            return;
+        }
+
+        QSharedPointer<ImagePyramid> pyramid = ImagePyramid::get(image);
+        Detections detections;
+        foreach (const Level &level, levels(image, scaleFactor, minObjectSize)) {
+            detectLevel(*pyramid, level, detections, outputRejectLevels);
+            if (!detections.scanned)
+                break;
+        }
+
+        objects = detections.candidates;
+        rejectLevels = detections.rejectLevels;
+        levelWeights = detections.levelWeights;
+        group(objects, rejectLevels, levelWeights, minNeighbors, outputRejectLevels);
+    }
+};
+
+class CascadeResourceMaker : public ResourceMaker<PyramidCascadeClassifier>
 {
     QString file;
 
@@ -179,9 +276,9 @@ public:
     }
 
 private:
-    CascadeClassifier *make() const
+    PyramidCascadeClassifier *make() const
     {
-        CascadeClassifier *cascade = new CascadeClassifier();
+        PyramidCascadeClassifier *cascade = new PyramidCascadeClassifier();
         if (!cascade->load(file.toStdString()))
             qFatal("Failed to load: %s", qPrintable(file));
         return cascade;
@@ -191,6 +288,9 @@ private:
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV cascade classifier
+ *
+ * With \c parallelScales, the scales of a new format cascade are scanned concurrently, each with a classifier of its own,
+ * and the candidates of every scale are grouped together in scale order exactly as a serial scan would.
  * \author Josh Klontz \cite jklontz
  * \author David Crouse \cite dgcrouse
  */
@@ -201,6 +301,8 @@ class CascadeTransform : public MetaTransform
     Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
     Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
     Q_PROPERTY(bool ROCMode READ get_ROCMode WRITE set_ROCMode RESET reset_ROCMode STORED false)
+    Q_PROPERTY(int warm READ get_warm WRITE set_warm RESET reset_warm STORED false)
+    Q_PROPERTY(bool parallelScales READ get_parallelScales WRITE set_parallelScales RESET reset_parallelScales STORED false)
     
     // Training parameters 
     Q_PROPERTY(int numStages READ get_numStages WRITE set_numStages RESET reset_numStages STORED false) 
@@ -226,6 +328,8 @@ class CascadeTransform : public MetaTransform
     BR_PROPERTY(int, minSize, 64)
     BR_PROPERTY(int, minNeighbors, 5)
     BR_PROPERTY(bool, ROCMode, false)
+    BR_PROPERTY(int, warm, 0) // Classifiers to load at init rather than on demand
+    BR_PROPERTY(bool, parallelScales, true)
         
     // Training parameters - Default values provided trigger OpenCV defaults
     BR_PROPERTY(int, numStages, -1)
@@ -247,11 +351,15 @@ class CascadeTransform : public MetaTransform
     BR_PROPERTY(bool, show, false)
     BR_PROPERTY(bool, baseFormatSave, false)                    
 
-    Resource<CascadeClassifier> cascadeResource;
+    Resource<PyramidCascadeClassifier> cascadeResource;
 
     void init()
     {
         cascadeResource.setResourceMaker(new CascadeResourceMaker(model));
+        cascadeResource.setThreadAffine(true);
+        cascadeResource.setName("Cascade(" + model + ")");
+        if (warm > 0)
+            cascadeResource.warm(warm);
         if (model == "Ear" || model == "Eye" || model == "FrontalFace" || model == "ProfileFace")
             this->trainable = false;
     }
@@ -370,6 +478,37 @@ class CascadeTransform : public MetaTransform
         trainCascade(params);
     }
 
+    static void detectLevel(const Resource<PyramidCascadeClassifier> *resource, ImagePyramid *pyramid, const PyramidCascadeClassifier::Level *level,
+                            PyramidCascadeClassifier::Detections *detections, bool outputRejectLevels)
+    {
+        PyramidCascadeClassifier *cascade = resource->acquire();
+        cascade->detectLevel(*pyramid, *level, *detections, outputRejectLevels);
+        resource->release(cascade);
+    }
+
+    // PyramidCascadeClassifier::detectMultiScale with the scales spread across the shared pool
+    void detectParallel(const PyramidCascadeClassifier *cascade, const Mat &m, std::vector<Rect> &rects, std::vector<int> &rejectLevels, std::vector<double> &levelWeights) const
+    {
+        QSharedPointer<ImagePyramid> pyramid = ImagePyramid::get(m);
+        const QList<PyramidCascadeClassifier::Level> levels = cascade->levels(m, 1.2, Size(minSize, minSize));
+        QVector<PyramidCascadeClassifier::Detections> detections(levels.size());
+
+        TaskGroup tasks;
+        for (int i=0; i<levels.size(); i++)
+            tasks.run(detectLevel, &cascadeResource, pyramid.data(), &levels[i], &detections[i], bool(ROCMode));
+        tasks.wait();
+
+        // A serial scan stops at the first scale that fails
+        for (int i=0; i<detections.size(); i++) {
+            if (!detections[i].scanned)
+                break;
+            rects.insert(rects.end(), detections[i].candidates.begin(), detections[i].candidates.end());
+            rejectLevels.insert(rejectLevels.end(), detections[i].rejectLevels.begin(), detections[i].rejectLevels.end());
+            levelWeights.insert(levelWeights.end(), detections[i].levelWeights.begin(), detections[i].levelWeights.end());
+        }
+        PyramidCascadeClassifier::group(rects, rejectLevels, levelWeights, minNeighbors, ROCMode);
+    }
+
     void project(const Template &src, Template &dst) const
     {
         TemplateList temp;
@@ -379,7 +518,7 @@ class CascadeTransform : public MetaTransform
 
     void project(const TemplateList &src, TemplateList &dst) const
     {
-        CascadeClassifier *cascade = cascadeResource.acquire();
+        PyramidCascadeClassifier *cascade = cascadeResource.acquire();
         foreach (const Template &t, src) {
             const bool enrollAll = t.file.getBool("enrollAll");
 
@@ -396,8 +535,9 @@ class CascadeTransform : public MetaTransform
                 std::vector<Rect> rects;
                 std::vector<int> rejectLevels;
                 std::vector<double> levelWeights;
-                if (ROCMode) cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, 1.2, minNeighbors, (enrollAll ? 0 : CASCADE_FIND_BIGGEST_OBJECT) | CASCADE_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
-                else         cascade->detectMultiScale(m, rects, 1.2, minNeighbors, enrollAll ? 0 : CASCADE_FIND_BIGGEST_OBJECT, Size(minSize, minSize));
+                if (parallelScales && (Globals->parallelism > 1) && cascade->usesPyramid(m)) detectParallel(cascade, m, rects, rejectLevels, levelWeights);
+                else if (ROCMode) cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, 1.2, minNeighbors, (enrollAll ? 0 : CASCADE_FIND_BIGGEST_OBJECT) | CASCADE_SCALE_IMAGE, Size(minSize, minSize), true);
+                else              cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, 1.2, minNeighbors, enrollAll ? 0 : CASCADE_FIND_BIGGEST_OBJECT, Size(minSize, minSize), false);
 
                 if (!enrollAll && rects.empty())
                     rects.push_back(Rect(0, 0, m.cols, m.rows));
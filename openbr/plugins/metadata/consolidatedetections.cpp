@@ -14,12 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <Eigen/Dense>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
 
-using namespace Eigen;
 using namespace cv;
 
 namespace br
@@ -28,124 +25,144 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Consolidate redundant/overlapping detections.
+ *
+ * Detections overlap when their intersection covers more than \c overlap of the larger one.
+ * Overlapping pairs are found by sorting the detections by their left edge and sweeping,
+ * so only detections whose horizontal extents intersect are ever compared.
+ * - \c Regions averages the position, size and confidence of each connected group of overlapping detections.
+ * - \c Suppression keeps the most confident detection of each neighborhood and drops any detection overlapping one already kept.
  * \author Brendan Klare \cite bklare
  */
 class ConsolidateDetectionsTransform : public UntrainableMetadataTransform
 {
     Q_OBJECT
+    Q_ENUMS(Method)
+    Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
 
-    void projectMetadata(const File &src, File &dst) const
-    {
-        dst = src;
-        if (!dst.contains("Confidences"))
-            return;
+public:
+    /*!< */
+    enum Method { Regions,
+                  Suppression };
 
-        //Compute overlap between rectangles and create discrete Laplacian matrix
-        QList<Rect> rects = OpenCVUtils::toRects(src.rects());
-        int n = rects.size();
-        if (n == 0)
-            return;
-        MatrixXf laplace(n,n);
-        for (int i = 0; i < n; i++) {
-            laplace(i,i) = 0;
-        }
-        for (int i = 0; i < n; i++){
-            for (int j = i + 1; j < n; j++) {
-                float overlap = (float)((rects[i] & rects[j]).area()) / (float)max(rects[i].area(), rects[j].area());
-                if (overlap > 0.5) {
-                    laplace(i,j) = -1.0;
-                    laplace(j,i) = -1.0;
-                    laplace(i,i) = laplace(i,i) + 1.0;
-                    laplace(j,j) = laplace(j,j) + 1.0;
-                } else {
-                    laplace(i,j) = 0;
-                    laplace(j,i) = 0;
+private:
+    BR_PROPERTY(Method, method, Regions)
+    BR_PROPERTY(float, overlap, 0.5)
+
+    // For each detection, the later or earlier detections it overlaps
+    QVector< QVector<int> > neighbors(const QList<Rect> &rects) const
+    {
+        const int n = rects.size();
+        QVector<int> order(n);
+        for (int i=0; i<n; i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), LeftEdge(rects));
+
+        QVector< QVector<int> > neighbors(n);
+        for (int a=0; a<n; a++) {
+            const Rect &r = rects[order[a]];
+            for (int b=a+1; (b<n) && (rects[order[b]].x < r.x + r.width); b++) {
+                const Rect &s = rects[order[b]];
+                if ((s.y >= r.y + r.height) || (r.y >= s.y + s.height))
+                    continue;
+                if (float((r & s).area()) / float(std::max(r.area(), s.area())) > overlap) {
+                    neighbors[order[a]].append(order[b]);
+                    neighbors[order[b]].append(order[a]);
                 }
             }
         }
+        return neighbors;
+    }
 
-        // Compute eigendecomposition
-        SelfAdjointEigenSolver<Eigen::MatrixXf> eSolver(laplace);
-        MatrixXf allEVals = eSolver.eigenvalues();
-        MatrixXf allEVecs = eSolver.eigenvectors();
+    struct LeftEdge
+    {
+        const QList<Rect> &rects;
+        LeftEdge(const QList<Rect> &rects) : rects(rects) {}
+        bool operator()(int a, int b) const { return rects[a].x < rects[b].x; }
+    };
 
-        //Keep eigenvectors with zero eigenvalues
-        int nRegions = 0;
-        for (int i = 0; i < n; i++) {
-            if (fabs(allEVals(i)) < 1e-4) {
-                nRegions++;
+    struct HigherConfidence
+    {
+        const QList<float> &confidences;
+        HigherConfidence(const QList<float> &confidences) : confidences(confidences) {}
+        bool operator()(int a, int b) const { return confidences[a] > confidences[b]; }
+    };
+
+    // The connected groups of overlapping detections, averaged
+    static void regions(const QList<Rect> &rects, const QList<float> &confidences, const QVector< QVector<int> > &neighbors,
+                        QList<Rect> &consolidatedRects, QList<float> &consolidatedConfidences)
+    {
+        const int n = rects.size();
+        QVector<bool> visited(n, false);
+        QVector<int> stack;
+        for (int i=0; i<n; i++) {
+            if (visited[i]) continue;
+            visited[i] = true;
+            stack.append(i);
+
+            float midX = 0, midY = 0, width = 0, height = 0, confidence = 0;
+            int count = 0;
+            while (!stack.isEmpty()) {
+                const int j = stack.last();
+                stack.removeLast();
+                const Rect &r = rects[j];
+                midX += (float)r.x + (float)r.width  / 2.0;
+                midY += (float)r.y + (float)r.height / 2.0;
+                width  += (float)r.width;
+                height += (float)r.height;
+                confidence += confidences[j];
+                count++;
+                foreach (int k, neighbors[j])
+                    if (!visited[k]) {
+                        visited[k] = true;
+                        stack.append(k);
+                    }
             }
+
+            consolidatedRects.append(Rect(qRound((midX / count) - (width  / count) / 2.0),
+                                          qRound((midY / count) - (height / count) / 2.0),
+                                          qRound(width / count), qRound(height / count)));
+            consolidatedConfidences.append(confidence / count);
         }
-        MatrixXf regionVecs(n, nRegions);
-        for (int i = 0, cnt = 0; i < n; i++) {
-            if (fabs(allEVals(i)) < 1e-4)
-                regionVecs.col(cnt++) = allEVecs.col(i);
-        }
+    }
 
-        //Determine membership for each consolidated location
-        // and compute average of regions. This is determined by
-        // finding which eigenvector has the highest magnitude for
-        // each input dimension. Each input dimension corresponds to
-        // one of the input rect region. Thus, each eigenvector represents
-        // a set of overlaping regions.
-        float *midX = new float[nRegions];
-        float *midY = new float[nRegions];
-        float *avgWidth = new float[nRegions];
-        float *avgHeight = new float[nRegions];
-        float *confs = new float[nRegions];
-        int *cnts = new int[nRegions];
-        int mx;
-        int mxIdx;
-        for (int i = 0 ; i < nRegions; i++) {
-            midX[i] = 0;
-            midY[i] = 0;
-            avgWidth[i] = 0;
-            avgHeight[i] = 0;
-            confs[i] = 0;
-            cnts[i] = 0;
+    // Greedy non-maximum suppression in order of decreasing confidence
+    static void suppression(const QList<Rect> &rects, const QList<float> &confidences, const QVector< QVector<int> > &neighbors,
+                            QList<Rect> &consolidatedRects, QList<float> &consolidatedConfidences)
+    {
+        QVector<int> order(rects.size());
+        for (int i=0; i<order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), HigherConfidence(confidences));
+
+        QVector<bool> suppressed(rects.size(), false);
+        foreach (int i, order) {
+            if (suppressed[i]) continue;
+            consolidatedRects.append(rects[i]);
+            consolidatedConfidences.append(confidences[i]);
+            foreach (int j, neighbors[i])
+                suppressed[j] = true;
         }
+    }
 
-        QList<float> confidences = dst.getList<float>("Confidences");
-        for (int i = 0; i < n; i++) {
-            mx = 0.0;
-            mxIdx = -1;
+    void projectMetadata(const File &src, File &dst) const
+    {
+        dst = src;
+        if (!dst.contains("Confidences"))
+            return;
 
-            for (int j = 0; j < nRegions; j++) {
-                if (fabs(regionVecs(i,j)) > mx) {
-                    mx = fabs(regionVecs(i,j));
-                    mxIdx = j;
-                }
-            }
+        const QList<Rect> rects = OpenCVUtils::toRects(src.rects());
+        if (rects.isEmpty())
+            return;
 
-            Rect curRect = rects[i];
-            midX[mxIdx] += ((float)curRect.x + (float)curRect.width  / 2.0);
-            midY[mxIdx] += ((float)curRect.y + (float)curRect.height / 2.0);
-            avgWidth[mxIdx]  += (float) curRect.width;
-            avgHeight[mxIdx] += (float) curRect.height;
-            confs[mxIdx] += confidences[i];
-            cnts[mxIdx]++;
-        }
+        const QList<float> confidences = dst.getList<float>("Confidences");
+        if (confidences.size() < rects.size())
+            qFatal("Expected a confidence for each of the %d detections.", rects.size());
 
         QList<Rect> consolidatedRects;
         QList<float> consolidatedConfidences;
-        for (int i = 0; i < nRegions; i++) {
-            float cntF = (float) cnts[i];
-            if (cntF > 0) {
-                int x = qRound((midX[i] / cntF) - (avgWidth[i] / cntF) / 2.0);
-                int y = qRound((midY[i] / cntF) - (avgHeight[i] / cntF) / 2.0);
-                int w = qRound(avgWidth[i] / cntF);
-                int h = qRound(avgHeight[i] / cntF);
-                consolidatedRects.append(Rect(x,y,w,h));
-                consolidatedConfidences.append(confs[i] / cntF);
-            }
-        }
-
-        delete [] midX;
-        delete [] midY;
-        delete [] avgWidth;
-        delete [] avgHeight;
-        delete [] confs;
-        delete [] cnts;
+        if (method == Suppression) suppression(rects, confidences, neighbors(rects), consolidatedRects, consolidatedConfidences);
+        else                       regions(rects, confidences, neighbors(rects), consolidatedRects, consolidatedConfidences);
 
         dst.setRects(consolidatedRects);
         dst.setList<float>("Confidences", consolidatedConfidences);
@@ -28,6 +28,10 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Creates a Delaunay triangulation based on a set of points
+ *
+ * When \c cacheTopology is set the triangulation of the first template is kept as vertex indices, keyed by the number of points,
+ * and reused for every template with the same landmark scheme.
+ * Each triangle is warped within its own bounding box rather than over the whole image.
  * \author Scott Klum \cite sklum
  */
 class DelaunayTransform : public UntrainableTransform
@@ -36,8 +40,71 @@ class DelaunayTransform : public UntrainableTransform
 
     Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
     Q_PROPERTY(bool warp READ get_warp WRITE set_warp RESET reset_warp STORED false)
+    Q_PROPERTY(bool cacheTopology READ get_cacheTopology WRITE set_cacheTopology RESET reset_cacheTopology STORED false)
     BR_PROPERTY(float, scaleFactor, 1)
     BR_PROPERTY(bool, warp, true)
+    BR_PROPERTY(bool, cacheTopology, false)
+
+    mutable QMutex topologyLock;
+    mutable QHash<int, QVector<int> > topologies; // Vertex indices of each triangle, keyed by number of points
+
+    // Indices of the vertices of the triangles within the matrix
+    static QVector<int> triangulate(const QList<QPointF> &points, int rows, int cols)
+    {
+        Subdiv2D subdiv(Rect(0,0,cols,rows));
+        for (int i = 0; i < points.size(); i++)
+            subdiv.insert(OpenCVUtils::toPoint(points[i]));
+
+        vector<Vec6f> triangleList;
+        subdiv.getTriangleList(triangleList);
+
+        QVector<int> triangles;
+        for (size_t i = 0; i < triangleList.size(); i++) {
+            // Check the triangle to make sure it's falls within the matrix
+            int vertices[3];
+            bool valid = true;
+            for (int j = 0; j < 3; j++) {
+                const float x = triangleList[i][2*j], y = triangleList[i][2*j+1];
+                if (x > cols || y > rows || x < 0 || y < 0) valid = false;
+                vertices[j] = indexOf(points, x, y);
+                if (vertices[j] < 0) valid = false;
+            }
+            if (valid)
+                for (int j = 0; j < 3; j++)
+                    triangles.append(vertices[j]);
+        }
+        return triangles;
+    }
+
+    static int indexOf(const QList<QPointF> &points, float x, float y)
+    {
+        int best = -1;
+        float bestDistance = 1e-3f;
+        for (int i = 0; i < points.size(); i++) {
+            const float distance = fabs(points[i].x() - x) + fabs(points[i].y() - y);
+            if (distance < bestDistance) {
+                best = i;
+                bestDistance = distance;
+            }
+        }
+        return best;
+    }
+
+    QVector<int> topology(const QList<QPointF> &points, int rows, int cols) const
+    {
+        if (!cacheTopology)
+            return triangulate(points, rows, cols);
+
+        QMutexLocker locker(&topologyLock);
+        QHash<int, QVector<int> >::const_iterator it = topologies.constFind(points.size());
+        if (it != topologies.constEnd())
+            return it.value();
+        locker.unlock();
+
+        const QVector<int> triangles = triangulate(points, rows, cols);
+        locker.relock();
+        return topologies.insert(points.size(), triangles).value();
+    }
 
     void project(const Template &src, Template &dst) const
     {
@@ -59,7 +126,6 @@ class DelaunayTransform : public UntrainableTransform
         points.append(rects.last().bottomLeft());
         points.append(rects.last().bottomRight());
 
-        Subdiv2D subdiv(Rect(0,0,cols,rows));
         // Make sure points are valid for Subdiv2D
         // TODO: Modify points to make them valid
         for (int i = 0; i < points.size(); i++) {
@@ -68,26 +134,13 @@ class DelaunayTransform : public UntrainableTransform
                 if (Globals->verbose) qWarning("Delauney triangulation failed because points lie on boundary.");
                 return;
             }
-            subdiv.insert(OpenCVUtils::toPoint(points[i]));
         }
 
-        vector<Vec6f> triangleList;
-        subdiv.getTriangleList(triangleList);
-
+        const QVector<int> triangles = topology(points, rows, cols);
         QList<QPointF> validTriangles;
-
-        for (size_t i = 0; i < triangleList.size(); i++) {
-            // Check the triangle to make sure it's falls within the matrix
-            bool valid = true;
-
-            QList<QPointF> vertices;
-            vertices.append(QPointF(triangleList[i][0],triangleList[i][1]));
-            vertices.append(QPointF(triangleList[i][2],triangleList[i][3]));
-            vertices.append(QPointF(triangleList[i][4],triangleList[i][5]));
-            for (int j = 0; j < 3; j++) if (vertices[j].x() > cols || vertices[j].y() > rows || vertices[j].x() < 0 || vertices[j].y() < 0) valid = false;
-
-            if (valid) validTriangles.append(vertices);
-        }
+        validTriangles.reserve(triangles.size());
+        foreach (int index, triangles)
+            validTriangles.append(points[index]);
 
         if (warp) {
             dst.m() = Mat::zeros(rows,cols,src.m().type());
@@ -106,7 +159,11 @@ class DelaunayTransform : public UntrainableTransform
 
             float norm = procrustesStats.at(6);
 
-            QList<Point2f> mappedPoints;
+            vector<Point2f> mappedPoints;
+            mappedPoints.reserve(validTriangles.size());
+
+            const Rect bounds(0, 0, cols, rows);
+            Mat buffer, mask;
 
             for (int i = 0; i < validTriangles.size(); i+=3) {
                 // Matrix to store original (pre-transformed) triangle vertices
@@ -123,41 +180,39 @@ class DelaunayTransform : public UntrainableTransform
                 for (int j = 0; j < 3; j++) srcPoints[j] = OpenCVUtils::toPoint(validTriangles[i+j]);
 
                 Point2f dstPoints[3];
+                vector<Point> corners;
                 for (int j = 0; j < 3; j++) {
                     // Scale and shift destination points
                     Point2f warpedPoint = Point2f(dstMat(j,0)*scaleFactor+cols/2,dstMat(j,1)*scaleFactor+rows/2);
                     dstPoints[j] = warpedPoint;
-                    mappedPoints.append(warpedPoint);
+                    mappedPoints.push_back(warpedPoint);
+                    corners.push_back(warpedPoint);
                 }
 
-                Mat buffer(rows,cols,src.m().type());
-
-                warpAffine(src.m(), buffer, getAffineTransform(srcPoints, dstPoints), Size(cols,rows));
-
-                Mat mask = Mat::zeros(rows, cols, CV_8UC1);
-                Point maskPoints[1][3];
-                maskPoints[0][0] = dstPoints[0];
-                maskPoints[0][1] = dstPoints[1];
-                maskPoints[0][2] = dstPoints[2];
-                const Point* ppt = { maskPoints[0] };
-
-                fillConvexPoly(mask, ppt, 3, Scalar(255,255,255), 8);
-
-                Mat output(rows,cols,src.m().type());
-
-                if (i > 0) {
-                    Mat overlap;
-                    bitwise_and(dst.m(),mask,overlap);
-                    mask.setTo(0, overlap!=0);
-                }
-
-                bitwise_and(buffer,mask,output);
-
-                dst.m() += output;
+                // Only the pixels of the triangle's bounding box are warped
+                const Rect roi = boundingRect(corners) & bounds;
+                if (roi.area() == 0)
+                    continue;
+
+                Mat affine = getAffineTransform(srcPoints, dstPoints);
+                affine.at<double>(0,2) -= roi.x;
+                affine.at<double>(1,2) -= roi.y;
+                warpAffine(src.m(), buffer, affine, roi.size());
+
+                mask = Mat::zeros(roi.size(), CV_8UC1);
+                Point maskPoints[3];
+                for (int j = 0; j < 3; j++)
+                    maskPoints[j] = corners[j] - roi.tl();
+                fillConvexPoly(mask, maskPoints, 3, Scalar(255,255,255), 8);
+
+                // Pixels already covered by an earlier triangle are kept
+                Mat output = dst.m()(roi);
+                mask.setTo(0, output!=0);
+                buffer.copyTo(output, mask);
             }
 
             // Overwrite any rects
-            Rect boundingBox = boundingRect(mappedPoints.toVector().toStdVector());
+            Rect boundingBox = boundingRect(mappedPoints);
             dst.file.setRects(QList<QRectF>() << OpenCVUtils::fromRect(boundingBox));
         } else dst = src;
 
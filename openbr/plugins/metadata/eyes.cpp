@@ -37,6 +37,7 @@
 #include <opencv2/imgproc/imgproc_c.h>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -50,6 +51,10 @@ namespace br
  * "Average of Synthetic Exact Filters,"
  * Computer Vision and Pattern Recognition, 2009. CVPR 2009.
  * IEEE Conference on , vol., no., pp.2105-2112, 20-25 June 2009
+ *
+ * Both eye filters are correlated at once: their conjugate spectra are combined into one complex filter,
+ * so a single forward and inverse DFT per face yields the left correlation as the real part and the right as the imaginary part.
+ * Buffers come from the thread's br::MatArena and transforms are sized with cv::getOptimalDFTSize.
  * \author David Bolme
  * \author Josh Klontz \cite jklontz
  */
@@ -57,9 +62,25 @@ class ASEFEyesTransform : public UntrainableTransform
 {
     Q_OBJECT
 
-    Mat left_filter_dft, right_filter_dft, lut;
+    Mat filters_dft, lut; // filters_dft is conj(DFT(left)) + i*conj(DFT(right))
     Rect left_rect, right_rect;
-    int width, height;
+    int width, height, dft_rows, dft_cols;
+
+    // Location of the largest value of one channel of a complex matrix within rect
+    static Point maxLoc(const Mat &m, const Rect &rect, int channel)
+    {
+        Point best(0, 0);
+        float bestValue = -std::numeric_limits<float>::max();
+        for (int y=0; y<rect.height; y++) {
+            const float *row = m.ptr<float>(rect.y + y) + 2*rect.x + channel;
+            for (int x=0; x<rect.width; x++)
+                if (row[2*x] > bestValue) {
+                    bestValue = row[2*x];
+                    best = Point(x, y);
+                }
+        }
+        return best;
+    }
 
 public:
     ASEFEyesTransform()
@@ -132,13 +153,26 @@ public:
                (left_filter.channels() == 1) &&
                (right_filter.channels() == 1));
 
-        // Create the arrays needed for the computation
-        left_filter_dft  = Mat(r, c, CV_32F);
-        right_filter_dft = Mat(r, c, CV_32F);
-
-        // Compute the filters in the Fourier domain
-        dft(left_filter, left_filter_dft, CV_DXT_FORWARD);
-        dft(right_filter, right_filter_dft, CV_DXT_FORWARD);
+        // Compute the filters in the Fourier domain, zero padded to a fast transform size
+        dft_rows = getOptimalDFTSize(height);
+        dft_cols = getOptimalDFTSize(width);
+        Mat left_filter_dft, right_filter_dft;
+        copyMakeBorder(left_filter, left_filter, 0, dft_rows-height, 0, dft_cols-width, BORDER_CONSTANT, Scalar(0));
+        copyMakeBorder(right_filter, right_filter, 0, dft_rows-height, 0, dft_cols-width, BORDER_CONSTANT, Scalar(0));
+        dft(left_filter, left_filter_dft, DFT_COMPLEX_OUTPUT);
+        dft(right_filter, right_filter_dft, DFT_COMPLEX_OUTPUT);
+
+        // conj(a+bi) + i*conj(c+di) = (a+d) + (c-b)i
+        filters_dft = Mat(dft_rows, dft_cols, CV_32FC2);
+        for (int i=0; i<dft_rows; i++) {
+            const float *l = left_filter_dft.ptr<float>(i);
+            const float *rt = right_filter_dft.ptr<float>(i);
+            float *f = filters_dft.ptr<float>(i);
+            for (int j=0; j<dft_cols; j++) {
+                f[2*j]   = l[2*j] + rt[2*j+1];
+                f[2*j+1] = rt[2*j] - l[2*j+1];
+            }
+        }
 
         // Create the look up table for the log transform
         lut = Mat(256, 1, CV_32F);
@@ -153,35 +187,33 @@ private:
         Mat gray;
         OpenCVUtils::cvtGray(src.m()(roi), gray);
 
-        Mat image_tile;
         // (r,c) == (128, 128) EyeLocatorASEF128x128.fel
-        resize(gray, image_tile, Size(height, width));
+        Mat image_tile = MatArena::mat(height, width, CV_8UC1);
+        resize(gray, image_tile, Size(width, height));
 
         // _preprocess
-        Mat image;
-        LUT(image_tile, lut, image);
-
-        // correlate
-        Mat left_corr, right_corr;
-        dft(image, image, CV_DXT_FORWARD);
-        mulSpectrums(image, left_filter_dft, left_corr, 0, true);
-        mulSpectrums(image, right_filter_dft, right_corr, 0, true);
-        dft(left_corr, left_corr, CV_DXT_INV_SCALE);
-        dft(right_corr, right_corr, CV_DXT_INV_SCALE);
+        Mat image = MatArena::mat(dft_rows, dft_cols, CV_32FC1);
+        if ((dft_rows != height) || (dft_cols != width))
+            image.setTo(Scalar(0));
+        Mat image_roi = image(Rect(0, 0, width, height));
+        LUT(image_tile, lut, image_roi);
+
+        // correlate, left in the real part and right in the imaginary part
+        Mat corr = MatArena::mat(dft_rows, dft_cols, CV_32FC2);
+        dft(image, corr, DFT_COMPLEX_OUTPUT);
+        mulSpectrums(corr, filters_dft, corr, 0);
+        dft(corr, corr, DFT_INVERSE | DFT_SCALE);
 
         // locateEyes
-        double minVal, maxVal;
-        Point minLoc, maxLoc;
-
         // left_rect == (23, 35)  (32, 32) EyeLocatorASEF128x128.fel
-        minMaxLoc(left_corr(left_rect), &minVal, &maxVal, &minLoc, &maxLoc);
-        float first_eye_x = (left_rect.x + maxLoc.x)*gray.cols/width+roi.x;
-        float first_eye_y = (left_rect.y + maxLoc.y)*gray.rows/height+roi.y;
+        const Point left = maxLoc(corr, left_rect, 0);
+        float first_eye_x = (left_rect.x + left.x)*gray.cols/width+roi.x;
+        float first_eye_y = (left_rect.y + left.y)*gray.rows/height+roi.y;
 
         // right_rect == (71, 32)  (32, 32) EyeLocatorASEF128x128.fel
-        minMaxLoc(right_corr(right_rect), &minVal, &maxVal, &minLoc, &maxLoc);
-        float second_eye_x = (right_rect.x + maxLoc.x)*gray.cols/width+roi.x;
-        float second_eye_y = (right_rect.y + maxLoc.y)*gray.rows/height+roi.y;
+        const Point right = maxLoc(corr, right_rect, 1);
+        float second_eye_x = (right_rect.x + right.x)*gray.cols/width+roi.x;
+        float second_eye_y = (right_rect.y + right.y)*gray.rows/height+roi.y;
 
         dst.m() = src.m();
         dst.file.appendPoint(QPointF(first_eye_x, first_eye_y));
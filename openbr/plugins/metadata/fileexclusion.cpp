@@ -15,18 +15,26 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/predicate.h>
 
 namespace br
 {
 
+/*!
+ * \ingroup transforms
+ * \brief Remove templates listed in \c exclusionGallery, or satisfying the br::MetadataPredicate expression \c condition.
+ */
 class FileExclusionTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
 
     Q_PROPERTY(QString exclusionGallery READ get_exclusionGallery WRITE set_exclusionGallery RESET reset_exclusionGallery STORED false)
+    Q_PROPERTY(QString condition READ get_condition WRITE set_condition RESET reset_condition STORED false)
     BR_PROPERTY(QString, exclusionGallery, "")
+    BR_PROPERTY(QString, condition, "")
 
     QSet<QString> excluded;
+    MetadataPredicate predicate;
 
     void project(const Template &, Template &) const
     {
@@ -36,13 +44,14 @@ class FileExclusionTransform : public UntrainableMetaTransform
     void project(const TemplateList &src, TemplateList &dst) const
     {
         foreach (const Template &srcTemp, src) {
-            if (!excluded.contains(srcTemp.file))
+            if (!excluded.contains(srcTemp.file.name) && (predicate.isEmpty() || !predicate(srcTemp.file)))
                 dst.append(srcTemp);
         }
     }
 
     void init()
     {
+        predicate = MetadataPredicate(condition);
         if (exclusionGallery.isEmpty())
             return;
         File rFile(exclusionGallery);
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/nameindex.h>
 
 
 namespace br
@@ -32,19 +33,24 @@ class GroundTruthTransform : public UntrainableMetadataTransform
     BR_PROPERTY(QString, groundTruth, "")
     BR_PROPERTY(QStringList, keys, QStringList())
 
-    QMap<QString,File> files;
+    FileList files;
+    NameIndex index;
 
     void init()
     {
-        foreach (const File &file, TemplateList::fromGallery(groundTruth).files())
-            files.insert(file.baseName(), file);
+        files = TemplateList::fromGallery(groundTruth).files();
+        index = NameIndex();
+        // Later files with the same base name take precedence
+        for (int i=files.size()-1; i>=0; i--)
+            index.insert(files[i].baseName(), i);
     }
 
     void projectMetadata(const File &src, File &dst) const
     {
         (void) src;
+        const int i = index.indexOf(dst.baseName());
         foreach(const QString &key, keys)
-            dst.set(key,files[dst.baseName()].value(key));
+            dst.set(key, i == -1 ? QVariant() : files[i].value(key));
     }
 };
 
@@ -16,7 +16,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <opencv2/objdetect/objdetect.hpp>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/pyramid.h>
 
 using namespace cv;
 
@@ -33,10 +36,49 @@ class HOGPersonDetectorTransform : public UntrainableTransform
     Q_OBJECT
 
     HOGDescriptor hog;
+    Mat weights; // The detector laid out like a window of ImagePyramid::hogBlocks
+    float rho;
 
     void init()
     {
-        hog.setSVMDetector(HOGDescriptor::getDefaultPeopleDetector());
+        const std::vector<float> detector = HOGDescriptor::getDefaultPeopleDetector();
+        const Rect window = ImagePyramid::hogBlockWindow(hog, 0, 0);
+        weights = Mat(window.height, window.width, CV_32FC1, (void*)&detector[0]).clone();
+        rho = (detector.size() > size_t(window.area())) ? detector[window.area()] : 0;
+    }
+
+    // HOGDescriptor::detect with its default arguments, scoring windows from the pyramid's shared block histograms
+    void detect(const Mat &blocks, std::vector<Point> &locations) const
+    {
+        const int histogramSize = (hog.blockSize.width/hog.cellSize.width) * (hog.blockSize.height/hog.cellSize.height) * hog.nbins;
+        const Rect window = ImagePyramid::hogBlockWindow(hog, 0, 0);
+        for (int y=0; y*histogramSize+window.width<=blocks.cols; y++)
+            for (int x=0; x+window.height<=blocks.rows; x++)
+                if (rho + blocks(ImagePyramid::hogBlockWindow(hog, x, y)).dot(weights) >= 0)
+                    locations.push_back(Point(x*hog.blockStride.width, y*hog.blockStride.height));
+    }
+
+    // HOGDescriptor::detectMultiScale with its default arguments, over the shared pyramid
+    void detectMultiScale(const Mat &img, std::vector<Rect> &objLocs) const
+    {
+        const double scale0 = 1.05;
+        QSharedPointer<ImagePyramid> pyramid = ImagePyramid::get(img);
+
+        double scale = 1;
+        for (int level=0; level<hog.nlevels; level++) {
+            const Size size(cvRound(img.cols/scale), cvRound(img.rows/scale));
+            std::vector<Point> locations;
+            detect(pyramid->hogBlocks(size, hog), locations);
+
+            const Size scaledWinSize(cvRound(hog.winSize.width*scale), cvRound(hog.winSize.height*scale));
+            for (size_t i=0; i<locations.size(); i++)
+                objLocs.push_back(Rect(cvRound(locations[i].x*scale), cvRound(locations[i].y*scale), scaledWinSize.width, scaledWinSize.height));
+
+            scale *= scale0;
+            if (cvRound(img.cols/scale) < hog.winSize.width || cvRound(img.rows/scale) < hog.winSize.height)
+                break;
+        }
+        groupRectangles(objLocs, 2, 0.2);
     }
 
     void project(const Template &src, Template &dst) const
@@ -44,7 +86,7 @@ class HOGPersonDetectorTransform : public UntrainableTransform
         dst = src;
         std::vector<Rect> objLocs;
         QList<Rect> rects;
-        hog.detectMultiScale(src, objLocs);
+        detectMultiScale(src, objLocs);
         foreach (const Rect &obj, objLocs)
             rects.append(obj);
         dst.file.setRects(rects);
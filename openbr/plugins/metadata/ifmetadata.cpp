@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/predicate.h>
 
 namespace br
 {
@@ -22,6 +23,9 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Clear templates without the required metadata.
+ *
+ * Keeps templates whose \c key equals \c value, or if \c condition is set, templates satisfying the br::MetadataPredicate
+ * expression, for example <tt>IfMetadata(condition='Gender=Male&!(Age~^1)')</tt>.
  * \author Josh Klontz \cite jklontz
  */
 class IfMetadataTransform : public UntrainableMetadataTransform
@@ -29,12 +33,22 @@ class IfMetadataTransform : public UntrainableMetadataTransform
     Q_OBJECT
     Q_PROPERTY(QString key READ get_key WRITE set_key RESET reset_key STORED false)
     Q_PROPERTY(QString value READ get_value WRITE set_value RESET reset_value STORED false)
+    Q_PROPERTY(QString condition READ get_condition WRITE set_condition RESET reset_condition STORED false)
     BR_PROPERTY(QString, key, "")
     BR_PROPERTY(QString, value, "")
+    BR_PROPERTY(QString, condition, "")
+
+    MetadataPredicate predicate;
+
+    void init()
+    {
+        predicate = condition.isEmpty() ? MetadataPredicate::equals(key, QStringList(value))
+                                        : MetadataPredicate(condition);
+    }
 
     void projectMetadata(const File &src, File &dst) const
     {
-        if (src.get<QString>(key, "") == value)
+        if (predicate(src))
             dst = src;
     }
 };
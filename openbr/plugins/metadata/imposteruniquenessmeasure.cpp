@@ -23,6 +23,12 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Impostor Uniqueness Measure \cite klare12
+ *
+ * Templates are scored against the impostors with one blocked br::Distance::compare() call,
+ * ignoring impostors with the same \c inputVariable.
+ * The impostors compared against can be a sample of the training data, chosen once by hashing file names and packed into one contiguous matrix.
+ * The sample has at most \c sampleSize templates, or if \c sampleSize is zero and \c confidence is set, the fewest for which the
+ * highest sampled score is among the top \c tail of all impostor scores with probability \c confidence.
  * \author Josh Klontz \cite jklontz
  */
 class ImpostorUniquenessMeasureTransform : public Transform
@@ -32,44 +38,124 @@ class ImpostorUniquenessMeasureTransform : public Transform
     Q_PROPERTY(double mean READ get_mean WRITE set_mean RESET reset_mean)
     Q_PROPERTY(double stddev READ get_stddev WRITE set_stddev RESET reset_stddev)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(int sampleSize READ get_sampleSize WRITE set_sampleSize RESET reset_sampleSize STORED false)
+    Q_PROPERTY(float confidence READ get_confidence WRITE set_confidence RESET reset_confidence STORED false)
+    Q_PROPERTY(float tail READ get_tail WRITE set_tail RESET reset_tail STORED false)
     BR_PROPERTY(br::Distance*, distance, Distance::make("Dist(L2)", this))
     BR_PROPERTY(double, mean, 0)
     BR_PROPERTY(double, stddev, 1)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(int, sampleSize, 0)
+    BR_PROPERTY(float, confidence, 0)
+    BR_PROPERTY(float, tail, 0.01)
 
     TemplateList impostors;
+    TemplateList sample; // Matrices reference rows of features when packed
+    QStringList sampleLabels;
+    cv::Mat features;
 
-    float calculateIUM(const Template &probe, const TemplateList &gallery) const
+    int sampledSize() const
     {
-        const QString probeLabel = probe.file.get<QString>(inputVariable);
-        TemplateList subset = gallery;
-        for (int j=subset.size()-1; j>=0; j--)
-            if (subset[j].file.get<QString>(inputVariable) == probeLabel)
-                subset.removeAt(j);
-
-        QList<float> scores = distance->compare(subset, probe);
-        float min, max;
-        Common::MinMax(scores, &min, &max);
-        double mean = Common::Mean(scores);
-        return (max-mean)/(max-min);
+        if (sampleSize > 0)
+            return std::min(sampleSize, impostors.size());
+        if ((confidence > 0) && (confidence < 1) && (tail > 0) && (tail < 1))
+            return std::min(int(ceil(log(1.0 - confidence) / log(1.0 - tail))), impostors.size());
+        return impostors.size();
+    }
+
+    // Select the sample and pack it into consecutive rows of one matrix
+    void pack()
+    {
+        QList<int> indices;
+        const int n = sampledSize();
+        if (n < impostors.size()) {
+            QList< QPair<uint,int> > order; order.reserve(impostors.size());
+            for (int i=0; i<impostors.size(); i++)
+                order.append(QPair<uint,int>(qHash(impostors[i].file.name), i));
+            std::sort(order.begin(), order.end());
+            for (int i=0; i<n; i++)
+                indices.append(order[i].second);
+            std::sort(indices.begin(), indices.end());
+        } else {
+            for (int i=0; i<impostors.size(); i++)
+                indices.append(i);
+        }
+
+        sample.clear();
+        sampleLabels.clear();
+        foreach (int index, indices) {
+            sample.append(impostors[index]);
+            sampleLabels.append(impostors[index].file.get<QString>(inputVariable));
+        }
+
+        // Templates that aren't a single matrix of a common size and type are left unpacked
+        features = cv::Mat();
+        int rows = 0, cols = 0, type = -1;
+        foreach (const Template &t, sample) {
+            if (t.size() != 1 || t.m().empty()) return;
+            if (type == -1) {
+                rows = t.m().rows;
+                cols = t.m().cols;
+                type = t.m().type();
+            } else if ((t.m().rows != rows) || (t.m().cols != cols) || (t.m().type() != type)) {
+                return;
+            }
+        }
+        if (type == -1) return;
+
+        features = cv::Mat(sample.size(), rows*cols*CV_MAT_CN(type), CV_MAT_DEPTH(type));
+        for (int i=0; i<sample.size(); i++) {
+            cv::Mat row = features.row(i).reshape(CV_MAT_CN(type), rows);
+            sample[i].m().copyTo(row);
+            sample[i].m() = row;
+        }
+    }
+
+    float calculateIUM(const float *scores, const QString &probeLabel) const
+    {
+        float min = std::numeric_limits<float>::max(), max = -std::numeric_limits<float>::max();
+        double sum = 0;
+        int count = 0;
+        for (int i=0; i<sampleLabels.size(); i++) {
+            if ((scores[i] == -std::numeric_limits<float>::max()) || (sampleLabels[i] == probeLabel))
+                continue;
+            min = std::min(min, scores[i]);
+            max = std::max(max, scores[i]);
+            sum += scores[i];
+            count++;
+        }
+        if ((count == 0) || (max == min))
+            return 0;
+        return (max - sum/count)/(max-min);
+    }
+
+    // Scores a block of probes against the sample at a time, so at most blockSize rows of scores are kept
+    QList<float> calculateIUMs(const TemplateList &probes) const
+    {
+        static const int blockSize = 1024;
+        QList<float> iums; iums.reserve(probes.size());
+        for (int i=0; i<probes.size(); i+=blockSize) {
+            const TemplateList block = probes.mid(i, blockSize);
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(sample.files(), block.files()));
+            distance->compare(sample, block, scores.data());
+            for (int j=0; j<block.size(); j++)
+                iums.append(calculateIUM(scores->data.ptr<float>(j), block[j].file.get<QString>(inputVariable)));
+        }
+        return iums;
     }
 
     void train(const TemplateList &data)
     {
         distance->train(data);
         impostors = data;
-
-        QList<float> iums; iums.reserve(impostors.size());
-        for (int i=0; i<data.size(); i++)
-            iums.append(calculateIUM(impostors[i], impostors));
-
-        Common::MeanStdDev(iums, &mean, &stddev);
+        pack();
+        Common::MeanStdDev(calculateIUMs(impostors), &mean, &stddev);
     }
 
     void project(const Template &src, Template &dst) const
     {
         dst = src;
-        float ium = calculateIUM(src, impostors);
+        float ium = calculateIUMs(TemplateList() << src).first();
         dst.file.set("Impostor_Uniqueness_Measure", ium);
         dst.file.set("Impostor_Uniqueness_Measure_Bin", ium < mean-stddev ? 0 : (ium < mean+stddev ? 1 : 2));
     }
@@ -84,6 +170,7 @@ class ImpostorUniquenessMeasureTransform : public Transform
     {
         distance->load(stream);
         stream >> mean >> stddev >> impostors;
+        pack();
     }
 };
 
@@ -14,10 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QJsonObject>
-#include <QJsonDocument>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/jsonutils.h>
 
 namespace br
 {
@@ -25,18 +23,28 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Represent the metadata as JSON template data.
+ *
+ * The matrix is a null terminated JSON object on one line, if \c ndjson is set the line ends with a newline
+ * so concatenated template data is newline delimited JSON.
  * \author Josh Klontz \cite jklontz
  */
 class JSONTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(bool ndjson READ get_ndjson WRITE set_ndjson RESET reset_ndjson STORED false)
+    BR_PROPERTY(bool, ndjson, false)
 
     void project(const Template &src, Template &dst) const
     {
         dst.file = src.file;
         dst.file.set("AlgorithmID", 2);
-        const QByteArray json = QJsonDocument(QJsonObject::fromVariantMap(dst.file.localMetadata())).toJson().replace('\n', ' ');
-        dst += cv::Mat(1, json.size()+1 /*include null terminator*/, CV_8UC1, (void*) json.data()).clone();
+        QByteArray json;
+        JSONUtils::append(json, dst.file);
+        if (ndjson)
+            json.append('\n');
+        cv::Mat m(1, json.size()+1 /*include null terminator*/, CV_8UC1);
+        memcpy(m.data, json.constData(), json.size()+1);
+        dst += m;
     }
 };
 
@@ -1,68 +1,267 @@
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/common.h>
+#include <openbr/core/metrics.h>
 #include <mongoose.h>
 
 namespace br
 {
 
-// This function will be called by mongoose on every new request.
-static int begin_request_handler(struct mg_connection *conn) {
-  const struct mg_request_info *request_info = mg_get_request_info(conn);
-  char content[100];
-
-  // Prepare the message we're going to send
-  int content_length = snprintf(content, sizeof(content),
-                                "Hello from mongoose! Remote port: %d",
-                                request_info->remote_port);
-
-  // Send HTTP reply to the client
-  mg_printf(conn,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: %d\r\n"        // Always set Content-Length
-            "\r\n"
-            "%s",
-            content_length, content);
-
-  // Returning non-zero tells mongoose that our function has replied to
-  // the client, and mongoose should not send client any more data.
-  return 1;
-}
+static const Metrics::Counter enrollRequests("br_http_requests_total{endpoint=\"enroll\"}", "Requests served by br::Serve.");
+static const Metrics::Counter verifyRequests("br_http_requests_total{endpoint=\"verify\"}", "Requests served by br::Serve.");
+static const Metrics::Counter searchRequests("br_http_requests_total{endpoint=\"search\"}", "Requests served by br::Serve.");
 
 /*!
  * \ingroup initializers
- * \brief Initialize mongoose server
+ * \brief Serves enrollment, verification and search of the current algorithm over HTTP.
+ *
+ * Started by br::Serve, the algorithm and \c gallery are loaded once and requests are handled by a pool of br::Context::parallelism
+ * worker threads over keep-alive connections. Request bodies are encoded images, decoded by the algorithm's Open transform.
+ * - <tt>POST /enroll</tt> responds with the serialized br::Template.
+ * - <tt>POST /verify?target=<name></tt> responds with the score against the gallery template named \c name.
+ * - <tt>POST /search?k=<k></tt> responds with the \c k best gallery matches, one <tt>name score</tt> line each.
+ * - <tt>GET /metrics</tt> responds with the process' br::Metrics in the Prometheus text format.
+ *
+ * Concurrent searches are coalesced: the first waits up to \c batchTimeout milliseconds for up to \c batchSize searches,
+ * which are compared against the gallery together in one call to br::Distance::compare.
  */
-class MongooseInitializer : public Initializer
+class ServeInitializer : public Initializer
 {
     Q_OBJECT
+    Q_PROPERTY(QString gallery READ get_gallery WRITE set_gallery RESET reset_gallery STORED false)
+    Q_PROPERTY(int port READ get_port WRITE set_port RESET reset_port STORED false)
+    Q_PROPERTY(bool keepAlive READ get_keepAlive WRITE set_keepAlive RESET reset_keepAlive STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int batchTimeout READ get_batchTimeout WRITE set_batchTimeout RESET reset_batchTimeout STORED false)
+    BR_PROPERTY(QString, gallery, "")
+    BR_PROPERTY(int, port, 8080)
+    BR_PROPERTY(bool, keepAlive, true)
+    BR_PROPERTY(int, batchSize, 32)
+    BR_PROPERTY(int, batchTimeout, 2)
 
-    static struct mg_context *ctx;
-    static struct mg_callbacks callbacks;
+    typedef QPair<float,int> Match;
+
+    struct Search
+    {
+        Template probe;
+        int k;
+        QList<Match> matches;
+        bool done;
+    };
+
+    QSharedPointer<Transform> transform;
+    QSharedPointer<Distance> distance;
+    TemplateList targets;
+    QHash<QString, int> targetIndex;
+
+    mutable QMutex searchLock;
+    mutable QWaitCondition batchFull, batchDone;
+    mutable QList<Search*> pending;
+    mutable bool collecting;
+
+    void init()
+    {
+        collecting = false;
+    }
 
     void initialize() const
     {
-        // List of options. Last element must be NULL.
-        const char *options[] = { "listening_ports", "8080", NULL };
+        // Every Initializer is constructed at start up, only serve when constructed by br::Serve
+        if (file.name.isEmpty())
+            return;
+        const_cast<ServeInitializer*>(this)->serve();
+    }
+
+    void serve()
+    {
+        transform = Transform::fromAlgorithm(Globals->algorithm);
+        distance = Distance::fromAlgorithm(Globals->algorithm);
 
-        // Prepare callbacks structure. We have only one callback, the rest are NULL.
+        if (!gallery.isEmpty()) {
+            File targetGallery = gallery;
+            if (!(QStringList() << "gal" << "mgal" << "shards" << "mem" << "template" << "ut").contains(targetGallery.suffix())) {
+                const File enrolled = targetGallery.baseName() + targetGallery.hash() + ".mem";
+                Enroll(targetGallery, enrolled);
+                targetGallery = enrolled;
+            }
+            targets = TemplateList::fromGallery(targetGallery);
+            for (int i=0; i<targets.size(); i++)
+                targetIndex.insert(targets[i].file.name, i);
+        }
+
+        const QByteArray ports = QByteArray::number(port);
+        const QByteArray threads = QByteArray::number(std::max(1, Globals->parallelism));
+        const char *options[] = { "listening_ports", ports.data(),
+                                  "num_threads", threads.data(),
+                                  "enable_keep_alive", keepAlive ? "yes" : "no",
+                                  NULL };
+
+        struct mg_callbacks callbacks;
         memset(&callbacks, 0, sizeof(callbacks));
-        callbacks.begin_request = begin_request_handler;
+        callbacks.begin_request = handleRequest;
+
+        struct mg_context *ctx = mg_start(&callbacks, this, options);
+        if (!ctx)
+            qFatal("Failed to start server on port %d.", port);
+        qDebug("Serving %s with %d targets on port %d", qPrintable(Globals->algorithm), targets.size(), port);
 
-        // Start the web server.
-        ctx = mg_start(&callbacks, NULL, options);
+        // Requests are answered from the server's threads until the process is stopped
+        forever QThread::sleep(1);
     }
 
-    void finalize() const
+    static QByteArray readBody(struct mg_connection *conn)
     {
-        // Stop the server.
-        mg_stop(ctx);
+        const char *length = mg_get_header(conn, "Content-Length");
+        QByteArray body(length ? atoi(length) : 0, 0);
+        int read = 0;
+        while (read < body.size()) {
+            const int n = mg_read(conn, body.data() + read, body.size() - read);
+            if (n <= 0) break;
+            read += n;
+        }
+        body.resize(read);
+        return body;
+    }
+
+    static QString queryVariable(const struct mg_request_info *request, const char *name)
+    {
+        if (!request->query_string)
+            return QString();
+        char value[1024];
+        const int length = mg_get_var(request->query_string, strlen(request->query_string), name, value, sizeof(value));
+        return length < 0 ? QString() : QString::fromUtf8(value, length);
+    }
+
+    static void respond(struct mg_connection *conn, const char *status, const char *type, const QByteArray &body)
+    {
+        mg_printf(conn,
+                  "HTTP/1.1 %s\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Length: %d\r\n" // Required for keep-alive
+                  "\r\n",
+                  status, type, body.size());
+        mg_write(conn, body.data(), body.size());
     }
-};
 
-struct mg_context *MongooseInitializer::ctx;
-struct mg_callbacks MongooseInitializer::callbacks;
+    Template enroll(const QByteArray &image) const
+    {
+        Template src(File("request"));
+        src.append(cv::Mat(1, image.size(), CV_8UC1, (void*) image.data()).clone());
+        Template dst;
+        transform->project(src, dst);
+        return dst;
+    }
+
+    // Answered as part of a batch, the first search to arrive collects the batch and compares it
+    QList<Match> search(const Template &probe, int k) const
+    {
+        Search request;
+        request.probe = probe;
+        request.k = k;
+        request.done = false;
+
+        QMutexLocker locker(&searchLock);
+        pending.append(&request);
+        if (collecting) {
+            if (pending.size() >= batchSize)
+                batchFull.wakeOne();
+            while (!request.done)
+                batchDone.wait(&searchLock);
+            return request.matches;
+        }
+
+        collecting = true;
+        QElapsedTimer timer;
+        timer.start();
+        while ((pending.size() < batchSize) && (timer.elapsed() < batchTimeout))
+            batchFull.wait(&searchLock, std::max(qint64(1), batchTimeout - timer.elapsed()));
+        const QList<Search*> batch = pending;
+        pending.clear();
+        collecting = false;
+        locker.unlock();
+
+        TemplateList queries;
+        foreach (const Search *search, batch)
+            queries.append(search->probe);
+        QScopedPointer<MatrixOutput> scores(MatrixOutput::make(targets.files(), queries.files()));
+        distance->compare(targets, queries, scores.data());
+
+        for (int i=0; i<batch.size(); i++) {
+            const float *row = scores->data.ptr<float>(i);
+            QList<float> values;
+            for (int j=0; j<targets.size(); j++)
+                values.append(row[j]);
+            batch[i]->matches = Common::Sort(values, true, batch[i]->k);
+        }
+
+        locker.relock();
+        foreach (Search *search, batch)
+            search->done = true;
+        batchDone.wakeAll();
+        return request.matches;
+    }
+
+    static int handleRequest(struct mg_connection *conn)
+    {
+        const struct mg_request_info *request = mg_get_request_info(conn);
+        const ServeInitializer *server = static_cast<const ServeInitializer*>(request->user_data);
+        const QString uri = request->uri;
+
+        if (uri == "/metrics") {
+            respond(conn, "200 OK", "text/plain; version=0.0.4", Metrics::exposition());
+            return 1;
+        }
+
+        const QByteArray body = readBody(conn);
+
+        if (strcmp(request->request_method, "POST") || body.isEmpty()) {
+            respond(conn, "400 Bad Request", "text/plain", "Expected a POST with an encoded image body.\n");
+            return 1;
+        }
+
+        const Template probe = server->enroll(body);
+        if (probe.file.fte || probe.isEmpty()) {
+            respond(conn, "422 Unprocessable Entity", "text/plain", "Failed to enroll.\n");
+            return 1;
+        }
+
+        if (uri == "/enroll") {
+            enrollRequests.add();
+            QByteArray data;
+            QDataStream stream(&data, QFile::WriteOnly);
+            stream << probe;
+            respond(conn, "200 OK", "application/octet-stream", data);
+        } else if (uri == "/verify") {
+            verifyRequests.add();
+            const QString target = queryVariable(request, "target");
+            if (!server->targetIndex.contains(target)) {
+                respond(conn, "404 Not Found", "text/plain", "Unknown target.\n");
+                return 1;
+            }
+            const float score = server->distance->compare(server->targets[server->targetIndex.value(target)], probe);
+            respond(conn, "200 OK", "text/plain", QByteArray::number(score) + "\n");
+        } else if (uri == "/search") {
+            searchRequests.add();
+            const QString k = queryVariable(request, "k");
+            const int n = std::min(server->targets.size(), k.isEmpty() ? 10 : k.toInt());
+            QByteArray lines;
+            foreach (const Match &match, server->search(probe, n))
+                lines += server->targets[match.second].file.name.toUtf8() + " " + QByteArray::number(match.first) + "\n";
+            respond(conn, "200 OK", "text/plain", lines);
+        } else {
+            respond(conn, "404 Not Found", "text/plain", "Unknown endpoint.\n");
+        }
+
+        // Non-zero tells mongoose the request was handled
+        return 1;
+    }
+};
 
-BR_REGISTER(Initializer, MongooseInitializer)
+BR_REGISTER(Initializer, ServeInitializer)
 
 } // namespace br
 
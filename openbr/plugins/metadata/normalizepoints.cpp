@@ -35,10 +35,11 @@ class NormalizePointsTransform : public UntrainableMetadataTransform
     {
         dst = src;
 
-        QList<QPointF> points = dst.points();
-        QPointF normPoint = points.at(index);
+        const QList<QPointF> points = dst.points();
+        const QPointF normPoint = points.at(index);
 
         QList<QPointF> normalizedPoints;
+        normalizedPoints.reserve(points.size() - 1);
 
         for (int i=0; i<points.size(); i++)
             if (i!=index)
@@ -32,17 +32,16 @@ class PointDisplacementTransform : public UntrainableMetadataTransform
     {
         dst = src;
 
-        QList<QPointF> points = dst.points();
+        const QList<QPointF> points = dst.points();
         QList<QPointF> normalizedPoints;
+        normalizedPoints.reserve(points.size() * (points.size() - 1));
 
         for (int i=0; i<points.size(); i++)
             for (int j=0; j<points.size(); j++)
                 // There is redundant information here
                 if (j!=i) {
-                    QPointF normalizedPoint = points[i]-points[j];
-                    normalizedPoint.setX(pow(normalizedPoint.x(),2));
-                    normalizedPoint.setY(pow(normalizedPoint.y(),2));
-                    normalizedPoints.append(normalizedPoint);
+                    const QPointF d = points[i]-points[j];
+                    normalizedPoints.append(QPointF(d.x()*d.x(), d.y()*d.y()));
                 }
 
         dst.setPoints(normalizedPoints);
@@ -17,17 +17,18 @@
 #include <Eigen/Dense>
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/opencvutils.h>
 #include <openbr/core/eigenutils.h>
 
-using namespace cv;
-
 namespace br
 {
 
 /*!
  * \ingroup transforms
  * \brief Procrustes alignment of points
+ *
+ * Each shape is packed once into an n by 2 Eigen matrix of its points followed by the corners of its last rect,
+ * then centered and scaled to unit norm in place. Training accumulates the mean of the normalized shapes directly,
+ * and projection solves for the 2 by 2 rotation with a fixed size SVD.
  * \author Scott Klum \cite sklum
  */
 class ProcrustesTransform : public MetadataTransform
@@ -37,88 +38,73 @@ class ProcrustesTransform : public MetadataTransform
     Q_PROPERTY(bool warp READ get_warp WRITE set_warp RESET reset_warp STORED false)
     BR_PROPERTY(bool, warp, true)
 
+    typedef Eigen::Matrix<float, Eigen::Dynamic, 2> Shape;
+
     Eigen::MatrixXf meanShape;
 
-    void train(const TemplateList &data)
+    // Packs the points and bounding box corners of file, centered at the origin and scaled to unit norm
+    static bool normalizedShape(const File &file, Shape &shape, Eigen::RowVector2f &mean, float &norm)
     {
-        QList< QList<QPointF> > normalizedPoints;
-
-        // Normalize all sets of points
-        foreach (br::Template datum, data) {
-            QList<QPointF> points = datum.file.points();
-            QList<QRectF> rects = datum.file.rects();
-
-            if (points.empty() || rects.empty()) continue;
-
-            // Assume rect appended last was bounding box
-            points.append(rects.last().topLeft());
-            points.append(rects.last().topRight());
-            points.append(rects.last().bottomLeft());
-            points.append(rects.last().bottomRight());
+        const QList<QPointF> points = file.points();
+        const QList<QRectF> rects = file.rects();
+        if (points.empty() || rects.empty())
+            return false;
 
-            // Center shape at origin
-            Scalar mean = cv::mean(OpenCVUtils::toPoints(points).toVector().toStdVector());
-            for (int i = 0; i < points.size(); i++) points[i] -= QPointF(mean[0],mean[1]);
-
-            // Remove scale component
-            float norm = cv::norm(OpenCVUtils::toPoints(points).toVector().toStdVector());
-            for (int i = 0; i < points.size(); i++) points[i] /= norm;
-
-            normalizedPoints.append(points);
-        }
-
-        if (normalizedPoints.empty()) qFatal("Unable to calculate normalized points");
+        // Assume rect appended last was bounding box
+        const QRectF &box = rects.last();
+        shape.resize(points.size() + 4, 2);
+        for (int i = 0; i < points.size(); i++)
+            shape.row(i) << points[i].x(), points[i].y();
+        shape.row(points.size()    ) << box.topLeft().x(),     box.topLeft().y();
+        shape.row(points.size() + 1) << box.topRight().x(),    box.topRight().y();
+        shape.row(points.size() + 2) << box.bottomLeft().x(),  box.bottomLeft().y();
+        shape.row(points.size() + 3) << box.bottomRight().x(), box.bottomRight().y();
+
+        mean = shape.colwise().mean();
+        shape.rowwise() -= mean;
+        norm = shape.norm();
+        shape /= norm;
+        return true;
+    }
 
+    void train(const TemplateList &data)
+    {
         // Determine mean shape, assuming all shapes contain the same number of points
-        meanShape = Eigen::MatrixXf(normalizedPoints[0].size(), 2);
-
-        for (int i = 0; i < normalizedPoints[0].size(); i++) {
-            double x = 0;
-            double y = 0;
-
-            for (int j = 0; j < normalizedPoints.size(); j++) {
-                x += normalizedPoints[j][i].x();
-                y += normalizedPoints[j][i].y();
+        Eigen::MatrixXd sum;
+        int count = 0;
+        Shape shape;
+        Eigen::RowVector2f mean;
+        float norm;
+        foreach (const br::Template &datum, data) {
+            if (!normalizedShape(datum.file, shape, mean, norm)) continue;
+            if (count == 0) {
+                sum = Eigen::MatrixXd::Zero(shape.rows(), 2);
+            } else if (shape.rows() != sum.rows()) {
+                qWarning("Procrustes skipping %s with %d points, expected %d.", qPrintable(datum.file.name), int(shape.rows()) - 4, int(sum.rows()) - 4);
+                continue;
             }
-
-            x /= (double)normalizedPoints.size();
-            y /= (double)normalizedPoints.size();
-
-            meanShape(i,0) = x;
-            meanShape(i,1) = y;
+            sum += shape.cast<double>();
+            count++;
         }
+
+        if (count == 0) qFatal("Unable to calculate normalized points");
+        meanShape = (sum / count).cast<float>();
     }
 
     void projectMetadata(const File &src, File &dst) const
     {
-        QList<QPointF> points = src.points();
-        QList<QRectF> rects = src.rects();
-
-        if (points.empty() || rects.empty()) {
+        Shape srcMat;
+        Eigen::RowVector2f mean;
+        float norm;
+        if (!normalizedShape(src, srcMat, mean, norm)) {
             dst = src;
             if (Globals->verbose) qWarning("Procrustes alignment failed because points or rects are empty.");
             return;
         }
 
-        // Assume rect appended last was bounding box
-        points.append(rects.last().topLeft());
-        points.append(rects.last().topRight());
-        points.append(rects.last().bottomLeft());
-        points.append(rects.last().bottomRight());
-
-        Scalar mean = cv::mean(OpenCVUtils::toPoints(points).toVector().toStdVector());
-        for (int i = 0; i < points.size(); i++) points[i] -= QPointF(mean[0],mean[1]);
-
-        Eigen::MatrixXf srcMat(points.size(), 2);
-        float norm = cv::norm(OpenCVUtils::toPoints(points).toVector().toStdVector());
-        for (int i = 0; i < points.size(); i++) {
-            points[i] /= norm;
-            srcMat(i,0) = points[i].x();
-            srcMat(i,1) = points[i].y();
-        }
-
-        Eigen::JacobiSVD<Eigen::MatrixXf> svd(srcMat.transpose()*meanShape, Eigen::ComputeThinU | Eigen::ComputeThinV);
-        Eigen::MatrixXf R = svd.matrixU()*svd.matrixV().transpose();
+        const Eigen::Matrix2f M = srcMat.transpose()*meanShape;
+        Eigen::JacobiSVD<Eigen::Matrix2f> svd(M, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        const Eigen::Matrix2f R = svd.matrixU()*svd.matrixV().transpose();
 
         dst = src;
 
@@ -129,10 +115,12 @@ class ProcrustesTransform : public MetadataTransform
         dst.setList<float>("ProcrustesStats",procrustesStats);
 
         if (warp) {
-            Eigen::MatrixXf dstMat = srcMat*R;
-            for (int i = 0; i < dstMat.rows(); i++) {
-                dst.appendPoint(QPointF(dstMat(i,0),dstMat(i,1)));
-            }
+            const Shape dstMat = srcMat*R;
+            QList<QPointF> points;
+            points.reserve(dstMat.rows());
+            for (int i = 0; i < dstMat.rows(); i++)
+                points.append(QPointF(dstMat(i,0),dstMat(i,1)));
+            dst.appendPoints(points);
         }
     }
 
@@ -36,14 +36,27 @@ class RegexPropertyTransform : public UntrainableMetadataTransform
     BR_PROPERTY(QString, inputProperty, "name")
     BR_PROPERTY(QString, outputProperty, "Label")
 
+    QRegularExpression re;
+    MetadataKey inputKey, outputKey;
+
+    void init()
+    {
+        re = QRegularExpression(regexp);
+        if (!re.isValid())
+            qFatal("Invalid regular expression \"%s\": %s", qPrintable(regexp), qPrintable(re.errorString()));
+        inputKey = MetadataKey(inputProperty);
+        outputKey = MetadataKey(outputProperty);
+    }
+
     void projectMetadata(const File &src, File &dst) const
     {
         dst = src;
-        QRegularExpression re(regexp);
-        QRegularExpressionMatch match = re.match(dst.get<QString>(inputProperty));
+        const QString input = dst.containsLocal(inputKey) ? dst.localValue(inputKey).toString()
+                                                          : dst.get<QString>(inputProperty);
+        QRegularExpressionMatch match = re.match(input);
         if (!match.hasMatch())
-            qFatal("Unable to match regular expression \"%s\" to base name \"%s\"!", qPrintable(regexp), qPrintable(dst.get<QString>(inputProperty)));
-        dst.set(outputProperty, match.captured(match.lastCapturedIndex()));
+            qFatal("Unable to match regular expression \"%s\" to base name \"%s\"!", qPrintable(regexp), qPrintable(input));
+        dst.set(outputKey, match.captured(match.lastCapturedIndex()));
     }
 };
 
@@ -7,6 +7,7 @@
 #include <openbr/core/qtutils.h>
 #include <openbr/core/opencvutils.h>
 #include <openbr/core/eigenutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace std;
 using namespace cv;
@@ -54,6 +55,9 @@ BR_REGISTER(Initializer, StasmInitializer)
 /*!
  * \ingroup transforms
  * \brief Wraps STASM key point detector
+ *
+ * When \c maxFaces is greater than one and no eyes are pinned, the faces of an image are detected once and each face found,
+ * up to \c maxFaces, is landmarked and output as its own template.
  * \author Scott Klum \cite sklum
  */
 class StasmTransform : public UntrainableTransform
@@ -68,16 +72,34 @@ class StasmTransform : public UntrainableTransform
     BR_PROPERTY(QList<float>, pinPoints, QList<float>())
     Q_PROPERTY(QStringList pinLabels READ get_pinLabels WRITE set_pinLabels RESET reset_pinLabels STORED false)
     BR_PROPERTY(QStringList, pinLabels, QStringList())
+    Q_PROPERTY(int warm READ get_warm WRITE set_warm RESET reset_warm STORED false)
+    BR_PROPERTY(int, warm, 0) // Classifiers to load at init rather than on demand
+    Q_PROPERTY(int maxFaces READ get_maxFaces WRITE set_maxFaces RESET reset_maxFaces STORED false)
+    BR_PROPERTY(int, maxFaces, 1)
 
     Resource<StasmCascadeClassifier> stasmCascadeResource;
 
     void init()
     {
-        if (!stasm_init(qPrintable(Globals->sdkPath + "/share/openbr/models/stasm"), 0)) qFatal("Failed to initalize stasm.");
         stasmCascadeResource.setResourceMaker(new StasmResourceMaker());
+        stasmCascadeResource.setThreadAffine(true);
+        stasmCascadeResource.setName("Stasm");
+        if (warm > 0)
+            stasmCascadeResource.warm(warm);
     }
 
-    void project(const Template &src, Template &dst) const
+    // Stasm models are loaded on first use rather than when the algorithm is constructed
+    static void initializeStasm()
+    {
+        static QMutex lock;
+        static bool initialized = false;
+        QMutexLocker locker(&lock);
+        if (initialized) return;
+        if (!stasm_init(qPrintable(Globals->sdkPath + "/share/openbr/models/stasm"), 0)) qFatal("Failed to initalize stasm.");
+        initialized = true;
+    }
+
+    static Mat grayscale(const Template &src)
     {
         Mat stasmSrc(src);
         if (src.m().channels() == 3)
@@ -87,10 +109,98 @@ class StasmTransform : public UntrainableTransform
 
         if (!stasmSrc.isContinuous())
             qFatal("Stasm expects continuous matrix data.");
+        return stasmSrc;
+    }
+
+    void setLandmarks(float *landmarks, Template &dst) const
+    {
+        int nLandmarks = stasm_NLANDMARKS;
+        if (stasm3Format) {
+            nLandmarks = 76;
+            stasm_convert_shape(landmarks, nLandmarks);
+        }
+
+        QList<QPointF> points;
+        for (int i = 0; i < nLandmarks; i++) {
+            QPointF point(landmarks[2 * i], landmarks[2 * i + 1]);
+            points.append(point);
+        }
+        dst.file.set("StasmRightEye", points[38]);
+        dst.file.set("StasmLeftEye", points[39]);
+        dst.file.appendPoints(points);
+    }
+
+    bool pinned() const
+    {
+        return !pinPoints.isEmpty() || !pinLabels.isEmpty();
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if ((maxFaces <= 1) || pinned()) {
+            UntrainableTransform::project(src, dst);
+            return;
+        }
+
+        // One template per face, each image's faces found by a single detector pass
+        QVector<TemplateList> faces(src.size());
+        TaskGroup tasks;
+        for (int i=0; i<src.size(); i++) {
+            if (Globals->parallelism > 1) tasks.run(_projectFaces, this, &src[i], &faces[i]);
+            else                          _projectFaces(this, &src[i], &faces[i]);
+        }
+        tasks.wait();
+        foreach (const TemplateList &found, faces)
+            dst.append(found);
+    }
+
+    static void _projectFaces(const StasmTransform *transform, const Template *src, TemplateList *dst)
+    {
+        transform->projectFaces(*src, *dst);
+    }
+
+    void projectFaces(const Template &src, TemplateList &dst) const
+    {
+        initializeStasm();
+        const Mat stasmSrc = grayscale(src);
+
+        int nFaces = 0;
+        QVector<float> landmarks(2 * stasm_NLANDMARKS * maxFaces);
+        StasmCascadeClassifier *stasmCascade = stasmCascadeResource.acquire();
+        stasm_search_faces(&nFaces, landmarks.data(), maxFaces, reinterpret_cast<const char*>(stasmSrc.data), stasmSrc.cols, stasmSrc.rows, *stasmCascade);
+        stasmCascadeResource.release(stasmCascade);
+
+        if (nFaces == 0) {
+            if (Globals->verbose) qWarning("No face found in %s.", qPrintable(src.file.fileName()));
+            Template u = src;
+            if (clearLandmarks) {
+                u.file.clearPoints();
+                u.file.clearRects();
+            }
+            u.file.fte = true;
+            dst.append(u);
+            return;
+        }
+
+        for (int i = 0; i < nFaces; i++) {
+            Template u = src;
+            if (clearLandmarks) {
+                u.file.clearPoints();
+                u.file.clearRects();
+            }
+            setLandmarks(landmarks.data() + 2 * stasm_NLANDMARKS * i, u);
+            dst.append(u);
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        initializeStasm();
+
+        const Mat stasmSrc = grayscale(src);
         dst = src;
 
         int foundFace = 0;
-        int nLandmarks = stasm_NLANDMARKS;
         float landmarks[2 * stasm_NLANDMARKS];
 
         bool searchPinned = false;
@@ -116,7 +226,7 @@ class StasmTransform : public UntrainableTransform
         if (searchPinned) {
             float pins[2 * stasm_NLANDMARKS];
 
-            for (int i = 0; i < nLandmarks; i++) {
+            for (int i = 0; i < stasm_NLANDMARKS; i++) {
                 if      (i == 38) /* Stasm Right Eye */ { pins[2*i] = rightEye.x(); pins[2*i+1] = rightEye.y(); }
                 else if (i == 39) /* Stasm Left Eye  */ { pins[2*i] = leftEye.x();  pins[2*i+1] = leftEye.y(); }
                 else { pins[2*i] = 0; pins[2*i+1] = 0; }
@@ -134,11 +244,6 @@ class StasmTransform : public UntrainableTransform
             stasmCascadeResource.release(stasmCascade);
         }
 
-        if (stasm3Format) {
-            nLandmarks = 76;
-            stasm_convert_shape(landmarks, nLandmarks);
-        }
-
         // For convenience, if these are the only points/rects we want to deal with as the algorithm progresses
         if (clearLandmarks) {
             dst.file.clearPoints();
@@ -149,14 +254,7 @@ class StasmTransform : public UntrainableTransform
             if (Globals->verbose) qWarning("No face found in %s.", qPrintable(src.file.fileName()));
             dst.file.fte = true;
         } else {
-            QList<QPointF> points;
-            for (int i = 0; i < nLandmarks; i++) {
-                QPointF point(landmarks[2 * i], landmarks[2 * i + 1]);
-                points.append(point);
-            }
-            dst.file.set("StasmRightEye", points[38]);
-            dst.file.set("StasmLeftEye", points[39]);
-            dst.file.appendPoints(points);
+            setLandmarks(landmarks, dst);
         }
     }
 };
@@ -1,7 +1,11 @@
 #ifndef OPENBR_INTERNAL_H
 #define OPENBR_INTERNAL_H
 
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThreadStorage>
 #include "openbr/openbr_plugin.h"
+#include "openbr/core/columns.h"
 #include "openbr/core/resource.h"
 
 namespace br
@@ -45,6 +49,53 @@ protected:
     UntrainableMetaTransform() : UntrainableTransform(false) {}
 };
 
+/*!
+ * \brief A br::UntrainableTransform where each output pixel depends only on the corresponding input pixel.
+ *
+ * Adjacent pixel transforms in a br::PipeTransform are fused by PipeTransform::simplify
+ * into a single tiled pass that writes one output matrix.
+ */
+class BR_EXPORT PixelTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+public:
+    /*!
+     * \brief The matrix type produced from an input of the given type, or -1 if the input can't be handled tile by tile.
+     */
+    virtual int outputType(int type) const = 0;
+
+    /*!
+     * \brief Process a block of rows, \em dst is preallocated with the size of \em src and type outputType(src.type()).
+     */
+    virtual void projectTile(const cv::Mat &src, cv::Mat &dst) const = 0;
+
+    /*!
+     * \brief An element-wise Likely expression of \em src computing this transform in floating point, or empty if there is none.
+     *
+     * Runs of pixel transforms that all have one are JIT compiled into a single kernel when built with Likely.
+     */
+    virtual QString likelyExpression(const QString &src) const { (void) src; return QString(); }
+};
+
+/*!
+ * \brief Implemented by classification transforms that can score many windows of one image in a single call.
+ *
+ * br::SlidingWindowTransform uses it to avoid constructing a br::Template per window.
+ */
+class BR_EXPORT WindowClassifier
+{
+public:
+    virtual ~WindowClassifier() {}
+
+    /*!
+     * \brief Appends to \em responses the value project() would leave in <tt>dst.m().at<float>(0)</tt> for each window of \em image.
+     *
+     * Returns \c false without classifying anything if the transform's current configuration doesn't produce such a value.
+     */
+    virtual bool classifyWindows(const cv::Mat &image, const QList<cv::Rect> &windows, QList<float> &responses) const = 0;
+};
+
 class TransformCopier : public ResourceMaker<Transform>
 {
 public:
@@ -288,6 +339,16 @@ public:
 
     bool timeVarying() const { return isTimeVarying; }
 
+    // Composites that train their children in turn read the data once only if a single child is trainable and reads it once
+    bool trainsChildrenInOnePass() const
+    {
+        int trained = 0;
+        foreach (const br::Transform *transform, transforms)
+            if (transform->trainable && ((++trained > 1) || !transform->trainsInOnePass()))
+                return false;
+        return true;
+    }
+
     void init()
     {
         isTimeVarying = false;
@@ -467,11 +528,59 @@ inline void splitFTEs(TemplateList &src, TemplateList  &ftes)
     }
 }
 
+// Keeps landmarks consistent with an image decoded at 1/scale of its stored resolution
+inline void scaleLandmarks(File &file, int scale)
+{
+    if (scale == 1)
+        return;
+
+    QList<QPointF> points = file.points();
+    for (int i=0; i<points.size(); i++)
+        points[i] /= scale;
+    file.setPoints(points);
+
+    QList<QRectF> rects = file.rects();
+    for (int i=0; i<rects.size(); i++)
+        rects[i] = QRectF(rects[i].topLeft() / scale, rects[i].size() / scale);
+    file.setRects(rects);
+}
+
 typedef QPair<int,float> Neighbor; // QPair<id,similarity>
 typedef QList<Neighbor> Neighbors;
 typedef QVector<Neighbors> Neighborhood;
 
 BR_EXPORT bool compareNeighbors(const Neighbor &a, const Neighbor &b);
+BR_EXPORT void insertNeighbor(Neighbors &heap, const Neighbor &neighbor, int capacity); // Bounded min-heap with respect to compareNeighbors(), sort with std::sort_heap()
+
+/*!
+ * \brief A br::Output that retains only the #k highest scoring targets for each query.
+ *
+ * Scores are kept in bounded min-heaps, one set per br::Output::writerSlot(), and merged by topK().
+ * Memory scales with queries x k rather than queries x targets.
+ * When every target is retained, because #k is negative or at least the number of targets, scores are kept in a dense matrix instead.
+ */
+class BR_EXPORT TopKOutput : public Output
+{
+    Q_OBJECT
+
+public:
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    BR_PROPERTY(int, k, -1) /*!< \brief Number of targets to retain per query, or all targets if negative. */
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles);
+    Neighborhood topK() const; /*!< \brief The retained targets for each query, ordered from highest to lowest score. */
+
+protected:
+    virtual bool accept(float value, int i, int j) const { (void) value; (void) i; (void) j; return true; } /*!< \brief Return \c false to exclude a comparison before ranking. */
+
+private:
+    QVector<Neighborhood> heaps;
+    QMutex overflowLock;
+    int capacity;
+    cv::Mat scores, accepted; // Dense storage when every target is retained
+
+    void set(float value, int i, int j);
+};
 
 /*!
  * \brief A br::Distance that does not require training data.
@@ -485,6 +594,39 @@ private:
     void train(const TemplateList &data) { (void) data; }
 };
 
+/*!
+ * \brief A br::Distance that accepts (0) or rejects (-FLOAT_MAX) comparisons from target metadata alone.
+ *
+ * Template lists are compared by evaluating mask() over the target metadata columns once per query rather than once per pair,
+ * or once per block of targets if it doesn't depend on the query,
+ * and br::ListDistance::compareMasked() uses it to skip the other distances for rejected targets.
+ */
+class BR_EXPORT MaskDistance : public UntrainableDistance
+{
+    Q_OBJECT
+
+public:
+    virtual QStringList maskKeys() const = 0; /*!< \brief Target metadata keys read by mask(). */
+    virtual QBitArray mask(const MetadataColumns &targets, const Template &query) const = 0; /*!< \brief Targets accepted for comparison with the query. */
+    virtual bool queryDependent() const { return true; } /*!< \brief \c false if mask() ignores the query, so it is evaluated once per block of targets. */
+
+    static QBitArray combinedMask(const QList<const MaskDistance*> &masks, const MetadataColumns &targets, const Template &query, const QBitArray &independent); /*!< \brief Targets accepted by all the masks, given the result of independentMask(). */
+    static QBitArray independentMask(const QList<const MaskDistance*> &masks, const MetadataColumns &targets); /*!< \brief Targets accepted by all the masks that don't depend on the query. */
+
+protected:
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
+};
+
+/*!
+ * \brief Collects scores of training template pairs for calibrating a br::Distance with bounded memory.
+ *
+ * Genuine pairs are enumerated within each label's group and compared in parallel.
+ * Impostor pairs are compared in blocks of query rows, and if there are more than \em maxImpostors pairs
+ * a random sample of rows is compared instead. Pairs scoring -FLOAT_MAX are skipped,
+ * as are pairs of the same \c MODALITY if \em crossModality.
+ */
+BR_EXPORT void trainingScores(const Distance *distance, const TemplateList &src, const QList<int> &labels, bool crossModality, qint64 maxImpostors, QList<float> &genuines, QList<float> &impostors);
+
 /*!
  * \brief A br::Distance that checks the elements of its list property to see if it needs to be trained.
  */
@@ -503,6 +645,15 @@ public:
                 return true;
         return false;
     }
+
+protected:
+    /*!
+     * \brief Compares a block by first masking targets with the br::MaskDistance elements of distances.
+     *
+     * The other distances are only computed for accepted pairs, and summed if \em sum is \c true, or applied in series otherwise.
+     * Targets are compared in cache sized tiles, each distance comparing a query against the tile's remaining candidates at once.
+     */
+    void compareMasked(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset, bool sum) const;
 };
 
 }
@@ -25,16 +25,23 @@ namespace br
  * \brief The highest scoring matches.
  * \author Josh Klontz \cite jklontz
  */
-class bestOutput : public Output
+class bestOutput : public TopKOutput
 {
     Q_OBJECT
 
     typedef QPair< float, QPair<int, int> > BestMatch;
-    QList<BestMatch> bestMatches;
 
     ~bestOutput()
     {
-        if (file.isNull() || bestMatches.isEmpty()) return;
+        if (file.isNull() || queryFiles.isEmpty()) return;
+
+        QList<BestMatch> bestMatches;
+        const Neighborhood neighborhood = topK();
+        for (int i=0; i<neighborhood.size(); i++)
+            if (!neighborhood[i].isEmpty())
+                bestMatches.append(BestMatch(neighborhood[i].first().second, QPair<int,int>(i, neighborhood[i].first().first)));
+        if (bestMatches.isEmpty()) return;
+
         qSort(bestMatches);
         QStringList lines; lines.reserve(bestMatches.size()+1);
         lines.append("Value,Target,Query");
@@ -45,25 +52,14 @@ class bestOutput : public Output
 
     void initialize(const FileList &targetFiles, const FileList &queryFiles)
     {
-        Output::initialize(targetFiles, queryFiles);
-        bestMatches.reserve(queryFiles.size());
-        for (int i=0; i<queryFiles.size(); i++)
-            bestMatches.append(BestMatch(-std::numeric_limits<float>::max(), QPair<int,int>(-1, -1)));
+        k = 1;
+        TopKOutput::initialize(targetFiles, queryFiles);
     }
 
-    void set(float value, int i, int j)
+    bool accept(float value, int i, int j) const
     {
-        static QMutex lock;
-
-        // Return early for self similar matrices
-        if (selfSimilar && (i == j)) return;
-
-        if (value > bestMatches[i].first) {
-            lock.lock();
-            if (value > bestMatches[i].first)
-                bestMatches[i] = BestMatch(value, QPair<int,int>(i,j));
-            lock.unlock();
-        }
+        // Skip failures and the diagonal for self similar matrices
+        return (value > -std::numeric_limits<float>::max()) && (!selfSimilar || (i != j));
     }
 };
 
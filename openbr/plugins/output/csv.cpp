@@ -15,7 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/qtutils.h>
+#include <openbr/core/textwriter.h>
 
 namespace br
 {
@@ -29,18 +29,34 @@ class csvOutput : public MatrixOutput
 {
     Q_OBJECT
 
+    // Scores are formatted like MatrixOutput::toString()
+    struct Row : public TextWriter::RowFormatter
+    {
+        QList<QByteArray> queries;
+        cv::Mat scores;
+
+        void format(int row, QByteArray &dst) const
+        {
+            dst += queries[row];
+            const float *values = scores.ptr<float>(row);
+            for (int j=0; j<scores.cols; j++) {
+                dst += ',';
+                TextWriter::appendNumber(dst, values[j]);
+            }
+            dst += '\n';
+        }
+    };
+
     ~csvOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
-        lines.append("File," + targetFiles.names().join(","));
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList words;
-            for (int j=0; j<targetFiles.size(); j++)
-                words.append(toString(i,j));  // The toString idiom is used to output match scores - see MatrixOutput
-            lines.append(queryFiles[i].name+","+words.join(","));
-        }
-        QtUtils::writeFile(file, lines);
+        TextWriter writer(file);
+        writer.writeLine("File," + targetFiles.names().join(","));
+        Row row;
+        foreach (const File &query, queryFiles)
+            row.queries.append(query.name.toLocal8Bit());
+        row.scores = data;
+        writer.writeRows(queryFiles.size(), row);
     }
 };
 
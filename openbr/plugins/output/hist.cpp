@@ -30,14 +30,19 @@ class histOutput : public Output
     Q_OBJECT
 
     float min, max, step;
-    QVector<int> bins;
+    QVector< QVector<int> > bins; // One histogram per writer slot
+    QMutex sharedLock;
 
     ~histOutput()
     {
-        if (file.isNull() || bins.isEmpty()) return;
+        if (file.isNull() || bins.isEmpty() || bins.first().isEmpty()) return;
         QStringList counts;
-        foreach (int count, bins)
+        for (int i=0; i<bins.first().size(); i++) {
+            int count = 0;
+            foreach (const QVector<int> &slotBins, bins)
+                count += slotBins[i];
             counts.append(QString::number(count));
+        }
         const QString result = counts.join(",");
         QtUtils::writeFile(file, result);
     }
@@ -48,7 +53,9 @@ class histOutput : public Output
         min = file.get<float>("min", -5);
         max = file.get<float>("max", 5);
         step = file.get<float>("step", 0.1);
-        bins = QVector<int>((max-min)/step, 0);
+        bins = QVector< QVector<int> >(writerSlots());
+        for (int i=0; i<bins.size(); i++)
+            bins[i] = QVector<int>((max-min)/step, 0); // Unshared, so each slot increments its own copy
     }
 
     void set(float value, int i, int j)
@@ -56,7 +63,17 @@ class histOutput : public Output
         (void) i;
         (void) j;
         if ((value < min) || (value >= max)) return;
-        bins[(value-min)/step]++; // This should technically be locked to ensure atomic increment
+
+        const int slot = writerSlot();
+        QVector<int> &slotBins = bins[slot];
+        const int bin = std::min(int((value-min)/step), slotBins.size()-1);
+        if (bin < 0) return;
+        if (!sharedWriterSlot(slot)) {
+            slotBins[bin]++;
+        } else {
+            QMutexLocker locker(&sharedLock);
+            slotBins[bin]++;
+        }
     }
 };
 
@@ -15,7 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/qtutils.h>
+#include <openbr/core/textwriter.h>
 
 namespace br
 {
@@ -29,11 +29,38 @@ class meltOutput : public MatrixOutput
 {
     Q_OBJECT
 
+    struct Row : public TextWriter::RowFormatter
+    {
+        QList<QByteArray> queries, targets;
+        QList<QString> queryLabels, targetLabels;
+        QByteArray values;
+        cv::Mat scores;
+        bool selfSimilar, genuineOnly, impostorOnly;
+
+        void format(int i, QByteArray &dst) const
+        {
+            const float *row = scores.ptr<float>(i);
+            for (int j=(selfSimilar ? i+1 : 0); j<targets.size(); j++) {
+                const bool genuine = queryLabels[i] == targetLabels[j];
+                if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
+                dst += queries[i];
+                dst += ',';
+                dst += targets[j];
+                dst += genuine ? ",1," : ",0,";
+                TextWriter::appendNumber(dst, row[j]);
+                dst += values;
+                dst += '\n';
+            }
+        }
+    };
+
     ~meltOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const bool genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
-        const bool impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+        Row row;
+        row.genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
+        row.impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+        row.selfSimilar = selfSimilar;
 
         QMap<QString,QVariant> args = file.localMetadata();
         args.remove("Genuine");
@@ -41,26 +68,19 @@ class meltOutput : public MatrixOutput
 
         QString keys; foreach (const QString &key, args.keys()) keys += "," + key;
         QString values; foreach (const QVariant &value, args.values()) values += "," + value.toString();
+        row.values = values.toLocal8Bit();
 
-        QStringList lines;
-        if (file.baseName() != "terminal") lines.append(QString("Query,Target,Mask,Similarity%1").arg(keys));
-
-        QList<QString> queryLabels = File::get<QString>(queryFiles, "Label");
-        QList<QString> targetLabels = File::get<QString>(targetFiles, "Label");
-
-        for (int i=0; i<queryFiles.size(); i++) {
-            for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
-                const bool genuine = queryLabels[i] == targetLabels[j];
-                if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
-                lines.append(QString("%1,%2,%3,%4%5").arg(queryFiles[i],
-                                                          targetFiles[j],
-                                                          QString::number(genuine),
-                                                          QString::number(data.at<float>(i,j)),
-                                                          values));
-            }
-        }
+        TextWriter writer(file);
+        if (file.baseName() != "terminal") writer.writeLine(QString("Query,Target,Mask,Similarity%1").arg(keys));
 
-        QtUtils::writeFile(file, lines);
+        foreach (const File &query, queryFiles)
+            row.queries.append(query.name.toLocal8Bit());
+        foreach (const File &target, targetFiles)
+            row.targets.append(target.name.toLocal8Bit());
+        row.queryLabels = File::get<QString>(queryFiles, "Label");
+        row.targetLabels = File::get<QString>(targetFiles, "Label");
+        row.scores = data;
+        writer.writeRows(queryFiles.size(), row);
     }
 };
 
@@ -14,7 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif // _WIN32
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
@@ -23,6 +28,10 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief \ref simmat output.
+ *
+ * Scores can be stored at reduced \em precision: \c Half, or linearly quantized between \em low and \em high as \c 16Bit or \c 8Bit.
+ * br::Evaluate, br::Fuse and BEE::readMatrix expand them back to floats.
+ * When resumed, an existing matrix with the same header and size is reopened in place, keeping the scores it holds.
  * \author Josh Klontz \cite jklontz
  */
 class mtxOutput : public Output
@@ -31,43 +40,77 @@ class mtxOutput : public Output
 
     Q_PROPERTY(QString targetGallery READ get_targetGallery WRITE set_targetGallery RESET reset_targetGallery STORED false)
     Q_PROPERTY(QString queryGallery READ get_queryGallery WRITE set_queryGallery RESET reset_queryGallery STORED false)
+    Q_PROPERTY(QString precision READ get_precision WRITE set_precision RESET reset_precision STORED false)
+    Q_PROPERTY(float low READ get_low WRITE set_low RESET reset_low STORED false)
+    Q_PROPERTY(float high READ get_high WRITE set_high RESET reset_high STORED false)
     BR_PROPERTY(QString, targetGallery, "Unknown_Target")
     BR_PROPERTY(QString, queryGallery, "Unknown_Query")
+    BR_PROPERTY(QString, precision, "Float")
+    BR_PROPERTY(float, low, 0)
+    BR_PROPERTY(float, high, 1)
 
+    BEE::ScoreCodec codec;
     int headerSize, rowBlock, columnBlock;
     cv::Mat blockScores;
+    QFile f;
 
     ~mtxOutput()
     {
-        writeBlock();
+        if (f.isOpen()) {
+            writeBlock();
+            f.close();
+        }
     }
 
     void setBlock(int rowBlock, int columnBlock)
     {
-        if ((rowBlock == 0) && (columnBlock == 0)) {
-            // Initialize the file
-            QFile f(file);
+        if (!f.isOpen() || ((rowBlock == 0) && (columnBlock == 0))) {
+            // Initialize the file, which stays open so each block is written as soon as it is complete
+            if (f.isOpen()) f.close();
+            f.setFileName(file);
             QtUtils::touchDir(f);
-            if (!f.open(QFile::WriteOnly))
+            const bool resume = file.getBool("resume") && f.exists();
+            if (!f.open(resume ? QFile::ReadWrite : (QFile::ReadWrite | QFile::Truncate)))
                 qFatal("Unable to open %s for writing.", qPrintable(file));
+            codec = BEE::ScoreCodec::fromPrecision(precision, low, high);
             const int endian = 0x12345678;
             QByteArray header;
             header.append("S2\n");
             header.append(qPrintable(targetGallery));
             header.append("\n");
             header.append(qPrintable(queryGallery));
-            header.append("\nMF ");
+            header.append("\nM");
+            header.append(codec.type());
+            header.append(" ");
             header.append(qPrintable(QString::number(queryFiles.size())));
             header.append(" ");
             header.append(qPrintable(QString::number(targetFiles.size())));
             header.append(" ");
+            if (!codec.parameters().isEmpty()) {
+                header.append(qPrintable(codec.parameters()));
+                header.append(" ");
+            }
             header.append(QByteArray((const char*)&endian, 4));
             header.append("\n");
-            headerSize = f.write(header);
-            const float defaultValue = -std::numeric_limits<float>::max();
-            for (int i=0; i<targetFiles.size()*queryFiles.size(); i++)
-                f.write((const char*)&defaultValue, 4);
-            f.close();
+
+            if (resume) {
+                // The scores already written are kept
+                headerSize = header.size();
+                if ((f.read(headerSize) != header) || (f.size() != headerSize + codec.elementSize()*qint64(targetFiles.size())*queryFiles.size()))
+                    qFatal("%s does not match the comparison being resumed.", qPrintable(file));
+            } else {
+                headerSize = f.write(header);
+
+                // Scores never set keep the default value, written in large chunks
+                const std::vector<float> defaultValues(1 << 18, -std::numeric_limits<float>::max());
+                QByteArray defaultBytes(defaultValues.size() * codec.elementSize(), 0);
+                codec.encode(&defaultValues[0], (uchar*) defaultBytes.data(), defaultValues.size());
+                for (qint64 remaining = qint64(targetFiles.size())*queryFiles.size(); remaining > 0; remaining -= qint64(defaultValues.size())) {
+                    const qint64 bytes = codec.elementSize() * std::min(remaining, qint64(defaultValues.size()));
+                    if (f.write(defaultBytes.constData(), bytes) != bytes)
+                        qFatal("Failed to initialize %s.", qPrintable(file));
+                }
+            }
         } else {
             writeBlock();
         }
@@ -92,16 +135,39 @@ class mtxOutput : public Output
         qFatal("Logic error.");
     }
 
+    bool flush()
+    {
+        if (!f.flush())
+            return false;
+#ifndef _WIN32
+        fsync(f.handle());
+#endif // _WIN32
+        return true;
+    }
+
     void writeBlock()
     {
-        QFile f(file);
-        if (!f.open(QFile::ReadWrite))
-            qFatal("Unable to open %s for modifying.", qPrintable(file));
-        for (int i=0; i<blockScores.rows; i++) {
-            f.seek(headerSize + sizeof(float)*(quint64(rowBlock*this->blockRows+i)*targetFiles.size()+(columnBlock*this->blockCols)));
-            f.write((const char*)blockScores.row(i).data, sizeof(float)*blockScores.cols);
+        if (blockScores.empty())
+            return;
+
+        const int elementSize = codec.elementSize();
+        const qint64 origin = headerSize + elementSize*(qint64(rowBlock)*this->blockRows*targetFiles.size() + qint64(columnBlock)*this->blockCols);
+        if (blockScores.cols == targetFiles.size()) {
+            // Full width blocks are contiguous on disk
+            QByteArray encoded(elementSize*blockScores.rows*blockScores.cols, 0);
+            codec.encode(blockScores.ptr<float>(), (uchar*) encoded.data(), blockScores.rows*blockScores.cols);
+            f.seek(origin);
+            if (f.write(encoded) != encoded.size())
+                qFatal("Failed to write block to %s.", qPrintable(file));
+        } else {
+            QByteArray encoded(elementSize*blockScores.cols, 0);
+            for (int i=0; i<blockScores.rows; i++) {
+                codec.encode(blockScores.ptr<float>(i), (uchar*) encoded.data(), blockScores.cols);
+                f.seek(origin + elementSize*qint64(i)*targetFiles.size());
+                f.write(encoded);
+            }
         }
-        f.close();
+        blockScores.release();
     }
 };
 
@@ -17,7 +17,6 @@
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
 #include <openbr/core/qtutils.h>
-#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -25,9 +24,11 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Outputs highest ranked matches with scores.
+ *
+ * Set \c k to bound the number of targets retained per query, queries whose first genuine match falls outside the top \c k are omitted.
  * \author Scott Klum \cite sklum
  */
-class rankOutput : public MatrixOutput
+class rankOutput : public TopKOutput
 {
     Q_OBJECT
 
@@ -37,23 +38,21 @@ class rankOutput : public MatrixOutput
 
         QList<int> ranks;
         QList<int> positions;
+        QList<int> queries;
         QList<float> scores;
         QStringList lines;
 
+        const Neighborhood neighborhood = topK();
         for (int i=0; i<queryFiles.size(); i++) {
-            typedef QPair<float,int> Pair;
-            int rank = 1;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (QString(targetFiles[pair.second]) != QString(queryFiles[i])) {
-                        if (targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
-                            ranks.append(rank);
-                            positions.append(pair.second);
-                            scores.append(pair.first);
-                            break;
-                        }
-                        rank++;
-                    }
+            const Neighbors &neighbors = neighborhood[i];
+            for (int rank=0; rank<neighbors.size(); rank++) {
+                const Neighbor &neighbor = neighbors[rank];
+                if (targetFiles[neighbor.first].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
+                    ranks.append(rank+1);
+                    positions.append(neighbor.first);
+                    queries.append(i);
+                    scores.append(neighbor.second);
+                    break;
                 }
             }
         }
@@ -61,11 +60,23 @@ class rankOutput : public MatrixOutput
         typedef QPair<int,int> RankPair;
         foreach (const RankPair &pair, Common::Sort(ranks, false))
             // pair.first == rank retrieved, pair.second == original position
-            lines.append(queryFiles[pair.second].name + " " + QString::number(pair.first) + " " + QString::number(scores[pair.second]) + " " + targetFiles[positions[pair.second]].name);
+            lines.append(queryFiles[queries[pair.second]].name + " " + QString::number(pair.first) + " " + QString::number(scores[pair.second]) + " " + targetFiles[positions[pair.second]].name);
 
 
         QtUtils::writeFile(file, lines);
     }
+
+    // Impostors that fail these checks don't count towards the rank, so they are never retained
+    bool accept(float value, int i, int j) const
+    {
+        (void) value;
+        if (Globals->crossValidate > 0) {
+            const int partition = targetFiles[j].get<int>("Partition",-1);
+            if ((partition != -1) && (partition != queryFiles[i].get<int>("Partition",-1)))
+                return false;
+        }
+        return QString(targetFiles[j]) != QString(queryFiles[i]);
+    }
 };
 
 BR_REGISTER(Output, rankOutput)
@@ -0,0 +1,202 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QTime>
+#include <limits>
+#include <numeric>
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Online evaluation that accumulates genuine and impostor score histograms as comparisons arrive.
+ *
+ * Genuine and impostor comparisons are determined from the target and query labels, as for BEE::makeMask().
+ * Scores are binned between \em min and \em max, scores outside the range are counted in the end bins.
+ * At most every \em interval seconds, the true accept rate at each of \em far and the rank one retrieval rate so far are logged,
+ * so long comparisons can be judged before they finish without storing a similarity matrix.
+ * The final operating points are written to the output file as <tt>Threshold,FAR,TAR</tt> lines.
+ */
+class rocOutput : public Output
+{
+    Q_OBJECT
+
+    Q_PROPERTY(float min READ get_min WRITE set_min RESET reset_min STORED false)
+    Q_PROPERTY(float max READ get_max WRITE set_max RESET reset_max STORED false)
+    Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
+    Q_PROPERTY(QList<float> far READ get_far WRITE set_far RESET reset_far STORED false)
+    Q_PROPERTY(int interval READ get_interval WRITE set_interval RESET reset_interval STORED false)
+    BR_PROPERTY(float, min, -1)
+    BR_PROPERTY(float, max, 1)
+    BR_PROPERTY(int, bins, 10000)
+    BR_PROPERTY(QList<float>, far, QList<float>() << 1e-4 << 1e-3 << 1e-2)
+    BR_PROPERTY(int, interval, 10)
+
+    // Written only by the thread that owns the writer slot
+    struct Accumulator
+    {
+        QVector<qint64> genuine, impostor;
+        QVector<float> bestGenuine, bestImpostor; // Per query
+    };
+
+    QSharedPointer<BEE::ImplicitMask> mask;
+    QVector<Accumulator> accumulators;
+    QMutex sharedLock;
+    QTime lastReport;
+
+    ~rocOutput()
+    {
+        if (accumulators.isEmpty()) return;
+
+        QVector<qint64> genuine, impostor;
+        report(genuine, impostor);
+        if (file.isNull()) return;
+
+        const qint64 genuineCount = std::accumulate(genuine.begin(), genuine.end(), qint64(0));
+        const qint64 impostorCount = std::accumulate(impostor.begin(), impostor.end(), qint64(0));
+        if ((genuineCount == 0) || (impostorCount == 0)) return;
+
+        QStringList lines;
+        lines.append("Threshold,FAR,TAR");
+        qint64 truePositives = 0, falsePositives = 0;
+        for (int bin=bins-1; bin>=0; bin--) {
+            if ((genuine[bin] == 0) && (impostor[bin] == 0)) continue;
+            truePositives += genuine[bin];
+            falsePositives += impostor[bin];
+            lines.append(QString("%1,%2,%3").arg(QString::number(threshold(bin)),
+                                                 QString::number(double(falsePositives) / impostorCount),
+                                                 QString::number(double(truePositives) / genuineCount)));
+        }
+        QtUtils::writeFile(file, lines);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        if ((bins < 1) || !(max > min)) qFatal("Invalid histogram range.");
+        mask = QSharedPointer<BEE::ImplicitMask>(new BEE::ImplicitMask(targetFiles, queryFiles));
+        accumulators = QVector<Accumulator>(writerSlots());
+        lastReport.start();
+    }
+
+    // Comparisons aren't made while the next block is being set, so the accumulators can be read here
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        Output::setBlock(rowBlock, columnBlock);
+        if ((interval >= 0) && (lastReport.elapsed() >= 1000 * interval)) {
+            QVector<qint64> genuine, impostor;
+            report(genuine, impostor);
+            lastReport.restart();
+        }
+    }
+
+    void set(float value, int i, int j)
+    {
+        if (value != value) return;
+        const BEE::MaskValue truth = mask->at(i, j);
+        if (truth == BEE::DontCare) return;
+
+        const int slot = writerSlot();
+        if (!sharedWriterSlot(slot)) {
+            accumulate(accumulators[slot], value, i, truth == BEE::Match);
+        } else {
+            QMutexLocker locker(&sharedLock);
+            accumulate(accumulators[slot], value, i, truth == BEE::Match);
+        }
+    }
+
+    void accumulate(Accumulator &accumulator, float value, int query, bool isGenuine)
+    {
+        if (accumulator.genuine.isEmpty()) {
+            accumulator.genuine = QVector<qint64>(bins, 0);
+            accumulator.impostor = QVector<qint64>(bins, 0);
+            accumulator.bestGenuine = QVector<float>(queryFiles.size(), -std::numeric_limits<float>::infinity());
+            accumulator.bestImpostor = QVector<float>(queryFiles.size(), -std::numeric_limits<float>::infinity());
+        }
+
+        const int bin = qBound(0, int((value - min) / (max - min) * bins), bins-1);
+        if (isGenuine) {
+            accumulator.genuine[bin]++;
+            accumulator.bestGenuine[query] = std::max(accumulator.bestGenuine[query], value);
+        } else {
+            accumulator.impostor[bin]++;
+            accumulator.bestImpostor[query] = std::max(accumulator.bestImpostor[query], value);
+        }
+    }
+
+    float threshold(int bin) const
+    {
+        return min + bin * (max - min) / bins;
+    }
+
+    // Merge the accumulators and log the current operating points
+    void report(QVector<qint64> &genuine, QVector<qint64> &impostor) const
+    {
+        genuine = QVector<qint64>(bins, 0);
+        impostor = QVector<qint64>(bins, 0);
+        QVector<float> bestGenuine(queryFiles.size(), -std::numeric_limits<float>::infinity());
+        QVector<float> bestImpostor(queryFiles.size(), -std::numeric_limits<float>::infinity());
+        foreach (const Accumulator &accumulator, accumulators) {
+            if (accumulator.genuine.isEmpty()) continue;
+            for (int bin=0; bin<bins; bin++) {
+                genuine[bin] += accumulator.genuine[bin];
+                impostor[bin] += accumulator.impostor[bin];
+            }
+            for (int i=0; i<queryFiles.size(); i++) {
+                bestGenuine[i] = std::max(bestGenuine[i], accumulator.bestGenuine[i]);
+                bestImpostor[i] = std::max(bestImpostor[i], accumulator.bestImpostor[i]);
+            }
+        }
+
+        const qint64 genuineCount = std::accumulate(genuine.begin(), genuine.end(), qint64(0));
+        const qint64 impostorCount = std::accumulate(impostor.begin(), impostor.end(), qint64(0));
+        if ((genuineCount == 0) || (impostorCount == 0)) return;
+
+        // The true accept rate at the lowest threshold that doesn't exceed each false accept rate
+        QStringList rates;
+        foreach (float rate, far) {
+            qint64 truePositives = 0, falsePositives = 0, accepted = 0;
+            for (int bin=bins-1; bin>=0; bin--) {
+                falsePositives += impostor[bin];
+                if (double(falsePositives) / impostorCount > rate) break;
+                truePositives += genuine[bin];
+                accepted = truePositives;
+            }
+            rates.append(QString("TAR @ FAR = %1: %2").arg(QString::number(rate), QString::number(double(accepted) / genuineCount, 'f', 3)));
+        }
+
+        // A search is a rank one hit if its best genuine outscores every impostor
+        int searches = 0, hits = 0;
+        for (int i=0; i<queryFiles.size(); i++) {
+            if (bestGenuine[i] == -std::numeric_limits<float>::infinity()) continue;
+            searches++;
+            if (bestGenuine[i] > bestImpostor[i]) hits++;
+        }
+
+        qDebug("%s, Rank 1: %.3f (%lld genuine, %lld impostor)", qPrintable(rates.join(", ")),
+               searches > 0 ? float(hits) / searches : 0.f, genuineCount, impostorCount);
+    }
+};
+
+BR_REGISTER(Output, rocOutput)
+
+} // namespace br
+
+#include "output/roc.moc"
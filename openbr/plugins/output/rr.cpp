@@ -16,8 +16,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
-#include <openbr/core/qtutils.h>
-#include <openbr/core/opencvutils.h>
+#include <openbr/core/textwriter.h>
 
 namespace br
 {
@@ -32,34 +31,48 @@ class rrOutput : public MatrixOutput
 {
     Q_OBJECT
 
-    ~rrOutput()
+    struct Row : public TextWriter::RowFormatter
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const int limit = file.get<int>("limit", 20);
-        const bool byLine = file.getBool("byLine");
-        const bool simple = file.getBool("simple");
-        const float threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        FileList queries, targets;
+        cv::Mat scores;
+        int limit;
+        bool byLine, simple;
+        float threshold;
 
-        QStringList lines;
-
-        for (int i=0; i<queryFiles.size(); i++) {
+        void format(int i, QByteArray &dst) const
+        {
             QStringList files;
-            if (simple) files.append(queryFiles[i].fileName());
+            if (simple) files.append(queries[i].fileName());
 
             typedef QPair<float,int> Pair;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true, limit)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
+            foreach (const Pair &pair, Common::Sort(scores.ptr<float>(i), scores.cols, true, limit)) {
+                if (Globals->crossValidate > 0 ? (targets[pair.second].get<int>("Partition",-1) == -1 || targets[pair.second].get<int>("Partition",-1) == queries[i].get<int>("Partition",-1)) : true) {
                     if (pair.first < threshold) break;
-                    File target = targetFiles[pair.second];
+                    File target = targets[pair.second];
                     target.set("Score", QString::number(pair.first));
                     if (simple) files.append(target.fileName() + " " + QString::number(pair.first));
                     else files.append(target.flat());
                 }
             }
-            lines.append(files.join(byLine ? "\n" : ","));
+            dst += files.join(byLine ? "\n" : ",").toLocal8Bit();
+            dst += '\n';
         }
+    };
+
+    ~rrOutput()
+    {
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
+        Row row;
+        row.limit = file.get<int>("limit", 20);
+        row.byLine = file.getBool("byLine");
+        row.simple = file.getBool("simple");
+        row.threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        row.queries = queryFiles;
+        row.targets = targetFiles;
+        row.scores = data;
 
-        QtUtils::writeFile(file, lines);
+        TextWriter writer(file);
+        writer.writeRows(queryFiles.size(), row);
     }
 };
 
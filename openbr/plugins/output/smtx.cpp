@@ -0,0 +1,78 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Sparse \ref simmat output.
+ *
+ * Only scores of at least \em threshold are stored, limited to the \em k highest per query if \em k is non-negative.
+ * Comparisons that aren't stored read back as -FLT_MAX.
+ * Scores are buffered per comparison thread by br::TopKOutput, so br::Distance::compareBlock writes without locking.
+ */
+class smtxOutput : public TopKOutput
+{
+    Q_OBJECT
+
+    Q_PROPERTY(QString targetGallery READ get_targetGallery WRITE set_targetGallery RESET reset_targetGallery STORED false)
+    Q_PROPERTY(QString queryGallery READ get_queryGallery WRITE set_queryGallery RESET reset_queryGallery STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    BR_PROPERTY(QString, targetGallery, "Unknown_Target")
+    BR_PROPERTY(QString, queryGallery, "Unknown_Query")
+    BR_PROPERTY(float, threshold, -std::numeric_limits<float>::max())
+
+    ~smtxOutput()
+    {
+        if (file.isNull() || queryFiles.isEmpty()) return;
+
+        BEE::SparseMatrix sparse;
+        sparse.rows = queryFiles.size();
+        sparse.cols = targetFiles.size();
+        sparse.rowPointers.reserve(sparse.rows + 1);
+        sparse.rowPointers.append(0);
+
+        // Each row is stored in column order
+        const Neighborhood neighborhood = topK();
+        for (int i=0; i<neighborhood.size(); i++) {
+            Neighbors neighbors = neighborhood[i];
+            std::sort(neighbors.begin(), neighbors.end());
+            foreach (const Neighbor &neighbor, neighbors) {
+                sparse.columns.append(neighbor.first);
+                sparse.values.append(neighbor.second);
+            }
+            sparse.rowPointers.append(sparse.values.size());
+        }
+
+        BEE::writeSparseMatrix(sparse, file, targetGallery, queryGallery);
+    }
+
+    bool accept(float value, int i, int j) const
+    {
+        (void) i; (void) j;
+        return (value >= threshold) && (value != -std::numeric_limits<float>::max());
+    }
+};
+
+BR_REGISTER(Output, smtxOutput)
+
+} // namespace br
+
+#include "output/smtx.moc"
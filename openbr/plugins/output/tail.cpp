@@ -48,19 +48,36 @@ class tailOutput : public Output
         }
     };
 
+    // Min-heap with respect to value, the front is the next comparison to be discarded
+    struct Tail
+    {
+        QList<Comparison> comparisons;
+        float lastValue;
+
+        Tail() : lastValue(-std::numeric_limits<float>::max()) {}
+    };
+
     float threshold;
     int atLeast, atMost;
     bool args;
-    float lastValue;
-    QList<Comparison> comparisons;
-    QMutex comparisonsLock;
+    QVector<Tail> tails; // One per writer slot
+    QMutex sharedLock;
 
     ~tailOutput()
     {
-        if (file.isNull() || comparisons.isEmpty()) return;
-        QStringList lines; lines.reserve(comparisons.size()+1);
+        if (file.isNull() || tails.isEmpty()) return;
+
+        // Each slot retains a superset of its share of the overall tail
+        Tail merged;
+        foreach (const Tail &tail, tails)
+            foreach (const Comparison &comparison, tail.comparisons)
+                insert(merged, comparison);
+        if (merged.comparisons.isEmpty()) return;
+
+        std::sort_heap(merged.comparisons.begin(), merged.comparisons.end(), greaterThan);
+        QStringList lines; lines.reserve(merged.comparisons.size()+1);
         lines.append("Value,Target,Query");
-        foreach (const Comparison &duplicate, comparisons)
+        foreach (const Comparison &duplicate, merged.comparisons)
             lines.append(duplicate.toString(args));
         QtUtils::writeFile(file, lines);
     }
@@ -72,7 +89,7 @@ class tailOutput : public Output
         atLeast = file.get<int>("atLeast", 1);
         atMost = file.get<int>("atMost", std::numeric_limits<int>::max());
         args = file.get<bool>("args", false);
-        lastValue = -std::numeric_limits<float>::max();
+        tails = QVector<Tail>(writerSlots());
     }
 
     void set(float value, int i, int j)
@@ -80,31 +97,41 @@ class tailOutput : public Output
         // Return early for self similar matrices
         if (selfSimilar && (i <= j)) return;
 
+        const int slot = writerSlot();
+        if (!sharedWriterSlot(slot)) {
+            consider(tails[slot], value, i, j);
+        } else {
+            QMutexLocker locker(&sharedLock);
+            consider(tails[slot], value, i, j);
+        }
+    }
+
+    void consider(Tail &tail, float value, int i, int j)
+    {
         // Consider only values passing the criteria
-        if ((value < threshold) && (value <= lastValue) && (comparisons.size() >= atLeast))
+        if ((value < threshold) && (value <= tail.lastValue) && (tail.comparisons.size() >= atLeast))
             return;
+        insert(tail, Comparison(queryFiles[i], targetFiles[j], value));
+    }
 
-        comparisonsLock.lock();
-        if (comparisons.isEmpty() || (value < comparisons.last().value)) {
-            // Special cases
-            comparisons.append(Comparison(queryFiles[i], targetFiles[j], value));
-        } else {
-            // General case
-            for (int k=0; k<comparisons.size(); k++) {
-                if (comparisons[k].value <= value) {
-                    comparisons.insert(k, Comparison(queryFiles[i], targetFiles[j], value));
-                    break;
-                }
-            }
-        }
+    void insert(Tail &tail, const Comparison &comparison) const
+    {
+        QList<Comparison> &comparisons = tail.comparisons;
+        comparisons.append(comparison);
+        std::push_heap(comparisons.begin(), comparisons.end(), greaterThan);
 
-        while (comparisons.size() > atMost)
-            comparisons.removeLast();
-        while ((comparisons.size() > atLeast) && (comparisons.last().value < threshold))
+        while ((comparisons.size() > atMost) ||
+               ((comparisons.size() > atLeast) && (comparisons.first().value < threshold))) {
+            std::pop_heap(comparisons.begin(), comparisons.end(), greaterThan);
             comparisons.removeLast();
+        }
 
-        lastValue = comparisons.last().value;
-        comparisonsLock.unlock();
+        tail.lastValue = comparisons.isEmpty() ? -std::numeric_limits<float>::max() : comparisons.first().value;
+    }
+
+    static bool greaterThan(const Comparison &a, const Comparison &b)
+    {
+        return b < a;
     }
 };
 
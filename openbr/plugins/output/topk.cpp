@@ -0,0 +1,115 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
+
+namespace br
+{
+
+void TopKOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
+{
+    Output::initialize(targetFiles, queryFiles);
+    capacity = (k < 0) ? targetFiles.size() : std::min(k, targetFiles.size());
+
+    // Heaps the size of every target would take writerSlots() times the memory of a dense matrix
+    if (capacity == targetFiles.size()) {
+        heaps.clear();
+        scores.create(queryFiles.size(), targetFiles.size(), CV_32FC1);
+        accepted = cv::Mat::zeros(queryFiles.size(), targetFiles.size(), CV_8UC1);
+    } else {
+        heaps = QVector<Neighborhood>(writerSlots());
+        scores.release();
+        accepted.release();
+    }
+}
+
+void TopKOutput::set(float value, int i, int j)
+{
+    if ((capacity == 0) || !accept(value, i, j))
+        return;
+
+    // Each comparison is written once, so dense writes don't need a writer slot
+    if (!scores.empty()) {
+        scores.at<float>(i, j) = value;
+        accepted.at<uchar>(i, j) = 1;
+        return;
+    }
+
+    const int slot = writerSlot();
+    if (!sharedWriterSlot(slot)) {
+        Neighborhood &local = heaps[slot];
+        if (local.isEmpty())
+            local.resize(queryFiles.size());
+        insertNeighbor(local[i], Neighbor(j, value), capacity);
+    } else {
+        QMutexLocker locker(&overflowLock);
+        Neighborhood &shared = heaps[slot];
+        if (shared.isEmpty())
+            shared.resize(queryFiles.size());
+        insertNeighbor(shared[i], Neighbor(j, value), capacity);
+    }
+}
+
+static const int blockQueries = 64;
+
+// Merges the writers' heaps for queries [begin, end)
+static void mergeNeighbors(const QVector<Neighborhood> *heaps, Neighborhood *merged, int capacity, int begin, int end)
+{
+    for (int i=begin; i<end; i++) {
+        Neighbors &neighbors = (*merged)[i];
+        foreach (const Neighborhood &local, *heaps)
+            if (!local.isEmpty())
+                neighbors.append(local[i]);
+        const int keep = std::min(capacity, neighbors.size());
+        if (keep < neighbors.size()) {
+            std::nth_element(neighbors.begin(), neighbors.begin()+keep, neighbors.end(), compareNeighbors);
+            neighbors.erase(neighbors.begin()+keep, neighbors.end());
+        }
+        std::sort(neighbors.begin(), neighbors.end(), compareNeighbors);
+    }
+}
+
+// Sorts the accepted scores of queries [begin, end)
+static void sortScores(const cv::Mat *scores, const cv::Mat *accepted, Neighborhood *merged, int begin, int end)
+{
+    for (int i=begin; i<end; i++) {
+        Neighbors &neighbors = (*merged)[i];
+        const float *score = scores->ptr<float>(i);
+        const uchar *mask = accepted->ptr<uchar>(i);
+        for (int j=0; j<scores->cols; j++)
+            if (mask[j])
+                neighbors.append(Neighbor(j, score[j]));
+        std::sort(neighbors.begin(), neighbors.end(), compareNeighbors);
+    }
+}
+
+Neighborhood TopKOutput::topK() const
+{
+    Neighborhood merged(queryFiles.size());
+
+    // Queries are independent, so blocks of them are merged in parallel
+    TaskGroup group;
+    for (int begin=0; begin<merged.size(); begin+=blockQueries) {
+        const int end = std::min(merged.size(), begin+blockQueries);
+        if (scores.empty()) group.run(mergeNeighbors, &heaps, &merged, capacity, begin, end);
+        else                group.run(sortScores, &scores, &accepted, &merged, begin, end);
+    }
+    group.wait();
+    return merged;
+}
+
+} // namespace br
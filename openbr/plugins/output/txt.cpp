@@ -15,7 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/qtutils.h>
+#include <openbr/core/textwriter.h>
 
 namespace br
 {
@@ -32,10 +32,9 @@ class txtOutput : public MatrixOutput
     ~txtOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
+        TextWriter writer(file);
         foreach (const File &file, queryFiles)
-            lines.append(file.name + " " + file.get<QString>("Label"));
-        QtUtils::writeFile(file, lines);
+            writer.writeLine(file.name + " " + file.get<QString>("Label"));
     }
 };
 
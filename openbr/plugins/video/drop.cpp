@@ -25,6 +25,8 @@ namespace br
  * \author Austin Blanton \cite imaus10
  *
  * For a video with m frames, DropFrames will pass on m/n frames.
+ * Dropped frames have already been decoded, when reading from a file prefer sampling in the gallery,
+ * such as the \c keyframes, \c gop, \c interval and \c n arguments of \ref libavGallery or \ref keyframesGallery.
  */
 class DropFrames : public UntrainableMetaTransform
 {
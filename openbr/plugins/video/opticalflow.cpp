@@ -25,6 +25,21 @@ using namespace cv;
 namespace br
 {
 
+// Append the flow, or its magnitude, to dst
+static void appendFlow(const Mat &flow, bool useMagnitude, Template &dst)
+{
+    if (useMagnitude) {
+        // the result is two channels
+        Mat flowOneCh;
+        std::vector<Mat> channels(2);
+        split(flow, channels);
+        magnitude(channels[0], channels[1], flowOneCh);
+        dst += flowOneCh;
+    } else {
+        dst += flow;
+    }
+}
+
 /*!
  * \ingroup transforms
  * \brief Gets a one-channel dense optical flow from two images
@@ -59,23 +74,126 @@ class OpticalFlowTransform : public UntrainableMetaTransform
         if (src[0].channels() != 1) OpenCVUtils::cvtGray(src[0], prevImg);
         if (src[1].channels() != 1) OpenCVUtils::cvtGray(src[1], nextImg);
         calcOpticalFlowFarneback(prevImg, nextImg, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flags);
-
-        if (useMagnitude) {
-            // the result is two channels
-            Mat flowOneCh;
-            std::vector<Mat> channels(2);
-            split(flow, channels);
-            magnitude(channels[0], channels[1], flowOneCh);
-            dst += flowOneCh;
-        } else {
-            dst += flow;
-        }
+        appendFlow(flow, useMagnitude, dst);
         dst.file = src.file;
     }
 };
 
 BR_REGISTER(Transform, OpticalFlowTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Gets a one-channel dense optical flow between consecutive frames of a video
+ *
+ * A drop-in for <tt>AggregateFrames(2)+OpticalFlow</tt>. Each frame is converted to gray once, and the previous
+ * flow is the initial estimate for the next pair (\c OPTFLOW_USE_INITIAL_FLOW), so fewer \c iterations are needed.
+ * With \c useRects flow is only computed inside the frame's rects grown by \c padding pixels, and is zero elsewhere.
+ */
+class IncrementalOpticalFlowTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(double pyr_scale READ get_pyr_scale WRITE set_pyr_scale RESET reset_pyr_scale STORED false)
+    Q_PROPERTY(int levels READ get_levels WRITE set_levels RESET reset_levels STORED false)
+    Q_PROPERTY(int winsize READ get_winsize WRITE set_winsize RESET reset_winsize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    Q_PROPERTY(int poly_n READ get_poly_n WRITE set_poly_n RESET reset_poly_n STORED false)
+    Q_PROPERTY(double poly_sigma READ get_poly_sigma WRITE set_poly_sigma RESET reset_poly_sigma STORED false)
+    Q_PROPERTY(int flags READ get_flags WRITE set_flags RESET reset_flags STORED false)
+    Q_PROPERTY(bool useMagnitude READ get_useMagnitude WRITE set_useMagnitude RESET reset_useMagnitude STORED false)
+    Q_PROPERTY(bool useRects READ get_useRects WRITE set_useRects RESET reset_useRects STORED false)
+    Q_PROPERTY(int padding READ get_padding WRITE set_padding RESET reset_padding STORED false)
+    BR_PROPERTY(double, pyr_scale, 0.1)
+    BR_PROPERTY(int, levels, 1)
+    BR_PROPERTY(int, winsize, 5)
+    BR_PROPERTY(int, iterations, 10)
+    BR_PROPERTY(int, poly_n, 7)
+    BR_PROPERTY(double, poly_sigma, 1.1)
+    BR_PROPERTY(int, flags, 0)
+    BR_PROPERTY(bool, useMagnitude, true)
+    BR_PROPERTY(bool, useRects, false)
+    BR_PROPERTY(int, padding, 8)
+
+    Mat prevGray, prevFlow;
+    File prevFile;
+
+public:
+    IncrementalOpticalFlowTransform() : TimeVaryingTransform(false, false) {}
+
+private:
+    void train(const TemplateList &data)
+    {
+        (void) data;
+    }
+
+    // Flow from prevGray to gray, seeded with prevFlow when it is available
+    Mat flowTo(const Mat &gray, const QList<QRectF> &rects) const
+    {
+        const bool seeded = (prevFlow.size() == gray.size());
+        const int flowFlags = seeded ? (flags | OPTFLOW_USE_INITIAL_FLOW) : flags;
+
+        if (!useRects) {
+            Mat flow = seeded ? prevFlow.clone() : Mat();
+            calcOpticalFlowFarneback(prevGray, gray, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flowFlags);
+            return flow;
+        }
+
+        Mat flow(gray.size(), CV_32FC2, Scalar::all(0));
+        const Rect frame(0, 0, gray.cols, gray.rows);
+        foreach (const QRectF &rect, rects) {
+            const Rect roi = OpenCVUtils::toRect(rect.adjusted(-padding, -padding, padding, padding)) & frame;
+            if (roi.area() == 0)
+                continue;
+            Mat region = seeded ? prevFlow(roi).clone() : Mat();
+            calcOpticalFlowFarneback(prevGray(roi), gray(roi), region, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flowFlags);
+            region.copyTo(flow(roi));
+        }
+        return flow;
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src) {
+            Mat gray = t;
+            if (t.m().channels() != 1) OpenCVUtils::cvtGray(t, gray);
+
+            // Flow restarts after the first frame, or a change in resolution
+            if (prevGray.size() == gray.size()) {
+                Template out;
+                // Regions from both frames cover objects that moved in or out of them
+                prevFlow = flowTo(gray, prevFile.rects() + t.file.rects());
+                appendFlow(prevFlow, useMagnitude, out);
+                out.file = prevFile;
+                dst.append(out);
+            } else {
+                prevFlow.release();
+            }
+
+            prevGray = gray;
+            prevFile = t.file;
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        (void) output;
+        prevGray.release();
+        prevFlow.release();
+        prevFile = File();
+    }
+
+    void store(QDataStream &stream) const
+    {
+        (void) stream;
+    }
+
+    void load(QDataStream &stream)
+    {
+        (void) stream;
+    }
+};
+
+BR_REGISTER(Transform, IncrementalOpticalFlowTransform)
+
 } // namespace br
 
 #include "video/opticalflow.moc"
@@ -0,0 +1,258 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Tracks detections across the frames of a video so each object is detected and enrolled once.
+ *
+ * \c detector runs on a frame every \c interval frames, or sooner when a track is lost or there are none.
+ * Its detections are associated with tracks greedily by intersection over union, those with less than \c iou
+ * overlap start new tracks. Between detections tracks follow their last detected appearance by normalized
+ * cross correlation, a track whose best match is below \c minSimilarity is lost for that frame. Tracks missing
+ * for more than \c maxMisses consecutive frames end.
+ *
+ * When a track ends its highest \c Confidence detection is projected through \c enroll, or output as is,
+ * with \c TrackID, \c TrackStart and \c TrackEnd metadata. For example:
+ * <tt>Track(Cascade(FrontalFace),ASEFEyes+Affine(88,88,0.25,0.35)+FTE(DFFS)+Mask+Blur(1.1)+Gamma(0.2),interval=15)</tt>
+ */
+class TrackTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform *detector READ get_detector WRITE set_detector RESET reset_detector)
+    Q_PROPERTY(br::Transform *enroll READ get_enroll WRITE set_enroll RESET reset_enroll)
+    Q_PROPERTY(int interval READ get_interval WRITE set_interval RESET reset_interval STORED false)
+    Q_PROPERTY(float iou READ get_iou WRITE set_iou RESET reset_iou STORED false)
+    Q_PROPERTY(float minSimilarity READ get_minSimilarity WRITE set_minSimilarity RESET reset_minSimilarity STORED false)
+    Q_PROPERTY(int maxMisses READ get_maxMisses WRITE set_maxMisses RESET reset_maxMisses STORED false)
+    BR_PROPERTY(br::Transform *, detector, NULL)
+    BR_PROPERTY(br::Transform *, enroll, NULL)
+    BR_PROPERTY(int, interval, 10)
+    BR_PROPERTY(float, iou, 0.3)
+    BR_PROPERTY(float, minSimilarity, 0.6)
+    BR_PROPERTY(int, maxMisses, 5)
+
+    struct Track
+    {
+        int id, start, end, misses;
+        Rect rect;
+        Mat appearance; // Gray pixels of the last detection
+        Template best;
+        float quality;
+    };
+
+    QList<Track> tracks;
+    int nextID, frames, lastDetection;
+
+public:
+    TrackTransform() : TimeVaryingTransform(false, false), nextID(0), frames(0), lastDetection(-1) {}
+
+private:
+    void init()
+    {
+        if (detector == NULL)
+            qFatal("Track requires a detector.");
+        trainable = detector->trainable || (enroll && enroll->trainable);
+        tracks.clear();
+        nextID = frames = 0;
+        lastDetection = -1;
+    }
+
+    // As in a pipe, enroll is trained on the detections in the training data
+    void train(const TemplateList &data)
+    {
+        if (detector->trainable)
+            detector->train(data);
+        if (enroll && enroll->trainable) {
+            TemplateList detections;
+            detector->project(data, detections);
+            enroll->train(detections);
+        }
+    }
+
+    static float intersectionOverUnion(const Rect &a, const Rect &b)
+    {
+        const int intersection = (a & b).area();
+        const int area = a.area() + b.area() - intersection;
+        return area > 0 ? float(intersection) / area : 0;
+    }
+
+    // Move the track to the best match of its appearance near where it was, returns false if there isn't one
+    bool follow(Track &track, const Mat &gray) const
+    {
+        const Rect frame(0, 0, gray.cols, gray.rows);
+        const Rect search = Rect(track.rect.x - track.rect.width/2, track.rect.y - track.rect.height/2,
+                                 2*track.rect.width, 2*track.rect.height) & frame;
+        if ((search.width < track.appearance.cols) || (search.height < track.appearance.rows))
+            return false;
+
+        Mat response;
+        matchTemplate(gray(search), track.appearance, response, TM_CCOEFF_NORMED);
+        double similarity;
+        Point location;
+        minMaxLoc(response, NULL, &similarity, NULL, &location);
+        if (similarity < minSimilarity)
+            return false;
+
+        track.rect = Rect(search.x + location.x, search.y + location.y, track.appearance.cols, track.appearance.rows);
+        return true;
+    }
+
+    void update(Track &track, const Template &detection, const Rect &rect, const Mat &gray, int frameNumber) const
+    {
+        track.rect = rect & Rect(0, 0, gray.cols, gray.rows);
+        track.appearance = gray(track.rect).clone();
+        track.end = frameNumber;
+        track.misses = 0;
+
+        const float quality = detection.file.get<float>("Confidence", 0);
+        if (track.best.isEmpty() || (quality > track.quality)) {
+            track.best = detection;
+            track.quality = quality;
+        }
+    }
+
+    // Greedily pair detections with the tracks they overlap most, unpaired detections start new tracks
+    void associate(const TemplateList &detections, const Mat &gray, int frameNumber)
+    {
+        QList<Rect> rects;
+        foreach (const Template &detection, detections)
+            rects.append(detection.file.rects().isEmpty() ? Rect() : OpenCVUtils::toRect(detection.file.rects().last()));
+
+        QVector<bool> matchedTrack(tracks.size(), false), matchedDetection(rects.size(), false);
+        forever {
+            float bestOverlap = iou;
+            int bestTrack = -1, bestDetection = -1;
+            for (int i=0; i<tracks.size(); i++) {
+                if (matchedTrack[i]) continue;
+                for (int j=0; j<rects.size(); j++) {
+                    if (matchedDetection[j]) continue;
+                    const float overlap = intersectionOverUnion(tracks[i].rect, rects[j]);
+                    if (overlap >= bestOverlap) {
+                        bestOverlap = overlap;
+                        bestTrack = i;
+                        bestDetection = j;
+                    }
+                }
+            }
+            if (bestTrack < 0)
+                break;
+
+            matchedTrack[bestTrack] = matchedDetection[bestDetection] = true;
+            update(tracks[bestTrack], detections[bestDetection], rects[bestDetection], gray, frameNumber);
+        }
+
+        // Followed tracks the detector didn't confirm count as missed, those that couldn't be followed already have
+        for (int i=0; i<matchedTrack.size(); i++)
+            if (!matchedTrack[i] && (tracks[i].end == frameNumber))
+                tracks[i].misses++;
+
+        for (int j=0; j<rects.size(); j++) {
+            if (matchedDetection[j] || (rects[j].area() == 0))
+                continue;
+            Track track;
+            track.id = nextID++;
+            track.start = frameNumber;
+            track.quality = 0;
+            update(track, detections[j], rects[j], gray, frameNumber);
+            if (track.rect.area() > 0)
+                tracks.append(track);
+        }
+    }
+
+    void output(const Track &track, TemplateList &dst) const
+    {
+        Template out;
+        if (enroll) enroll->project(track.best, out);
+        else        out = track.best;
+        out.file.set("TrackID", track.id);
+        out.file.set("TrackStart", track.start);
+        out.file.set("TrackEnd", track.end);
+        dst.append(out);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src) {
+            if (t.isEmpty())
+                continue;
+
+            const int frameNumber = t.file.get<int>("FrameNumber", frames);
+            frames++;
+
+            Mat gray = t;
+            if (t.m().channels() != 1) OpenCVUtils::cvtGray(t, gray);
+
+            bool lost = false;
+            for (int i=0; i<tracks.size(); i++) {
+                if (follow(tracks[i], gray)) {
+                    tracks[i].end = frameNumber;
+                } else {
+                    tracks[i].misses++;
+                    lost = true;
+                }
+            }
+
+            if (lost || tracks.isEmpty() || (lastDetection < 0) || (frames - lastDetection >= interval)) {
+                Template frame = t;
+                frame.file.set("enrollAll", true);
+                TemplateList detections;
+                detector->project(TemplateList() << frame, detections);
+                associate(detections, gray, frameNumber);
+                lastDetection = frames;
+            }
+
+            for (int i=tracks.size()-1; i>=0; i--)
+                if (tracks[i].misses > maxMisses)
+                    output(tracks.takeAt(i), dst);
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        foreach (const Track &track, tracks)
+            this->output(track, output);
+        tracks.clear();
+        lastDetection = -1;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        detector->store(stream);
+        if (enroll) enroll->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        detector->load(stream);
+        if (enroll) enroll->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, TrackTransform)
+
+} // namespace br
+
+#include "video/track.moc"
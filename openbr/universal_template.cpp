@@ -1,10 +1,17 @@
 #include <QFile>
-#include <QFutureSynchronizer>
 #include <QMutex>
 #include <QMutexLocker>
-#include <QtConcurrent>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QTime>
+#include <QWaitCondition>
+#include <QtDebug>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
 
 #include "universal_template.h"
 
@@ -46,66 +53,181 @@ void br_iterate_utemplates(br_const_utemplate begin, br_const_utemplate end, br_
     }
 }
 
-static void callAndFree(br_utemplate_callback callback, br_utemplate t, br_callback_context context)
-{
-    callback(t, context);
-    free(t);
-}
+namespace {
 
-static bool read_buffer(FILE *file, char *buffer, size_t bytes)
+// Shared by the tasks of one br_iterate_utemplates_file_ranges call
+struct RangeQueue
 {
-    size_t bytesRemaining = bytes;
-    while (bytesRemaining) {
-        const size_t bytesRead = fread(buffer, 1, bytesRemaining, file);
-        buffer += bytesRead;
-        bytesRemaining -= bytesRead;
-
-        if (feof(file)) {
-            if ((bytesRemaining != bytes) && !fseek(file, bytesRemaining - bytes, SEEK_CUR)) // Try to rewind
-                bytesRemaining = bytes;
-            if (bytesRemaining == bytes)
-                return false;
-            qFatal("End of file after reading %d of %d bytes.", int(bytes - bytesRemaining), int(bytes));
+    br_utemplate_range_callback callback;
+    br_callback_context context;
+    bool ordered;
+    QMutex mutex;
+    QWaitCondition turn;
+    int next; // Sequence number of the next range to deliver when ordered
+    QSemaphore buffers; // Bounds the memory held by ranges waiting for a thread
+
+    RangeQueue(br_utemplate_range_callback callback, br_callback_context context, bool ordered, int buffers)
+        : callback(callback), context(context), ordered(ordered), next(0), buffers(buffers) {}
+};
+
+class RangeTask : public QRunnable
+{
+    RangeQueue *queue;
+    char *buffer;
+    size_t size;
+    int sequence;
+
+public:
+    RangeTask(RangeQueue *queue, char *buffer, size_t size, int sequence)
+        : queue(queue), buffer(buffer), size(size), sequence(sequence) {}
+
+    void run()
+    {
+        if (queue->ordered) {
+            QMutexLocker locker(&queue->mutex);
+            while (queue->next != sequence)
+                queue->turn.wait(&queue->mutex);
         }
 
-        if (ferror(file)) {
-            perror(NULL);
-            qFatal("Error after reading %d of %d bytes.", int(bytes - bytesRemaining), int(bytes));
+        queue->callback(reinterpret_cast<br_const_utemplate>(buffer), reinterpret_cast<br_const_utemplate>(buffer + size), queue->context);
+
+        if (queue->ordered) {
+            QMutexLocker locker(&queue->mutex);
+            queue->next++;
+            queue->turn.wakeAll();
         }
+
+        free(buffer);
+        queue->buffers.release();
     }
-    return true;
+};
+
+struct TemplateCallback
+{
+    br_utemplate_callback callback;
+    br_callback_context context;
+};
+
+void iterateRange(br_const_utemplate begin, br_const_utemplate end, br_callback_context context)
+{
+    const TemplateCallback *templateCallback = reinterpret_cast<const TemplateCallback*>(context);
+    br_iterate_utemplates(begin, end, templateCallback->callback, templateCallback->context);
 }
 
-int br_iterate_utemplates_file(FILE *file, br_utemplate_callback callback, br_callback_context context, bool parallel)
+// Bytes between the current position and the end of the file, unbounded if the file can't seek
+size_t remainingBytes(FILE *file)
+{
+    const long position = ftell(file);
+    if ((position < 0) || fseek(file, 0, SEEK_END))
+        return std::numeric_limits<size_t>::max();
+    const long end = ftell(file);
+    if (fseek(file, position, SEEK_SET))
+        qFatal("Unable to seek in template file!");
+    return end > position ? size_t(end - position) : 0;
+}
+
+} // namespace
+
+int br_iterate_utemplates_file_ranges(FILE *file, br_utemplate_range_callback callback, br_callback_context context, int threads, bool ordered)
 {
+    threads = std::max(1, threads);
+
+    // The chunks in flight share a fixed budget, so memory doesn't grow with the thread count
+    static const size_t budget = size_t(256) << 20, minChunkSize = size_t(1) << 20, maxChunkSize = size_t(64) << 20;
+    const int buffers = int(std::min(size_t(threads + 1), budget / minChunkSize));
+    const size_t chunkSize = std::min(maxChunkSize, budget / size_t(buffers));
+
+    // A single ordered reader delivers on the caller's thread, as a plain sequential iteration would
+    const bool inlined = ordered && (threads == 1);
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    RangeQueue queue(callback, context, ordered, buffers);
+
     int count = 0;
-    QFutureSynchronizer<void> futures;
-    while (true) {
-        br_utemplate t = (br_utemplate) malloc(sizeof(br_universal_template));
+    int sequence = 0;
+    char *carry = NULL; // Partial template at the end of the previous chunk
+    size_t carried = 0;
+    bool eof = false;
+
+    while (!eof) {
+        // A template larger than a chunk needs a larger buffer
+        size_t capacity = chunkSize;
+        if (carried >= sizeof(br_universal_template)) {
+            const br_const_utemplate t = reinterpret_cast<br_const_utemplate>(carry);
+            const size_t bytes = sizeof(br_universal_template) + size_t(t->urlSize) + size_t(t->fvSize);
+            if (bytes - carried > remainingBytes(file))
+                break; // Not in the file (yet), leave it for a retry rather than allocating its claimed size
+            capacity = std::max(capacity, bytes);
+        }
 
-        if (!read_buffer(file, (char*) t, sizeof(br_universal_template))) {
-            free(t);
-            break;
+        queue.buffers.acquire();
+        char *buffer = (char*) malloc(capacity);
+        if (!buffer)
+            qFatal("Unable to allocate %lld bytes after reading %d templates.", qint64(capacity), count);
+        memcpy(buffer, carry, carried);
+        free(carry);
+        carry = NULL;
+
+        const size_t size = carried + fread(buffer + carried, 1, capacity - carried, file);
+        if (size < capacity) {
+            if (ferror(file)) {
+                perror(NULL);
+                qFatal("Error after reading %d templates.", count);
+            }
+            eof = true;
         }
 
-        t = (br_utemplate) realloc(t, sizeof(br_universal_template) + t->urlSize + t->fvSize);
-        if (!read_buffer(file, (char*) &t->data, t->urlSize + t->fvSize)) {
-            free(t);
+        // Find the complete templates in the buffer
+        size_t end = 0;
+        int templates = 0;
+        while (end + sizeof(br_universal_template) <= size) {
+            const br_const_utemplate t = reinterpret_cast<br_const_utemplate>(buffer + end);
+            const size_t bytes = sizeof(br_universal_template) + t->urlSize + t->fvSize;
+            if (end + bytes > size)
+                break;
+            end += bytes;
+            templates++;
+        }
 
-            // Try to rewind header read
-            if (fseek(file, -sizeof(br_universal_template), SEEK_CUR))
-                qFatal("Unable to recover from partial template read!");
+        carried = size - end;
+        if (carried) {
+            carry = (char*) malloc(carried);
+            if (!carry)
+                qFatal("Unable to allocate %lld bytes after reading %d templates.", qint64(carried), count);
+            memcpy(carry, buffer + end, carried);
+        }
 
-            break;
+        if (templates == 0) {
+            free(buffer);
+            queue.buffers.release();
+            continue;
         }
 
-        if (parallel) futures.addFuture(QtConcurrent::run(callAndFree, callback, t, context));
-        else          callAndFree(callback, t, context);
-        count++;
+        count += templates;
+        if (inlined) RangeTask(&queue, buffer, end, sequence++).run();
+        else         pool.start(new RangeTask(&queue, buffer, end, sequence++));
     }
+    pool.waitForDone();
+
+    // Leave a trailing partial template unread so it can be retried once written
+    if (carried) {
+        free(carry);
+        if (fseek(file, -long(carried), SEEK_CUR))
+            qFatal("Unable to recover from partial template read!");
+    }
+
     return count;
 }
 
+int br_iterate_utemplates_file(FILE *file, br_utemplate_callback callback, br_callback_context context, bool parallel)
+{
+    TemplateCallback templateCallback;
+    templateCallback.callback = callback;
+    templateCallback.context = context;
+    if (parallel) return br_iterate_utemplates_file_ranges(file, iterateRange, &templateCallback, QThread::idealThreadCount(), false);
+    else          return br_iterate_utemplates_file_ranges(file, iterateRange, &templateCallback, 1, true);
+}
+
 void br_log(const char *message)
 {
     qDebug() << qPrintable(QTime::currentTime().toString("hh:mm:ss.zzz")) << "-" << message;
@@ -91,6 +91,24 @@ BR_EXPORT void br_iterate_utemplates(br_const_utemplate begin, br_const_utemplat
  */
 BR_EXPORT int br_iterate_utemplates_file(FILE *file, br_utemplate_callback callback, br_callback_context context, bool parallel);
 
+/*!
+ * \brief br_universal_template range callback, called with a contiguous in-place array of templates.
+ * \see br_iterate_utemplates_file_ranges
+ */
+typedef void (*br_utemplate_range_callback)(br_const_utemplate begin, br_const_utemplate end, br_callback_context context);
+
+/*!
+ * \brief Iterate over br_universal_template in a file, reading large chunks and handing each chunk's templates to a pool of \c threads workers.
+ * Up to \c threads + 1 chunks of at most 64 MB are held at once, sized so together they take no more than 256 MB unless a single template is larger.
+ * \param ordered If true ranges are delivered one at a time in file order, overlapping the callback with reading the next chunk.
+ * With a single thread ordered ranges are delivered on the caller's thread instead, otherwise callbacks run on pool threads.
+ * A template claiming more bytes than remain in the file is left unread, as a partially written one would be.
+ * Templates are valid only for the duration of the callback.
+ * \return The number of templates iterated
+ * \see br_iterate_utemplates_file
+ */
+BR_EXPORT int br_iterate_utemplates_file_ranges(FILE *file, br_utemplate_range_callback callback, br_callback_context context, int threads, bool ordered);
+
 /*!
  * \brief Write a message annotated with the current time to stderr.
  */
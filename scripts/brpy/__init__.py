@@ -191,6 +191,12 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_unload_img.argtypes = [c_void_p]
     br.br_unload_img.restype = POINTER(c_ubyte)
 
+    br.br_load_encoded_view.argtypes = [c_char_p, c_int]
+    br.br_load_encoded_view.restype = c_void_p
+
+    br.br_load_pixels_view.argtypes = [c_void_p, c_int, c_int, c_int, c_int]
+    br.br_load_pixels_view.restype = c_void_p
+
     br.br_template_list_from_buffer.argtypes = [c_char_p, c_int]
     br.br_template_list_from_buffer.restype = c_void_p
 
@@ -228,12 +234,27 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_enroll_template_list.argtypes = [c_void_p]
     br.br_enroll_template_list.restype = c_void_p
 
+    br.br_make_enroller.argtypes = [c_char_p, c_int]
+    br.br_make_enroller.restype = c_void_p
+
+    br.br_enroller_enroll.argtypes = [c_void_p, c_void_p]
+
+    br.br_free_enroller.argtypes = [c_void_p]
+
     br.br_compare_template_lists.argtypes = [c_void_p, c_void_p]
     br.br_compare_template_lists.restype = c_void_p
 
     br.br_get_matrix_output_at.argtypes = [c_void_p, c_int, c_int]
     br.br_get_matrix_output_at.restype = c_float
 
+    br.br_get_matrix_output_data.argtypes = [c_void_p, POINTER(c_int), POINTER(c_int), POINTER(c_int)]
+    br.br_get_matrix_output_data.restype = POINTER(c_float)
+
+    br.br_compare_template_lists_into.argtypes = [c_void_p, c_void_p, POINTER(c_float), c_int]
+
+    br.br_get_matrix_view.argtypes = [c_void_p, c_int, POINTER(c_int), POINTER(c_int), POINTER(c_int), POINTER(c_int)]
+    br.br_get_matrix_view.restype = POINTER(c_ubyte)
+
     br.br_get_template.argtypes = [c_void_p, c_int]
     br.br_get_template.restype = c_void_p
 
@@ -3,8 +3,9 @@ mark_as_advanced(EIGEN3_DIR)
 include_directories(${EIGEN3_DIR})
 set(EIGEN3_LICENSE ${EIGEN3_DIR}/COPYING.LGPL)
 
-#find_package(MKL)
-#if(MKL_FOUND)
-#  add_definitions(-DEIGEN_USE_MKL_ALL)
-#  set(EIGEN3_LIBS ${MKL_LIBS})
-#endif()
+# Route Eigen's dense products and eigen solvers through MKL's BLAS/LAPACKE
+if(${BR_WITH_EIGEN3_MKL})
+  find_package(MKL REQUIRED)
+  add_definitions(-DEIGEN_USE_MKL_ALL)
+  set(EIGEN3_LIBS ${MKL_LIBS})
+endif()
@@ -1,6 +1,6 @@
 find_path(MKL_DIR include/mkl_cblas.h /opt/intel/mkl)
 include_directories(${MKL_DIR}/include)
-set(MKL_LIBS ${MKL_DIR}/lib/libmkl_rt.dylib)
+find_library(MKL_LIBS mkl_rt PATHS ${MKL_DIR}/lib ${MKL_DIR}/lib/intel64 NO_DEFAULT_PATH)
 
 include(FindPackageHandleStandardArgs)
-find_package_handle_standard_args(MKL DEFAULT_MSG MKL_DIR)
+find_package_handle_standard_args(MKL DEFAULT_MSG MKL_DIR MKL_LIBS)